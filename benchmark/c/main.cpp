@@ -3,12 +3,19 @@
 
 #include <cmath>
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <numeric>
+#include <random>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "ort_genai.h"
@@ -112,7 +119,19 @@ void WriteE2EStats(std::string_view label,
             << "\n";
 }
 
-std::string GeneratePrompt(size_t num_prompt_tokens, const OgaModel& model, const OgaTokenizer& tokenizer) {
+void WriteLatencyStats(std::string_view label,
+                       const Statistics& stats) {
+  using MillisecondsFp = std::chrono::duration<float, std::chrono::milliseconds::period>;
+  std::cout << label << ":"
+            << "\n\tavg (ms):       " << MillisecondsFp{stats.average}.count()
+            << "\n\tp50 (ms):       " << MillisecondsFp{stats.p50}.count()
+            << "\n\tp90 (ms):       " << MillisecondsFp{stats.p90}.count()
+            << "\n\tp99 (ms):       " << MillisecondsFp{stats.p99}.count()
+            << "\n\tn:              " << stats.n
+            << "\n";
+}
+
+std::vector<int32_t> GeneratePromptTokens(size_t num_prompt_tokens, const OgaModel& model, const OgaTokenizer& tokenizer) {
   const char* const base_prompt = "A";
   auto base_prompt_sequences = OgaSequences::Create();
 
@@ -126,7 +145,12 @@ std::string GeneratePrompt(size_t num_prompt_tokens, const OgaModel& model, cons
   auto output_sequences = model.Generate(*params);
   const auto output_sequence_length = output_sequences->SequenceCount(0);
   const auto* output_sequence_data = output_sequences->SequenceData(0);
-  return std::string{tokenizer.Decode(output_sequence_data, output_sequence_length)};
+  return {output_sequence_data, output_sequence_data + output_sequence_length};
+}
+
+std::string GeneratePrompt(size_t num_prompt_tokens, const OgaModel& model, const OgaTokenizer& tokenizer) {
+  const auto tokens = GeneratePromptTokens(num_prompt_tokens, model, tokenizer);
+  return std::string{tokenizer.Decode(tokens.data(), tokens.size())};
 }
 
 void RunBenchmark(const benchmark::Options& opts) {
@@ -231,13 +255,442 @@ void RunBenchmark(const benchmark::Options& opts) {
   }
 }
 
+struct RequestLengths {
+  size_t num_prompt_tokens;
+  size_t num_tokens_to_generate;
+};
+
+// One request per '<prompt length> <generation length>' line, blank lines and lines starting with '#' are skipped
+std::vector<RequestLengths> LoadRequestLengths(const std::string& path) {
+  std::ifstream file{path};
+  if (!file) {
+    throw std::runtime_error("Failed to open trace file: " + path);
+  }
+
+  std::vector<RequestLengths> lengths;
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream s{line};
+    RequestLengths request{};
+    if (!(s >> request.num_prompt_tokens >> request.num_tokens_to_generate) ||
+        request.num_prompt_tokens < 1 || request.num_tokens_to_generate < 1) {
+      throw std::runtime_error("Invalid trace file line: " + line);
+    }
+    lengths.push_back(request);
+  }
+
+  if (lengths.empty()) {
+    throw std::runtime_error("Trace file has no requests: " + path);
+  }
+  return lengths;
+}
+
+struct RequestTimes {
+  std::vector<Duration> time_to_first_token;  // From the arrival of the request, so it includes the time it was queued
+  std::vector<Duration> inter_token_latency;  // Between consecutive tokens of a request
+  std::vector<Duration> e2e_latency;          // From the arrival of the request to its last token
+  size_t num_generated_tokens{};
+};
+
+// Generates the request and adds its measurements to the times
+void RunRequest(const OgaModel& model, const int32_t* prompt_tokens, size_t num_prompt_tokens, size_t num_tokens_to_generate,
+                Clock::time_point arrival, RequestTimes& times) {
+  const size_t num_tokens = num_prompt_tokens + num_tokens_to_generate;
+  auto params = OgaGeneratorParams::Create(model);
+  params->SetSearchOption("max_length", static_cast<double>(num_tokens));
+  params->SetSearchOption("min_length", static_cast<double>(num_tokens));
+  params->SetInputIDs(prompt_tokens, num_prompt_tokens, num_prompt_tokens, 1);
+
+  auto generator = OgaGenerator::Create(model, *params);
+  auto last_token_time = arrival;
+  while (!generator->IsDone()) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+
+    const auto now = Clock::now();
+    (last_token_time == arrival ? times.time_to_first_token : times.inter_token_latency).push_back(now - last_token_time);
+    last_token_time = now;
+    ++times.num_generated_tokens;
+  }
+  times.e2e_latency.push_back(last_token_time - arrival);
+}
+
+void RunServingBenchmark(const benchmark::Options& opts) {
+  auto model = OgaModel::Create(opts.model_path.c_str());
+  auto tokenizer = OgaTokenizer::Create(*model);
+
+  std::vector<RequestLengths> lengths{{opts.num_prompt_tokens, opts.num_tokens_to_generate}};
+  if (!opts.trace_file_path.empty()) {
+    lengths = LoadRequestLengths(opts.trace_file_path);
+  }
+
+  // Every prompt is the leading part of the longest one
+  size_t max_prompt_tokens = 0;
+  for (const auto& request : lengths) {
+    max_prompt_tokens = std::max(max_prompt_tokens, request.num_prompt_tokens);
+  }
+  const auto prompt_tokens = GeneratePromptTokens(max_prompt_tokens, *model, *tokenizer);
+  auto run_request = [&](size_t request_index, Clock::time_point arrival, RequestTimes& times) {
+    const auto& request = lengths[request_index % lengths.size()];
+    RunRequest(*model, prompt_tokens.data(), std::min(request.num_prompt_tokens, prompt_tokens.size()),
+               request.num_tokens_to_generate, arrival, times);
+  };
+
+  if (opts.verbose) std::cout << "Running warmup iterations (" << opts.num_warmup_iterations << ")...\n";
+  for (size_t i = 0; i < opts.num_warmup_iterations; ++i) {
+    RequestTimes unused;
+    run_request(0, Clock::now(), unused);
+  }
+
+  // Poisson arrivals have exponentially distributed gaps between them
+  std::vector<Clock::time_point> arrivals(opts.num_requests);
+  {
+    std::mt19937 engine{opts.seed};
+    std::exponential_distribution<double> gap_seconds{opts.request_rate > 0 ? opts.request_rate : 1.0};
+    auto arrival = Clock::now();
+    for (auto& a : arrivals) {
+      a = arrival;
+      if (opts.request_rate > 0) {
+        arrival += std::chrono::duration_cast<Duration>(std::chrono::duration<double>{gap_seconds(engine)});
+      }
+    }
+  }
+
+  if (opts.verbose) std::cout << "Running requests (" << opts.num_requests << ") on " << opts.concurrency << " thread(s)...\n";
+
+  // Each thread takes the next request in arrival order once it's done with its last one, and keeps its own times
+  std::atomic<size_t> next_request{};
+  std::vector<RequestTimes> thread_times(opts.concurrency);
+  std::vector<std::exception_ptr> thread_errors(opts.concurrency);
+  {
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < opts.concurrency; ++t) {
+      threads.emplace_back([&, t] {
+        try {
+          for (size_t i; (i = next_request++) < opts.num_requests;) {
+            std::this_thread::sleep_until(arrivals[i]);
+            run_request(i, arrivals[i], thread_times[t]);
+          }
+        } catch (...) {
+          thread_errors[t] = std::current_exception();
+          next_request = opts.num_requests;
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+  const auto wall_time = Clock::now() - arrivals.front();
+
+  for (const auto& error : thread_errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  RequestTimes times;
+  for (const auto& t : thread_times) {
+    times.time_to_first_token.insert(times.time_to_first_token.end(), t.time_to_first_token.begin(), t.time_to_first_token.end());
+    times.inter_token_latency.insert(times.inter_token_latency.end(), t.inter_token_latency.begin(), t.inter_token_latency.end());
+    times.e2e_latency.insert(times.e2e_latency.end(), t.e2e_latency.begin(), t.e2e_latency.end());
+    times.num_generated_tokens += t.num_generated_tokens;
+  }
+
+  {
+    using SecondsFp = std::chrono::duration<float>;
+    const float wall_seconds = SecondsFp{wall_time}.count();
+
+    std::cout << "Concurrency: " << opts.concurrency
+              << ", requests: " << opts.num_requests
+              << ", request rate (requests/s): " << (opts.request_rate > 0 ? std::to_string(opts.request_rate) : "all at once")
+              << ", lengths: " << (opts.trace_file_path.empty() ? "fixed" : opts.trace_file_path)
+              << "\n";
+
+    WriteLatencyStats("Time to first token", ComputeStats(times.time_to_first_token));
+    WriteLatencyStats("Inter token latency", ComputeStats(times.inter_token_latency));
+    WriteLatencyStats("E2E request latency", ComputeStats(times.e2e_latency));
+
+    std::cout << "Throughput:"
+              << "\n\twall time (s):    " << wall_seconds
+              << "\n\trequests/s:       " << opts.num_requests / wall_seconds
+              << "\n\toutput tokens/s:  " << times.num_generated_tokens / wall_seconds
+              << "\n";
+
+    std::cout << "Peak working set size (bytes): " << benchmark::utils::GetPeakWorkingSetSizeInBytes() << "\n";
+  }
+}
+
+// Short samples of each language, repeated to make the texts of each length
+const std::pair<const char*, const char*> c_language_samples[] = {
+    {"en", "The quick brown fox jumps over the lazy dog, while the patient farmer counts his sheep before the storm. "},
+    {"zh", "快速的棕色狐狸跳过了懒惰的狗，耐心的农夫在暴风雨来临之前数着他的羊。"},
+    {"ru", "Быстрая коричневая лиса прыгает через ленивую собаку, а терпеливый фермер считает овец перед бурей. "},
+    {"code", "for (size_t i = 0; i < values.size(); ++i) {\n  total += values[i] * weights[i];\n}\n"},
+};
+
+std::string ReadTextFile(const std::string& path) {
+  std::ifstream file{path, std::ios::binary};
+  if (!file) {
+    throw std::runtime_error("Failed to open text file: " + path);
+  }
+  std::ostringstream s;
+  s << file.rdbuf();
+  if (s.str().empty()) {
+    throw std::runtime_error("Text file is empty: " + path);
+  }
+  return s.str();
+}
+
+// The sample repeated to length bytes, or a little less so a UTF-8 character isn't cut in half
+std::string MakeText(std::string_view sample, size_t length) {
+  std::string text;
+  while (text.size() < length) {
+    text.append(sample);
+  }
+  size_t end = length;
+  while (end > 0 && (static_cast<unsigned char>(text[end]) & 0xC0) == 0x80) {
+    --end;
+  }
+  text.resize(end);
+  return text;
+}
+
+// Runs op(thread_index) num_iterations times on each of the threads at once, returning the wall time from when the
+// first thread started to when the last one finished
+template <typename Op>
+Duration RunOnThreads(size_t thread_count, size_t num_iterations, const Op& op) {
+  std::atomic<size_t> ready{};
+  std::vector<Clock::time_point> starts(thread_count), ends(thread_count);
+  std::vector<std::exception_ptr> errors(thread_count);
+  {
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < thread_count; ++t) {
+      threads.emplace_back([&, t] {
+        // Start together, so the threads created last don't run alone at the end
+        ++ready;
+        while (ready < thread_count) {
+          std::this_thread::yield();
+        }
+        starts[t] = Clock::now();
+        try {
+          for (size_t i = 0; i < num_iterations; ++i) {
+            op(t);
+          }
+        } catch (...) {
+          errors[t] = std::current_exception();
+        }
+        ends[t] = Clock::now();
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  for (const auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+  return *std::max_element(ends.begin(), ends.end()) - *std::min_element(starts.begin(), starts.end());
+}
+
+void RunTokenizerBenchmark(const benchmark::Options& opts) {
+  auto model = OgaModel::Create(opts.model_path.c_str());
+  auto tokenizer = OgaTokenizer::Create(*model);
+
+  std::vector<std::pair<std::string, std::string>> samples;  // Name & text
+  for (const auto& language : opts.languages) {
+    auto it = std::find_if(std::begin(c_language_samples), std::end(c_language_samples),
+                           [&](const auto& sample) { return language == sample.first; });
+    if (it == std::end(c_language_samples)) {
+      throw std::runtime_error("Unknown language: " + language);
+    }
+    samples.emplace_back(it->first, it->second);
+  }
+  for (const auto& path : opts.text_file_paths) {
+    samples.emplace_back(path, ReadTextFile(path));
+  }
+
+  if (opts.batch_size < 1) {
+    throw std::runtime_error("Batch size must be at least 1.");
+  }
+
+  std::cout << "Operation\tLanguage\tText bytes\tTokens\tThreads\ttokens/s\tMB/s\n";
+
+  for (const auto& [language, sample] : samples) {
+    for (size_t length : opts.text_lengths) {
+      const std::string text = MakeText(sample, length);
+      std::vector<int32_t> tokens;
+      {
+        auto sequences = OgaSequences::Create();
+        tokenizer->Encode(text.c_str(), *sequences);
+        tokens.assign(sequences->SequenceData(0), sequences->SequenceData(0) + sequences->SequenceCount(0));
+      }
+
+      // Each operation handles the whole text (or batch_size of them) once per iteration
+      auto encode = [&](size_t) {
+        auto sequences = OgaSequences::Create();
+        tokenizer->Encode(text.c_str(), *sequences);
+      };
+      auto decode = [&](size_t) {
+        tokenizer->Decode(tokens.data(), tokens.size());
+      };
+      auto stream_decode = [&](size_t) {
+        auto stream = OgaTokenizerStream::Create(*tokenizer);
+        for (int32_t token : tokens) {
+          stream->Decode(token);
+        }
+      };
+      std::vector<std::vector<char>> buffers(*std::max_element(opts.tokenizer_thread_counts.begin(), opts.tokenizer_thread_counts.end()));
+      auto stream_decode_next = [&](size_t thread_index) {
+        std::vector<std::unique_ptr<OgaTokenizerStream>> streams;
+        std::vector<OgaTokenizerStream*> stream_ptrs;
+        for (size_t i = 0; i < opts.batch_size; ++i) {
+          streams.push_back(OgaTokenizerStream::Create(*tokenizer));
+          stream_ptrs.push_back(streams.back().get());
+        }
+        auto& buffer = buffers[thread_index];
+        buffer.resize(256 * opts.batch_size);
+        std::vector<int32_t> next_tokens(opts.batch_size);
+        std::vector<size_t> chunk_offsets(opts.batch_size + 1);
+        for (int32_t token : tokens) {
+          std::fill(next_tokens.begin(), next_tokens.end(), token);
+          OgaTokenizerStream::DecodeNext(stream_ptrs.data(), next_tokens.data(), opts.batch_size, buffer.data(), buffer.size(), chunk_offsets.data());
+        }
+      };
+
+      auto run = [&](const char* operation, size_t streams_per_iteration, const auto& op) {
+        for (size_t thread_count : opts.tokenizer_thread_counts) {
+          RunOnThreads(thread_count, opts.num_warmup_iterations, op);
+          const float seconds = std::chrono::duration<float>{RunOnThreads(thread_count, opts.num_iterations, op)}.count();
+          const float texts = static_cast<float>(thread_count * opts.num_iterations * streams_per_iteration);
+          std::cout << operation << "\t" << language << "\t" << text.size() << "\t" << tokens.size() << "\t" << thread_count
+                    << "\t" << texts * tokens.size() / seconds << "\t" << texts * text.size() / seconds / 1.0e6f << "\n";
+        }
+      };
+
+      run("Encode", 1, encode);
+      run("Decode", 1, decode);
+      run("TokenizerStream::Decode", 1, stream_decode);
+      if (opts.batch_size > 1) {
+        run("TokenizerStream::DecodeNext", opts.batch_size, stream_decode_next);
+      }
+    }
+  }
+
+  std::cout << "Peak working set size (bytes): " << benchmark::utils::GetPeakWorkingSetSizeInBytes() << "\n";
+}
+
+// Peak bytes of each of the model's allocation sites (see OgaModel_GetMetric), in MB
+struct MemoryUsage {
+  double kv_cache{};
+  double step_arena{};  // The pasts & presents replaced every step, and the attention masks
+  double logits{};
+  double inputs{};  // input_ids & position_inputs
+  double static_buffers{};
+  double roaming_arrays{};
+  double process_growth{};  // Of the working set while generating, on a CPU device that also holds the ORT arena
+
+  double Total() const { return kv_cache + step_arena + logits + inputs + static_buffers + roaming_arrays; }
+};
+
+void RunMemoryBenchmark(const benchmark::Options& opts) {
+  auto batch_sizes = opts.memory_batch_sizes;
+  std::sort(batch_sizes.begin(), batch_sizes.end());
+
+  constexpr double c_mb = 1024.0 * 1024.0;
+  std::cout << std::fixed << std::setprecision(1)
+            << "Context length\tBeams\tBatch size\tKV cache (MB)\tStep arena (MB)\tLogits (MB)\tInputs (MB)\t"
+            << "Static buffers (MB)\tRoaming arrays (MB)\tTotal (MB)\tProcess growth (MB)\tFits\n";
+
+  std::ostringstream summary;
+  for (size_t context_length : opts.context_lengths) {
+    for (size_t num_beams : opts.num_beams) {
+      // The peaks are over the model's lifetime. With a new model for each configuration they're those of the largest
+      // batch size so far, which is the one just run as the memory only grows with the batch size
+      auto model = OgaModel::Create(opts.model_path.c_str());
+      auto tokenizer = OgaTokenizer::Create(*model);
+      const auto prompt_tokens = GeneratePromptTokens(std::min(opts.num_prompt_tokens, context_length - 1), *model, *tokenizer);
+
+      size_t largest_fit = 0;
+      for (size_t batch_size : batch_sizes) {
+        MemoryUsage usage;
+        bool fits = true;
+        const size_t working_set_start = benchmark::utils::GetWorkingSetSizeInBytes();
+        size_t working_set_peak = working_set_start;
+        try {
+          auto params = OgaGeneratorParams::Create(*model);
+          params->SetSearchOption("max_length", static_cast<double>(context_length));
+          params->SetSearchOption("min_length", static_cast<double>(context_length));
+          params->SetSearchOption("num_beams", static_cast<double>(num_beams));
+          std::vector<int32_t> input_ids;
+          for (size_t i = 0; i < batch_size; ++i) {
+            input_ids.insert(input_ids.end(), prompt_tokens.begin(), prompt_tokens.end());
+          }
+          params->SetInputIDs(input_ids.data(), input_ids.size(), prompt_tokens.size(), batch_size);
+
+          auto generator = OgaGenerator::Create(*model, *params);
+          while (!generator->IsDone()) {
+            generator->ComputeLogits();
+            generator->GenerateNextToken();
+            working_set_peak = std::max(working_set_peak, benchmark::utils::GetWorkingSetSizeInBytes());
+          }
+          usage.static_buffers = model->GetMetric("static_buffer_bytes") / c_mb;  // Pooled with the generator's graph
+        } catch (const std::exception& e) {
+          fits = false;
+          if (opts.verbose) std::cout << "Batch size " << batch_size << " failed: " << e.what() << "\n";
+        }
+
+        usage.kv_cache = model->GetMetric("kv_cache_peak_bytes") / c_mb;
+        usage.step_arena = model->GetMetric("step_arena_peak_bytes") / c_mb;
+        usage.logits = model->GetMetric("logits_peak_bytes") / c_mb;
+        usage.inputs = (model->GetMetric("input_ids_peak_bytes") + model->GetMetric("position_inputs_peak_bytes")) / c_mb;
+        usage.roaming_arrays = model->GetMetric("roaming_array_peak_bytes") / c_mb;
+        usage.process_growth = (working_set_peak - working_set_start) / c_mb;
+        if (opts.memory_budget_mb && usage.Total() > static_cast<double>(opts.memory_budget_mb)) {
+          fits = false;
+        }
+
+        std::cout << context_length << "\t" << num_beams << "\t" << batch_size << "\t" << usage.kv_cache << "\t"
+                  << usage.step_arena << "\t" << usage.logits << "\t" << usage.inputs << "\t" << usage.static_buffers << "\t"
+                  << usage.roaming_arrays << "\t" << usage.Total() << "\t" << usage.process_growth << "\t"
+                  << (fits ? "yes" : "no") << "\n";
+        if (!fits) {
+          break;
+        }
+        largest_fit = batch_size;
+      }
+
+      summary << "\tcontext length " << context_length << ", beams " << num_beams << ": "
+              << (largest_fit ? std::to_string(largest_fit) : std::string{"none"}) << "\n";
+    }
+  }
+
+  std::cout << "Largest batch size that fits:\n"
+            << summary.str();
+  std::cout << "Peak working set size (bytes): " << benchmark::utils::GetPeakWorkingSetSizeInBytes() << "\n";
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
   OgaHandle handle;
   try {
     const auto opts = benchmark::ParseOptionsFromCommandLine(argc, argv);
-    RunBenchmark(opts);
+    if (opts.memory_benchmark) {
+      RunMemoryBenchmark(opts);
+    } else if (opts.tokenizer_benchmark) {
+      RunTokenizerBenchmark(opts);
+    } else if (opts.concurrency > 0) {
+      RunServingBenchmark(opts);
+    } else {
+      RunBenchmark(opts);
+    }
     return 0;
   } catch (const std::exception& e) {
     std::cerr << "Exception: " << e.what() << "\n";
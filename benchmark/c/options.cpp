@@ -11,11 +11,22 @@
 #include <string>
 #include <string_view>
 #include <system_error>
+#include <type_traits>
+#include <vector>
 
 namespace benchmark {
 
 namespace {
 
+template <typename T>
+std::string ToString(const std::vector<T>& values) {
+  std::ostringstream s;
+  for (size_t i = 0; i < values.size(); ++i) {
+    s << (i ? "," : "") << values[i];
+  }
+  return s.str();
+}
+
 [[noreturn]] void PrintHelpAndExit(const char* program_name, int exit_code) {
   Options defaults{};
   std::ostringstream s;
@@ -34,6 +45,37 @@ namespace {
     << "      Number of times to repeat the benchmark. Default: " << defaults.num_iterations << "\n"
     << "    -w,--warmup <number>\n"
     << "      Number of warmup runs before benchmarking. Default: " << defaults.num_warmup_iterations << "\n"
+    << "    -c,--concurrency <number>\n"
+    << "      Run the serving benchmark instead, with this many generators on their own threads. Default: " << defaults.concurrency << " (off)\n"
+    << "    -n,--num_requests <number>\n"
+    << "      Serving: Number of single sequence requests. Default: " << defaults.num_requests << "\n"
+    << "    --request_rate <number>\n"
+    << "      Serving: Mean requests per second of the Poisson arrivals, 0 for all at once. Default: " << defaults.request_rate << "\n"
+    << "    --trace_file <path>\n"
+    << "      Serving: File with a '<prompt length> <generation length>' line per request, reused in order as needed.\n"
+    << "      Without it every request uses the prompt and generation lengths.\n"
+    << "    --seed <number>\n"
+    << "      Serving: Seed of the request arrivals. Default: " << defaults.seed << "\n"
+    << "    --tokenizer\n"
+    << "      Run the tokenizer benchmark instead: Encode, Decode and TokenizerStream decoding throughput.\n"
+    << "    --tokenizer_threads <number>[,<number>...]\n"
+    << "      Tokenizer: Thread counts to run with, each thread encodes and decodes on its own. Default: " << ToString(defaults.tokenizer_thread_counts) << "\n"
+    << "    --text_lengths <number>[,<number>...]\n"
+    << "      Tokenizer: Text lengths in bytes. Default: " << ToString(defaults.text_lengths) << "\n"
+    << "    --languages <name>[,<name>...]\n"
+    << "      Tokenizer: Built in samples to use, of en, zh, ru and code. Default: " << ToString(defaults.languages) << "\n"
+    << "    --text_file <path>\n"
+    << "      Tokenizer: A UTF-8 text file to use like a language sample, can be given more than once.\n"
+    << "    --memory\n"
+    << "      Run the memory benchmark instead: The peak memory of each part, up to the largest batch size that fits.\n"
+    << "    --memory_batch_sizes <number>[,<number>...]\n"
+    << "      Memory: Batch sizes to try, from the smallest until one doesn't fit. Default: " << ToString(defaults.memory_batch_sizes) << "\n"
+    << "    --context_lengths <number>[,<number>...]\n"
+    << "      Memory: Total lengths to generate to, the prompt is at most the prompt length. Default: " << ToString(defaults.context_lengths) << "\n"
+    << "    --num_beams <number>[,<number>...]\n"
+    << "      Memory: Beam counts to try. Default: " << ToString(defaults.num_beams) << "\n"
+    << "    --memory_budget_mb <number>\n"
+    << "      Memory: A batch size doesn't fit once the buffers of genai peak above this. Default: " << defaults.memory_budget_mb << " (only failed runs don't fit)\n"
     << "    -v,--verbose\n"
     << "      Show more informational output.\n"
     << "    -h,--help\n"
@@ -46,18 +88,85 @@ namespace {
 template <typename T>
 T ParseNumber(std::string_view s) {
   T n;
-  const auto *s_begin = s.data(), *s_end = s.data() + s.size();
-  const auto [ptr, ec] = std::from_chars(s_begin, s_end, n);
-  if (ec != std::errc{} || ptr != s_end) {
-    throw std::runtime_error(std::string{"Failed to parse option value as number: "}.append(s));
+  if constexpr (std::is_floating_point_v<T>) {
+    // std::from_chars for floating point isn't available everywhere yet
+    const std::string str{s};
+    char* str_end{};
+    n = static_cast<T>(std::strtod(str.c_str(), &str_end));
+    if (str.empty() || str_end != str.c_str() + str.size()) {
+      throw std::runtime_error(std::string{"Failed to parse option value as number: "}.append(s));
+    }
+  } else {
+    const auto *s_begin = s.data(), *s_end = s.data() + s.size();
+    const auto [ptr, ec] = std::from_chars(s_begin, s_end, n);
+    if (ec != std::errc{} || ptr != s_end) {
+      throw std::runtime_error(std::string{"Failed to parse option value as number: "}.append(s));
+    }
   }
   return n;
 }
 
+template <typename T>
+std::vector<T> ParseList(std::string_view s) {
+  std::vector<T> values;
+  while (true) {
+    const auto comma = s.find(',');
+    const auto item = s.substr(0, comma);
+    if constexpr (std::is_same_v<T, std::string>) {
+      values.emplace_back(item);
+    } else {
+      values.push_back(ParseNumber<T>(item));
+    }
+    if (comma == std::string_view::npos) {
+      return values;
+    }
+    s.remove_prefix(comma + 1);
+  }
+}
+
 void VerifyOptions(const Options& opts) {
   if (opts.model_path.empty()) {
     throw std::runtime_error("ONNX model directory path must be provided.");
   }
+  if (opts.request_rate < 0) {
+    throw std::runtime_error("Request rate must not be negative.");
+  }
+  if (opts.concurrency > 0 && opts.num_requests < 1) {
+    throw std::runtime_error("Number of requests must be at least 1.");
+  }
+  if (opts.tokenizer_benchmark) {
+    if (opts.tokenizer_thread_counts.empty() || opts.text_lengths.empty() ||
+        (opts.languages.empty() && opts.text_file_paths.empty())) {
+      throw std::runtime_error("The tokenizer benchmark needs thread counts, text lengths and languages or text files.");
+    }
+    for (size_t n : opts.tokenizer_thread_counts) {
+      if (n < 1) {
+        throw std::runtime_error("Tokenizer thread counts must be at least 1.");
+      }
+    }
+    for (size_t n : opts.text_lengths) {
+      if (n < 1) {
+        throw std::runtime_error("Text lengths must be at least 1.");
+      }
+    }
+  }
+  if (opts.memory_benchmark) {
+    if (opts.memory_batch_sizes.empty() || opts.context_lengths.empty() || opts.num_beams.empty()) {
+      throw std::runtime_error("The memory benchmark needs batch sizes, context lengths and beam counts.");
+    }
+    for (const auto* values : {&opts.memory_batch_sizes, &opts.num_beams}) {
+      for (size_t n : *values) {
+        if (n < 1) {
+          throw std::runtime_error("Memory batch sizes and beam counts must be at least 1.");
+        }
+      }
+    }
+    for (size_t n : opts.context_lengths) {
+      if (n < 2) {
+        throw std::runtime_error("Context lengths must be at least 2, a prompt token and a generated one.");
+      }
+    }
+  }
 }
 
 }  // namespace
@@ -89,6 +198,36 @@ Options ParseOptionsFromCommandLine(int argc, const char* const* argv) {
         opts.num_iterations = ParseNumber<size_t>(next_arg(i));
       } else if (arg == "-w" || arg == "--warmup") {
         opts.num_warmup_iterations = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "-c" || arg == "--concurrency") {
+        opts.concurrency = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "-n" || arg == "--num_requests") {
+        opts.num_requests = ParseNumber<size_t>(next_arg(i));
+      } else if (arg == "--request_rate") {
+        opts.request_rate = ParseNumber<double>(next_arg(i));
+      } else if (arg == "--trace_file") {
+        opts.trace_file_path = next_arg(i);
+      } else if (arg == "--seed") {
+        opts.seed = ParseNumber<unsigned int>(next_arg(i));
+      } else if (arg == "--tokenizer") {
+        opts.tokenizer_benchmark = true;
+      } else if (arg == "--tokenizer_threads") {
+        opts.tokenizer_thread_counts = ParseList<size_t>(next_arg(i));
+      } else if (arg == "--text_lengths") {
+        opts.text_lengths = ParseList<size_t>(next_arg(i));
+      } else if (arg == "--languages") {
+        opts.languages = ParseList<std::string>(next_arg(i));
+      } else if (arg == "--text_file") {
+        opts.text_file_paths.emplace_back(next_arg(i));
+      } else if (arg == "--memory") {
+        opts.memory_benchmark = true;
+      } else if (arg == "--memory_batch_sizes") {
+        opts.memory_batch_sizes = ParseList<size_t>(next_arg(i));
+      } else if (arg == "--context_lengths") {
+        opts.context_lengths = ParseList<size_t>(next_arg(i));
+      } else if (arg == "--num_beams") {
+        opts.num_beams = ParseList<size_t>(next_arg(i));
+      } else if (arg == "--memory_budget_mb") {
+        opts.memory_budget_mb = ParseNumber<size_t>(next_arg(i));
       } else if (arg == "-v" || arg == "--verbose") {
         opts.verbose = true;
       } else if (arg == "-h" || arg == "--help") {
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 namespace benchmark {
 
@@ -15,6 +16,30 @@ struct Options {
   size_t num_iterations{5};
   size_t num_warmup_iterations{1};
   bool verbose{false};
+
+  // Serving mode, used when concurrency is set. Each request is a single sequence generated by one of 'concurrency'
+  // threads, arriving at request_rate per second (all at once when 0) with lengths from the trace file if there is one
+  size_t concurrency{0};
+  size_t num_requests{32};
+  double request_rate{0};
+  std::string trace_file_path{};
+  unsigned int seed{0};
+
+  // Tokenizer mode, used when tokenizer_benchmark is set. The model folder's tokenizer encodes and decodes a text of
+  // each language and length, from every thread count's threads at once
+  bool tokenizer_benchmark{false};
+  std::vector<size_t> tokenizer_thread_counts{1, 2, 4, 8};
+  std::vector<size_t> text_lengths{256, 4096, 65536};  // In bytes, the language samples are repeated to fill them
+  std::vector<std::string> languages{"en", "zh", "ru", "code"};
+  std::vector<std::string> text_file_paths{};  // Used like the built in samples, named by their paths
+
+  // Memory mode, used when memory_benchmark is set. Each context length & beam count generates every batch size from
+  // the smallest up, until one doesn't fit, and reports the peak memory of each part
+  bool memory_benchmark{false};
+  std::vector<size_t> memory_batch_sizes{1, 2, 4, 8, 16, 32, 64};
+  std::vector<size_t> context_lengths{256, 1024, 4096};
+  std::vector<size_t> num_beams{1};
+  size_t memory_budget_mb{0};  // A batch doesn't fit when genai's buffers peak above it, 0 to only stop on failing runs
 };
 
 Options ParseOptionsFromCommandLine(int argc, const char* const* argv);
@@ -4,8 +4,13 @@
 #include "resource_utils.h"
 
 #include <sys/resource.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#endif
 
 #include <cerrno>
+#include <fstream>
 #include <stdexcept>
 #include <string>
 
@@ -20,4 +25,23 @@ size_t GetPeakWorkingSetSizeInBytes() {
   return static_cast<size_t>(rusage.ru_maxrss * 1024L);
 }
 
+size_t GetWorkingSetSizeInBytes() {
+#if defined(__APPLE__)
+  mach_task_basic_info info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS) {
+    throw std::runtime_error("task_info failed");
+  }
+  return static_cast<size_t>(info.resident_size);
+#else
+  // The second field is the resident set size in pages
+  std::ifstream statm{"/proc/self/statm"};
+  size_t total_pages{}, resident_pages{};
+  if (!(statm >> total_pages >> resident_pages)) {
+    throw std::runtime_error("Failed to read /proc/self/statm");
+  }
+  return resident_pages * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
 }  // namespace benchmark::utils
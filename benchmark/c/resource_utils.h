@@ -9,4 +9,6 @@ namespace benchmark::utils {
 
 size_t GetPeakWorkingSetSizeInBytes();
 
+size_t GetWorkingSetSizeInBytes();  // Right now, to measure the growth over part of the run
+
 }  // namespace benchmark::utils
@@ -20,4 +20,13 @@ size_t GetPeakWorkingSetSizeInBytes() {
   return pmc.PeakWorkingSetSize;
 }
 
+size_t GetWorkingSetSizeInBytes() {
+  PROCESS_MEMORY_COUNTERS pmc;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+    throw std::runtime_error("GetProcessMemoryInfo failed with error code " + std::to_string(GetLastError()));
+  }
+
+  return pmc.WorkingSetSize;
+}
+
 }  // namespace benchmark::utils
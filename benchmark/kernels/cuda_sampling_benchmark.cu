@@ -0,0 +1,117 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Google Benchmark microbenchmarks of the CUDA softmax, top k and sampling kernels, timed with cuda events so only the
+// kernels are measured
+
+#include <benchmark/benchmark.h>
+#include <cuda_runtime.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include "span.h"
+#include "cuda_sampling.cuh"
+#include "smartptrs.h"
+
+#include "kernel_benchmark.h"
+
+namespace {
+
+void CheckCuda(cudaError_t error) {
+  if (error != cudaSuccess)
+    throw std::runtime_error(std::string("CUDA error: ") + cudaGetErrorString(error));
+}
+
+// Device copies of fixed random logits, the scores the kernels run on are reset from them before every iteration
+struct CudaBenchmarkData {
+  CudaBenchmarkData(int vocab_size, int batch_size) : vocab_size_{vocab_size}, batch_size_{batch_size} {
+    CheckCuda(cudaStreamCreate(&stream_));
+    CheckCuda(cudaEventCreate(&start_));
+    CheckCuda(cudaEventCreate(&stop_));
+
+    const size_t count = static_cast<size_t>(vocab_size) * batch_size;
+    const auto logits = CreateRandomLogits(count);
+    logits_ = Generators::CudaMallocArray<float>(count);
+    scores_ = Generators::CudaMallocArray<float>(count);
+    output_ = Generators::CudaMallocArray<float>(count);
+    next_tokens_ = Generators::CudaMallocArray<int32_t>(batch_size);
+    CheckCuda(cudaMemcpy(logits_.get(), logits.data(), count * sizeof(float), cudaMemcpyHostToDevice));
+    sampling_data_ = std::make_unique<Generators::cuda::SamplingData>(0, batch_size, vocab_size, stream_);
+  }
+
+  ~CudaBenchmarkData() {
+    cudaEventDestroy(stop_);
+    cudaEventDestroy(start_);
+    cudaStreamDestroy(stream_);
+  }
+
+  // Resets the scores, then sets the manual time of the iteration to how long launch() takes on the stream
+  template <typename Launch>
+  void RunIteration(benchmark::State& state, Launch&& launch) {
+    CheckCuda(cudaMemcpyAsync(scores_.get(), logits_.get(), static_cast<size_t>(vocab_size_) * batch_size_ * sizeof(float), cudaMemcpyDeviceToDevice, stream_));
+    CheckCuda(cudaEventRecord(start_, stream_));
+    launch();
+    CheckCuda(cudaEventRecord(stop_, stream_));
+    CheckCuda(cudaEventSynchronize(stop_));
+
+    float milliseconds{};
+    CheckCuda(cudaEventElapsedTime(&milliseconds, start_, stop_));
+    state.SetIterationTime(milliseconds / 1000.0);
+  }
+
+  int vocab_size_, batch_size_;
+  cudaStream_t stream_{};
+  cudaEvent_t start_{}, stop_{};
+  Generators::cuda_unique_ptr<float> logits_, scores_, output_;
+  Generators::cuda_unique_ptr<int32_t> next_tokens_;
+  std::unique_ptr<Generators::cuda::SamplingData> sampling_data_;
+};
+
+void BM_CudaSoftMax(benchmark::State& state) {
+  const int vocab_size = static_cast<int>(state.range(0));
+  const int batch_size = static_cast<int>(state.range(1));
+  CudaBenchmarkData data{vocab_size, batch_size};
+  for (auto _ : state) {
+    data.RunIteration(state, [&] {
+      Generators::cuda::DispatchBlockwiseSoftmaxForward<false>(&data.stream_, data.output_.get(), data.scores_.get(), vocab_size, vocab_size, vocab_size, batch_size);
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * vocab_size * batch_size);
+}
+
+void BM_CudaGetTopKSubset(benchmark::State& state) {
+  const int vocab_size = static_cast<int>(state.range(0));
+  const int batch_size = static_cast<int>(state.range(1));
+  const int k = static_cast<int>(state.range(2));
+  CudaBenchmarkData data{vocab_size, batch_size};
+  auto indices = Generators::CudaMallocArray<int>(static_cast<size_t>(k) * batch_size);
+  for (auto _ : state) {
+    data.RunIteration(state, [&] {
+      Generators::cuda::GetTopKSubset(data.sampling_data_.get(), data.stream_, data.scores_.get(), data.output_.get(), indices.get(), vocab_size, batch_size, k, 1.0f);
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+// k of -1 samples top p only, p of 0 top k only, like the GreedySearch_Cuda sampling methods
+void BM_CudaGetSample(benchmark::State& state) {
+  const int vocab_size = static_cast<int>(state.range(0));
+  const int batch_size = static_cast<int>(state.range(1));
+  const int k = static_cast<int>(state.range(2));
+  const float p = state.range(3) / 100.0f;
+  CudaBenchmarkData data{vocab_size, batch_size};
+  for (auto _ : state) {
+    data.RunIteration(state, [&] {
+      Generators::cuda::GetSample(data.sampling_data_.get(), data.stream_, data.next_tokens_.get(), data.scores_.get(), vocab_size, batch_size, k, p, 1.0f);
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+}  // namespace
+
+BENCHMARK(BM_CudaSoftMax)->ArgsProduct({c_vocab_sizes, c_batch_sizes})->ArgNames({"vocab", "batch"})->UseManualTime();
+BENCHMARK(BM_CudaGetTopKSubset)->ArgsProduct({c_vocab_sizes, c_batch_sizes, {5, 50}})->ArgNames({"vocab", "batch", "k"})->UseManualTime();
+BENCHMARK(BM_CudaGetSample)->ArgsProduct({c_vocab_sizes, c_batch_sizes, {5, 50}, {0}})->ArgNames({"vocab", "batch", "k", "p%"})->UseManualTime();
+BENCHMARK(BM_CudaGetSample)->ArgsProduct({c_vocab_sizes, c_batch_sizes, {-1}, {50, 90, 99}})->ArgNames({"vocab", "batch", "k", "p%"})->UseManualTime();
+BENCHMARK(BM_CudaGetSample)->ArgsProduct({c_vocab_sizes, c_batch_sizes, {50}, {90}})->ArgNames({"vocab", "batch", "k", "p%"})->UseManualTime();
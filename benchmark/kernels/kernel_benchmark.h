@@ -0,0 +1,21 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// The vocab sizes of llama 2, a 100k BPE vocab (gpt-4, llama 3 is 128k), qwen 2 and gemma
+inline const std::vector<int64_t> c_vocab_sizes{32000, 100352, 151936, 256000};
+inline const std::vector<int64_t> c_batch_sizes{1, 8};
+
+// Normally distributed logits, seeded so every run of a benchmark sees the same ones
+inline std::vector<float> CreateRandomLogits(size_t count) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist{0.0f, 4.0f};
+  std::vector<float> logits(count);
+  for (auto& logit : logits)
+    logit = dist(engine);
+  return logits;
+}
@@ -0,0 +1,106 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// Google Benchmark microbenchmarks of the CPU softmax, top k and sampling kernels. Run with --benchmark_filter to pick
+// some of them, e.g. --benchmark_filter=SampleTopK/vocab:151936
+
+#include <benchmark/benchmark.h>
+#include <generators.h>
+#include <search.h>
+#include <softmax.h>
+#include <vector>
+
+#include "kernel_benchmark.h"
+
+namespace {
+
+void BM_SoftMax(benchmark::State& state) {
+  const auto vocab_size = static_cast<size_t>(state.range(0));
+  auto scores = CreateRandomLogits(vocab_size);
+  for (auto _ : state) {
+    // Normalized scores take the same work as logits, so they don't need to be reset
+    Generators::SoftMax(scores, 1.0f);
+    benchmark::DoNotOptimize(scores.data());
+  }
+  state.SetItemsProcessed(state.iterations() * vocab_size);
+}
+
+void BM_LogSoftMax(benchmark::State& state) {
+  const auto vocab_size = static_cast<size_t>(state.range(0));
+  auto scores = CreateRandomLogits(vocab_size);
+  for (auto _ : state) {
+    Generators::LogSoftMax(scores, 1.0f);
+    benchmark::DoNotOptimize(scores.data());
+  }
+  state.SetItemsProcessed(state.iterations() * vocab_size);
+}
+
+void BM_TopKIndices(benchmark::State& state) {
+  const auto vocab_size = static_cast<size_t>(state.range(0));
+  const auto scores = CreateRandomLogits(vocab_size);
+  std::vector<int32_t> top_k(static_cast<size_t>(state.range(1)));
+  for (auto _ : state) {
+    Generators::top_k_indices(top_k, scores);
+    benchmark::DoNotOptimize(top_k.data());
+  }
+  state.SetItemsProcessed(state.iterations() * vocab_size);
+}
+
+// Times sample() on a CPU greedy search over fresh logits every iteration. The search is recreated when its sequences
+// reach max_length, outside of the timing like the logits copy
+template <typename Sample>
+void RunCpuSampling(benchmark::State& state, Sample&& sample) {
+  const int vocab_size = static_cast<int>(state.range(0));
+  const int batch_size = static_cast<int>(state.range(1));
+
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 1024;
+  params->search.random_seed = 0;
+  params->batch_size = batch_size;
+  params->sequence_length = 1;
+  params->vocab_size = vocab_size;
+  params->eos_token_id = -1;  // So the sequences never end early and take the shortcuts for finished ones
+  params->device_type = Generators::DeviceType::CPU;
+  const std::vector<int32_t> input_ids(batch_size, 0);
+  params->input_ids = input_ids;
+
+  const auto logits = CreateRandomLogits(static_cast<size_t>(vocab_size) * batch_size);
+  std::vector<float> scores(logits.size());
+  std::unique_ptr<Generators::Search> search;
+  for (auto _ : state) {
+    state.PauseTiming();
+    if (!search || search->IsDone())
+      search = std::make_unique<Generators::GreedySearch_Cpu>(*params);
+    std::copy(logits.begin(), logits.end(), scores.begin());
+    search->SetLogits(Generators::cpu_span<float>(scores));
+    state.ResumeTiming();
+
+    sample(*search);
+  }
+  state.SetItemsProcessed(state.iterations() * batch_size);
+}
+
+void BM_SampleTopK(benchmark::State& state) {
+  const int k = static_cast<int>(state.range(2));
+  RunCpuSampling(state, [k](Generators::Search& search) { search.SampleTopK(k, 1.0f); });
+}
+
+void BM_SampleTopP(benchmark::State& state) {
+  const float p = state.range(2) / 100.0f;
+  RunCpuSampling(state, [p](Generators::Search& search) { search.SampleTopP(p, 1.0f); });
+}
+
+void BM_SampleTopKTopP(benchmark::State& state) {
+  const int k = static_cast<int>(state.range(2));
+  const float p = state.range(3) / 100.0f;
+  RunCpuSampling(state, [k, p](Generators::Search& search) { search.SampleTopKTopP(k, p, 1.0f); });
+}
+
+}  // namespace
+
+BENCHMARK(BM_SoftMax)->ArgsProduct({c_vocab_sizes})->ArgNames({"vocab"});
+BENCHMARK(BM_LogSoftMax)->ArgsProduct({c_vocab_sizes})->ArgNames({"vocab"});
+BENCHMARK(BM_TopKIndices)->ArgsProduct({c_vocab_sizes, {1, 50, 256}})->ArgNames({"vocab", "k"});
+BENCHMARK(BM_SampleTopK)->ArgsProduct({c_vocab_sizes, c_batch_sizes, {5, 50}})->ArgNames({"vocab", "batch", "k"});
+BENCHMARK(BM_SampleTopP)->ArgsProduct({c_vocab_sizes, c_batch_sizes, {50, 90, 99}})->ArgNames({"vocab", "batch", "p%"});
+BENCHMARK(BM_SampleTopKTopP)->ArgsProduct({c_vocab_sizes, c_batch_sizes, {50}, {90}})->ArgNames({"vocab", "batch", "k", "p%"});
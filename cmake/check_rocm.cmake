@@ -5,4 +5,27 @@ endif()
 if(USE_ROCM)
   list(APPEND onnxruntime_libs "${ORT_LIB_DIR}/${ONNXRUNTIME_PROVIDERS_ROCM_LIB}")
   add_compile_definitions(USE_ROCM=1)
-endif()
\ No newline at end of file
+endif()
+
+# Without CUDA, the CUDA sources are built with hipcc instead, so the search and the input updates stay on the AMD GPU.
+# src/cuda_hip.h maps the CUDA runtime onto HIP, and the code paths for DeviceType::CUDA serve the ROCm provider
+if(USE_ROCM AND NOT USE_CUDA)
+  enable_language(HIP)
+  message(STATUS "CMAKE_HIP_COMPILER_VERSION: ${CMAKE_HIP_COMPILER_VERSION}")
+  find_package(hip REQUIRED)
+  find_package(hipcub REQUIRED)
+
+  file(GLOB generator_hip_srcs CONFIGURE_DEPENDS
+    "${GENERATORS_ROOT}/*.cu"
+    "${MODELS_ROOT}/*.cu"
+  )
+  file(GLOB generator_hip_hdrs CONFIGURE_DEPENDS
+    "${GENERATORS_ROOT}/*.cuh"
+    "${MODELS_ROOT}/*.cuh"
+  )
+  # check_cuda.cmake took the host sources of the CUDA search out, they're needed again
+  file(GLOB generator_cuda_host_srcs "${GENERATORS_ROOT}/*_cuda*.cpp" "${GENERATORS_ROOT}/*_cuda*.h")
+  set_source_files_properties(${generator_hip_srcs} PROPERTIES LANGUAGE HIP)
+  list(APPEND generator_srcs ${generator_hip_srcs} ${generator_hip_hdrs} ${generator_cuda_host_srcs})
+  add_compile_definitions(USE_CUDA=1)
+endif()
@@ -44,6 +44,20 @@ FetchContent_Declare(
 
 onnxruntime_fetchcontent_makeavailable(googletest)
 
+if(ENABLE_KERNEL_BENCHMARK)
+  set(BENCHMARK_ENABLE_TESTING OFF CACHE BOOL "" FORCE)
+  set(BENCHMARK_ENABLE_INSTALL OFF CACHE BOOL "" FORCE)
+
+  FetchContent_Declare(
+    google_benchmark
+    GIT_REPOSITORY ${DEP_URL_google_benchmark}
+    GIT_TAG ${DEP_SHA1_google_benchmark}
+    FIND_PACKAGE_ARGS NAMES benchmark
+  )
+
+  onnxruntime_fetchcontent_makeavailable(google_benchmark)
+endif()
+
 if(USE_DML)
   set(WIL_BUILD_PACKAGING OFF CACHE BOOL "" FORCE)
   set(WIL_BUILD_TESTS OFF CACHE BOOL "" FORCE)
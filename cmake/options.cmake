@@ -16,4 +16,5 @@ option(TEST_PHI2 "Enable tests for Phi2" OFF)
 
 # performance
 option(ENABLE_MODEL_BENCHMARK "Build model benchmark program" ON)
+option(ENABLE_KERNEL_BENCHMARK "Build the Google Benchmark program for the sampling & softmax kernels" OFF)
 
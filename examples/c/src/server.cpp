@@ -0,0 +1,1106 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+// An OpenAI compatible HTTP server on top of the request scheduler. Every request is its own scheduler request, so many
+// clients share one model instance, and one engine thread steps the scheduler for all of them.
+//
+//   POST /v1/completions         {"prompt", "max_tokens", "temperature", "top_p", "top_k", "stream", "priority"}
+//   POST /v1/chat/completions    the same with "messages" instead of "prompt", put through --message-template
+//   GET  /v1/models
+//   GET  /metrics                Prometheus text of the model and scheduler metrics
+//   GET  /health
+//
+// With "stream": true the tokens are sent as server sent events as they're generated, decoded by a TokenizerStream per
+// request. A client that goes away mid generation has its request cancelled, which frees its slot for the next one.
+//
+// Prompts and generation can run on separate servers, so each pool is sized for its own work and long prompts don't
+// stall the steps of the running generations. A server started with --decode_server host:port only runs the prompts: it
+// picks the first token, saves the generator's state (the tokens and their kv caches) and posts it to the decode server,
+// then passes the decode server's response through to the client:
+//
+//   POST /internal/decode        a JSON line of the request and its tokens, then the bytes of OgaGenerator::SaveState
+//
+// The decode route is only served with --internal_token set, and only to requests with that token in their
+// X-Internal-Token header, which the prefill servers are started with too.
+
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+using socket_t = SOCKET;
+#define close_socket closesocket
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+using socket_t = int;
+constexpr socket_t INVALID_SOCKET = -1;
+#define close_socket close
+#endif
+
+#include "ort_genai.h"
+
+namespace {
+
+// JSON, just what the requests and responses need
+
+struct Json {
+  enum class Type { Null,
+                    Bool,
+                    Number,
+                    String,
+                    Array,
+                    Object } type{Type::Null};
+  bool boolean{};
+  double number{};
+  std::string string;
+  std::vector<Json> array;
+  std::vector<std::pair<std::string, Json>> object;
+
+  const Json* Find(std::string_view key) const {
+    for (auto& [name, value] : object) {
+      if (name == key)
+        return &value;
+    }
+    return nullptr;
+  }
+
+  double GetNumber(std::string_view key, double default_value) const {
+    auto* value = Find(key);
+    return value && value->type == Type::Number ? value->number : default_value;
+  }
+
+  bool GetBool(std::string_view key, bool default_value) const {
+    auto* value = Find(key);
+    return value && value->type == Type::Bool ? value->boolean : default_value;
+  }
+
+  const std::string* GetString(std::string_view key) const {
+    auto* value = Find(key);
+    return value && value->type == Type::String ? &value->string : nullptr;
+  }
+
+  // For the values a client sends: numbers in [min, max], anything else is a malformed request
+  double GetNumber(std::string_view key, double default_value, double min, double max) const {
+    const double value = GetNumber(key, default_value);
+    if (!(value >= min && value <= max))
+      throw std::runtime_error("The request's " + std::string{key} + " is invalid");
+    return value;
+  }
+
+  // Whole numbers in [min, max]
+  int64_t GetInteger(std::string_view key, double default_value, double min, double max) const {
+    const double value = GetNumber(key, default_value, min, max);
+    if (value != static_cast<double>(static_cast<int64_t>(value)))
+      throw std::runtime_error("The request's " + std::string{key} + " is invalid");
+    return static_cast<int64_t>(value);
+  }
+};
+
+struct JsonParser {
+  explicit JsonParser(std::string_view text) : text_{text} {}
+
+  Json ParseDocument() {
+    auto value = ParseValue(0);
+    SkipWhitespace();
+    if (pos_ != text_.size())
+      Fail("trailing characters");
+    return value;
+  }
+
+ private:
+  [[noreturn]] void Fail(const char* what) const {
+    throw std::runtime_error(std::string{"Invalid JSON at offset "} + std::to_string(pos_) + ": " + what);
+  }
+
+  void SkipWhitespace() {
+    while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r'))
+      pos_++;
+  }
+
+  bool Consume(std::string_view token) {
+    if (text_.substr(pos_, token.size()) != token)
+      return false;
+    pos_ += token.size();
+    return true;
+  }
+
+  Json ParseValue(int depth) {
+    if (depth > 64)
+      Fail("nested too deep");
+    SkipWhitespace();
+    if (pos_ == text_.size())
+      Fail("unexpected end");
+
+    Json value;
+    const char c = text_[pos_];
+    if (c == '{') {
+      value.type = Json::Type::Object;
+      pos_++;
+      SkipWhitespace();
+      if (Consume("}"))
+        return value;
+      do {
+        SkipWhitespace();
+        if (pos_ == text_.size() || text_[pos_] != '"')
+          Fail("expected a key");
+        auto key = ParseString();
+        SkipWhitespace();
+        if (!Consume(":"))
+          Fail("expected ':'");
+        auto member = ParseValue(depth + 1);
+        value.object.emplace_back(std::move(key), std::move(member));
+        SkipWhitespace();
+      } while (Consume(","));
+      if (!Consume("}"))
+        Fail("expected '}'");
+    } else if (c == '[') {
+      value.type = Json::Type::Array;
+      pos_++;
+      SkipWhitespace();
+      if (Consume("]"))
+        return value;
+      do {
+        value.array.push_back(ParseValue(depth + 1));
+        SkipWhitespace();
+      } while (Consume(","));
+      if (!Consume("]"))
+        Fail("expected ']'");
+    } else if (c == '"') {
+      value.type = Json::Type::String;
+      value.string = ParseString();
+    } else if (Consume("true")) {
+      value.type = Json::Type::Bool;
+      value.boolean = true;
+    } else if (Consume("false")) {
+      value.type = Json::Type::Bool;
+    } else if (Consume("null")) {
+    } else {
+      const size_t start = pos_;
+      while (pos_ < text_.size() && text_[pos_] != '\0' && std::strchr("+-0123456789.eE", text_[pos_]))
+        pos_++;
+      if (start == pos_)
+        Fail("unexpected character");
+      value.type = Json::Type::Number;
+      value.number = std::stod(std::string{text_.substr(start, pos_ - start)});
+    }
+    return value;
+  }
+
+  uint32_t ParseHex4() {
+    if (pos_ + 4 > text_.size())
+      Fail("short \\u escape");
+    const auto hex = std::string{text_.substr(pos_, 4)};
+    pos_ += 4;
+    return static_cast<uint32_t>(std::stoul(hex, nullptr, 16));
+  }
+
+  static void AppendUtf8(std::string& out, uint32_t code_point) {
+    if (code_point < 0x80) {
+      out += static_cast<char>(code_point);
+    } else if (code_point < 0x800) {
+      out += static_cast<char>(0xC0 | (code_point >> 6));
+      out += static_cast<char>(0x80 | (code_point & 0x3F));
+    } else if (code_point < 0x10000) {
+      out += static_cast<char>(0xE0 | (code_point >> 12));
+      out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (code_point & 0x3F));
+    } else {
+      out += static_cast<char>(0xF0 | (code_point >> 18));
+      out += static_cast<char>(0x80 | ((code_point >> 12) & 0x3F));
+      out += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+      out += static_cast<char>(0x80 | (code_point & 0x3F));
+    }
+  }
+
+  std::string ParseString() {
+    pos_++;  // The opening quote
+    std::string out;
+    while (pos_ < text_.size() && text_[pos_] != '"') {
+      char c = text_[pos_++];
+      if (c != '\\') {
+        out += c;
+        continue;
+      }
+      if (pos_ == text_.size())
+        Fail("unexpected end in a string");
+      c = text_[pos_++];
+      switch (c) {
+        case 'n':
+          out += '\n';
+          break;
+        case 't':
+          out += '\t';
+          break;
+        case 'r':
+          out += '\r';
+          break;
+        case 'b':
+          out += '\b';
+          break;
+        case 'f':
+          out += '\f';
+          break;
+        case 'u': {
+          uint32_t code_point = ParseHex4();
+          if (code_point >= 0xDC00 && code_point < 0xE000)
+            Fail("unpaired low surrogate");
+          if (code_point >= 0xD800 && code_point < 0xDC00) {  // Must be followed by its low surrogate
+            if (!Consume("\\u"))
+              Fail("unpaired high surrogate");
+            const uint32_t low = ParseHex4();
+            if (low < 0xDC00 || low >= 0xE000)
+              Fail("unpaired high surrogate");
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) + (low - 0xDC00);
+          }
+          AppendUtf8(out, code_point);
+          break;
+        }
+        default:
+          out += c;  // \" \\ and \/
+      }
+    }
+    if (!Consume("\""))
+      Fail("unterminated string");
+    return out;
+  }
+
+  std::string_view text_;
+  size_t pos_{};
+};
+
+std::string JsonString(std::string_view text) {
+  std::string out{"\""};
+  for (char c : text) {
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\r':
+        out += "\\r";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          char escaped[8];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          out += escaped;
+        } else {
+          out += c;
+        }
+    }
+  }
+  return out + '"';
+}
+
+// Round trips, unlike std::to_string's 6 decimals
+std::string FormatNumber(double value) {
+  char buffer[32];
+  std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+  return buffer;
+}
+
+// HTTP/1.1, one request per connection
+
+struct HttpRequest {
+  std::string method;
+  std::string path;
+  std::string internal_token;  // X-Internal-Token
+  size_t content_length{};
+  std::string body;  // All of it, except for the decode route where it's what came with the header, see Server::Decode
+};
+
+bool SendAll(socket_t socket, std::string_view data) {
+  while (!data.empty()) {
+    const auto sent = send(socket, data.data(), static_cast<int>(data.size()), 0);
+    if (sent <= 0)
+      return false;
+    data.remove_prefix(sent);
+  }
+  return true;
+}
+
+constexpr std::string_view c_decode_path = "/internal/decode";
+constexpr size_t c_max_body_bytes = 16 * 1024 * 1024;
+constexpr size_t c_max_state_bytes = size_t{4} * 1024 * 1024 * 1024;  // The kv caches of a long prompt are large
+
+bool ReceiveAll(socket_t socket, char* data, size_t size) {
+  while (size) {
+    const auto received = recv(socket, data, static_cast<int>(std::min<size_t>(size, 1 << 20)), 0);
+    if (received <= 0)
+      return false;
+    data += received;
+    size -= received;
+  }
+  return true;
+}
+
+std::string_view Trim(std::string_view text) {
+  const auto begin = text.find_first_not_of(" \t\r");
+  if (begin == std::string_view::npos)
+    return {};
+  return text.substr(begin, text.find_last_not_of(" \t\r") + 1 - begin);
+}
+
+// Reads the header, and the body unless it's the decode route's. That one is only read once its token is checked
+bool ReadRequest(socket_t socket, HttpRequest& request) {
+  constexpr size_t c_max_header_bytes = 64 * 1024;
+
+  std::string data;
+  size_t header_end;
+  char buffer[8192];
+  while ((header_end = data.find("\r\n\r\n")) == std::string::npos) {
+    if (data.size() > c_max_header_bytes)
+      return false;
+    const auto received = recv(socket, buffer, sizeof(buffer), 0);
+    if (received <= 0)
+      return false;
+    data.append(buffer, received);
+  }
+
+  std::istringstream header{data.substr(0, header_end)};
+  std::string version;
+  header >> request.method >> request.path >> version;
+  size_t content_length = 0;
+  std::string line;
+  std::getline(header, line);
+  while (std::getline(header, line)) {
+    const auto colon = line.find(':');
+    if (colon == std::string::npos)
+      continue;
+    std::string name = line.substr(0, colon);
+    for (auto& c : name)
+      c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    const auto value = Trim(std::string_view{line}.substr(colon + 1));
+    if (name == "content-length") {
+      const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), content_length);
+      if (value.empty() || error != std::errc{} || end != value.data() + value.size())
+        return false;
+    } else if (name == "x-internal-token")
+      request.internal_token = value;
+  }
+  if (content_length > (request.path == c_decode_path ? c_max_state_bytes : c_max_body_bytes))
+    return false;
+
+  request.content_length = content_length;
+  request.body = data.substr(header_end + 4);
+  if (request.path == c_decode_path)
+    return true;
+  while (request.body.size() < content_length) {
+    const auto received = recv(socket, buffer, sizeof(buffer), 0);
+    if (received <= 0)
+      return false;
+    request.body.append(buffer, received);
+  }
+  request.body.resize(content_length);
+  return true;
+}
+
+const char* StatusText(int status) {
+  switch (status) {
+    case 200:
+      return "OK";
+    case 400:
+      return "Bad Request";
+    case 403:
+      return "Forbidden";
+    case 404:
+      return "Not Found";
+    default:
+      return "Internal Server Error";
+  }
+}
+
+void SendResponse(socket_t socket, int status, std::string_view content_type, std::string_view body) {
+  std::string response = "HTTP/1.1 " + std::to_string(status) + " " + StatusText(status) + "\r\n" +
+                         "Content-Type: " + std::string{content_type} + "\r\n" +
+                         "Content-Length: " + std::to_string(body.size()) + "\r\n" +
+                         "Connection: close\r\n\r\n";
+  response += body;
+  SendAll(socket, response);
+}
+
+void SendError(socket_t socket, int status, std::string_view message) {
+  SendResponse(socket, status, "application/json", "{\"error\":{\"message\":" + JsonString(message) + "}}");
+}
+
+// The engine thread owns the scheduler. Connection threads submit their requests to it, and it hands each one's tokens
+// to its session as the steps generate them
+
+struct Session {
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<int32_t> tokens;  // Generated, but not taken by the connection yet
+  bool done{};
+  std::string error;
+
+  std::atomic<bool> cancelled{};  // Set by the connection, the engine drops the request on its next loop
+};
+
+struct Engine {
+  Engine(const OgaModel& model, int32_t max_active_requests, size_t max_kv_cache_bytes)
+      : model_{model},
+        max_active_requests_{max_active_requests},
+        max_kv_cache_bytes_{max_kv_cache_bytes},
+        scheduler_{OgaScheduler::Create(model, max_active_requests, max_kv_cache_bytes, true)} {
+    thread_ = std::thread{[this] { Loop(); }};
+  }
+
+  ~Engine() {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      stopping_ = true;
+    }
+    work_.notify_one();
+    thread_.join();
+  }
+
+  std::shared_ptr<Session> Submit(std::unique_ptr<OgaGeneratorParams> params, int32_t priority) {
+    auto session = std::make_shared<Session>();
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      submitted_.push_back({std::move(params), priority, session});
+    }
+    work_.notify_one();
+    return session;
+  }
+
+  void Cancel(Session& session) {
+    session.cancelled = true;
+    work_.notify_one();
+  }
+
+  std::atomic<size_t> active_count_{}, waiting_count_{};
+
+ private:
+  struct Submitted {
+    std::unique_ptr<OgaGeneratorParams> params;
+    int32_t priority;
+    std::shared_ptr<Session> session;
+  };
+
+  static void Finish(Session& session, std::string error) {
+    {
+      std::lock_guard<std::mutex> lock{session.mutex};
+      session.done = true;
+      session.error = std::move(error);
+    }
+    session.changed.notify_all();
+  }
+
+  void Loop() {
+    for (;;) {
+      std::deque<Submitted> submitted;
+      {
+        std::unique_lock<std::mutex> lock{mutex_};
+        work_.wait(lock, [this] { return stopping_ || !submitted_.empty() || !sessions_.empty(); });
+        if (stopping_)
+          break;
+        submitted.swap(submitted_);
+      }
+
+      for (auto& request : submitted) {
+        try {
+          sessions_.emplace(scheduler_->AddRequest(*request.params, request.priority), request.session);
+        } catch (const std::exception& e) {
+          Finish(*request.session, e.what());
+        }
+      }
+
+      for (auto it = sessions_.begin(); it != sessions_.end();) {
+        if (!it->second->cancelled) {
+          ++it;
+          continue;
+        }
+        scheduler_->Cancel(it->first);
+        it = sessions_.erase(it);
+      }
+      if (sessions_.empty())
+        continue;
+
+      try {
+        scheduler_->Step();
+      } catch (const std::exception& e) {
+        // The requests fail one by one through TakeFinished, so this is the scheduler itself, start over with a new one
+        for (auto& [id, session] : sessions_)
+          Finish(*session, e.what());
+        sessions_.clear();
+        scheduler_ = OgaScheduler::Create(model_, max_active_requests_, max_kv_cache_bytes_, true);
+        continue;
+      }
+
+      for (size_t i = 0; i < scheduler_->GetStepTokenCount(); i++) {
+        uint64_t id;
+        const int32_t* tokens;
+        size_t token_count;
+        scheduler_->GetStepTokens(i, id, tokens, token_count);
+        auto it = sessions_.find(id);
+        if (it == sessions_.end() || token_count == 0)
+          continue;
+        auto& session = *it->second;
+        {
+          std::lock_guard<std::mutex> lock{session.mutex};
+          session.tokens.push_back(tokens[0]);
+        }
+        session.changed.notify_all();
+      }
+
+      uint64_t ids[64];
+      const char* errors[64];
+      while (size_t count = scheduler_->TakeFinished(ids, errors, std::size(ids))) {
+        for (size_t i = 0; i < count; i++) {
+          auto it = sessions_.find(ids[i]);
+          if (it != sessions_.end()) {
+            Finish(*it->second, errors[i] ? errors[i] : "");
+            sessions_.erase(it);
+          }
+          OgaDestroyString(errors[i]);
+        }
+      }
+
+      active_count_ = static_cast<size_t>(scheduler_->GetMetric("active_count"));
+      waiting_count_ = static_cast<size_t>(scheduler_->GetMetric("waiting_count"));
+    }
+  }
+
+  const OgaModel& model_;
+  const int32_t max_active_requests_;
+  const size_t max_kv_cache_bytes_;
+  std::unique_ptr<OgaScheduler> scheduler_;
+  std::unordered_map<uint64_t, std::shared_ptr<Session>> sessions_;  // The engine thread's only
+
+  std::mutex mutex_;
+  std::condition_variable work_;
+  std::deque<Submitted> submitted_;
+  bool stopping_{};
+
+  std::thread thread_;  // Last, so it starts after everything it uses
+};
+
+struct ServerOptions {
+  std::string host{"0.0.0.0"};
+  int port{8080};
+  int32_t max_active_requests{8};
+  size_t max_kv_cache_bytes{};
+  std::string model_name;
+  std::string message_template{"<|{role}|>\n{content}<|end|>\n"};  // Phi-3 style, like the other examples
+  std::string generation_prompt{"<|assistant|>"};
+  std::string decode_server;   // host:port the generations continue on, after their prompts run here
+  std::string internal_token;  // Shared by the prefill & decode servers, the decode route is off without it
+  int max_connections{256};    // Handled at once, each on a thread of its own. More wait to be accepted
+};
+
+struct Server {
+  Server(const char* model_path, const ServerOptions& options)
+      : options_{options},
+        model_{OgaModel::Create(model_path)},
+        tokenizer_{OgaTokenizer::Create(*model_)},
+        context_length_{static_cast<size_t>(model_->GetMetric("context_length"))},
+        engine_{*model_, options.max_active_requests, options.max_kv_cache_bytes},
+        prefill_slots_{options.max_active_requests} {}
+
+  void HandleConnection(socket_t socket) {
+    HttpRequest request;
+    if (!ReadRequest(socket, request)) {
+      SendError(socket, 400, "Malformed request");
+      return;
+    }
+    http_requests_++;
+
+    try {
+      if (request.method == "GET" && request.path == "/health")
+        SendResponse(socket, 200, "text/plain", "ok");
+      else if (request.method == "GET" && request.path == "/metrics")
+        SendResponse(socket, 200, "text/plain; version=0.0.4", GetMetrics());
+      else if (request.method == "GET" && request.path == "/v1/models")
+        SendResponse(socket, 200, "application/json", "{\"object\":\"list\",\"data\":[{\"id\":" + JsonString(options_.model_name) + ",\"object\":\"model\",\"owned_by\":\"onnxruntime-genai\"}]}");
+      else if (request.method == "POST" && request.path == "/v1/completions")
+        Complete(socket, JsonParser{request.body}.ParseDocument(), false);
+      else if (request.method == "POST" && request.path == "/v1/chat/completions")
+        Complete(socket, JsonParser{request.body}.ParseDocument(), true);
+      else if (request.method == "POST" && request.path == c_decode_path) {
+        if (!IsInternal(request)) {
+          SendError(socket, 403, "Not an internal request");
+          return;
+        }
+        Decode(socket, request);
+      } else
+        SendError(socket, 404, "No route for " + request.method + " " + request.path);
+    } catch (const std::exception& e) {
+      SendError(socket, 400, e.what());
+    }
+  }
+
+ private:
+  bool IsInternal(const HttpRequest& request) const {
+    const auto& token = options_.internal_token;
+    if (token.empty() || request.internal_token.size() != token.size())
+      return false;
+    unsigned char difference = 0;  // Compares every byte, so the time taken doesn't tell how much of the token matched
+    for (size_t i = 0; i < token.size(); i++)
+      difference |= static_cast<unsigned char>(token[i] ^ request.internal_token[i]);
+    return difference == 0;
+  }
+
+  std::string ApplyTemplate(const Json& messages) const {
+    if (messages.type != Json::Type::Array || messages.array.empty())
+      throw std::runtime_error("messages must be a non empty array");
+
+    std::string prompt;
+    for (auto& message : messages.array) {
+      auto* role = message.GetString("role");
+      auto* content = message.GetString("content");
+      if (!role || !content)
+        throw std::runtime_error("Every message needs a role and a content string");
+
+      std::string text = options_.message_template;
+      for (auto [placeholder, value] : {std::pair{std::string_view{"{role}"}, role}, std::pair{std::string_view{"{content}"}, content}}) {
+        if (auto at = text.find(placeholder); at != std::string::npos)
+          text.replace(at, placeholder.size(), *value);
+      }
+      prompt += text;
+    }
+    return prompt + options_.generation_prompt;
+  }
+
+  // A completion request, once its prompt is tokenized
+  struct Completion {
+    bool chat{};
+    bool stream{};
+    std::vector<int32_t> tokens;  // The prompt, followed by the token a prefill server picked after it, if any
+    size_t prompt_tokens{};
+    size_t max_tokens{};
+    double temperature{};
+    double top_p{};
+    double top_k{};
+    int32_t priority{};
+  };
+
+  void Complete(socket_t socket, const Json& body, bool chat) {
+    if (body.type != Json::Type::Object)
+      throw std::runtime_error("The body must be a JSON object");
+
+    std::string prompt;
+    if (chat) {
+      auto* messages = body.Find("messages");
+      if (!messages)
+        throw std::runtime_error("messages is missing");
+      prompt = ApplyTemplate(*messages);
+    } else {
+      auto* text = body.GetString("prompt");
+      if (!text)
+        throw std::runtime_error("prompt must be a string");
+      prompt = *text;
+    }
+
+    Completion completion;
+    completion.chat = chat;
+    completion.stream = body.GetBool("stream", false);
+    auto sequences = OgaSequences::Create();
+    tokenizer_->Encode(prompt.c_str(), *sequences);
+    completion.tokens.assign(sequences->SequenceData(0), sequences->SequenceData(0) + sequences->SequenceCount(0));
+    completion.prompt_tokens = completion.tokens.size();
+    completion.max_tokens = static_cast<size_t>(body.GetInteger("max_tokens", 256, 1, INT32_MAX));
+    completion.temperature = body.GetNumber("temperature", 1.0, 0, 1e6);
+    completion.top_p = body.GetNumber("top_p", 1.0, 0, 1);
+    completion.top_k = static_cast<double>(body.GetInteger("top_k", 50, 0, INT32_MAX));
+    completion.priority = static_cast<int32_t>(body.GetInteger("priority", 0, INT32_MIN, INT32_MAX));
+    FitContext(completion);
+
+    if (!options_.decode_server.empty()) {
+      Prefill(socket, completion);
+      return;
+    }
+    Respond(socket, completion, engine_.Submit(CreateParams(completion), completion.priority));
+  }
+
+  // Generates at most up to the context length, a prompt that fills it is rejected
+  void FitContext(Completion& completion) const {
+    if (completion.prompt_tokens >= context_length_)
+      throw std::runtime_error("The prompt's " + std::to_string(completion.prompt_tokens) + " tokens don't fit in the context length of " + std::to_string(context_length_));
+    completion.max_tokens = std::min(completion.max_tokens, context_length_ - completion.prompt_tokens);
+  }
+
+  std::unique_ptr<OgaGeneratorParams> CreateParams(const Completion& completion) const {
+    auto params = OgaGeneratorParams::Create(*model_);
+    params->SetSearchOption("max_length", static_cast<double>(completion.prompt_tokens + completion.max_tokens));
+    if (completion.temperature > 0) {
+      params->SetSearchOptionBool("do_sample", true);
+      params->SetSearchOption("temperature", completion.temperature);
+      params->SetSearchOption("top_p", completion.top_p);
+      params->SetSearchOption("top_k", completion.top_k);
+    }
+    auto sequences = OgaSequences::Create();
+    sequences->Append(completion.tokens.data(), completion.tokens.size());
+    params->SetInputSequences(*sequences);
+    return params;
+  }
+
+  // Runs the prompt and picks the first token here, then continues on the decode server with the generator's state
+  void Prefill(socket_t socket, Completion& completion) {
+    std::vector<uint8_t> state;
+    {
+      // At most max_active_requests prompts run at once, like the engine's slots, so their kv caches fit too
+      prefill_slots_.acquire();
+      struct SlotRelease {
+        ~SlotRelease() { slots.release(); }
+        std::counting_semaphore<>& slots;
+      } slot_release{prefill_slots_};
+
+      auto params = CreateParams(completion);
+      auto generator = OgaGenerator::Create(*model_, *params);
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+      completion.tokens.push_back(generator->GetSequenceData(0)[generator->GetSequenceCount(0) - 1]);
+
+      if (generator->IsDone()) {
+        // Nothing left for the decode server
+        auto session = std::make_shared<Session>();
+        session->done = true;
+        generator.reset();
+        Respond(socket, completion, session);
+        return;
+      }
+      state = generator->SaveState();
+    }
+
+    std::string header = "{\"chat\":" + std::string{completion.chat ? "true" : "false"} + ",\"stream\":" + (completion.stream ? "true" : "false") +
+                         ",\"prompt_tokens\":" + std::to_string(completion.prompt_tokens) + ",\"max_tokens\":" + std::to_string(completion.max_tokens) +
+                         ",\"temperature\":" + FormatNumber(completion.temperature) + ",\"top_p\":" + FormatNumber(completion.top_p) +
+                         ",\"top_k\":" + FormatNumber(completion.top_k) + ",\"priority\":" + std::to_string(completion.priority) + ",\"tokens\":[";
+    for (size_t i = 0; i < completion.tokens.size(); i++)
+      header += (i ? "," : "") + std::to_string(completion.tokens[i]);
+    header += "]}\n";
+
+    const auto colon = options_.decode_server.rfind(':');
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(colon == std::string::npos ? 0 : std::stoi(options_.decode_server.substr(colon + 1))));
+    socket_t decode = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (decode == INVALID_SOCKET || colon == std::string::npos || inet_pton(AF_INET, options_.decode_server.substr(0, colon).c_str(), &address.sin_addr) != 1 ||
+        connect(decode, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+      if (decode != INVALID_SOCKET)
+        close_socket(decode);
+      throw std::runtime_error("Unable to connect to the decode server " + options_.decode_server);
+    }
+
+    const std::string request = "POST " + std::string{c_decode_path} + " HTTP/1.1\r\nContent-Type: application/octet-stream\r\nX-Internal-Token: " +
+                                options_.internal_token + "\r\nContent-Length: " + std::to_string(header.size() + state.size()) +
+                                "\r\nConnection: close\r\n\r\n" + header;
+    if (SendAll(decode, request) && SendAll(decode, {reinterpret_cast<const char*>(state.data()), state.size()})) {
+      state = {};
+      // The decode server's response is the client's, stream or not. When a streaming client goes, closing the
+      // connection makes the decode server's next send fail, which cancels the request there
+      char buffer[8192];
+      for (;;) {
+        const auto received = recv(decode, buffer, sizeof(buffer), 0);
+        if (received <= 0 || !SendAll(socket, {buffer, static_cast<size_t>(received)}))
+          break;
+      }
+    } else
+      SendError(socket, 500, "Unable to send the request to the decode server " + options_.decode_server);
+    close_socket(decode);
+  }
+
+  // A request whose prompt ran on a prefill server, it continues from the state that server saved. The JSON line is read
+  // and checked first, then the state is read straight into a buffer of its size
+  void Decode(socket_t socket, HttpRequest& request) {
+    std::string& data = request.body;
+    size_t line_end;
+    char buffer[8192];
+    while ((line_end = data.find('\n')) == std::string::npos) {
+      if (data.size() >= std::min(request.content_length, c_max_body_bytes))
+        throw std::runtime_error("The request doesn't start with a JSON line");
+      const auto received = recv(socket, buffer, static_cast<int>(std::min(sizeof(buffer), request.content_length - data.size())), 0);
+      if (received <= 0)
+        throw std::runtime_error("The request ended before its JSON line");
+      data.append(buffer, received);
+    }
+    if (line_end >= request.content_length)
+      throw std::runtime_error("The request's JSON line is longer than its content");
+
+    const auto header = JsonParser{std::string_view{data}.substr(0, line_end)}.ParseDocument();
+    auto* tokens = header.Find("tokens");
+    if (header.type != Json::Type::Object || !tokens || tokens->type != Json::Type::Array)
+      throw std::runtime_error("The request's JSON line needs its tokens");
+
+    Completion completion;
+    completion.chat = header.GetBool("chat", false);
+    completion.stream = header.GetBool("stream", false);
+    completion.prompt_tokens = static_cast<size_t>(header.GetInteger("prompt_tokens", 0, 1, INT32_MAX));
+    completion.max_tokens = static_cast<size_t>(header.GetInteger("max_tokens", 256, 1, INT32_MAX));
+    completion.temperature = header.GetNumber("temperature", 1.0, 0, 1e6);
+    completion.top_p = header.GetNumber("top_p", 1.0, 0, 1);
+    completion.top_k = static_cast<double>(header.GetInteger("top_k", 50, 0, INT32_MAX));
+    completion.priority = static_cast<int32_t>(header.GetInteger("priority", 0, INT32_MIN, INT32_MAX));
+    FitContext(completion);
+    // The prompt and the first token the prefill server picked after it
+    if (tokens->array.size() != completion.prompt_tokens + 1)
+      throw std::runtime_error("The request's tokens need the prompt and the first generated token");
+    for (auto& token : tokens->array) {
+      if (token.type != Json::Type::Number || !(token.number >= 0 && token.number <= INT32_MAX) || token.number != static_cast<double>(static_cast<int32_t>(token.number)))
+        throw std::runtime_error("The request's tokens must be token ids");
+      completion.tokens.push_back(static_cast<int32_t>(token.number));
+    }
+
+    std::vector<uint8_t> state(request.content_length - line_end - 1);
+    const size_t received = std::min(state.size(), data.size() - line_end - 1);
+    std::memcpy(state.data(), data.data() + line_end + 1, received);
+    data = {};
+    if (!ReceiveAll(socket, reinterpret_cast<char*>(state.data() + received), state.size() - received))
+      throw std::runtime_error("The request ended before its state");
+
+    auto params = CreateParams(completion);
+    params->SetRestoredState(state.data(), state.size());
+    state = {};
+    Respond(socket, completion, engine_.Submit(std::move(params), completion.priority));
+  }
+
+  // Sends the tokens of the session as they're generated, after those the completion already has
+  void Respond(socket_t socket, const Completion& completion, const std::shared_ptr<Session>& session) {
+    const bool chat = completion.chat, stream = completion.stream;
+    auto tokenizer_stream = OgaTokenizerStream::Create(*tokenizer_);
+
+    const std::string id = std::string{chat ? "chatcmpl-" : "cmpl-"} + std::to_string(next_id_++);
+    const std::string object = chat ? "chat.completion" : "text_completion";
+    const std::string created = std::to_string(std::time(nullptr));
+    const auto choice = [&](std::string_view text, std::string_view finish_reason, bool delta) {
+      std::string content = chat ? std::string{delta ? "\"delta\":" : "\"message\":"} + "{\"role\":\"assistant\",\"content\":" + JsonString(text) + "}"
+                                 : "\"text\":" + JsonString(text);
+      return "{\"index\":0," + content + ",\"finish_reason\":" + (finish_reason.empty() ? std::string{"null"} : JsonString(finish_reason)) + "}";
+    };
+    const auto header = [&](bool chunk) {
+      return "{\"id\":\"" + id + "\",\"object\":\"" + object + (chunk && chat ? ".chunk" : "") + "\",\"created\":" + created +
+             ",\"model\":" + JsonString(options_.model_name) + ",\"choices\":[";
+    };
+
+    if (stream && !SendAll(socket, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n")) {
+      engine_.Cancel(*session);
+      return;
+    }
+
+    std::string text;
+    size_t completion_tokens = 0;
+    std::string error;
+    std::deque<int32_t> tokens{completion.tokens.begin() + completion.prompt_tokens, completion.tokens.end()};
+    for (;;) {
+      bool done;
+      {
+        std::unique_lock<std::mutex> lock{session->mutex};
+        session->changed.wait(lock, [&] { return session->done || !session->tokens.empty() || !tokens.empty(); });
+        tokens.insert(tokens.end(), session->tokens.begin(), session->tokens.end());
+        session->tokens.clear();
+        done = session->done;
+        error = session->error;
+      }
+
+      std::string chunk;
+      for (auto token : tokens)
+        chunk += tokenizer_stream->Decode(token);
+      completion_tokens += tokens.size();
+      tokens.clear();
+
+      if (stream && !chunk.empty() && !SendAll(socket, "data: " + header(true) + choice(chunk, "", true) + "]}\n\n")) {
+        engine_.Cancel(*session);  // The client has gone
+        return;
+      }
+      if (!stream)
+        text += chunk;
+      if (done)
+        break;
+    }
+
+    const size_t prompt_tokens = completion.prompt_tokens;
+    const std::string finish_reason = completion_tokens >= completion.max_tokens ? "length" : "stop";
+    if (stream) {
+      if (!error.empty())
+        SendAll(socket, "data: {\"error\":{\"message\":" + JsonString(error) + "}}\n\n");
+      else
+        SendAll(socket, "data: " + header(true) + choice("", finish_reason, true) + "]}\n\n");
+      SendAll(socket, "data: [DONE]\n\n");
+      return;
+    }
+
+    if (!error.empty()) {
+      SendError(socket, 500, error);
+      return;
+    }
+    SendResponse(socket, 200, "application/json",
+                 header(false) + choice(text, finish_reason, false) + "],\"usage\":{\"prompt_tokens\":" + std::to_string(prompt_tokens) +
+                     ",\"completion_tokens\":" + std::to_string(completion_tokens) + ",\"total_tokens\":" + std::to_string(prompt_tokens + completion_tokens) + "}}");
+  }
+
+  std::string GetMetrics() const {
+    std::ostringstream out;
+    const auto metric = [&](const char* name, const char* type, const char* help, double value) {
+      out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n"
+          << name << " " << static_cast<uint64_t>(value) << "\n";
+    };
+    metric("genai_prompt_tokens_total", "counter", "Prompt tokens run by the model", model_->GetMetric("prompt_token_count"));
+    metric("genai_generated_tokens_total", "counter", "Tokens generated by the model", model_->GetMetric("generated_token_count"));
+    metric("genai_kv_cache_bytes", "gauge", "Bytes of the kv caches of the running requests", model_->GetMetric("kv_cache_bytes"));
+    metric("genai_active_requests", "gauge", "Requests in a scheduler slot", static_cast<double>(engine_.active_count_));
+    metric("genai_waiting_requests", "gauge", "Requests waiting for a slot", static_cast<double>(engine_.waiting_count_));
+    metric("genai_http_requests_total", "counter", "HTTP requests received", static_cast<double>(http_requests_));
+    return out.str();
+  }
+
+  const ServerOptions options_;
+  std::unique_ptr<OgaModel> model_;
+  std::unique_ptr<OgaTokenizer> tokenizer_;
+  const size_t context_length_;  // The largest max_length, prompt included
+  Engine engine_;
+  std::counting_semaphore<> prefill_slots_;  // See Prefill
+  std::atomic<uint64_t> next_id_{}, http_requests_{};
+};
+
+void PrintUsage(const char* program) {
+  std::cerr << "usage: " << program << " model_path [--host 0.0.0.0] [--port 8080] [--max_active_requests 8]\n"
+            << "       [--max_kv_cache_mb 0] [--model_name name] [--message_template \"<|{role}|>\\n{content}<|end|>\\n\"]\n"
+            << "       [--generation_prompt \"<|assistant|>\"] [--decode_server host:port] [--internal_token token]\n"
+            << "       [--max_connections 256]\n"
+            << "Templates take \\n for a new line." << std::endl;
+}
+
+std::string Unescape(std::string_view text) {
+  std::string out;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '\\' && i + 1 < text.size() && text[i + 1] == 'n') {
+      out += '\n';
+      i++;
+    } else {
+      out += text[i];
+    }
+  }
+  return out;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2 || argc % 2 != 0) {
+    PrintUsage(argv[0]);
+    return -1;
+  }
+
+  const char* model_path = argv[1];
+  ServerOptions options;
+  options.model_name = model_path;
+  if (auto slash = options.model_name.find_last_of("/\\", options.model_name.size() - 2); slash != std::string::npos)
+    options.model_name = options.model_name.substr(slash + 1);
+  while (!options.model_name.empty() && (options.model_name.back() == '/' || options.model_name.back() == '\\'))
+    options.model_name.pop_back();
+
+  for (int i = 2; i + 1 < argc; i += 2) {
+    const std::string_view name{argv[i]};
+    const char* value = argv[i + 1];
+    if (name == "--host")
+      options.host = value;
+    else if (name == "--port")
+      options.port = std::stoi(value);
+    else if (name == "--max_active_requests")
+      options.max_active_requests = std::stoi(value);
+    else if (name == "--max_kv_cache_mb")
+      options.max_kv_cache_bytes = std::stoull(value) * 1024 * 1024;
+    else if (name == "--model_name")
+      options.model_name = value;
+    else if (name == "--message_template")
+      options.message_template = Unescape(value);
+    else if (name == "--generation_prompt")
+      options.generation_prompt = Unescape(value);
+    else if (name == "--decode_server")
+      options.decode_server = value;
+    else if (name == "--internal_token")
+      options.internal_token = value;
+    else if (name == "--max_connections")
+      options.max_connections = std::max(std::stoi(value), 1);
+    else {
+      PrintUsage(argv[0]);
+      return -1;
+    }
+  }
+  if (!options.decode_server.empty() && options.internal_token.empty()) {
+    std::cerr << "--decode_server needs the --internal_token the decode server was started with" << std::endl;
+    return -1;
+  }
+
+#ifdef _WIN32
+  WSADATA wsa_data;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+    std::cerr << "WSAStartup failed" << std::endl;
+    return -1;
+  }
+#else
+  std::signal(SIGPIPE, SIG_IGN);  // A client that hung up fails the send instead of ending the process
+#endif
+
+  try {
+    std::cout << "Loading " << model_path << "..." << std::endl;
+    Server server{model_path, options};
+
+    socket_t listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET)
+      throw std::runtime_error("Unable to create a socket");
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(static_cast<uint16_t>(options.port));
+    if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1)
+      throw std::runtime_error("Invalid host address " + options.host);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+      throw std::runtime_error("Unable to listen on " + options.host + ":" + std::to_string(options.port));
+    std::cout << "Serving " << options.model_name << " on http://" << options.host << ":" << options.port << std::endl;
+
+    std::counting_semaphore<> connection_slots{options.max_connections};
+    for (;;) {
+      connection_slots.acquire();
+      socket_t connection = accept(listener, nullptr, nullptr);
+      if (connection == INVALID_SOCKET) {
+        connection_slots.release();
+        continue;
+      }
+      std::thread{[&server, &connection_slots, connection] {
+        try {
+          server.HandleConnection(connection);
+        } catch (const std::exception& e) {
+          std::cerr << e.what() << std::endl;  // A thread of its own, where an exception would end the process
+        }
+        close_socket(connection);
+        connection_slots.release();
+      }}.detach();
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    OgaShutdown();
+    return -1;
+  }
+}
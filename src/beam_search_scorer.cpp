@@ -44,13 +44,14 @@ bool BeamHypotheses::CanImprove(float best_sum_logprobs, int current_length) con
 }
 
 BeamSearchScorer::BeamSearchScorer(const GeneratorParams& parameters)
-    : batch_size_{parameters.batch_size},
-      num_beams_{parameters.search.num_beams},
+    : num_beam_groups_{parameters.search.num_beam_groups},
+      batch_size_{parameters.batch_size * num_beam_groups_},
+      num_beams_{parameters.search.num_beams / num_beam_groups_},
       max_length_{parameters.search.max_length},
       pad_token_id_{parameters.pad_token_id},
       eos_token_id_{parameters.eos_token_id},
       early_stopping_{parameters.search.early_stopping},
-      not_done_count_{parameters.batch_size} {
+      not_done_count_{batch_size_} {
   size_t const batch_beam_size = static_cast<size_t>(batch_size_) * num_beams_;
 
   std::span<HypothesisScore> beams;
@@ -73,17 +74,31 @@ BeamSearchScorer::BeamSearchScorer(const GeneratorParams& parameters)
   // Initialize score of first beam of each group with 0 and the rest with -1e9.
   // This ensures that the beams in the same group don't produce same tokens every time.
   std::span<float> const beam_scores = next_beam_scores_;
-  for (int i = 0; i < parameters.batch_size; i++) {
-    for (int j = 1; j < parameters.search.num_beams; j++) {
-      beam_scores[i * parameters.search.num_beams + j] = -1e9;
+  for (int i = 0; i < batch_size_; i++) {
+    for (int j = 1; j < num_beams_; j++) {
+      beam_scores[i * num_beams_ + j] = -1e9;
     }
   }
 }
 
+RoamingArray<int32_t> BeamSearchScorer::GetHypothesis(size_t batch_id, size_t index) const {
+  if (num_beam_groups_ == 1)
+    return beam_hyps_[batch_id].GetHypothesis(index);
+
+  std::vector<HypothesisScore> hypotheses;
+  for (size_t group = 0; group < num_beam_groups_; group++) {
+    const BeamHypotheses& beam_hyp = beam_hyps_[batch_id * num_beam_groups_ + group];
+    hypotheses.insert(hypotheses.end(), beam_hyp.beams_.begin(), beam_hyp.beams_.begin() + beam_hyp.beams_used_);
+  }
+  std::stable_sort(hypotheses.begin(), hypotheses.end(), [](const HypothesisScore& a, const HypothesisScore& b) { return a.score > b.score; });
+  return hypotheses[index].hypothesis;
+}
+
 void BeamSearchScorer::Process(Sequences& sequences,
                                std::span<const float> next_scores,
                                std::span<const int32_t> next_tokens,
-                               std::span<const int32_t> next_indices) {
+                               std::span<const int32_t> next_indices,
+                               int group) {
   // Sequences shape is (batch_size * num_beams, total_sequence_length)
   // It contains word ID of whole sequence generated so far.
   // It is different from subgraph input_ids, which only need one word when past state is not empty.
@@ -93,7 +108,9 @@ void BeamSearchScorer::Process(Sequences& sequences,
   assert(next_scores.size() == next_tokens.size());
   assert(next_scores.size() == next_indices.size());
 
-  for (size_t batch = 0; batch < batch_size_; batch++) {
+  const size_t first_batch = group < 0 ? 0 : group;
+  const size_t batch_step = group < 0 ? 1 : num_beam_groups_;
+  for (size_t batch = first_batch; batch < batch_size_; batch += batch_step) {
     BeamHypotheses& beam_hyp = beam_hyps_[batch];
     if (beam_hyp.done_) {
       assert(beam_hyp.beams_used_ == num_beams_);  // Batch can only be done if all beams have been generated
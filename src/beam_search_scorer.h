@@ -30,13 +30,18 @@ struct BeamHypotheses {
   bool done_;
 };
 
+// With search.num_beam_groups, each group of a batch entry's beams is scored as if it were a batch entry of its own, with
+// its own hypotheses, so the scorer's batch is batch_size * num_beam_groups entries of num_beams / num_beam_groups beams
 struct BeamSearchScorer {
   BeamSearchScorer(const GeneratorParams& parameters);
 
+  // The next_* arrays have 2 * num_beams / num_beam_groups candidates per group. With a group, only the beams of that
+  // group are processed, as diverse beam search picks the groups one after another
   void Process(Sequences& sequences,
                std::span<const float> next_scores,
                std::span<const int32_t> next_tokens,
-               std::span<const int32_t> next_indices);
+               std::span<const int32_t> next_indices,
+               int group = -1);
 
   void Finalize(Sequences& sequences,
                 size_t num_return_sequences);
@@ -46,11 +51,13 @@ struct BeamSearchScorer {
   cpu_span<float> GetNextScores() { return next_beam_scores_; }
   cpu_span<int32_t> GetNextTokens() { return next_beam_tokens_; }
   cpu_span<int32_t> GetNextIndicesCPU() { return next_beam_indices_; }
-  BeamHypotheses GetBeamHypotheses(size_t batch_id) { return beam_hyps_[batch_id]; }
+  // The index-th best hypothesis of the batch entry, of all of its beam groups
+  RoamingArray<int32_t> GetHypothesis(size_t batch_id, size_t index) const;
 
  private:
-  int batch_size_;
-  int num_beams_;
+  int num_beam_groups_;
+  int batch_size_;  // Of the groups, batch_size * num_beam_groups
+  int num_beams_;   // Of each group
   int max_length_;
   int pad_token_id_;
   int eos_token_id_;
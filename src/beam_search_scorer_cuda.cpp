@@ -31,8 +31,6 @@ BeamSearchScorer_Cuda::BeamSearchScorer_Cuda(const GeneratorParams& parameters)
   next_beam_scores_ptr_ = CudaMallocArray<float>(batch_beam_size, &next_beam_scores_);
   next_beam_tokens_ptr_ = CudaMallocArray<int32_t>(batch_beam_size, &next_beam_tokens_);
   next_beam_indices_ptr_ = CudaMallocArray<int32_t>(batch_beam_size, &next_beam_indices_);
-  next_beam_indices_cpu_ptr_ = std::make_unique<int32_t[]>(batch_beam_size);
-  next_beam_indices_cpu_ = cpu_span<int32_t>(next_beam_indices_cpu_ptr_.get(), batch_beam_size);
 
   cuda::LaunchInitScoresKernel(next_beam_scores_.data(), parameters.batch_size, parameters.search.num_beams, stream_);
 
@@ -70,7 +68,13 @@ void BeamSearchScorer_Cuda::Process(Sequences_Cuda& sequences,
                                                           stream_);
 }
 
-bool BeamSearchScorer_Cuda::IsDoneLater() const {
+bool BeamSearchScorer_Cuda::IsDoneLater(bool wait) const {
+  if (state_cpu_->not_done_count_ == 0)
+    return true;
+  if (!wait)
+    return false;
+
+  TraceSpan span{"cudaEventSynchronize"};
   cudaEventSynchronize(event_process_complete_);
   return state_cpu_->not_done_count_ == 0;
 }
@@ -87,7 +91,7 @@ RoamingArray<int32_t> BeamSearchScorer_Cuda::GetBeamHypothesis(size_t batch_id,
   cuda::LaunchBeamSearchScorer_GetHypothesisPtr(batch_id, beam_id, beam_hyps_, hypothesis_ptr.get(), hypothesis_length.get(), hypothesis_score.get(), stream_);
   CudaCheck() == cudaStreamSynchronize(stream_);
   std::span<int32_t> hypothesis_span(*hypothesis_ptr.get(), *hypothesis_length.get());
-  return gpu_span<int32_t>{hypothesis_span.data(), hypothesis_span.size()};
+  return {gpu_span<int32_t>{hypothesis_span.data(), hypothesis_span.size()}, stream_};
 }
 
 }  // namespace Generators
@@ -1,4 +1,4 @@
-#include <cuda_runtime.h>
+#include "cuda_hip.h"
 #include <assert.h>
 #include <algorithm>
 #include "span.h"
@@ -12,15 +12,13 @@ struct BeamSearchScorer_Cuda {
                 size_t num_return_sequences);
 
   bool IsDone() const { return false; }  // For CUDA we speculatively run the next step while we wait for the GPU to report status. We use 'IsDoneLater()' for this
-  bool IsDoneLater() const;
+
+  // The process kernel writes the done count straight to pinned host memory, so without waiting for the last Process() the
+  // result is only late: a false can be a step behind, but a true is final
+  bool IsDoneLater(bool wait) const;
 
   gpu_span<float> GetNextScores() { return next_beam_scores_; }
   gpu_span<int32_t> GetNextTokens() { return next_beam_tokens_; }
-  cpu_span<int32_t> GetNextIndicesCPU() {
-    cudaMemcpyAsync(next_beam_indices_cpu_.data(), next_beam_indices_.data(), next_beam_indices_.size_bytes(), cudaMemcpyDeviceToHost, stream_);
-    cudaStreamSynchronize(stream_);
-    return next_beam_indices_cpu_;
-  }
   gpu_span<int32_t> GetNextIndicesGPU() { return next_beam_indices_; }
   RoamingArray<int32_t> GetBeamHypothesis(size_t batch_id, size_t beam_id) const;
 
@@ -39,9 +37,6 @@ struct BeamSearchScorer_Cuda {
   cuda_unique_ptr<int32_t> next_beam_indices_ptr_;
   gpu_span<int32_t> next_beam_indices_;
 
-  std::unique_ptr<int32_t[]> next_beam_indices_cpu_ptr_;
-  cpu_span<int32_t> next_beam_indices_cpu_;
-
   cuda_unique_ptr<int32_t> hypothesis_buffer_ptr_;  // Allocated buffer to hold all hypotheses
   gpu_span<int32_t> hypothesis_buffer_;             // Span of the allocated buffer
   size_t hypothesis_buffer_used_{};                 // Offset of available buffer, or length of used buffer.
@@ -1,5 +1,4 @@
-#include <cuda_runtime.h>
-#include <cub/cub.cuh>
+#include "cuda_hip.cuh"
 #include <limits>
 #include "beam_search_topk.h"
 
@@ -157,9 +156,11 @@ void TopKLauncherMaxK(
 
   dim3 grid(batch_beam_size, voc_parts);
 
+#if !USE_ROCM
   cudaFuncSetAttribute(BeamSearchOnlineTopKStage1Kernel<T, max_k, kThreadBlockSize>,
                        cudaFuncAttributePreferredSharedMemoryCarveout,
                        cudaSharedmemCarveoutMaxL1);
+#endif
 
   BeamSearchOnlineTopKStage1Kernel<T, max_k, kThreadBlockSize>
       <<<grid, kThreadBlockSize, 0, stream>>>(input, K, vocab_size, (vocab_size + voc_parts - 1) / voc_parts, output_values_tmp, output_indices_tmp);
@@ -0,0 +1,79 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "cascade.h"
+#include "search.h"
+#include "models/model.h"
+
+namespace Generators {
+
+namespace {
+
+std::shared_ptr<GeneratorParams> CreateCascadeParams(const Model& model, const GeneratorParams& params, std::span<const int32_t> input_ids) {
+  auto cascade_params = CreateGeneratorParams(model);
+  cascade_params->search = params.search;
+  cascade_params->batch_size = 1;
+  cascade_params->sequence_length = static_cast<int>(input_ids.size());
+  cascade_params->input_ids_owner.assign(input_ids.begin(), input_ids.end());
+  cascade_params->input_ids = cascade_params->input_ids_owner;
+  return cascade_params;
+}
+
+}  // namespace
+
+CascadeGenerator::CascadeGenerator(const Model& small_model, const Model& large_model, const GeneratorParams& params, float min_logprob, int window)
+    : large_model_{large_model},
+      large_params_{CreateCascadeParams(large_model, params, params.input_ids)},
+      min_logprob_{min_logprob},
+      window_size_{static_cast<size_t>(window)} {
+  if (window < 1)
+    throw std::runtime_error("window must be 1 or greater, is " + std::to_string(window));
+  if (small_model.config_->model.vocab_size != large_model.config_->model.vocab_size)
+    throw std::runtime_error("The small model's vocab_size (" + std::to_string(small_model.config_->model.vocab_size) + ") must match the large model's (" + std::to_string(large_model.config_->model.vocab_size) + ")");
+  // The large model continues where the small one stopped, which only one unpadded sequence can do
+  if (params.batch_size != 1 || params.search.num_beams != 1)
+    throw std::runtime_error("Cascade routing only supports a batch_size and num_beams of 1");
+  if (std::find(params.input_ids.begin(), params.input_ids.end(), params.pad_token_id) != params.input_ids.end())
+    throw std::runtime_error("Cascade routing doesn't support padded input_ids");
+
+  small_params_ = CreateCascadeParams(small_model, params, params.input_ids);
+  small_params_->search.logprobs = true;
+  small_ = CreateGenerator(small_model, *small_params_);
+}
+
+void CascadeGenerator::GenerateNextToken() {
+  if (large_) {
+    large_->ComputeLogits();
+    large_->GenerateNextToken();
+    return;
+  }
+
+  small_->ComputeLogits();
+  small_->GenerateNextToken();
+
+  float logprob;
+  small_->search_->GetLogProbs({&logprob, 1}, {}, {});
+  window_.push_back(logprob);
+  window_sum_ += logprob;
+  if (window_.size() > window_size_) {
+    window_sum_ -= window_.front();
+    window_.pop_front();
+  }
+
+  if (window_sum_ / window_.size() < min_logprob_)
+    Escalate();
+}
+
+void CascadeGenerator::Escalate() {
+  auto sequence = small_->GetSequence(0).GetCPU();
+  escalation_length_ = sequence.size() - 1;  // Without the unsure pick, the large model makes its own
+
+  large_params_->sequence_length = static_cast<int>(escalation_length_);
+  large_params_->input_ids_owner.assign(sequence.begin(), sequence.begin() + escalation_length_);
+  large_params_->input_ids = large_params_->input_ids_owner;
+  small_.reset();  // Its kv caches aren't needed anymore
+  large_ = CreateGenerator(large_model_, *large_params_);
+}
+
+}  // namespace Generators
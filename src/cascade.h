@@ -0,0 +1,45 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <deque>
+
+namespace Generators {
+
+// Cascade routing of a single sequence. Generation starts on a small model with search.logprobs on, and moves to the
+// large model for good once the small one turns unsure: when the mean log probability of its last 'window' picks drops
+// below min_logprob. The pick that tipped the mean is dropped, and the large model is prefilled with the prompt and the
+// rest of the small model's tokens, as the kv caches of different models can't be carried across. So easy sequences
+// only run on the small model, and hard ones cost a prefill on top of the large model's generation.
+struct CascadeGenerator {
+  // params are those of the large model, the small one's search options & prompt are copied from them
+  CascadeGenerator(const Model& small_model, const Model& large_model, const GeneratorParams& params, float min_logprob, int window);
+
+  bool IsDone() const { return GetGenerator().IsDone(); }
+
+  // ComputeLogits() & GenerateNextToken() on the model the sequence is on, moving it to the large model when the small
+  // one gets unsure
+  void GenerateNextToken();
+
+  RoamingArray<int32_t> GetSequence() const { return GetGenerator().GetSequence(0); }
+
+  bool IsEscalated() const { return large_ != nullptr; }
+  size_t GetEscalationLength() const { return escalation_length_; }  // The sequence length the large model was prefilled with, 0 if not escalated
+
+ private:
+  const Generator& GetGenerator() const { return large_ ? *large_ : *small_; }
+  void Escalate();
+
+  const Model& large_model_;
+  std::shared_ptr<GeneratorParams> large_params_;
+  std::shared_ptr<GeneratorParams> small_params_;
+  std::unique_ptr<Generator> small_;  // Released once escalated
+  std::unique_ptr<Generator> large_;  // Created once escalated
+
+  float min_logprob_;
+  size_t window_size_;
+  std::deque<float> window_;  // Log probabilities of the small model's last picks
+  float window_sum_{};
+  size_t escalation_length_{};
+};
+
+}  // namespace Generators
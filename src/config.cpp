@@ -64,6 +64,10 @@ struct SessionOptions_Element : JSON::Element {
       v_.log_id = value;
     else if (name == "enable_profiling")
       v_.enable_profiling = value;
+    else if (name == "optimized_model_cache_dir")
+      v_.optimized_model_cache_dir = value;
+    else if (name == "intra_op_thread_affinities")
+      v_.intra_op_thread_affinities = value;
     else
       throw JSON::unknown_value_error{};
   }
@@ -75,6 +79,8 @@ struct SessionOptions_Element : JSON::Element {
       v_.inter_op_num_threads = static_cast<int>(value);
     else if (name == "log_severity_level")
       v_.log_severity_level = static_cast<int>(value);
+    else if (name == "numa_node")
+      v_.numa_node = static_cast<int>(value);
     else
       throw JSON::unknown_value_error{};
   }
@@ -84,6 +90,10 @@ struct SessionOptions_Element : JSON::Element {
       v_.enable_cpu_mem_arena = value;
     else if (name == "enable_mem_pattern")
       v_.enable_mem_pattern = value;
+    else if (name == "use_memory_map")
+      v_.use_memory_map = value;
+    else if (name == "cache_prepacked_weights")
+      v_.cache_prepacked_weights = value;
     else
       throw JSON::unknown_value_error{};
   }
@@ -135,10 +145,18 @@ struct Inputs_Element : JSON::Element {
       v_.past_value_names = value;
     } else if (name == "past_names") {
       v_.past_names = value;
+    } else if (name == "past_sequence_length") {
+      v_.past_sequence_length = value;
     } else if (name == "cross_past_key_names") {
       v_.cross_past_key_names = value;
     } else if (name == "cross_past_value_names") {
       v_.cross_past_value_names = value;
+    } else if (name == "past_key_scale_names") {
+      v_.past_key_scale_names = value;
+    } else if (name == "past_value_scale_names") {
+      v_.past_value_scale_names = value;
+    } else if (name == "adapter_ids") {
+      v_.adapter_ids = value;
     } else
       throw JSON::unknown_value_error{};
   }
@@ -163,6 +181,14 @@ struct Outputs_Element : JSON::Element {
       v_.cross_present_key_names = value;
     } else if (name == "cross_present_value_names") {
       v_.cross_present_value_names = value;
+    } else if (name == "present_key_scale_names") {
+      v_.present_key_scale_names = value;
+    } else if (name == "present_value_scale_names") {
+      v_.present_value_scale_names = value;
+    } else if (name == "hidden_states") {
+      v_.hidden_states = value;
+    } else if (name == "draft_logits_names") {
+      v_.draft_logits_names = value;
     } else
       throw JSON::unknown_value_error{};
   }
@@ -171,6 +197,103 @@ struct Outputs_Element : JSON::Element {
   Config::Model::Decoder::Outputs& v_;
 };
 
+struct PrefixCache_Element : JSON::Element {
+  explicit PrefixCache_Element(Config::Model::Decoder::PrefixCache& v) : v_{v} {}
+
+  void OnNumber(std::string_view name, double value) override {
+    if (name == "block_size") {
+      v_.block_size = static_cast<int>(value);
+    } else if (name == "max_entries") {
+      v_.max_entries = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  Config::Model::Decoder::PrefixCache& v_;
+};
+
+struct Adapters_Element : JSON::Element {
+  explicit Adapters_Element(Config::Model::Decoder::Adapters& v) : v_{v} {}
+
+  void OnString(std::string_view name, std::string_view value) override {
+    if (name == "weight_prefix") {
+      v_.weight_prefix = value;
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  void OnNumber(std::string_view name, double value) override {
+    if (name == "max_adapters") {
+      v_.max_adapters = static_cast<int>(value);
+    } else if (name == "max_rank") {
+      v_.max_rank = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  Config::Model::Decoder::Adapters& v_;
+};
+
+// The buckets of graph_capture_batch_sizes or graph_capture_prompt_lengths
+struct GraphCaptureBuckets_Element : JSON::Element {
+  explicit GraphCaptureBuckets_Element(std::vector<int>& v, const char* name) : v_{v}, name_{name} {}
+
+  void OnNumber(std::string_view name, double value) override {
+    if (value < 1)
+      throw std::runtime_error(std::string{name_} + " must all be 1 or greater");
+    v_.push_back(static_cast<int>(value));
+  }
+
+  void OnComplete(bool empty) override {
+    std::sort(v_.begin(), v_.end());
+    v_.erase(std::unique(v_.begin(), v_.end()), v_.end());
+  }
+
+ private:
+  std::vector<int>& v_;
+  const char* name_;
+};
+
+struct PipelineStage_Element : JSON::Element {
+  explicit PipelineStage_Element(Config::Model::Decoder::PipelineStage& v) : v_{v} {}
+
+  void OnString(std::string_view name, std::string_view value) override {
+    if (name == "filename") {
+      v_.filename = value;
+    } else if (name == "offloaded_weights") {
+      v_.offloaded_weights = value;
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  void OnNumber(std::string_view name, double value) override {
+    if (name == "num_hidden_layers") {
+      v_.num_hidden_layers = static_cast<int>(value);
+    } else if (name == "device_id") {
+      v_.device_id = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+ private:
+  Config::Model::Decoder::PipelineStage& v_;
+};
+
+struct Pipeline_Element : JSON::Element {
+  explicit Pipeline_Element(std::vector<Config::Model::Decoder::PipelineStage>& v) : v_{v} {}
+
+  JSON::Element& OnObject(std::string_view name) override {
+    stage_element_ = std::make_unique<PipelineStage_Element>(v_.emplace_back());
+    return *stage_element_;
+  }
+
+ private:
+  std::vector<Config::Model::Decoder::PipelineStage>& v_;
+  std::unique_ptr<PipelineStage_Element> stage_element_;
+};
+
 struct Decoder_Element : JSON::Element {
   explicit Decoder_Element(Config::Model::Decoder& v) : v_{v} {}
 
@@ -192,6 +315,23 @@ struct Decoder_Element : JSON::Element {
       v_.num_hidden_layers = static_cast<int>(value);
     } else if (name == "head_size") {
       v_.head_size = static_cast<int>(value);
+    } else if (name == "tensor_parallel_size") {
+      v_.tensor_parallel_size = static_cast<int>(value);
+    } else if (name == "pipeline_micro_batches") {
+      v_.pipeline_micro_batches = static_cast<int>(value);
+    } else if (name == "draft_heads") {
+      v_.draft_heads = static_cast<int>(value);
+    } else if (name == "static_window_size") {
+      v_.static_window_size = static_cast<int>(value);
+    } else if (name == "graph_capture_pool_budget_mb") {
+      v_.graph_capture_pool_budget_mb = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
+  void OnBool(std::string_view name, bool value) override {
+    if (name == "last_token_logits") {
+      v_.last_token_logits = value;
     } else
       throw JSON::unknown_value_error{};
   }
@@ -206,6 +346,25 @@ struct Decoder_Element : JSON::Element {
     if (name == "outputs") {
       return outputs_;
     }
+    if (name == "prefix_cache") {
+      return prefix_cache_;
+    }
+    if (name == "adapters") {
+      return adapters_;
+    }
+    throw JSON::unknown_value_error{};
+  }
+
+  Element& OnArray(std::string_view name) override {
+    if (name == "graph_capture_batch_sizes") {
+      return graph_capture_batch_sizes_;
+    }
+    if (name == "graph_capture_prompt_lengths") {
+      return graph_capture_prompt_lengths_;
+    }
+    if (name == "pipeline") {
+      return pipeline_;
+    }
     throw JSON::unknown_value_error{};
   }
 
@@ -214,6 +373,11 @@ struct Decoder_Element : JSON::Element {
   SessionOptions_Element session_options_{v_.session_options};
   Inputs_Element inputs_{v_.inputs};
   Outputs_Element outputs_{v_.outputs};
+  PrefixCache_Element prefix_cache_{v_.prefix_cache};
+  Adapters_Element adapters_{v_.adapters};
+  GraphCaptureBuckets_Element graph_capture_batch_sizes_{v_.graph_capture_batch_sizes, "graph_capture_batch_sizes"};
+  GraphCaptureBuckets_Element graph_capture_prompt_lengths_{v_.graph_capture_prompt_lengths, "graph_capture_prompt_lengths"};
+  Pipeline_Element pipeline_{v_.pipeline};
 };
 
 struct VisionInputs_Element : JSON::Element {
@@ -256,6 +420,13 @@ struct Vision_Element : JSON::Element {
       throw JSON::unknown_value_error{};
   }
 
+  void OnNumber(std::string_view name, double value) override {
+    if (name == "feature_cache_entries") {
+      v_.feature_cache_entries = static_cast<int>(value);
+    } else
+      throw JSON::unknown_value_error{};
+  }
+
   Element& OnObject(std::string_view name) override {
     if (name == "inputs") {
       return inputs_;
@@ -294,6 +465,17 @@ struct Eos_Array_Element : JSON::Element {
   Config::Model& v_;
 };
 
+struct Int32_Array_Element : JSON::Element {
+  explicit Int32_Array_Element(std::vector<int32_t>& v) : v_{v} {}
+
+  void OnNumber(std::string_view /*name*/, double value) override {
+    v_.push_back(static_cast<int32_t>(value));
+  }
+
+ private:
+  std::vector<int32_t>& v_;
+};
+
 struct EmbeddingInputs_Element : JSON::Element {
   explicit EmbeddingInputs_Element(Config::Model::Embedding::Inputs& v) : v_{v} {}
 
@@ -362,6 +544,10 @@ struct Model_Element : JSON::Element {
       v_.vocab_size = static_cast<int>(value);
     } else if (name == "context_length") {
       v_.context_length = static_cast<int>(value);
+    } else if (name == "device_memory_budget_mb") {
+      v_.device_memory_budget_mb = static_cast<int>(value);
+    } else if (name == "tokenizer_cache_size") {
+      v_.tokenizer_cache_size = static_cast<int>(value);
     } else if (name == "pad_token_id") {
       v_.pad_token_id = static_cast<int>(value);
     } else if (name == "eos_token_id") {
@@ -379,6 +565,8 @@ struct Model_Element : JSON::Element {
   Element& OnArray(std::string_view name) override {
     if (name == "eos_token_id")
       return eos_token_ids_;
+    if (name == "logits_token_ids")
+      return logits_token_ids_;
     throw JSON::unknown_value_error{};
   }
 
@@ -403,6 +591,7 @@ struct Model_Element : JSON::Element {
   EncoderDecoderInit_Element encoder_decoder_init_{v_.encoder_decoder_init};
   Decoder_Element decoder_{v_.decoder};
   Eos_Array_Element eos_token_ids_{v_};
+  Int32_Array_Element logits_token_ids_{v_.logits_token_ids};
   Vision_Element vision_{v_.vision};
   Embedding_Element embedding_{v_.embedding};
 };
@@ -431,16 +620,34 @@ struct Search_Element : JSON::Element {
       v_.temperature = static_cast<float>(value);
     } else if (name == "repetition_penalty") {
       v_.repetition_penalty = static_cast<float>(value);
+    } else if (name == "presence_penalty") {
+      v_.presence_penalty = static_cast<float>(value);
+    } else if (name == "frequency_penalty") {
+      v_.frequency_penalty = static_cast<float>(value);
     } else if (name == "length_penalty") {
       v_.length_penalty = static_cast<float>(value);
     } else if (name == "no_repeat_ngram_size") {
       v_.no_repeat_ngram_size = static_cast<int>(value);
+    } else if (name == "num_beam_groups") {
+      v_.num_beam_groups = static_cast<int>(value);
     } else if (name == "diversity_penalty") {
       v_.diversity_penalty = static_cast<float>(value);
     } else if (name == "length_penalty") {
       v_.length_penalty = static_cast<float>(value);
     } else if (name == "random_seed") {
       v_.random_seed = static_cast<int>(value);
+    } else if (name == "kv_block_size") {
+      v_.kv_block_size = static_cast<int>(value);
+    } else if (name == "prefill_chunk_size") {
+      v_.prefill_chunk_size = static_cast<int>(value);
+    } else if (name == "kv_window_size") {
+      v_.kv_window_size = static_cast<int>(value);
+    } else if (name == "kv_sink_tokens") {
+      v_.kv_sink_tokens = static_cast<int>(value);
+    } else if (name == "done_check_interval") {
+      v_.done_check_interval = static_cast<int>(value);
+    } else if (name == "top_logprobs") {
+      v_.top_logprobs = static_cast<int>(value);
     } else
       throw JSON::unknown_value_error{};
   }
@@ -452,6 +659,14 @@ struct Search_Element : JSON::Element {
       v_.past_present_share_buffer = value;
     } else if (name == "early_stopping") {
       v_.early_stopping = value;
+    } else if (name == "unpadded_prefill") {
+      v_.unpadded_prefill = value;
+    } else if (name == "compact_finished_rows") {
+      v_.compact_finished_rows = value;
+    } else if (name == "pad_to_prompt_graph") {
+      v_.pad_to_prompt_graph = value;
+    } else if (name == "logprobs") {
+      v_.logprobs = value;
     } else
       throw JSON::unknown_value_error{};
   }
@@ -549,6 +764,19 @@ Config::Config(const fs::path& path) : config_path{path} {
 
   if (search.max_length == 0)
     search.max_length = model.context_length;
+
+  if (!model.logits_token_ids.empty()) {
+    const auto& rows = model.logits_token_ids;
+    const auto row_of = [&](int token) { return static_cast<int>(std::find(rows.begin(), rows.end(), token) - rows.begin()); };
+    if (row_of(model.eos_token_id) == static_cast<int>(rows.size()))
+      throw std::runtime_error("model logits_token_ids must include eos_token_id (" + std::to_string(model.eos_token_id) + ")");
+    model.logits_eos_rows.push_back(row_of(model.eos_token_id));
+    for (int token : model.eos_token_ids) {
+      const int row = row_of(token);
+      if (token != model.eos_token_id && row != static_cast<int>(rows.size()))
+        model.logits_eos_rows.push_back(row);
+    }
+  }
 }
 
 void Config::AddMapping(const std::string& nominal_name, const std::string& graph_name) {
@@ -569,4 +797,11 @@ std::pair<std::string, bool> Config::GetGraphName(const std::string& nominal_nam
   return {it->second, true};
 }
 
+std::string FormatIndexedName(std::string_view pattern, int index) {
+  std::string name{pattern};
+  if (auto position = name.find("%d"); position != std::string::npos)
+    name.replace(position, 2, std::to_string(index));
+  return name;
+}
+
 }  // namespace Generators
@@ -30,6 +30,15 @@ struct Config {
     std::optional<std::string> log_id;
     std::optional<int> log_severity_level;
     std::optional<std::string> enable_profiling;
+    bool use_memory_map{};  // Map the model files into memory instead of reading them, so they load faster & are shared through the page cache
+    std::optional<std::string> optimized_model_cache_dir;  // Where the graph optimized models are saved on first load, so later loads skip optimizing them
+    // With optimized_model_cache_dir, the CPU kernels' prepacked weights (like MatMulNBits') are saved in the cached model's
+    // data file too, so later loads on CPUs with the same instruction set map them instead of prepacking them again
+    bool cache_prepacked_weights{};
+    std::optional<std::string> intra_op_thread_affinities;  // ORT's session.intra_op_thread_affinities, like "1;2;3", 1 based CPUs of each intra op thread after the first
+    // If set, the model is an instance for this NUMA node (Linux only): the intra op threads & the CPU search's threads are
+    // pinned to its CPUs and the weights are allocated on its memory, so one instance per socket runs at full bandwidth
+    std::optional<int> numa_node;
 
     std::vector<ProviderOptions> provider_options;
   };
@@ -46,6 +55,13 @@ struct Config {
     int vocab_size{};
     int context_length{};
 
+    // When the decoder's lm_head was built for only some tokens (builder.py allowed_token_ids), the token of each logits
+    // row. The search then picks among the rows and maps its picks to these, see GeneratorParams::logits_token_ids
+    std::vector<int32_t> logits_token_ids;
+    std::vector<int> logits_eos_rows;  // Set from logits_token_ids, the rows of the eos tokens, eos_token_id's first
+    int device_memory_budget_mb{};  // If > 0, the kv caches, graph capture buffers & cached prefixes of all generators are kept within this many MiB, see DeviceMemoryBudget
+    int tokenizer_cache_size{};     // If > 0, Tokenizer::Encode keeps the tokens of this many recently encoded strings, like repeated system prompts
+
     // For models like whisper
     struct EncoderDecoderInit {
       std::string filename;
@@ -74,6 +90,8 @@ struct Config {
       struct Outputs {
         std::string visual_features{"visual_features"};
       } outputs;
+
+      int feature_cache_entries{};  // If > 0, the visual features of this many recently seen images are kept, so repeated images skip the vision model
     } vision;
 
     struct Decoder {
@@ -85,6 +103,18 @@ struct Config {
       int num_key_value_heads{};
       int num_hidden_layers{};
       int head_size{};
+      bool last_token_logits{};  // The logits output only holds the last token of each sequence, as in {batch_size, 1, vocab_size}
+      int tensor_parallel_size{1};  // If > 1, the decoder is sharded over this many GPUs with a process per rank, and filename has a %d for the rank
+      int draft_heads{};            // Medusa style heads with outputs.draft_logits_names, head i guessing the token i + 2 places after each one
+      std::vector<int> graph_capture_batch_sizes;  // Sorted batch size buckets that share captured graphs, picked without TryGraphCapture
+      // If > 0, every input & output of the decoder has a fixed shape, for NPU execution providers that compile static
+      // graphs. Prompts run in windows of this many tokens and generation in windows of one, with pasts and attention masks
+      // sized to model.context_length. See DecoderOnly_WindowedState
+      int static_window_size{};
+      int graph_capture_pool_budget_mb{};  // If > 0, idle captured graphs are evicted, least recently used first, while their static buffers take more MiB
+      // Sorted prompt length buckets with captured prefill graphs on CUDA. With search.pad_to_prompt_graph, prompts up to the
+      // largest are left padded to their bucket, so the prompt run replays a graph instead of launching every kernel
+      std::vector<int> graph_capture_prompt_lengths;
 
       struct Inputs {
         std::string input_ids{Defaults::InputIdsName};
@@ -95,7 +125,10 @@ struct Config {
         std::string total_sequence_length{"total_seq_len"};
         std::string past_key_names{"past_key_values.%d.key"}, past_value_names{"past_key_values.%d.value"};
         std::string past_names;  // When key/value pairs are combined
+        std::string past_sequence_length{"past_sequence_length"};  // int32 [1] on the CPU, the valid past entries of shared kv caches. Not with graph capture
         std::string cross_past_key_names, cross_past_value_names;
+        std::string past_key_scale_names, past_value_scale_names;  // Per head scales of int8 kv caches
+        std::string adapter_ids{"lora_adapter_ids"};                // int32 [batch_size] adapter slot of each sequence, see Adapters
       } inputs;
 
       struct Outputs {
@@ -103,8 +136,31 @@ struct Config {
         std::string present_key_names{"present.%d.key"}, present_value_names{"present.%d.value"};
         std::string present_names;  // When key/value pairs are combined
         std::string cross_present_key_names, cross_present_value_names;
+        std::string present_key_scale_names, present_value_scale_names;  // Per head scales of int8 kv caches
+        std::string hidden_states{"hidden_states"};                      // Of every pipeline stage before the last, the next stage's inputs.embeddings
+        std::string draft_logits_names{"draft_logits.%d"};              // Of each of the draft_heads, shaped like the logits
       } outputs;
 
+      struct PrefixCache {
+        int block_size{};     // If > 0, prompt kv caches are kept in multiples of this many tokens so prompts sharing a prefix only prefill the rest
+        int max_entries{16};  // Least recently used prefixes are dropped beyond this count
+      } prefix_cache;
+
+      struct Adapters {
+        int max_adapters{};                  // If > 0, the decoder's stacked LoRA weight inputs have max_adapters + 1 slots, see Adapters
+        int max_rank{};                      // The size the dynamic (rank) dimensions of the stacked weights are allocated to
+        std::string weight_prefix{"lora."};  // The decoder inputs starting with this are the stacked LoRA weights
+      } adapters;
+
+      struct PipelineStage {
+        std::string filename;
+        int num_hidden_layers{};  // Of this stage, whose kv cache inputs & outputs are numbered from 0
+        int device_id{};
+        std::string offloaded_weights;  // If set, a safetensors file of weights the stage takes as inputs, streamed onto its device before it runs, see WeightStream
+      };
+      std::vector<PipelineStage> pipeline;  // If set, the decoder is split layer wise into these stages, see DecoderPipeline_Model
+      int pipeline_micro_batches{1};        // The batch is split into this many, so the stages can work on different ones at once
+
     } decoder;
   } model;
 
@@ -115,15 +171,28 @@ struct Config {
     int num_beams{1};  // 1 means no beam search.
     int num_return_sequences{1};
     float repetition_penalty{1.0f};  // 1.0 means no penalty.
+    float presence_penalty{};        // Subtracted from the scores of the tokens generated so far, once each (OpenAI's presence_penalty)
+    float frequency_penalty{};       // Subtracted from the scores of the tokens generated so far, once per time it was generated
     int top_k{};                     // Number of highest probability vocabulary tokens to keep for top-k-filtering that will be used by default in the generate method of the model.
     float top_p{};                   // If set to float >0 and <1, only the most probable tokens with probabilities that add up to top_p or higher are kept for generation.
     float temperature{1.0f};
     bool early_stopping{true};  //  Whether to stop the beam search when at least num_beams sentences are finished per batch or not.
-    int no_repeat_ngram_size{};
-    float diversity_penalty{};
+    int no_repeat_ngram_size{};        // If > 0, no n-gram of this many tokens can appear in a sequence twice
+    int num_beam_groups{1};            // If > 1, diverse beam search: the beams are split into this many groups that are penalized for picking the same tokens
+    float diversity_penalty{};         // With num_beam_groups, subtracted from the scores of the tokens the earlier groups picked for the same step
     float length_penalty{1.0f};        // Exponential penalty to the length that is used with beam-based generation. length_penalty > 0.0 promotes longer sequences, while length_penalty < 0.0 encourages shorter sequences.
     bool past_present_share_buffer{};  // The past/present kv tensors are shared and allocated once to max_length (cuda only)
-    int random_seed{-1};               // -1 = Seed with random device, otherwise use value to seed RNG
+    int kv_block_size{};               // If > 0, kv caches grow in blocks of this many tokens instead of being reallocated every step, or allocated to max_length when shared
+    int prefill_chunk_size{};          // If > 0, the prompt is run in chunks of at most this many tokens to bound the prompt's logits & kv memory
+    int kv_window_size{};              // If > 0, kv caches only keep the kv_sink_tokens leading tokens and the most recent kv_window_size after them
+    int kv_sink_tokens{4};             // With kv_window_size, how many of the leading (attention sink) tokens are always kept
+    int random_seed{-1};               // -1 = Seed with random device, otherwise use value to seed RNG. Can be set per batch entry, see GetRandomStreams
+    int done_check_interval{1};        // The cuda search only waits for the device's done status every this many steps (finished sequences get pad tokens in between)
+    bool unpadded_prefill{};           // Runs the prompt of each sequence of a batch on its own without its padding, then batches the kv caches for the generation
+    bool compact_finished_rows{};      // Greedy batches drop the sequences that have finished from the model runs, instead of running them on pad tokens
+    bool pad_to_prompt_graph{};        // Left pads prompts to their model.decoder.graph_capture_prompt_lengths bucket. The pad tokens are part of the sequence and count against max_length
+    bool logprobs{};                   // Greedy searches keep the log probability of each step's tokens, see Search::GetTokenLogProbs
+    int top_logprobs{};                // With logprobs, also keep this many (at most 20) of the most likely tokens of each step and their log probabilities
   } search;
 
   void AddMapping(const std::string& nominal_name, const std::string& graph_name);
@@ -138,4 +207,8 @@ void SetSearchNumber(Config::Search& search, std::string_view name, double value
 void SetSearchBool(Config::Search& search, std::string_view name, bool value);
 bool IsCudaGraphEnabled(Config::SessionOptions& session_options);
 
+// The name at index of a config pattern like "past_key_values.%d.key". Patterns come from the config, so the %d is
+// replaced here rather than the pattern being used as a printf format
+std::string FormatIndexedName(std::string_view pattern, int index);
+
 }  // namespace Generators
\ No newline at end of file
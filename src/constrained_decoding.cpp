@@ -0,0 +1,799 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "constrained_decoding.h"
+#include "json.h"
+#include "models/model.h"
+#include <bitset>
+#include <charconv>
+#include <map>
+
+namespace Generators {
+
+namespace {
+
+using ByteSet = std::bitset<256>;
+
+constexpr size_t c_max_nfa_states = 1 << 20;
+constexpr size_t c_max_dfa_states = 1 << 16;
+constexpr int c_max_repeat = 1000;
+
+struct RegexNode {
+  enum struct Kind { Set,
+                     Concat,
+                     Alternate,
+                     Repeat } kind;
+  ByteSet set;                      // Set: the bytes it matches
+  std::vector<RegexNode> children;  // Concat & Alternate, or the single repeated node
+  int min{}, max{};                 // Repeat, a max of -1 is unbounded
+};
+
+RegexNode MakeSet(const ByteSet& set) { return RegexNode{RegexNode::Kind::Set, set, {}}; }
+RegexNode MakeConcat() { return RegexNode{RegexNode::Kind::Concat, {}, {}}; }
+
+ByteSet MakeRange(unsigned char first, unsigned char last) {
+  ByteSet set;
+  for (int c = first; c <= last; c++)
+    set.set(c);
+  return set;
+}
+
+// Parses the common subset of regex syntax: literals, '.', [] classes with ranges & negation, groups (capturing or not),
+// '|', the '*', '+', '?' and {m,n} quantifiers, and the \d \w \s \D \W \S \n \r \t \f \v \xHH \uHHHH escapes. The whole
+// output has to match, so ^ & $ are ignored. Non ASCII characters outside of classes are matched as their UTF-8 bytes.
+struct RegexParser {
+  RegexParser(std::string_view pattern) : pattern_{pattern} {}
+
+  RegexNode Parse() {
+    Skip('^');
+    auto node = ParseAlternate();
+    if (pos_ != pattern_.size())
+      Error("unmatched ')'");
+    return node;
+  }
+
+ private:
+  [[noreturn]] void Error(const char* message) const {
+    throw std::runtime_error("Invalid regex at index " + std::to_string(pos_) + ": " + message);
+  }
+
+  bool AtEnd() const { return pos_ == pattern_.size(); }
+  unsigned char Peek() const { return static_cast<unsigned char>(pattern_[pos_]); }
+  unsigned char Next() {
+    if (AtEnd())
+      Error("unexpected end");
+    return static_cast<unsigned char>(pattern_[pos_++]);
+  }
+  bool Skip(char c) {
+    if (AtEnd() || pattern_[pos_] != c)
+      return false;
+    pos_++;
+    return true;
+  }
+
+  RegexNode ParseAlternate() {
+    RegexNode node{RegexNode::Kind::Alternate, {}, {}};
+    node.children.push_back(ParseConcat());
+    while (Skip('|'))
+      node.children.push_back(ParseConcat());
+    if (node.children.size() == 1)
+      return std::move(node.children.front());
+    return node;
+  }
+
+  RegexNode ParseConcat() {
+    auto node = MakeConcat();
+    while (!AtEnd() && Peek() != '|' && Peek() != ')') {
+      // A trailing $ only anchors the end
+      if (Peek() == '$' && pos_ + 1 == pattern_.size()) {
+        pos_++;
+        break;
+      }
+      node.children.push_back(ParseRepeat());
+    }
+    return node;
+  }
+
+  int ParseCount() {
+    int value = 0;
+    auto result = std::from_chars(pattern_.data() + pos_, pattern_.data() + pattern_.size(), value);
+    if (result.ec != std::errc{})
+      Error("expected a repeat count");
+    pos_ = result.ptr - pattern_.data();
+    if (value > c_max_repeat)
+      Error("repeat count is too large");
+    return value;
+  }
+
+  RegexNode ParseRepeat() {
+    auto node = ParseAtom();
+    while (!AtEnd()) {
+      int min, max;
+      if (Skip('*'))
+        min = 0, max = -1;
+      else if (Skip('+'))
+        min = 1, max = -1;
+      else if (Skip('?'))
+        min = 0, max = 1;
+      else if (Skip('{')) {
+        min = max = ParseCount();
+        if (Skip(','))
+          max = !AtEnd() && Peek() == '}' ? -1 : ParseCount();
+        if (!Skip('}'))
+          Error("expected '}'");
+        if (max != -1 && max < min)
+          Error("repeat max is less than its min");
+      } else
+        break;
+      Skip('?');  // Lazy quantifiers match the same strings
+
+      RegexNode repeat{RegexNode::Kind::Repeat, {}, {}, min, max};
+      repeat.children.push_back(std::move(node));
+      node = std::move(repeat);
+    }
+    return node;
+  }
+
+  RegexNode ParseAtom() {
+    const unsigned char c = Next();
+    switch (c) {
+      case '(': {
+        if (Skip('?') && !Skip(':'))
+          Error("only (?: groups are supported");
+        auto node = ParseAlternate();
+        if (!Skip(')'))
+          Error("expected ')'");
+        return node;
+      }
+      case '[':
+        return MakeSet(ParseClass());
+      case '.':
+        return MakeSet(~ByteSet{}.set('\n'));
+      case '\\':
+        return ParseEscape(false);
+      case '*':
+      case '+':
+      case '?':
+      case '{':
+        Error("nothing to repeat");
+      default:
+        return MakeSet(ByteSet{}.set(c));
+    }
+  }
+
+  // After a '\', inside a class only escapes of a single byte are allowed
+  RegexNode ParseEscape(bool in_class) {
+    const unsigned char c = Next();
+    switch (c) {
+      case 'd':
+        return MakeSet(MakeRange('0', '9'));
+      case 'D':
+        return MakeSet(~MakeRange('0', '9'));
+      case 'w':
+        return MakeSet(WordSet());
+      case 'W':
+        return MakeSet(~WordSet());
+      case 's':
+        return MakeSet(SpaceSet());
+      case 'S':
+        return MakeSet(~SpaceSet());
+      case 'n':
+        return MakeSet(ByteSet{}.set('\n'));
+      case 'r':
+        return MakeSet(ByteSet{}.set('\r'));
+      case 't':
+        return MakeSet(ByteSet{}.set('\t'));
+      case 'f':
+        return MakeSet(ByteSet{}.set('\f'));
+      case 'v':
+        return MakeSet(ByteSet{}.set('\v'));
+      case 'x':
+        return MakeSet(ByteSet{}.set(ParseHex(2)));
+      case 'u': {
+        const uint32_t code_point = ParseHex(4);
+        if (code_point < 0x80)
+          return MakeSet(ByteSet{}.set(code_point));
+        if (in_class)
+          Error("character classes only support ASCII");
+        auto node = MakeConcat();
+        for (unsigned char byte : EncodeUtf8(code_point))
+          node.children.push_back(MakeSet(ByteSet{}.set(byte)));
+        return node;
+      }
+      default:
+        if (std::isalnum(c))
+          Error("unsupported escape");
+        return MakeSet(ByteSet{}.set(c));
+    }
+  }
+
+  uint32_t ParseHex(int digits) {
+    uint32_t value = 0;
+    for (int i = 0; i < digits; i++) {
+      const unsigned char c = Next();
+      if (!std::isxdigit(c))
+        Error("expected a hex digit");
+      value = value * 16 + (std::isdigit(c) ? c - '0' : std::tolower(c) - 'a' + 10);
+    }
+    return value;
+  }
+
+  ByteSet ParseClass() {
+    const bool negate = Skip('^');
+    ByteSet set;
+    bool first = true;
+    while (first || !Skip(']')) {
+      first = false;
+      auto low = ParseClassByte();
+      if (low.count() == 1 && !AtEnd() && Peek() == '-' && pos_ + 1 < pattern_.size() && pattern_[pos_ + 1] != ']') {
+        pos_++;
+        auto high = ParseClassByte();
+        if (high.count() != 1)
+          Error("invalid class range");
+        const auto first_byte = FirstByte(low), last_byte = FirstByte(high);
+        if (last_byte < first_byte)
+          Error("class range is out of order");
+        set |= MakeRange(first_byte, last_byte);
+      } else
+        set |= low;
+    }
+    return negate ? ~set : set;
+  }
+
+  ByteSet ParseClassByte() {
+    const unsigned char c = Next();
+    if (c >= 0x80)
+      Error("character classes only support ASCII");
+    if (c == '\\')
+      return ParseEscape(true).set;
+    return ByteSet{}.set(c);
+  }
+
+  static unsigned char FirstByte(const ByteSet& set) {
+    for (int c = 0; c < 256; c++)
+      if (set[c])
+        return static_cast<unsigned char>(c);
+    return 0;
+  }
+
+  static ByteSet WordSet() { return MakeRange('a', 'z') | MakeRange('A', 'Z') | MakeRange('0', '9') | ByteSet{}.set('_'); }
+  static ByteSet SpaceSet() { return ByteSet{}.set(' ').set('\t').set('\n').set('\r').set('\f').set('\v'); }
+
+  static std::string EncodeUtf8(uint32_t code_point) {
+    std::string bytes;
+    if (code_point < 0x800) {
+      bytes += static_cast<char>(0xC0 | (code_point >> 6));
+    } else {
+      bytes += static_cast<char>(0xE0 | (code_point >> 12));
+      bytes += static_cast<char>(0x80 | ((code_point >> 6) & 0x3F));
+    }
+    bytes += static_cast<char>(0x80 | (code_point & 0x3F));
+    return bytes;
+  }
+
+  std::string_view pattern_;
+  size_t pos_{};
+};
+
+// Thompson NFA, where every state has epsilon moves and at most one byte set move
+struct Nfa {
+  struct State {
+    std::vector<int> epsilon;
+    ByteSet set;
+    int next{-1};
+  };
+
+  int Add() {
+    if (states_.size() == c_max_nfa_states)
+      throw std::runtime_error("The constraint's regex is too large");
+    states_.emplace_back();
+    return static_cast<int>(states_.size() - 1);
+  }
+
+  // Adds the states matching node after start, and returns the state they end in
+  int Build(const RegexNode& node, int start) {
+    switch (node.kind) {
+      case RegexNode::Kind::Set: {
+        const int from = Add(), to = Add();
+        states_[start].epsilon.push_back(from);
+        states_[from].set = node.set;
+        states_[from].next = to;
+        return to;
+      }
+      case RegexNode::Kind::Concat: {
+        int end = start;
+        for (auto& child : node.children)
+          end = Build(child, end);
+        return end;
+      }
+      case RegexNode::Kind::Alternate: {
+        const int end = Add();
+        for (auto& child : node.children) {
+          const int child_start = Add();
+          states_[start].epsilon.push_back(child_start);
+          const int child_end = Build(child, child_start);
+          states_[child_end].epsilon.push_back(end);
+        }
+        return end;
+      }
+      case RegexNode::Kind::Repeat: {
+        const auto& child = node.children.front();
+        int end = start;
+        for (int i = 0; i < node.min; i++)
+          end = Build(child, end);
+
+        if (node.max == -1) {
+          const int loop = Add();
+          states_[end].epsilon.push_back(loop);
+          const int child_end = Build(child, loop);
+          states_[child_end].epsilon.push_back(loop);
+          return loop;
+        }
+
+        // Every optional repetition can be skipped to the end
+        std::vector<int> exits;
+        for (int i = node.min; i < node.max; i++) {
+          exits.push_back(end);
+          end = Build(child, end);
+        }
+        for (int exit : exits)
+          states_[exit].epsilon.push_back(end);
+        return end;
+      }
+    }
+    return start;
+  }
+
+  // Adds every state reachable through epsilon moves, and sorts them so a set of states has a single representation
+  void Close(std::vector<int>& states) const {
+    std::vector<bool> seen(states_.size());
+    std::vector<int> stack = states;
+    states.clear();
+    while (!stack.empty()) {
+      const int state = stack.back();
+      stack.pop_back();
+      if (seen[state])
+        continue;
+      seen[state] = true;
+      states.push_back(state);
+      for (int next : states_[state].epsilon)
+        stack.push_back(next);
+    }
+    std::sort(states.begin(), states.end());
+  }
+
+  std::vector<State> states_;
+};
+
+// Minimal JSON document tree for the schema, built by the JSON parser's callbacks
+struct JsonValue {
+  enum struct Type { Null,
+                     Bool,
+                     Number,
+                     String,
+                     Array,
+                     Object } type{Type::Null};
+  bool boolean{};
+  double number{};
+  std::string string;
+  std::vector<std::pair<std::string, JsonValue>> members;  // Of an object, or the elements of an array with empty names
+
+  const JsonValue* Find(std::string_view name) const {
+    for (auto& member : members)
+      if (member.first == name)
+        return &member.second;
+    return nullptr;
+  }
+};
+
+struct JsonValueElement : JSON::Element {
+  JsonValueElement(JsonValue& value) : value_{value} {}
+
+  void OnString(std::string_view name, std::string_view value) override { Add(name, JsonValue::Type::String).string = value; }
+  void OnNumber(std::string_view name, double value) override { Add(name, JsonValue::Type::Number).number = value; }
+  void OnBool(std::string_view name, bool value) override { Add(name, JsonValue::Type::Bool).boolean = value; }
+  void OnNull(std::string_view name) override { Add(name, JsonValue::Type::Null); }
+  JSON::Element& OnArray(std::string_view name) override { return AddChild(name, JsonValue::Type::Array); }
+  JSON::Element& OnObject(std::string_view name) override { return AddChild(name, JsonValue::Type::Object); }
+
+ private:
+  JsonValue& Add(std::string_view name, JsonValue::Type type) {
+    auto& value = value_.members.emplace_back(std::string{name}, JsonValue{}).second;
+    value.type = type;
+    return value;
+  }
+
+  // The parser is done with a child before the next member is added, so it never sees its value move
+  JSON::Element& AddChild(std::string_view name, JsonValue::Type type) {
+    return *children_.emplace_back(std::make_unique<JsonValueElement>(Add(name, type)));
+  }
+
+  JsonValue& value_;
+  std::vector<std::unique_ptr<JsonValueElement>> children_;
+};
+
+constexpr std::string_view c_json_whitespace = "[ \\t\\n]*";
+constexpr std::string_view c_json_string_char = "([^\"\\\\\\x00-\\x1f]|\\\\[\"\\\\/bfnrt]|\\\\u[0-9a-fA-F]{4})";
+constexpr std::string_view c_json_integer = "-?(0|[1-9][0-9]*)";
+constexpr std::string_view c_json_number = "-?(0|[1-9][0-9]*)(\\.[0-9]+)?([eE][+-]?[0-9]+)?";
+constexpr int c_json_any_depth = 2;
+
+std::string EscapeRegex(std::string_view text) {
+  std::string escaped;
+  for (char c : text) {
+    if (std::strchr("\\.^$|?*+()[]{}", c) && c != '\0')
+      escaped += '\\';
+    escaped += c;
+  }
+  return escaped;
+}
+
+std::string EncodeJsonString(std::string_view text) {
+  std::string encoded = "\"";
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      encoded += '\\';
+      encoded += static_cast<char>(c);
+    } else if (c < 0x20) {
+      char buffer[8];
+      std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      encoded += buffer;
+    } else
+      encoded += static_cast<char>(c);
+  }
+  return encoded + '"';
+}
+
+// The JSON text of a schema's enum or const value, which can only be a plain value
+std::string EncodeJsonLiteral(const JsonValue& value) {
+  switch (value.type) {
+    case JsonValue::Type::Null:
+      return "null";
+    case JsonValue::Type::Bool:
+      return value.boolean ? "true" : "false";
+    case JsonValue::Type::Number: {
+      char buffer[32];
+      if (value.number == std::floor(value.number) && std::abs(value.number) < 1e15)
+        std::snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value.number));
+      else
+        std::snprintf(buffer, sizeof(buffer), "%.17g", value.number);
+      return buffer;
+    }
+    case JsonValue::Type::String:
+      return EncodeJsonString(value.string);
+    default:
+      throw std::runtime_error("JSON schema enum and const values must be strings, numbers, booleans or null");
+  }
+}
+
+std::string Alternatives(const std::vector<std::string>& regexes) {
+  if (regexes.size() == 1)
+    return regexes.front();
+  std::string regex = "(";
+  for (auto& alternative : regexes)
+    regex += (regex.size() > 1 ? "|" : "") + alternative;
+  return regex + ")";
+}
+
+std::string Repeat(std::string_view regex, int min, int max) {
+  std::string repeat = "(" + std::string{regex} + "){" + std::to_string(min) + ",";
+  return max >= 0 ? repeat + std::to_string(max) + "}" : repeat + "}";
+}
+
+int GetCount(const JsonValue& schema, std::string_view name, int default_value) {
+  auto* value = schema.Find(name);
+  if (!value)
+    return default_value;
+  if (value->type != JsonValue::Type::Number || value->number < 0 || value->number > c_max_repeat)
+    throw std::runtime_error("JSON schema " + std::string{name} + " must be a number from 0 to " + std::to_string(c_max_repeat));
+  return static_cast<int>(value->number);
+}
+
+std::string JsonStringRegex() { return "\"" + std::string{c_json_string_char} + "*\""; }
+
+// Elements separated by commas, between open and close
+std::string JsonList(std::string_view open, std::string_view element, int min, int max, std::string_view close) {
+  const std::string ws{c_json_whitespace};
+  std::string list = std::string{open} + ws;
+  if (max != 0) {
+    std::string elements = std::string{element} + Repeat(ws + "," + ws + std::string{element}, std::max(min - 1, 0), max > 0 ? max - 1 : -1);
+    list += min == 0 ? "(" + elements + ")?" : elements;
+  }
+  return list + ws + std::string{close};
+}
+
+std::string JsonAnyRegex(int depth) {
+  std::vector<std::string> alternatives{JsonStringRegex(), std::string{c_json_number}, "true", "false", "null"};
+  if (depth > 0) {
+    const std::string value = JsonAnyRegex(depth - 1);
+    const std::string ws{c_json_whitespace};
+    alternatives.push_back(JsonList("\\[", value, 0, -1, "\\]"));
+    alternatives.push_back(JsonList("\\{", JsonStringRegex() + ws + ":" + ws + value, 0, -1, "\\}"));
+  }
+  return Alternatives(alternatives);
+}
+
+std::string JsonSchemaRegex(const JsonValue& schema);
+
+std::string JsonObjectRegex(const JsonValue& schema) {
+  auto* properties = schema.Find("properties");
+  if (!properties)
+    return JsonList("\\{", JsonStringRegex() + std::string{c_json_whitespace} + ":" + std::string{c_json_whitespace} + JsonAnyRegex(c_json_any_depth - 1), 0, -1, "\\}");
+  if (properties->type != JsonValue::Type::Object)
+    throw std::runtime_error("JSON schema properties must be an object");
+
+  std::vector<std::string> required_names;
+  if (auto* required = schema.Find("required")) {
+    for (auto& name : required->members) {
+      if (name.second.type != JsonValue::Type::String)
+        throw std::runtime_error("JSON schema required must be an array of strings");
+      required_names.push_back(name.second.string);
+    }
+  }
+
+  const std::string ws{c_json_whitespace};
+  std::vector<std::string> members;
+  std::vector<bool> required;
+  for (auto& property : properties->members) {
+    members.push_back(EscapeRegex(EncodeJsonString(property.first)) + ws + ":" + ws + JsonSchemaRegex(property.second));
+    required.push_back(std::find(required_names.begin(), required_names.end(), property.first) != required_names.end());
+  }
+
+  // Members come in the order of the properties, with the optional ones left out. So the object is one of the members
+  // that can come first (those with only optional members before them) followed by the members after it
+  std::vector<std::string> bodies;
+  for (size_t first = 0; first < members.size(); first++) {
+    std::string body = members[first];
+    for (size_t i = first + 1; i < members.size(); i++) {
+      const std::string member = ws + "," + ws + members[i];
+      body += required[i] ? member : "(" + member + ")?";
+    }
+    bodies.push_back(body);
+    if (required[first])
+      break;
+  }
+
+  std::string regex = "\\{" + ws;
+  if (bodies.empty())
+    regex += "";
+  else if (std::find(required.begin(), required.end(), true) == required.end())
+    regex += "(" + Alternatives(bodies) + ")?";
+  else
+    regex += Alternatives(bodies);
+  return regex + ws + "\\}";
+}
+
+std::string JsonTypeRegex(const JsonValue& schema, std::string_view type) {
+  if (type == "string") {
+    const int min = GetCount(schema, "minLength", 0), max = GetCount(schema, "maxLength", -1);
+    if (auto* pattern = schema.Find("pattern")) {
+      if (pattern->type != JsonValue::Type::String)
+        throw std::runtime_error("JSON schema pattern must be a string");
+      return "\"(" + pattern->string + ")\"";
+    }
+    if (min == 0 && max == -1)
+      return JsonStringRegex();
+    return "\"" + Repeat(c_json_string_char, min, max) + "\"";
+  }
+  if (type == "integer")
+    return std::string{c_json_integer};
+  if (type == "number")
+    return std::string{c_json_number};
+  if (type == "boolean")
+    return "(true|false)";
+  if (type == "null")
+    return "null";
+  if (type == "array") {
+    auto* items = schema.Find("items");
+    const std::string item = items ? JsonSchemaRegex(*items) : JsonAnyRegex(c_json_any_depth - 1);
+    return JsonList("\\[", item, GetCount(schema, "minItems", 0), GetCount(schema, "maxItems", -1), "\\]");
+  }
+  if (type == "object")
+    return JsonObjectRegex(schema);
+  throw std::runtime_error("Unsupported JSON schema type: " + std::string{type});
+}
+
+std::string JsonSchemaRegex(const JsonValue& schema) {
+  if (schema.type == JsonValue::Type::Bool && schema.boolean)
+    return JsonAnyRegex(c_json_any_depth);
+  if (schema.type != JsonValue::Type::Object)
+    throw std::runtime_error("A JSON schema must be an object");
+
+  for (const char* unsupported : {"$ref", "allOf", "not", "if", "patternProperties"})
+    if (schema.Find(unsupported))
+      throw std::runtime_error("Unsupported JSON schema keyword: " + std::string{unsupported});
+
+  if (auto* value = schema.Find("const"))
+    return EscapeRegex(EncodeJsonLiteral(*value));
+
+  std::vector<std::string> alternatives;
+  if (auto* values = schema.Find("enum")) {
+    for (auto& value : values->members)
+      alternatives.push_back(EscapeRegex(EncodeJsonLiteral(value.second)));
+  } else if (auto* any_of = schema.Find("anyOf") ? schema.Find("anyOf") : schema.Find("oneOf")) {
+    for (auto& sub_schema : any_of->members)
+      alternatives.push_back(JsonSchemaRegex(sub_schema.second));
+  } else if (auto* type = schema.Find("type")) {
+    if (type->type == JsonValue::Type::String)
+      alternatives.push_back(JsonTypeRegex(schema, type->string));
+    else
+      for (auto& name : type->members)
+        alternatives.push_back(JsonTypeRegex(schema, name.second.string));
+  } else if (schema.Find("properties"))
+    alternatives.push_back(JsonObjectRegex(schema));
+  else
+    alternatives.push_back(JsonAnyRegex(c_json_any_depth));
+
+  if (alternatives.empty())
+    throw std::runtime_error("A JSON schema's enum, anyOf, oneOf or type can't be empty");
+  return Alternatives(alternatives);
+}
+
+}  // namespace
+
+std::string RegexFromJsonSchema(std::string_view schema) {
+  JsonValue document{JsonValue::Type::Array};
+  JsonValueElement root{document};
+  JSON::Parse(root, schema);
+  return JsonSchemaRegex(document.members.front().second);
+}
+
+TokenConstraint::TokenConstraint(std::string_view type, std::string_view grammar, std::span<const std::string> token_strings, std::span<const int32_t> eos_token_ids)
+    : token_strings_{token_strings.begin(), token_strings.end()},
+      eos_token_ids_{eos_token_ids.begin(), eos_token_ids.end()},
+      mask_words_{(token_strings.size() + 31) / 32} {
+  std::string regex;
+  if (type == "regex")
+    regex = grammar;
+  else if (type == "json_schema")
+    regex = RegexFromJsonSchema(grammar);
+  else
+    throw std::runtime_error("Unknown guidance type '" + std::string{type} + "', it must be regex or json_schema");
+
+  Nfa nfa;
+  const int nfa_start = nfa.Add();
+  const int nfa_accept = nfa.Build(RegexParser{regex}.Parse(), nfa_start);
+
+  // Subset construction, with the states numbered in the order they're found so the initial state is 0
+  std::map<std::vector<int>, int32_t> dfa_states;
+  std::vector<std::vector<int>> pending;
+  auto get_state = [&](std::vector<int>&& nfa_states) {
+    auto [it, inserted] = dfa_states.emplace(std::move(nfa_states), static_cast<int32_t>(dfa_states.size()));
+    if (inserted) {
+      if (dfa_states.size() > c_max_dfa_states)
+        throw std::runtime_error("The constraint's grammar needs too many states");
+      pending.push_back(it->first);
+      transitions_.emplace_back();
+      accepting_.push_back(std::binary_search(it->first.begin(), it->first.end(), nfa_accept));
+    }
+    return it->second;
+  };
+
+  std::vector<int> start{nfa_start};
+  nfa.Close(start);
+  get_state(std::move(start));
+  for (size_t state = 0; state < pending.size(); state++) {
+    std::array<std::vector<int>, 256> next;
+    for (int nfa_state : pending[state]) {
+      auto& s = nfa.states_[nfa_state];
+      if (s.next < 0)
+        continue;
+      for (int c = 0; c < 256; c++)
+        if (s.set[c])
+          next[c].push_back(s.next);
+    }
+    for (int c = 0; c < 256; c++) {
+      if (next[c].empty()) {
+        transitions_[state][c] = -1;
+        continue;
+      }
+      nfa.Close(next[c]);
+      transitions_[state][c] = get_state(std::move(next[c]));
+    }
+  }
+  final_state_ = static_cast<int32_t>(transitions_.size());
+
+  // A trie of the token strings, so tokens with a common prefix share the walk through the DFA
+  struct TrieNode {
+    std::vector<std::pair<unsigned char, int>> children;
+    std::vector<int32_t> tokens;
+  };
+  std::vector<TrieNode> trie(1);
+  for (int32_t token = 0; token < static_cast<int32_t>(token_strings_.size()); token++) {
+    if (token_strings_[token].empty() || std::find(eos_token_ids_.begin(), eos_token_ids_.end(), token) != eos_token_ids_.end())
+      continue;
+    int node = 0;
+    for (unsigned char c : token_strings_[token]) {
+      auto& children = trie[node].children;
+      auto it = std::find_if(children.begin(), children.end(), [c](auto& child) { return child.first == c; });
+      if (it != children.end()) {
+        node = it->second;
+        continue;
+      }
+      const int child = static_cast<int>(trie.size());
+      trie[node].children.emplace_back(c, child);
+      trie.emplace_back();
+      node = child;
+    }
+    trie[node].tokens.push_back(token);
+  }
+
+  masks_.assign((final_state_ + 1) * mask_words_, 0);
+  auto allow = [&](int32_t state, int32_t token) { masks_[state * mask_words_ + token / 32] |= 1U << (token % 32); };
+  std::vector<std::pair<int, int32_t>> stack;
+  for (int32_t state = 0; state < final_state_; state++) {
+    bool any_allowed = false;
+    stack.assign(1, {0, state});
+    while (!stack.empty()) {
+      auto [node, dfa_state] = stack.back();
+      stack.pop_back();
+      for (auto [c, child] : trie[node].children) {
+        const int32_t next = transitions_[dfa_state][c];
+        if (next < 0)
+          continue;
+        for (int32_t token : trie[child].tokens)
+          allow(state, token);
+        any_allowed |= !trie[child].tokens.empty();
+        stack.emplace_back(child, next);
+      }
+    }
+
+    // Also end the output when no token can continue it, rather than leave the sampling nothing to pick from
+    if (accepting_[state] || !any_allowed)
+      for (int32_t token : eos_token_ids_)
+        allow(state, token);
+  }
+  for (int32_t token : eos_token_ids_)
+    allow(final_state_, token);
+}
+
+int32_t TokenConstraint::Advance(int32_t state, int32_t token) const {
+  if (state == final_state_ || token < 0 || token >= static_cast<int32_t>(token_strings_.size()) ||
+      std::find(eos_token_ids_.begin(), eos_token_ids_.end(), token) != eos_token_ids_.end())
+    return final_state_;
+
+  for (unsigned char c : token_strings_[token]) {
+    state = transitions_[state][c];
+    if (state < 0)
+      return final_state_;
+  }
+  return state;
+}
+
+std::shared_ptr<TokenConstraint> TokenConstraint::Create(const Tokenizer& tokenizer, std::string_view type, std::string_view grammar,
+                                                         int vocab_size, std::span<const int32_t> eos_token_ids) {
+  // Decoded on its own a token can lose the leading space it has in the middle of a text (SentencePiece strips it at the
+  // start), so each token is also decoded twice in a row, and its string is what the second one adds
+  std::vector<int32_t> singles(vocab_size), pairs(2 * static_cast<size_t>(vocab_size));
+  for (int32_t token = 0; token < vocab_size; token++)
+    singles[token] = pairs[2 * token] = pairs[2 * token + 1] = token;
+  // A model's vocab_size can be padded past the tokenizer's vocabulary, then the ids the tokenizer rejects get no string
+  auto decode = [&](std::span<const int32_t> sequences) {
+    try {
+      return tokenizer.DecodeBatch(sequences, vocab_size);
+    } catch (const std::exception&) {
+      const size_t length = sequences.size() / vocab_size;
+      std::vector<std::string> strings(vocab_size);
+      for (size_t i = 0; i < strings.size(); i++) {
+        try {
+          strings[i] = tokenizer.Decode(sequences.subspan(i * length, length));
+        } catch (const std::exception&) {
+        }
+      }
+      return strings;
+    }
+  };
+  auto single_strings = decode(singles);
+  auto pair_strings = decode(pairs);
+
+  std::vector<std::string> token_strings(vocab_size);
+  for (int32_t token = 0; token < vocab_size; token++) {
+    auto& single = single_strings[token];
+    auto& pair = pair_strings[token];
+    token_strings[token] = pair.size() > single.size() && pair.compare(0, single.size(), single) == 0 ? pair.substr(single.size()) : single;
+  }
+  return std::make_shared<TokenConstraint>(type, grammar, token_strings, eos_token_ids);
+}
+
+}  // namespace Generators
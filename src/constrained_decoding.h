@@ -0,0 +1,48 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// Constrains the generated tokens to the strings of a regex or JSON schema. The grammar is compiled into a DFA over
+// bytes, then against the string of every token in the vocabulary, so each DFA state has a bitmask of the tokens that
+// keep the output a prefix of a match. Applying the constraint each step is then a pass over the vocab_size / 32 mask
+// words of every sequence's state, see Search::ApplyTokenConstraint.
+struct TokenConstraint {
+  // type is "regex" or "json_schema". token_strings[i] is the text token i adds to the output, special tokens have an
+  // empty string and are never allowed. The eos tokens are only allowed once the output is a complete match.
+  TokenConstraint(std::string_view type, std::string_view grammar, std::span<const std::string> token_strings, std::span<const int32_t> eos_token_ids);
+
+  // Gets the token strings by decoding the vocabulary with the tokenizer
+  static std::shared_ptr<TokenConstraint> Create(const Tokenizer& tokenizer, std::string_view type, std::string_view grammar,
+                                                 int vocab_size, std::span<const int32_t> eos_token_ids);
+
+  static constexpr int32_t c_initial_state = 0;
+
+  // The state after the output continues with token. An eos token, or one the mask didn't allow, leads to the final
+  // state, which only allows the eos tokens
+  int32_t Advance(int32_t state, int32_t token) const;
+  bool IsComplete(int32_t state) const { return state == final_state_ || accepting_[state]; }  // The output so far is a full match
+
+  size_t GetStateCount() const { return masks_.size() / mask_words_; }
+  size_t GetMaskWords() const { return mask_words_; }
+  std::span<const uint32_t> GetMask(int32_t state) const { return std::span<const uint32_t>{masks_}.subspan(state * mask_words_, mask_words_); }  // Bit t % 32 of word t / 32 is set if token t is allowed
+  std::span<const uint32_t> GetMasks() const { return masks_; }  // The masks of every state, {state_count, mask_words}
+
+ private:
+  std::vector<std::array<int32_t, 256>> transitions_;  // Next DFA state for each byte, -1 if the byte can't follow
+  std::vector<bool> accepting_;
+  std::vector<std::string> token_strings_;
+  std::vector<int32_t> eos_token_ids_;
+  int32_t final_state_;
+
+  size_t mask_words_;
+  std::vector<uint32_t> masks_;
+};
+
+// The regex of the JSON text a schema accepts. Supports the type (or a list of them), properties & required (always in
+// the order of the properties), items, minItems & maxItems, minLength, maxLength & pattern, enum, const, anyOf and oneOf
+// keywords. Objects without properties and schemas without a type take any JSON value up to two levels deep.
+std::string RegexFromJsonSchema(std::string_view schema);
+
+}  // namespace Generators
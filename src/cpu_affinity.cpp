@@ -0,0 +1,166 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "cpu_affinity.h"
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace Generators {
+
+std::string GetCpuIsaKey() {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+  const auto cpuid = [](int leaf, int subleaf) {
+    std::array<unsigned, 4> registers{};  // eax, ebx, ecx, edx
+#if defined(_M_X64) || defined(_M_IX86)
+    __cpuidex(reinterpret_cast<int*>(registers.data()), leaf, subleaf);
+#else
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+    return registers;
+  };
+
+  const auto bit = [](uint64_t value, int index) { return ((value >> index) & 1) != 0; };
+
+  // Leaves past the highest one the CPU has return the highest one's values, so they're read only if they exist
+  const unsigned max_leaf = cpuid(0, 0)[0];
+  const auto leaf1 = cpuid(1, 0);
+  const auto leaf7 = max_leaf >= 7 ? cpuid(7, 0) : std::array<unsigned, 4>{};
+  const auto leaf7_1 = max_leaf >= 7 && leaf7[0] >= 1 ? cpuid(7, 1) : std::array<unsigned, 4>{};
+
+  // The wider registers are only usable if the OS saves them on a context switch, which XCR0 tells (if XGETBV exists)
+  uint64_t xcr0 = 0;
+  if (bit(leaf1[2], 27)) {
+#if defined(_M_X64) || defined(_M_IX86)
+    xcr0 = _xgetbv(0);
+#else
+    unsigned eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    xcr0 = static_cast<uint64_t>(edx) << 32 | eax;
+#endif
+  }
+  const bool os_avx = (xcr0 & 0x6) == 0x6;                 // SSE & AVX state
+  const bool os_avx512 = os_avx && (xcr0 & 0xE0) == 0xE0;  // Opmask & ZMM state
+  const bool os_amx = (xcr0 & 0x60000) == 0x60000;         // Tile config & data state
+
+  const std::pair<const char*, bool> features[]{
+      {"avx", os_avx && bit(leaf1[2], 28)},
+      {"fma", os_avx && bit(leaf1[2], 12)},
+      {"avx2", os_avx && bit(leaf7[1], 5)},
+      {"avxvnni", os_avx && bit(leaf7_1[0], 4)},
+      {"avx512f", os_avx512 && bit(leaf7[1], 16)},
+      {"avx512bw", os_avx512 && bit(leaf7[1], 30)},
+      {"avx512vnni", os_avx512 && bit(leaf7[2], 11)},
+      {"amx", os_amx && bit(leaf7[3], 24)},
+  };
+  std::string key{sizeof(void*) == 8 ? "x64" : "x86"};
+  for (auto& [name, supported] : features) {
+    if (supported)
+      key += std::string{"-"} + name;
+  }
+  return key;
+#elif defined(__aarch64__) || defined(_M_ARM64)
+  return "arm64";
+#else
+  return "unknown";
+#endif
+}
+
+#if defined(__linux__)
+
+namespace {
+
+cpu_set_t ToCpuSet(const std::vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto cpu : cpus)
+    CPU_SET(cpu, &set);
+  return set;
+}
+
+}  // namespace
+
+std::vector<int> GetNumaNodeCpus(int node) {
+  // Like "0-15,32-47"
+  const auto path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+  std::ifstream file{path};
+  std::string list;
+  if (!file || !std::getline(file, list))
+    throw std::runtime_error("NUMA node " + std::to_string(node) + " doesn't exist, there's no " + path);
+
+  std::vector<int> cpus;
+  std::istringstream ranges{list};
+  for (std::string range; std::getline(ranges, range, ',');) {
+    if (range.empty())
+      continue;
+    const auto dash = range.find('-');
+    const int first = std::stoi(range.substr(0, dash));
+    const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+  }
+  if (cpus.empty())
+    throw std::runtime_error("NUMA node " + std::to_string(node) + " has no CPUs");
+  return cpus;
+}
+
+void PinThread(std::thread& thread, const std::vector<int>& cpus) {
+  auto set = ToCpuSet(cpus);
+  if (pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) != 0)
+    throw std::runtime_error("Couldn't set the affinity of a thread");
+}
+
+ScopedThreadAffinity::ScopedThreadAffinity(const std::vector<int>& cpus) : old_mask_(sizeof(cpu_set_t)) {
+  auto* old_set = reinterpret_cast<cpu_set_t*>(old_mask_.data());
+  if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), old_set) != 0)
+    throw std::runtime_error("Couldn't get the affinity of the calling thread");
+  auto set = ToCpuSet(cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    throw std::runtime_error("Couldn't set the affinity of the calling thread");
+}
+
+ScopedThreadAffinity::~ScopedThreadAffinity() {
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), reinterpret_cast<cpu_set_t*>(old_mask_.data()));
+}
+
+#else
+
+std::vector<int> GetNumaNodeCpus(int /*node*/) {
+  throw std::runtime_error("session_options.numa_node is only supported on Linux");
+}
+
+void PinThread(std::thread& /*thread*/, const std::vector<int>& /*cpus*/) {
+  throw std::runtime_error("Pinning threads is only supported on Linux");
+}
+
+ScopedThreadAffinity::ScopedThreadAffinity(const std::vector<int>& /*cpus*/) {
+  throw std::runtime_error("Pinning threads is only supported on Linux");
+}
+
+ScopedThreadAffinity::~ScopedThreadAffinity() = default;
+
+#endif
+
+std::string GetIntraOpThreadAffinities(const std::vector<int>& cpus, int thread_count) {
+  // ORT numbers the processors from 1
+  std::string affinities;
+  for (int i = 1; i < thread_count; i++) {
+    if (!affinities.empty())
+      affinities += ';';
+    affinities += std::to_string(cpus[i % cpus.size()] + 1);
+  }
+  return affinities;
+}
+
+}  // namespace Generators
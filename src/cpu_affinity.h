@@ -0,0 +1,37 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Generators {
+
+// The CPUs of a NUMA node, from /sys/devices/system/node. Only on Linux, elsewhere it throws
+std::vector<int> GetNumaNodeCpus(int node);
+
+// The value of ORT's session.intra_op_thread_affinities that pins each of the thread_count - 1 intra op threads (the first
+// is the one calling Run) to one of cpus, round robin
+std::string GetIntraOpThreadAffinities(const std::vector<int>& cpus, int thread_count);
+
+// Names the CPU's architecture and the vector extensions its kernels pick between, like "x64-avx2-avx512f", so what
+// was laid out for one (like ORT's prepacked weights) is only reused on CPUs with the same
+std::string GetCpuIsaKey();
+
+// Pins a thread to cpus
+void PinThread(std::thread& thread, const std::vector<int>& cpus);
+
+// Pins the calling thread to cpus until destroyed, then gives it back its old affinity. What the thread allocates and
+// first writes in between, like the weights of a session it creates, is then placed on the memory of those CPUs' node
+struct ScopedThreadAffinity {
+  ScopedThreadAffinity(const std::vector<int>& cpus);
+  ~ScopedThreadAffinity();
+
+ private:
+  ScopedThreadAffinity(const ScopedThreadAffinity&) = delete;
+  void operator=(const ScopedThreadAffinity&) = delete;
+
+  std::vector<unsigned char> old_mask_;  // A cpu_set_t
+};
+
+}  // namespace Generators
@@ -0,0 +1,55 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+// What the CPU kernels (softmax, fp16 conversion, ...) dispatch on: each module builds its AVX2, AVX-512 or NEON
+// functions with these target attributes, and picks a table of them once by what the CPU supports
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define GENERATORS_X64 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC lets any function use the AVX intrinsics, the caller checks the CPU supports them first
+#define GENERATORS_TARGET_AVX2
+#define GENERATORS_TARGET_AVX512
+#else
+#define GENERATORS_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define GENERATORS_TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define GENERATORS_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace Generators {
+
+#if GENERATORS_X64
+#if defined(_MSC_VER) && !defined(__clang__)
+// The OS has to save the ymm/zmm registers too (XCR0), not just the CPU support the instructions
+inline bool HasAvx2() {
+  int info[4];
+  __cpuid(info, 1);
+  const bool fma = (info[2] & (1 << 12)) != 0;
+  const bool osxsave = (info[2] & (1 << 27)) != 0;
+  const bool f16c = (info[2] & (1 << 29)) != 0;
+  if (!fma || !osxsave || !f16c || (_xgetbv(0) & 0x6) != 0x6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+}
+
+inline bool HasAvx512() {
+  if (!HasAvx2() || (_xgetbv(0) & 0xe6) != 0xe6)
+    return false;
+  int info[4];
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 16)) != 0;
+}
+#else
+inline bool HasAvx2() { return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c"); }
+inline bool HasAvx512() { return __builtin_cpu_supports("avx512f"); }
+#endif
+#endif
+
+}  // namespace Generators
@@ -2,6 +2,11 @@
 // Licensed under the MIT License.
 
 using System;
+using System.Collections.Generic;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
+using System.Threading;
+using System.Threading.Tasks;
 
 namespace Microsoft.ML.OnnxRuntimeGenAI
 {
@@ -10,6 +15,9 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
         private IntPtr _generatorHandle;
         private bool _disposed = false;
 
+        // Kept alive for as long as native steps can call it
+        private static readonly NativeMethods.OgaGeneratorCallback _stepCompleted = OnStepCompleted;
+
         public Generator(Model model, GeneratorParams generatorParams)
         {
             Result.VerifySuccess(NativeMethods.OgaCreateGenerator(model.Handle, generatorParams.Handle, out _generatorHandle));
@@ -30,6 +38,97 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             Result.VerifySuccess(NativeMethods.OgaGenerator_GenerateNextToken(_generatorHandle));
         }
 
+        // Runs up to maxSteps steps in one native call and returns how many ran. The batch size next tokens of each step
+        // are written one step after another into tokens, which needs room for maxSteps * batch size of them.
+        public ulong GenerateTokens(ulong maxSteps, Span<int> tokens)
+        {
+            unsafe
+            {
+                fixed (int* tokensPtr = tokens)
+                {
+                    Result.VerifySuccess(NativeMethods.OgaGenerator_GenerateTokens(_generatorHandle, (UIntPtr)maxSteps, tokensPtr, (UIntPtr)tokens.Length, out UIntPtr stepCount));
+                    return stepCount.ToUInt64();
+                }
+            }
+        }
+
+        // Stops the generator for good, a step in progress fails and IsDone returns true from then on. Can be called from
+        // any thread.
+        public void Cancel()
+        {
+            NativeMethods.OgaGenerator_Cancel(_generatorHandle);
+        }
+
+        // Runs a ComputeLogits & GenerateNextToken step on the native async threads, so no thread pool thread is blocked
+        // while the model runs. Cancelling the token cancels the generator like Cancel, and the task then throws an
+        // OperationCanceledException. The generator must not be used or disposed until the task completes.
+        public async Task GenerateNextTokenAsync(CancellationToken cancellationToken = default)
+        {
+            cancellationToken.ThrowIfCancellationRequested();
+            using (cancellationToken.Register(Cancel))
+            {
+                try
+                {
+                    await QueueStep().ConfigureAwait(false);
+                }
+                catch (OnnxRuntimeGenAIException) when (cancellationToken.IsCancellationRequested)
+                {
+                    throw new OperationCanceledException(cancellationToken);
+                }
+            }
+        }
+
+        // Streams the text of the first sequence's new tokens as they're generated, until the generator is done, running
+        // the steps like GenerateNextTokenAsync. Tokens that don't complete a character yet are decoded with the next ones.
+        public async IAsyncEnumerable<string> GenerateTextAsync(TokenizerStream tokenizerStream, [EnumeratorCancellation] CancellationToken cancellationToken = default)
+        {
+            while (!IsDone())
+            {
+                await GenerateNextTokenAsync(cancellationToken).ConfigureAwait(false);
+                string text = tokenizerStream.Decode(GetLastToken(0));
+                if (text.Length > 0)
+                {
+                    yield return text;
+                }
+            }
+        }
+
+        private Task QueueStep()
+        {
+            var completion = new TaskCompletionSource<bool>(TaskCreationOptions.RunContinuationsAsynchronously);
+            GCHandle handle = GCHandle.Alloc(completion);
+            IntPtr result = NativeMethods.OgaGenerator_GenerateNextTokenAsync(_generatorHandle, _stepCompleted, GCHandle.ToIntPtr(handle));
+            if (result != IntPtr.Zero)
+            {
+                handle.Free();
+                Result.VerifySuccess(result);
+            }
+            return completion.Task;
+        }
+
+        private static void OnStepCompleted(IntPtr generator, IntPtr result, IntPtr userData)
+        {
+            GCHandle handle = GCHandle.FromIntPtr(userData);
+            var completion = (TaskCompletionSource<bool>)handle.Target;
+            handle.Free();
+            // Nothing can be thrown back into the native thread
+            try
+            {
+                Result.VerifySuccess(result);
+                completion.SetResult(true);
+            }
+            catch (Exception e)
+            {
+                completion.SetException(e);
+            }
+        }
+
+        private int GetLastToken(ulong index)
+        {
+            ReadOnlySpan<int> sequence = GetSequence(index);
+            return sequence[sequence.Length - 1];
+        }
+
         public ReadOnlySpan<int> GetSequence(ulong index)
         {
             ulong sequenceLength = NativeMethods.OgaGenerator_GetSequenceCount(_generatorHandle, (UIntPtr)index).ToUInt64();
@@ -40,6 +139,24 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             }
         }
 
+        public double GetMetric(string name)
+        {
+            Result.VerifySuccess(NativeMethods.OgaGenerator_GetMetric(_generatorHandle, StringUtils.ToUtf8(name), out double value));
+            return value;
+        }
+
+        // Returns copies of the bucket upper bounds in milliseconds and the step counts, which have an extra last bucket
+        public (double[] upperBoundsMs, ulong[] counts) GetDecodeTimeHistogram()
+        {
+            Result.VerifySuccess(NativeMethods.OgaGenerator_GetDecodeTimeHistogram(_generatorHandle, out IntPtr boundsPtr, out IntPtr countsPtr, out UIntPtr bucketCount));
+            int count = (int)bucketCount.ToUInt64();
+            unsafe
+            {
+                return (new ReadOnlySpan<double>(boundsPtr.ToPointer(), count - 1).ToArray(),
+                        new ReadOnlySpan<ulong>(countsPtr.ToPointer(), count).ToArray());
+            }
+        }
+
         ~Generator()
         {
             Dispose(false);
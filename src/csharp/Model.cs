@@ -25,6 +25,12 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             return new Sequences(nativeSequences);
         }
 
+        public double GetMetric(string name)
+        {
+            Result.VerifySuccess(NativeMethods.OgaModel_GetMetric(_modelHandle, StringUtils.ToUtf8(name), out double value));
+            return value;
+        }
+
         ~Model()
         {
             Dispose(false);
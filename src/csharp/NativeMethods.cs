@@ -100,6 +100,31 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
         [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
         public static extern IntPtr /* OgaResult* */ OgaGenerator_GenerateNextToken(IntPtr /* OgaGenerator* */ generator);
 
+        // Runs up to maxSteps ComputeLogits & GenerateNextToken steps, writing the batch_size next tokens of each step
+        // one after another into tokens. stepCount is the number of steps run.
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern unsafe IntPtr /* OgaResult* */ OgaGenerator_GenerateTokens(IntPtr /* OgaGenerator* */ generator,
+                                                                                       UIntPtr /* size_t */ maxSteps,
+                                                                                       int* /* int32_t* */ tokens,
+                                                                                       UIntPtr /* size_t */ tokensCount,
+                                                                                       out UIntPtr /* size_t* */ stepCount);
+
+        // Called on a native thread once an OgaGenerator_GenerateNextTokenAsync step completes. The result is nonzero
+        // on failure and owned by the callback.
+        [UnmanagedFunctionPointer(CallingConvention.Winapi)]
+        public delegate void OgaGeneratorCallback(IntPtr /* OgaGenerator* */ generator, IntPtr /* OgaResult* */ result, IntPtr /* void* */ userData);
+
+        // Queues a ComputeLogits & GenerateNextToken step on the native async threads and returns right away. The callback
+        // isn't called if queueing the step fails.
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern IntPtr /* OgaResult* */ OgaGenerator_GenerateNextTokenAsync(IntPtr /* OgaGenerator* */ generator,
+                                                                                        OgaGeneratorCallback callback,
+                                                                                        IntPtr /* void* */ userData);
+
+        // Stops the generator for good, terminating a model run in progress. Can be called from any thread.
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern void OgaGenerator_Cancel(IntPtr /* OgaGenerator* */ generator);
+
         // This function returns the length of the sequence at the given index.
         [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
         public static extern UIntPtr /* size_t */ OgaGenerator_GetSequenceCount(IntPtr /* const OgaGenerator* */ generator,
@@ -112,6 +137,23 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
         public static extern IntPtr /* const in32_t* */ OgaGenerator_GetSequenceData(IntPtr /* const OgaGenerator* */ generator,
                                                                                      UIntPtr /* size_t */ index);
 
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern IntPtr /* OgaResult* */ OgaGenerator_GetMetric(IntPtr /* const OgaGenerator* */ generator,
+                                                                            byte[] /* const char* */ name,
+                                                                            out double /* double* */ value);
+
+        // The returned arrays are owned by the library and the OgaGenerator, there is one less bound than count
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern IntPtr /* OgaResult* */ OgaGenerator_GetDecodeTimeHistogram(IntPtr /* const OgaGenerator* */ generator,
+                                                                                         out IntPtr /* const double** */ upperBoundsMs,
+                                                                                         out IntPtr /* const uint64_t** */ counts,
+                                                                                         out UIntPtr /* size_t* */ bucketCount);
+
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern IntPtr /* OgaResult* */ OgaModel_GetMetric(IntPtr /* const OgaModel* */ model,
+                                                                        byte[] /* const char* */ name,
+                                                                        out double /* double* */ value);
+
         [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
         public static extern IntPtr /* OgaResult* */ OgaCreateSequences(out IntPtr /* OgaSequences** */ sequences);
 
@@ -185,6 +227,15 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
                                                                               int /* int32_t */ token,
                                                                               out IntPtr /* const char** */ outStr);
 
+        // This function decodes the next token of many streams into the given buffer, see OgaTokenizerStreamDecodeNext.
+        [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
+        public static extern unsafe IntPtr /* OgaResult* */ OgaTokenizerStreamDecodeNext(IntPtr* /* OgaTokenizerStream* const* */ streams,
+                                                                                         int* /* const int32_t* */ tokens,
+                                                                                         UIntPtr /* size_t */ streamCount,
+                                                                                         byte* /* char* */ buffer,
+                                                                                         UIntPtr /* size_t */ bufferSize,
+                                                                                         UIntPtr* /* size_t* */ chunkOffsets);
+
         [DllImport(NativeLib.DllName, CallingConvention = CallingConvention.Winapi)]
         public static extern IntPtr /* OgaResult* */ OgaCreateTensorFromBuffer(IntPtr /* data* */ data,
                                                                                long[] shape_dims,
@@ -82,6 +82,38 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             }
         }
 
+        // Decodes into utf8 without creating a string. Returns false, writing nothing, if utf8 is too small.
+        public bool TryDecode(ReadOnlySpan<int> sequence, Span<byte> utf8, out int bytesWritten)
+        {
+            IntPtr outStr = IntPtr.Zero;
+            unsafe
+            {
+                fixed (int* sequencePtr = sequence)
+                {
+                    Result.VerifySuccess(NativeMethods.OgaTokenizerDecode(_tokenizerHandle, sequencePtr, (UIntPtr)sequence.Length, out outStr));
+                }
+            }
+            try
+            {
+                int length = StringUtils.Utf8Length(outStr);
+                bytesWritten = 0;
+                if (length > utf8.Length)
+                {
+                    return false;
+                }
+                unsafe
+                {
+                    new ReadOnlySpan<byte>(outStr.ToPointer(), length).CopyTo(utf8);
+                }
+                bytesWritten = length;
+                return true;
+            }
+            finally
+            {
+                NativeMethods.OgaDestroyString(outStr);
+            }
+        }
+
         public TokenizerStream CreateStream()
         {
             IntPtr tokenizerStreamHandle = IntPtr.Zero;
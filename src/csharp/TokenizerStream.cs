@@ -2,6 +2,7 @@
 // Licensed under the MIT License.
 
 using System;
+using System.Buffers;
 using System.Runtime.InteropServices;
 
 namespace Microsoft.ML.OnnxRuntimeGenAI
@@ -25,6 +26,63 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             return StringUtils.FromUtf8(decodedStr);
         }
 
+        // Decodes the token into utf8 without creating a string and returns the bytes written. A chunk that doesn't fit
+        // stays in the stream and comes first in the next one, and a token of -1 only writes what's left.
+        public int Decode(int token, Span<byte> utf8)
+        {
+            unsafe
+            {
+                IntPtr handle = _tokenizerStreamHandle;
+                UIntPtr* chunkOffsets = stackalloc UIntPtr[2];
+                fixed (byte* utf8Ptr = utf8)
+                {
+                    Result.VerifySuccess(NativeMethods.OgaTokenizerStreamDecodeNext(&handle, &token, (UIntPtr)1, utf8Ptr, (UIntPtr)utf8.Length, chunkOffsets));
+                }
+                return (int)chunkOffsets[1].ToUInt64();
+            }
+        }
+
+        // Decodes the next token of every stream in one native call, tokens[i] for streams[i], writing the chunks one
+        // after another into utf8: the chunk of streams[i] is from chunkOffsets[i] to chunkOffsets[i + 1], so chunkOffsets
+        // needs room for streams.Length + 1 offsets. Chunks that don't fit work as in Decode. The native arrays it needs
+        // are pooled, so no call allocates once the pools are warm.
+        public static void DecodeNext(ReadOnlySpan<TokenizerStream> streams, ReadOnlySpan<int> tokens, Span<byte> utf8, Span<int> chunkOffsets)
+        {
+            if (tokens.Length != streams.Length || chunkOffsets.Length != streams.Length + 1)
+            {
+                throw new ArgumentException("DecodeNext needs one token per stream and the stream count + 1 chunk offsets");
+            }
+
+            IntPtr[] handles = ArrayPool<IntPtr>.Shared.Rent(streams.Length);
+            UIntPtr[] offsets = ArrayPool<UIntPtr>.Shared.Rent(streams.Length + 1);
+            try
+            {
+                for (int i = 0; i < streams.Length; i++)
+                {
+                    handles[i] = streams[i]._tokenizerStreamHandle;
+                }
+                unsafe
+                {
+                    fixed (IntPtr* handlesPtr = handles)
+                    fixed (int* tokensPtr = tokens)
+                    fixed (byte* utf8Ptr = utf8)
+                    fixed (UIntPtr* offsetsPtr = offsets)
+                    {
+                        Result.VerifySuccess(NativeMethods.OgaTokenizerStreamDecodeNext(handlesPtr, tokensPtr, (UIntPtr)streams.Length, utf8Ptr, (UIntPtr)utf8.Length, offsetsPtr));
+                    }
+                }
+                for (int i = 0; i < chunkOffsets.Length; i++)
+                {
+                    chunkOffsets[i] = (int)offsets[i].ToUInt64();
+                }
+            }
+            finally
+            {
+                ArrayPool<IntPtr>.Shared.Return(handles);
+                ArrayPool<UIntPtr>.Shared.Return(offsets);
+            }
+        }
+
         ~TokenizerStream()
         {
             Dispose(false);
@@ -56,6 +56,13 @@ namespace Microsoft.ML.OnnxRuntimeGenAI
             return utf8Bytes;
         }
 
+        internal static unsafe int Utf8Length(IntPtr nativeUtf8)
+        {
+            int len = 0;
+            while (*(byte*)(nativeUtf8 + len) != 0) ++len;
+            return len;
+        }
+
         internal static string FromUtf8(IntPtr nativeUtf8)
         {
             unsafe
@@ -0,0 +1,28 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+// The device side libraries of the kernels: fp16 and cub on CUDA, their HIP ports on ROCm (see cuda_hip.h)
+#include "cuda_hip.h"
+#if USE_ROCM
+#include <hip/hip_fp16.h>
+#include <hipcub/hipcub.hpp>
+
+namespace cub = hipcub;
+#else
+#include <cuda_fp16.h>
+#include <cub/cub.cuh>
+#endif
+
+namespace Generators {
+namespace cuda {
+
+// Threads that run in lockstep, for the reductions that go through shared memory a warp (wavefront) at a time
+#if USE_ROCM
+constexpr int c_warp_size = 64;
+#else
+constexpr int c_warp_size = 32;
+#endif
+
+}  // namespace cuda
+}  // namespace Generators
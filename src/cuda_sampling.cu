@@ -2,6 +2,7 @@
 // Licensed under the MIT License.
 
 #include <algorithm>
+#include <limits>
 #include <memory>
 #include <numeric>
 #include <random>
@@ -9,39 +10,26 @@
 #include "beam_search_topk.h"
 #include "cuda_sampling.cuh"
 #include "smartptrs.h"
-#include <cuda_runtime.h>
-#include <cub/cub.cuh>
+#include "cuda_hip.cuh"
 #include <iostream>
 
 namespace Generators {
 namespace cuda {
 
 constexpr int kMaxThreads = 1024;
-constexpr int kGPUWarpSize = 32;
-
-__global__ void InitCurandStates(unsigned long long seed, curandState* states, int batch_size) {
-  int index = threadIdx.x + blockIdx.x * blockDim.x;
-  if (index >= batch_size)
-    return;
-
-  curand_init(seed, index, 0, &states[index]);
-}
-
-SamplingData::SamplingData(unsigned long long random_seed, int batch_size, int vocab_size, cudaStream_t stream) {
-  indices_sorted = CudaMallocArray<int>(vocab_size * batch_size);
-  scores_sorted = CudaMallocArray<float>(vocab_size * batch_size);
+constexpr int kGPUWarpSize = c_warp_size;  // SoftmaxReduce goes a warp at a time
+constexpr int kMaxSortedTopK = 64;  // Top k subsets up to this size are gathered with GetTopKKernel
+
+SamplingData::SamplingData(std::span<const RandomStream> streams, int batch_size, int vocab_size, cudaStream_t stream) {
+  // Only the top k subsets of at most kMaxSortedTopK tokens are sorted, larger ones are sampled without sorting
+  const int sorted_size = std::min(vocab_size, kMaxSortedTopK) * batch_size;
+  indices_sorted = CudaMallocArray<int>(sorted_size);
+  scores_sorted = CudaMallocArray<float>(sorted_size);
   scores_softmaxed = CudaMallocArray<float>(vocab_size * batch_size);
-  prefix_sums = CudaMallocArray<float>(vocab_size * batch_size);
+  prefix_sums = CudaMallocArray<float>(sorted_size);
   thresholds = CudaMallocArray<float>(batch_size);
-  indices_in = CudaMallocArray<int>(vocab_size * batch_size);
-  offsets = CudaMallocArray<int>(batch_size + 1);
-  curand_states = CudaMallocArray<curandState>(batch_size);
-  temp_storage_bytes = 0;
-  cub::DeviceSegmentedRadixSort::SortPairsDescending(nullptr, temp_storage_bytes, (float*)nullptr, (float*)nullptr,
-    (int*)nullptr, (int*)nullptr, vocab_size*batch_size, batch_size, (int*)nullptr, (int*)nullptr, 0, sizeof(float) * 8, stream);
-  temp_buffer = CudaMallocArray<float>(temp_storage_bytes / sizeof(float));
-
-  InitCurandStates<<<int(batch_size / 128) + 1, 128, 0, stream>>>(random_seed, curand_states.get(), batch_size);
+  random_streams = CudaMallocArray<RandomStream>(batch_size);
+  cudaMemcpyAsync(random_streams.get(), streams.data(), streams.size_bytes(), cudaMemcpyHostToDevice, stream);
 }
 
 // Softmax Kernels and Launchers
@@ -331,59 +319,6 @@ void LaunchPopulateIndices(int* indices, int size, int batch_size, cudaStream_t
   PopulateIndices<<<grid, block, 0, stream>>>(indices, size, batch_size);
 }
 
-__global__ void PopulateOffsets(int* offsets, int size, int batch_size) {
-  int index = threadIdx.x + blockIdx.x * blockDim.x;
-  if (index < batch_size + 1)
-    offsets[index] = index * size;
-}
-
-void LaunchPopulateOffsets(int* offsets, int size, int batch_size, cudaStream_t stream) {
-  dim3 grid(int(batch_size/128)+1, 1, 1);
-  dim3 block(128, 1, 1);
-  PopulateOffsets<<<grid, block, 0, stream>>>(offsets, size, batch_size);
-}
-
-// Sorting Kernel Launcher
-
-template <typename T>
-void LaunchSortPairs(void* d_temp_storage,
-                     size_t temp_storage_bytes,
-                     const T* d_keys_in,
-                     T* d_keys_out,
-                     const int* d_values_in,
-                     int* d_values_out,
-                     int num_items,
-                     int num_segments,
-                     int* d_offsets,
-                     cudaStream_t stream,
-                     bool is_descending) {
-  if (is_descending) {
-    cub::DeviceSegmentedRadixSort::SortPairsDescending(d_temp_storage, temp_storage_bytes, d_keys_in, d_keys_out,
-        d_values_in, d_values_out, num_items, num_segments, d_offsets, d_offsets + 1, 0, sizeof(T) * 8, stream);
-  } else {
-    cub::DeviceSegmentedRadixSort::SortPairs(d_temp_storage, temp_storage_bytes, d_keys_in, d_keys_out,
-        d_values_in, d_values_out, num_items, num_segments, d_offsets, d_offsets + 1, 0, sizeof(T) * 8, stream);
-  }
-}
-
-template <typename T>
-void GetTempStorageSize(const T* d_keys_in,
-                        const int* d_values_in,
-                        int* d_offsets,
-                        int num_items,
-                        int num_segments,
-                        cudaStream_t stream,
-                        bool is_descending,
-                        size_t& temp_storage_bytes) {
-  if (is_descending) {
-    cub::DeviceSegmentedRadixSort::SortPairsDescending(nullptr, temp_storage_bytes, d_keys_in, (T*)nullptr,
-        d_values_in, (int*)nullptr, num_items, num_segments, d_offsets, d_offsets + 1, 0, sizeof(T) * 8, stream);
-  } else {
-    cub::DeviceSegmentedRadixSort::SortPairs(nullptr, temp_storage_bytes, d_keys_in, (T*)nullptr,
-        d_values_in, (int*)nullptr, num_items, num_segments, d_offsets, d_offsets + 1, 0, sizeof(T) * 8, stream);
-  }
-}
-
 // Sampling Kernels and Launchers
 
 template <int kBlockSize>
@@ -442,31 +377,31 @@ void LaunchGetTopKSubset(cudaStream_t stream, float* scores_in, float* scores_ou
 }
 
 // Sets up random thresholds for top p or top k sampling
-__global__ void RandomThresholdKernelTopPAndK(curandState* curand_states, float* thresholds, float* prefix_sums, int batch_size, float p, int k) {
+__global__ void RandomThresholdKernelTopPAndK(const RandomStream* streams, uint64_t step, float* thresholds, float* prefix_sums, int batch_size, float p, int k) {
   int index = threadIdx.x + blockIdx.x * blockDim.x;
 
   float k_prob = prefix_sums[k-1];
   if (index < batch_size) {
     float min_p = fminf(p, k_prob);
-    thresholds[index] = min_p * curand_uniform(&curand_states[index]);
+    thresholds[index] = min_p * RandomUniform(streams[index], step);
   }
 }
 
 // Sets up random thresholds for top p or top k sampling
-__global__ void RandomThresholdKernelTopP(curandState* curand_states, float* thresholds, float* prefix_sums, int batch_size, float p) {
+__global__ void RandomThresholdKernelTopP(const RandomStream* streams, uint64_t step, float* thresholds, float* prefix_sums, int batch_size, float p) {
   int index = threadIdx.x + blockIdx.x * blockDim.x;
 
   if (index < batch_size) {
-    thresholds[index] = p * curand_uniform(&curand_states[index]);
+    thresholds[index] = p * RandomUniform(streams[index], step);
   }
 }
 
 // Sets up random thresholds for top p or top k sampling
-__global__ void RandomThresholdKernelTopK(curandState* curand_states, float* thresholds, float* prefix_sums, int batch_size, int k) {
+__global__ void RandomThresholdKernelTopK(const RandomStream* streams, uint64_t step, float* thresholds, float* prefix_sums, int batch_size, int k) {
   int index = threadIdx.x + blockIdx.x * blockDim.x;
 
   if (index < batch_size) {
-    thresholds[index] = prefix_sums[k - 1] * curand_uniform(&curand_states[index]);
+    thresholds[index] = prefix_sums[k - 1] * RandomUniform(streams[index], step);
   }
 }
 
@@ -508,47 +443,17 @@ void LaunchSampleKernel(SamplingData* data, cudaStream_t stream, float* scores,
   // Random Thresholds for Top P or Top K Sampling
   std::span<float> thresholds{data->thresholds.get(), static_cast<size_t>(batch_size)};
   if (p > 0.0 && k > 1) {
-    RandomThresholdKernelTopPAndK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), batch_size, p, k);
+    RandomThresholdKernelTopPAndK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->random_streams.get(), data->random_step++, thresholds.data(), prefix_sums.data(), batch_size, p, k);
   } else if (p > 0.0) {
-    RandomThresholdKernelTopP<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), batch_size, p);
+    RandomThresholdKernelTopP<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->random_streams.get(), data->random_step++, thresholds.data(), prefix_sums.data(), batch_size, p);
   } else if (k > 1) {
-    RandomThresholdKernelTopK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->curand_states.get(), thresholds.data(), prefix_sums.data(), batch_size, k);
+    RandomThresholdKernelTopK<<<int(batch_size / 128) + 1, 128, 0, stream>>>(data->random_streams.get(), data->random_step++, thresholds.data(), prefix_sums.data(), batch_size, k);
   }
   SampleKernel<256><<<grid, block, 0, stream>>>(prefix_sums.data(), indices, index_out, sample_range, thresholds.data());
 }
 
 // Top P+K Kernel Launchers
 
-// Outputs sorted scores and corresponding indices... scores_out and indices_out should already be allocated
-void SoftmaxAndSort(SamplingData* data, cudaStream_t stream, float* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, float temperature) {
-  // Softmax scores
-  std::span<float> scores{data->scores_softmaxed.get(), static_cast<size_t>(vocab_size * batch_size)};
-  DispatchBlockwiseSoftmaxForward<false>(&stream, scores.data(), const_cast<const float*>(scores_in), vocab_size, vocab_size, vocab_size, batch_size, temperature);
-  // Sort indices by scores
-  std::span<int> offsets_gpu{data->offsets.get(), static_cast<size_t>(batch_size + 1)};
-  LaunchPopulateOffsets(offsets_gpu.data(), vocab_size, batch_size, stream);
-  std::span<int32_t> indices_in{data->indices_in.get(), static_cast<size_t>(vocab_size * batch_size)};
-  LaunchPopulateIndices(indices_in.data(), vocab_size, batch_size, stream);
-  std::span<float> temp_span{data->temp_buffer.get(), data->temp_storage_bytes / sizeof(float)};
-  LaunchSortPairs<float>(temp_span.data(), data->temp_storage_bytes, scores.data(), scores_out,
-                         indices_in.data(), indices_out, vocab_size * batch_size, batch_size, offsets_gpu.data(),
-                         stream, /*is_descending*/true);
-}
-
-void LaunchGetTopKSubsetFullSort(SamplingData* data, cudaStream_t stream, float* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, int k) {
-  // Sort indices and scores
-  std::span<float> scores_sorted{data->scores_sorted.get(), static_cast<size_t>(vocab_size * batch_size)};
-  std::span<int> indices_sorted{data->indices_sorted.get(), static_cast<size_t>(vocab_size * batch_size)};
-  std::span<int> offsets_gpu{data->offsets.get(), static_cast<size_t>(batch_size + 1)};
-  LaunchPopulateOffsets(offsets_gpu.data(), vocab_size, batch_size, stream);
-  std::span<int32_t> indices_in{data->indices_in.get(), static_cast<size_t>(vocab_size * batch_size)};
-  LaunchPopulateIndices(indices_in.data(), vocab_size, batch_size, stream);
-  std::span<float> temp_span{data->temp_buffer.get(), data->temp_storage_bytes / sizeof(float)};
-  LaunchSortPairs<float>(temp_span.data(), data->temp_storage_bytes, scores_in, scores_sorted.data(),
-                         indices_in.data(), indices_sorted.data(), vocab_size * batch_size, batch_size, offsets_gpu.data(),
-                         stream, /*is_descending*/true);
-}
-
 void GetTopKSubset(SamplingData* data, cudaStream_t stream, float* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, int k, float temperature) {
   // Softmax scores
   std::span<float> scores_softmaxed{data->scores_softmaxed.get(), static_cast<size_t>(vocab_size * batch_size)};
@@ -571,27 +476,384 @@ void GetTopKSubset(SamplingData* data, cudaStream_t stream, float* scores_in, fl
     GetTopK(16);
   } else if (k <= 32) {
     GetTopK(32);
-  } else if (k <= 64) {
-    GetTopK(64);
   } else {
-    LaunchGetTopKSubsetFullSort(data, stream, scores_softmaxed.data(), scores_out, indices_out, vocab_size, batch_size, k);
+    assert(k <= kMaxSortedTopK);
+    GetTopK(64);
+  }
+}
+
+
+// Sampling without sorting, for top p and top k subsets larger than kMaxSortedTopK.
+// Every token's probability is turned into an integer weight, which is also its sort key, so the sums are exact and the
+// kept set & the sampled token are found by radix selecting over a histogram of the keys, a few bits at a time. Top k
+// subsets of up to kCandidatesPerThread * kBlockSize tokens are then sampled in shared memory (see SampleTopKCandidates)
+constexpr int kRadixBits = 11;
+constexpr int kRadixBins = 1 << kRadixBits;
+constexpr int kCandidatesPerThread = 4;  // Top k subsets up to this many per thread are sampled from shared memory
+
+struct RadixSelectState {
+  uint32_t key;                 // Bits of the selected key found so far
+  unsigned long long above;     // Total (weight or count) of the keys greater than the selected one
+};
+
+__device__ __forceinline__ uint32_t ProbabilityKey(float score, float max, float scale) {
+  // Scaled so the most likely token is 2^31, the weights of a whole vocab still add up without overflowing 64 bits
+  return __float2uint_rz(fminf(__expf((score - max) * scale), 1.0f) * 2147483648.0f);
+}
+
+// Adds every key matching the selected bits above 'shift + bits' to bins[], by weight or by count
+template <int kBlockSize>
+__device__ void RadixHistogram(const float* scores, int vocab_size, float max, float scale, bool by_count,
+                               int shift, int bits, uint32_t prefix, unsigned long long* bins) {
+  for (int i = threadIdx.x; i < (1 << bits); i += kBlockSize)
+    bins[i] = 0;
+  __syncthreads();
+
+  const int high = shift + bits;
+  for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+    uint32_t key = ProbabilityKey(scores[i], max, scale);
+    if (high == 32 || (key >> high) == (prefix >> high))
+      atomicAdd(&bins[(key >> shift) & ((1U << bits) - 1)], by_count ? 1ULL : static_cast<unsigned long long>(key));
   }
+  __syncthreads();
 }
 
+// Walks the bins from the highest key down and selects the one where the running total reaches 'target'
+template <int kBlockSize>
+__device__ void FindRadixBin(const unsigned long long* bins, int bin_count, unsigned long long target, int shift,
+                             RadixSelectState& state) {
+  const unsigned long long base = state.above;
+  __syncthreads();
+
+  const int per_thread = (bin_count + kBlockSize - 1) / kBlockSize;
+  const int first = bin_count - 1 - threadIdx.x * per_thread;
+  unsigned long long local = 0;
+  for (int j = 0; j < per_thread && first - j >= 0; j++)
+    local += bins[first - j];
+
+  using BlockScan = cub::BlockScan<unsigned long long, kBlockSize>;
+  __shared__ typename BlockScan::TempStorage temp_storage;
+  unsigned long long above;
+  BlockScan(temp_storage).ExclusiveSum(local, above);
+  above += base;
+
+  // The totals are exact, so exactly one thread's range holds the target
+  if (above < target && target <= above + local) {
+    for (int j = 0; first - j >= 0; j++) {
+      const int bin = first - j;
+      if (target <= above + bins[bin]) {
+        state.key |= static_cast<uint32_t>(bin) << shift;
+        state.above = above;
+        break;
+      }
+      above += bins[bin];
+    }
+  }
+  __syncthreads();
+}
+
+// Selects the greatest key where the total of it and the keys above it reaches 'target'
+template <int kBlockSize>
+__device__ void RadixSelect(const float* scores, int vocab_size, float max, float scale, bool by_count,
+                            unsigned long long target, unsigned long long* bins, RadixSelectState& state) {
+  if (threadIdx.x == 0)
+    state = {0, 0};
+  __syncthreads();
+
+  for (int shift = 32 - kRadixBits; shift > -kRadixBits; shift -= kRadixBits) {
+    const int low = shift < 0 ? 0 : shift;
+    const int bits = shift + kRadixBits - low;
+    RadixHistogram<kBlockSize>(scores, vocab_size, max, scale, by_count, low, bits, state.key, bins);
+    FindRadixBin<kBlockSize>(bins, 1 << bits, target, low, state);
+  }
+}
+
+// A random weight in [1, kept_weight], as a fraction of the smaller of the top k and top p weights like sampling the
+// sorted tokens
+__device__ unsigned long long SampleTarget(unsigned long long kept_weight, float p, RandomStream stream, uint64_t step) {
+  double limit = static_cast<double>(kept_weight);
+  if (p > 0.0f)
+    limit = fmin(limit, static_cast<double>(p) * static_cast<double>(kept_weight));
+  unsigned long long value = static_cast<unsigned long long>(ceil(limit * RandomUniform(stream, step)));
+  return value < 1 ? 1 : (value > kept_weight ? kept_weight : value);
+}
+
+// Samples from a top k subset that fits in shared memory, given the k-th key and the count of the keys above it. One more
+// pass over the vocab gathers the subset in index order, which is then sorted in place, so the sampled token is found
+// with a scan of k weights instead of radix selecting over the whole vocab again. Picks the same token as that would
+template <int kBlockSize>
+__device__ int SampleTopKCandidates(const float* scores, int vocab_size, float max, float scale, int k, float p,
+                                    uint32_t key_k, unsigned long long count_above, RandomStream stream, uint64_t step) {
+  using Sort = cub::BlockRadixSort<uint32_t, kBlockSize, kCandidatesPerThread, int>;
+  using IntScan = cub::BlockScan<int, kBlockSize>;
+  using WeightScan = cub::BlockScan<unsigned long long, kBlockSize>;
+  __shared__ union {
+    typename Sort::TempStorage sort;
+    typename IntScan::TempStorage scan;
+    typename WeightScan::TempStorage weights;
+  } temp_storage;
+  __shared__ uint32_t candidate_keys[kCandidatesPerThread * kBlockSize];
+  __shared__ int candidate_tokens[kCandidatesPerThread * kBlockSize];
+  __shared__ unsigned long long target;
+  __shared__ int token;
+
+  // Of the tokens with the k-th key, only the first ones in index order are kept
+  const int ties = k - static_cast<int>(count_above);
+  int kept = 0, ties_seen = 0;
+  for (int base = 0; base < vocab_size && kept < k; base += kBlockSize) {
+    const int i = base + threadIdx.x;
+    const uint32_t key = i < vocab_size ? ProbabilityKey(scores[i], max, scale) : 0;
+    const int tie = i < vocab_size && key == key_k;
+    int tie_rank, tie_count;
+    IntScan(temp_storage.scan).ExclusiveSum(tie, tie_rank, tie_count);
+    __syncthreads();
+    const int keep = i < vocab_size && (key > key_k || (tie && ties_seen + tie_rank < ties));
+    int keep_rank, keep_count;
+    IntScan(temp_storage.scan).ExclusiveSum(keep, keep_rank, keep_count);
+    __syncthreads();
+    if (keep) {
+      candidate_keys[kept + keep_rank] = key;
+      candidate_tokens[kept + keep_rank] = i;
+    }
+    kept += keep_count;
+    ties_seen += tie_count;
+  }
+  __syncthreads();
+
+  uint32_t keys[kCandidatesPerThread];
+  int tokens[kCandidatesPerThread];
+  for (int j = 0; j < kCandidatesPerThread; j++) {
+    const int slot = threadIdx.x * kCandidatesPerThread + j;
+    keys[j] = slot < k ? candidate_keys[slot] : 0;
+    tokens[j] = slot < k ? candidate_tokens[slot] : vocab_size;
+  }
+  // The sort is stable, so equal keys stay in index order, and the padding after them adds no weight
+  Sort(temp_storage.sort).SortDescending(keys, tokens);
+  __syncthreads();
+
+  unsigned long long local = 0;
+  for (int j = 0; j < kCandidatesPerThread; j++)
+    local += keys[j];
+  unsigned long long above, kept_weight;
+  WeightScan(temp_storage.weights).ExclusiveSum(local, above, kept_weight);
+  if (threadIdx.x == 0) {
+    target = SampleTarget(kept_weight, p, stream, step);
+    token = tokens[0];  // The top token, if no thread's range holds the target
+  }
+  __syncthreads();
+
+  if (above < target && target <= above + local) {
+    for (int j = 0; j < kCandidatesPerThread; j++) {
+      above += keys[j];
+      if (target <= above) {
+        token = tokens[j];
+        break;
+      }
+    }
+  }
+  __syncthreads();
+  return token;
+}
+
+template <int kBlockSize>
+__global__ void RadixSampleKernel(const float* scores_in, int32_t* next_token_out, const RandomStream* streams, uint64_t step,
+                                  int vocab_size, int k, float p, float temperature,
+                                  const int* row_ks, const float* row_ps, const float* row_temperatures) {
+  const float* scores = scores_in + static_cast<size_t>(blockIdx.x) * vocab_size;
+  if (row_ks) {
+    k = row_ks[blockIdx.x];
+    p = row_ps[blockIdx.x];
+    temperature = row_temperatures[blockIdx.x];
+  }
+  const float scale = 1.0f / temperature;
+
+  __shared__ unsigned long long bins[kRadixBins];
+  __shared__ RadixSelectState state;
+  __shared__ float row_max;
+  __shared__ unsigned long long target;
+  __shared__ int token;
+
+  using FloatReduce = cub::BlockReduce<float, kBlockSize>;
+  using WeightReduce = cub::BlockReduce<unsigned long long, kBlockSize>;
+  __shared__ union {
+    typename FloatReduce::TempStorage max;
+    typename cub::BlockReduce<int, kBlockSize>::TempStorage min;
+    typename WeightReduce::TempStorage sum;
+    typename cub::BlockScan<int, kBlockSize>::TempStorage scan;
+  } temp_storage;
+
+  float max = std::numeric_limits<float>::lowest();
+  for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+    max = fmaxf(max, scores[i]);
+  max = FloatReduce(temp_storage.max).Reduce(max, cub::Max());
+  if (threadIdx.x == 0)
+    row_max = max;
+  __syncthreads();
+
+  // A greedy row takes the first token with the top score, without using up a random value
+  if (k == 1) {
+    int first = vocab_size;
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+      if (scores[i] == row_max) {
+        first = i;
+        break;
+      }
+    }
+    first = cub::BlockReduce<int, kBlockSize>(temp_storage.min).Reduce(first, cub::Min());
+    if (threadIdx.x == 0)
+      next_token_out[blockIdx.x] = first;
+    return;
+  }
+
+  // The weight of the whole vocab, or of the top k tokens, with the ties of the k-th token kept in index order
+  unsigned long long kept_weight;
+  if (k > 0) {
+    RadixSelect<kBlockSize>(scores, vocab_size, row_max, scale, true, k, bins, state);
+    const uint32_t key_k = state.key;
+    const unsigned long long count_above = state.above;
+    if (k <= kCandidatesPerThread * kBlockSize) {
+      const int sampled = SampleTopKCandidates<kBlockSize>(scores, vocab_size, row_max, scale, k, p, key_k, count_above,
+                                                           streams[blockIdx.x], step);
+      if (threadIdx.x == 0)
+        next_token_out[blockIdx.x] = sampled;
+      return;
+    }
+
+    unsigned long long weight = 0;
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+      uint32_t key = ProbabilityKey(scores[i], row_max, scale);
+      if (key > key_k)
+        weight += key;
+    }
+    weight = WeightReduce(temp_storage.sum).Sum(weight);
+    kept_weight = weight + (k - count_above) * key_k;
+  } else {
+    unsigned long long weight = 0;
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+      weight += ProbabilityKey(scores[i], row_max, scale);
+    kept_weight = WeightReduce(temp_storage.sum).Sum(weight);
+  }
+
+  if (threadIdx.x == 0) {
+    target = SampleTarget(kept_weight, p, streams[blockIdx.x], step);
+    token = -1;
+  }
+  __syncthreads();
+
+  RadixSelect<kBlockSize>(scores, vocab_size, row_max, scale, false, target, bins, state);
+  const uint32_t sampled_key = state.key;
+  const unsigned long long rank = (target - state.above + sampled_key - 1) / sampled_key - 1;
+
+  // Of the tokens with the sampled key, the one at 'rank' in index order is where the threshold is reached
+  unsigned long long seen = 0;
+  for (int base = 0; base < vocab_size && token < 0; base += kBlockSize) {
+    const int i = base + threadIdx.x;
+    const int match = i < vocab_size && ProbabilityKey(scores[i], row_max, scale) == sampled_key;
+    int match_rank, match_count;
+    cub::BlockScan<int, kBlockSize>(temp_storage.scan).ExclusiveSum(match, match_rank, match_count);
+    if (match && seen + match_rank == rank)
+      token = i;
+    seen += match_count;
+    __syncthreads();
+  }
+
+  if (threadIdx.x == 0)
+    next_token_out[blockIdx.x] = token;
+}
 
 // Kernel launcher for combined (or seperate) top k and top p sampling; where k is the max number of tokens to sample and p is the probability threshold
 void GetSample(SamplingData* data, cudaStream_t stream, int32_t* next_token_out, float* scores_in, int vocab_size, int batch_size, int k, float p, float temperature) {
-  int sample_range = (k > 0 && k <= 64) ? k : vocab_size;
+  if (k <= 0 || k > kMaxSortedTopK || k >= vocab_size) {
+    RadixSampleKernel<256><<<batch_size, 256, 0, stream>>>(scores_in, next_token_out, data->random_streams.get(), data->random_step++,
+                                                           vocab_size, k < vocab_size ? k : 0, p, temperature,
+                                                           nullptr, nullptr, nullptr);
+    return;
+  }
+
+  int sample_range = k;
   std::span<float> scores_sorted(data->scores_sorted.get(), static_cast<size_t>(sample_range * batch_size));
   std::span<int> indices_sorted(data->indices_sorted.get(), static_cast<size_t>(sample_range * batch_size));
-  if (k > 0 && k < vocab_size) {
-    GetTopKSubset(data, stream, scores_in, scores_sorted.data(), indices_sorted.data(), vocab_size, batch_size, k, temperature);
-  } else {
-    SoftmaxAndSort(data, stream, scores_in, scores_sorted.data(), indices_sorted.data(), vocab_size, batch_size, temperature);
-  }
+  GetTopKSubset(data, stream, scores_in, scores_sorted.data(), indices_sorted.data(), vocab_size, batch_size, k, temperature);
   // Sample kernel
   LaunchSampleKernel(data, stream, scores_sorted.data(), indices_sorted.data(), next_token_out, sample_range, batch_size, p, k);
 }
 
+void GetSampleRows(SamplingData* data, cudaStream_t stream, int32_t* next_token_out, float* scores_in, int vocab_size, int batch_size,
+                   const int* ks, const float* ps, const float* temperatures) {
+  RadixSampleKernel<256><<<batch_size, 256, 0, stream>>>(scores_in, next_token_out, data->random_streams.get(), data->random_step++,
+                                                         vocab_size, 0, 0.0f, 1.0f, ks, ps, temperatures);
+}
+
+template <int kBlockSize>
+__global__ void TokenLogProbsKernel(const float* scores_in, const int32_t* tokens, const bool* finished, int vocab_size, int top_n,
+                                    int pad_token_id, float* token_logprobs, float* top_logprobs, int32_t* top_tokens) {
+  const int batch_id = blockIdx.x;
+  if (finished[batch_id]) {
+    for (int i = threadIdx.x; i < top_n; i += kBlockSize) {
+      top_tokens[batch_id * top_n + i] = pad_token_id;
+      top_logprobs[batch_id * top_n + i] = 0.0f;
+    }
+    if (threadIdx.x == 0)
+      token_logprobs[batch_id] = 0.0f;
+    return;
+  }
+
+  using Pair = cub::KeyValuePair<int, float>;
+  using FloatReduce = cub::BlockReduce<float, kBlockSize>;
+  using PairReduce = cub::BlockReduce<Pair, kBlockSize>;
+  __shared__ union {
+    typename FloatReduce::TempStorage floats;
+    typename PairReduce::TempStorage pairs;
+  } temp_storage;
+  __shared__ float log_sum;
+  __shared__ Pair previous;
+
+  const float* scores = scores_in + static_cast<size_t>(batch_id) * vocab_size;
+  float max = -INFINITY;
+  for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+    max = fmaxf(max, scores[i]);
+  max = FloatReduce(temp_storage.floats).Reduce(max, cub::Max());
+  if (threadIdx.x == 0)
+    log_sum = max;
+  __syncthreads();
+
+  float sum = 0.0f;
+  for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+    sum += expf(scores[i] - log_sum);
+  __syncthreads();
+  sum = FloatReduce(temp_storage.floats).Sum(sum);
+  if (threadIdx.x == 0) {
+    log_sum += logf(sum);
+    token_logprobs[batch_id] = scores[tokens[batch_id]] - log_sum;
+    previous = {-1, INFINITY};
+  }
+  __syncthreads();
+
+  // Each round takes the best token after the previous round's, a pass over the vocab for each of the few top_n
+  for (int n = 0; n < top_n; n++) {
+    Pair best{vocab_size, -INFINITY};
+    const Pair last = previous;
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+      const float score = scores[i];
+      const bool after_last = score < last.value || (score == last.value && i > last.key);
+      if (after_last && (score > best.value || best.key == vocab_size))
+        best = {i, score};
+    }
+    best = PairReduce(temp_storage.pairs).Reduce(best, cub::ArgMax());
+    if (threadIdx.x == 0) {
+      top_tokens[batch_id * top_n + n] = best.key;
+      top_logprobs[batch_id * top_n + n] = best.value - log_sum;
+      previous = best;
+    }
+    __syncthreads();
+  }
+}
+
+void LaunchTokenLogProbs(const float* scores, const int32_t* tokens, const bool* finished, int vocab_size, int batch_size, int top_n,
+                         int pad_token_id, float* token_logprobs, float* top_logprobs, int32_t* top_tokens, cudaStream_t stream) {
+  TokenLogProbsKernel<256><<<batch_size, 256, 0, stream>>>(scores, tokens, finished, vocab_size, top_n, pad_token_id,
+                                                           token_logprobs, top_logprobs, top_tokens);
+}
+
 } // namespace cuda
 } // namespace Generators
@@ -1,27 +1,37 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 #include "smartptrs.h"
-#include <curand_kernel.h>
+#include "cuda_hip.cuh"
+#include "philox.h"
 
 namespace Generators {
 namespace cuda {
 
 struct SamplingData {
-  SamplingData(unsigned long long random_seed, int batch_size, int vocab_size, cudaStream_t stream);
+  // One random stream per batch entry (see GetRandomStreams)
+  SamplingData(std::span<const RandomStream> streams, int batch_size, int vocab_size, cudaStream_t stream);
   cuda_unique_ptr<int> indices_sorted;
   cuda_unique_ptr<float> scores_sorted;
   cuda_unique_ptr<float> scores_softmaxed;
   cuda_unique_ptr<float> prefix_sums;
   cuda_unique_ptr<float> thresholds;
-  cuda_unique_ptr<int> indices_in;
-  cuda_unique_ptr<int> offsets;
-  cuda_unique_ptr<float> temp_buffer;
-  cuda_unique_ptr<curandState> curand_states;
-  size_t temp_storage_bytes = 0;
+  cuda_unique_ptr<RandomStream> random_streams;
+  uint64_t random_step{};  // Counts the sampling calls, the counter of the draws
 };
 
 void LaunchPopulateIndices(int* indices, int size, int batch_size, cudaStream_t stream);
+// Softmaxes the scores, then writes the top k (at most 64) of every batch entry in descending order with their indices
+void GetTopKSubset(SamplingData* data, cudaStream_t stream, float* scores_in, float* scores_out, int* indices_out, int vocab_size, int batch_size, int k, float temperature);
 void GetSample(SamplingData* data, cudaStream_t stream, int32_t* d_next_token, float* d_scores, int vocab_size, int batch_size, int k, float p, float temperature);
+// Like GetSample, with the device arrays of each batch entry's k, p and temperature. A k of 1 picks the top token, 0 is
+// the whole vocab, and p is only applied when more than 0
+void GetSampleRows(SamplingData* data, cudaStream_t stream, int32_t* d_next_token, float* d_scores, int vocab_size, int batch_size,
+                   const int* ks, const float* ps, const float* temperatures);
+
+// Writes the log softmax of each batch entry's scores at its token, and at its top_n most likely tokens (most likely first,
+// ties to the lower id) into top_tokens & top_logprobs. Finished entries get 0 and pad_token_id.
+void LaunchTokenLogProbs(const float* scores, const int32_t* tokens, const bool* finished, int vocab_size, int batch_size, int top_n,
+                         int pad_token_id, float* token_logprobs, float* top_logprobs, int32_t* top_tokens, cudaStream_t stream);
 
 template <bool is_log_softmax>
 void DispatchBlockwiseSoftmaxForward(cudaStream_t* stream, float* output, const float* input, int softmax_elements, int input_stride, int output_stride, int batch_count, float temperature=1.0);
@@ -39,38 +39,39 @@ void DmlCommandRecorder::ExecuteCommandList(
     ID3D12GraphicsCommandList* command_list,
     _Outptr_ ID3D12Fence** fence,
     _Out_ uint64_t* completion_value) {
-  if (!operations_recorded_in_current_command_list) {
-    // The caller can re-use relevant resources after the next set of work to be
-    // flushed has completed.  Its command list hasn't been executed yet, just batched.
-    DmlGpuEvent gpu_event = queue_->GetNextCompletionEvent();
-    gpu_event.fence.CopyTo(fence);
-    *completion_value = gpu_event.fence_value;
-
-    queue_->ExecuteCommandLists(std::span<ID3D12CommandList*>(reinterpret_cast<ID3D12CommandList**>(&command_list), 1));
-
-    // The fence value at which the current command allocator may be re-used will now be higher
-    command_allocator_ring_.UpdateCurrentAllocatorCompletionEvent(queue_->GetNextCompletionEvent());
-
-    // Fail early if something horrifying happens
-    THROW_IF_FAILED(d3d_device_->GetDeviceRemovedReason());
-
-    return;
-  }
-
   // Remember the descriptor heap and apply it to the next command list.  This avoids unnecessarily setting it onto
   // the D3D object lazily at a point when the operation may not be parallelized with GPU work.
   auto heap = current_descriptor_heap_;
 
-  // Execute work in the current command list plus provided command list while closing the recorder.
-  CloseAndExecute(command_list);
-  Open();
+  if (!command_list) {
+    CloseAndExecute();
+    Open();
+    SetDescriptorHeap(heap);
 
-  // Reset the descriptor heap opportunistically per above comment
-  SetDescriptorHeap(heap);
+    DmlGpuEvent gpu_event = queue_->GetCurrentCompletionEvent();
+    gpu_event.fence.CopyTo(fence);
+    *completion_value = gpu_event.fence_value;
+    return;
+  }
 
-  DmlGpuEvent gpu_event = queue_->GetCurrentCompletionEvent();
+  // The caller can re-use relevant resources after the next set of work to be flushed has completed, which the
+  // command list is bundled into
+  DmlGpuEvent gpu_event = queue_->GetNextCompletionEvent();
   gpu_event.fence.CopyTo(fence);
   *completion_value = gpu_event.fence_value;
+
+  // What was recorded so far goes before it, so it's closed into the bundle and recording goes on in another list
+  if (operations_recorded_in_current_command_list) {
+    THROW_IF_FAILED(current_command_list_->Close());
+    bundled_command_lists_.push_back(current_command_list_);
+    bundled_recorded_lists_.push_back(std::move(current_command_list_));
+    operations_recorded_in_current_command_list = false;
+    current_descriptor_heap_ = nullptr;
+    Open();
+    SetDescriptorHeap(heap);
+  }
+
+  bundled_command_lists_.push_back(command_list);
 }
 
 ComPtr<ID3D12GraphicsCommandList> DmlCommandRecorder::GetCommandList() {
@@ -96,6 +97,11 @@ void DmlCommandRecorder::Open() {
 
   ID3D12CommandAllocator* allocator = command_allocator_ring_.GetNextAllocator(queue_->GetNextCompletionEvent());
 
+  if (!cached_command_list_ && !free_command_lists_.empty()) {
+    cached_command_list_ = std::move(free_command_lists_.back());
+    free_command_lists_.pop_back();
+  }
+
   if (!cached_command_list_) {
     THROW_IF_FAILED(d3d_device_->CreateCommandList(
         0,
@@ -117,20 +123,31 @@ void DmlCommandRecorder::CloseAndExecute() {
 void DmlCommandRecorder::CloseAndExecute(_In_opt_ ID3D12GraphicsCommandList* command_list) {
   THROW_IF_FAILED(current_command_list_->Close());
 
-  ID3D12GraphicsCommandList* command_lists_to_execute[2] = {};
-  uint32_t command_lists_to_execute_count = 0;
+  // The bundled lists go first, in the order they were given, then what was recorded after them
+  std::vector<ID3D12CommandList*> command_lists_to_execute;
+  command_lists_to_execute.reserve(bundled_command_lists_.size() + 2);
+  for (auto& bundled_command_list : bundled_command_lists_) {
+    command_lists_to_execute.push_back(bundled_command_list.Get());
+  }
 
   if (operations_recorded_in_current_command_list) {
-    command_lists_to_execute[command_lists_to_execute_count++] = current_command_list_.Get();
+    command_lists_to_execute.push_back(current_command_list_.Get());
   }
 
   if (command_list) {
-    command_lists_to_execute[command_lists_to_execute_count++] = command_list;
+    command_lists_to_execute.push_back(command_list);
+  }
+
+  if (!command_lists_to_execute.empty()) {
+    queue_->ExecuteCommandLists(std::span<ID3D12CommandList*>(command_lists_to_execute.data(), command_lists_to_execute.size()));
   }
 
-  if (command_lists_to_execute_count > 0) {
-    queue_->ExecuteCommandLists(std::span<ID3D12CommandList*>(reinterpret_cast<ID3D12CommandList**>(command_lists_to_execute), command_lists_to_execute_count));
+  // A submitted command list can be reset right away, its allocator is only reset once the GPU is done with it
+  bundled_command_lists_.clear();
+  for (auto& recorded_list : bundled_recorded_lists_) {
+    free_command_lists_.push_back(std::move(recorded_list));
   }
+  bundled_recorded_lists_.clear();
 
   cached_command_list_ = current_command_list_;
   current_command_list_ = nullptr;
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 #include <d3d12.h>
 #include <DirectML.h>
 #include "../span.h"
@@ -46,6 +47,9 @@ class DmlCommandRecorder {
       uint64_t src_offset,
       uint64_t byte_count);
 
+  // Prebuilt command lists aren't submitted right away, they're bundled in order with the work recorded before and
+  // after them and submitted by one ExecuteCommandLists at the next CloseAndExecute. fence & completion_value are
+  // signaled once that bundle is done. A null command_list submits the bundle now
   void ExecuteCommandList(
       ID3D12GraphicsCommandList* command_list,
       _Outptr_ ID3D12Fence** fence,
@@ -60,7 +64,7 @@ class DmlCommandRecorder {
   void CloseAndExecute();
 
   bool HasUnsubmittedWork() {
-    return operations_recorded_in_current_command_list;
+    return operations_recorded_in_current_command_list || !bundled_command_lists_.empty();
   }
 
   // Forces the descriptor heap to be reset to D3D before executing future operations
@@ -91,6 +95,12 @@ class DmlCommandRecorder {
   // A cached command list which may be re-used.
   ComPtr<ID3D12GraphicsCommandList> cached_command_list_;
 
+  // The command lists of the next submission in order, prebuilt ones and the recorded ones that came before them. The
+  // recorded ones are reused once submitted
+  std::vector<ComPtr<ID3D12GraphicsCommandList>> bundled_command_lists_;
+  std::vector<ComPtr<ID3D12GraphicsCommandList>> bundled_recorded_lists_;
+  std::vector<ComPtr<ID3D12GraphicsCommandList>> free_command_lists_;
+
   Ort::Allocator& device_allocator_;
   const OrtDmlApi* ort_dml_api_;
 
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
 #include <stdexcept>
 #include <dxcore.h>
 #include <dxcore_interface.h>
@@ -21,7 +23,7 @@ static bool IsSoftwareAdapter(IDXGIAdapter1* adapter) {
   return desc.Flags & DXGI_ADAPTER_FLAG_SOFTWARE || (is_basic_render_driver_vendor_id && is_basic_render_driver_device_id);
 };
 
-static std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters() {
+static std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters(DmlAdapterOptions::Policy policy) {
   ComPtr<IDXGIFactory4> dxgi_factory;
   THROW_IF_FAILED(CreateDXGIFactory(IID_PPV_ARGS(&dxgi_factory)));
 
@@ -29,15 +31,16 @@ static std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters() {
 
   ComPtr<IDXGIFactory6> dxgi_factory6;
   if (SUCCEEDED(dxgi_factory.As(&dxgi_factory6))) {
-    // Enumerate adapters by performance. This only works in Windows 10 Version 1803 and later.
+    // Enumerate adapters by preference. This only works in Windows 10 Version 1803 and later.
+    const auto preference = policy == DmlAdapterOptions::Policy::MinimumPower ? DXGI_GPU_PREFERENCE_MINIMUM_POWER : DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE;
     ComPtr<IDXGIAdapter1> adapter;
     for (uint32_t adapter_index = 0;
          dxgi_factory6->EnumAdapterByGpuPreference(
              adapter_index,
-             DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE,
+             preference,
              IID_PPV_ARGS(&adapter)) != DXGI_ERROR_NOT_FOUND;
          adapter_index++) {
-      // Since we enumerate by performance, we can ignore everything that comes after the first software adapter, which includes the IDD
+      // Since we enumerate by preference, we can ignore everything that comes after the first software adapter, which includes the IDD
       // adapters. This is necessary for now because IDD (e.g. remote desktop) adapters don't have the DXGI_ADAPTER_FLAG_SOFTWARE flag,
       // even though they run on software.
       if (IsSoftwareAdapter(adapter.Get())) {
@@ -72,15 +75,59 @@ static std::vector<ComPtr<IDXGIAdapter1>> EnumerateAdapters() {
     }
   }
 
+  if (policy == DmlAdapterOptions::Policy::DedicatedMemory) {
+    // Stable, so adapters with as much memory stay in the order of preference, like a dGPU over an iGPU's carve out
+    const auto dedicated_memory = [](const ComPtr<IDXGIAdapter1>& adapter) {
+      DXGI_ADAPTER_DESC1 desc = {};
+      THROW_IF_FAILED(adapter->GetDesc1(&desc));
+      return desc.DedicatedVideoMemory;
+    };
+    std::stable_sort(adapter_infos.begin(), adapter_infos.end(), [&](const auto& a, const auto& b) { return dedicated_memory(a) > dedicated_memory(b); });
+  }
+
+  if (adapter_infos.empty())
+    throw std::runtime_error("No DirectX 12 capable hardware adapter was found");
   return adapter_infos;
 }
 
-static ComPtr<IDXGIAdapter1> CreatePerformantAdapter() {
-  auto filtered_adapters = EnumerateAdapters();
-  return filtered_adapters.front();
+static ComPtr<IDXGIAdapter1> SelectAdapter(const DmlAdapterOptions& options) {
+  auto adapters = EnumerateAdapters(options.policy);
+
+  int device_id = options.device_id;
+  if (options.next_device_id) {
+    static std::atomic<int> next_device_id;
+    device_id = next_device_id++ % static_cast<int>(adapters.size());
+  }
+  if (device_id < 0 || device_id >= static_cast<int>(adapters.size()))
+    throw std::runtime_error("The dml device_id " + std::to_string(device_id) + " is out of range, there are " + std::to_string(adapters.size()) + " adapters");
+  return adapters[device_id];
+}
+
+DmlAdapterOptions ParseAdapterOptions(std::span<const std::pair<std::string, std::string>> provider_options) {
+  DmlAdapterOptions options;
+  for (auto& [name, value] : provider_options) {
+    if (name == "adapter_selection") {
+      if (value == "high_performance")
+        options.policy = DmlAdapterOptions::Policy::HighPerformance;
+      else if (value == "minimum_power")
+        options.policy = DmlAdapterOptions::Policy::MinimumPower;
+      else if (value == "dedicated_memory")
+        options.policy = DmlAdapterOptions::Policy::DedicatedMemory;
+      else
+        throw std::runtime_error("Unknown dml adapter_selection " + value + ", it can be high_performance, minimum_power or dedicated_memory");
+    } else if (name == "device_id") {
+      if (value == "next")
+        options.next_device_id = true;
+      else
+        options.device_id = std::stoi(value);
+    } else {
+      throw std::runtime_error("Unknown dml provider option " + name);
+    }
+  }
+  return options;
 }
 
-DmlObjects CreateDmlObjects(const std::string& current_module_path) {
+DmlObjects CreateDmlObjects(const std::string& current_module_path, const DmlAdapterOptions& adapter_options) {
   D3D12_COMMAND_QUEUE_DESC command_queue_description = {
       D3D12_COMMAND_LIST_TYPE_COMPUTE,
       0,
@@ -90,7 +137,7 @@ DmlObjects CreateDmlObjects(const std::string& current_module_path) {
 
   DmlObjects dml_objects;
 
-  auto adapter = CreatePerformantAdapter();
+  auto adapter = SelectAdapter(adapter_options);
 
   ComPtr<ID3D12SDKConfiguration1> d3d12_sdk_config;
   ComPtr<ID3D12DeviceFactory> d3d12_factory;
@@ -161,6 +208,10 @@ DmlReusedCommandListState BuildReusableCommandList(
   ID3D12DescriptorHeap* descriptor_heaps[] = {command_list_state.heap.Get()};
   command_list_state.graphics_command_list->SetDescriptorHeaps(ARRAYSIZE(descriptor_heaps), descriptor_heaps);
 
+  // The list is bundled with others into one submission, so it waits for the writes of the ones before it
+  auto barrier = CD3DX12_RESOURCE_BARRIER::UAV(nullptr);
+  command_list_state.graphics_command_list->ResourceBarrier(1, &barrier);
+
   ComPtr<IDMLCommandRecorder> recorder;
   THROW_IF_FAILED(dml_device->CreateCommandRecorder(IID_PPV_ARGS(recorder.GetAddressOf())));
 
@@ -188,7 +239,7 @@ void ExecuteReusableCommandList(
   DML_BINDING_PROPERTIES exec_binding_props = command_list_state.compiled_operator->GetBindingProperties();
 
   std::vector<DML_BUFFER_BINDING> input_bindings(input_resources.size());
-  std::vector<DML_BINDING_DESC> input_binding_descs(output_resources.size());
+  std::vector<DML_BINDING_DESC> input_binding_descs(input_resources.size());
 
   std::vector<DML_BUFFER_BINDING> output_bindings(output_resources.size());
   std::vector<DML_BINDING_DESC> output_binding_descs(output_resources.size());
@@ -212,12 +263,16 @@ void ExecuteReusableCommandList(
 
     command_list_state.binding_table->BindOutputs(static_cast<uint32_t>(output_binding_descs.size()), output_binding_descs.data());
 
-    // Create the temporary resource
-    if (exec_binding_props.TemporaryResourceSize > 0) {
+    // Create and bind the temporary resource, the state keeps its allocation so it isn't reused while the operator runs
+    if (exec_binding_props.TemporaryResourceSize > 0 && !command_list_state.temporary_tensor) {
       ComPtr<ID3D12Resource> temporary_resource;
-      std::array<int64_t, 1> persistent_resource_shape = {static_cast<int64_t>(exec_binding_props.TemporaryResourceSize)};
-      auto persistent_tensor = OrtValue::CreateTensor(allocator, persistent_resource_shape, ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8);
-      Ort::ThrowOnError(ort_dml_api->GetD3D12ResourceFromAllocation(&allocator, persistent_tensor->GetTensorMutableRawData(), &temporary_resource));
+      std::array<int64_t, 1> temporary_resource_shape = {static_cast<int64_t>(exec_binding_props.TemporaryResourceSize)};
+      command_list_state.temporary_tensor = OrtValue::CreateTensor(allocator, temporary_resource_shape, ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8);
+      Ort::ThrowOnError(ort_dml_api->GetD3D12ResourceFromAllocation(&allocator, command_list_state.temporary_tensor->GetTensorMutableRawData(), &temporary_resource));
+
+      DML_BUFFER_BINDING temporary_binding{temporary_resource.Get(), 0, exec_binding_props.TemporaryResourceSize};
+      DML_BINDING_DESC temporary_binding_desc{DML_BINDING_TYPE_BUFFER, &temporary_binding};
+      command_list_state.binding_table->BindTemporaryResource(&temporary_binding_desc);
     }
   }
 
@@ -292,6 +347,50 @@ ComPtr<IDMLCompiledOperator> CreateCastOperator(
   return compiled_cast_op;
 }
 
+ComPtr<IDMLCompiledOperator> CreateTopKOperator(
+    IDMLDevice* dml_device,
+    uint32_t batch_size,
+    uint32_t vocab_size,
+    uint32_t k) {
+  // DML tensors are at least 4D, the rows are the third dimension
+  std::array<uint32_t, 4> input_sizes{1, 1, batch_size, vocab_size};
+  DML_BUFFER_TENSOR_DESC input_buffer_desc{};
+  input_buffer_desc.Sizes = input_sizes.data();
+  input_buffer_desc.DimensionCount = static_cast<uint32_t>(input_sizes.size());
+  input_buffer_desc.DataType = DML_TENSOR_DATA_TYPE_FLOAT32;
+  input_buffer_desc.TotalTensorSizeInBytes = static_cast<uint64_t>(batch_size) * vocab_size * sizeof(float);
+  DML_TENSOR_DESC input_tensor_desc = {DML_TENSOR_TYPE_BUFFER, &input_buffer_desc};
+
+  std::array<uint32_t, 4> output_sizes{1, 1, batch_size, k};
+  DML_BUFFER_TENSOR_DESC values_buffer_desc{};
+  values_buffer_desc.Sizes = output_sizes.data();
+  values_buffer_desc.DimensionCount = static_cast<uint32_t>(output_sizes.size());
+  values_buffer_desc.DataType = DML_TENSOR_DATA_TYPE_FLOAT32;
+  values_buffer_desc.TotalTensorSizeInBytes = static_cast<uint64_t>(batch_size) * k * sizeof(float);
+  DML_TENSOR_DESC values_tensor_desc = {DML_TENSOR_TYPE_BUFFER, &values_buffer_desc};
+
+  DML_BUFFER_TENSOR_DESC indices_buffer_desc = values_buffer_desc;
+  indices_buffer_desc.DataType = DML_TENSOR_DATA_TYPE_UINT32;
+  DML_TENSOR_DESC indices_tensor_desc = {DML_TENSOR_TYPE_BUFFER, &indices_buffer_desc};
+
+  DML_TOP_K1_OPERATOR_DESC top_k_op_desc{};
+  top_k_op_desc.InputTensor = &input_tensor_desc;
+  top_k_op_desc.OutputValueTensor = &values_tensor_desc;
+  top_k_op_desc.OutputIndexTensor = &indices_tensor_desc;
+  top_k_op_desc.Axis = 3;
+  top_k_op_desc.K = k;
+  top_k_op_desc.AxisDirection = DML_AXIS_DIRECTION_DECREASING;
+  DML_OPERATOR_DESC top_k_op_dml_desc = {DML_OPERATOR_TOP_K1, &top_k_op_desc};
+
+  ComPtr<IDMLOperator> top_k_op;
+  THROW_IF_FAILED(dml_device->CreateOperator(&top_k_op_dml_desc, IID_PPV_ARGS(&top_k_op)));
+
+  ComPtr<IDMLCompiledOperator> compiled_top_k_op;
+  THROW_IF_FAILED(dml_device->CompileOperator(top_k_op.Get(), DML_EXECUTION_FLAG_DESCRIPTORS_VOLATILE, IID_PPV_ARGS(&compiled_top_k_op)));
+
+  return compiled_top_k_op;
+}
+
 void GetNextDispatchSize(
     uint32_t element_count,
     uint32_t num_threads,
@@ -434,6 +533,74 @@ void DmlCastInputToOutput(
       rebind);
 }
 
+void DmlTopK(
+    DmlExecutionContext* execution_context,
+    OrtAllocator& allocator,
+    OrtValue& logits,
+    OrtValue& values,
+    OrtValue& indices,
+    IDMLDevice* dml_device,
+    const OrtDmlApi* ort_dml_api,
+    DmlReusedCommandListState& command_list_state) {
+  auto logits_shape_info = logits.GetTensorTypeAndShapeInfo();
+  const auto vocab_size = static_cast<uint32_t>(logits_shape_info->GetShape().back());
+  const auto batch_size = static_cast<uint32_t>(logits_shape_info->GetElementCount() / vocab_size);
+  const auto k = static_cast<uint32_t>(values.GetTensorTypeAndShapeInfo()->GetShape().back());
+
+  // The shapes are fixed for a generator, so the operator is only compiled on the first call
+  if (!command_list_state.compiled_operator) {
+    auto compiled_top_k_operator = DmlHelpers::CreateTopKOperator(dml_device, batch_size, vocab_size, k);
+
+    ComPtr<ID3D12Resource> persistent_resource;
+    uint64_t persistent_resource_size = compiled_top_k_operator->GetBindingProperties().PersistentResourceSize;
+
+    std::optional<DML_BUFFER_BINDING> persistent_resource_binding;
+
+    if (persistent_resource_size > 0) {
+      std::array<int64_t, 1> persistent_resource_shape = {static_cast<int64_t>(persistent_resource_size)};
+      auto persistent_tensor = OrtValue::CreateTensor(allocator, persistent_resource_shape, ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8);
+      Ort::ThrowOnError(ort_dml_api->GetD3D12ResourceFromAllocation(&allocator, persistent_tensor->GetTensorMutableRawData(), &persistent_resource));
+      persistent_resource_binding = DML_BUFFER_BINDING{persistent_resource.Get(), 0, persistent_resource_size};
+    }
+
+    DML_BINDING_DESC persistent_resource_bindingDesc = persistent_resource_binding
+                                                           ? DML_BINDING_DESC{DML_BINDING_TYPE_BUFFER, &*persistent_resource_binding}
+                                                           : DML_BINDING_DESC{DML_BINDING_TYPE_NONE, nullptr};
+
+    DML_BINDING_DESC input_array_binding_desc = DML_BINDING_DESC{DML_BINDING_TYPE_NONE, nullptr};
+    execution_context->InitializeOperator(compiled_top_k_operator.Get(), persistent_resource_bindingDesc, input_array_binding_desc);
+    command_list_state = DmlHelpers::BuildReusableCommandList(dml_device, compiled_top_k_operator.Get(), persistent_resource.Get(), persistent_resource_binding);
+  }
+
+  ComPtr<ID3D12Resource> logits_resource;
+  Ort::ThrowOnError(ort_dml_api->GetD3D12ResourceFromAllocation(&allocator, logits.GetTensorMutableData<uint8_t>(), &logits_resource));
+
+  ComPtr<ID3D12Resource> values_resource;
+  Ort::ThrowOnError(ort_dml_api->GetD3D12ResourceFromAllocation(&allocator, values.GetTensorMutableData<uint8_t>(), &values_resource));
+
+  ComPtr<ID3D12Resource> indices_resource;
+  Ort::ThrowOnError(ort_dml_api->GetD3D12ResourceFromAllocation(&allocator, indices.GetTensorMutableData<uint8_t>(), &indices_resource));
+
+  std::array<ID3D12Resource*, 1> input_resources = {logits_resource.Get()};
+  std::array<uint64_t, 1> input_sizes = {static_cast<uint64_t>(batch_size) * vocab_size * sizeof(float)};
+
+  std::array<ID3D12Resource*, 2> output_resources = {values_resource.Get(), indices_resource.Get()};
+  std::array<uint64_t, 2> output_sizes = {static_cast<uint64_t>(batch_size) * k * sizeof(float), static_cast<uint64_t>(batch_size) * k * sizeof(uint32_t)};
+
+  // The logits tensor can be a different allocation every step, so the bindings are always updated
+  command_list_state.source_resource = std::move(logits_resource);
+  DmlHelpers::ExecuteReusableCommandList(
+      execution_context,
+      command_list_state,
+      allocator,
+      ort_dml_api,
+      input_resources,
+      input_sizes,
+      output_resources,
+      output_sizes,
+      true);
+}
+
 bool IsIntelDevice(ID3D12Device* d3d12_device) {
   return AdapterInfo(d3d12_device).IsIntel();
 }
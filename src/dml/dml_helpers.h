@@ -18,6 +18,7 @@ struct DmlReusedCommandListState {
   Microsoft::WRL::ComPtr<ID3D12Resource> persistent_resource;
   Microsoft::WRL::ComPtr<ID3D12Resource> source_resource;
   Microsoft::WRL::ComPtr<ID3D12Resource> target_resource;
+  std::unique_ptr<OrtValue> temporary_tensor;  // Keeps the allocation of the temporary resource while it's bound
   OrtValue* previousInput = nullptr;
   OrtValue* previousOutput = nullptr;
 };
@@ -30,8 +31,24 @@ struct DmlObjects {
   ComPtr<ID3D12Resource> upload_buffer;
 };
 
+// How a model picks its adapter, from the dml provider options "adapter_selection" and "device_id"
+struct DmlAdapterOptions {
+  enum class Policy {
+    HighPerformance,  // "high_performance", the adapters in the order of DXGI's high performance preference
+    MinimumPower,     // "minimum_power", like an integrated GPU first
+    DedicatedMemory,  // "dedicated_memory", the most dedicated video memory first
+  };
+  Policy policy{Policy::HighPerformance};
+
+  // The adapter of the policy's order to use, or with next_device_id set, each model takes the one after the last
+  // model's, wrapping around, so loading a model once per adapter puts an instance on every one
+  int device_id{};
+  bool next_device_id{};
+};
+
 namespace DmlHelpers {
-DmlObjects CreateDmlObjects(const std::string& current_module_path);
+DmlAdapterOptions ParseAdapterOptions(std::span<const std::pair<std::string, std::string>> provider_options);
+DmlObjects CreateDmlObjects(const std::string& current_module_path, const DmlAdapterOptions& adapter_options);
 
 DmlReusedCommandListState BuildReusableCommandList(
     IDMLDevice* dml_device,
@@ -56,6 +73,13 @@ ComPtr<IDMLCompiledOperator> CreateCastOperator(
     DML_TENSOR_DATA_TYPE source_data_type,
     DML_TENSOR_DATA_TYPE target_data_type);
 
+// Top k along the last dimension of {batch_size, vocab_size} fp32 values, largest first, with uint32 indices
+ComPtr<IDMLCompiledOperator> CreateTopKOperator(
+    IDMLDevice* dml_device,
+    uint32_t batch_size,
+    uint32_t vocab_size,
+    uint32_t k);
+
 void GetNextDispatchSize(
     uint32_t element_count,
     uint32_t num_threads,
@@ -73,5 +97,17 @@ void DmlCastInputToOutput(
     const OrtDmlApi* ort_dml_api,
     DmlReusedCommandListState& command_list_state);
 
+// Writes the top k logits of every row and their indices to values & indices, both {batch_size, k}, where k is the
+// last dimension of values. The logits are fp32 with the vocabulary as the last dimension
+void DmlTopK(
+    DmlExecutionContext* execution_context,
+    OrtAllocator& allocator,
+    OrtValue& logits,
+    OrtValue& values,
+    OrtValue& indices,
+    IDMLDevice* dml_device,
+    const OrtDmlApi* ort_dml_api,
+    DmlReusedCommandListState& command_list_state);
+
 bool IsIntelDevice(ID3D12Device* d3d12_device);
 }  // namespace DmlHelpers
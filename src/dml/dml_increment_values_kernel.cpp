@@ -86,6 +86,10 @@ DmlIncrementValuesKernel::DmlIncrementValuesKernel(
   ID3D12DescriptorHeap* descriptor_heaps[] = {heap_.Get()};
   graphics_command_list_->SetDescriptorHeaps(ARRAYSIZE(descriptor_heaps), descriptor_heaps);
 
+  // The list is bundled with others into one submission, so it waits for the writes of the ones before it
+  auto barrier = CD3DX12_RESOURCE_BARRIER::UAV(nullptr);
+  graphics_command_list_->ResourceBarrier(1, &barrier);
+
   // Set the root signature and pipeline state
   graphics_command_list_->SetComputeRootSignature(root_signature_.Get());
   graphics_command_list_->SetPipelineState(pipeline_state_.Get());
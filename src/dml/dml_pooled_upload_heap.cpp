@@ -165,11 +165,11 @@ DmlGpuEvent DmlPooledUploadHeap::BeginUploadToGpu(
       D3D12_RESOURCE_STATE_GENERIC_READ,
       src.size());
 
+  // The copy is left for the next flush, which submits it with the rest of the step's work. State::Run flushes before
+  // every session run, and as ORT runs on the same command queue the copy is done before the run reads dst. The
+  // allocation is only reused once done_event is signaled
   DmlGpuEvent done_event = execution_context_->GetCurrentCompletionEvent();
 
-  execution_context_->Flush();
-  done_event.WaitForSignal();
-
   // Add an allocation entry to the chunk
   chunk->allocations.push_back(Allocation{static_cast<size_t>(src.size()), offset_in_chunk, done_event});
 
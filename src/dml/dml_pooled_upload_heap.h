@@ -17,7 +17,8 @@ class DmlPooledUploadHeap {
   DmlPooledUploadHeap(ID3D12Device* device, DmlExecutionContext* execution_context);
 
   // Makes a copy of the source data and begins copying it into the destination resource, and returns a GpuEvent
-  // which will become signaled when the copy is complete. The destination resource must be a default or readback
+  // which will become signaled when the copy is complete. The copy is submitted but not waited on, so it's only
+  // ordered before later work on the same command queue. The destination resource must be a default or readback
   // buffer.
   DmlGpuEvent BeginUploadToGpu(
       ID3D12Resource* dst,
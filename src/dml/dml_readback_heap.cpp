@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <wil/result.h>
 #include <stdexcept>
+#include <algorithm>
 #include "dml_readback_heap.h"
 #include "dml_execution_context.h"
 
@@ -43,21 +44,27 @@ static size_t ComputeNewCapacity(size_t existing_capacity, size_t desired_capaci
   return new_capacity;
 }
 
-void DmlReadbackHeap::EnsureReadbackHeap(size_t size) {
-  if (!readback_heap_) {
+void DmlReadbackHeap::EnsureReadbackHeap(ReadbackBuffer& buffer, size_t size) {
+  if (!buffer.resource) {
     // Initialize the readback heap for the first time
-    assert(capacity_ == 0);
-    capacity_ = ComputeNewCapacity(c_initial_capacity, size);
-    readback_heap_ = CreateReadbackHeap(device_.Get(), capacity_);
-  } else if (capacity_ < size) {
+    assert(buffer.capacity == 0);
+    buffer.capacity = ComputeNewCapacity(c_initial_capacity, size);
+    buffer.resource = CreateReadbackHeap(device_.Get(), buffer.capacity);
+  } else if (buffer.capacity < size) {
     // Ensure there's sufficient capacity
-    capacity_ = ComputeNewCapacity(capacity_, size);
+    buffer.capacity = ComputeNewCapacity(buffer.capacity, size);
 
-    readback_heap_ = nullptr;
-    readback_heap_ = CreateReadbackHeap(device_.Get(), capacity_);
+    buffer.resource = nullptr;
+    buffer.resource = CreateReadbackHeap(device_.Get(), buffer.capacity);
   }
 
-  assert(readback_heap_->GetDesc().Width >= size);
+  assert(buffer.resource->GetDesc().Width >= size);
+}
+
+void DmlReadbackHeap::WaitForReadback(ReadbackBuffer& buffer) {
+  // The copies were already flushed when they were recorded
+  buffer.done_event.WaitForSignal();
+  execution_context_->ReleaseCompletedReferences();
 }
 
 void DmlReadbackHeap::ReadbackFromGpu(
@@ -67,11 +74,16 @@ void DmlReadbackHeap::ReadbackFromGpu(
     D3D12_RESOURCE_STATES src_state) {
   assert(!dst.empty());
 
-  EnsureReadbackHeap(dst.size());
+  // Blocking readbacks can use any buffer that no readback is pending on
+  auto it = std::find_if(buffers_.begin(), buffers_.end(), [](const ReadbackBuffer& b) { return !b.pending; });
+  if (it == buffers_.end())
+    throw std::runtime_error("Too many pending DML readbacks, EndReadbackFromGpu must be called first");
+  ReadbackBuffer& buffer = *it;
+  EnsureReadbackHeap(buffer, dst.size());
 
   // Copy from the source resource into the readback heap
   execution_context_->CopyBufferRegion(
-      readback_heap_.Get(),
+      buffer.resource.Get(),
       0,
       D3D12_RESOURCE_STATE_COPY_DEST,
       src,
@@ -80,15 +92,15 @@ void DmlReadbackHeap::ReadbackFromGpu(
       dst.size());
 
   // Wait for completion and map the result
+  buffer.done_event = execution_context_->GetCurrentCompletionEvent();
   execution_context_->Flush();
-  execution_context_->GetCurrentCompletionEvent().WaitForSignal();
-  execution_context_->ReleaseCompletedReferences();
+  WaitForReadback(buffer);
 
   // Map the readback heap and copy it into the destination
   void* readback_heap_data = nullptr;
-  THROW_IF_FAILED(readback_heap_->Map(0, nullptr, &readback_heap_data));
+  THROW_IF_FAILED(buffer.resource->Map(0, nullptr, &readback_heap_data));
   memcpy(dst.data(), readback_heap_data, dst.size());
-  readback_heap_->Unmap(0, nullptr);
+  buffer.resource->Unmap(0, nullptr);
 }
 
 void DmlReadbackHeap::ReadbackFromGpu(
@@ -97,49 +109,78 @@ void DmlReadbackHeap::ReadbackFromGpu(
     std::span<ID3D12Resource*> src,
     D3D12_RESOURCE_STATES src_state) {
   assert(dst.size() == src.size());
-  assert(dst_sizes.size() == src.size());
 
   if (dst.empty()) {
     return;
   }
 
+  EndReadbackFromGpu(BeginReadbackFromGpu(dst_sizes, src, src_state), dst, dst_sizes);
+}
+
+size_t DmlReadbackHeap::BeginReadbackFromGpu(
+    std::span<const uint32_t> sizes,
+    std::span<ID3D12Resource*> src,
+    D3D12_RESOURCE_STATES src_state) {
+  assert(sizes.size() == src.size());
+
+  const size_t readback = next_buffer_;
+  ReadbackBuffer& buffer = buffers_[readback];
+  if (buffer.pending)
+    throw std::runtime_error("Too many pending DML readbacks, EndReadbackFromGpu must be called first");
+
   uint32_t total_size = 0;
-  for (auto size : dst_sizes) {
+  for (auto size : sizes) {
     total_size += size;
   }
 
-  EnsureReadbackHeap(total_size);
+  EnsureReadbackHeap(buffer, total_size);
 
-  // Copy from the source resource into the readback heap
+  // Copy from the source resources into the readback heap
   uint32_t offset = 0;
-  for (uint32_t i = 0; i < dst.size(); ++i) {
+  for (uint32_t i = 0; i < src.size(); ++i) {
     execution_context_->CopyBufferRegion(
-        readback_heap_.Get(),
+        buffer.resource.Get(),
         offset,
         D3D12_RESOURCE_STATE_COPY_DEST,
         src[i],
         0,
         src_state,
-        dst_sizes[i]);
+        sizes[i]);
 
-    offset += dst_sizes[i];
+    offset += sizes[i];
   }
 
-  // Wait for completion and map the result
+  // Submit the copies, but don't wait for them
+  buffer.done_event = execution_context_->GetCurrentCompletionEvent();
   execution_context_->Flush();
-  execution_context_->GetCurrentCompletionEvent().WaitForSignal();
-  execution_context_->ReleaseCompletedReferences();
+  buffer.pending = true;
+
+  next_buffer_ = (next_buffer_ + 1) % c_ring_size;
+  return readback;
+}
+
+void DmlReadbackHeap::EndReadbackFromGpu(
+    size_t readback,
+    std::span<void*> dst,
+    std::span<const uint32_t> dst_sizes) {
+  assert(dst.size() == dst_sizes.size());
+
+  ReadbackBuffer& buffer = buffers_.at(readback);
+  if (!buffer.pending)
+    throw std::runtime_error("EndReadbackFromGpu called for a readback that isn't pending");
+  buffer.pending = false;
+
+  WaitForReadback(buffer);
 
   // Map the readback heap and copy it into the destination
   void* readback_heap_data = nullptr;
-  THROW_IF_FAILED(readback_heap_->Map(0, nullptr, &readback_heap_data));
+  THROW_IF_FAILED(buffer.resource->Map(0, nullptr, &readback_heap_data));
 
-  // Copy from the source resource into the readback heap
-  offset = 0;
+  uint32_t offset = 0;
   for (uint32_t i = 0; i < dst.size(); ++i) {
     memcpy(dst[i], static_cast<uint8_t*>(readback_heap_data) + offset, dst_sizes[i]);
     offset += dst_sizes[i];
   }
 
-  readback_heap_->Unmap(0, nullptr);
-}
\ No newline at end of file
+  buffer.resource->Unmap(0, nullptr);
+}
@@ -3,11 +3,14 @@
 
 #pragma once
 
+#include <array>
 #include <d3d12.h>
+#include "dml_gpu_event.h"
 #include "dml_execution_context.h"
 
-// Because we never perform more than one readback at a time, we don't need anything fancy for managing the
-// readback heap - just maintain a single resource and reallocate it if it's not big enough.
+// A small ring of readback buffers, each a single resource that's reallocated when it's not big enough. A readback
+// can be started with BeginReadbackFromGpu and finished later with EndReadbackFromGpu, so the CPU can keep recording
+// or preparing work while the copy runs, and the next readback goes to a different buffer than the one still pending.
 class DmlReadbackHeap {
  public:
   DmlReadbackHeap(ID3D12Device* device, DmlExecutionContext* execution_context);
@@ -27,14 +30,37 @@ class DmlReadbackHeap {
       std::span<ID3D12Resource*> src,
       D3D12_RESOURCE_STATES src_state);
 
- private:
-  void EnsureReadbackHeap(size_t size);
+  // Records and submits the copies of the whole src resources into the next readback buffer without waiting for them,
+  // and returns the readback to pass to EndReadbackFromGpu. At most c_ring_size readbacks can be pending at a time.
+  size_t BeginReadbackFromGpu(
+      std::span<const uint32_t> sizes,
+      std::span<ID3D12Resource*> src,
+      D3D12_RESOURCE_STATES src_state);
+
+  // Waits for a readback started by BeginReadbackFromGpu, then copies its data into dst. dst_sizes must match the
+  // sizes it was started with
+  void EndReadbackFromGpu(
+      size_t readback,
+      std::span<void*> dst,
+      std::span<const uint32_t> dst_sizes);
 
+ private:
   static constexpr size_t c_initial_capacity = 1024 * 1024;  // 1MB
+  static constexpr size_t c_ring_size = 2;
+
+  struct ReadbackBuffer {
+    ComPtr<ID3D12Resource> resource;
+    size_t capacity = 0;
+    DmlGpuEvent done_event{};  // Signaled when the copies into the buffer are complete
+    bool pending = false;      // Started but not yet ended
+  };
+
+  void EnsureReadbackHeap(ReadbackBuffer& buffer, size_t size);
+  void WaitForReadback(ReadbackBuffer& buffer);
 
   ComPtr<ID3D12Device> device_;
   DmlExecutionContext* execution_context_;
 
-  ComPtr<ID3D12Resource> readback_heap_;
-  size_t capacity_ = 0;
-};
\ No newline at end of file
+  std::array<ReadbackBuffer, c_ring_size> buffers_;
+  size_t next_buffer_ = 0;
+};
@@ -0,0 +1,107 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "float16.h"
+#include "cpu_features.h"
+#include "models/utils.h"
+
+namespace Generators {
+
+namespace {
+
+struct Kernels {
+  void (*Fp16ToFp32)(const uint16_t* src, float* dst, size_t n);
+  void (*Fp32ToFp16)(const float* src, uint16_t* dst, size_t n);
+};
+
+void Fp16ToFp32Scalar(const uint16_t* src, float* dst, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = FastFloat16ToFloat32(src[i]);
+}
+
+void Fp32ToFp16Scalar(const float* src, uint16_t* dst, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = FastFloat32ToFloat16(src[i]);
+}
+
+constexpr Kernels c_scalar_kernels{Fp16ToFp32Scalar, Fp32ToFp16Scalar};
+
+#if GENERATORS_X64
+
+GENERATORS_TARGET_AVX2 void Fp16ToFp32Avx2(const uint16_t* src, float* dst, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+  Fp16ToFp32Scalar(src + i, dst + i, n - i);
+}
+
+GENERATORS_TARGET_AVX2 void Fp32ToFp16Avx2(const float* src, uint16_t* dst, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+  Fp32ToFp16Scalar(src + i, dst + i, n - i);
+}
+
+GENERATORS_TARGET_AVX512 void Fp16ToFp32Avx512(const uint16_t* src, float* dst, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i))));
+  Fp16ToFp32Scalar(src + i, dst + i, n - i);
+}
+
+GENERATORS_TARGET_AVX512 void Fp32ToFp16Avx512(const float* src, uint16_t* dst, size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+  Fp32ToFp16Scalar(src + i, dst + i, n - i);
+}
+
+constexpr Kernels c_avx2_kernels{Fp16ToFp32Avx2, Fp32ToFp16Avx2};
+constexpr Kernels c_avx512_kernels{Fp16ToFp32Avx512, Fp32ToFp16Avx512};
+
+const Kernels& GetKernels() {
+  static const Kernels& kernels = HasAvx512() ? c_avx512_kernels : HasAvx2() ? c_avx2_kernels
+                                                                               : c_scalar_kernels;
+  return kernels;
+}
+
+#elif GENERATORS_NEON
+
+void Fp16ToFp32Neon(const uint16_t* src, float* dst, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(src + i))));
+  Fp16ToFp32Scalar(src + i, dst + i, n - i);
+}
+
+void Fp32ToFp16Neon(const float* src, uint16_t* dst, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    vst1_u16(dst + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(src + i))));
+  Fp32ToFp16Scalar(src + i, dst + i, n - i);
+}
+
+constexpr Kernels c_neon_kernels{Fp16ToFp32Neon, Fp32ToFp16Neon};
+
+const Kernels& GetKernels() { return c_neon_kernels; }
+
+#else
+
+const Kernels& GetKernels() { return c_scalar_kernels; }
+
+#endif
+
+}  // namespace
+
+void Fp16ToFp32(std::span<const uint16_t> fp16, std::span<float> fp32) {
+  assert(fp16.size() == fp32.size());
+  GetKernels().Fp16ToFp32(fp16.data(), fp32.data(), fp16.size());
+}
+
+void Fp32ToFp16(std::span<const float> fp32, std::span<uint16_t> fp16) {
+  assert(fp32.size() == fp16.size());
+  GetKernels().Fp32ToFp16(fp32.data(), fp16.data(), fp32.size());
+}
+
+}  // namespace Generators
@@ -0,0 +1,12 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// Converts the logits and inputs of fp16 models, using F16C (checked along with AVX2), AVX-512 or NEON when the CPU has it.
+// The vector conversions round to nearest even and keep infinities and NaNs, only the scalar tails are the Fast* ones
+void Fp16ToFp32(std::span<const uint16_t> fp16, std::span<float> fp32);
+void Fp32ToFp16(std::span<const float> fp32, std::span<uint16_t> fp16);
+
+}  // namespace Generators
@@ -5,8 +5,12 @@
 #include "sequences.h"
 #include "models/model.h"
 #include "search.h"
+#include "constrained_decoding.h"
+#include "models/embedding_state.h"
+#include "models/audio_features.h"
 #if USE_CUDA
 #include "search_cuda.h"
+#include "models/kernels.h"
 #endif
 
 namespace Generators {
@@ -25,7 +29,75 @@ void Shutdown() {
 }
 
 OrtEnv& GetOrtEnv() {
-  return *GetOrtGlobals()->env_;
+  auto& globals = *GetOrtGlobals();
+  globals.env_in_use_ = true;
+  return *globals.env_;
+}
+
+void SetGlobalThreadPools(int intra_op_num_threads, int inter_op_num_threads) {
+  if (intra_op_num_threads < 0 || inter_op_num_threads < 0)
+    throw std::runtime_error("Thread counts must be 0 or greater");
+
+  auto& globals = *GetOrtGlobals();
+  if (globals.env_in_use_)
+    throw std::runtime_error("SetGlobalThreadPools must be called before any model is created");
+
+  auto threading_options = OrtThreadingOptions::Create();
+  threading_options->SetGlobalIntraOpNumThreads(intra_op_num_threads);
+  threading_options->SetGlobalInterOpNumThreads(inter_op_num_threads);
+  globals.env_ = OrtEnv::Create(threading_options.get(), OrtLoggingLevel::ORT_LOGGING_LEVEL_ERROR);
+  globals.global_thread_pools_ = true;
+
+  // The search runs between model runs, when the intra op threads are idle, so it gets the same number of cores
+  globals.thread_pool_ = std::make_unique<ThreadPool>(intra_op_num_threads > 0 ? intra_op_num_threads : std::thread::hardware_concurrency());
+}
+
+ThreadPool& GetThreadPool() {
+  // Generators on other threads can ask for it at the same time
+  auto& globals = *GetOrtGlobals();
+  std::call_once(globals.thread_pool_once_, [&globals] {
+    if (!globals.thread_pool_)
+      globals.thread_pool_ = std::make_unique<ThreadPool>(std::thread::hardware_concurrency());
+  });
+  return *globals.thread_pool_;
+}
+
+OrtPrepackedWeightsContainer& GetPrepackedWeightsContainer(int numa_node) {
+  auto& globals = *GetOrtGlobals();
+  std::lock_guard<std::mutex> lock{globals.prepacked_weights_mutex_};
+  auto& container = globals.prepacked_weights_containers_[numa_node];
+  if (!container)
+    container = OrtPrepackedWeightsContainer::Create();
+  return *container;
+}
+
+void SetAsyncThreadCount(int thread_count) {
+  if (thread_count < 0)
+    throw std::runtime_error("Thread count must be 0 or greater");
+
+  // The queue is created here with the count, unless an asynchronous step already created it with the default one
+  auto& globals = *GetOrtGlobals();
+  bool created = false;
+  std::call_once(globals.async_queue_once_, [&] {
+    globals.async_queue_ = std::make_unique<TaskQueue>(thread_count > 0 ? thread_count : std::thread::hardware_concurrency());
+    created = true;
+  });
+  if (!created)
+    throw std::runtime_error("SetAsyncThreadCount must be called before the first asynchronous step");
+}
+
+TaskQueue& GetAsyncQueue() {
+  auto& globals = *GetOrtGlobals();
+  std::call_once(globals.async_queue_once_, [&globals] {
+    globals.async_queue_ = std::make_unique<TaskQueue>(std::thread::hardware_concurrency());
+  });
+  return *globals.async_queue_;
+}
+
+DeadlineTimer& GetDeadlineTimer() {
+  auto& globals = *GetOrtGlobals();
+  std::call_once(globals.deadline_timer_once_, [&globals] { globals.deadline_timer_ = std::make_unique<DeadlineTimer>(); });
+  return *globals.deadline_timer_;
 }
 
 std::string to_string(DeviceType device_type) {
@@ -44,16 +116,32 @@ GeneratorParams::GeneratorParams(const Model& model)
     : search{model.config_->search},
       pad_token_id{model.config_->model.pad_token_id},
       eos_token_id{model.config_->model.eos_token_id},
-      vocab_size{model.config_->model.vocab_size},
       hidden_size{model.config_->model.decoder.hidden_size},
       device_type{model.device_type_},
       cuda_stream{model.cuda_stream_},
       is_cuda_graph_enabled_{IsCudaGraphEnabled(model.config_->model.decoder.session_options)},
-      config_{model.config_.get()} {
+      config_{model.config_.get()},
+      model_{model.shared_from_this()} {
   use_cuda_graph = is_cuda_graph_enabled_;
   if (use_cuda_graph) {
     max_batch_size = 1;  // set it to 1 by default
   }
+
+  SetLogitsRows(model);
+}
+
+void GeneratorParams::SetLogitsRows(const Model& model) {
+  const auto& model_config = model.config_->model;
+  eos_token_ids = model_config.eos_token_ids;
+  vocab_size = model_config.vocab_size;
+  eos_logits_index = eos_token_id;
+  logits_token_ids = {};
+  if (!model_config.logits_token_ids.empty()) {
+    logits_token_ids = model_config.logits_token_ids;
+    vocab_size = static_cast<int>(logits_token_ids.size());
+    eos_logits_index = model_config.logits_eos_rows.front();
+    eos_token_ids = model_config.logits_eos_rows.size() > 1 ? std::span<const int>{model_config.logits_eos_rows} : std::span<const int>{};
+  }
 }
 
 void GeneratorParams::TryGraphCapture(int max_bs) {
@@ -73,6 +161,12 @@ void GeneratorParams::TryGraphCapture(int max_bs) {
   }
 }
 
+Config::Search& GeneratorParams::GetMutableRowSearch(size_t batch_id) {
+  if (batch_id >= row_search.size())
+    row_search.resize(batch_id + 1, search);
+  return row_search[batch_id];
+}
+
 void GeneratorParams::SetInputs(const NamedTensors& named_tensors) {
   for (const auto& [name, tensor] : named_tensors) {
     if (name == Config::Defaults::InputIdsName) {
@@ -89,6 +183,96 @@ void GeneratorParams::SetInputs(const NamedTensors& named_tensors) {
   }
 }
 
+void GeneratorParams::SetRestoredState(std::span<const uint8_t> data) {
+  if (!model_)
+    throw std::runtime_error("A saved state can only be restored with generator params created for a model");
+  restored_prefix = PrefixCache::Entry::Deserialize(*model_, data, cuda_stream);
+}
+
+std::shared_ptr<GeneratorParams> GeneratorParams::CopyFor(const Model& model) const {
+  auto params = std::make_shared<GeneratorParams>(*this);
+  params->external_owner_ = nullptr;
+  if (input_ids.data() == input_ids_owner.data())
+    params->input_ids = params->input_ids_owner;
+  if (IsForModel(model))
+    return params;
+
+  // The replicas load the same config, so only where the spans point and the device change
+  params->config_ = model.config_.get();
+  params->model_ = model.shared_from_this();
+  params->cuda_stream = model.cuda_stream_;
+  params->SetLogitsRows(model);
+  if (restored_prefix) {
+    model_->MakeDeviceCurrent();
+    const auto data = restored_prefix->Serialize(*model_, model_->cuda_stream_);
+    model.MakeDeviceCurrent();
+    params->restored_prefix = PrefixCache::Entry::Deserialize(model, data, model.cuda_stream_);
+  }
+  return params;
+}
+
+void GeneratorParams::SetWhisperInputFeatures(std::span<const Tensor* const> clips) {
+  if (clips.empty())
+    throw std::runtime_error("SetWhisperInputFeatures needs at least one clip");
+
+  int64_t mel_count{}, max_frame_count{};
+  for (const auto* clip : clips) {
+    auto type_info = clip->ort_tensor_->GetTensorTypeAndShapeInfo();
+    const auto shape = type_info->GetShape();
+    if (type_info->GetElementType() != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT || shape.size() != 3 || shape[0] != 1)
+      throw std::runtime_error("Whisper input feature clips must be float32 shaped [1, number_of_mels, number_of_frames]");
+    if (mel_count != 0 && shape[1] != mel_count)
+      throw std::runtime_error("Whisper input feature clips must all have the same number_of_mels");
+    mel_count = shape[1];
+    max_frame_count = std::max(max_frame_count, shape[2]);
+  }
+
+  const auto clip_count = static_cast<int64_t>(clips.size());
+  auto batch = OrtValue::CreateTensor<float>(Ort::Allocator::GetWithDefaultOptions(), std::array<int64_t, 3>{clip_count, mel_count, max_frame_count});
+  auto* target = batch->GetTensorMutableData<float>();
+  for (const auto* clip : clips) {
+    const int64_t frame_count = clip->ort_tensor_->GetTensorTypeAndShapeInfo()->GetShape()[2];
+    const float* source = clip->ort_tensor_->GetTensorData<float>();
+    const float pad = *std::min_element(source, source + mel_count * frame_count);
+    for (int64_t mel = 0; mel < mel_count; mel++, source += frame_count, target += max_frame_count) {
+      std::copy(source, source + frame_count, target);
+      std::fill(target + frame_count, target + max_frame_count, pad);
+    }
+  }
+
+  inputs.emplace<Whisper>().input_features = std::make_shared<Tensor>(std::move(batch));
+}
+
+void GeneratorParams::SetWhisperAudio(std::span<const std::span<const float>> clips, int sample_rate, int mel_count, bool pad_to_30_seconds) {
+  if (clips.empty())
+    throw std::runtime_error("SetWhisperAudio needs at least one clip");
+  if (mel_count < 1)
+    throw std::runtime_error("mel_count must be 1 or greater, is " + std::to_string(mel_count));
+
+  std::vector<std::vector<float>> resampled;
+  size_t max_length{};
+  for (auto clip : clips) {
+    resampled.push_back(ResampleTo16kHz(clip, sample_rate));
+    max_length = std::max(max_length, resampled.back().size());
+  }
+
+  size_t frame_count = std::max<size_t>(1, (max_length + c_whisper_hop_length - 1) / c_whisper_hop_length);
+  if (pad_to_30_seconds) {
+    if (frame_count > c_whisper_frame_count)
+      throw std::runtime_error("Audio clips padded to 30 seconds can't be longer, transcribe longer audio in chunks");
+    frame_count = c_whisper_frame_count;
+  }
+
+  const auto clip_count = static_cast<int64_t>(clips.size());
+  auto batch = OrtValue::CreateTensor<float>(Ort::Allocator::GetWithDefaultOptions(), std::array<int64_t, 3>{clip_count, mel_count, static_cast<int64_t>(frame_count)});
+  auto* features = batch->GetTensorMutableData<float>();
+  const size_t clip_size = mel_count * frame_count;
+  for (size_t i = 0; i < resampled.size(); i++)
+    ComputeLogMelSpectrogram(resampled[i], mel_count, {features + i * clip_size, clip_size});
+
+  inputs.emplace<Whisper>().input_features = std::make_shared<Tensor>(std::move(batch));
+}
+
 std::unique_ptr<Generator> CreateGenerator(const Model& model, const GeneratorParams& params) {
   return std::make_unique<Generator>(model, params);
 }
@@ -108,6 +292,32 @@ std::unique_ptr<Search> CreateSearch(const GeneratorParams& params) {
   return std::make_unique<GreedySearch_Cpu>(params);
 }
 
+// Left pads the prompts to the smallest model.decoder.graph_capture_prompt_lengths bucket that fits them, so the prompt run
+// replays that bucket's captured graph. Longer prompts are left as they are and run without one. Only when asked for with
+// search.pad_to_prompt_graph, as the pad tokens stay in the sequence and take up part of max_length
+static void PadToPromptGraph(const Model& model, GeneratorParams& params) {
+  const auto& buckets = model.config_->model.decoder.graph_capture_prompt_lengths;
+  if (!params.search.pad_to_prompt_graph || !params.use_cuda_graph || buckets.empty() || params.restored_prefix)
+    return;
+  auto bucket = std::lower_bound(buckets.begin(), buckets.end(), params.sequence_length);
+  if (bucket == buckets.end() || *bucket == params.sequence_length || *bucket >= params.search.max_length)
+    return;
+  if (std::any_of(params.row_search.begin(), params.row_search.end(), [&](const Config::Search& row) { return row.max_length <= *bucket; }))
+    return;
+
+  const size_t padding = *bucket - params.sequence_length;
+  std::vector<int32_t> input_ids;
+  input_ids.reserve(static_cast<size_t>(params.batch_size) * *bucket);
+  for (int i = 0; i < params.batch_size; i++) {
+    input_ids.insert(input_ids.end(), padding, params.pad_token_id);
+    auto row = params.input_ids.subspan(static_cast<size_t>(i) * params.sequence_length, params.sequence_length);
+    input_ids.insert(input_ids.end(), row.begin(), row.end());
+  }
+  params.input_ids_owner = std::move(input_ids);
+  params.input_ids = params.input_ids_owner;
+  params.sequence_length = *bucket;
+}
+
 Generator::Generator(const Model& model, const GeneratorParams& params) : model_{model.shared_from_this()} {
   if (params.search.max_length == 0)
     throw std::runtime_error("search max_length is 0");
@@ -122,15 +332,169 @@ Generator::Generator(const Model& model, const GeneratorParams& params) : model_
   if (params.input_ids.empty() || params.input_ids.data() == nullptr)
     throw std::runtime_error("input_ids not set in GeneratorParams");
 
-  search_ = CreateSearch(params);
-  state_ = model.CreateState(search_->GetSequenceLengths(), params);
+  if (!params.guidance_type.empty()) {
+    if (params.search.num_beams > 1)
+      throw std::runtime_error("Guidance doesn't support beam search, num_beams must be 1");
+    constraint_ = model.GetTokenConstraint(params.guidance_type, params.guidance_data);
+    constraint_states_.assign(params.batch_size, TokenConstraint::c_initial_state);
+  }
+
+  if (!params.stop_sequences.empty() && params.search.num_beams > 1)
+    throw std::runtime_error("Stop sequences don't support beam search, num_beams must be 1");
+
+  if (params.search.no_repeat_ngram_size < 0)
+    throw std::runtime_error("no_repeat_ngram_size must be 0 or greater, is " + std::to_string(params.search.no_repeat_ngram_size));
+  if (params.search.num_beam_groups < 1 || params.search.num_beams % params.search.num_beam_groups != 0)
+    throw std::runtime_error("num_beams (" + std::to_string(params.search.num_beams) + ") must be a multiple of num_beam_groups (" + std::to_string(params.search.num_beam_groups) + ")");
+
+  // The search picks logits rows and maps them to tokens, so nothing that looks up the logits of a token is supported
+  if (!params.logits_token_ids.empty()) {
+    const auto uses_token_logits = [](const Config::Search& search) {
+      return search.repetition_penalty != 1.0f || search.presence_penalty != 0.0f || search.frequency_penalty != 0.0f;
+    };
+    if (params.search.num_beams > 1 || params.search.no_repeat_ngram_size > 0 || params.search.top_logprobs > 0 || !params.guidance_type.empty() ||
+        !params.logits_processors.empty() || uses_token_logits(params.search) || std::any_of(params.row_search.begin(), params.row_search.end(), uses_token_logits))
+      throw std::runtime_error("A model with logits_token_ids doesn't support beam search, penalties, no_repeat_ngram_size, top_logprobs, guidance or logits processors, its logits are only of some tokens");
+  }
+
+  if (params.timeout_seconds < 0)
+    throw std::runtime_error("timeout_seconds must be 0 or greater");
+
+  if (params.search.logprobs && params.search.num_beams > 1)
+    throw std::runtime_error("Log probabilities don't support beam search, num_beams must be 1");
+  if (params.search.top_logprobs < 0 || params.search.top_logprobs > 20)
+    throw std::runtime_error("top_logprobs must be between 0 and 20, is " + std::to_string(params.search.top_logprobs));
+
+  if (!params.row_search.empty()) {
+    if (params.search.num_beams > 1)
+      throw std::runtime_error("Search settings per batch entry don't support beam search, num_beams must be 1");
+    if (params.row_search.size() > static_cast<size_t>(params.batch_size))
+      throw std::runtime_error("There are search settings for " + std::to_string(params.row_search.size()) + " batch entries, but batch_size is " + std::to_string(params.batch_size));
+    for (size_t i = 0; i < params.row_search.size(); i++) {
+      const auto& row = params.row_search[i];
+      if (row.max_length <= params.sequence_length || row.max_length > params.search.max_length)
+        throw std::runtime_error("The max_length of batch entry " + std::to_string(i) + " (" + std::to_string(row.max_length) + ") must be more than the input sequence_length and at most search max_length (" + std::to_string(params.search.max_length) + ")");
+      if (row.do_sample && (row.top_p < 0.0f || row.top_p > 1.0f))
+        throw std::runtime_error("top_p of batch entry " + std::to_string(i) + " must be between 0.0 and 1.0");
+      if (row.do_sample && row.top_k < 0)
+        throw std::runtime_error("top_k of batch entry " + std::to_string(i) + " must be 0 or greater");
+    }
+  }
+
+  // Every rank of a sharded model searches the same (all reduced) logits, sampling has to pick the same tokens on each
+  if (model.config_->model.decoder.tensor_parallel_size > 1 && params.search.do_sample && params.search.random_seed == -1)
+    throw std::runtime_error("A model sharded with tensor_parallel_size needs search random_seed set to sample, the same on every rank");
+
+  model.MakeDeviceCurrent();
+
+  // The params may be shared with other generators, so the ones with this generator's stream, or of another replica, are a copy
+  const GeneratorParams* run_params = &params;
+  std::shared_ptr<GeneratorParams> stream_params;
+  if (params.device_type == DeviceType::CUDA || !params.IsForModel(model)) {
+    stream_params = params.CopyFor(model);
+    run_params = stream_params.get();
+  }
+  if (params.device_type == DeviceType::CUDA) {
+    cuda_stream_ = std::make_unique<PooledCudaStream>(model);
+    stream_params->cuda_stream = *cuda_stream_;
+    PadToPromptGraph(model, *stream_params);
+  }
+
+  search_ = CreateSearch(*run_params);
+  state_ = model.CreateState(search_->GetSequenceLengths(), *run_params);
+  if (run_params->restored_prefix && state_->GetCachedPrefix() != run_params->restored_prefix.get())
+    throw std::runtime_error("Restoring a saved state is not supported by this model type");
+
+  metrics_.prompt_token_count = std::count_if(params.input_ids.begin(), params.input_ids.end(), [&](int32_t id) { return id != params.pad_token_id; });
+  model.prompt_token_count_ += metrics_.prompt_token_count;
+
+  if (params.timeout_seconds > 0) {
+    const auto timeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(params.timeout_seconds));
+    deadline_id_ = GetDeadlineTimer().Schedule(created_ + timeout, [this] {
+      timed_out_ = true;
+      Cancel();
+    });
+  }
+  model.generator_count_++;
+}
+
+Generator::~Generator() {
+  model_->generator_count_--;
+  // Waits if the timer is cancelling this generator right now. After Shutdown() the timer is gone
+  if (deadline_id_ && GetOrtGlobals())
+    GetOrtGlobals()->deadline_timer_->Cancel(deadline_id_);
+}
+
+void Generator::Cancel() {
+  cancelled_ = true;
+  std::unique_lock<std::mutex> step_lock{step_mutex_, std::try_to_lock};
+  if (step_lock.owns_lock()) {
+    ReleaseState();  // Between steps nothing uses it
+    return;
+  }
+
+  // A step is running, its model run (or the next one) fails, then the step sees cancelled_ and releases the state
+  std::lock_guard<std::mutex> lock{state_mutex_};
+  if (state_)
+    state_->Cancel();
+}
+
+bool Generator::IsSwappedOut() const {
+  std::lock_guard<std::mutex> lock{state_mutex_};
+  return state_ && state_->IsSwappedOut();
+}
+
+void Generator::ReleaseState() {
+  std::lock_guard<std::mutex> lock{state_mutex_};
+  state_.reset();
+}
+
+void Generator::ThrowIfCancelled() {
+  if (!cancelled_)
+    return;
+  ReleaseState();
+  throw std::runtime_error(timed_out_ ? "The generator was cancelled, its timeout_seconds passed" : "The generator was cancelled");
+}
+
+std::unique_lock<std::mutex> Generator::LockStep() {
+  std::unique_lock<std::mutex> lock{step_mutex_};
+  ThrowIfCancelled();
+  model_->MakeDeviceCurrent();  // The thread may have last stepped a generator of a replica on another GPU
+  return lock;
 }
 
 void Generator::ComputeLogits() {
+  TraceSpan span{"Generator::ComputeLogits"};
   if (computed_logits_)
     throw std::runtime_error("ComputeLogits called again without calling GenerateNextToken first");
 
-  auto logits = state_->Run(search_->GetSequenceLength(), search_->GetNextTokens(), search_->GetNextIndices());
+  auto lock = LockStep();
+  step_start_ = std::chrono::steady_clock::now();
+  if (state_->IsSwappedOut())
+    state_->SwapIn();
+  if (search_->params_->search.compact_finished_rows)
+    state_->SetFinishedRows(search_->GetFinishedRows());
+  RoamingArray<float> logits;
+  try {
+    logits = state_->Run(search_->GetSequenceLength(), search_->GetNextTokens(), search_->GetNextIndices());
+  } catch (...) {
+    ThrowIfCancelled();  // Instead of the error of the terminated run
+    throw;
+  }
+  ThrowIfCancelled();  // Cancelled too late to stop the run, its logits are dropped
+  const auto* logits_fp16 = std::exchange(state_->pending_fp16_logits_, nullptr);
+  SetLogits(logits);
+  if (logits_fp16)
+    search_->SetFp16Logits(logits_fp16);
+  if (metrics_.step_count == 0)
+    metrics_.prefill_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - step_start_).count();
+}
+
+void Generator::SetLogits(RoamingArray<float> logits) {
+  TraceSpan span{"Generator::SetLogits"};
+  if (computed_logits_)
+    throw std::runtime_error("SetLogits called again without calling GenerateNextToken first");
+
   if (g_log.enabled && g_log.model_logits) {
     auto& stream = Log("model_logits");
     DumpSpan(stream, logits.GetCPU());
@@ -141,10 +505,18 @@ void Generator::ComputeLogits() {
 
   auto& search = search_->params_->search;
   search_->ApplyMinLength(search.min_length);
-  search_->ApplyRepetitionPenalty(search.repetition_penalty);
+  if (search_->params_->row_search.empty())
+    search_->ApplyPenalties(search.repetition_penalty, search.presence_penalty, search.frequency_penalty);
+  else
+    search_->ApplyRowPenalties();
+  search_->ApplyNoRepeatNgram(search.no_repeat_ngram_size);
+  if (constraint_)
+    search_->ApplyTokenConstraint(*constraint_, constraint_states_);
 }
 
 bool Generator::IsDone() const {
+  if (cancelled_)
+    return true;
   if (computed_logits_)
     throw std::runtime_error("IsDone() can't be called in the middle of processing logits");
 
@@ -152,11 +524,16 @@ bool Generator::IsDone() const {
 }
 
 void Generator::GenerateNextToken() {
+  TraceSpan span{"Generator::GenerateNextToken"};
   if (!computed_logits_)
     throw std::runtime_error("Must call ComputeLogits before GenerateNextToken");
+  auto lock = LockStep();
   computed_logits_ = false;
   auto& search = search_->params_->search;
 
+  if (!search_->params_->logits_processors.empty())
+    search_->ApplyLogitsProcessors(search_->params_->logits_processors);
+
   if (g_log.enabled && g_log.generate_next_token) {
     auto& stream = Log("generate_next_token");
     stream << SGR::Fg_Green << "do_sample: " << SGR::Reset << search.do_sample << ' '
@@ -167,8 +544,16 @@ void Generator::GenerateNextToken() {
            << std::endl;
   }
 
+  // Every batch entry picks its token its own way, checked when the generator was created
+  if (!search_->params_->row_search.empty()) {
+    search_->SampleRows();
+    RecordStep();
+    return;
+  }
+
   if (!search.do_sample || search.top_k == 1) {
     search_->SelectTop();
+    RecordStep();
     return;
   }
 
@@ -190,12 +575,204 @@ void Generator::GenerateNextToken() {
     assert(search.top_k == 0);
     search_->SampleTopP(search.top_p, search.temperature);
   }
+  RecordStep();
+}
+
+void Generator::RecordStep() {
+  next_tokens_ = search_->GetNextTokens();
+  next_tokens_.PrefetchToCPU();
+
+  if (constraint_) {
+    auto next_tokens = next_tokens_.GetCPU();
+    for (size_t i = 0; i < constraint_states_.size(); i++)
+      constraint_states_[i] = constraint_->Advance(constraint_states_[i], next_tokens[i]);
+  }
+
+  const auto now = std::chrono::steady_clock::now();
+  if (metrics_.step_count++ == 0) {
+    metrics_.time_to_first_token_seconds = std::chrono::duration<double>(now - created_).count();
+  } else {
+    const double seconds = std::chrono::duration<double>(now - step_start_).count();
+    metrics_.decode_seconds += seconds;
+    const auto& bounds = GeneratorMetrics::c_decode_time_bounds_ms;
+    metrics_.decode_time_histogram[std::lower_bound(bounds.begin(), bounds.end(), seconds * 1000) - bounds.begin()]++;
+  }
+  model_->generated_token_count_ += search_->params_->batch_size;
+  step_start_ = now;  // For steps that get their logits from SetLogits() instead of ComputeLogits()
+}
+
+void Generator::SwapOut() {
+  if (computed_logits_)
+    throw std::runtime_error("SwapOut called between ComputeLogits and GenerateNextToken");
+  if (async_pending_)
+    throw std::runtime_error("SwapOut called while a GenerateNextTokenAsync step is pending");
+  auto lock = LockStep();
+  state_->SwapOut();
+}
+
+void Generator::SwapIn() {
+  if (async_pending_)
+    throw std::runtime_error("SwapIn called while a GenerateNextTokenAsync step is pending");
+  auto lock = LockStep();
+  state_->SwapIn();
+}
+
+std::vector<uint8_t> Generator::SaveState() {
+  if (computed_logits_)
+    throw std::runtime_error("SaveState called between ComputeLogits and GenerateNextToken");
+  if (async_pending_)
+    throw std::runtime_error("SaveState called while a GenerateNextTokenAsync step is pending");
+  if (metrics_.step_count == 0)
+    throw std::runtime_error("A generator's state can only be saved after its prompt has run");
+  auto lock = LockStep();
+  state_->SwapIn();
+
+  // The last token picked hasn't been run yet, so it's left to the input_ids of the generator that restores the state
+  const int length = search_->GetSequenceLength() - 1;
+  PrefixCache::Entry entry;
+  entry.kv = state_->CopyKVCaches(length);
+  auto sequence = search_->GetSequence(0).GetCPU();
+  entry.tokens.assign(sequence.begin(), sequence.begin() + length);
+  return entry.Serialize(*model_, state_->cuda_stream_);
+}
+
+void Generator::RestoreState(std::span<const uint8_t> data) {
+  if (computed_logits_ || metrics_.step_count > 0 || async_pending_)
+    throw std::runtime_error("RestoreState must be called before the first ComputeLogits");
+  auto lock = LockStep();
+
+  // The params of the new state are a copy, the generator's own may be shared with others
+  auto params = std::make_shared<GeneratorParams>(*state_->params_);
+  params->restored_prefix = PrefixCache::Entry::Deserialize(*model_, data, state_->cuda_stream_);
+  auto state = model_->CreateState(search_->GetSequenceLengths(), *params);
+  if (state->GetCachedPrefix() != params->restored_prefix.get())
+    throw std::runtime_error("Restoring a saved state is not supported by this model type");
+  std::lock_guard<std::mutex> state_lock{state_mutex_};
+  state_ = std::move(state);
+}
+
+std::unique_ptr<Generator> Generator::Fork() {
+  if (async_pending_)
+    throw std::runtime_error("Fork called while a GenerateNextTokenAsync step is pending");
+  if (metrics_.step_count == 0 && !computed_logits_)
+    throw std::runtime_error("A generator can only be forked after its prompt has run");
+  auto lock = LockStep();
+  state_->SwapIn();
+
+  // Whether or not the last token of the sequence has run yet, the fork runs it again to get logits of its own
+  auto sequence = search_->GetSequence(0).GetCPU();
+  const size_t length = sequence.size() - 1;
+  if (!fork_prefix_ || !std::equal(fork_prefix_->tokens.begin(), fork_prefix_->tokens.end(), sequence.begin(), sequence.begin() + length)) {
+    auto entry = std::make_shared<PrefixCache::Entry>();
+    entry->kv = state_->CopyKVCaches(static_cast<int>(length));
+    entry->tokens.assign(sequence.begin(), sequence.begin() + length);
+#if USE_CUDA
+    // The copies are on this generator's stream, the forks read them on theirs
+    if (model_->device_type_ == DeviceType::CUDA)
+      CudaCheck() == cudaStreamSynchronize(state_->cuda_stream_);
+#endif
+    fork_prefix_ = std::move(entry);
+  }
+
+  if (!fork_count_)
+    fork_count_ = std::make_shared<std::atomic<uint32_t>>();
+  auto params = std::make_shared<GeneratorParams>(*search_->params_);
+  params->sequence_length = static_cast<int>(sequence.size());
+  params->input_ids_owner.assign(sequence.begin(), sequence.end());
+  params->input_ids = params->input_ids_owner;
+  params->restored_prefix = fork_prefix_;
+  params->fork_index = ++*fork_count_;
+  params->external_owner_ = nullptr;
+
+  auto fork = CreateGenerator(*model_, *params);
+  fork->fork_count_ = fork_count_;
+  fork->constraint_states_ = constraint_states_;  // The guidance continues from the tokens generated so far
+  return fork;
+}
+
+double Generator::GetMetric(std::string_view name) const {
+  const size_t batch_size = search_->params_->batch_size;
+  if (name == "prompt_token_count")
+    return static_cast<double>(metrics_.prompt_token_count);
+  if (name == "generated_token_count")
+    return static_cast<double>(metrics_.step_count * batch_size);
+  if (name == "step_count")
+    return static_cast<double>(metrics_.step_count);
+  if (name == "prefill_seconds")
+    return metrics_.prefill_seconds;
+  if (name == "time_to_first_token_seconds")
+    return metrics_.time_to_first_token_seconds;
+  if (name == "decode_seconds")
+    return metrics_.decode_seconds;
+  if (name == "tokens_per_second")
+    return metrics_.decode_seconds > 0 ? (metrics_.step_count - 1) * batch_size / metrics_.decode_seconds : 0.0;
+  if (name == "kv_cache_bytes") {
+    std::lock_guard<std::mutex> lock{state_mutex_};
+    return state_ ? static_cast<double>(state_->kv_cache_bytes_) : 0.0;  // Released once cancelled
+  }
+  throw std::runtime_error("Unknown generator metric: " + std::string(name));
+}
+
+void Generator::GenerateNextTokenAsync(std::function<void(std::exception_ptr error)> on_done) {
+  if (async_pending_.exchange(true))
+    throw std::runtime_error("GenerateNextTokenAsync called again before the previous step completed");
+
+  GetAsyncQueue().Submit([this, on_done = std::move(on_done)] {
+    std::exception_ptr error;
+    try {
+      ComputeLogits();
+      GenerateNextToken();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    // Cleared first, so on_done can queue the next step
+    async_pending_ = false;
+    on_done(error);
+  });
+}
+
+size_t Generator::GenerateTokens(size_t max_steps, std::span<int32_t> tokens) {
+  const auto& params = *search_->params_;
+  const size_t batch_size = params.batch_size;
+  if (params.search.num_beams != 1)
+    throw std::runtime_error("GenerateTokens doesn't support beam search, the next tokens of the beams aren't the final sequences");
+  if (tokens.size() < max_steps * batch_size)
+    throw std::runtime_error("GenerateTokens needs room for " + std::to_string(max_steps * batch_size) + " tokens, but only has " + std::to_string(tokens.size()));
+
+  size_t steps = 0;
+  for (; steps < max_steps && !IsDone(); steps++) {
+    ComputeLogits();
+    GenerateNextToken();
+
+    auto next_tokens = search_->GetNextTokens();
+    auto* destination = tokens.data() + steps * batch_size;
+#if USE_CUDA
+    if (next_tokens.IsOnGPU()) {
+      // Copied straight into the caller's buffer, GetCPU() would copy through a pinned buffer of the pool
+      auto next_tokens_gpu = next_tokens.GetGPU();
+      CudaCheck() == cudaMemcpyAsync(destination, next_tokens_gpu.data(), next_tokens_gpu.size_bytes(), cudaMemcpyDeviceToHost, params.cuda_stream);
+      CudaCheck() == cudaStreamSynchronize(params.cuda_stream);
+      continue;
+    }
+#endif
+    auto next_tokens_cpu = next_tokens.GetCPU();
+    std::copy(next_tokens_cpu.begin(), next_tokens_cpu.end(), destination);
+  }
+  return steps;
 }
 
 RoamingArray<int32_t> Generator::GetSequence(size_t index) const {
   return search_->GetSequence(index);
 }
 
+cpu_span<int32_t> Generator::GetNextTokens() {
+  if (async_pending_)
+    throw std::runtime_error("GetNextTokens called while a GenerateNextTokenAsync step is pending");
+  if (metrics_.step_count == 0)
+    throw std::runtime_error("GetNextTokens called before the first GenerateNextToken");
+  return next_tokens_.GetCPU();
+}
+
 TokenSequences Generate(const Model& model, const GeneratorParams& params) {
   auto generator = CreateGenerator(model, params);
 
@@ -204,9 +781,15 @@ TokenSequences Generate(const Model& model, const GeneratorParams& params) {
     generator->GenerateNextToken();
   }
 
-  TokenSequences result;
+  // Every copy is queued before the first is waited on
+  std::vector<RoamingArray<int32_t>> sequences;
   for (int i = 0; i < params.batch_size * params.search.num_return_sequences; i++) {
-    auto sequence = generator->search_->GetSequence(i);
+    sequences.push_back(generator->search_->GetSequence(i));
+    sequences.back().PrefetchToCPU();
+  }
+
+  TokenSequences result;
+  for (auto& sequence : sequences) {
     auto sequence_cpu = sequence.GetCPU();
 
     auto& v = result.emplace_back();
@@ -215,4 +798,203 @@ TokenSequences Generate(const Model& model, const GeneratorParams& params) {
   return result;
 }
 
+std::vector<float> Score(const Model& model, std::span<const std::span<const int32_t>> prompts, std::span<const std::span<const int32_t>> continuations) {
+  if (prompts.empty())
+    throw std::runtime_error("Score needs at least one prompt");
+  if (prompts.size() != continuations.size())
+    throw std::runtime_error("Score needs one continuation per prompt, there are " + std::to_string(prompts.size()) + " prompts and " + std::to_string(continuations.size()) + " continuations");
+  if (model.config_->model.decoder.last_token_logits)
+    throw std::runtime_error("Score needs the logits of every token, but the model only puts out the last token's (decoder.last_token_logits)");
+  if (!model.config_->model.logits_token_ids.empty())
+    throw std::runtime_error("Score needs the logits of every token id, but the model only puts out those of logits_token_ids");
+
+  const auto check_tokens = [&model](std::span<const int32_t> tokens, const char* what, size_t index) {
+    const int vocab_size = model.config_->model.vocab_size;
+    for (int32_t token : tokens) {
+      if (token < 0 || token >= vocab_size)
+        throw std::runtime_error(std::string{what} + " " + std::to_string(index) + " has token id " + std::to_string(token) + ", which isn't in the vocabulary of " + std::to_string(vocab_size));
+    }
+  };
+
+  size_t length = 0;
+  for (size_t i = 0; i < prompts.size(); i++) {
+    if (prompts[i].empty())
+      throw std::runtime_error("Prompt " + std::to_string(i) + " is empty, the first continuation token needs a token before it");
+    check_tokens(prompts[i], "Prompt", i);
+    check_tokens(continuations[i], "Continuation", i);
+    length = std::max(length, prompts[i].size() + continuations[i].size());
+  }
+
+  // Each prompt & continuation is left padded to the longest one, so every continuation ends on the last token
+  auto params = CreateGeneratorParams(model);
+  const auto batch_size = prompts.size();
+  params->input_ids_owner.assign(batch_size * length, params->pad_token_id);
+  for (size_t i = 0; i < batch_size; i++) {
+    auto row = params->input_ids_owner.begin() + (i + 1) * length - prompts[i].size() - continuations[i].size();
+    row = std::copy(prompts[i].begin(), prompts[i].end(), row);
+    std::copy(continuations[i].begin(), continuations[i].end(), row);
+  }
+  params->input_ids = params->input_ids_owner;
+  params->batch_size = static_cast<int>(batch_size);
+  params->sequence_length = static_cast<int>(length);
+  params->search.max_length = static_cast<int>(length + 1);
+  params->search.num_beams = 1;
+  params->search.past_present_share_buffer = false;
+  params->use_cuda_graph = false;
+
+  auto generator = CreateGenerator(model, *params);
+  generator->ComputeLogits();
+  auto logits = generator->state_->GetAllLogits();
+
+  // The logits row before each continuation token predicts it
+  const size_t vocab_size = params->vocab_size;
+#if USE_CUDA
+  const bool on_cuda = model.device_type_ == DeviceType::CUDA;
+  const size_t logit_count = on_cuda ? logits.GetGPU().size() : logits.GetCPU().size();
+#else
+  const size_t logit_count = logits.GetCPU().size();
+#endif
+  const size_t run_length = logit_count / (batch_size * vocab_size);
+  std::vector<int32_t> rows, tokens;
+  for (size_t i = 0; i < batch_size; i++) {
+    const auto& continuation = continuations[i];
+    if (continuation.size() + 1 > run_length)
+      throw std::runtime_error("Continuation " + std::to_string(i) + " has " + std::to_string(continuation.size()) + " tokens, but the run only put out the logits of the last " + std::to_string(run_length) + " (prefix caching or prompt chunking?)");
+    for (size_t j = 0; j < continuation.size(); j++) {
+      rows.push_back(static_cast<int32_t>(i * run_length + run_length - continuation.size() - 1 + j));
+      tokens.push_back(continuation[j]);
+    }
+  }
+
+  std::vector<float> logprobs(rows.size());
+  if (rows.empty())
+    return logprobs;
+
+#if USE_CUDA
+  if (on_cuda) {
+    auto stream = generator->state_->cuda_stream_;
+    auto rows_gpu = CudaMallocArray<int32_t>(rows.size());
+    auto tokens_gpu = CudaMallocArray<int32_t>(tokens.size());
+    auto logprobs_gpu = CudaMallocArray<float>(logprobs.size());
+    cudaMemcpyAsync(rows_gpu.get(), rows.data(), rows.size() * sizeof(int32_t), cudaMemcpyHostToDevice, stream);
+    cudaMemcpyAsync(tokens_gpu.get(), tokens.data(), tokens.size() * sizeof(int32_t), cudaMemcpyHostToDevice, stream);
+    cuda::LaunchGatherLogProbs(logits.GetGPU().data(), rows_gpu.get(), tokens_gpu.get(), logprobs_gpu.get(),
+                               static_cast<int>(rows.size()), static_cast<int>(vocab_size), stream);
+    cudaMemcpyAsync(logprobs.data(), logprobs_gpu.get(), logprobs.size() * sizeof(float), cudaMemcpyDeviceToHost, stream);
+    cudaStreamSynchronize(stream);
+    return logprobs;
+  }
+#endif
+
+  auto logits_cpu = logits.GetCPU();
+  for (size_t i = 0; i < rows.size(); i++) {
+    auto row = logits_cpu.subspan(rows[i] * vocab_size, vocab_size);
+    const float max = *std::max_element(row.begin(), row.end());
+    float sum = 0.0f;
+    for (auto logit : row)
+      sum += std::exp(logit - max);
+    logprobs[i] = row[tokens[i]] - max - std::log(sum);
+  }
+  return logprobs;
+}
+
+void WarmUp(const Model& model, const GeneratorParams& params, std::span<const int> batch_sizes, std::span<const int> prompt_lengths) {
+  // ORT runs a graph normally a couple of times before capturing it on a later run
+  constexpr int c_decode_steps = 3;
+
+  const auto& decoder = model.config_->model.decoder;
+  std::vector<int> batches(batch_sizes.begin(), batch_sizes.end());
+  if (batches.empty())
+    batches = decoder.graph_capture_batch_sizes.empty() ? std::vector<int>{params.batch_size} : decoder.graph_capture_batch_sizes;
+  std::vector<int> lengths(prompt_lengths.begin(), prompt_lengths.end());
+  if (lengths.empty())
+    lengths = decoder.graph_capture_prompt_lengths.empty() ? std::vector<int>{1} : decoder.graph_capture_prompt_lengths;
+
+  // Any token but the pad token, so no row is masked out entirely
+  const int32_t token = params.pad_token_id == 0 ? 1 : 0;
+  for (int batch_size : batches) {
+    if (batch_size < 1)
+      throw std::runtime_error("Warm-up batch sizes must be 1 or more, not " + std::to_string(batch_size));
+    for (int length : lengths) {
+      if (length < 1 || length >= params.search.max_length)
+        throw std::runtime_error("Warm-up prompt lengths must be from 1 to below max_length (" + std::to_string(params.search.max_length) + "), not " + std::to_string(length));
+
+      auto warmup_params = std::make_shared<GeneratorParams>(params);
+      warmup_params->input_ids_owner.assign(static_cast<size_t>(batch_size) * length, token);
+      warmup_params->input_ids = warmup_params->input_ids_owner;
+      warmup_params->batch_size = batch_size;
+      warmup_params->sequence_length = length;
+      // Keeps the params' max_batch_size, as the graphs are looked up by it, so they're the ones real generators replay
+      if (warmup_params->use_cuda_graph && decoder.graph_capture_batch_sizes.empty() && batch_size > warmup_params->max_batch_size)
+        throw std::runtime_error("Warm-up batch size " + std::to_string(batch_size) + " is larger than the params' max_batch_size (" + std::to_string(warmup_params->max_batch_size) + ")");
+
+      auto generator = CreateGenerator(model, *warmup_params);
+      for (int step = 0; step <= c_decode_steps && !generator->IsDone(); step++) {
+        generator->ComputeLogits();
+        generator->GenerateNextToken();
+      }
+    }
+  }
+}
+
+EmbeddingPooling ParseEmbeddingPooling(std::string_view name) {
+  if (name == "mean")
+    return EmbeddingPooling::Mean;
+  if (name == "last_token")
+    return EmbeddingPooling::LastToken;
+  throw std::runtime_error("Unknown embedding pooling " + std::string(name) + ", can be mean or last_token");
+}
+
+std::vector<float> Embed(const Model& model, std::span<const std::span<const int32_t>> prompts, EmbeddingPooling pooling, size_t max_batch_tokens) {
+  if (prompts.empty())
+    throw std::runtime_error("Embed needs at least one prompt");
+  for (size_t i = 0; i < prompts.size(); i++) {
+    if (prompts[i].empty())
+      throw std::runtime_error("Prompt " + std::to_string(i) + " is empty");
+  }
+
+  // Sorted by length, each batch is padded only to its own longest prompt
+  std::vector<size_t> order(prompts.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return prompts[a].size() < prompts[b].size(); });
+
+  const size_t hidden_size = model.config_->model.decoder.hidden_size;
+  std::vector<float> embeddings(prompts.size() * hidden_size);
+  for (size_t start = 0; start < order.size();) {
+    size_t end = start + 1;
+    while (end < order.size() && (max_batch_tokens == 0 || (end - start + 1) * prompts[order[end]].size() <= max_batch_tokens))
+      end++;
+    const size_t batch_size = end - start;
+    const size_t length = prompts[order[end - 1]].size();
+
+    auto params = CreateGeneratorParams(model);
+    params->input_ids_owner.assign(batch_size * length, params->pad_token_id);
+    std::vector<int32_t> lengths;
+    for (size_t i = 0; i < batch_size; i++) {
+      const auto& prompt = prompts[order[start + i]];
+      std::copy(prompt.begin(), prompt.end(), params->input_ids_owner.begin() + (i + 1) * length - prompt.size());
+      lengths.push_back(static_cast<int32_t>(prompt.size()));
+    }
+    params->input_ids = params->input_ids_owner;
+    params->batch_size = static_cast<int>(batch_size);
+    params->sequence_length = static_cast<int>(length);
+    params->search.max_length = static_cast<int>(length);
+    params->search.num_beams = 1;
+    params->search.past_present_share_buffer = false;
+    params->use_cuda_graph = false;
+
+    cpu_span<int32_t> sequence_lengths;
+    auto sequence_lengths_buffer = AllocateArray<int32_t>(batch_size, &sequence_lengths);
+    auto state = model.CreateEmbeddingState(sequence_lengths, *params);
+    state->Run(static_cast<int>(length), {});
+
+    std::vector<float> pooled(batch_size * hidden_size);
+    state->Pool(pooling, lengths, pooled);
+    for (size_t i = 0; i < batch_size; i++)
+      std::copy_n(pooled.begin() + i * hidden_size, hidden_size, embeddings.begin() + order[start + i] * hidden_size);
+    start = end;
+  }
+  return embeddings;
+}
+
 }  // namespace Generators
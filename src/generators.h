@@ -6,6 +6,7 @@
 #include <algorithm>
 #include <array>
 #include <assert.h>
+#include <chrono>
 #include <cmath>
 #include <cstring>
 #include "filesystem.h"
@@ -24,7 +25,7 @@
 #include <variant>
 #include <vector>
 #if USE_CUDA
-#include <cuda_runtime.h>
+#include "cuda_hip.h"
 #include "cuda_common.h"
 #else
 // If we don't include cuda_runtime.h, we define this to avoid lots of extra #ifdefs
@@ -37,12 +38,16 @@ using cudaStream_t = void*;
 #include "config.h"
 #include "logging.h"
 #include "tensor.h"
+#include "thread_pool.h"
+#include "models/prefix_cache.h"
 
 namespace Generators {
 struct Model;
+struct PooledCudaStream;
 struct State;
 struct Search;
 struct Tokenizer;
+struct TokenConstraint;
 
 // OgaSequences are a vector of int32 vectors
 using TokenSequences = std::vector<std::vector<int32_t>>;
@@ -55,6 +60,21 @@ enum struct DeviceType {
 
 std::string to_string(DeviceType device_type);
 
+// What a custom logits processor works on every step. The arrays are where the search keeps them, device memory on CUDA
+// and CPU memory otherwise, so a processor can launch its own kernels on the stream instead of copying them to the host.
+struct LogitsProcessorContext {
+  RoamingArray<float> scores;       // (batch_beam_size, vocab_size), changed in place
+  RoamingArray<int32_t> sequences;  // (batch_beam_size, max_length), the first sequence_length tokens of each are valid
+  int batch_beam_size;
+  int vocab_size;
+  int max_length;  // The length of the rows of sequences. On the CPU the rows grow as tokens are added, so it can be less than search.max_length
+  int sequence_length;
+  DeviceType device_type;
+  cudaStream_t stream;  // The generator's CUDA stream, or nullptr. Work queued on it runs before the next tokens are picked.
+};
+
+using LogitsProcessor = std::function<void(LogitsProcessorContext& context)>;
+
 struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
   GeneratorParams() = default;  // This constructor is only used if doing a custom model handler vs built-in
   GeneratorParams(const Model& model);
@@ -64,7 +84,10 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
   // Read only values copied from model
   int pad_token_id{};
   int eos_token_id{};
-  int vocab_size{};
+  std::span<const int> eos_token_ids;  // The logits rows of the eos tokens, only set when the model has several. eos_logits_index is the first
+  int eos_logits_index{};              // The logits row of eos_token_id, which the logits of the other eos tokens are merged into
+  int vocab_size{};                    // Of the logits rows, which are fewer than the tokens with logits_token_ids
+  std::span<const int32_t> logits_token_ids;  // The token of each logits row, from model.logits_token_ids. Empty when the rows are the tokens
   int context_length{};
 
   int batch_size{1};
@@ -75,7 +98,7 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
   int BatchBeamSize() const { return search.num_beams * batch_size; }
 
   DeviceType device_type{DeviceType::CPU};
-  cudaStream_t cuda_stream{};
+  cudaStream_t cuda_stream{};  // The model's, a generator runs on a copy of its params with a stream of its own
 
 #if 0
   struct Bert {
@@ -98,7 +121,7 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
   std::span<const int32_t> input_ids;  // Array of [batchsize][sequence_length]
 
   struct Whisper {
-    std::shared_ptr<Tensor> input_features;  // float32 [batch_size, number_of_mels, something that is 3000]
+    std::shared_ptr<Tensor> input_features;  // float32 [batch_size, number_of_mels, number_of_frames], 3000 frames for 30 seconds
   };
 
   std::variant<Whisper> inputs;
@@ -115,39 +138,203 @@ struct GeneratorParams : std::enable_shared_from_this<GeneratorParams> {
   // A list of extra model inputs that will be matched at runtime based on name
   std::vector<Input> extra_inputs;
 
+  // The LoRA adapter of each batch entry (or a single one for all of them), "" for the base model. See Adapters
+  std::vector<std::string> adapter_names;
+
+  // Set by Generator::RestoreState or OgaGeneratorParamsSetRestoredState, the first run continues from its kv caches
+  // instead of running its tokens again
+  std::shared_ptr<const PrefixCache::Entry> restored_prefix;
+
+  uint32_t fork_index{};  // Set by Generator::Fork, so the forks of a seeded generator don't sample the same tokens
+
+  // Run in order every step, after the built in processing (min length, repetition penalty, guidance) and before the
+  // next tokens are picked
+  std::vector<LogitsProcessor> logits_processors;
+
+  // Constrains the output to a "regex" or "json_schema" guidance_type, whose text is guidance_data. Empty means no constraint.
+  std::string guidance_type;
+  std::string guidance_data;
+
+  // A sequence is done once it generates any of these token sequences, which it ends with. Only without beam search
+  std::vector<std::vector<int32_t>> stop_sequences;
+
+  // Once this long has passed since a generator was created, it's cancelled like by Generator::Cancel. 0 means no deadline
+  double timeout_seconds{};
+
+  // The search settings of each batch entry, so requests with different sampling settings can share a batch. Only their
+  // do_sample, top_k, top_p, temperature, the penalties and max_length (at most search.max_length) are used, and only
+  // without beam search. The batch entries past the end use search
+  std::vector<Config::Search> row_search;
+  const Config::Search& GetRowSearch(size_t batch_id) const { return batch_id < row_search.size() ? row_search[batch_id] : search; }
+  Config::Search& GetMutableRowSearch(size_t batch_id);  // Adds the rows up to batch_id first, as copies of search
+
   void TryGraphCapture(int max_bs);
 
   void SetInputs(const NamedTensors& inputs);
 
+  // Sets the whisper input_features to a batch of float32 [1, number_of_mels, number_of_frames] clips of different
+  // lengths. They're padded to the longest clip with each clip's minimum, the value the feature extractor gives silence,
+  // so short clips only cost as much encoder work as the longest one in the batch instead of a full 30 seconds.
+  void SetWhisperInputFeatures(std::span<const Tensor* const> clips);
+
+  // Sets the whisper input_features from raw mono pcm clips at sample_rate, one per batch entry, computed natively like
+  // the feature extractor does (see ComputeLogMelSpectrogram). The clips are padded with silence to the 30 second window
+  // of the encoder, or with pad_to_30_seconds false to the longest one, for encoders with a dynamic frame count.
+  void SetWhisperAudio(std::span<const std::span<const float>> clips, int sample_rate, int mel_count, bool pad_to_30_seconds);
+
+  // Sets restored_prefix from a Generator::SaveState, so the generators created with these params continue from it
+  void SetRestoredState(std::span<const uint8_t> data);
+
+  // A copy to run on model, which may be another replica of the params' model (see ReplicaPool). Then what's taken from
+  // the model is taken from it instead, and the restored state is copied onto its device
+  bool IsForModel(const Model& model) const { return !model_ || model_.get() == &model; }
+  std::shared_ptr<GeneratorParams> CopyFor(const Model& model) const;
+
  private:
+  void SetLogitsRows(const Model& model);
+
   bool is_cuda_graph_enabled_{};
-  const Config* config_{nullptr};  // Non owning pointer to the config.
-                                   // The model outlives the GeneratorParams
+  const Config* config_{nullptr};
+  std::shared_ptr<const Model> model_;  // Owns config_ and what the spans above point into, even once a reload replaced it
+};
+
+// Always on counters of a generator's work, cheap enough to keep for every step
+struct GeneratorMetrics {
+  // Upper bounds of the decode time histogram buckets, plus a last bucket for everything slower
+  static constexpr std::array<double, 12> c_decode_time_bounds_ms{1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+
+  size_t prompt_token_count{};            // Non pad tokens of the input_ids
+  size_t step_count{};                    // GenerateNextToken() calls, each adds a token to every sequence
+  double prefill_seconds{};               // The first ComputeLogits(), which runs the prompt
+  double time_to_first_token_seconds{};   // From creating the generator to the end of the first GenerateNextToken()
+  double decode_seconds{};                // ComputeLogits() through GenerateNextToken() of every step after the first
+  std::array<uint64_t, c_decode_time_bounds_ms.size() + 1> decode_time_histogram{};  // Steps after the first, by time
 };
 
 struct Generator {
   Generator(const Model& model, const GeneratorParams& params);
+  ~Generator();
 
-  bool IsDone() const;
+  bool IsDone() const;  // Also true once cancelled
   void ComputeLogits();
+  void SetLogits(RoamingArray<float> logits);  // Takes the place of ComputeLogits() when the logits come from elsewhere, like a speculative decoding run
   void GenerateNextToken();
 
+  // Runs ComputeLogits() & GenerateNextToken() on the async task queue, then calls on_done from that thread with nullptr
+  // or the error. Until on_done is called the generator must not be used or destroyed.
+  void GenerateNextTokenAsync(std::function<void(std::exception_ptr error)> on_done);
+
+  // Runs up to max_steps ComputeLogits() & GenerateNextToken() steps, stopping early once IsDone(). The batch_size next
+  // tokens of each step are written one step after another into tokens, which holds at least max_steps * batch_size.
+  // Returns the number of steps run.
+  size_t GenerateTokens(size_t max_steps, std::span<int32_t> tokens);
+
   RoamingArray<int32_t> GetSequence(size_t index) const;
 
+  // The tokens the last GenerateNextToken() appended, one for each of the batch_size * num_beams sequences, valid until
+  // the next one. On CUDA they're read from a pinned copy queued at the end of the step, so streaming a token doesn't
+  // copy the whole sequence, and the wait is only for that copy.
+  cpu_span<int32_t> GetNextTokens();
+
+  // Moves the kv caches to pinned host memory on the model's copy stream and gives their device memory back, so an idle
+  // or preempted generator doesn't hold it. SwapIn() queues the copies back without waiting for them, the next run does.
+  // ComputeLogits() swaps in by itself. Only between steps, once the prompt has run, and on CUDA
+  void SwapOut();
+  void SwapIn();
+  bool IsSwappedOut() const;
+
+  // Saves the tokens of the single sequence and the kv caches that cover them, to continue it in another generator
+  // later, like the next turn of a chat. Between steps or once done, after the prompt has run.
+  std::vector<uint8_t> SaveState();
+
+  // Continues from a saved state in a new generator, before its first ComputeLogits(). The input_ids must start with the
+  // saved tokens, then only the tokens after them go through the model (like a new chat turn), the saved ones are not run
+  // again. Only for a single unpadded sequence without beams, on CPU or CUDA, with kv caches that can grow
+  void RestoreState(std::span<const uint8_t> data);
+
+  // Returns a new generator that continues the single sequence from here, on kv caches shared with this one instead of
+  // running its tokens again, so n continuations of a prompt take one prefill (parallel sampling). Once the prompt has
+  // run, between steps or after ComputeLogits(): forking right after the first ComputeLogits() lets every continuation
+  // pick its own first token. The forks made at the same point share one copy of the kv caches, each fork's first run
+  // only reads it and writes its own. Each fork samples with its own random numbers, also from the same random_seed.
+  // Same limits as RestoreState
+  std::unique_ptr<Generator> Fork();
+
+  // One of prompt_token_count, generated_token_count, step_count, prefill_seconds, time_to_first_token_seconds,
+  // decode_seconds, tokens_per_second (after the first token) or kv_cache_bytes
+  double GetMetric(std::string_view name) const;
+  const GeneratorMetrics& GetMetrics() const { return metrics_; }
+
+  // Stops the generator for good, from any thread but one running its step (like from a logits processor). A model run in progress is terminated and fails, then the state with
+  // its kv caches and graph buffers is released right away, or by the step that was running once it returns. Every
+  // step after that throws, and IsDone() is true. Also called when GeneratorParams::timeout_seconds passes
+  void Cancel();
+  bool IsCancelled() const { return cancelled_; }
+
+  // Calls fn with the state between steps, holding the step lock so a Cancel() from another thread (like the timeout's)
+  // can't release the state while fn reads it. Throws once cancelled
+  template <typename Fn>
+  auto WithState(Fn&& fn) {
+    auto lock = LockStep();
+    return fn(*state_);
+  }
+
   std::shared_ptr<const Model> model_;
+  std::unique_ptr<PooledCudaStream> cuda_stream_;  // On CUDA, the stream of the search & state, instead of the model's shared one
   std::unique_ptr<State> state_;
   std::unique_ptr<Search> search_;
   bool computed_logits_{};  // Set to true in ComputeLogits() and false after appending a token to ensure a 1 to 1 call ratio
+  std::atomic<bool> async_pending_{};  // Set while a GenerateNextTokenAsync() step is queued or running
+
+ private:
+  void RecordStep();  // Called at the end of every GenerateNextToken(), advances the constraint states & metrics
+
+  // Every use of state_ holds the step lock, which throws once cancelled. See Cancel
+  std::unique_lock<std::mutex> LockStep();
+  void ThrowIfCancelled();  // Releasing the state first
+  void ReleaseState();
+
+  RoamingArray<int32_t> next_tokens_;  // Of the last step, with the copy to the host already queued
+
+  std::shared_ptr<const TokenConstraint> constraint_;  // From the params' guidance, if any
+
+  std::shared_ptr<const PrefixCache::Entry> fork_prefix_;  // The kv caches of the last Fork(), for the next ones at the same point
+  std::shared_ptr<std::atomic<uint32_t>> fork_count_;      // Shared by a generator and all its forks, numbers their random streams
+  std::vector<int32_t> constraint_states_;            // The constraint state of each sequence
+
+  GeneratorMetrics metrics_;
+  std::chrono::steady_clock::time_point created_{std::chrono::steady_clock::now()};
+  std::chrono::steady_clock::time_point step_start_{created_};
+
+  std::mutex step_mutex_;           // Held by the thread running a step, so Cancel() knows whether it can release the state itself
+  mutable std::mutex state_mutex_;  // Held to release state_, to cancel its run from another thread, or to read it outside a step
+  std::atomic<bool> cancelled_{};
+  std::atomic<bool> timed_out_{};
+  uint64_t deadline_id_{};  // Of the timeout_seconds deadline on the DeadlineTimer, 0 for none
 };
 
 struct OrtGlobals {
   OrtGlobals();
 
   std::unique_ptr<OrtEnv> env_;
+  bool env_in_use_{};           // Set by GetOrtEnv(), after that env_ can't be replaced
+  bool global_thread_pools_{};  // env_ owns the ORT thread pools, so sessions are created without their own
+  std::unique_ptr<ThreadPool> thread_pool_;  // Used by the CPU search, created on first use by GetThreadPool()
+  std::once_flag thread_pool_once_;
+  // Shared by every session of a NUMA node (-1 for those without session_options.numa_node), created on first use by
+  // GetPrepackedWeightsContainer(), so the prepacked weights of a node's instance are on its memory
+  std::unordered_map<int, std::unique_ptr<OrtPrepackedWeightsContainer>> prepacked_weights_containers_;
+  std::mutex prepacked_weights_mutex_;  // Models can load on several threads at once
 #if USE_CUDA
-  std::unique_ptr<OrtMemoryInfo> memory_info_cuda_;
-  std::unique_ptr<Ort::Allocator> allocator_cuda_;
+  // By device id, as the stages of a pipelined decoder can each use their own GPU
+  std::vector<std::unique_ptr<OrtMemoryInfo>> memory_info_cuda_;
+  std::vector<std::unique_ptr<Ort::Allocator>> allocator_cuda_;
 #endif
+  std::unique_ptr<DeadlineTimer> deadline_timer_;  // Cancels the generators past their timeout, created on first use by GetDeadlineTimer()
+  std::once_flag deadline_timer_once_;
+  // Last, so the queued steps finish while everything they use is still alive
+  std::unique_ptr<TaskQueue> async_queue_;  // Runs GenerateNextTokenAsync() steps, created by SetAsyncThreadCount() or on first use by GetAsyncQueue()
+  std::once_flag async_queue_once_;
  private:
   OrtGlobals(const OrtGlobals&) = delete;
   void operator=(const OrtGlobals&) = delete;
@@ -157,12 +344,51 @@ std::unique_ptr<OrtGlobals>& GetOrtGlobals();
 void Shutdown();  // Do this once at exit, Ort code will fail after this call
 OrtEnv& GetOrtEnv();
 
+// Makes every session share one set of ORT intra & inter op thread pools instead of each creating its own, and sizes the
+// CPU search's thread pool to match the intra op pool. Must be called before GetOrtEnv(). A thread count of 0 means the default.
+void SetGlobalThreadPools(int intra_op_num_threads, int inter_op_num_threads);
+ThreadPool& GetThreadPool();
+
+// Every session is created with this, so loading the same model more than once (e.g. to run it on separate streams)
+// prepacks its weights once
+OrtPrepackedWeightsContainer& GetPrepackedWeightsContainer(int numa_node = -1);
+
+// Sets how many steps GenerateNextTokenAsync() runs at once, must be called before it's first used. 0 means one per core.
+void SetAsyncThreadCount(int thread_count);
+TaskQueue& GetAsyncQueue();
+DeadlineTimer& GetDeadlineTimer();
+
 std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, const char* config_path);
+std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, std::unique_ptr<Config> config);
 std::shared_ptr<GeneratorParams> CreateGeneratorParams(const Model& model);
 std::shared_ptr<GeneratorParams> CreateGeneratorParams();  // For benchmarking purposes only
 std::unique_ptr<Generator> CreateGenerator(const Model& model, const GeneratorParams& params);
 std::vector<std::vector<int32_t>> Generate(const Model& model, const GeneratorParams& params);  // Uses CreateGenerator and a simple loop to return the entire sequence
 
+// The log probability of every continuation token, one continuation after another, from a single run of each prompt
+// followed by its continuation. The log softmax is only taken of the chosen tokens, on the model's device. The logits
+// are seen the way the search sees them, with every eos id merged into eos_token_id.
+std::vector<float> Score(const Model& model, std::span<const std::span<const int32_t>> prompts, std::span<const std::span<const int32_t>> continuations);
+
+enum struct EmbeddingPooling {
+  Mean,       // The mean of the hidden states of every prompt token
+  LastToken,  // The hidden state of the last prompt token
+};
+
+// One fp32 embedding of model.decoder.hidden_size per prompt, one after another, from the last layer's hidden states of
+// a decoder built without its lm_head. The prompts are run shortest first in batches of similar lengths, so there's little
+// padding, each batch padded to at most max_batch_tokens tokens (0 for a single batch). Only the prompt runs, without kv caches.
+std::vector<float> Embed(const Model& model, std::span<const std::span<const int32_t>> prompts, EmbeddingPooling pooling, size_t max_batch_tokens = 0);
+EmbeddingPooling ParseEmbeddingPooling(std::string_view name);  // "mean" or "last_token"
+
+// Runs a prompt and a few decode steps of pad-free dummy tokens for every pair of batch size and prompt length, so the
+// kernel selection, autotuning, arena growth and graph capture of those shapes happen before real requests do. The
+// generators use the search options of params. Empty batch_sizes are the model.decoder.graph_capture_batch_sizes buckets,
+// or params.batch_size without them, and empty prompt_lengths the graph_capture_prompt_lengths buckets, or a single token.
+// The graphs captured go back to the model's CapturedGraphPool, for the generators of those shapes and of params'
+// max_batch_size to replay.
+void WarmUp(const Model& model, const GeneratorParams& params, std::span<const int> batch_sizes = {}, std::span<const int> prompt_lengths = {});
+
 float Float16ToFloat32(uint16_t v);  // v is a IEEE 752-2008 binary16 format, 1 sign bit, 5 bit exponent, 10 bit fraction
 void top_k_indices(std::span<int32_t> top_k, std::span<const float> inputs);
 
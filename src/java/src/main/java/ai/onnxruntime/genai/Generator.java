@@ -3,6 +3,9 @@
  */
 package ai.onnxruntime.genai;
 
+import java.nio.ByteOrder;
+import java.nio.IntBuffer;
+
 /**
  * The Generator class generates output using a model and generator parameters.
  *
@@ -87,6 +90,46 @@ public final class Generator implements AutoCloseable, Iterable<Integer> {
     generateNextTokenNative(nativeHandle);
   }
 
+  /**
+   * Runs up to maxSteps steps of computeLogits and generateNextToken in one native call, stopping
+   * early once the generation is done. Beam search isn't supported.
+   *
+   * @param maxSteps The most steps to run.
+   * @param tokens Receives the batch size next tokens of each step run, one step after another. It
+   *     must hold at least maxSteps * batch size tokens.
+   * @return The number of steps run.
+   * @throws GenAIException If the call to the GenAI native API fails.
+   */
+  public int generateTokens(int maxSteps, int[] tokens) throws GenAIException {
+    if (nativeHandle == 0) {
+      throw new IllegalStateException("Instance has been freed and is invalid");
+    }
+
+    return generateTokensNative(nativeHandle, maxSteps, tokens);
+  }
+
+  /**
+   * Like generateTokens(int, int[]), but the native code writes straight into the direct buffer,
+   * from its position, without a copy. The position is left unchanged.
+   *
+   * @param maxSteps The most steps to run.
+   * @param tokens A direct buffer in native byte order, with at least maxSteps * batch size
+   *     remaining tokens.
+   * @return The number of steps run.
+   * @throws GenAIException If the call to the GenAI native API fails.
+   */
+  public int generateTokens(int maxSteps, IntBuffer tokens) throws GenAIException {
+    if (nativeHandle == 0) {
+      throw new IllegalStateException("Instance has been freed and is invalid");
+    }
+    if (!tokens.isDirect() || tokens.order() != ByteOrder.nativeOrder()) {
+      throw new IllegalArgumentException("tokens must be a direct buffer in native byte order");
+    }
+
+    return generateTokensDirectNative(
+        nativeHandle, maxSteps, tokens, tokens.position(), tokens.remaining());
+  }
+
   /**
    * Retrieves a sequence of token ids for the specified sequence index.
    *
@@ -102,6 +145,25 @@ public final class Generator implements AutoCloseable, Iterable<Integer> {
     return getSequenceNative(nativeHandle, sequenceIndex);
   }
 
+  /**
+   * Retrieves a read only view of the token ids of the specified sequence, without copying them
+   * out of the generator. The view is only valid until the next step or close of the generator.
+   *
+   * @param sequenceIndex The index of the sequence.
+   * @return A read only direct buffer over the sequence token ids.
+   * @throws GenAIException If the call to the GenAI native API fails.
+   */
+  public IntBuffer getSequenceBuffer(long sequenceIndex) throws GenAIException {
+    if (nativeHandle == 0) {
+      throw new IllegalStateException("Instance has been freed and is invalid");
+    }
+
+    return getSequenceBufferNative(nativeHandle, sequenceIndex)
+        .order(ByteOrder.nativeOrder())
+        .asIntBuffer()
+        .asReadOnlyBuffer();
+  }
+
   /**
    * Retrieves the last token in the sequence for the specified sequence index.
    *
@@ -117,6 +179,22 @@ public final class Generator implements AutoCloseable, Iterable<Integer> {
     return getSequenceLastToken(nativeHandle, sequenceIndex);
   }
 
+  /**
+   * Retrieves one of the generator's metrics, which are always collected.
+   *
+   * @param name One of prompt_token_count, generated_token_count, step_count, prefill_seconds,
+   *     time_to_first_token_seconds, decode_seconds, tokens_per_second or kv_cache_bytes.
+   * @return The value of the metric.
+   * @throws GenAIException If the name is unknown.
+   */
+  public double getMetric(String name) throws GenAIException {
+    if (nativeHandle == 0) {
+      throw new IllegalStateException("Instance has been freed and is invalid");
+    }
+
+    return getMetric(nativeHandle, name);
+  }
+
   /** Closes the Generator and releases any associated resources. */
   @Override
   public void close() {
@@ -164,9 +242,21 @@ public final class Generator implements AutoCloseable, Iterable<Integer> {
 
   private native void generateNextTokenNative(long nativeHandle) throws GenAIException;
 
+  private native int generateTokensNative(long nativeHandle, int maxSteps, int[] tokens)
+      throws GenAIException;
+
+  private native int generateTokensDirectNative(
+      long nativeHandle, int maxSteps, IntBuffer tokens, int position, int remaining)
+      throws GenAIException;
+
   private native int[] getSequenceNative(long nativeHandle, long sequenceIndex)
       throws GenAIException;
 
+  private native java.nio.ByteBuffer getSequenceBufferNative(long nativeHandle, long sequenceIndex)
+      throws GenAIException;
+
   private native int getSequenceLastToken(long nativeHandle, long sequenceIndex)
       throws GenAIException;
+
+  private native double getMetric(long nativeHandle, String name) throws GenAIException;
 }
@@ -64,6 +64,22 @@ public final class Model implements AutoCloseable {
     return new Sequences(sequencesHandle);
   }
 
+  /**
+   * Retrieves one of the model's metrics, which are always collected.
+   *
+   * @param name One of prompt_token_count, generated_token_count, kv_cache_bytes,
+   *     static_buffer_bytes, device_memory_bytes or device_memory_budget_bytes.
+   * @return The value of the metric.
+   * @throws GenAIException If the name is unknown.
+   */
+  public double getMetric(String name) throws GenAIException {
+    if (nativeHandle == 0) {
+      throw new IllegalStateException("Instance has been freed and is invalid");
+    }
+
+    return getMetric(nativeHandle, name);
+  }
+
   @Override
   public void close() {
     if (nativeHandle != 0) {
@@ -89,4 +105,6 @@ public final class Model implements AutoCloseable {
   private native void destroyModel(long modelHandle);
 
   private native long generate(long modelHandle, long generatorParamsHandle) throws GenAIException;
+
+  private native double getMetric(long modelHandle, String name) throws GenAIException;
 }
@@ -3,6 +3,9 @@
  */
 package ai.onnxruntime.genai;
 
+import java.nio.ByteOrder;
+import java.nio.IntBuffer;
+
 /** Represents a collection of encoded prompts/responses. */
 public final class Sequences implements AutoCloseable {
   private long nativeHandle;
@@ -38,6 +41,24 @@ public final class Sequences implements AutoCloseable {
     return getSequenceNative(nativeHandle, sequenceIndex);
   }
 
+  /**
+   * Gets a read only view of the sequence at the specified index, without copying it. The view is
+   * only valid until the Sequences is closed.
+   *
+   * @param sequenceIndex The index of the sequence.
+   * @return A read only direct buffer over the sequence.
+   */
+  public IntBuffer getSequenceBuffer(long sequenceIndex) {
+    if (nativeHandle == 0) {
+      throw new IllegalStateException("Instance has been freed and is invalid");
+    }
+
+    return getSequenceBufferNative(nativeHandle, sequenceIndex)
+        .order(ByteOrder.nativeOrder())
+        .asIntBuffer()
+        .asReadOnlyBuffer();
+  }
+
   @Override
   public void close() {
     if (nativeHandle != 0) {
@@ -62,5 +83,8 @@ public final class Sequences implements AutoCloseable {
 
   private native int[] getSequenceNative(long sequencesHandle, long sequenceIndex);
 
+  private native java.nio.ByteBuffer getSequenceBufferNative(
+      long sequencesHandle, long sequenceIndex);
+
   private native void destroySequences(long sequencesHandle);
 }
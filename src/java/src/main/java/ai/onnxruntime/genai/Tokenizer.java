@@ -55,6 +55,26 @@ public class Tokenizer implements AutoCloseable {
     return tokenizerDecode(nativeHandle, sequence);
   }
 
+  /**
+   * Decodes the remaining token ids of a direct buffer, like one from Generator.getSequenceBuffer,
+   * without copying them into a java array.
+   *
+   * @param sequence A direct buffer in native byte order of the token ids to decode to text.
+   * @return The text representation of the sequence.
+   * @throws GenAIException If the call to the GenAI native API fails.
+   */
+  public String decode(java.nio.IntBuffer sequence) throws GenAIException {
+    if (nativeHandle == 0) {
+      throw new IllegalStateException("Instance has been freed and is invalid");
+    }
+    if (!sequence.isDirect() || sequence.order() != java.nio.ByteOrder.nativeOrder()) {
+      throw new IllegalArgumentException("sequence must be a direct buffer in native byte order");
+    }
+
+    return tokenizerDecodeDirect(
+        nativeHandle, sequence, sequence.position(), sequence.remaining());
+  }
+
   /**
    * Decodes a batch of sequences of token ids into text.
    *
@@ -112,5 +132,9 @@ public class Tokenizer implements AutoCloseable {
 
   private native String tokenizerDecode(long tokenizerHandle, int[] sequence) throws GenAIException;
 
+  private native String tokenizerDecodeDirect(
+      long tokenizerHandle, java.nio.IntBuffer sequence, int position, int remaining)
+      throws GenAIException;
+
   private native long createTokenizerStream(long tokenizerHandle) throws GenAIException;
 }
@@ -43,6 +43,45 @@ Java_ai_onnxruntime_genai_Generator_generateNextTokenNative(JNIEnv* env, jobject
   ThrowIfError(env, OgaGenerator_GenerateNextToken(reinterpret_cast<OgaGenerator*>(native_handle)));
 }
 
+extern "C" JNIEXPORT jint JNICALL
+Java_ai_onnxruntime_genai_Generator_generateTokensNative(JNIEnv* env, jobject thiz, jlong native_handle,
+                                                         jint max_steps, jintArray tokens) {
+  // The steps write straight into the java array, which is copied back when its elements are released
+  jint* token_data = env->GetIntArrayElements(tokens, nullptr);
+  size_t step_count = 0;
+  OgaResult* result = OgaGenerator_GenerateTokens(reinterpret_cast<OgaGenerator*>(native_handle), static_cast<size_t>(max_steps),
+                                                  reinterpret_cast<int32_t*>(token_data), env->GetArrayLength(tokens), &step_count);
+  env->ReleaseIntArrayElements(tokens, token_data, 0);
+  ThrowIfError(env, result);
+  return static_cast<jint>(step_count);
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_ai_onnxruntime_genai_Generator_generateTokensDirectNative(JNIEnv* env, jobject thiz, jlong native_handle,
+                                                               jint max_steps, jobject tokens, jint position, jint remaining) {
+  auto* token_data = static_cast<int32_t*>(env->GetDirectBufferAddress(tokens));
+  if (!token_data) {
+    ThrowException(env, "generateTokens needs a direct buffer");
+    return 0;
+  }
+
+  size_t step_count = 0;
+  ThrowIfError(env, OgaGenerator_GenerateTokens(reinterpret_cast<OgaGenerator*>(native_handle), static_cast<size_t>(max_steps),
+                                                token_data + position, static_cast<size_t>(remaining), &step_count));
+  return static_cast<jint>(step_count);
+}
+
+extern "C" JNIEXPORT jobject JNICALL
+Java_ai_onnxruntime_genai_Generator_getSequenceBufferNative(JNIEnv* env, jobject thiz, jlong generator, jlong index) {
+  const OgaGenerator* oga_generator = reinterpret_cast<const OgaGenerator*>(generator);
+
+  size_t num_tokens = OgaGenerator_GetSequenceCount(oga_generator, index);
+  const int32_t* tokens = OgaGenerator_GetSequenceData(oga_generator, index);
+
+  // The java side only hands out a read only view, so the const_cast never leads to a write
+  return env->NewDirectByteBuffer(const_cast<int32_t*>(tokens), static_cast<jlong>(num_tokens * sizeof(int32_t)));
+}
+
 extern "C" JNIEXPORT jintArray JNICALL
 Java_ai_onnxruntime_genai_Generator_getSequenceNative(JNIEnv* env, jobject thiz, jlong generator, jlong index) {
   const OgaGenerator* oga_generator = reinterpret_cast<const OgaGenerator*>(generator);
@@ -78,4 +117,12 @@ Java_ai_onnxruntime_genai_Generator_getSequenceLastToken(JNIEnv* env, jobject th
   }
 
   return jint(tokens[num_tokens - 1]);
-}
\ No newline at end of file
+}
+extern "C" JNIEXPORT jdouble JNICALL
+Java_ai_onnxruntime_genai_Generator_getMetric(JNIEnv* env, jobject thiz, jlong generator, jstring name) {
+  CString metric_name{env, name};
+
+  double value = 0;
+  ThrowIfError(env, OgaGenerator_GetMetric(reinterpret_cast<const OgaGenerator*>(generator), metric_name, &value));
+  return value;
+}
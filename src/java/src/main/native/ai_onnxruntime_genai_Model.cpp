@@ -37,4 +37,12 @@ Java_ai_onnxruntime_genai_Model_generate(JNIEnv* env, jobject thiz, jlong model_
   }
 
   return reinterpret_cast<jlong>(sequences);
-}
\ No newline at end of file
+}
+extern "C" JNIEXPORT jdouble JNICALL
+Java_ai_onnxruntime_genai_Model_getMetric(JNIEnv* env, jobject thiz, jlong model_handle, jstring name) {
+  CString metric_name{env, name};
+
+  double value = 0;
+  ThrowIfError(env, OgaModel_GetMetric(reinterpret_cast<const OgaModel*>(model_handle), metric_name, &value));
+  return value;
+}
@@ -38,3 +38,15 @@ Java_ai_onnxruntime_genai_Sequences_getSequenceNative(JNIEnv* env, jobject thiz,
 
   return java_int_array;
 }
+
+extern "C" JNIEXPORT jobject JNICALL
+Java_ai_onnxruntime_genai_Sequences_getSequenceBufferNative(JNIEnv* env, jobject thiz, jlong sequences_handle,
+                                                            jlong sequence_index) {
+  const OgaSequences* sequences = reinterpret_cast<const OgaSequences*>(sequences_handle);
+
+  size_t num_tokens = OgaSequencesGetSequenceCount(sequences, (size_t)sequence_index);
+  const int32_t* tokens = OgaSequencesGetSequenceData(sequences, (size_t)sequence_index);
+
+  // The java side only hands out a read only view, so the const_cast never leads to a write
+  return env->NewDirectByteBuffer(const_cast<int32_t*>(tokens), static_cast<jlong>(num_tokens * sizeof(int32_t)));
+}
@@ -71,6 +71,27 @@ Java_ai_onnxruntime_genai_Tokenizer_tokenizerDecode(JNIEnv* env, jobject thiz, j
   return result;
 }
 
+extern "C" JNIEXPORT jstring JNICALL
+Java_ai_onnxruntime_genai_Tokenizer_tokenizerDecodeDirect(JNIEnv* env, jobject thiz, jlong tokenizer_handle,
+                                                          jobject sequence, jint position, jint remaining) {
+  const OgaTokenizer* tokenizer = reinterpret_cast<const OgaTokenizer*>(tokenizer_handle);
+  const auto* tokens = static_cast<const int32_t*>(env->GetDirectBufferAddress(sequence));
+  if (!tokens) {
+    ThrowException(env, "decode needs a direct buffer");
+    return nullptr;
+  }
+
+  const char* decoded_text = nullptr;
+  if (ThrowIfError(env, OgaTokenizerDecode(tokenizer, tokens + position, static_cast<size_t>(remaining), &decoded_text))) {
+    return nullptr;
+  }
+
+  jstring result = env->NewStringUTF(decoded_text);
+  OgaDestroyString(decoded_text);
+
+  return result;
+}
+
 extern "C" JNIEXPORT jlong JNICALL
 Java_ai_onnxruntime_genai_Tokenizer_createTokenizerStream(JNIEnv* env, jobject thiz, jlong tokenizer_handle) {
   const OgaTokenizer* tokenizer = reinterpret_cast<const OgaTokenizer*>(tokenizer_handle);
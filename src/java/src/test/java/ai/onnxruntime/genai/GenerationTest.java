@@ -8,6 +8,9 @@ import static org.junit.jupiter.api.Assertions.assertEquals;
 import static org.junit.jupiter.api.Assertions.assertTrue;
 
 import java.io.File;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.IntBuffer;
 import java.util.function.Consumer;
 import java.util.logging.Logger;
 import org.junit.jupiter.api.Test;
@@ -100,4 +103,44 @@ public class GenerationTest {
       }
     }
   }
+
+  @Test
+  public void testGenerateTokensDirectBuffer() throws GenAIException {
+    // Same input and expected output as testWithInputIds, with the steps written to a direct buffer
+    Model model = new Model(TestUtils.testModelPath());
+    GeneratorParams params = new GeneratorParams(model);
+    int batchSize = 2;
+    int sequenceLength = 4;
+    int maxLength = 10;
+    int[] inputIDs = new int[] {0, 0, 0, 52, 0, 0, 195, 731};
+
+    params.setInput(inputIDs, sequenceLength, batchSize);
+    params.setSearchOption("max_length", maxLength);
+
+    int[] expectedOutput =
+        new int[] {
+          0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+          0, 0, 195, 731, 731, 114, 114, 114, 114, 114
+        };
+
+    try (Generator generator = new Generator(model, params)) {
+      int steps = maxLength - sequenceLength;
+      IntBuffer tokens =
+          ByteBuffer.allocateDirect(steps * batchSize * Integer.BYTES)
+              .order(ByteOrder.nativeOrder())
+              .asIntBuffer();
+      assertEquals(generator.generateTokens(steps, tokens), steps);
+
+      for (int i = 0; i < batchSize; i++) {
+        IntBuffer sequence = generator.getSequenceBuffer(i);
+        assertEquals(sequence.remaining(), maxLength);
+        for (int j = 0; j < maxLength; j++) {
+          assertEquals(sequence.get(j), expectedOutput[i * maxLength + j]);
+        }
+        for (int step = 0; step < steps; step++) {
+          assertEquals(tokens.get(step * batchSize + i), expectedOutput[i * maxLength + sequenceLength + step]);
+        }
+      }
+    }
+  }
 }
@@ -3,8 +3,10 @@
 
 #include "generators.h"
 #include "json.h"
+#include <atomic>
 #include <iostream>
 #include <fstream>
+#include <mutex>
 
 namespace Generators {
 
@@ -12,6 +14,86 @@ LogItems g_log;
 static std::ostream* gp_stream{&std::cerr};
 static std::unique_ptr<std::ofstream> gp_logfile;
 
+namespace {
+
+const auto g_trace_epoch = std::chrono::steady_clock::now();  // Event times are relative to this
+
+struct TraceEvent {
+  const char* name;
+  int64_t start_us;
+  int64_t duration_us;
+  int thread_id;
+  std::vector<std::pair<const char*, double>> counters;  // For a counter event, empty for a span
+};
+
+// Keeps the events in memory so recording one is cheap, they're only formatted when written out
+struct TraceRecorder {
+  ~TraceRecorder() { Write(); }
+
+  void Add(const char* name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end,
+           std::vector<std::pair<const char*, double>> counters = {}) {
+    // Small sequential ids read better in the trace viewers than native thread ids
+    static std::atomic<int> next_thread_id;
+    thread_local int thread_id = next_thread_id++;
+
+    using std::chrono::duration_cast, std::chrono::microseconds;
+    TraceEvent event{name, duration_cast<microseconds>(start - g_trace_epoch).count(), duration_cast<microseconds>(end - start).count(), thread_id, std::move(counters)};
+    std::lock_guard lock{mutex_};
+    events_.push_back(std::move(event));
+  }
+
+  void Write() {
+    std::lock_guard lock{mutex_};
+    if (events_.empty())
+      return;
+
+    auto file = fs::path{filename_}.open_for_write();
+    file << "{\"traceEvents\":[";
+    for (size_t i = 0; i < events_.size(); i++) {
+      const auto& event = events_[i];
+      file << (i ? ",\n" : "\n") << "{\"name\":\"" << event.name << "\",\"ph\":\"" << (event.counters.empty() ? 'X' : 'C')
+           << "\",\"pid\":0,\"tid\":" << event.thread_id << ",\"ts\":" << event.start_us;
+      if (event.counters.empty())
+        file << ",\"dur\":" << event.duration_us << '}';
+      else {
+        file << ",\"args\":{";
+        for (size_t j = 0; j < event.counters.size(); j++)
+          file << (j ? "," : "") << '"' << event.counters[j].first << "\":" << event.counters[j].second;
+        file << "}}";
+      }
+    }
+    file << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    events_.clear();
+  }
+
+  void SetFilename(std::string_view filename) {
+    Write();  // What was recorded so far goes to the previous file
+    std::lock_guard lock{mutex_};
+    filename_ = filename.empty() ? "genai_trace.json" : filename;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::vector<TraceEvent> events_;
+  std::string filename_{"genai_trace.json"};
+};
+
+TraceRecorder& GetTraceRecorder() {
+  static TraceRecorder recorder;
+  return recorder;
+}
+
+}  // namespace
+
+void AddTraceEvent(const char* name, std::chrono::steady_clock::time_point start) {
+  GetTraceRecorder().Add(name, start, std::chrono::steady_clock::now());
+}
+
+void AddTraceCounter(const char* name, std::span<const std::pair<const char*, double>> values) {
+  auto now = std::chrono::steady_clock::now();
+  GetTraceRecorder().Add(name, now, now, {values.data(), values.data() + values.size()});
+}
+
 void SetLogBool(std::string_view name, bool value) {
   if (name == "enabled")
     g_log.enabled = value;
@@ -35,7 +117,11 @@ void SetLogBool(std::string_view name, bool value) {
     g_log.model_output_values = value;
   else if (name == "model_logits")
     g_log.model_logits = value;
-  else
+  else if (name == "trace") {
+    if (g_log.trace && !value)
+      GetTraceRecorder().Write();
+    g_log.trace = value;
+  } else
     throw JSON::unknown_value_error{};
 }
 
@@ -52,7 +138,9 @@ void SetLogString(std::string_view name, std::string_view value) {
       gp_stream = gp_logfile.get();
     else
       gp_stream = &std::cerr;
-  } else
+  } else if (name == "trace_filename")
+    GetTraceRecorder().SetFilename(value);
+  else
     throw JSON::unknown_value_error{};
 }
 
@@ -15,6 +15,12 @@
  *
  * Logging to a file is special: SetLogString("filename", "path") as "filename" is not a string in LogItems
  *
+ * TRACE: SetLogBool("trace", true) records TraceSpans (State::Run, KV_Cache::Update, Logits::Get, searches, tokenizer
+ *        calls and device syncs) in memory, and writes them as Chrome trace json when trace is turned off or at exit.
+ *        Load the file in chrome://tracing or https://ui.perfetto.dev. SetLogString("trace_filename", "path") sets where
+ *        it goes, "genai_trace.json" by default. After every State::Run the device allocation counts & live bytes of
+ *        each allocation site are added as counters too, see Model::TraceAllocations.
+ *
  * COLOR: The functions use ANSI SGR terminal codes for color, the 'struct SGR' below makes it easy to add common
  *        options during log options. Just look in the code for examples of how to use it. Note that the colors
  *        may differ in intensity/saturation on different platforms.
@@ -42,6 +48,7 @@ struct LogItems {
   bool model_output_shapes{};  // Before the model runs there are only the output shapes, no values in them. Useful for pre Session::Run debugging
   bool model_output_values{};  // After the model runs the output tensor values can be displayed
   bool model_logits{};         // Same as model_output_values but only for the logits
+  bool trace{};                // Record the TraceSpans, see TRACE above
 };
 
 extern LogItems g_log;
@@ -76,4 +83,27 @@ std::ostream& operator<<(std::ostream& stream, SGR sgr_code);
 
 std::ostream& Log(std::string_view label, std::string_view text = {});
 
+void AddTraceEvent(const char* name, std::chrono::steady_clock::time_point start);
+// A counter event at the current time, with a series for each of the values. The names must outlive the trace too
+void AddTraceCounter(const char* name, std::span<const std::pair<const char*, double>> values);
+
+// Records a trace event covering its lifetime when trace logging is on. 'name' must outlive the trace, like a literal
+struct TraceSpan {
+  explicit TraceSpan(const char* name) : name_{g_log.enabled && g_log.trace ? name : nullptr} {
+    if (name_)
+      start_ = std::chrono::steady_clock::now();
+  }
+  ~TraceSpan() {
+    if (name_)
+      AddTraceEvent(name_, start_);
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+ private:
+  const char* name_;
+  std::chrono::steady_clock::time_point start_;
+};
+
 }  // namespace Generators
\ No newline at end of file
@@ -0,0 +1,232 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "../generators.h"
+#include "model.h"
+#include "adapters.h"
+
+namespace Generators {
+
+namespace {
+
+// Copies the row major source of shape source_shape into the corner of destination of the (no smaller) shape
+// destination_shape, leaving the rest of destination as it is
+void CopyPadded(const uint8_t* source, std::span<const int64_t> source_shape, uint8_t* destination, std::span<const int64_t> destination_shape, size_t element_size) {
+  if (source_shape.size() == 1) {
+    std::memcpy(destination, source, source_shape[0] * element_size);
+    return;
+  }
+
+  const auto inner_elements = [](std::span<const int64_t> shape) {
+    return std::accumulate(shape.begin() + 1, shape.end(), size_t{1}, [](size_t a, int64_t b) { return a * static_cast<size_t>(b); });
+  };
+  const size_t source_stride = inner_elements(source_shape) * element_size;
+  const size_t destination_stride = inner_elements(destination_shape) * element_size;
+  for (int64_t i = 0; i < source_shape[0]; i++)
+    CopyPadded(source + i * source_stride, source_shape.subspan(1, source_shape.size() - 1), destination + i * destination_stride,
+               destination_shape.subspan(1, destination_shape.size() - 1), element_size);
+}
+
+}  // namespace
+
+Adapters::Adapters(const Model& model, OrtSession& session) : model_{model} {
+  const auto& config = model.config_->model.decoder.adapters;
+  const int64_t slot_count = config.max_adapters + 1;
+
+  auto input_names = session.GetInputNames();
+  for (size_t i = 0; i < input_names.size(); i++) {
+    if (input_names[i].compare(0, config.weight_prefix.size(), config.weight_prefix) != 0)
+      continue;
+
+    auto type_info = session.GetInputTypeInfo(i);
+    auto& info = type_info->GetTensorTypeAndShapeInfo();
+    Weight weight{input_names[i], info.GetElementType(), info.GetShape()};
+    if (weight.shape.size() < 2)
+      throw std::runtime_error("Adapter weight input " + weight.name + " must have a slot dimension and at least one more");
+    if (weight.shape[0] > 0 && weight.shape[0] != slot_count)
+      throw std::runtime_error("Adapter weight input " + weight.name + " has " + std::to_string(weight.shape[0]) + " slots, but adapters.max_adapters + 1 is " + std::to_string(slot_count));
+    weight.shape[0] = slot_count;
+
+    // The rank is usually left dynamic, so the weights can be built for any max_rank
+    for (size_t dim = 1; dim < weight.shape.size(); dim++) {
+      if (weight.shape[dim] > 0)
+        continue;
+      if (config.max_rank < 1)
+        throw std::runtime_error("Adapter weight input " + weight.name + " has a dynamic dimension, so adapters.max_rank must be set");
+      weight.shape[dim] = config.max_rank;
+    }
+
+    weight.slot_bytes = SizeOf(weight.type) * std::accumulate(weight.shape.begin() + 1, weight.shape.end(), size_t{1}, [](size_t a, int64_t b) { return a * static_cast<size_t>(b); });
+    weight.value = OrtValue::CreateTensor(*model.allocator_device_, weight.shape, weight.type);
+    weights_.push_back(std::move(weight));
+  }
+  if (weights_.empty())
+    throw std::runtime_error("adapters.max_adapters is set, but the model has no inputs starting with " + config.weight_prefix);
+
+  for (auto& weight : weights_) {
+    for (int32_t slot = 0; slot < slot_count; slot++)
+      CopyToSlot(weight, slot, nullptr);
+  }
+  slot_users_.resize(slot_count);
+  slot_users_[0] = 1;  // The base model slot is never free
+}
+
+void Adapters::CopyToSlot(Weight& weight, int32_t slot, const OrtValue* source) {
+  std::vector<uint8_t> padded(weight.slot_bytes);
+  if (source) {
+    auto info = source->GetTensorTypeAndShapeInfo();
+    if (info->GetElementType() != weight.type)
+      throw std::runtime_error("Adapter weight " + weight.name + " must have the element type of the model input, " + std::to_string(weight.type));
+    auto shape = info->GetShape();
+    const std::span<const int64_t> slot_shape{weight.shape.data() + 1, weight.shape.size() - 1};
+    if (shape.size() != slot_shape.size())
+      throw std::runtime_error("Adapter weight " + weight.name + " must have " + std::to_string(slot_shape.size()) + " dimensions");
+    for (size_t dim = 0; dim < shape.size(); dim++) {
+      if (shape[dim] > slot_shape[dim])
+        throw std::runtime_error("Adapter weight " + weight.name + " dimension " + std::to_string(dim) + " is " + std::to_string(shape[dim]) + ", more than the model's " + std::to_string(slot_shape[dim]));
+    }
+    if (std::find(shape.begin(), shape.end(), 0) == shape.end())
+      CopyPadded(source->GetTensorData<uint8_t>(), shape, padded.data(), slot_shape, SizeOf(weight.type));
+  }
+
+  auto* destination = weight.value->GetTensorMutableData<uint8_t>() + slot * weight.slot_bytes;
+  switch (model_.device_type_) {
+    case DeviceType::CPU:
+      std::memcpy(destination, padded.data(), padded.size());
+      break;
+#if USE_CUDA
+    case DeviceType::CUDA:
+      // Only a free slot is written, which the sequences running on the other slots never read
+      cudaMemcpyAsync(destination, padded.data(), padded.size(), cudaMemcpyHostToDevice, model_.cuda_stream_);
+      cudaStreamSynchronize(model_.cuda_stream_);
+      break;
+#endif
+    default:
+      throw std::runtime_error("Adapters are only supported on CPU and CUDA, not " + to_string(model_.device_type_));
+  }
+}
+
+void Adapters::Load(const std::string& name, const NamedTensors& weights) {
+  if (name.empty())
+    throw std::runtime_error("An adapter name can't be empty, that is the base model");
+  for (auto& weight : weights) {
+    if (std::none_of(weights_.begin(), weights_.end(), [&](const Weight& w) { return w.name == weight.first; }))
+      throw std::runtime_error("Adapter " + name + " has a weight the model has no input for: " + weight.first);
+  }
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  auto free_slot = std::find(slot_users_.begin(), slot_users_.end(), 0);
+  if (free_slot == slot_users_.end())
+    throw std::runtime_error("Every adapter slot is in use, unload an adapter first or raise adapters.max_adapters (" + std::to_string(slot_users_.size() - 1) + ")");
+  const auto slot = static_cast<int32_t>(free_slot - slot_users_.begin());
+
+  for (auto& weight : weights_) {
+    auto source = weights.find(weight.name);
+    CopyToSlot(weight, slot, source != weights.end() ? source->second->ort_tensor_.get() : nullptr);
+  }
+
+  // A replaced adapter's old slot is freed once the generators using it are done
+  auto [it, inserted] = slots_.emplace(name, slot);
+  if (!inserted) {
+    slot_users_[it->second]--;
+    it->second = slot;
+  }
+  slot_users_[slot]++;
+}
+
+void Adapters::Unload(const std::string& name) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  auto it = slots_.find(name);
+  if (it == slots_.end())
+    throw std::runtime_error("Adapter " + name + " isn't loaded");
+  slot_users_[it->second]--;
+  slots_.erase(it);
+}
+
+std::vector<int32_t> Adapters::Acquire(std::span<const std::string> names) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  std::vector<int32_t> slots;
+  for (auto& name : names) {
+    int32_t slot = 0;
+    if (!name.empty()) {
+      auto it = slots_.find(name);
+      if (it == slots_.end()) {
+        for (auto acquired : slots)
+          slot_users_[acquired]--;
+        throw std::runtime_error("Adapter " + name + " isn't loaded");
+      }
+      slot = it->second;
+    }
+    slot_users_[slot]++;
+    slots.push_back(slot);
+  }
+  return slots;
+}
+
+void Adapters::Release(std::span<const int32_t> slots) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  for (auto slot : slots)
+    slot_users_[slot]--;
+}
+
+void Adapters::AddInputs(State& state) const {
+  for (auto& weight : weights_) {
+    state.input_names_.push_back(weight.name.c_str());
+    state.inputs_.push_back(weight.value.get());
+  }
+}
+
+AdapterInputs::AdapterInputs(const Model& model, State& state)
+    : model_{model},
+      state_{state},
+      adapters_{model.GetAdapters()} {
+  const auto& params = *state_.params_;
+  const auto& names = params.adapter_names;
+  if (!adapters_) {
+    if (std::any_of(names.begin(), names.end(), [](const std::string& name) { return !name.empty(); }))
+      throw std::runtime_error("The model has no adapter inputs, set model.decoder.adapters.max_adapters for one that does");
+    return;
+  }
+  if (params.use_cuda_graph)
+    throw std::runtime_error("Adapters don't support graph capture");
+  if (names.size() > 1 && names.size() != static_cast<size_t>(params.batch_size))
+    throw std::runtime_error("adapter_names must have one name, or one per batch entry (" + std::to_string(params.batch_size) + "), not " + std::to_string(names.size()));
+
+  std::vector<std::string> batch_names(params.batch_size, names.empty() ? std::string{} : names.front());
+  if (names.size() > 1)
+    batch_names.assign(names.begin(), names.end());
+  slots_ = adapters_->Acquire(batch_names);
+
+  // The beams of a batch entry share its adapter
+  std::vector<int32_t> adapter_ids;
+  for (auto slot : slots_)
+    adapter_ids.insert(adapter_ids.end(), params.search.num_beams, slot);
+
+  const std::array<int64_t, 1> shape{static_cast<int64_t>(adapter_ids.size())};
+  adapter_ids_ = OrtValue::CreateTensor<int32_t>(*model_.allocator_device_, shape);
+  auto* data = adapter_ids_->GetTensorMutableData<int32_t>();
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    cudaMemcpyAsync(data, adapter_ids.data(), adapter_ids.size() * sizeof(int32_t), cudaMemcpyHostToDevice, state_.cuda_stream_);
+    cudaStreamSynchronize(state_.cuda_stream_);
+    return;
+  }
+#endif
+  std::copy(adapter_ids.begin(), adapter_ids.end(), data);
+}
+
+AdapterInputs::~AdapterInputs() {
+  if (adapters_ && !slots_.empty())
+    adapters_->Release(slots_);
+}
+
+void AdapterInputs::Add() {
+  if (!adapters_)
+    return;
+
+  adapters_->AddInputs(state_);
+  state_.input_names_.push_back(model_.config_->model.decoder.inputs.adapter_ids.c_str());
+  state_.inputs_.push_back(adapter_ids_.get());
+}
+
+}  // namespace Generators
@@ -0,0 +1,66 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <mutex>
+
+namespace Generators {
+
+// LoRA adapters served together from one batch. The decoder takes every LoRA weight as an input stacked over the adapter
+// slots, like [max_adapters + 1, in_features, rank] for an A weight and [max_adapters + 1, rank, out_features] for a B
+// weight, plus the int32 [batch_size] slot of each sequence (inputs.adapter_ids). The graph gathers every sequence's A & B
+// by its slot and adds x * A * B to the base projection, so a single run serves any mix of adapters. Slot 0 stays zero,
+// which is the base model.
+//
+// The stacked weights live on the device for as long as the model. Loading an adapter only copies its weights into a free
+// slot, so adapters can be added, replaced and removed while generators run, without reloading the base weights.
+struct Adapters {
+  // Takes the session inputs starting with decoder.adapters.weight_prefix as the stacked weights
+  Adapters(const Model& model, OrtSession& session);
+
+  // Loads or replaces the adapter. weights are named like the stacked inputs, without the slot dimension, and may be smaller
+  // in any dimension (a lower rank) as they're zero padded. Inputs without a weight are zero, for modules it doesn't adapt.
+  // Generators already running with an adapter being replaced keep using its old weights.
+  void Load(const std::string& name, const NamedTensors& weights);
+  void Unload(const std::string& name);  // Its slot is reused once no generator uses it
+
+  // Gets the slot of each adapter name, "" for the base model, and holds them for the generator until Release
+  std::vector<int32_t> Acquire(std::span<const std::string> names);
+  void Release(std::span<const int32_t> slots);
+
+  void AddInputs(State& state) const;  // Adds every stacked weight
+
+ private:
+  struct Weight {
+    std::string name;
+    ONNXTensorElementDataType type;
+    std::vector<int64_t> shape;  // Including the slot dimension
+    size_t slot_bytes;
+    std::unique_ptr<OrtValue> value;
+  };
+
+  void CopyToSlot(Weight& weight, int32_t slot, const OrtValue* source);
+
+  const Model& model_;
+  std::vector<Weight> weights_;
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, int32_t> slots_;  // Slot of each loaded adapter
+  std::vector<int> slot_users_;                     // Generators using each slot, plus one while an adapter name is on it
+};
+
+// The adapter inputs of a state, for the adapter each sequence picked in GeneratorParams::adapter_names
+struct AdapterInputs {
+  AdapterInputs(const Model& model, State& state);
+  ~AdapterInputs();
+
+  void Add();
+
+ private:
+  const Model& model_;
+  State& state_;
+  Adapters* adapters_;
+  std::vector<int32_t> slots_;  // Of each batch entry
+  std::unique_ptr<OrtValue> adapter_ids_;
+};
+
+}  // namespace Generators
@@ -0,0 +1,173 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "../vector_math.h"
+#include "audio_features.h"
+
+namespace Generators {
+
+namespace {
+
+constexpr double c_pi = 3.14159265358979323846;
+constexpr int c_fft_length = 400;  // 25 ms
+constexpr int c_bin_count = c_fft_length / 2 + 1;
+constexpr size_t c_block_size = 64;  // Frames or samples given to a thread at a time
+
+// The real DFT of a frame as dot products: row k < c_bin_count holds the Hann windowed cosines of bin k, row
+// c_bin_count + k its windowed sines. Whisper's n_fft of 400 isn't a power of 2, and a frame is only 400 samples, so
+// vectorized dot products are simpler and about as fast as a mixed radix FFT
+const std::vector<float>& GetDftMatrix() {
+  static const std::vector<float> matrix = [] {
+    std::vector<float> rows(2 * c_bin_count * c_fft_length);
+    for (int k = 0; k < c_bin_count; k++) {
+      for (int n = 0; n < c_fft_length; n++) {
+        const double window = 0.5 - 0.5 * std::cos(2 * c_pi * n / c_fft_length);  // Periodic, like torch.hann_window
+        const double angle = 2 * c_pi * ((k * n) % c_fft_length) / c_fft_length;
+        rows[k * c_fft_length + n] = static_cast<float>(window * std::cos(angle));
+        rows[(c_bin_count + k) * c_fft_length + n] = static_cast<float>(window * std::sin(angle));
+      }
+    }
+    return rows;
+  }();
+  return matrix;
+}
+
+// The slaney mel scale (librosa's default, which Whisper's filters come from): linear under 1 kHz, logarithmic above
+constexpr double c_linear_hz_per_mel = 200.0 / 3;
+constexpr double c_log_start_hz = 1000.0;
+constexpr double c_log_start_mel = c_log_start_hz / c_linear_hz_per_mel;
+const double c_log_step = std::log(6.4) / 27;
+
+double HzToMel(double hz) {
+  return hz < c_log_start_hz ? hz / c_linear_hz_per_mel : c_log_start_mel + std::log(hz / c_log_start_hz) / c_log_step;
+}
+
+double MelToHz(double mel) {
+  return mel < c_log_start_mel ? mel * c_linear_hz_per_mel : c_log_start_hz * std::exp(c_log_step * (mel - c_log_start_mel));
+}
+
+// The nonzero weights of a triangular filter, over the bins from start on
+struct MelFilter {
+  int start{};
+  std::vector<float> weights;
+};
+
+// Equally spaced on the mel scale from 0 Hz to the Nyquist frequency, each one normalized to the same area (slaney)
+std::vector<MelFilter> GetMelFilters(int mel_count) {
+  std::vector<double> edges(mel_count + 2);
+  const double max_mel = HzToMel(c_whisper_sample_rate / 2.0);
+  for (int i = 0; i < mel_count + 2; i++)
+    edges[i] = MelToHz(max_mel * i / (mel_count + 1));
+
+  std::vector<MelFilter> filters(mel_count);
+  for (int m = 0; m < mel_count; m++) {
+    const double lower = edges[m], center = edges[m + 1], upper = edges[m + 2];
+    const double area_norm = 2.0 / (upper - lower);
+    std::vector<float> weights(c_bin_count);
+    for (int k = 0; k < c_bin_count; k++) {
+      const double hz = static_cast<double>(k) * c_whisper_sample_rate / c_fft_length;
+      weights[k] = static_cast<float>(std::max(0.0, std::min((hz - lower) / (center - lower), (upper - hz) / (upper - center))) * area_norm);
+    }
+    auto first = std::find_if(weights.begin(), weights.end(), [](float w) { return w != 0.0f; });
+    auto last = std::find_if(weights.rbegin(), weights.rend(), [](float w) { return w != 0.0f; }).base();
+    if (first < last) {
+      filters[m].start = static_cast<int>(first - weights.begin());
+      filters[m].weights.assign(first, last);
+    }
+  }
+  return filters;
+}
+
+// The index a centered STFT reads at position i of a signal of length samples, mirrored at the ends without repeating
+// the edge sample (numpy's 'reflect' padding)
+size_t Reflect(int64_t i, int64_t length) {
+  if (length == 1)
+    return 0;
+  const int64_t period = 2 * (length - 1);
+  i = std::abs(i) % period;
+  return static_cast<size_t>(i < length ? i : period - i);
+}
+
+}  // namespace
+
+std::vector<float> ResampleTo16kHz(std::span<const float> pcm, int sample_rate) {
+  if (sample_rate <= 0 || sample_rate > 384000)
+    throw std::runtime_error("The audio sample_rate must be between 1 and 384000 Hz, is " + std::to_string(sample_rate));
+  if (sample_rate == c_whisper_sample_rate)
+    return {pcm.begin(), pcm.end()};
+
+  // Up by up then down by down, with a low pass at the lower of the two Nyquist frequencies (relative to the input's)
+  const int divisor = std::gcd(sample_rate, c_whisper_sample_rate);
+  const size_t up = c_whisper_sample_rate / divisor, down = sample_rate / divisor;
+  const double cutoff = std::min(1.0, static_cast<double>(up) / down);
+  constexpr int c_zero_crossings = 16;
+  const int half = static_cast<int>(std::ceil(c_zero_crossings / cutoff));
+  const size_t tap_count = 2 * half;
+
+  // The filter of each phase: the output at input position i + phase / up reads the inputs [i - half + 1, i + half]
+  std::vector<float> filters(up * tap_count);
+  for (size_t phase = 0; phase < up; phase++) {
+    for (size_t tap = 0; tap < tap_count; tap++) {
+      const double distance = (static_cast<double>(tap) - half + 1) - static_cast<double>(phase) / up;
+      const double x = c_pi * distance * cutoff;
+      const double sinc = x == 0.0 ? 1.0 : std::sin(x) / x;
+      const double window = std::abs(distance) < half ? 0.5 + 0.5 * std::cos(c_pi * distance / half) : 0.0;
+      filters[phase * tap_count + tap] = static_cast<float>(cutoff * sinc * window);
+    }
+  }
+
+  std::vector<float> padded(pcm.size() + 2 * half);
+  std::copy(pcm.begin(), pcm.end(), padded.begin() + half);
+
+  std::vector<float> output((pcm.size() * up + down - 1) / down);
+  GetThreadPool().ParallelFor((output.size() + c_block_size - 1) / c_block_size, [&](size_t block, size_t) {
+    const size_t end = std::min(output.size(), (block + 1) * c_block_size);
+    for (size_t n = block * c_block_size; n < end; n++) {
+      const size_t position = n * down;  // In units of 1 / up input samples
+      output[n] = Dot({padded.data() + position / up + 1, tap_count}, filters.data() + (position % up) * tap_count);
+    }
+  });
+  return output;
+}
+
+void ComputeLogMelSpectrogram(std::span<const float> pcm, int mel_count, std::span<float> features) {
+  if (mel_count < 1 || features.size() % mel_count != 0)
+    throw std::runtime_error("The features must hold [number_of_mels, number_of_frames] values");
+  const size_t frame_count = features.size() / mel_count;
+  const auto length = static_cast<int64_t>(frame_count) * c_whisper_hop_length;
+
+  // The frames are centered on every hop, so the signal is reflected by half a frame at both ends
+  std::vector<float> signal(length + c_fft_length);
+  const auto pcm_length = std::min(static_cast<int64_t>(pcm.size()), length);
+  for (size_t i = 0; i < signal.size(); i++) {
+    const size_t source = Reflect(static_cast<int64_t>(i) - c_fft_length / 2, length);
+    signal[i] = static_cast<int64_t>(source) < pcm_length ? pcm[source] : 0.0f;
+  }
+
+  const auto& dft = GetDftMatrix();
+  const auto filters = GetMelFilters(mel_count);
+  auto& thread_pool = GetThreadPool();
+  std::vector<float> power_spectra(thread_pool.GetThreadCount() * c_bin_count);
+  thread_pool.ParallelFor((frame_count + c_block_size - 1) / c_block_size, [&](size_t block, size_t thread_index) {
+    float* power = power_spectra.data() + thread_index * c_bin_count;
+    const size_t end = std::min(frame_count, (block + 1) * c_block_size);
+    for (size_t frame = block * c_block_size; frame < end; frame++) {
+      const std::span<const float> samples{signal.data() + frame * c_whisper_hop_length, c_fft_length};
+      for (int k = 0; k < c_bin_count; k++) {
+        const float real = Dot(samples, dft.data() + k * c_fft_length);
+        const float imaginary = Dot(samples, dft.data() + (c_bin_count + k) * c_fft_length);
+        power[k] = real * real + imaginary * imaginary;
+      }
+      for (int m = 0; m < mel_count; m++) {
+        const float energy = Dot({filters[m].weights.data(), filters[m].weights.size()}, power + filters[m].start);
+        features[m * frame_count + frame] = std::log10(std::max(energy, 1e-10f));
+      }
+    }
+  });
+
+  const float max = *std::max_element(features.begin(), features.end());
+  for (auto& value : features)
+    value = (std::max(value, max - 8.0f) + 4.0f) / 4.0f;
+}
+
+}  // namespace Generators
@@ -0,0 +1,22 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// Whisper's audio front end, what its Python feature extractor computes: 16 kHz mono audio padded with silence to a
+// whole number of 10 ms frames, a 25 ms periodic Hann windowed STFT every 10 ms, a slaney mel filterbank over the power
+// spectrum, then log10 clamped to 80 dB under the peak and scaled to about [-1, 1]
+constexpr int c_whisper_sample_rate = 16000;
+constexpr int c_whisper_hop_length = 160;    // 10 ms
+constexpr int c_whisper_frame_count = 3000;  // 30 seconds, the window of the encoder
+
+// Resamples mono pcm to 16 kHz with a polyphase windowed sinc filter, a copy if it's already at 16 kHz
+std::vector<float> ResampleTo16kHz(std::span<const float> pcm, int sample_rate);
+
+// Writes the log mel spectrogram of 16 kHz pcm to features, [mel_count, frame_count] with as many frames as it holds.
+// The pcm is padded with silence, or cut, to frame_count * c_whisper_hop_length samples. The dot products of the STFT
+// and the filterbank use the CPU's vector instructions, and the frames are split between the threads of GetThreadPool()
+void ComputeLogMelSpectrogram(std::span<const float> pcm, int mel_count, std::span<float> features);
+
+}  // namespace Generators
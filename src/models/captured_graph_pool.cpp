@@ -18,101 +18,224 @@ void CapturedGraphInfoRecycler::operator()(CapturedGraphInfo* captured_graph_inf
   }
 }
 
-CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model, const GeneratorParams& params) const {
+CapturedGraphInfoPtr CapturedGraphPool::ReserveCapturedGraph(const Model& model, const GeneratorParams& params, int64_t encoder_sequence_length) const {
   if (!params.use_cuda_graph || (model.device_type_ != DeviceType::CUDA && model.device_type_ != DeviceType::DML)) {
     return nullptr;
   }
 
+  const int max_batch_size = GetMaxBatchSize(params);
+
   // Multiple generators can reserve graphs in parallel, so we need to make it thread saf
   std::unique_lock lock(captured_graph_mutex_);
 
-  auto key = std::make_unique<CapturedGraphKey>(params.max_batch_size, params.search.max_length, params.search.num_beams, params.extra_inputs);
-  auto& captured_graphs = captured_graphs_map_[*key];
+  auto& captured_graphs = captured_graphs_map_[CapturedGraphKey(max_batch_size, params.search.max_length, params.search.num_beams, params.extra_inputs, encoder_sequence_length)];
 
   // If no graphs are available, create a graph with a new ID
   if (captured_graphs.empty()) {
-    auto new_captured_graph = CapturedGraphInfoPtr(new CapturedGraphInfo);
+    // We can unlock the mutex here since we don't access state that is subject to changes after this point
+    lock.unlock();
+    EvictOverBudget();  // Make room for the new graph's buffers
+    return CreateCapturedGraph(model, max_batch_size, params.search.max_length, params.search.num_beams, params.extra_inputs, encoder_sequence_length);
+  }
+
+  // We found a graph, so take it from the pool and return it to the caller. The most recently returned one, so the graphs
+  // that sit idle the longest are the ones left to evict
+  auto captured_graph = std::move(captured_graphs.back());
+  captured_graphs.pop_back();
+  return captured_graph;
+}
+
+int CapturedGraphPool::GetMaxBatchSize(const GeneratorParams& params) const {
+  auto& buckets = config_->model.decoder.graph_capture_batch_sizes;
+  if (buckets.empty())
+    return params.max_batch_size;
 
+  const int batch_size = std::max(params.max_batch_size, params.batch_size);
+  auto bucket = std::lower_bound(buckets.begin(), buckets.end(), batch_size);
+  if (bucket == buckets.end())
+    throw std::runtime_error("Batch size " + std::to_string(batch_size) + " is larger than the largest graph_capture_batch_sizes bucket (" + std::to_string(buckets.back()) + ")");
+  return *bucket;
+}
+
+void CapturedGraphPool::AddBucketGraphs(const Model& model) const {
+  if (!IsCudaGraphEnabled(config_->model.decoder.session_options) || (model.device_type_ != DeviceType::CUDA && model.device_type_ != DeviceType::DML))
+    return;
+
+  // Generators with the configured search options and no extra inputs will find these
+  const auto& search = config_->search;
+  for (int max_batch_size : config_->model.decoder.graph_capture_batch_sizes)
+    AddCapturedGraph(CreateCapturedGraph(model, max_batch_size, search.max_length, search.num_beams, {}));
+}
+
+CapturedGraphInfoPtr CapturedGraphPool::CreateCapturedGraph(const Model& model, int max_batch_size, int max_length, int num_beams,
+                                                            const std::vector<GeneratorParams::Input>& extra_inputs,
+                                                            int64_t encoder_sequence_length) const {
+  auto new_captured_graph = CapturedGraphInfoPtr(new CapturedGraphInfo);
+
+  {
     // Create a unique annotation id
+    std::lock_guard lock(captured_graph_mutex_);
     new_captured_graph->index_ = current_graph_annotation_id_++;
+  }
 
-    // We can unlock the mutex here since we don't access state that is subject to changes after this point
-    lock.unlock();
-
-    new_captured_graph->max_batch_size_ = params.max_batch_size;
-    new_captured_graph->max_length_ = params.search.max_length;
-    new_captured_graph->num_beams_ = params.search.num_beams;
-    new_captured_graph->pool_ = shared_from_this();
+  new_captured_graph->max_batch_size_ = max_batch_size;
+  new_captured_graph->max_length_ = max_length;
+  new_captured_graph->num_beams_ = num_beams;
+  new_captured_graph->pool_ = shared_from_this();
+  created_graph_count_++;
 
-    // Create the static buffer for the input ids
-    size_t max_beam_batch_size = static_cast<size_t>(params.search.num_beams) * params.max_batch_size;
-    new_captured_graph->sb_input_ids_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+  // Create the static buffer for the input ids
+  size_t max_beam_batch_size = static_cast<size_t>(num_beams) * max_batch_size;
+  new_captured_graph->sb_input_ids_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
 
 #if USE_DML
-    if (model.device_type_ == DeviceType::DML) {
-      new_captured_graph->sb_input_ids_int32_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
-    }
+  if (model.device_type_ == DeviceType::DML) {
+    new_captured_graph->sb_input_ids_int32_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
+  }
 #endif
 
-    // Create the static buffers for the cache
-    int layer_count = config_->model.decoder.num_hidden_layers;
-    new_captured_graph->sb_kv_caches_.reserve(layer_count * 2);
+  // Create the static buffers for the cache
+  int layer_count = config_->model.decoder.num_hidden_layers;
+  new_captured_graph->sb_kv_caches_.reserve(layer_count * 2);
+
+  for (int i = 0; i < layer_count * 2; ++i) {
+    new_captured_graph->sb_kv_caches_.push_back(std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_));
+  }
 
+  // Create the static buffers for the cross attention caches of encoder decoder models, like Whisper
+  if (encoder_sequence_length > 0) {
+    new_captured_graph->sb_cross_caches_.reserve(layer_count * 2);
     for (int i = 0; i < layer_count * 2; ++i) {
-      new_captured_graph->sb_kv_caches_.push_back(std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size));
+      new_captured_graph->sb_cross_caches_.push_back(std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_));
     }
+  }
 
-    // Create the static buffer for the position ids, if needed
-    if (session_info_->HasInput(config_->model.decoder.inputs.position_ids)) {
-      new_captured_graph->sb_position_ids_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
-    }
+  // Create the static buffer for the position ids, if needed
+  if (session_info_->HasInput(config_->model.decoder.inputs.position_ids)) {
+    new_captured_graph->sb_position_ids_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
+  }
 
-    // Create the static buffer for the attention mask, if needed
-    if (session_info_->HasInput(config_->model.decoder.inputs.attention_mask)) {
-      new_captured_graph->sb_attention_mask_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+  // Create the static buffer for the attention mask, if needed
+  if (session_info_->HasInput(config_->model.decoder.inputs.attention_mask)) {
+    new_captured_graph->sb_attention_mask_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
 
 #if USE_DML
-      // DML currently needs an additional static buffer for the mask
-      if (model.device_type_ == DeviceType::DML) {
-        new_captured_graph->sb_attention_mask_next_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
-      }
-#endif
+    // DML currently needs an additional static buffer for the mask
+    if (model.device_type_ == DeviceType::DML) {
+      new_captured_graph->sb_attention_mask_next_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
     }
+#endif
+  }
 
-    auto output_type = session_info_->GetOutputDataType(config_->model.decoder.outputs.logits);
+  auto output_type = session_info_->GetOutputDataType(config_->model.decoder.outputs.logits);
 
-    if (output_type == Ort::TypeToTensorType<float>::type) {
-      new_captured_graph->sb_logits32_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
-    }
+  if (output_type == Ort::TypeToTensorType<float>::type) {
+    new_captured_graph->sb_logits32_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
+  }
 
-    if (output_type == Ort::TypeToTensorType<Ort::Float16_t>::type) {
-      new_captured_graph->sb_logits16_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
-    }
+  if (output_type == Ort::TypeToTensorType<Ort::Float16_t>::type) {
+    new_captured_graph->sb_logits16_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
+  }
 
-    // Create the extra inputs
-    for (const auto& extra_input : params.extra_inputs) {
-      auto first_dim = extra_input.tensor->ort_tensor_->GetTensorTypeAndShapeInfo()->GetShape()[0];
-      new_captured_graph->sb_extra_inputs_[extra_input.name] = std::make_unique<StaticBuffer>(allocator_device_, first_dim);
-    }
+  // Create the extra inputs
+  for (const auto& extra_input : extra_inputs) {
+    auto first_dim = extra_input.tensor->ort_tensor_->GetTensorTypeAndShapeInfo()->GetShape()[0];
+    new_captured_graph->sb_extra_inputs_[extra_input.name] = std::make_unique<StaticBuffer>(allocator_device_, first_dim, static_buffer_bytes_, budget_);
+  }
 
-    // Create the input embeddings if needed
-    if (!model.config_->model.embedding.filename.empty()) {
-      new_captured_graph->sb_embeddings_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size);
+  // Create the input embeddings if needed
+  if (!model.config_->model.embedding.filename.empty()) {
+    new_captured_graph->sb_embeddings_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
+  }
+
+  // The prefill graphs only take the prompt's inputs, so generators with extra inputs or input embeddings don't get them.
+  // Encoder decoder models run their prompt in the encoder session
+  if (model.device_type_ == DeviceType::CUDA && extra_inputs.empty() && !new_captured_graph->sb_embeddings_ && encoder_sequence_length == 0) {
+    for (int length : config_->model.decoder.graph_capture_prompt_lengths) {
+      if (length >= max_length)
+        break;
+      auto& prompt_graph = new_captured_graph->prompt_graphs_.emplace_back();
+      prompt_graph.length_ = length;
+      {
+        std::lock_guard lock(captured_graph_mutex_);
+        prompt_graph.index_ = current_graph_annotation_id_++;
+      }
+      prompt_graph.sb_input_ids_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
+      if (new_captured_graph->sb_position_ids_)
+        prompt_graph.sb_position_ids_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
+      if (new_captured_graph->sb_attention_mask_)
+        prompt_graph.sb_attention_mask_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
+      prompt_graph.sb_logits_ = std::make_unique<StaticBuffer>(allocator_device_, max_beam_batch_size, static_buffer_bytes_, budget_);
     }
+  }
 
-    new_captured_graph->key_ = std::move(key);
+  new_captured_graph->key_ = std::make_unique<CapturedGraphKey>(max_batch_size, max_length, num_beams, extra_inputs, encoder_sequence_length);
 
-    return new_captured_graph;
-  }
+  return new_captured_graph;
+}
 
-  // We found a graph, so take it from the pool and return it to the caller
-  auto captured_graph = std::move(captured_graphs.front());
-  captured_graphs.pop_front();
-  return captured_graph;
+std::unique_ptr<OrtValue> CopyToStaticBuffer(StaticBuffer& buffer, const OrtValue& value, [[maybe_unused]] cudaStream_t stream) {
+  auto info = value.GetTensorTypeAndShapeInfo();
+  auto copy = buffer.CreateTensorOnStaticBuffer(info->GetShape(), info->GetElementType());
+#if USE_CUDA
+  cudaMemcpyAsync(copy->GetTensorMutableRawData(), value.GetTensorRawData(), info->GetElementCount() * SizeOf(info->GetElementType()), cudaMemcpyDeviceToDevice, stream);
+  return copy;
+#else
+  throw std::runtime_error("CopyToStaticBuffer is only supported on CUDA");
+#endif
 }
 
 void CapturedGraphPool::AddCapturedGraph(CapturedGraphInfoPtr&& captured_graph) const {
-  std::unique_lock lock(captured_graph_mutex_);
-  captured_graphs_map_[*captured_graph->key_].push_back(std::move(captured_graph));
+  {
+    std::unique_lock lock(captured_graph_mutex_);
+    captured_graph->last_returned_ = ++return_count_;
+    captured_graphs_map_[*captured_graph->key_].push_back(std::move(captured_graph));
+  }
+  // Its buffers are allocated on its first run, so this is when the pool learns what the graph costs
+  EvictOverBudget();
+}
+
+bool CapturedGraphPool::EvictPooledGraph() const {
+  std::unique_ptr<CapturedGraphInfo> evicted;
+  {
+    std::lock_guard lock(captured_graph_mutex_);
+
+    // Each list is in the order its graphs were returned, so the least recently used graph is at the front of one of them
+    auto oldest = captured_graphs_map_.end();
+    for (auto it = captured_graphs_map_.begin(); it != captured_graphs_map_.end(); ++it) {
+      if (!it->second.empty() && (oldest == captured_graphs_map_.end() || it->second.front()->last_returned_ < oldest->second.front()->last_returned_))
+        oldest = it;
+    }
+    if (oldest == captured_graphs_map_.end())
+      return false;
+
+    // Released from its recycler, which would only return it to the pool
+    evicted.reset(oldest->second.front().release());
+    oldest->second.pop_front();
+    if (oldest->second.empty())
+      captured_graphs_map_.erase(oldest);  // Keys of shapes that stop coming back don't pile up either
+  }
+  evicted_graph_count_++;
+  return true;  // The static buffers are freed as evicted goes out of scope, outside of the lock
+}
+
+void CapturedGraphPool::EvictOverBudget() const {
+  const int64_t budget_bytes = GetBudgetBytes();
+  if (budget_bytes == 0)
+    return;
+  while (*static_buffer_bytes_ > budget_bytes && EvictPooledGraph()) {
+  }
+}
+
+int64_t CapturedGraphPool::GetPooledGraphCount() const {
+  std::lock_guard lock(captured_graph_mutex_);
+  int64_t count = 0;
+  for (const auto& [key, captured_graphs] : captured_graphs_map_)
+    count += static_cast<int64_t>(captured_graphs.size());
+  return count;
+}
+
+int64_t CapturedGraphPool::GetBudgetBytes() const {
+  return static_cast<int64_t>(config_->model.decoder.graph_capture_pool_budget_mb) << 20;
 }
 }  // namespace Generators
@@ -29,10 +29,12 @@ struct InputKey {
 };
 
 struct CapturedGraphKey {
-  CapturedGraphKey(int max_batch_size, int max_length, int num_beams, const std::vector<Generators::GeneratorParams::Input>& extra_inputs)
+  CapturedGraphKey(int max_batch_size, int max_length, int num_beams, const std::vector<Generators::GeneratorParams::Input>& extra_inputs,
+                   int64_t encoder_sequence_length = 0)
       : max_batch_size_(max_batch_size),
         max_length_(max_length),
-        num_beams_(num_beams) {
+        num_beams_(num_beams),
+        encoder_sequence_length_(encoder_sequence_length) {
     extra_inputs_.reserve(extra_inputs.size());
 
     for (const auto& extra_input : extra_inputs) {
@@ -50,12 +52,14 @@ struct CapturedGraphKey {
     return max_batch_size_ == other.max_batch_size_ &&
            max_length_ == other.max_length_ &&
            num_beams_ == other.num_beams_ &&
+           encoder_sequence_length_ == other.encoder_sequence_length_ &&
            extra_inputs_ == other.extra_inputs_;
   }
 
   int max_batch_size_;
   int max_length_;
   int num_beams_;
+  int64_t encoder_sequence_length_;  // Of the cross attention caches, 0 for models without them
   std::vector<InputKey> extra_inputs_;
 };
 
@@ -90,6 +94,7 @@ struct std::hash<CapturedGraphKey> {
     hash_combine(seed, captured_graph_key.max_batch_size_);
     hash_combine(seed, captured_graph_key.max_length_);
     hash_combine(seed, captured_graph_key.num_beams_);
+    hash_combine(seed, captured_graph_key.encoder_sequence_length_);
     hash_combine(seed, captured_graph_key.extra_inputs_);
     return seed;
   }
@@ -109,40 +114,100 @@ using CapturedGraphInfoPtr = std::unique_ptr<CapturedGraphInfo, CapturedGraphInf
 
 class CapturedGraphPool : public std::enable_shared_from_this<CapturedGraphPool> {
  public:
-  CapturedGraphPool(const Config* config, const SessionInfo* session_info, Ort::Allocator* allocator_device)
+  CapturedGraphPool(const Config* config, const SessionInfo* session_info, Ort::Allocator* allocator_device,
+                    std::shared_ptr<DeviceMemoryBudget> budget = {})
       : config_(config),
         session_info_(session_info),
-        allocator_device_(allocator_device){};
+        allocator_device_(allocator_device),
+        budget_(std::move(budget)){};
 
   void AddCapturedGraph(CapturedGraphInfoPtr&& captured_graph) const;
-  CapturedGraphInfoPtr ReserveCapturedGraph(const Model& model, const GeneratorParams& params) const;
+  // encoder_sequence_length is the length of the cross attention caches of encoder decoder models, as a graph only
+  // replays the shapes it was captured with
+  CapturedGraphInfoPtr ReserveCapturedGraph(const Model& model, const GeneratorParams& params, int64_t encoder_sequence_length = 0) const;
+
+  // Adds a graph for every model.decoder.graph_capture_batch_sizes bucket, so their annotation IDs and buffers are
+  // ready before the first generator. Each one is captured on its first run and replayed by every later generator.
+  void AddBucketGraphs(const Model& model) const;
+
+  // The max_batch_size of the graphs used by params, with buckets this is the smallest bucket that fits the batch
+  int GetMaxBatchSize(const GeneratorParams& params) const;
+
+  // Bytes allocated by the static buffers of this pool's graphs, whether they're pooled or reserved
+  int64_t GetStaticBufferBytes() const { return *static_buffer_bytes_; }
+
+  // Destroys the least recently used of the pooled graphs that no generator is using, freeing its static buffers. Returns
+  // false if there are none. A DeviceMemoryBudget eviction hook, later generators capture new graphs in their place
+  bool EvictPooledGraph() const;
+
+  // For the model's metrics: every graph that hasn't been evicted, those of them waiting in the pool, the evictions so
+  // far, and model.decoder.graph_capture_pool_budget_mb in bytes (0 when unlimited)
+  int64_t GetGraphCount() const { return created_graph_count_ - evicted_graph_count_; }
+  int64_t GetPooledGraphCount() const;
+  int64_t GetEvictedGraphCount() const { return evicted_graph_count_; }
+  int64_t GetBudgetBytes() const;
 
  private:
+  // Evicts pooled graphs while the static buffers are over model.decoder.graph_capture_pool_budget_mb. The graphs in use
+  // can't be, so the budget only bounds what the idle ones add
+  void EvictOverBudget() const;
+
+  CapturedGraphInfoPtr CreateCapturedGraph(const Model& model, int max_batch_size, int max_length, int num_beams,
+                                           const std::vector<Generators::GeneratorParams::Input>& extra_inputs,
+                                           int64_t encoder_sequence_length = 0) const;
+
   // Map from batch_size/max_length to a list of captured graphs
   mutable std::unordered_map<CapturedGraphKey, std::list<CapturedGraphInfoPtr>> captured_graphs_map_;
   mutable std::mutex captured_graph_mutex_;
 
   // 0 is reserved for internal usage in cuda graphs, so we start from 1
   mutable int current_graph_annotation_id_ = 1;
+  mutable uint64_t return_count_{};  // Stamps CapturedGraphInfo::last_returned_, under captured_graph_mutex_
+  mutable std::atomic<int64_t> created_graph_count_{};
+  mutable std::atomic<int64_t> evicted_graph_count_{};
   const Config* config_;
   const SessionInfo* session_info_;
   Ort::Allocator* allocator_device_;
+  std::shared_ptr<std::atomic<int64_t>> static_buffer_bytes_{std::make_shared<std::atomic<int64_t>>()};  // Shared with the buffers, which can outlive the pool
+  std::shared_ptr<DeviceMemoryBudget> budget_;
+};
+
+// The static buffers of the prefill graph for prompts padded to one of model.decoder.graph_capture_prompt_lengths. The kv
+// caches are the decode graph's, as they're allocated for the whole max_length
+struct CapturedPromptGraph {
+  int length_;
+  int index_;  // Its own annotation index, so it doesn't collide with the decode graph of the same batch size
+  std::unique_ptr<Generators::StaticBuffer> sb_input_ids_;
+  std::unique_ptr<Generators::StaticBuffer> sb_position_ids_;
+  std::unique_ptr<Generators::StaticBuffer> sb_attention_mask_;
+  std::unique_ptr<Generators::StaticBuffer> sb_logits_;
+
+  int GenerateUniqueAnnotationID(int batch_size) const {
+    int bit_shift = sizeof(int) * 8 / 2;
+    return (index_ << bit_shift) | batch_size;
+  }
 };
 
+// A copy of value, a tensor on the device, in buffer. For the inputs of a captured graph that are built elsewhere
+std::unique_ptr<OrtValue> CopyToStaticBuffer(StaticBuffer& buffer, const OrtValue& value, cudaStream_t stream);
+
 struct CapturedGraphInfo {
   std::weak_ptr<const CapturedGraphPool> pool_;
   int max_batch_size_;
   int max_length_;
   int num_beams_;
   int index_;
+  uint64_t last_returned_{};  // When it was last returned to the pool, the one returned longest ago is evicted first
   std::unique_ptr<Generators::StaticBuffer> sb_input_ids_;
   std::vector<std::unique_ptr<Generators::StaticBuffer>> sb_kv_caches_;
+  std::vector<std::unique_ptr<Generators::StaticBuffer>> sb_cross_caches_;  // Written once by the encoder step, read by every decoder step
   std::unique_ptr<Generators::StaticBuffer> sb_logits16_;
   std::unique_ptr<Generators::StaticBuffer> sb_logits32_;
   std::unique_ptr<Generators::StaticBuffer> sb_position_ids_;
   std::unique_ptr<Generators::StaticBuffer> sb_attention_mask_;
   std::unordered_map<std::string, std::unique_ptr<Generators::StaticBuffer>> sb_extra_inputs_;
   std::unique_ptr<Generators::StaticBuffer> sb_embeddings_;
+  std::vector<CapturedPromptGraph> prompt_graphs_;  // Sorted by length
   std::unique_ptr<CapturedGraphKey> key_;
 
 #if USE_DML
@@ -159,5 +224,11 @@ struct CapturedGraphInfo {
     int bit_shift = sizeof(int) * 8 / 2;
     return (index_ << bit_shift) | batch_size;
   }
+
+  // The prefill graph of prompts with exactly sequence_length tokens, if there's a bucket of that length
+  const CapturedPromptGraph* FindPromptGraph(int sequence_length) const {
+    auto it = std::find_if(prompt_graphs_.begin(), prompt_graphs_.end(), [&](const CapturedPromptGraph& graph) { return graph.length_ == sequence_length; });
+    return it != prompt_graphs_.end() ? &*it : nullptr;
+  }
 };
 }  // namespace Generators
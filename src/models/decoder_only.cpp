@@ -1,46 +1,368 @@
 #include "../generators.h"
+#include "../float16.h"
 #include "decoder_only.h"
+#include "embedding_state.h"
+#include "kernels.h"
 
 namespace Generators {
+
+namespace {
+
+// Prefix caching and chunked prefill split the prompt into ranges of a single unpadded sequence, and need the kv
+// caches to grow run to run (the shared past/present buffers & graph capture use fixed size ones, windowed ones drop entries)
+bool CanSplitPrompt(const DecoderOnly_Model& model, const GeneratorParams& params) {
+  if (params.batch_size != 1 || params.search.num_beams != 1 || params.use_cuda_graph || params.search.past_present_share_buffer || params.search.kv_window_size > 0)
+    return false;
+  if (model.device_type_ != DeviceType::CPU && model.device_type_ != DeviceType::CUDA)
+    return false;
+  return std::find(params.input_ids.begin(), params.input_ids.end(), params.pad_token_id) == params.input_ids.end();
+}
+
+// The cached prefixes are the base model's kv caches
+bool UsesAdapter(const GeneratorParams& params) {
+  return std::any_of(params.adapter_names.begin(), params.adapter_names.end(), [](const std::string& name) { return !name.empty(); });
+}
+
+// Each prompt of the batch is run as a single unpadded sequence, so the extra inputs of the batch can't be split up
+bool CanPrefillUnpadded(const DecoderOnly_Model& model, const GeneratorParams& params) {
+  if (!params.search.unpadded_prefill || params.batch_size == 1 || params.use_cuda_graph || params.search.kv_window_size > 0 || !params.extra_inputs.empty())
+    return false;
+  return model.device_type_ == DeviceType::CPU || model.device_type_ == DeviceType::CUDA;
+}
+
+// Finished rows are dropped by gathering the rest of every input, so the fixed size buffers of graph capture and
+// past_present_share_buffer, windowed kv caches, extra inputs and adapter ids keep running the whole batch
+bool CanCompactRows(const DecoderOnly_Model& model, const GeneratorParams& params) {
+  if (!params.search.compact_finished_rows || params.search.num_beams != 1 || params.batch_size == 1)
+    return false;
+  if (params.use_cuda_graph || params.search.past_present_share_buffer || params.search.kv_window_size > 0 || !params.extra_inputs.empty() || UsesAdapter(params))
+    return false;
+  if (model.device_type_ == DeviceType::CUDA)
+    return params.batch_size <= cuda::c_gather_beams_max_beams;
+  return model.device_type_ == DeviceType::CPU;
+}
+
+// A prefix from a saved state continues the same sequence, see Generator::RestoreState
+std::shared_ptr<const PrefixCache::Entry> GetRestoredPrefix(const DecoderOnly_Model& model, const GeneratorParams& params) {
+  auto& prefix = params.restored_prefix;
+  if (!CanSplitPrompt(model, params))
+    throw std::runtime_error("A saved state can only be restored into a single unpadded sequence without beams, graph capture, past_present_share_buffer or kv_window_size");
+  if (prefix->tokens.size() >= params.input_ids.size() || !std::equal(prefix->tokens.begin(), prefix->tokens.end(), params.input_ids.begin()))
+    throw std::runtime_error("The input_ids must start with the " + std::to_string(prefix->tokens.size()) + " tokens of the saved state and add at least one more");
+  return prefix;
+}
+
+}  // namespace
+
 DecoderOnly_Model::DecoderOnly_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
     : Model{std::move(config)} {
-  session_decoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
+  auto filename = config_->model.decoder.filename;
+  // Each rank loads its own shard, the AllReduce ops in them keep the processes in lockstep
+  if (config_->model.decoder.tensor_parallel_size > 1)
+    filename = FormatIndexedName(filename, tensor_parallel_rank_);
+  session_decoder_ = CreateSession(ort_env, filename, session_options_.get());
 
   InitDeviceAllocator(*session_decoder_);
+  InitAdapters(*session_decoder_);
 }
 
 std::unique_ptr<State> DecoderOnly_Model::CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const {
+  if (config_->model.decoder.static_window_size > 0)
+    return std::make_unique<DecoderOnly_WindowedState>(*this, params);
   return std::make_unique<DecoderOnly_State>(*this, sequence_lengths, params);
 }
 
+std::unique_ptr<Embedding_State> DecoderOnly_Model::CreateEmbeddingState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const {
+  return std::make_unique<Embedding_State>(*this, *session_decoder_, sequence_lengths, params);
+}
+
 DecoderOnly_State::DecoderOnly_State(const DecoderOnly_Model& model, RoamingArray<int32_t> sequence_lengths_unk, const GeneratorParams& params)
     : State{params, model},
       model_{model},
       captured_graph_info_(model.GetCapturedGraphPool()->ReserveCapturedGraph(model, params)),
+      prompt_graph_{captured_graph_info_ ? captured_graph_info_->FindPromptGraph(params.sequence_length) : nullptr},
+      use_prefix_cache_{model.GetPrefixCache() && CanSplitPrompt(model, params) && !UsesAdapter(params)},
+      prefill_chunk_size_{params.search.prefill_chunk_size > 0 && CanSplitPrompt(model, params) ? static_cast<size_t>(params.search.prefill_chunk_size) : 0},
+      unpadded_prefill_{CanPrefillUnpadded(model, params)},
+      cached_prefix_{params.restored_prefix ? GetRestoredPrefix(model, params) : use_prefix_cache_ ? model.GetPrefixCache()->Find(params.input_ids) : nullptr},
       position_inputs_{model, *this, sequence_lengths_unk} {
   input_ids_.Add();
   position_inputs_.Add();
   logits_.Add();
   kv_cache_.Add();
   extra_inputs_.Add();
+  adapter_inputs_.Add();
+
+  if (CanCompactRows(model, params)) {
+    rows_.resize(params.batch_size);
+    std::iota(rows_.begin(), rows_.end(), 0);
+    row_tokens_.resize(params.batch_size);
+#if USE_CUDA
+    if (model.device_type_ == DeviceType::CUDA)
+      row_tokens_device_ = CudaMallocArray<int32_t>(params.batch_size);
+#endif
+  }
 }
 
 RoamingArray<float> DecoderOnly_State::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
   if (!first_run_) {
-    UpdateInputsOutputs(next_tokens, next_indices, current_length);
+    UpdateInputsOutputs(GetRowTokens(next_tokens), next_indices, current_length);
+    if (!kept_rows_.empty())
+      DropRows();
+  }
+
+  bool is_prompt = first_run_;
+  if (is_prompt && unpadded_prefill_) {
+    RunUnpaddedPrompts();
+    return logits_.Get();
   }
 
   int batch_size = static_cast<int>(input_ids_.GetShape()[0]);
-  State::Run(*model_.session_decoder_, *model_.run_options_, batch_size);
+  State::Run(*model_.session_decoder_, *run_options_, batch_size);
+
+  // With chunked prefill, feed the rest of the prompt through the same kv cache that's used for generation
+  if (is_prompt) {
+    const size_t prompt_length = params_->sequence_length;
+    for (size_t start = GetFirstRunEnd(); start < prompt_length;) {
+      const size_t end = std::min(prompt_length, start + prefill_chunk_size_);
+      input_ids_.AdvancePrompt(start, end);
+      position_inputs_.AdvancePrompt(start, end);
+      kv_cache_.Update({}, static_cast<int>(end));
+      logits_.AdvancePrompt(start, end);
+      State::Run(*model_.session_decoder_, *run_options_, batch_size);
+      start = end;
+    }
+  }
+
+  if (is_prompt && use_prefix_cache_) {
+    auto* prefix_cache = model_.GetPrefixCache();
+    if (auto length = prefix_cache->GetStoreLength(params_->input_ids); length > GetCachedPrefixLength()) {
+      auto entry = std::make_shared<PrefixCache::Entry>();
+      entry->tokens.assign(params_->input_ids.begin(), params_->input_ids.begin() + length);
+      entry->kv = kv_cache_.CopyPresents(static_cast<int>(length));
+#if USE_CUDA
+      // The copies are on this generator's stream, the ones finding the entry read it on theirs
+      if (model_.device_type_ == DeviceType::CUDA)
+        CudaCheck() == cudaStreamSynchronize(cuda_stream_);
+#endif
+      prefix_cache->Store(std::move(entry));
+    }
+  }
 
   return logits_.Get();
 }
 
+RoamingArray<float> DecoderOnly_State::RunTokens(size_t past_length, std::span<const int32_t> tokens) {
+  if (first_run_)
+    throw std::runtime_error("RunTokens can only continue a sequence after the prompt has been run");
+
+  const size_t end = past_length + tokens.size();
+  kv_cache_.Rewind(static_cast<int>(past_length));
+  input_ids_.AdvanceSequence(tokens);
+  position_inputs_.AdvanceSequence(past_length, end);
+  kv_cache_.Update({}, static_cast<int>(end));
+  logits_.AdvancePrompt(past_length, end);
+  State::Run(*model_.session_decoder_, *run_options_, 1);
+  return logits_.GetAll();
+}
+
+void DecoderOnly_State::SwapOut() {
+  if (first_run_)
+    throw std::runtime_error("A generator can only be swapped out after its prompt has run");
+  if (swapped_out_)
+    return;
+
+  // Past the kv caches, only the attention mask outlives a run on the step arenas
+  position_inputs_.MoveOffStepArena();
+  kv_cache_.SwapOut();
+  ReleaseStepArenas();
+  swapped_out_ = true;
+}
+
+void DecoderOnly_State::SwapIn() {
+  if (!swapped_out_)
+    return;
+
+  kv_cache_.SwapIn();
+  swapped_out_ = false;
+}
+
+std::vector<std::unique_ptr<OrtValue>> DecoderOnly_State::CopyKVCaches(int length) const {
+  if (params_->BatchBeamSize() != 1)
+    throw std::runtime_error("Only the state of a single sequence without beams can be saved");
+  if (params_->search.kv_window_size > 0)
+    throw std::runtime_error("The state of kv caches with a kv_window_size can't be saved, they've dropped entries");
+  return kv_cache_.CopyPresents(length);
+}
+
+// Runs the prompt of every batch entry on its own, up to its last non pad token, then puts its kv caches and last token
+// logits where a run of the padded batch would have, so the generation goes on as if it had run. The prompts only cost
+// their own tokens, and each one can use the prefix cache and chunked prefill of a single sequence.
+void DecoderOnly_State::RunUnpaddedPrompts() {
+  TraceSpan span{"DecoderOnly_State::RunUnpaddedPrompts"};
+  const size_t prompt_length = params_->sequence_length;
+  const int num_beams = params_->search.num_beams;
+  for (int batch_index = 0; batch_index < params_->batch_size; batch_index++) {
+    auto prompt = params_->input_ids.subspan(batch_index * prompt_length, prompt_length);
+    size_t length = prompt_length;
+    while (length > 1 && prompt[length - 1] == params_->pad_token_id)
+      length--;
+
+    auto params = std::make_shared<GeneratorParams>(*params_);
+    params->batch_size = 1;
+    params->search.num_beams = 1;
+    params->search.unpadded_prefill = false;
+    params->sequence_length = static_cast<int>(length);
+    params->input_ids = prompt.subspan(0, length);
+    if (params_->adapter_names.size() > 1)
+      params->adapter_names = {params_->adapter_names[batch_index]};
+
+    std::array<int32_t, 1> sequence_lengths{};
+    DecoderOnly_State state{model_, cpu_span<int32_t>{sequence_lengths.data(), sequence_lengths.size()}, *params};
+    state.Run(static_cast<int>(length), {}, {});
+
+    // The beams of an entry start from the same prompt
+    for (int beam_index = 0; beam_index < num_beams; beam_index++) {
+      const int batch_beam_index = batch_index * num_beams + beam_index;
+      kv_cache_.CopyBatchEntry(state.kv_cache_, batch_beam_index, static_cast<int>(length));
+      logits_.CopyPromptEntry(state.logits_, batch_beam_index, length - 1);
+    }
+  }
+  first_run_ = false;
+}
+
+void DecoderOnly_State::SetFinishedRows(std::span<const bool> finished) {
+  if (rows_.empty() || finished.empty())
+    return;
+
+  kept_rows_.clear();
+  for (size_t row = 0; row < rows_.size(); row++) {
+    if (!finished[rows_[row]])
+      kept_rows_.push_back(static_cast<int32_t>(row));
+  }
+  // Once every row has finished so has the generator, and there's nothing to drop while none has
+  if (kept_rows_.empty() || kept_rows_.size() == rows_.size())
+    kept_rows_.clear();
+}
+
+RoamingArray<int32_t> DecoderOnly_State::GetRowTokens(RoamingArray<int32_t> next_tokens) {
+  if (rows_.size() == static_cast<size_t>(params_->batch_size) || rows_.empty())
+    return next_tokens;
+
+#if USE_CUDA
+  if (next_tokens.IsOnGPU()) {
+    GatherRows(model_, next_tokens.GetGPU().data(), row_tokens_device_.get(), rows_, sizeof(int32_t), cuda_stream_);
+    return {gpu_span<int32_t>{row_tokens_device_.get(), rows_.size()}, cuda_stream_};
+  }
+#endif
+  auto tokens = next_tokens.GetCPU();
+  for (size_t row = 0; row < rows_.size(); row++)
+    row_tokens_[row] = tokens[rows_[row]];
+  return cpu_span<int32_t>{row_tokens_.data(), rows_.size()};
+}
+
+// The inputs were just updated for the next run, so they all have the same rows. Each of them keeps the kept ones, and
+// the logits put them back in their place in the batch for the search
+void DecoderOnly_State::DropRows() {
+  TraceSpan span{"DecoderOnly_State::DropRows"};
+  input_ids_.DropRows(kept_rows_);
+  position_inputs_.DropRows(kept_rows_);
+  kv_cache_.DropRows(kept_rows_);
+
+  std::vector<int32_t> rows;
+  for (auto row : kept_rows_)
+    rows.push_back(rows_[row]);
+  rows_ = std::move(rows);
+  logits_.DropRows(rows_);
+  kept_rows_.clear();
+}
+
 void DecoderOnly_State::UpdateInputsOutputs(const RoamingArray<int32_t>& next_tokens_unk, RoamingArray<int32_t> beam_indices, int current_length) {
   input_ids_.Update(next_tokens_unk);
   position_inputs_.Update(current_length);
-  kv_cache_.Update(beam_indices.GetCPU(), current_length);
+  kv_cache_.Update(beam_indices, current_length);
   logits_.Update();
 }
 
+DecoderOnly_WindowedState::DecoderOnly_WindowedState(const DecoderOnly_Model& model, const GeneratorParams& params)
+    : State{params, model},
+      model_{model},
+      prompt_window_size_{static_cast<size_t>(model.config_->model.decoder.static_window_size)},
+      context_length_{static_cast<size_t>(model.config_->model.context_length)},
+      window_size_{params.sequence_length > 0 ? prompt_window_size_ : 1},
+      logits_type_{model.session_info_->GetOutputDataType(model.config_->model.decoder.outputs.logits)} {
+  if (params.BatchBeamSize() != 1)
+    throw std::runtime_error("model.decoder.static_window_size only supports a single sequence without beams");
+  if (model.device_type_ != DeviceType::CPU)
+    throw std::runtime_error("model.decoder.static_window_size needs the decoder's inputs and outputs in CPU memory, not on " + to_string(model.device_type_));
+  if (prompt_window_size_ >= context_length_)
+    throw std::runtime_error("model.decoder.static_window_size must be smaller than model.context_length");
+  if (static_cast<size_t>(params.search.max_length) > context_length_)
+    throw std::runtime_error("search.max_length can't be more than model.context_length with model.decoder.static_window_size");
+  if (!params.extra_inputs.empty() || params.use_cuda_graph || params.search.past_present_share_buffer || params.search.kv_window_size > 0)
+    throw std::runtime_error("model.decoder.static_window_size can't be combined with extra inputs, graph capture, past_present_share_buffer or kv_window_size");
+
+  input_ids_.Add();
+  position_inputs_.Add();
+  kv_cache_.Add();
+  kv_cache_.SetWindowSize(window_size_);
+
+  logits_index_ = outputs_.size();
+  output_names_.push_back(model.config_->model.decoder.outputs.logits.c_str());
+  outputs_.push_back(nullptr);  // Set by RunWindow, for the window size
+}
+
+void DecoderOnly_WindowedState::RunWindow(std::span<const int32_t> tokens, size_t next_window_size) {
+  if (past_length_ + window_size_ > context_length_)
+    throw std::runtime_error("The sequence doesn't fit in model.context_length (" + std::to_string(context_length_) +
+                             ") with windows of " + std::to_string(window_size_) + " tokens");
+
+  input_ids_.SetWindow(window_size_, tokens);
+  position_inputs_.SetWindow(window_size_, past_length_, tokens.size());
+
+  const std::array<int64_t, 3> logits_shape{1, static_cast<int64_t>(window_size_), params_->vocab_size};
+  if (!logits_ || logits_->GetTensorTypeAndShapeInfo()->GetShape()[1] != logits_shape[1]) {
+    logits_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::Logits), logits_shape, logits_type_);
+    outputs_[logits_index_] = logits_.get();
+  }
+
+  State::Run(*model_.session_decoder_, *run_options_, 1);
+
+  kv_cache_.Update(past_length_, tokens.size(), next_window_size);
+  past_length_ += tokens.size();
+  last_token_count_ = tokens.size();
+  window_size_ = next_window_size;
+}
+
+RoamingArray<float> DecoderOnly_WindowedState::Run(int /*current_length*/, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> /*next_indices*/) {
+  if (first_run_) {
+    // Every window of the prompt is full but the last, which is followed by the generation's windows of one token
+    std::span<const int32_t> prompt = params_->input_ids;
+    for (size_t start = 0; start < prompt.size(); start += prompt_window_size_) {
+      const size_t end = std::min(prompt.size(), start + prompt_window_size_);
+      RunWindow(prompt.subspan(start, end - start), end == prompt.size() ? 1 : prompt_window_size_);
+    }
+    first_run_ = false;
+  } else {
+    auto tokens = next_tokens.GetCPU();
+    RunWindow(std::span<const int32_t>{tokens.data(), 1}, 1);
+  }
+
+  // The logits of the window's last token, the ones after it are pads
+  const size_t vocab_size = params_->vocab_size;
+  next_logits_.resize(vocab_size);
+  const size_t offset = (last_token_count_ - 1) * vocab_size;
+  if (logits_type_ == Ort::TypeToTensorType<float>::type) {
+    const auto* logits = logits_->GetTensorData<float>() + offset;
+    std::copy(logits, logits + vocab_size, next_logits_.begin());
+  } else if (logits_type_ == Ort::TypeToTensorType<Ort::Float16_t>::type) {
+    Fp16ToFp32(std::span<const uint16_t>{logits_->GetTensorData<uint16_t>() + offset, vocab_size}, next_logits_);
+  } else
+    throw std::runtime_error("Unsupported logits type: " + std::to_string(logits_type_));
+
+  auto logits = cpu_span<float>{next_logits_.data(), vocab_size};
+  MergeEOSLogits(*params_, logits, vocab_size);
+  return logits;
+}
+
 }  // namespace Generators
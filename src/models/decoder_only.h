@@ -12,6 +12,7 @@ struct DecoderOnly_Model : Model {
   DecoderOnly_Model(std::unique_ptr<Config> config, OrtEnv& ort_env);
 
   std::unique_ptr<State> CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const override;
+  std::unique_ptr<Embedding_State> CreateEmbeddingState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const override;
 
   std::unique_ptr<OrtSession> session_decoder_;
 };
@@ -19,19 +20,75 @@ struct DecoderOnly_Model : Model {
 struct DecoderOnly_State : State {
   DecoderOnly_State(const DecoderOnly_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params);
   RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+  RoamingArray<float> RunTokens(size_t past_length, std::span<const int32_t> tokens) override;
+  RoamingArray<float> GetDraftLogits(size_t head) override { return logits_.GetDraftAll(head); }
+  RoamingArray<float> GetAllLogits() override { return logits_.GetAll(); }
   const CapturedGraphInfo* GetCapturedGraphInfo() const override { return captured_graph_info_.get(); };
+  const CapturedPromptGraph* GetCapturedPromptGraph() const override { return prompt_graph_; }
+  const PrefixCache::Entry* GetCachedPrefix() const override { return cached_prefix_.get(); }
+  size_t GetPrefillChunkSize() const override { return prefill_chunk_size_; }
+  void SwapOut() override;
+  void SwapIn() override;
+  std::vector<std::unique_ptr<OrtValue>> CopyKVCaches(int length) const override;
+  void SetFinishedRows(std::span<const bool> finished) override;
 
  private:
   void UpdateInputsOutputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> next_indices, int current_length);
+  void RunUnpaddedPrompts();  // The first run with search.unpadded_prefill
+  RoamingArray<int32_t> GetRowTokens(RoamingArray<int32_t> next_tokens);  // The next tokens of the rows still being run
+  void DropRows();  // Drops the rows SetFinishedRows found finished from the inputs of the next runs
 
   const DecoderOnly_Model& model_;
   CapturedGraphInfoPtr captured_graph_info_;
+  const CapturedPromptGraph* prompt_graph_;  // Of captured_graph_info_, when the prompt has the length of one
+  bool use_prefix_cache_;
+  size_t prefill_chunk_size_;
+  bool unpadded_prefill_;
+  std::shared_ptr<const PrefixCache::Entry> cached_prefix_;  // Must be initialized before the inputs below, as they depend on it
+
+  // With search.compact_finished_rows, the batch entry of every row still being run, and the ones of them to keep
+  std::vector<int32_t> rows_;
+  std::vector<int32_t> kept_rows_;
+  std::vector<int32_t> row_tokens_;
+#if USE_CUDA
+  cuda_unique_ptr<int32_t> row_tokens_device_;
+#endif
 
   InputIDs input_ids_{model_, *this};
   Logits logits_{model_, *this};
   KV_Cache kv_cache_{model_, *this};
   PositionInputs position_inputs_;
   ExtraInputs extra_inputs_{model_, *this};
+  AdapterInputs adapter_inputs_{model_, *this};
+};
+
+// Runs the decoder with static shapes only, for NPU execution providers that compile a graph per shape (set by
+// model.decoder.static_window_size). The prompt runs in windows of static_window_size tokens, the last one padded, and
+// every generation step in a window of one token. The pasts are sized to model.context_length too, and the runs write
+// into them in place, so the decoder only ever sees two sets of shapes. Only on the CPU, for a single sequence without
+// beams
+struct DecoderOnly_WindowedState : State {
+  DecoderOnly_WindowedState(const DecoderOnly_Model& model, const GeneratorParams& params);
+  RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+
+ private:
+  void RunWindow(std::span<const int32_t> tokens, size_t next_window_size);
+
+  const DecoderOnly_Model& model_;
+  const size_t prompt_window_size_;
+  const size_t context_length_;
+  size_t window_size_;
+  size_t past_length_{};       // Entries of the pasts that are valid
+  size_t last_token_count_{};  // Of the last run's window, the logits of its last one are the next token's
+
+  WindowedInputIDs input_ids_{model_, *this};
+  WindowedPositionInputs position_inputs_{model_, *this};
+  KV_Cache_Windowed kv_cache_{model_, *this};
+
+  ONNXTensorElementDataType logits_type_;
+  std::unique_ptr<OrtValue> logits_;  // {1, window_size, vocab_size}
+  size_t logits_index_{~0U};
+  std::vector<float> next_logits_;  // The fp32 logits of the last token, {1, vocab_size}
 };
 
 }  // namespace Generators
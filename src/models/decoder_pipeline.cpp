@@ -0,0 +1,346 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <future>
+#include <numeric>
+#include "../generators.h"
+#include "decoder_pipeline.h"
+
+namespace Generators {
+
+namespace {
+
+// The config of a single stage: its model file and layers, run whole on its device. The graph pool and prefix cache
+// are off, as those need a decoder in one session
+std::unique_ptr<Config> CreateStageConfig(const Config& config, const Config::Model::Decoder::PipelineStage& stage) {
+  auto stage_config = std::make_unique<Config>(config);
+  auto& decoder = stage_config->model.decoder;
+  decoder.filename = stage.filename;
+  decoder.num_hidden_layers = stage.num_hidden_layers;
+  decoder.pipeline = {stage};
+  decoder.prefix_cache.block_size = 0;
+  decoder.graph_capture_batch_sizes.clear();
+  decoder.graph_capture_prompt_lengths.clear();
+  return stage_config;
+}
+
+}  // namespace
+
+PipelineStage_Model::PipelineStage_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
+    : Model{std::move(config)} {
+  session_ = CreateSession(ort_env, config_->model.decoder.filename, session_options_.get());
+  InitDeviceAllocator(*session_);
+}
+
+std::unique_ptr<State> PipelineStage_Model::CreateState(RoamingArray<int32_t> /*sequence_lengths*/, const GeneratorParams& /*params*/) const {
+  throw std::runtime_error("A pipeline stage is only run as part of its DecoderPipeline_Model");
+}
+
+DecoderPipeline_Model::DecoderPipeline_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
+    : Model{std::move(config)} {
+  auto& decoder = config_->model.decoder;
+  if (decoder.tensor_parallel_size > 1)
+    throw std::runtime_error("A decoder can't be both tensor parallel and pipelined");
+  if (decoder.pipeline_micro_batches < 1)
+    throw std::runtime_error("pipeline_micro_batches must be at least 1");
+  if (!decoder.graph_capture_batch_sizes.empty() || !decoder.graph_capture_prompt_lengths.empty())
+    throw std::runtime_error("A pipelined decoder doesn't support graph capture");
+  const int stage_layers = std::accumulate(decoder.pipeline.begin(), decoder.pipeline.end(), 0, [](int sum, const auto& stage) { return sum + stage.num_hidden_layers; });
+  if (stage_layers != decoder.num_hidden_layers)
+    throw std::runtime_error("The pipeline stages have " + std::to_string(stage_layers) + " layers, but the decoder has " + std::to_string(decoder.num_hidden_layers));
+
+  for (size_t i = 0; i + 1 < decoder.pipeline.size(); i++)
+    stages_.push_back(std::make_unique<PipelineStage_Model>(CreateStageConfig(*config_, decoder.pipeline[i]), ort_env));
+
+  // The stages selected their own devices, switch back to the last one's
+  decoder.filename = decoder.pipeline.back().filename;
+  decoder.num_hidden_layers = decoder.pipeline.back().num_hidden_layers;
+  if (device_type_ == DeviceType::CUDA)
+    Ort::SetCurrentGpuDeviceId(cuda_device_id_);
+  session_decoder_ = CreateSession(ort_env, decoder.filename, session_options_.get());
+
+  InitDeviceAllocator(*session_decoder_);
+
+  if (std::any_of(decoder.pipeline.begin(), decoder.pipeline.end(), [](const auto& stage) { return !stage.offloaded_weights.empty(); })) {
+    if (std::any_of(decoder.pipeline.begin(), decoder.pipeline.end(), [&](const auto& stage) { return stage.device_id != decoder.pipeline.front().device_id; }))
+      throw std::runtime_error("A pipeline with offloaded weights runs its stages one after another, so they all need the same device_id");
+    std::vector<std::unique_ptr<OffloadedWeights>> weights;
+    for (auto& stage : decoder.pipeline)
+      weights.push_back(stage.offloaded_weights.empty() ? nullptr : std::make_unique<OffloadedWeights>(*this, config_->config_path / fs::path(stage.offloaded_weights)));
+    weight_stream_ = std::make_unique<WeightStream>(*this, std::move(weights));
+  }
+}
+
+std::unique_ptr<State> DecoderPipeline_Model::CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const {
+  return std::make_unique<DecoderPipeline_State>(*this, sequence_lengths, params);
+}
+
+PipelineStage_State::PipelineStage_State(const Model& model, OrtSession& session, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params, bool is_first, bool is_last)
+    : State{params, model},
+      model_{model},
+      session_{session},
+      position_inputs_{model, *this, sequence_lengths} {
+  if (is_first) {
+    input_ids_ = std::make_unique<InputIDs>(model_, *this);
+    input_ids_->Add();
+  } else {
+    inputs_embeds_ = std::make_unique<Embeddings>(model_, *this, Embeddings::Mode::Input, model_.config_->model.decoder.inputs.embeddings);
+    inputs_embeds_->Add();
+  }
+  position_inputs_.Add();
+  if (is_last) {
+    logits_ = std::make_unique<Logits>(model_, *this);
+    logits_->Add();
+  } else {
+    hidden_states_ = std::make_unique<Embeddings>(model_, *this, Embeddings::Mode::Output, model_.config_->model.decoder.outputs.hidden_states);
+    hidden_states_->Add();
+  }
+  kv_cache_.Add();
+}
+
+void PipelineStage_State::AddOffloadedWeights(const OffloadedWeights& weights) {
+  offloaded_weights_index_ = input_names_.size();
+  for (auto& tensor : weights.tensors_) {
+    input_names_.push_back(tensor.name.c_str());
+    inputs_.push_back(nullptr);
+  }
+}
+
+void PipelineStage_State::SetOffloadedWeights(std::span<OrtValue* const> values) {
+  std::copy(values.begin(), values.end(), inputs_.begin() + offloaded_weights_index_);
+}
+
+RoamingArray<float> PipelineStage_State::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
+  if (!first_run_) {
+    if (input_ids_)
+      input_ids_->Update(next_tokens);
+    if (inputs_embeds_)
+      inputs_embeds_->UpdateSequenceLength();
+    position_inputs_.Update(current_length);
+    kv_cache_.Update(next_indices.GetCPU(), current_length);
+    if (hidden_states_)
+      hidden_states_->UpdateSequenceLength();
+    if (logits_)
+      logits_->Update();
+  }
+
+  State::Run(session_, *run_options_, params_->BatchBeamSize());
+  return logits_ ? logits_->Get() : RoamingArray<float>{};
+}
+
+DecoderPipeline_State::DecoderPipeline_State(const DecoderPipeline_Model& model, RoamingArray<int32_t> sequence_lengths_unk, const GeneratorParams& params)
+    : State{params, model},
+      model_{model} {
+  if (params.use_cuda_graph)
+    throw std::runtime_error("A pipelined decoder doesn't support graph capture");
+  if (!params.extra_inputs.empty())
+    throw std::runtime_error("A pipelined decoder doesn't support extra inputs");
+  if (std::any_of(params.adapter_names.begin(), params.adapter_names.end(), [](const std::string& name) { return !name.empty(); }))
+    throw std::runtime_error("A pipelined decoder doesn't support adapters");
+
+  // Beam search reorders the kv caches across the whole batch, so it keeps the batch in one piece
+  const int micro_batch_count = params.search.num_beams > 1 ? 1 : std::gcd(params.batch_size, model.config_->model.decoder.pipeline_micro_batches);
+  const int micro_batch_size = params.batch_size / micro_batch_count;
+  micro_batch_beams_ = static_cast<size_t>(micro_batch_size) * params.search.num_beams;
+
+  cpu_span<int32_t> sequence_lengths = sequence_lengths_unk.GetCPU();
+  for (int i = 0; i < micro_batch_count; i++) {
+    auto micro_params = std::make_shared<GeneratorParams>(params);
+    micro_params->batch_size = micro_batch_size;
+    micro_params->input_ids = params.input_ids.subspan(static_cast<size_t>(i) * micro_batch_size * params.sequence_length, static_cast<size_t>(micro_batch_size) * params.sequence_length);
+    micro_params->external_owner_ = nullptr;
+    RoamingArray<int32_t> micro_sequence_lengths = sequence_lengths.subspan(i * micro_batch_beams_, micro_batch_beams_);
+
+    auto& states = stage_states_.emplace_back();
+    const size_t stage_count = model.stages_.size() + 1;
+    for (size_t s = 0; s < stage_count; s++) {
+      const bool is_last = s + 1 == stage_count;
+      if (model.device_type_ == DeviceType::CUDA)
+        Ort::SetCurrentGpuDeviceId(model.config_->model.decoder.pipeline[s].device_id);
+      const Model& stage_model = is_last ? static_cast<const Model&>(model) : *model.stages_[s];
+      OrtSession& session = is_last ? *model.session_decoder_ : *model.stages_[s]->session_;
+
+      // The generator's stream is on the device of the last stage, the earlier ones use the streams of their own models
+      const GeneratorParams* stage_params = micro_params.get();
+      std::shared_ptr<GeneratorParams> stream_params;
+      if (!is_last && model.device_type_ == DeviceType::CUDA) {
+        stream_params = std::make_shared<GeneratorParams>(*micro_params);
+        stream_params->cuda_stream = stage_model.cuda_stream_;
+        stage_params = stream_params.get();
+      }
+      states.push_back(std::make_unique<PipelineStage_State>(stage_model, session, micro_sequence_lengths, *stage_params, s == 0, is_last));
+      if (model.weight_stream_ && model.weight_stream_->IsOffloaded(s))
+        states.back()->AddOffloadedWeights(model.weight_stream_->GetWeights(s));
+    }
+    micro_batch_params_.push_back(std::move(micro_params));
+  }
+
+  // The offloaded stages run one after another on the calling thread
+  if (!model.weight_stream_)
+    stage_threads_ = std::make_unique<ThreadPool>(model.stages_.size() + 1);
+}
+
+void DecoderPipeline_State::Cancel() {
+  for (auto& micro_batch : stage_states_) {
+    for (auto& stage_state : micro_batch)
+      stage_state->Cancel();
+  }
+}
+
+RoamingArray<float> DecoderPipeline_State::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
+  const size_t micro_batch_count = stage_states_.size();
+  const size_t stage_count = stage_states_.front().size();
+  const auto& stage_configs = model_.config_->model.decoder.pipeline;
+
+  // The micro batches each take their own slice of the tokens, the beam indices only exist without micro batching
+  std::vector<RoamingArray<int32_t>> micro_batch_tokens;
+  cpu_span<int32_t> tokens = first_run_ ? cpu_span<int32_t>{} : next_tokens.GetCPU();
+  for (size_t i = 0; i < micro_batch_count; i++)
+    micro_batch_tokens.emplace_back(first_run_ ? tokens : tokens.subspan(i * micro_batch_beams_, micro_batch_beams_));
+  RoamingArray<int32_t> indices = micro_batch_count == 1 ? next_indices : RoamingArray<int32_t>{};
+
+  auto run_stage = [&](size_t i, size_t s) {
+    auto& state = *stage_states_[i][s];
+    if (s > 0)
+      state.inputs_embeds_->ReuseEmbeddingsBuffer(*stage_states_[i][s - 1]->hidden_states_);
+    return state.Run(current_length, micro_batch_tokens[i], indices);
+  };
+
+  if (model_.weight_stream_) {
+    auto micro_batch_logits = RunOffloaded(run_stage);
+    first_run_ = false;
+    return GatherLogits(micro_batch_logits);
+  }
+
+  // done[i][s] is set once stage s has run micro batch i. Every stage runs its micro batches in order on a thread of
+  // stage_threads_ (a lane), after the stage before it is done with the same micro batch
+  std::vector<std::vector<std::promise<void>>> done(micro_batch_count);
+  std::vector<std::vector<std::shared_future<void>>> done_futures(micro_batch_count);
+  for (size_t i = 0; i < micro_batch_count; i++) {
+    done[i].resize(stage_count);
+    for (auto& promise : done[i])
+      done_futures[i].push_back(promise.get_future().share());
+  }
+
+  auto run_stage_after_previous = [&](size_t i, size_t s) {
+    if (s > 0)
+      done_futures[i][s - 1].get();
+    return run_stage(i, s);
+  };
+
+  // The lanes start in stage order, so a lane only ever waits on one that's running. An error of the last stage is
+  // rethrown by ParallelFor, the ones of the earlier stages reach it through done
+  std::vector<RoamingArray<float>> micro_batch_logits;
+  stage_threads_->ParallelFor(stage_count, [&](size_t s, size_t /*thread_index*/) {
+    if (model_.device_type_ == DeviceType::CUDA)
+      Ort::SetCurrentGpuDeviceId(stage_configs[s].device_id);
+    if (s + 1 == stage_count) {
+      for (size_t i = 0; i < micro_batch_count; i++)
+        micro_batch_logits.push_back(run_stage_after_previous(i, s));
+      return;
+    }
+
+    size_t i = 0;
+    try {
+      for (; i < micro_batch_count; i++) {
+        run_stage_after_previous(i, s);
+        done[i][s].set_value();
+      }
+    } catch (...) {
+      // The later stages waiting on this one fail with the same error
+      for (; i < micro_batch_count; i++)
+        done[i][s].set_exception(std::current_exception());
+    }
+  });
+  // Whichever lane ran on this thread, it goes on on the device of the last stage, the search's
+  if (model_.device_type_ == DeviceType::CUDA)
+    Ort::SetCurrentGpuDeviceId(stage_configs.back().device_id);
+
+  first_run_ = false;
+  return GatherLogits(micro_batch_logits);
+}
+
+std::vector<RoamingArray<float>> DecoderPipeline_State::RunOffloaded(const std::function<RoamingArray<float>(size_t, size_t)>& run_stage) {
+  std::lock_guard<std::mutex> lock{model_.weight_stream_mutex_};
+  auto& weight_stream = *model_.weight_stream_;
+  const size_t micro_batch_count = stage_states_.size();
+  const size_t stage_count = stage_states_.front().size();
+
+  std::vector<RoamingArray<float>> micro_batch_logits;
+  for (size_t s = 0; s < stage_count; s++) {
+    // The micro batches of a stage share its stream, the model's for the earlier stages and the generator's for the last
+    cudaStream_t stream = stage_states_.front()[s]->cuda_stream_;
+    const bool offloaded = weight_stream.IsOffloaded(s);
+    if (offloaded) {
+      auto weights = weight_stream.Bind(s, stream);
+      for (auto& micro_batch : stage_states_)
+        micro_batch[s]->SetOffloadedWeights(weights);
+
+      // The next offloaded stage, the first one again for the next step, is copied in while this one runs
+      for (size_t next = 1; next <= stage_count; next++) {
+        if (weight_stream.IsOffloaded((s + next) % stage_count)) {
+          weight_stream.Prefetch((s + next) % stage_count);
+          break;
+        }
+      }
+    }
+
+    for (size_t i = 0; i < micro_batch_count; i++) {
+      auto logits = run_stage(i, s);
+      if (s + 1 == stage_count)
+        micro_batch_logits.push_back(logits);
+    }
+    if (offloaded)
+      weight_stream.Release(s, stream);
+  }
+  return micro_batch_logits;
+}
+
+RoamingArray<float> DecoderPipeline_State::GatherLogits(std::span<RoamingArray<float>> micro_batch_logits) {
+  if (micro_batch_logits.size() == 1) {
+    pending_fp16_logits_ = std::exchange(stage_states_.front().back()->pending_fp16_logits_, nullptr);
+    return micro_batch_logits.front();
+  }
+
+  const size_t vocab_size = static_cast<size_t>(params_->vocab_size);
+  const size_t micro_batch_elements = micro_batch_beams_ * vocab_size;
+  const std::array<int64_t, 2> shape{static_cast<int64_t>(micro_batch_beams_ * micro_batch_logits.size()), static_cast<int64_t>(vocab_size)};
+
+  // Logits::Get either gives all of the micro batches fp32 logits, or leaves all of them as fp16 for the search to
+  // convert into the fp32 ones it returns
+  const bool fp16 = stage_states_.front().back()->pending_fp16_logits_ != nullptr;
+  if (!logits_)
+    logits_ = OrtValue::CreateTensor<float>(model_.GetDeviceAllocator(AllocationSite::Logits), shape);
+  if (fp16 && !logits_fp16_)
+    logits_fp16_ = OrtValue::CreateTensor<Ort::Float16_t>(model_.GetDeviceAllocator(AllocationSite::Logits), shape);
+  const size_t element_size = fp16 ? sizeof(uint16_t) : sizeof(float);
+  auto* target = (fp16 ? logits_fp16_ : logits_)->GetTensorMutableData<uint8_t>();
+
+  for (size_t i = 0; i < micro_batch_logits.size(); i++) {
+    auto& state = *stage_states_[i].back();
+    const void* source = fp16 ? static_cast<const void*>(std::exchange(state.pending_fp16_logits_, nullptr)) : nullptr;
+    auto* destination = target + i * micro_batch_elements * element_size;
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA) {
+      if (!source)
+        source = micro_batch_logits[i].GetGPU().data();
+      cudaMemcpyAsync(destination, source, micro_batch_elements * element_size, cudaMemcpyDeviceToDevice, cuda_stream_);
+      continue;
+    }
+#endif
+    if (!source)
+      source = micro_batch_logits[i].GetCPU().data();
+    std::memcpy(destination, source, micro_batch_elements * element_size);
+  }
+
+  if (fp16)
+    pending_fp16_logits_ = logits_fp16_->GetTensorData<uint16_t>();
+  float* data = logits_->GetTensorMutableData<float>();
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA)
+    return {gpu_span<float>{data, shape[0] * vocab_size}, cuda_stream_};
+#endif
+  return cpu_span<float>{data, shape[0] * vocab_size};
+}
+
+}  // namespace Generators
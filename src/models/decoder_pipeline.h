@@ -0,0 +1,87 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include "model.h"
+#include "input_ids.h"
+#include "embeddings.h"
+#include "logits.h"
+#include "kv_cache.h"
+#include "position_inputs.h"
+#include "offloaded_weights.h"
+
+namespace Generators {
+
+// One of the earlier stages of a pipelined decoder, a model of its own so it has the session, allocator and stream of
+// its device. Its config is the decoder's, with the filename and layers of the stage
+struct PipelineStage_Model : Model {
+  PipelineStage_Model(std::unique_ptr<Config> config, OrtEnv& ort_env);
+
+  std::unique_ptr<State> CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const override;
+
+  std::unique_ptr<OrtSession> session_;
+};
+
+// A decoder split by layers into model.decoder.pipeline stages, each on its own device. The first stage takes the
+// input ids, the last one puts out the logits, and the ones in between pass on the hidden states. This model is the last
+// stage, so the search runs on the device of the logits.
+//
+// The batch of a generator is split into model.decoder.pipeline_micro_batches equal micro batches that flow through the
+// stages as a wavefront: while stage 1 runs micro batch 0, stage 0 runs micro batch 1, so no device waits for a whole
+// batch to pass through the others.
+//
+// Stages with offloaded_weights keep their weights in host memory, for decoders larger than the device. The stages then
+// share one device and run one after another, each one every micro batch, while the weight stream copies in the next
+// stage's weights.
+struct DecoderPipeline_Model : Model {
+  DecoderPipeline_Model(std::unique_ptr<Config> config, OrtEnv& ort_env);
+
+  std::unique_ptr<State> CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const override;
+
+  std::vector<std::unique_ptr<PipelineStage_Model>> stages_;  // Every stage but the last
+  std::unique_ptr<OrtSession> session_decoder_;                // The last stage
+
+  std::unique_ptr<WeightStream> weight_stream_;  // If a stage has offloaded weights
+  mutable std::mutex weight_stream_mutex_;       // The states take turns running, as they share its buffers
+};
+
+// The state of one micro batch in one stage
+struct PipelineStage_State : State {
+  PipelineStage_State(const Model& model, OrtSession& session, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params, bool is_first, bool is_last);
+
+  // Returns the logits in the last stage, nothing in the others
+  RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+
+  void AddOffloadedWeights(const OffloadedWeights& weights);    // As inputs, set by SetOffloadedWeights before every run
+  void SetOffloadedWeights(std::span<OrtValue* const> values);  // In the OffloadedWeights::tensors_ order
+
+  const Model& model_;
+  OrtSession& session_;
+
+  std::unique_ptr<InputIDs> input_ids_;        // First stage
+  std::unique_ptr<Embeddings> inputs_embeds_;  // Stages after the first
+  std::unique_ptr<Embeddings> hidden_states_;  // Stages before the last
+  std::unique_ptr<Logits> logits_;             // Last stage
+  PositionInputs position_inputs_;
+  KV_Cache kv_cache_{model_, *this};
+  size_t offloaded_weights_index_{};  // Of the first offloaded weight input
+};
+
+struct DecoderPipeline_State : State {
+  DecoderPipeline_State(const DecoderPipeline_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params);
+  RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+  void Cancel() override;
+
+ private:
+  std::vector<RoamingArray<float>> RunOffloaded(const std::function<RoamingArray<float>(size_t, size_t)>& run_stage);
+  RoamingArray<float> GatherLogits(std::span<RoamingArray<float>> micro_batch_logits);
+
+  const DecoderPipeline_Model& model_;
+  size_t micro_batch_beams_{};  // Sequences in each micro batch
+  std::vector<std::shared_ptr<GeneratorParams>> micro_batch_params_;
+  std::vector<std::vector<std::unique_ptr<PipelineStage_State>>> stage_states_;  // [micro batch][stage]
+  std::unique_ptr<ThreadPool> stage_threads_;                                    // A lane per stage, unless the weights are offloaded
+
+  std::unique_ptr<OrtValue> logits_, logits_fp16_;  // The logits of every micro batch when there's more than one, fp16 ones for the search to convert
+};
+
+}  // namespace Generators
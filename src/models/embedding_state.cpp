@@ -0,0 +1,104 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "../generators.h"
+#include "../float16.h"
+#include "embedding_state.h"
+#include "kernels.h"
+
+namespace Generators {
+
+Embedding_State::Embedding_State(const Model& model, OrtSession& session, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params)
+    : State{params, model},
+      model_{model},
+      session_{session},
+      position_inputs_{model, *this, sequence_lengths} {
+  const auto& decoder = model_.config_->model.decoder;
+  if (!model_.session_info_->HasOutput(decoder.outputs.hidden_states))
+    throw std::runtime_error("Embeddings need a decoder with a " + decoder.outputs.hidden_states + " output, like one built with exclude_lm_head");
+  if (params.hidden_size < 1)
+    throw std::runtime_error("Embeddings need model.decoder.hidden_size to be set");
+  if (model_.device_type_ != DeviceType::CPU && model_.device_type_ != DeviceType::CUDA)
+    throw std::runtime_error("Embeddings are only supported on CPU and CUDA, not " + to_string(model_.device_type_));
+
+  input_ids_.Add();
+  position_inputs_.Add();
+  hidden_states_ = std::make_unique<Embeddings>(model_, *this, Embeddings::Mode::Output, decoder.outputs.hidden_states);
+  hidden_states_->Add();
+
+  // The graph still takes the pasts of a decoder, a prompt run starts them empty
+  for (int i = 0; i < decoder.num_hidden_layers; i++) {
+    for (const auto* names : {&decoder.inputs.past_key_names, &decoder.inputs.past_value_names}) {
+      char string[64];
+      snprintf(string, std::size(string), names->c_str(), i);
+      if (model_.session_info_->HasInput(string))
+        past_names_.emplace_back(string);
+    }
+  }
+  if (!past_names_.empty()) {
+    const auto type = model_.session_info_->GetInputDataType(past_names_.front());
+    if (type == Ort::TypeToTensorType<int8_t>::type)
+      throw std::runtime_error("Embeddings don't support int8 kv caches, as those need scale inputs too");
+    const std::array<int64_t, 4> shape{params.BatchBeamSize(), decoder.num_key_value_heads, 0, decoder.head_size};
+    empty_past_ = OrtValue::CreateTensor(*model_.allocator_device_, shape, type);
+    for (auto& name : past_names_) {
+      input_names_.push_back(name.c_str());
+      inputs_.push_back(empty_past_.get());
+    }
+  }
+}
+
+RoamingArray<float> Embedding_State::Run(int /*current_length*/, RoamingArray<int32_t> /*next_tokens*/, RoamingArray<int32_t> /*next_indices*/) {
+  if (!first_run_)
+    throw std::runtime_error("An embedding state only runs its prompt once");
+  State::Run(session_, *run_options_, params_->batch_size);
+  return {};
+}
+
+void Embedding_State::Pool(EmbeddingPooling pooling, std::span<const int32_t> lengths, std::span<float> out) {
+  const int batch_size = params_->batch_size;
+  const int sequence_length = params_->sequence_length;
+  const int hidden_size = params_->hidden_size;
+  const bool mean = pooling == EmbeddingPooling::Mean;
+  auto& hidden_states = *hidden_states_->Get();
+  const bool is_fp16 = hidden_states.GetTensorTypeAndShapeInfo()->GetElementType() == Ort::TypeToTensorType<Ort::Float16_t>::type;
+
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    auto lengths_gpu = CudaMallocArray<int32_t>(batch_size);
+    auto out_gpu = CudaMallocArray<float>(out.size());
+    cudaMemcpyAsync(lengths_gpu.get(), lengths.data(), lengths.size_bytes(), cudaMemcpyHostToDevice, cuda_stream_);
+    if (is_fp16)
+      cuda::LaunchPoolHiddenStates(hidden_states.GetTensorData<uint16_t>(), lengths_gpu.get(), out_gpu.get(), batch_size, sequence_length, hidden_size, mean, cuda_stream_);
+    else
+      cuda::LaunchPoolHiddenStates(hidden_states.GetTensorData<float>(), lengths_gpu.get(), out_gpu.get(), batch_size, sequence_length, hidden_size, mean, cuda_stream_);
+    cudaMemcpyAsync(out.data(), out_gpu.get(), out.size_bytes(), cudaMemcpyDeviceToHost, cuda_stream_);
+    cudaStreamSynchronize(cuda_stream_);
+    return;
+  }
+#endif
+
+  // fp16 hidden states are converted a row at a time
+  std::vector<float> row_fp32(is_fp16 ? hidden_size : 0);
+  const auto row_values = [&](size_t row) -> const float* {
+    if (!is_fp16)
+      return hidden_states.GetTensorData<float>() + row;
+    Fp16ToFp32(std::span<const uint16_t>{hidden_states.GetTensorData<uint16_t>() + row, static_cast<size_t>(hidden_size)}, row_fp32);
+    return row_fp32.data();
+  };
+  for (int i = 0; i < batch_size; i++) {
+    auto pooled = out.subspan(static_cast<size_t>(i) * hidden_size, hidden_size);
+    const int first = mean ? sequence_length - lengths[i] : sequence_length - 1;
+    std::fill(pooled.begin(), pooled.end(), 0.0f);
+    for (int t = first; t < sequence_length; t++) {
+      const float* values = row_values((static_cast<size_t>(i) * sequence_length + t) * hidden_size);
+      for (int d = 0; d < hidden_size; d++)
+        pooled[d] += values[d];
+    }
+    const float scale = 1.0f / (sequence_length - first);
+    for (auto& v : pooled)
+      v *= scale;
+  }
+}
+
+}  // namespace Generators
@@ -0,0 +1,34 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include "model.h"
+#include "input_ids.h"
+#include "embeddings.h"
+#include "position_inputs.h"
+
+namespace Generators {
+
+// Runs only the prompt of a decoder built without its lm_head (builder.py's exclude_lm_head), for the last layer's
+// hidden states instead of logits. The pasts are empty and the presents aren't asked for, so no kv cache is kept.
+struct Embedding_State : State {
+  Embedding_State(const Model& model, OrtSession& session, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params);
+
+  // Runs the prompt once, there are no logits
+  RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+
+  // After Run, pools the hidden states of the last lengths[i] tokens of each batch entry (its left padded prompt) into
+  // out, as fp32 {batch_size, hidden_size}. Pooled on the model's device, so only the pooled values are copied back
+  void Pool(EmbeddingPooling pooling, std::span<const int32_t> lengths, std::span<float> out);
+
+ private:
+  const Model& model_;
+  OrtSession& session_;
+
+  InputIDs input_ids_{model_, *this};
+  PositionInputs position_inputs_;
+  std::unique_ptr<Embeddings> hidden_states_;
+  std::vector<std::string> past_names_;
+  std::unique_ptr<OrtValue> empty_past_;  // Of length 0, every past input shares it
+};
+
+}  // namespace Generators
@@ -5,11 +5,24 @@
 
 namespace Generators {
 
+namespace {
+
+bool IsOnDevice(const Tensor& tensor) {
+  return tensor.ort_tensor_->GetTensorMemoryInfo().GetDeviceType() == OrtMemoryInfoDeviceType_GPU;
+}
+
+}  // namespace
+
 ExtraInputs::ExtraInputs(const Model& model, State& state)
     : model_{model},
       state_{state} {
   extra_inputs_.reserve(state_.params_->extra_inputs.size());
 
+  for (auto& extra_input : state_.params_->extra_inputs) {
+    if (IsOnDevice(*extra_input.tensor) && model_.device_type_ != DeviceType::CUDA)
+      throw std::runtime_error("Extra input " + extra_input.name + " is in CUDA memory, which only a model on CUDA can take, not one on " + to_string(model_.device_type_));
+  }
+
   if (state_.GetCapturedGraphInfo()) {
     owned_extra_inputs_.reserve(state_.params_->extra_inputs.size());
 
@@ -22,7 +35,7 @@ ExtraInputs::ExtraInputs(const Model& model, State& state)
       extra_inputs_.push_back(owned_extra_inputs_.back().get());
     }
   } else {
-    // We don't use graph capture, so simply use the existing pointers
+    // We don't use graph capture, so simply use the existing pointers, device tensors are bound without any copy
     for (auto& extra_input : state_.params_->extra_inputs) {
       extra_inputs_.push_back(extra_input.tensor->ort_tensor_.get());
     }
@@ -41,7 +54,18 @@ void ExtraInputs::Add() {
     state_.inputs_.push_back(extra_inputs_[i]);
   }
 
-  // Copy the data from the CPU-backed ORT value to the static buffers
+#if USE_CUDA
+  // The runs (and the copies to the static buffers) go after the writes of the device tensors
+  for (auto& extra_input : state_.params_->extra_inputs) {
+    if (!IsOnDevice(*extra_input.tensor) || extra_input.tensor->stream_ == state_.cuda_stream_)
+      continue;
+    cuda_event_holder written{cudaEventDisableTiming};
+    cudaEventRecord(written, static_cast<cudaStream_t>(extra_input.tensor->stream_));
+    cudaStreamWaitEvent(state_.cuda_stream_, written);
+  }
+#endif
+
+  // Copy the data from the user's ORT value to the static buffers
   for (int i = 0; i < sb_extra_inputs_.size(); ++i) {
     auto type_and_shape_info = extra_inputs_[i]->GetTensorTypeAndShapeInfo();
     auto shape = type_and_shape_info->GetShape();
@@ -66,12 +90,13 @@ void ExtraInputs::Add() {
 
 #if USE_CUDA
       case DeviceType::CUDA: {
+        // A captured graph reads its static buffer, so even a device tensor is copied, but without going through the host
         cudaMemcpyAsync(
             extra_inputs_[i]->GetTensorMutableRawData(),
             state_.params_->extra_inputs[i].tensor->ort_tensor_->GetTensorMutableRawData(),
             copy_size_in_bytes,
-            cudaMemcpyHostToDevice,
-            model_.cuda_stream_);
+            IsOnDevice(*state_.params_->extra_inputs[i].tensor) ? cudaMemcpyDeviceToDevice : cudaMemcpyHostToDevice,
+            state_.cuda_stream_);
       } break;
 #endif
 
@@ -5,7 +5,7 @@ namespace Generators {
 
 Gpt_Model::Gpt_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
     : Model{std::move(config)} {
-  session_decoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
+  session_decoder_ = CreateSession(ort_env, config_->model.decoder.filename, session_options_.get());
   InitDeviceAllocator(*session_decoder_);
 }
 
@@ -17,6 +17,9 @@ Gpt_State::Gpt_State(const Gpt_Model& model, RoamingArray<int32_t> sequence_leng
     : State{params, model},
       model_{model},
       position_inputs_{model, *this, sequence_lengths_unk} {
+  // A replayed graph would keep the past length it was captured with, as the attention of these models reads it on the host
+  if (params.use_cuda_graph)
+    throw std::runtime_error("GPT style models with combined kv caches don't support graph capture, use past_present_share_buffer without it");
   input_ids_.Add();
   position_inputs_.Add();
   logits_.Add();
@@ -31,14 +34,49 @@ RoamingArray<float> Gpt_State::Run(int current_length, RoamingArray<int32_t> nex
     UpdateInputsOutputs(next_tokens, next_indices, current_length);
   }
 
-  State::Run(*model_.session_decoder_, *model_.run_options_, batch_size);
+  State::Run(*model_.session_decoder_, *run_options_, batch_size);
   return logits_.Get();
 }
 
+RoamingArray<float> Gpt_State::RunTokens(size_t past_length, std::span<const int32_t> tokens) {
+  if (first_run_)
+    throw std::runtime_error("RunTokens can only continue a sequence after the prompt has been run");
+
+  const size_t end = past_length + tokens.size();
+  kv_cache_.Rewind(static_cast<int>(past_length));
+  input_ids_.AdvanceSequence(tokens);
+  position_inputs_.AdvanceSequence(past_length, end);
+  kv_cache_.Update({}, static_cast<int>(end));
+  logits_.AdvancePrompt(past_length, end);
+  State::Run(*model_.session_decoder_, *run_options_, 1);
+  return logits_.GetAll();
+}
+
+void Gpt_State::SwapOut() {
+  if (first_run_)
+    throw std::runtime_error("A generator can only be swapped out after its prompt has run");
+  if (swapped_out_)
+    return;
+
+  // Past the kv caches, only the attention mask outlives a run on the step arenas
+  position_inputs_.MoveOffStepArena();
+  kv_cache_.SwapOut();
+  ReleaseStepArenas();
+  swapped_out_ = true;
+}
+
+void Gpt_State::SwapIn() {
+  if (!swapped_out_)
+    return;
+
+  kv_cache_.SwapIn();
+  swapped_out_ = false;
+}
+
 void Gpt_State::UpdateInputsOutputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> beam_indices, int current_length) {
   input_ids_.Update(next_tokens);
   position_inputs_.Update(current_length);
-  kv_cache_.Update(beam_indices.GetCPU(), current_length);
+  kv_cache_.Update(beam_indices, current_length);
   logits_.Update();
 }
 
@@ -19,6 +19,11 @@ struct Gpt_Model : Model {
 struct Gpt_State : State {
   Gpt_State(const Gpt_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params);
   RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+  RoamingArray<float> RunTokens(size_t past_length, std::span<const int32_t> tokens) override;
+  RoamingArray<float> GetDraftLogits(size_t head) override { return logits_.GetDraftAll(head); }
+  RoamingArray<float> GetAllLogits() override { return logits_.GetAll(); }
+  void SwapOut() override;
+  void SwapIn() override;
 
  private:
   void UpdateInputsOutputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> beam_indices, int current_length);
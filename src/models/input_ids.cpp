@@ -9,34 +9,79 @@ InputIDs::InputIDs(const Model& model, State& state)
     : model_{model},
       state_{state} {
   name_ = model_.config_->model.decoder.inputs.input_ids.c_str();
-  shape_ = {state_.params_->batch_size, state_.params_->sequence_length};
   type_ = model_.session_info_->GetInputDataType(name_);
+  if (type_ != Ort::TypeToTensorType<int64_t>::type && type_ != Ort::TypeToTensorType<int32_t>::type)
+    throw std::runtime_error("InputIDs must be int64 or int32");
+
+  SetPromptTokens(state_.GetCachedPrefixLength(), state_.GetFirstRunEnd());
+
+  if (state_.GetCapturedGraphInfo()) {
+    sb_input_ids_ = state_.GetCapturedGraphInfo()->sb_input_ids_.get();
+
+#if USE_DML
+    if (model_.device_type_ == DeviceType::DML) {
+      sb_input_ids_int32_ = state_.GetCapturedGraphInfo()->sb_input_ids_int32_.get();
+    }
+#endif
+  }
+
+  if (auto* prompt_graph = state_.GetCapturedPromptGraph())
+    value_ = CopyToStaticBuffer(*prompt_graph->sb_input_ids_, *value_, state_.cuda_stream_);
+}
+
+void InputIDs::SetPromptTokens(size_t start, size_t end) {
+  shape_ = {state_.params_->batch_size, static_cast<int64_t>(end - start)};
+
+  std::span<const int32_t> input_ids = state_.params_->input_ids;
+  if (shape_[1] != state_.params_->sequence_length) {
+    // Only single sequences skip a cached prefix or split the prompt into chunks, so the tokens are one contiguous range
+    assert(state_.params_->batch_size == 1);
+    input_ids = input_ids.subspan(start, end - start);
+  }
 
   // If 64-bit, convert from 32-bit to 64-bit
   if (type_ == Ort::TypeToTensorType<int64_t>::type) {
-    value_ = OrtValue::CreateTensor(model.allocator_cpu_, shape_, type_);
+    value_ = OrtValue::CreateTensor(model_.allocator_cpu_, shape_, type_);
     auto* p_data = value_->GetTensorMutableData<int64_t>();
-    for (auto v : state_.params_->input_ids) {
+    for (auto v : input_ids) {
       *p_data++ = v;
     }
   } else {
-    if (type_ != Ort::TypeToTensorType<int32_t>::type)
-      throw std::runtime_error("InputIDs must be int64 or int32");
-    value_ = OrtValue::CreateTensor<int32_t>(model.allocator_cpu_.GetInfo(), std::span<int32_t>(const_cast<int32_t*>(state_.params_->input_ids.data()), shape_[0] * shape_[1]), shape_);
+    value_ = OrtValue::CreateTensor<int32_t>(model_.allocator_cpu_.GetInfo(), std::span<int32_t>(const_cast<int32_t*>(input_ids.data()), shape_[0] * shape_[1]), shape_);
   }
 
-  value_ = model_.ExpandInputs(value_, state_.params_->search.num_beams);
+  value_ = model_.ExpandInputs(value_, state_.params_->search.num_beams, state_.cuda_stream_);
   shape_[0] *= state_.params_->search.num_beams;
+}
 
-  if (state_.GetCapturedGraphInfo()) {
-    sb_input_ids_ = state_.GetCapturedGraphInfo()->sb_input_ids_.get();
+void InputIDs::AdvancePrompt(size_t start, size_t end) {
+  SetPromptTokens(start, end);
+  state_.inputs_[input_index_] = value_.get();
+}
 
-#if USE_DML
-    if (model_.device_type_ == DeviceType::DML) {
-      sb_input_ids_int32_ = state_.GetCapturedGraphInfo()->sb_input_ids_int32_.get();
-    }
-#endif
-  }
+void InputIDs::AdvanceSequence(std::span<const int32_t> tokens) {
+  assert(state_.params_->BatchBeamSize() == 1);
+  shape_ = {1, static_cast<int64_t>(tokens.size())};
+
+  // The tokens are copied, as the caller's buffer doesn't have to outlive the run
+  value_ = OrtValue::CreateTensor(model_.allocator_cpu_, shape_, type_);
+  if (type_ == Ort::TypeToTensorType<int64_t>::type)
+    std::copy(tokens.begin(), tokens.end(), value_->GetTensorMutableData<int64_t>());
+  else
+    std::copy(tokens.begin(), tokens.end(), value_->GetTensorMutableData<int32_t>());
+
+  value_ = model_.ExpandInputs(value_, 1, state_.cuda_stream_);
+  state_.inputs_[input_index_] = value_.get();
+}
+
+void InputIDs::DropRows(std::span<const int32_t> rows) {
+  assert(shape_[1] == 1 && !sb_input_ids_);
+  std::array<int64_t, 2> shape{static_cast<int64_t>(rows.size()), 1};
+  auto value = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::InputIDs), shape, type_);
+  GatherRows(model_, value_->GetTensorRawData(), value->GetTensorMutableRawData(), rows, SizeOf(type_), state_.cuda_stream_);
+  state_.ReleaseAfterQueuedWork(std::exchange(value_, std::move(value)));
+  shape_ = shape;
+  state_.inputs_[input_index_] = value_.get();
 }
 
 void InputIDs::Add() {
@@ -51,11 +96,11 @@ void InputIDs::Update(RoamingArray<int32_t> next_tokens_unk) {
   if (shape_[1] != 1) {
     shape_[1] = 1;
     if (!sb_input_ids_) {
-      value_ = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+      value_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::InputIDs), shape_, type_);
 
 #if USE_DML
       if (model_.device_type_ == DeviceType::DML) {
-        value_int32_ = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+        value_int32_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::InputIDs), shape_, type_);
       }
 #endif
     } else {
@@ -77,8 +122,13 @@ void InputIDs::Update(RoamingArray<int32_t> next_tokens_unk) {
 #if USE_CUDA
       case DeviceType::CUDA: {
         auto* data = value_->GetTensorMutableData<int64_t>();
-        auto next_tokens = next_tokens_unk.GetGPU();
-        cuda::LaunchInt32ToInt64(next_tokens.data(), data, static_cast<int>(next_tokens.size()), model_.cuda_stream_);
+        const int32_t* next_tokens = next_tokens_unk.IsOnGPU() ? next_tokens_unk.GetGPU().data() : nullptr;
+        if (!next_tokens) {
+          if (!next_tokens_int32_)
+            next_tokens_int32_ = CudaMallocArray<int32_t>(shape_[0]);
+          next_tokens = CopyNextTokensToDevice(next_tokens_unk.GetCPU(), next_tokens_int32_.get());
+        }
+        cuda::LaunchInt32ToInt64(next_tokens, data, static_cast<int>(shape_[0]), state_.cuda_stream_);
       } break;
 #endif
 
@@ -118,12 +168,73 @@ void InputIDs::Update(RoamingArray<int32_t> next_tokens_unk) {
   } else {
     auto* data = value_->GetTensorMutableData<int32_t>();
 #if USE_CUDA
-    if (model_.device_type_ == DeviceType::CUDA)
-      cudaMemcpyAsync(data, next_tokens_unk.GetGPU().data(), shape_[0] * sizeof(int32_t), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
-    else
+    if (model_.device_type_ == DeviceType::CUDA) {
+      if (next_tokens_unk.IsOnGPU())
+        cudaMemcpyAsync(data, next_tokens_unk.GetGPU().data(), shape_[0] * sizeof(int32_t), cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+      else
+        CopyNextTokensToDevice(next_tokens_unk.GetCPU(), data);
+    } else
 #endif
       memcpy(data, next_tokens_unk.GetCPU().data(), shape_[0] * sizeof(int32_t));
   }
 }
 
+#if USE_CUDA
+const int32_t* InputIDs::CopyNextTokensToDevice(cpu_span<const int32_t> next_tokens, int32_t* device_data) {
+  const size_t count = static_cast<size_t>(shape_[0]);
+  assert(next_tokens.size() == count);
+  if (!staging_tokens_) {
+    staging_tokens_ = CudaMallocHostArray<int32_t>(c_staging_slots_ * count, &staging_tokens_span_);
+    staging_events_ = std::make_unique<cuda_event_holder[]>(c_staging_slots_);
+  }
+
+  // Going through pinned memory keeps the copy asynchronous, unlike from the pageable memory the tokens are in
+  auto& event = staging_events_[staging_slot_];
+  {
+    TraceSpan span{"cudaEventSynchronize"};
+    cudaEventSynchronize(event);
+  }
+  auto slot = staging_tokens_span_.subspan(staging_slot_ * count, count);
+  std::copy(next_tokens.begin(), next_tokens.end(), slot.begin());
+  cudaMemcpyAsync(device_data, slot.data(), slot.size_bytes(), cudaMemcpyHostToDevice, state_.cuda_stream_);
+  cudaEventRecord(event, state_.cuda_stream_);
+  staging_slot_ = (staging_slot_ + 1) % c_staging_slots_;
+  return device_data;
+}
+#endif
+
+WindowedInputIDs::WindowedInputIDs(const Model& model, State& state)
+    : model_{model},
+      state_{state},
+      type_{model_.session_info_->GetInputDataType(model_.config_->model.decoder.inputs.input_ids)} {
+  if (type_ != Ort::TypeToTensorType<int64_t>::type && type_ != Ort::TypeToTensorType<int32_t>::type)
+    throw std::runtime_error("InputIDs must be int64 or int32");
+}
+
+void WindowedInputIDs::Add() {
+  input_index_ = state_.inputs_.size();
+
+  state_.inputs_.push_back(value_.get());
+  state_.input_names_.push_back(model_.config_->model.decoder.inputs.input_ids.c_str());
+}
+
+void WindowedInputIDs::SetWindow(size_t window_size, std::span<const int32_t> tokens) {
+  // Only reallocated when the window size changes, between the prompt and the generation
+  const std::array<int64_t, 2> shape{1, static_cast<int64_t>(window_size)};
+  if (!value_ || value_->GetTensorTypeAndShapeInfo()->GetShape()[1] != shape[1]) {
+    value_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::InputIDs), shape, type_);
+    if (input_index_ != ~0U)
+      state_.inputs_[input_index_] = value_.get();
+  }
+
+  auto fill = [&](auto* data) {
+    std::copy(tokens.begin(), tokens.end(), data);
+    std::fill(data + tokens.size(), data + window_size, static_cast<std::remove_pointer_t<decltype(data)>>(state_.params_->pad_token_id));
+  };
+  if (type_ == Ort::TypeToTensorType<int32_t>::type)
+    fill(value_->GetTensorMutableData<int32_t>());
+  else
+    fill(value_->GetTensorMutableData<int64_t>());
+}
+
 }  // namespace Generators
@@ -11,6 +11,9 @@ struct InputIDs {
 
   void Add();
   void Update(RoamingArray<int32_t> next_tokens);
+  void AdvancePrompt(size_t start, size_t end);  // Switch to the prompt tokens [start, end) for the next chunk of a chunked prefill
+  void AdvanceSequence(std::span<const int32_t> tokens);  // Switch to arbitrary tokens of a single sequence, as run by speculative decoding
+  void DropRows(std::span<const int32_t> rows);           // After an Update(), keeps only the given rows of the batch, in that order
 
   auto& GetShape() const { return shape_; }
   const char* name_;
@@ -18,6 +21,11 @@ struct InputIDs {
   OrtValue* Get() { return value_.get(); }
 
  private:
+  void SetPromptTokens(size_t start, size_t end);
+#if USE_CUDA
+  const int32_t* CopyNextTokensToDevice(cpu_span<const int32_t> next_tokens, int32_t* device_data);
+#endif
+
   const Model& model_;
   State& state_;
   size_t input_index_{~0U};
@@ -29,6 +37,17 @@ struct InputIDs {
   // Used for decoding runs with cuda graphs.
   StaticBuffer* sb_input_ids_{};
 
+#if USE_CUDA
+  // Ring of pinned host slots for next tokens that are on the CPU, so their copy is async on the model stream. A slot is
+  // only rewritten once the event recorded after its last copy completes, which only waits if the GPU is that far behind
+  static constexpr size_t c_staging_slots_ = 4;
+  cuda_host_unique_ptr<int32_t> staging_tokens_;
+  cpu_span<int32_t> staging_tokens_span_;
+  std::unique_ptr<cuda_event_holder[]> staging_events_;
+  size_t staging_slot_{};
+  cuda_unique_ptr<int32_t> next_tokens_int32_;  // Device copy of the next tokens, when they're converted to int64
+#endif
+
 #if USE_DML
   std::unique_ptr<OrtValue> value_int32_;
   StaticBuffer* sb_input_ids_int32_{};
@@ -36,4 +55,23 @@ struct InputIDs {
 #endif
 };
 
+// The input ids of a decoder with static shapes, {1, window_size} every run. The tokens of a window that isn't full are
+// followed by pad tokens, see DecoderOnly_WindowedState
+struct WindowedInputIDs {
+  WindowedInputIDs(const Model& model, State& state);
+  WindowedInputIDs(const WindowedInputIDs&) = delete;
+  WindowedInputIDs& operator=(const WindowedInputIDs&) = delete;
+
+  void Add();
+  void SetWindow(size_t window_size, std::span<const int32_t> tokens);  // tokens.size() <= window_size
+
+ private:
+  const Model& model_;
+  State& state_;
+  size_t input_index_{~0U};
+
+  ONNXTensorElementDataType type_;
+  std::unique_ptr<OrtValue> value_;
+};
+
 }  // namespace Generators
@@ -1,9 +1,10 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
-#include <cuda_fp16.h>
-#include <cuda_runtime.h>
+#include "../cuda_hip.cuh"
 #include <stdint.h>
 #include <limits>
+#include <algorithm>
+#include "kernels.h"
 
 namespace Generators {
 namespace cuda {
@@ -23,6 +24,35 @@ void Launch_UpdatePositionIds(T* positions, int batch_beam_size, cudaStream_t st
 template void Launch_UpdatePositionIds(int32_t* positions, int batch_beam_size, cudaStream_t stream);
 template void Launch_UpdatePositionIds(int64_t* positions, int batch_beam_size, cudaStream_t stream);
 
+// Rows are left padded, so each one is (sequence_length - length) pad tokens followed by its tokens at positions 0..length-1
+template <typename T>
+__global__ void InitPositionInputs(T* positions, T* mask_data, T* next_positions, const int32_t* sequence_lengths,
+                                   int batch_beam_size, int sequence_length) {
+  int global_index = blockIdx.x * blockDim.x + threadIdx.x;
+  int i = global_index / sequence_length;
+  int j = global_index % sequence_length;
+  if (i < batch_beam_size) {
+    int pad_count = sequence_length - sequence_lengths[i];
+    bool is_pad = j < pad_count;
+    positions[global_index] = is_pad ? 0 : static_cast<T>(j - pad_count);
+    mask_data[global_index] = is_pad ? 0 : 1;
+    if (j == 0)
+      next_positions[i] = static_cast<T>(sequence_lengths[i]);
+  }
+}
+
+template <typename T>
+void Launch_InitPositionInputs(T* positions, T* mask_data, T* next_positions, const int32_t* sequence_lengths,
+                               int batch_beam_size, int sequence_length, cudaStream_t stream) {
+  InitPositionInputs<T><<<(batch_beam_size * sequence_length + 255) / 256, 256, 0, stream>>>(
+      positions, mask_data, next_positions, sequence_lengths, batch_beam_size, sequence_length);
+}
+
+template void Launch_InitPositionInputs(int32_t* positions, int32_t* mask_data, int32_t* next_positions, const int32_t* sequence_lengths,
+                                        int batch_beam_size, int sequence_length, cudaStream_t stream);
+template void Launch_InitPositionInputs(int64_t* positions, int64_t* mask_data, int64_t* next_positions, const int32_t* sequence_lengths,
+                                        int batch_beam_size, int sequence_length, cudaStream_t stream);
+
 template <typename T>
 __global__ void CopyAndUpdateAttentionMask(T* mask_data, const T* old_mask_data, int batch_beam_size,
                                            int current_length, int max_length) {
@@ -63,6 +93,34 @@ template void Launch_UpdateAttentionMask(int32_t* mask_data, const int32_t* old_
 template void Launch_UpdateAttentionMask(int64_t* mask_data, const int64_t* old_mask_data, int batch_beam_size,
                                          int current_length, int max_length, bool update_only, cudaStream_t stream);
 
+template <typename T>
+__global__ void SlideAttentionMask(T* mask_data, const T* old_mask_data, int batch_beam_size, int old_length, int past_length,
+                                   int sink_length) {
+  int global_index = blockIdx.x * blockDim.x + threadIdx.x;
+  int length = past_length + 1;
+  int i = global_index / length;
+  int j = global_index % length;
+  if (i < batch_beam_size) {
+    if (j < past_length) {
+      mask_data[i * length + j] = old_mask_data[i * old_length + (j < sink_length ? j : j + old_length - past_length)];
+    } else {
+      mask_data[i * length + j] = 1;
+    }
+  }
+}
+
+template <typename T>
+void Launch_SlideAttentionMask(T* mask_data, const T* old_mask_data, int batch_beam_size, int old_length, int past_length,
+                               int sink_length, cudaStream_t stream) {
+  SlideAttentionMask<T><<<(batch_beam_size * (past_length + 1) + 255) / 256, 256, 0, stream>>>(
+      mask_data, old_mask_data, batch_beam_size, old_length, past_length, sink_length);
+}
+
+template void Launch_SlideAttentionMask(int32_t* mask_data, const int32_t* old_mask_data, int batch_beam_size, int old_length,
+                                        int past_length, int sink_length, cudaStream_t stream);
+template void Launch_SlideAttentionMask(int64_t* mask_data, const int64_t* old_mask_data, int batch_beam_size, int old_length,
+                                        int past_length, int sink_length, cudaStream_t stream);
+
 __global__ void HandleEOSArray(float* batch_logits, int batch_beam_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count) {
   int index = blockIdx.x * blockDim.x + threadIdx.x;
   if (index >= batch_beam_size)
@@ -78,10 +136,161 @@ __global__ void HandleEOSArray(float* batch_logits, int batch_beam_size, int voc
   logits[eos_token_ids[0]] = max;  // Set the score of the primary EOS token to the highest of any of the EOS tokens
 }
 
+template <int kBlockSize>
+__global__ void GatherLogProbs(const float* logits, const int32_t* rows, const int32_t* tokens, float* logprobs, int vocab_size) {
+  using BlockReduce = cub::BlockReduce<float, kBlockSize>;
+  __shared__ typename BlockReduce::TempStorage temp_storage;
+  __shared__ float row_max;
+
+  const float* row = logits + static_cast<size_t>(rows[blockIdx.x]) * vocab_size;
+  float max = std::numeric_limits<float>::lowest();
+  for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+    max = fmaxf(max, row[i]);
+  max = BlockReduce(temp_storage).Reduce(max, cub::Max());
+  if (threadIdx.x == 0)
+    row_max = max;
+  __syncthreads();
+
+  float sum = 0.0f;
+  for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+    sum += expf(row[i] - row_max);
+  sum = BlockReduce(temp_storage).Sum(sum);
+  if (threadIdx.x == 0)
+    logprobs[blockIdx.x] = row[tokens[blockIdx.x]] - row_max - logf(sum);
+}
+
+void LaunchGatherLogProbs(const float* logits, const int32_t* rows, const int32_t* tokens, float* logprobs, int count, int vocab_size, cudaStream_t stream) {
+  constexpr int blockSize = 256;
+  GatherLogProbs<blockSize><<<count, blockSize, 0, stream>>>(logits, rows, tokens, logprobs, vocab_size);
+}
+
+template <typename T>
+__device__ float ToFloat(T value) { return static_cast<float>(value); }
+template <>
+__device__ float ToFloat(uint16_t value) { return __half2float(__ushort_as_half(value)); }
+
+template <typename T>
+__global__ void PoolHiddenStates(const T* hidden_states, const int32_t* lengths, float* pooled, int sequence_length, int hidden_size, bool mean) {
+  const int batch_id = blockIdx.y;
+  const int d = blockIdx.x * blockDim.x + threadIdx.x;
+  if (d >= hidden_size)
+    return;
+
+  const int first = mean ? sequence_length - lengths[batch_id] : sequence_length - 1;
+  const T* row = hidden_states + static_cast<size_t>(batch_id) * sequence_length * hidden_size + d;
+  float sum = 0.0f;
+  for (int t = first; t < sequence_length; t++)
+    sum += ToFloat(row[static_cast<size_t>(t) * hidden_size]);
+  pooled[static_cast<size_t>(batch_id) * hidden_size + d] = sum / (sequence_length - first);
+}
+
+template <typename T>
+void LaunchPoolHiddenStates(const T* hidden_states, const int32_t* lengths, float* pooled, int batch_size, int sequence_length, int hidden_size, bool mean, cudaStream_t stream) {
+  constexpr int blockSize = 256;
+  const dim3 grid((hidden_size + blockSize - 1) / blockSize, batch_size);
+  PoolHiddenStates<<<grid, blockSize, 0, stream>>>(hidden_states, lengths, pooled, sequence_length, hidden_size, mean);
+}
+
+template void LaunchPoolHiddenStates(const float*, const int32_t*, float*, int, int, int, bool, cudaStream_t);
+template void LaunchPoolHiddenStates(const uint16_t*, const int32_t*, float*, int, int, int, bool, cudaStream_t);
+
+template <typename T>
+__global__ void GatherLastTokenLogits(const T* logits, const int64_t* offsets, T* last_token_logits, float* last_token_logits_fp32, int vocab_size) {
+  const int row = blockIdx.y;
+  const int v = blockIdx.x * blockDim.x + threadIdx.x;
+  if (v >= vocab_size)
+    return;
+
+  const T value = logits[offsets[row] + v];
+  const size_t index = static_cast<size_t>(row) * vocab_size + v;
+  last_token_logits[index] = value;
+  if (last_token_logits_fp32)
+    last_token_logits_fp32[index] = ToFloat(value);
+}
+
+template <typename T>
+void LaunchGatherLastTokenLogits(const T* logits, const int64_t* offsets, T* last_token_logits, float* last_token_logits_fp32,
+                                 int rows, int vocab_size, cudaStream_t stream) {
+  constexpr int blockSize = 256;
+  const dim3 grid((vocab_size + blockSize - 1) / blockSize, rows);
+  GatherLastTokenLogits<<<grid, blockSize, 0, stream>>>(logits, offsets, last_token_logits, last_token_logits_fp32, vocab_size);
+}
+
+template void LaunchGatherLastTokenLogits(const float*, const int64_t*, float*, float*, int, int, cudaStream_t);
+template void LaunchGatherLastTokenLogits(const uint16_t*, const int64_t*, uint16_t*, float*, int, int, cudaStream_t);
+
 void LaunchHandleEOSArray(float* batch_logits, int batch_beam_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, cudaStream_t stream) {
   HandleEOSArray<<<(batch_beam_size + 255) / 256, 256, 0, stream>>>(batch_logits, batch_beam_size, vocab_size, eos_token_ids, eos_token_ids_count);
 }
 
+template <typename Word>
+__global__ void GatherBeams(GatherBeamsParams params, size_t words_per_beam) {
+  const int tensor = blockIdx.z;
+  const int beam = blockIdx.y;
+  const int32_t beam_index = params.device_beam_indices ? params.device_beam_indices[beam] : params.beam_indices[beam];
+  const Word* source = static_cast<const Word*>(params.sources[tensor]) + beam_index * words_per_beam;
+  Word* target = static_cast<Word*>(params.targets[tensor]) + beam * words_per_beam;
+  for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < words_per_beam; i += gridDim.x * blockDim.x)
+    target[i] = source[i];
+}
+
+template <typename Word>
+void LaunchGatherBeamWords(const GatherBeamsParams& params, int tensor_count, int batch_beam_size, size_t bytes_per_beam, cudaStream_t stream) {
+  constexpr size_t block_size = 256;
+  constexpr size_t max_blocks_per_beam = 128;
+  const size_t words_per_beam = bytes_per_beam / sizeof(Word);
+  const dim3 grid(static_cast<unsigned>(std::min((words_per_beam + block_size - 1) / block_size, max_blocks_per_beam)), batch_beam_size, tensor_count);
+  GatherBeams<Word><<<grid, block_size, 0, stream>>>(params, words_per_beam);
+}
+
+void LaunchGatherBeams(const GatherBeamsParams& params, int tensor_count, int batch_beam_size, size_t bytes_per_beam, cudaStream_t stream) {
+  if (tensor_count == 0 || bytes_per_beam == 0)
+    return;
+  // Every beam starts at a multiple of bytes_per_beam from an aligned allocation, so copy in the widest words that divide it
+  if (bytes_per_beam % sizeof(uint4) == 0)
+    LaunchGatherBeamWords<uint4>(params, tensor_count, batch_beam_size, bytes_per_beam, stream);
+  else if (bytes_per_beam % sizeof(uint32_t) == 0)
+    LaunchGatherBeamWords<uint32_t>(params, tensor_count, batch_beam_size, bytes_per_beam, stream);
+  else
+    LaunchGatherBeamWords<uint8_t>(params, tensor_count, batch_beam_size, bytes_per_beam, stream);
+}
+
+template <typename Word>
+__global__ void GatherBeamRows(GatherBeamsParams params, int rows_per_beam, size_t source_pitch, size_t target_pitch, size_t words_per_row) {
+  const int tensor = blockIdx.z;
+  const int beam = blockIdx.y / rows_per_beam;
+  const int row = blockIdx.y % rows_per_beam;
+  const int32_t beam_index = params.device_beam_indices ? params.device_beam_indices[beam] : params.beam_indices[beam];
+  const Word* source = static_cast<const Word*>(params.sources[tensor]) + (beam_index * rows_per_beam + row) * source_pitch;
+  Word* target = static_cast<Word*>(params.targets[tensor]) + (beam * rows_per_beam + row) * target_pitch;
+  for (size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < words_per_row; i += gridDim.x * blockDim.x)
+    target[i] = source[i];
+}
+
+template <typename Word>
+void LaunchGatherBeamRowWords(const GatherBeamsParams& params, int tensor_count, int batch_beam_size, int rows_per_beam,
+                              size_t source_pitch, size_t target_pitch, size_t row_bytes, cudaStream_t stream) {
+  constexpr size_t block_size = 256;
+  constexpr size_t max_blocks_per_row = 32;
+  const size_t words_per_row = row_bytes / sizeof(Word);
+  const dim3 grid(static_cast<unsigned>(std::min((words_per_row + block_size - 1) / block_size, max_blocks_per_row)), batch_beam_size * rows_per_beam, tensor_count);
+  GatherBeamRows<Word><<<grid, block_size, 0, stream>>>(params, rows_per_beam, source_pitch / sizeof(Word), target_pitch / sizeof(Word), words_per_row);
+}
+
+void LaunchGatherBeamRows(const GatherBeamsParams& params, int tensor_count, int batch_beam_size, int rows_per_beam,
+                          size_t source_pitch, size_t target_pitch, size_t row_bytes, cudaStream_t stream) {
+  if (tensor_count == 0 || row_bytes == 0)
+    return;
+  // The rows start at multiples of the pitches, so the words have to divide those as well as the row
+  const size_t alignment = row_bytes | source_pitch | target_pitch;
+  if (alignment % sizeof(uint4) == 0)
+    LaunchGatherBeamRowWords<uint4>(params, tensor_count, batch_beam_size, rows_per_beam, source_pitch, target_pitch, row_bytes, stream);
+  else if (alignment % sizeof(uint32_t) == 0)
+    LaunchGatherBeamRowWords<uint32_t>(params, tensor_count, batch_beam_size, rows_per_beam, source_pitch, target_pitch, row_bytes, stream);
+  else
+    LaunchGatherBeamRowWords<uint8_t>(params, tensor_count, batch_beam_size, rows_per_beam, source_pitch, target_pitch, row_bytes, stream);
+}
+
 __global__ void ConvertFp16ToFp32(const half* src, float* dst, int count) {
   int idx = threadIdx.x + blockIdx.x * blockDim.x;
   if (idx < count)
@@ -8,11 +8,49 @@ namespace cuda {
 template <typename T>
 void Launch_UpdatePositionIds(T* positions, int batch_beam_size, cudaStream_t stream);
 template <typename T>
+void Launch_InitPositionInputs(T* positions, T* mask_data, T* next_positions, const int32_t* sequence_lengths,
+                               int batch_beam_size, int sequence_length, cudaStream_t stream);
+template <typename T>
 void Launch_UpdateAttentionMask(T* mask_data, const T* old_mask_data, int batch_beam_size, int current_length,
                                 int max_length, bool update_only, cudaStream_t stream);
+// Keeps the first sink_length and the last (past_length - sink_length) of the old_length mask entries, then adds the current token's
+template <typename T>
+void Launch_SlideAttentionMask(T* mask_data, const T* old_mask_data, int batch_beam_size, int old_length, int past_length,
+                               int sink_length, cudaStream_t stream);
+
+// Passed by value, so the launch captures them and nothing has to be copied to the device first
+constexpr int c_gather_beams_max_tensors = 64;
+constexpr int c_gather_beams_max_beams = 256;
+struct GatherBeamsParams {
+  const void* sources[c_gather_beams_max_tensors];
+  void* targets[c_gather_beams_max_tensors];
+  int32_t beam_indices[c_gather_beams_max_beams];
+  const int32_t* device_beam_indices{};  // Read instead of beam_indices if set, for indices that are already on the device
+};
+
+// For each of the first tensor_count tensors, copies beam beam_indices[j] of the source to beam j of the target
+void LaunchGatherBeams(const GatherBeamsParams& params, int tensor_count, int batch_beam_size, size_t bytes_per_beam, cudaStream_t stream);
+// The same for beams of rows_per_beam rows each, where only the first row_bytes of every row are copied. The rows are
+// source_pitch bytes apart in the sources and target_pitch bytes apart in the targets
+void LaunchGatherBeamRows(const GatherBeamsParams& params, int tensor_count, int batch_beam_size, int rows_per_beam,
+                          size_t source_pitch, size_t target_pitch, size_t row_bytes, cudaStream_t stream);
 
 void LaunchHandleEOSArray(float* batch_logits, int batch_beam_size, int vocab_size, const int32_t* eos_token_ids, int eos_token_ids_count, cudaStream_t stream);
 
+// Writes the log softmax of logits row rows[i] at token tokens[i] to logprobs[i], for each of the count entries
+void LaunchGatherLogProbs(const float* logits, const int32_t* rows, const int32_t* tokens, float* logprobs, int count, int vocab_size, cudaStream_t stream);
+
+// Writes the fp32 mean of the hidden states of the last lengths[i] tokens of each batch entry of {batch_size,
+// sequence_length, hidden_size}, or just of its last token when not mean, into pooled {batch_size, hidden_size}
+template <typename T>
+void LaunchPoolHiddenStates(const T* hidden_states, const int32_t* lengths, float* pooled, int batch_size, int sequence_length, int hidden_size, bool mean, cudaStream_t stream);
+
+// Copies the vocab_size logits at element offsets[i] of logits to row i of last_token_logits, for each of the rows. When
+// last_token_logits_fp32 is set, the same pass also writes them there as fp32
+template <typename T>
+void LaunchGatherLastTokenLogits(const T* logits, const int64_t* offsets, T* last_token_logits, float* last_token_logits_fp32,
+                                 int rows, int vocab_size, cudaStream_t stream);
+
 void LaunchFp16ToFp32(const uint16_t* fp16, float* fp32, int count, cudaStream_t stream);
 void LaunchInt32ToInt64(const int32_t* src, int64_t* dst, int count, cudaStream_t stream);
 }  // namespace cuda
@@ -1,14 +1,199 @@
 #include "../generators.h"
 #include "model.h"
 #include "kv_cache.h"
+#include "kernels.h"
 
 namespace Generators {
 
+namespace {
+
+#if USE_CUDA
+// Indices on the device (from the CUDA beam search) are always read there, as copying them to the host would wait for the search
+bool CanGatherBeamsOnDevice(const Model& model, RoamingArray<int32_t>& beam_indices) {
+  return model.device_type_ == DeviceType::CUDA && (beam_indices.IsOnGPU() || beam_indices.GetCPU().size() <= cuda::c_gather_beams_max_beams);
+}
+
+// Calls launch(params, count) for every c_gather_beams_max_tensors of the (source, target) pairs of tensors, with params
+// holding the pairs and beam_indices
+template <typename Launch>
+void ForEachGatherBeamsLaunch(std::span<const std::pair<const void*, void*>> tensors, RoamingArray<int32_t>& beam_indices, Launch launch) {
+  cuda::GatherBeamsParams params;
+  if (beam_indices.IsOnGPU()) {
+    params.device_beam_indices = beam_indices.GetGPU().data();
+  } else {
+    auto indices = beam_indices.GetCPU();
+    std::copy(indices.begin(), indices.end(), params.beam_indices);
+  }
+  for (size_t start = 0; start < tensors.size(); start += cuda::c_gather_beams_max_tensors) {
+    const size_t count = std::min(tensors.size() - start, static_cast<size_t>(cuda::c_gather_beams_max_tensors));
+    for (size_t i = 0; i < count; i++) {
+      params.sources[i] = tensors[start + i].first;
+      params.targets[i] = tensors[start + i].second;
+    }
+    launch(params, static_cast<int>(count));
+  }
+}
+
+// Copies the beams of every (source, target) pair of tensors with one kernel launch per c_gather_beams_max_tensors of
+// them, target beam j coming from source beam beam_indices[j]
+void GatherBeams(std::span<const std::pair<const void*, void*>> tensors, RoamingArray<int32_t>& beam_indices,
+                 size_t bytes_per_beam, cudaStream_t stream) {
+  const int batch_beam_size = static_cast<int>(beam_indices.IsOnGPU() ? beam_indices.GetGPU().size() : beam_indices.GetCPU().size());
+  ForEachGatherBeamsLaunch(tensors, beam_indices, [&](const cuda::GatherBeamsParams& params, int count) {
+    cuda::LaunchGatherBeams(params, count, batch_beam_size, bytes_per_beam, stream);
+  });
+}
+
+// The same for beams of rows_per_beam rows, copying the leading row_bytes of each row between the pitches
+void GatherBeamRows(std::span<const std::pair<const void*, void*>> tensors, RoamingArray<int32_t>& beam_indices, int rows_per_beam,
+                    size_t source_pitch, size_t target_pitch, size_t row_bytes, cudaStream_t stream) {
+  const int batch_beam_size = static_cast<int>(beam_indices.IsOnGPU() ? beam_indices.GetGPU().size() : beam_indices.GetCPU().size());
+  ForEachGatherBeamsLaunch(tensors, beam_indices, [&](const cuda::GatherBeamsParams& params, int count) {
+    cuda::LaunchGatherBeamRows(params, count, batch_beam_size, rows_per_beam, source_pitch, target_pitch, row_bytes, stream);
+  });
+}
+#endif
+
+size_t TensorBytes(const OrtValue& value) {
+  auto info = value.GetTensorTypeAndShapeInfo();
+  return info->GetElementCount() * SizeOf(info->GetElementType());
+}
+
+// Bytes of the tensors that are set, the others have been moved from or aren't used
+size_t TensorBytes(std::span<const std::unique_ptr<OrtValue>> values) {
+  size_t bytes = 0;
+  for (auto& value : values) {
+    if (value)
+      bytes += TensorBytes(*value);
+  }
+  return bytes;
+}
+
+}  // namespace
+
+void KV_ByteCount::Set(size_t bytes) {
+  // Throws before changing anything when the growth doesn't fit the budget
+  if (bytes > bytes_)
+    model_.device_memory_budget_->Reserve(bytes - bytes_);
+  else
+    model_.device_memory_budget_->Release(bytes_ - bytes);
+  model_.kv_cache_bytes_ += static_cast<int64_t>(bytes) - static_cast<int64_t>(bytes_);
+  state_.kv_cache_bytes_ += bytes - bytes_;
+  bytes_ = bytes;
+}
+
+KV_BlockBuffer::KV_BlockBuffer(OrtAllocator& allocator, int block_size)
+    : allocator_{&allocator},
+      block_size_{block_size} {
+}
+
+KV_BlockBuffer::KV_BlockBuffer(KV_BlockBuffer&& other) noexcept
+    : allocator_{other.allocator_},
+      block_size_{other.block_size_},
+      buffer_{std::exchange(other.buffer_, nullptr)},
+      bytes_{std::exchange(other.bytes_, 0)},
+      block_count_{std::exchange(other.block_count_, 0)} {
+}
+
+KV_BlockBuffer::~KV_BlockBuffer() {
+  if (buffer_)
+    allocator_->Free(allocator_, buffer_);
+}
+
+std::unique_ptr<OrtValue> KV_BlockBuffer::CreateTensor(std::span<const int64_t> shape, ONNXTensorElementDataType type) {
+  assert(shape.size() == 4);
+  const size_t bytes_per_token = SizeOf(type) * shape[0] * shape[1] * shape[3];
+  const size_t bytes = bytes_per_token * shape[2];
+
+  if (bytes > bytes_) {
+    // Grow to the number of blocks that fit the sequence. The contents are not preserved, as the buffer being grown
+    // is always the one that's about to be fully overwritten by the next run
+    if (buffer_)
+      allocator_->Free(allocator_, buffer_);
+    block_count_ = (shape[2] + block_size_ - 1) / block_size_;
+    bytes_ = bytes_per_token * block_count_ * block_size_;
+    buffer_ = allocator_->Alloc(allocator_, bytes_);
+  }
+
+  return OrtValue::CreateTensor(*allocator_->Info(allocator_), buffer_, bytes, shape, type);
+}
+
+void KV_SwapBuffer::CopyOut([[maybe_unused]] std::span<OrtValue* const> values) {
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    Release();  // Swapped back in without a run since, so the tensors still hold what's being copied back
+    if (!event_)
+      event_ = std::make_unique<cuda_event_holder>(cudaEventDisableTiming);
+    size_t total_bytes = 0;
+    for (auto* value : values)
+      total_bytes += TensorBytes(*value);
+    buffer_ = CudaMallocHostArray<uint8_t>(total_bytes);
+
+    // The copies wait for the state's work, which comes after the run that wrote the tensors, then overlap the work of
+    // other states
+    cudaEventRecord(*event_, state_.cuda_stream_);
+    cudaStreamWaitEvent(model_.copy_stream_, *event_);
+    size_t offset = 0;
+    for (auto* value : values) {
+      const size_t bytes = TensorBytes(*value);
+      CudaCheck() == cudaMemcpyAsync(buffer_.get() + offset, value->GetTensorRawData(), bytes, cudaMemcpyDeviceToHost, model_.copy_stream_);
+      offset += bytes;
+    }
+    cudaEventRecord(*event_, model_.copy_stream_);
+
+    // The device memory can only be given back once it's copied
+    TraceSpan span{"cudaEventSynchronize"};
+    cudaEventSynchronize(*event_);
+    return;
+  }
+#endif
+  throw std::runtime_error("Swapping out the kv caches is only supported on CUDA, not " + to_string(model_.device_type_));
+}
+
+void KV_SwapBuffer::CopyIn([[maybe_unused]] std::span<OrtValue* const> values) {
+#if USE_CUDA
+  assert(buffer_);
+  size_t offset = 0;
+  for (auto* value : values) {
+    const size_t bytes = TensorBytes(*value);
+    CudaCheck() == cudaMemcpyAsync(value->GetTensorMutableRawData(), buffer_.get() + offset, bytes, cudaMemcpyHostToDevice, model_.copy_stream_);
+    offset += bytes;
+  }
+  cudaEventRecord(*event_, model_.copy_stream_);
+  cudaStreamWaitEvent(state_.cuda_stream_, *event_);
+#endif
+}
+
+void KV_SwapBuffer::Release() {
+#if USE_CUDA
+  // The next run waits for the copies back anyway, so the pinned memory can go before it's queued
+  if (buffer_) {
+    cudaEventSynchronize(*event_);
+    buffer_.reset();
+  }
+#endif
+}
+
 KV_Cache_Combined::KV_Cache_Combined(const Model& model, State& state)
     : model_{model},
       state_{state},
       layer_count_{model.config_->model.decoder.num_hidden_layers},
-      shape_{2, state_.params_->BatchBeamSize(), model.config_->model.decoder.num_key_value_heads, 0, model.config_->model.decoder.head_size} {
+      past_present_share_buffer_{state_.params_->search.past_present_share_buffer && state_.params_->search.num_beams == 1},
+      shape_{2, state_.params_->BatchBeamSize(), model.config_->model.decoder.num_key_value_heads, 0, model.config_->model.decoder.head_size},
+      byte_count_{model, state} {
+  if (state_.params_->search.kv_window_size > 0)
+    throw std::runtime_error("search.kv_window_size isn't supported by models with combined past/present kv tensors");
+  if (g_log.enabled && g_log.warning && past_present_share_buffer_ != state_.params_->search.past_present_share_buffer)
+    Log("warning", "past_present_share_buffer search option set to true, but has been disabled due to the current configuration. See https://aka.ms/generate_config for details");
+
+  if (past_present_share_buffer_) {
+    const auto& name = model_.config_->model.decoder.inputs.past_sequence_length;
+    if (!model_.session_info_->HasInput(name))
+      throw std::runtime_error("past_present_share_buffer with combined kv caches needs a model with the " + name + " input of its attention");
+    past_sequence_length_ = OrtValue::CreateTensor<int32_t>(model_.allocator_cpu_, std::array<int64_t, 1>{1});
+    *past_sequence_length_->GetTensorMutableData<int32_t>() = 0;
+  }
+
   pasts_.resize(layer_count_);
   presents_.reserve(layer_count_);
 
@@ -24,12 +209,13 @@ KV_Cache_Combined::KV_Cache_Combined(const Model& model, State& state)
   // Derive the KV data type from the KV input 0
   type_ = model_.session_info_->GetInputDataType(input_name_strings_[0]);
 
-  empty_past_ = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
-  shape_[3] = state_.params_->sequence_length;
+  empty_past_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), shape_, type_);
+  shape_[3] = past_present_share_buffer_ ? state_.params_->search.max_length : state_.params_->sequence_length;
 
   for (int i = 0; i < layer_count_; ++i) {
-    presents_.push_back(OrtValue::CreateTensor(*model.allocator_device_, shape_, type_));
+    presents_.push_back(OrtValue::CreateTensor(model.GetDeviceAllocator(AllocationSite::KV_Cache), shape_, type_));
   }
+  byte_count_.Set(TensorBytes(presents_));
 }
 
 void KV_Cache_Combined::Add() {
@@ -37,30 +223,115 @@ void KV_Cache_Combined::Add() {
   output_index_ = state_.outputs_.size();
 
   for (int i = 0; i < layer_count_; i++) {
-    state_.inputs_.push_back(empty_past_.get());
+    state_.inputs_.push_back(past_present_share_buffer_ ? presents_[i].get() : empty_past_.get());
     state_.input_names_.push_back(input_name_strings_[i].c_str());
     state_.outputs_.push_back(presents_[i].get());
     state_.output_names_.push_back(output_name_strings_[i].c_str());
   }
+
+  if (past_present_share_buffer_) {
+    past_sequence_length_index_ = state_.inputs_.size();
+    state_.inputs_.push_back(past_sequence_length_.get());
+    state_.input_names_.push_back(model_.config_->model.decoder.inputs.past_sequence_length.c_str());
+  }
 }
 
-void KV_Cache_Combined::Update(std::span<const int32_t> beam_indices, int current_length) {
+void KV_Cache_Combined::SwapOut() {
+  std::vector<OrtValue*> values;
+  for (auto& present : presents_)
+    values.push_back(present.get());
+  swap_buffer_.CopyOut(values);
+
+  for (int i = 0; i < layer_count_; i++) {
+    pasts_[i].reset();
+    presents_[i].reset();
+    state_.inputs_[input_index_ + i] = empty_past_.get();
+    state_.outputs_[output_index_ + i] = nullptr;
+  }
+  byte_count_.Set(0);
+}
+
+void KV_Cache_Combined::SwapIn() {
+  std::vector<OrtValue*> values;
+  for (int i = 0; i < layer_count_; i++) {
+    presents_[i] = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), shape_, type_);
+    state_.outputs_[output_index_ + i] = presents_[i].get();
+    if (past_present_share_buffer_)
+      state_.inputs_[input_index_ + i] = presents_[i].get();
+    values.push_back(presents_[i].get());
+  }
+  byte_count_.Set(TensorBytes(presents_));
+  swap_buffer_.CopyIn(values);
+}
+
+void KV_Cache_Combined::Update(RoamingArray<int32_t> beam_indices, int current_length) {
+  TraceSpan span{"KV_Cache::Update"};
+  swap_buffer_.Release();
   assert(state_.params_->search.num_beams == 1 || !beam_indices.empty());  // We require beam_indices if we're a beam search
 
+  // The run writes the new token's entry after the valid ones, in place
+  if (past_present_share_buffer_) {
+    *past_sequence_length_->GetTensorMutableData<int32_t>() = current_length - 1;
+    return;
+  }
+
+#if USE_CUDA
+  const bool gather_on_device = !beam_indices.empty() && CanGatherBeamsOnDevice(model_, beam_indices);
+  if (gather_on_device)
+    PickPastStatesOnDevice(beam_indices);
+#else
+  constexpr bool gather_on_device = false;
+#endif
+
+  state_.ReleaseBinding();
   for (int i = 0; i < layer_count_; i++) {
     if (beam_indices.empty()) {
       pasts_[i] = std::move(presents_[i]);
-    } else {
-      PickPastState(beam_indices, i);
+    } else if (!gather_on_device) {
+      PickPastState(beam_indices.GetCPU(), i);
     }
   }
 
   shape_[3] = current_length;
   for (int i = 0; i < layer_count_; i++) {
-    presents_[i] = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    presents_[i] = OrtValue::CreateTensor(state_.GetStepAllocator(), shape_, type_);
     state_.inputs_[input_index_ + i] = pasts_[i].get();
     state_.outputs_[output_index_ + i] = presents_[i].get();
   }
+  byte_count_.Set(TensorBytes(pasts_) + TensorBytes(presents_));
+}
+
+void KV_Cache_Combined::Rewind(int length) {
+  if (past_present_share_buffer_)
+    throw std::runtime_error("Combined kv caches with past_present_share_buffer can't be rewound");
+  assert(length <= shape_[3]);
+  if (length == shape_[3])
+    return;
+
+  // Every key and value head holds its sequence contiguously, so copy the leading part of each one
+  std::array<int64_t, 5> shape{shape_[0], shape_[1], shape_[2], length, shape_[4]};
+  const size_t element_size = SizeOf(type_);
+  const size_t head_count = shape_[0] * shape_[1] * shape_[2];
+  const size_t source_pitch = shape_[3] * shape_[4] * element_size;
+  const size_t target_pitch = length * shape_[4] * element_size;
+
+  for (int i = 0; i < layer_count_; i++) {
+    auto rewound = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), shape, type_);
+    auto* source = presents_[i]->GetTensorData<uint8_t>();
+    auto* target = rewound->GetTensorMutableData<uint8_t>();
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA) {
+      CudaCheck() == cudaMemcpy2DAsync(target, target_pitch, source, source_pitch, target_pitch, head_count, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+    } else
+#endif
+    {
+      for (size_t j = 0; j < head_count; j++)
+        std::copy_n(source + j * source_pitch, target_pitch, target + j * target_pitch);
+    }
+    presents_[i] = std::move(rewound);
+  }
+  shape_[3] = length;
+  byte_count_.Set(TensorBytes(pasts_) + TensorBytes(presents_));
 }
 
 // Copy present state to past state reordered by the beam_indices
@@ -71,7 +342,7 @@ void KV_Cache_Combined::PickPastState(std::span<const int32_t> beam_indices, int
   auto element_count = shape_[0] * past_key_size;
 
   const OrtValue& present = *presents_[index];
-  std::unique_ptr<OrtValue> past = OrtValue::CreateTensor<ScoreType>(*model_.allocator_device_, shape_);
+  std::unique_ptr<OrtValue> past = OrtValue::CreateTensor<ScoreType>(state_.GetStepAllocator(), shape_);
   auto past_span = std::span<ScoreType>(past->GetTensorMutableData<ScoreType>(), element_count);
   auto present_span = std::span<const ScoreType>(present.GetTensorData<ScoreType>(), element_count);
 
@@ -84,8 +355,8 @@ void KV_Cache_Combined::PickPastState(std::span<const int32_t> beam_indices, int
 
       auto past_key = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
       auto past_value = past_span.subspan(past_key_size + j * block_size_per_beam, block_size_per_beam);
-      cudaMemcpyAsync(past_key.data(), present_key.data(), present_key.size_bytes(), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
-      cudaMemcpyAsync(past_value.data(), present_value.data(), present_value.size_bytes(), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
+      cudaMemcpyAsync(past_key.data(), present_key.data(), present_key.size_bytes(), cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+      cudaMemcpyAsync(past_value.data(), present_value.data(), present_value.size_bytes(), cudaMemcpyDeviceToDevice, state_.cuda_stream_);
     }
   } else
 #endif
@@ -105,6 +376,23 @@ void KV_Cache_Combined::PickPastState(std::span<const int32_t> beam_indices, int
   pasts_[index] = std::move(past);
 }
 
+#if USE_CUDA
+void KV_Cache_Combined::PickPastStatesOnDevice(RoamingArray<int32_t>& beam_indices) {
+  // The keys and values are the two halves of each tensor, so they're gathered as separate tensors
+  const size_t bytes_per_beam = SizeOf(type_) * shape_[2] * shape_[3] * shape_[4];
+  const size_t past_key_bytes = shape_[1] * bytes_per_beam;
+  std::vector<std::pair<const void*, void*>> tensors;
+  for (int i = 0; i < layer_count_; i++) {
+    pasts_[i] = OrtValue::CreateTensor(state_.GetStepAllocator(), shape_, type_);
+    auto* present = presents_[i]->GetTensorData<uint8_t>();
+    auto* past = pasts_[i]->GetTensorMutableData<uint8_t>();
+    tensors.emplace_back(present, past);
+    tensors.emplace_back(present + past_key_bytes, past + past_key_bytes);
+  }
+  GatherBeams(tensors, beam_indices, bytes_per_beam, state_.cuda_stream_);
+}
+#endif
+
 void KV_Cache_Combined::PickPastState(std::span<const int32_t> beam_indices, int index) {
   if (type_ == Ort::TypeToTensorType<float>::type) {
     PickPastState<float>(beam_indices, index);
@@ -117,10 +405,23 @@ KV_Cache::KV_Cache(const Model& model, State& state)
     : model_{model},
       state_{state},
       layer_count_{model_.config_->model.decoder.num_hidden_layers},
-      past_present_share_buffer_{state_.params_->search.past_present_share_buffer && state_.params_->search.num_beams == 1},
-      shape_{state_.params_->BatchBeamSize(), model.config_->model.decoder.num_key_value_heads, 0, model.config_->model.decoder.head_size} {
-  if (g_log.enabled && g_log.warning && past_present_share_buffer_ != state_.params_->search.past_present_share_buffer)
-    Log("warning", "past_present_share_buffer search option set to true, but has been disabled due to the current configuration. See https://aka.ms/generate_config for details");
+      past_present_share_buffer_{state_.params_->search.past_present_share_buffer},
+      shape_{state_.params_->BatchBeamSize(), model.config_->model.decoder.num_key_value_heads, 0, model.config_->model.decoder.head_size},
+      byte_count_{model, state} {
+  if (const auto& search = state_.params_->search; search.kv_window_size > 0) {
+    if (past_present_share_buffer_ || state_.GetCapturedGraphInfo())
+      throw std::runtime_error("search.kv_window_size can't be used with past_present_share_buffer or graph capture, as they need kv caches of max_length");
+    if (model_.device_type_ != DeviceType::CPU && model_.device_type_ != DeviceType::CUDA)
+      throw std::runtime_error("search.kv_window_size is only supported on CPU and CUDA, not " + to_string(model_.device_type_));
+    // Once entries are dropped the past length no longer gives the positions, so the model has to take them
+    const auto& inputs = model_.config_->model.decoder.inputs;
+    if (!model_.session_info_->HasInput(inputs.position_ids) || !model_.session_info_->HasInput(inputs.attention_mask))
+      throw std::runtime_error("search.kv_window_size needs a model with position_ids and attention_mask inputs");
+    if (search.kv_sink_tokens < 0)
+      throw std::runtime_error("search.kv_sink_tokens must be 0 or greater, is " + std::to_string(search.kv_sink_tokens));
+    sink_length_ = search.kv_sink_tokens;
+    window_length_ = search.kv_sink_tokens + search.kv_window_size;
+  }
 
   pasts_.resize(layer_count_ * 2);
   presents_.reserve(layer_count_ * 2);
@@ -141,38 +442,146 @@ KV_Cache::KV_Cache(const Model& model, State& state)
   // Derive the KV data type from the KV input 0
   type_ = model_.session_info_->GetInputDataType(input_name_strings_[0]);
 
-  empty_past_ = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+  empty_past_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), shape_, type_);
+
+  // int8 kv caches come with a scale per head, that the model dequantizes the past with and outputs for the present
+  quantized_ = type_ == Ort::TypeToTensorType<int8_t>::type;
+  if (quantized_) {
+    const auto& inputs = model.config_->model.decoder.inputs;
+    const auto& outputs = model.config_->model.decoder.outputs;
+    if (inputs.past_key_scale_names.empty() || inputs.past_value_scale_names.empty() || outputs.present_key_scale_names.empty() || outputs.present_value_scale_names.empty())
+      throw std::runtime_error("int8 kv caches need the past & present key/value scale names to be set in the decoder inputs & outputs");
+    if (past_present_share_buffer_)
+      throw std::runtime_error("int8 kv caches can't use past_present_share_buffer, as the model requantizes the whole present every run");
+
+    for (int i = 0; i < layer_count_; ++i) {
+      char string[64];
+      snprintf(string, std::size(string), inputs.past_key_scale_names.c_str(), i);
+      scale_input_name_strings_.emplace_back(string);
+      snprintf(string, std::size(string), inputs.past_value_scale_names.c_str(), i);
+      scale_input_name_strings_.emplace_back(string);
+
+      snprintf(string, std::size(string), outputs.present_key_scale_names.c_str(), i);
+      scale_output_name_strings_.emplace_back(string);
+      snprintf(string, std::size(string), outputs.present_value_scale_names.c_str(), i);
+      scale_output_name_strings_.emplace_back(string);
+    }
+
+    scale_type_ = model_.session_info_->GetInputDataType(scale_input_name_strings_[0]);
+    scale_shape_ = {shape_[0], shape_[1], 1, 1};
+
+    // The empty past has no values to scale, but the model still takes the scale inputs
+    auto empty_past_scale = OrtValue::CreateTensor(model_.allocator_cpu_, scale_shape_, scale_type_);
+    std::memset(empty_past_scale->GetTensorMutableRawData(), 0, SizeOf(scale_type_) * scale_shape_[0] * scale_shape_[1]);
+    empty_past_scale_ = model_.ExpandInputs(empty_past_scale, 1, state_.cuda_stream_);
+
+    past_scales_.resize(layer_count_ * 2);
+    for (int i = 0; i < layer_count_ * 2; ++i) {
+      present_scales_.push_back(OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), scale_shape_, scale_type_));
+    }
+  }
 
   // Set the size after empty_past_ has been created with 0 for this field
   if (past_present_share_buffer_)
-    shape_[2] = state_.params_->search.max_length;
+    shape_[2] = GetSharedLength(state_.GetFirstRunEnd());
   else
-    shape_[2] = state_.params_->sequence_length;
+    shape_[2] = state_.GetFirstRunEnd();
 
   if (state_.GetCapturedGraphInfo()) {
-    assert(past_present_share_buffer_);
+    if (!past_present_share_buffer_)
+      throw std::runtime_error("Graph capture needs search.past_present_share_buffer, as the kv caches have to stay where they are");
     sb_kv_caches_.reserve(layer_count_ * 2);
     for (int i = 0; i < layer_count_ * 2; ++i) {
       sb_kv_caches_.push_back(state_.GetCapturedGraphInfo()->sb_kv_caches_[i].get());
     }
   }
 
+  // Block buffers only help when the past & presents are reallocated every step
+  if (state_.params_->search.kv_block_size > 0 && !past_present_share_buffer_ && sb_kv_caches_.empty()) {
+    block_buffers_.reserve(layer_count_ * 2 * 2);
+    for (int i = 0; i < layer_count_ * 2 * 2; ++i) {
+      block_buffers_.emplace_back(model_.GetDeviceAllocator(AllocationSite::KV_Cache), state_.params_->search.kv_block_size);
+    }
+    present_block_buffer_.resize(layer_count_ * 2);
+  }
+
   for (int i = 0; i < layer_count_ * 2; ++i) {
     presents_.push_back(
-        sb_kv_caches_.empty() ? OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_)
+        sb_kv_caches_.empty() ? CreatePresent(i, model_.GetDeviceAllocator(AllocationSite::KV_Cache))
                               : sb_kv_caches_[i]->CreateTensorOnStaticBuffer(shape_, type_));
   }
+  UpdateByteCount();
+
+  if (past_present_share_buffer_ && model_.session_info_->HasInput(model_.config_->model.decoder.inputs.past_sequence_length)) {
+    past_sequence_length_ = OrtValue::CreateTensor<int32_t>(model_.allocator_cpu_, std::array<int64_t, 1>{1});
+    *past_sequence_length_->GetTensorMutableData<int32_t>() = 0;
+    // A replayed graph would keep the past length it was captured with, as the attention reads it on the host
+    if (state_.GetCapturedGraphInfo())
+      throw std::runtime_error("Graph capture isn't supported for models with a past_sequence_length input, like Whisper's decoder");
+  }
+}
+
+void KV_Cache::UpdateByteCount() {
+  // With past_present_share_buffer the pasts are unset, as the presents are used for both
+  byte_count_.Set(TensorBytes(pasts_) + TensorBytes(presents_) + TensorBytes(past_scales_) + TensorBytes(present_scales_));
+}
+
+std::unique_ptr<OrtValue> KV_Cache::CreatePresent(int index, OrtAllocator& allocator) {
+  if (block_buffers_.empty())
+    return OrtValue::CreateTensor(allocator, shape_, type_);
+  return block_buffers_[index * 2 + present_block_buffer_[index]].CreateTensor(shape_, type_);
+}
+
+std::unique_ptr<OrtValue> KV_Cache::CreatePast(int index) {
+  if (block_buffers_.empty())
+    return OrtValue::CreateTensor(state_.GetStepAllocator(), shape_, type_);
+  return block_buffers_[index * 2 + (present_block_buffer_[index] ^ 1)].CreateTensor(shape_, type_);
 }
 
 void KV_Cache::AddEncoder() {
   // We don't set the input_index_ & output_index_ because the encoder step only runs once, there's no update
 
+  // The shared presents are longer than the prompt the encoder step outputs
+  if (past_present_share_buffer_) {
+    const std::array<int64_t, 4> shape{shape_[0], shape_[1], static_cast<int64_t>(state_.GetFirstRunEnd()), shape_[3]};
+    for (int i = 0; i < layer_count_ * 2; ++i) {
+      encoder_presents_.push_back(OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), shape, type_));
+    }
+  }
+
+  auto& presents = encoder_presents_.empty() ? presents_ : encoder_presents_;
   for (int i = 0; i < layer_count_ * 2; ++i) {
-    state_.outputs_.push_back(presents_[i].get());
+    state_.outputs_.push_back(presents[i].get());
     state_.output_names_.push_back(output_name_strings_[i].c_str());
   }
 }
 
+void KV_Cache::MoveEncoderPresents() {
+  const size_t element_size = SizeOf(type_);
+  const size_t head_count = shape_[0] * shape_[1];
+  const size_t source_pitch = state_.GetFirstRunEnd() * shape_[3] * element_size;
+  const size_t target_pitch = shape_[2] * shape_[3] * element_size;
+
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    auto* source = encoder_presents_[i]->GetTensorData<uint8_t>();
+    auto* target = presents_[i]->GetTensorMutableData<uint8_t>();
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA) {
+      CudaCheck() == cudaMemcpy2DAsync(target, target_pitch, source, source_pitch, source_pitch, head_count, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+    } else
+#endif
+    {
+      for (size_t j = 0; j < head_count; j++)
+        std::copy_n(source + j * source_pitch, source_pitch, target + j * target_pitch);
+    }
+  }
+  encoder_presents_.clear();
+}
+
+void KV_Cache::SetPastSequenceLength(int length) {
+  *past_sequence_length_->GetTensorMutableData<int32_t>() = length;
+}
+
 void KV_Cache::Add() {
   input_index_ = state_.inputs_.size();
   output_index_ = state_.outputs_.size();
@@ -189,28 +598,438 @@ void KV_Cache::Add() {
     for (int i = 0; i < layer_count_ * 2; ++i) {
       state_.inputs_[input_index_ + i] = presents_[i].get();
     }
+    if (!encoder_presents_.empty())
+      MoveEncoderPresents();
+  }
+
+  if (past_sequence_length_) {
+    SetPastSequenceLength(0);
+    state_.inputs_.push_back(past_sequence_length_.get());
+    state_.input_names_.push_back(model_.config_->model.decoder.inputs.past_sequence_length.c_str());
+  }
+
+  if (quantized_) {
+    scale_input_index_ = state_.inputs_.size();
+    scale_output_index_ = state_.outputs_.size();
+
+    for (int i = 0; i < layer_count_ * 2; ++i) {
+      state_.inputs_.push_back(empty_past_scale_.get());
+      state_.input_names_.push_back(scale_input_name_strings_[i].c_str());
+      state_.outputs_.push_back(present_scales_[i].get());
+      state_.output_names_.push_back(scale_output_name_strings_[i].c_str());
+    }
+  }
+
+  // With a cached prompt prefix, the first run continues from the prefix instead of an empty past
+  if (auto* prefix = state_.GetCachedPrefix()) {
+    assert(!past_present_share_buffer_);
+    // A restored saved state can come from any model, so check it is one of this one's
+    if (prefix->kv.size() != static_cast<size_t>(layer_count_ * (quantized_ ? 4 : 2)))
+      throw std::runtime_error("The kv caches of the prefix don't match the " + std::to_string(layer_count_) + " layers of the model");
+    for (int i = 0; i < layer_count_ * 2; ++i) {
+      auto info = prefix->kv[i]->GetTensorTypeAndShapeInfo();
+      auto shape = info->GetShape();
+      if (info->GetElementType() != type_ || shape.size() != 4 || shape[0] != 1 || shape[1] != shape_[1] || shape[2] != static_cast<int64_t>(prefix->tokens.size()) || shape[3] != shape_[3])
+        throw std::runtime_error("The kv caches of the prefix don't match the kv cache type and shape of the model");
+    }
+    for (int i = 0; i < layer_count_ * 2; ++i) {
+      state_.inputs_[input_index_ + i] = prefix->kv[i].get();
+      if (quantized_)
+        state_.inputs_[scale_input_index_ + i] = prefix->kv[layer_count_ * 2 + i].get();
+    }
   }
 }
 
-void KV_Cache::Update(std::span<const int32_t> beam_indices, int current_length) {
-  // If we're sharing past & present buffers there is nothing to do here, so early exit
-  if (past_present_share_buffer_)
+std::unique_ptr<OrtValue> KV_Cache::CopyPresent(int index, int length) const {
+  assert(length <= shape_[2]);
+  std::array<int64_t, 4> shape{shape_[0], shape_[1], length, shape_[3]};
+  const size_t element_size = SizeOf(type_);
+  const size_t head_count = shape_[0] * shape_[1];
+  const size_t source_pitch = shape_[2] * shape_[3] * element_size;
+  const size_t target_pitch = length * shape_[3] * element_size;
+
+  auto copy = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), shape, type_);
+  auto* source = presents_[index]->GetTensorData<uint8_t>();
+  auto* target = copy->GetTensorMutableData<uint8_t>();
+
+  // Every head holds its sequence contiguously, so copy the leading part of each one
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    CudaCheck() == cudaMemcpy2DAsync(target, target_pitch, source, source_pitch, target_pitch, head_count, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+  } else
+#endif
+  {
+    for (size_t j = 0; j < head_count; j++)
+      std::copy_n(source + j * source_pitch, target_pitch, target + j * target_pitch);
+  }
+  return copy;
+}
+
+std::vector<std::unique_ptr<OrtValue>> KV_Cache::CopyPresents(int length) const {
+  std::vector<std::unique_ptr<OrtValue>> copies;
+  copies.reserve(layer_count_ * (quantized_ ? 4 : 2));
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    copies.push_back(CopyPresent(i, length));
+  }
+
+  // The scales cover the whole present, so they stay valid for its leading part and follow the kv copies
+  if (quantized_) {
+    const size_t bytes = SizeOf(scale_type_) * scale_shape_[0] * scale_shape_[1];
+    for (int i = 0; i < layer_count_ * 2; ++i) {
+      auto copy = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), scale_shape_, scale_type_);
+#if USE_CUDA
+      if (model_.device_type_ == DeviceType::CUDA) {
+        CudaCheck() == cudaMemcpyAsync(copy->GetTensorMutableRawData(), present_scales_[i]->GetTensorRawData(), bytes, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+      } else
+#endif
+        std::memcpy(copy->GetTensorMutableRawData(), present_scales_[i]->GetTensorRawData(), bytes);
+      copies.push_back(std::move(copy));
+    }
+  }
+  return copies;
+}
+
+void KV_Cache::CopyBatchEntry(const KV_Cache& source, int batch_beam_index, int length) {
+  assert(source.shape_[0] == 1 && length <= source.shape_[2] && length <= shape_[2]);
+  const size_t element_size = SizeOf(type_);
+  const size_t head_count = shape_[1];
+  const size_t source_pitch = source.shape_[2] * shape_[3] * element_size;
+  const size_t target_pitch = shape_[2] * shape_[3] * element_size;
+  const size_t width = length * shape_[3] * element_size;
+  const size_t scale_bytes = quantized_ ? SizeOf(scale_type_) * scale_shape_[1] : 0;
+
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    auto* source_data = source.presents_[i]->GetTensorData<uint8_t>();
+    auto* target = presents_[i]->GetTensorMutableData<uint8_t>() + batch_beam_index * head_count * target_pitch;
+    // The positions after the prompt are masked out, but are zeroed as a NaN in them would still get through the softmax
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA) {
+      CudaCheck() == cudaMemcpy2DAsync(target, target_pitch, source_data, source_pitch, width, head_count, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+      if (width < target_pitch)
+        CudaCheck() == cudaMemset2DAsync(target + width, target_pitch, 0, target_pitch - width, head_count, state_.cuda_stream_);
+      if (quantized_)
+        CudaCheck() == cudaMemcpyAsync(present_scales_[i]->GetTensorMutableData<uint8_t>() + batch_beam_index * scale_bytes, source.present_scales_[i]->GetTensorRawData(), scale_bytes, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+      continue;
+    }
+#endif
+    for (size_t j = 0; j < head_count; j++) {
+      std::copy_n(source_data + j * source_pitch, width, target + j * target_pitch);
+      std::fill(target + j * target_pitch + width, target + (j + 1) * target_pitch, uint8_t{});
+    }
+    if (quantized_)
+      std::memcpy(present_scales_[i]->GetTensorMutableData<uint8_t>() + batch_beam_index * scale_bytes, source.present_scales_[i]->GetTensorRawData(), scale_bytes);
+  }
+}
+
+void KV_Cache::Rewind(int length) {
+  assert(!past_present_share_buffer_);
+  if (window_length_)
+    throw std::runtime_error("kv caches with a kv_window_size can't be rewound");
+  if (length == shape_[2])
+    return;
+
+  // With block buffers the copies are separate allocations, which is fine as Update() turns them into the pasts
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    presents_[i] = CopyPresent(i, length);
+  }
+  shape_[2] = length;
+  UpdateByteCount();
+}
+
+void KV_Cache::SwapOut() {
+  if (!sb_kv_caches_.empty())
+    throw std::runtime_error("kv caches on the static buffers of a captured graph can't be swapped out");
+
+  std::vector<OrtValue*> values;
+  for (auto* tensors : {&presents_, &present_scales_}) {
+    for (auto& value : *tensors)
+      values.push_back(value.get());
+  }
+  swap_buffer_.CopyOut(values);
+
+  // The pasts are what the last run read, the presents replace them in the next Update()
+  for (auto* tensors : {&pasts_, &presents_, &past_scales_, &present_scales_}) {
+    for (auto& value : *tensors)
+      value.reset();
+  }
+  block_buffers_.clear();
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    state_.inputs_[input_index_ + i] = empty_past_.get();
+    state_.outputs_[output_index_ + i] = nullptr;
+    if (quantized_) {
+      state_.inputs_[scale_input_index_ + i] = empty_past_scale_.get();
+      state_.outputs_[scale_output_index_ + i] = nullptr;
+    }
+  }
+  UpdateByteCount();
+}
+
+void KV_Cache::SwapIn() {
+  // Without block buffers present_block_buffer_ is empty
+  for (size_t i = 0; i < present_block_buffer_.size() * 2; ++i) {
+    block_buffers_.emplace_back(model_.GetDeviceAllocator(AllocationSite::KV_Cache), state_.params_->search.kv_block_size);
+  }
+  std::fill(present_block_buffer_.begin(), present_block_buffer_.end(), 0);
+
+  std::vector<OrtValue*> values;
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    presents_[i] = CreatePresent(i, model_.GetDeviceAllocator(AllocationSite::KV_Cache));
+    state_.outputs_[output_index_ + i] = presents_[i].get();
+    if (past_present_share_buffer_)
+      state_.inputs_[input_index_ + i] = presents_[i].get();
+    values.push_back(presents_[i].get());
+  }
+  for (int i = 0; quantized_ && i < layer_count_ * 2; ++i) {
+    present_scales_[i] = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), scale_shape_, scale_type_);
+    state_.outputs_[scale_output_index_ + i] = present_scales_[i].get();
+    values.push_back(present_scales_[i].get());
+  }
+  UpdateByteCount();
+  swap_buffer_.CopyIn(values);
+}
+
+void KV_Cache::Update(RoamingArray<int32_t> beam_indices, int current_length) {
+  TraceSpan span{"KV_Cache::Update"};
+  swap_buffer_.Release();
+
+  // If we're sharing past & present buffers the presents stay where they are, with beams only their entries move
+  if (past_present_share_buffer_) {
+    GrowSharedPresents(current_length);
+    if (!beam_indices.empty())
+      ReorderBeams(beam_indices, current_length - 1);
+    if (past_sequence_length_)
+      SetPastSequenceLength(current_length - 1);
     return;
+  }
+
+#if USE_CUDA
+  const bool gather_on_device = !beam_indices.empty() && CanGatherBeamsOnDevice(model_, beam_indices);
+  if (gather_on_device)
+    PickPastStatesOnDevice(beam_indices);
+#else
+  constexpr bool gather_on_device = false;
+#endif
 
+  state_.ReleaseBinding();
   for (int i = 0; i < layer_count_ * 2; i++) {
     if (beam_indices.empty()) {
       pasts_[i] = std::move(presents_[i]);
-    } else {
-      PickPastState(beam_indices, i);
+      // The present becomes the past, so the next present goes on the other block buffer
+      if (!block_buffers_.empty())
+        present_block_buffer_[i] ^= 1;
+      if (quantized_)
+        past_scales_[i] = std::move(present_scales_[i]);
+    } else if (!gather_on_device) {
+      PickPastState(beam_indices.GetCPU(), i);
+      if (quantized_)
+        PickPastScale(beam_indices.GetCPU(), i);
     }
     state_.inputs_[input_index_ + i] = pasts_[i].get();
+    if (quantized_)
+      state_.inputs_[scale_input_index_ + i] = past_scales_[i].get();
   }
 
-  shape_[2] = current_length;
+  // With a window, the current token's entry is added to what's left of the past instead of the whole sequence
+  if (window_length_ && shape_[2] > window_length_) {
+    DropPastEntries();
+    for (int i = 0; i < layer_count_ * 2; i++) {
+      state_.inputs_[input_index_ + i] = pasts_[i].get();
+    }
+  }
+  shape_[2] = window_length_ ? shape_[2] + 1 : current_length;
+
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    presents_[i] = CreatePresent(i, state_.GetStepAllocator());
+    state_.outputs_[output_index_ + i] = presents_[i].get();
+    if (quantized_) {
+      present_scales_[i] = OrtValue::CreateTensor(state_.GetStepAllocator(), scale_shape_, scale_type_);
+      state_.outputs_[scale_output_index_ + i] = present_scales_[i].get();
+    }
+  }
+  UpdateByteCount();
+}
+
+int64_t KV_Cache::GetSharedLength(int64_t length) const {
+  // A captured graph needs the presents to stay where they are, so they're allocated to max_length once
+  const int64_t max_length = state_.params_->search.max_length;
+  const int64_t block_size = state_.params_->search.kv_block_size;
+  if (block_size <= 0 || state_.GetCapturedGraphInfo())
+    return max_length;
+  return std::min(max_length, (length + block_size - 1) / block_size * block_size);
+}
+
+void KV_Cache::GrowSharedPresents(int length) {
+  const int64_t shared_length = GetSharedLength(length);
+  if (shared_length <= shape_[2])
+    return;
+
+  // The whole old present is copied to the start of each head of the new one, whatever part of it is valid
+  const size_t element_size = SizeOf(type_);
+  const size_t head_count = shape_[0] * shape_[1];
+  const size_t source_pitch = shape_[2] * shape_[3] * element_size;
+  const size_t target_pitch = shared_length * shape_[3] * element_size;
+  shape_[2] = shared_length;
+  state_.ReleaseBinding();
+
   for (int i = 0; i < layer_count_ * 2; i++) {
-    presents_[i] = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    auto present = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), shape_, type_);
+    auto* source = presents_[i]->GetTensorData<uint8_t>();
+    auto* target = present->GetTensorMutableData<uint8_t>();
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA) {
+      CudaCheck() == cudaMemcpy2DAsync(target, target_pitch, source, source_pitch, source_pitch, head_count, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+    } else
+#endif
+    {
+      for (size_t j = 0; j < head_count; j++)
+        std::copy_n(source + j * source_pitch, source_pitch, target + j * target_pitch);
+    }
+    state_.ReleaseAfterQueuedWork(std::exchange(presents_[i], std::move(present)));
+    state_.inputs_[input_index_ + i] = presents_[i].get();
     state_.outputs_[output_index_ + i] = presents_[i].get();
   }
+  UpdateByteCount();
+}
+
+void KV_Cache::ReorderBeams(RoamingArray<int32_t>& beam_indices, int length) {
+  // A beam can take another's entries while that one takes a third's, so the entries are gathered into scratch tensors
+  // and copied back. Only the first 'length' positions of each head are valid, the rest of max_length isn't touched
+  const std::array<int64_t, 4> scratch_shape{shape_[0], shape_[1], length, shape_[3]};
+  const int head_count = static_cast<int>(shape_[1]);
+  const size_t element_size = SizeOf(type_);
+  const size_t pitch = shape_[2] * shape_[3] * element_size;
+  const size_t width = length * shape_[3] * element_size;
+  const size_t batch_beam_size = shape_[0];
+
+  std::vector<std::unique_ptr<OrtValue>> scratch;
+  scratch.reserve(layer_count_ * 2);
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    scratch.push_back(OrtValue::CreateTensor(state_.GetStepAllocator(), scratch_shape, type_));
+  }
+
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    if (CanGatherBeamsOnDevice(model_, beam_indices)) {
+      std::vector<std::pair<const void*, void*>> tensors;
+      for (int i = 0; i < layer_count_ * 2; i++) {
+        tensors.emplace_back(presents_[i]->GetTensorRawData(), scratch[i]->GetTensorMutableRawData());
+      }
+      GatherBeamRows(tensors, beam_indices, head_count, pitch, width, width, state_.cuda_stream_);
+    } else {
+      auto indices = beam_indices.GetCPU();
+      for (int i = 0; i < layer_count_ * 2; i++) {
+        auto* source = presents_[i]->GetTensorData<uint8_t>();
+        auto* target = scratch[i]->GetTensorMutableData<uint8_t>();
+        for (size_t j = 0; j < batch_beam_size; j++)
+          CudaCheck() == cudaMemcpy2DAsync(target + j * head_count * width, width, source + indices[j] * head_count * pitch, pitch, width, head_count, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+      }
+    }
+    for (int i = 0; i < layer_count_ * 2; i++) {
+      CudaCheck() == cudaMemcpy2DAsync(presents_[i]->GetTensorMutableRawData(), pitch, scratch[i]->GetTensorRawData(), width, width, batch_beam_size * head_count, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+    }
+    return;
+  }
+#endif
+
+  auto indices = beam_indices.GetCPU();
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    auto* present = presents_[i]->GetTensorMutableData<uint8_t>();
+    auto* target = scratch[i]->GetTensorMutableData<uint8_t>();
+    for (size_t j = 0; j < batch_beam_size * head_count; j++)
+      std::copy_n(present + (indices[j / head_count] * head_count + j % head_count) * pitch, width, target + j * width);
+    for (size_t j = 0; j < batch_beam_size * head_count; j++)
+      std::copy_n(target + j * width, width, present + j * pitch);
+  }
+}
+
+void KV_Cache::DropRows(std::span<const int32_t> rows) {
+  // After Update() the pasts hold the cache, the presents are only written by the next run so they're just made again
+  assert(!past_present_share_buffer_ && !window_length_);
+  auto past_shape = pasts_[0]->GetTensorTypeAndShapeInfo()->GetShape();
+  const size_t bytes_per_row = SizeOf(type_) * past_shape[1] * past_shape[2] * past_shape[3];
+  const size_t scale_bytes_per_row = quantized_ ? SizeOf(scale_type_) * scale_shape_[1] : 0;
+  past_shape[0] = static_cast<int64_t>(rows.size());
+  shape_[0] = past_shape[0];
+  scale_shape_[0] = past_shape[0];
+
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    // On block buffers the kept rows go on the present's buffer, so the next present goes on the old past's
+    std::unique_ptr<OrtValue> past;
+    if (block_buffers_.empty())
+      past = OrtValue::CreateTensor(state_.GetStepAllocator(), past_shape, type_);
+    else {
+      past = block_buffers_[i * 2 + present_block_buffer_[i]].CreateTensor(past_shape, type_);
+      present_block_buffer_[i] ^= 1;
+    }
+    GatherRows(model_, pasts_[i]->GetTensorRawData(), past->GetTensorMutableRawData(), rows, bytes_per_row, state_.cuda_stream_);
+    state_.ReleaseAfterQueuedWork(std::exchange(pasts_[i], std::move(past)));
+    state_.inputs_[input_index_ + i] = pasts_[i].get();
+    presents_[i] = CreatePresent(i, state_.GetStepAllocator());
+    state_.outputs_[output_index_ + i] = presents_[i].get();
+
+    if (quantized_) {
+      auto past_scale = OrtValue::CreateTensor(state_.GetStepAllocator(), scale_shape_, scale_type_);
+      GatherRows(model_, past_scales_[i]->GetTensorRawData(), past_scale->GetTensorMutableRawData(), rows, scale_bytes_per_row, state_.cuda_stream_);
+      state_.ReleaseAfterQueuedWork(std::exchange(past_scales_[i], std::move(past_scale)));
+      state_.inputs_[scale_input_index_ + i] = past_scales_[i].get();
+      present_scales_[i] = OrtValue::CreateTensor(state_.GetStepAllocator(), scale_shape_, scale_type_);
+      state_.outputs_[scale_output_index_ + i] = present_scales_[i].get();
+    }
+  }
+  UpdateByteCount();
+}
+
+void KV_Cache::DropPastEntries() {
+  // Every head holds its sequence contiguously, so each keeps its sink entries and moves the most recent ones up behind
+  // them. int8 scales are per head, so they still apply to what's kept
+  const size_t element_size = SizeOf(type_);
+  const size_t head_count = shape_[0] * shape_[1];
+  const size_t source_pitch = shape_[2] * shape_[3] * element_size;
+  const size_t target_pitch = window_length_ * shape_[3] * element_size;
+  const size_t sink_bytes = sink_length_ * shape_[3] * element_size;
+  const size_t recent_bytes = target_pitch - sink_bytes;
+  const size_t recent_offset = source_pitch - recent_bytes;
+
+  std::array<int64_t, 4> shape{shape_[0], shape_[1], window_length_, shape_[3]};
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    auto past = OrtValue::CreateTensor(state_.GetStepAllocator(), shape, type_);
+    auto* source = pasts_[i]->GetTensorData<uint8_t>();
+    auto* target = past->GetTensorMutableData<uint8_t>();
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA) {
+      if (sink_bytes)
+        CudaCheck() == cudaMemcpy2DAsync(target, target_pitch, source, source_pitch, sink_bytes, head_count, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+      CudaCheck() == cudaMemcpy2DAsync(target + sink_bytes, target_pitch, source + recent_offset, source_pitch, recent_bytes, head_count, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+    } else
+#endif
+    {
+      for (size_t j = 0; j < head_count; j++) {
+        std::copy_n(source + j * source_pitch, sink_bytes, target + j * target_pitch);
+        std::copy_n(source + j * source_pitch + recent_offset, recent_bytes, target + j * target_pitch + sink_bytes);
+      }
+    }
+    pasts_[i] = std::move(past);
+  }
+  shape_[2] = window_length_;
+}
+
+// Copy the present scales to the past scales reordered by the beam_indices
+void KV_Cache::PickPastScale(std::span<const int32_t> beam_indices, int index) {
+  const size_t bytes_per_beam = SizeOf(scale_type_) * scale_shape_[1];
+  auto past_scale = OrtValue::CreateTensor(state_.GetStepAllocator(), scale_shape_, scale_type_);
+  auto* source = present_scales_[index]->GetTensorData<uint8_t>();
+  auto* target = past_scale->GetTensorMutableData<uint8_t>();
+
+  for (size_t j = 0; j < beam_indices.size(); j++) {
+#if USE_CUDA
+    if (model_.device_type_ == DeviceType::CUDA) {
+      cudaMemcpyAsync(target + j * bytes_per_beam, source + beam_indices[j] * bytes_per_beam, bytes_per_beam, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+    } else
+#endif
+      std::copy_n(source + beam_indices[j] * bytes_per_beam, bytes_per_beam, target + j * bytes_per_beam);
+  }
+
+  past_scales_[index] = std::move(past_scale);
 }
 
 // Copy present state to past state reordered by the beam_indices
@@ -220,7 +1039,7 @@ void KV_Cache::PickPastState(std::span<const int32_t> beam_indices, int index) {
   auto element_count = shape_[0] * block_size_per_beam;
 
   const OrtValue& present_value = *presents_[index];
-  std::unique_ptr<OrtValue> past_value = OrtValue::CreateTensor<ScoreType>(*model_.allocator_device_, shape_);
+  std::unique_ptr<OrtValue> past_value = CreatePast(index);
   auto past_span = std::span<ScoreType>(past_value->GetTensorMutableData<ScoreType>(), element_count);
   auto present_span = std::span<const ScoreType>(present_value.GetTensorData<ScoreType>(), element_count);
 
@@ -230,7 +1049,7 @@ void KV_Cache::PickPastState(std::span<const int32_t> beam_indices, int index) {
       int32_t beam_index = beam_indices[j];
       auto present = present_span.subspan(beam_index * block_size_per_beam, block_size_per_beam);
       auto past = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
-      cudaMemcpyAsync(past.data(), present.data(), present.size_bytes(), cudaMemcpyDeviceToDevice, model_.cuda_stream_);
+      cudaMemcpyAsync(past.data(), present.data(), present.size_bytes(), cudaMemcpyDeviceToDevice, state_.cuda_stream_);
     }
   } else
 #endif
@@ -246,19 +1065,42 @@ void KV_Cache::PickPastState(std::span<const int32_t> beam_indices, int index) {
   pasts_[index] = std::move(past_value);
 }
 
+#if USE_CUDA
+void KV_Cache::PickPastStatesOnDevice(RoamingArray<int32_t>& beam_indices) {
+  std::vector<std::pair<const void*, void*>> tensors;
+  for (int i = 0; i < layer_count_ * 2; i++) {
+    pasts_[i] = CreatePast(i);
+    tensors.emplace_back(presents_[i]->GetTensorRawData(), pasts_[i]->GetTensorMutableRawData());
+  }
+  GatherBeams(tensors, beam_indices, SizeOf(type_) * shape_[1] * shape_[2] * shape_[3], state_.cuda_stream_);
+
+  if (quantized_) {
+    tensors.clear();
+    for (int i = 0; i < layer_count_ * 2; i++) {
+      past_scales_[i] = OrtValue::CreateTensor(state_.GetStepAllocator(), scale_shape_, scale_type_);
+      tensors.emplace_back(present_scales_[i]->GetTensorRawData(), past_scales_[i]->GetTensorMutableRawData());
+    }
+    GatherBeams(tensors, beam_indices, SizeOf(scale_type_) * scale_shape_[1], state_.cuda_stream_);
+  }
+}
+#endif
+
 void KV_Cache::PickPastState(std::span<const int32_t> beam_indices, int index) {
   if (type_ == Ort::TypeToTensorType<float>::type) {
     PickPastState<float>(beam_indices, index);
+  } else if (type_ == Ort::TypeToTensorType<int8_t>::type) {
+    PickPastState<int8_t>(beam_indices, index);
   } else {
     PickPastState<Ort::Float16_t>(beam_indices, index);
   }
 }
 
-Cross_Cache::Cross_Cache(const Model& model, State& state)
+Cross_Cache::Cross_Cache(const Model& model, State& state, int64_t encoder_sequence_length)
     : model_{model},
       state_{state},
       layer_count_{model_.config_->model.decoder.num_hidden_layers},
-      shape_{state_.params_->BatchBeamSize(), model.config_->model.decoder.num_key_value_heads, 1500, model.config_->model.decoder.head_size} {
+      shape_{state_.params_->BatchBeamSize(), model.config_->model.decoder.num_key_value_heads, encoder_sequence_length, model.config_->model.decoder.head_size},
+      byte_count_{model, state} {
   values_.reserve(layer_count_ * 2);
 
   for (int i = 0; i < layer_count_; ++i) {
@@ -277,10 +1119,12 @@ Cross_Cache::Cross_Cache(const Model& model, State& state)
   // Derive the KV data type from the KV input 0
   type_ = model_.session_info_->GetInputDataType(input_name_strings_[0]);
 
-  for (int i = 0; i < layer_count_; ++i) {
-    values_.push_back(OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_));
-    values_.push_back(OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_));
+  auto* captured_graph_info = state_.GetCapturedGraphInfo();
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    values_.push_back(captured_graph_info ? captured_graph_info->sb_cross_caches_[i]->CreateTensorOnStaticBuffer(shape_, type_)
+                                          : OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), shape_, type_));
   }
+  byte_count_.Set(TensorBytes(values_));
 }
 
 void Cross_Cache::AddOutputs() {
@@ -297,4 +1141,101 @@ void Cross_Cache::AddInputs() {
   }
 }
 
+KV_Cache_Windowed::KV_Cache_Windowed(const Model& model, State& state)
+    : model_{model},
+      state_{state},
+      layer_count_{model_.config_->model.decoder.num_hidden_layers},
+      context_length_{model_.config_->model.context_length},
+      byte_count_{model, state} {
+  for (int i = 0; i < layer_count_; ++i) {
+    char string[64];
+    snprintf(string, std::size(string), model.config_->model.decoder.inputs.past_key_names.c_str(), i);
+    input_name_strings_.emplace_back(string);
+    snprintf(string, std::size(string), model.config_->model.decoder.inputs.past_value_names.c_str(), i);
+    input_name_strings_.emplace_back(string);
+
+    snprintf(string, std::size(string), model.config_->model.decoder.outputs.present_key_names.c_str(), i);
+    output_name_strings_.emplace_back(string);
+    snprintf(string, std::size(string), model.config_->model.decoder.outputs.present_value_names.c_str(), i);
+    output_name_strings_.emplace_back(string);
+  }
+
+  // Derive the KV data type from the KV input 0
+  type_ = model_.session_info_->GetInputDataType(input_name_strings_[0]);
+  pasts_.resize(layer_count_ * 2);
+  presents_.resize(layer_count_ * 2);
+}
+
+void KV_Cache_Windowed::Add() {
+  input_index_ = state_.inputs_.size();
+  output_index_ = state_.outputs_.size();
+
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    state_.inputs_.push_back(pasts_[i].get());
+    state_.input_names_.push_back(input_name_strings_[i].c_str());
+    state_.outputs_.push_back(presents_[i].get());
+    state_.output_names_.push_back(output_name_strings_[i].c_str());
+  }
+}
+
+std::unique_ptr<OrtValue> KV_Cache_Windowed::CreateZeroed(std::span<const int64_t> shape) const {
+  auto value = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::KV_Cache), shape, type_);
+  std::memset(value->GetTensorMutableRawData(), 0, TensorBytes(*value));
+  return value;
+}
+
+void KV_Cache_Windowed::SetTensors(size_t window_size) {
+  const auto& decoder = model_.config_->model.decoder;
+  // Like the exported attention's, the presents are the past followed by the window
+  const std::array<int64_t, 4> present_shape{1, decoder.num_key_value_heads, context_length_, decoder.head_size};
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    presents_[i] = CreateZeroed(present_shape);
+    if (input_index_ != ~0U) {
+      state_.inputs_[input_index_ + i] = pasts_[i].get();
+      state_.outputs_[output_index_ + i] = presents_[i].get();
+    }
+  }
+  window_size_ = window_size;
+  byte_count_.Set(TensorBytes(pasts_) + TensorBytes(presents_));
+}
+
+void KV_Cache_Windowed::SetWindowSize(size_t window_size) {
+  const auto& decoder = model_.config_->model.decoder;
+  const std::array<int64_t, 4> past_shape{1, decoder.num_key_value_heads, context_length_ - static_cast<int64_t>(window_size), decoder.head_size};
+  for (int i = 0; i < layer_count_ * 2; ++i)
+    pasts_[i] = CreateZeroed(past_shape);
+  SetTensors(window_size);
+}
+
+void KV_Cache_Windowed::Update(size_t past_length, size_t token_count, size_t next_window_size) {
+  const auto& decoder = model_.config_->model.decoder;
+  const size_t head_count = decoder.num_key_value_heads;
+  const size_t entry_bytes = decoder.head_size * SizeOf(type_);
+  const size_t past_slots = context_length_ - window_size_;
+  const size_t next_past_slots = context_length_ - next_window_size;
+  const size_t kept = std::min(past_length, next_past_slots);
+  const size_t added = std::min(past_length + token_count, next_past_slots) - kept;
+
+  for (int i = 0; i < layer_count_ * 2; ++i) {
+    // Between the prompt and the generation the pasts get more slots, then the kept entries are moved over once
+    if (next_window_size != window_size_) {
+      const std::array<int64_t, 4> past_shape{1, decoder.num_key_value_heads, static_cast<int64_t>(next_past_slots), decoder.head_size};
+      auto past = CreateZeroed(past_shape);
+      const auto* source = pasts_[i]->GetTensorData<uint8_t>();
+      auto* target = past->GetTensorMutableData<uint8_t>();
+      for (size_t head = 0; head < head_count; head++)
+        std::memcpy(target + head * next_past_slots * entry_bytes, source + head * past_slots * entry_bytes, kept * entry_bytes);
+      pasts_[i] = std::move(past);
+    }
+
+    const auto* present = presents_[i]->GetTensorData<uint8_t>();
+    auto* past = pasts_[i]->GetTensorMutableData<uint8_t>();
+    for (size_t head = 0; head < head_count; head++)
+      std::memcpy(past + (head * next_past_slots + kept) * entry_bytes, present + (head * context_length_ + past_slots) * entry_bytes, added * entry_bytes);
+  }
+
+  if (next_window_size != window_size_)
+    SetTensors(next_window_size);
+}
+
 }  // namespace Generators
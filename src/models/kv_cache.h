@@ -4,46 +4,173 @@
 
 namespace Generators {
 
+// Device buffer for a kv tensor that grows in fixed size blocks along the sequence dimension.
+// Tensors created on it are views, so as long as the requested sequence length fits in the blocks
+// already allocated there is no device allocation. Shapes are [batch_size * num_beams, num_heads, sequence_length, head_size]
+struct KV_BlockBuffer {
+  KV_BlockBuffer(OrtAllocator& allocator, int block_size);
+  KV_BlockBuffer(const KV_BlockBuffer&) = delete;
+  KV_BlockBuffer& operator=(const KV_BlockBuffer&) = delete;
+  KV_BlockBuffer(KV_BlockBuffer&& other) noexcept;
+  ~KV_BlockBuffer();
+
+  std::unique_ptr<OrtValue> CreateTensor(std::span<const int64_t> shape, ONNXTensorElementDataType type);
+
+  size_t GetBlockCount() const { return block_count_; }
+
+ private:
+  OrtAllocator* allocator_;
+  int block_size_;
+  void* buffer_{};
+  size_t bytes_{};
+  size_t block_count_{};
+};
+
+// A cache's share of State::kv_cache_bytes_, Model::kv_cache_bytes_ and Model::device_memory_budget_, which it gives
+// back when destroyed
+struct KV_ByteCount {
+  KV_ByteCount(const Model& model, State& state) : model_{model}, state_{state} {}
+  KV_ByteCount(const KV_ByteCount&) = delete;
+  KV_ByteCount& operator=(const KV_ByteCount&) = delete;
+  ~KV_ByteCount() { Set(0); }
+
+  void Set(size_t bytes);
+
+ private:
+  const Model& model_;
+  State& state_;
+  size_t bytes_{};
+};
+
+// Pinned host memory that the tensors of a kv cache are copied to while it's swapped out, see State::SwapOut. Only on CUDA
+struct KV_SwapBuffer {
+  KV_SwapBuffer(const Model& model, State& state) : model_{model}, state_{state} {}
+
+  // Copies the values one after another on the model's copy stream, after the work queued on the state's stream. Returns
+  // once they're copied, so they can be freed
+  void CopyOut(std::span<OrtValue* const> values);
+  // Queues the copies back into values, of the same shapes & order as the ones copied out. The state's stream waits for them
+  void CopyIn(std::span<OrtValue* const> values);
+  void Release();  // Frees the memory, before the next run
+
+ private:
+  const Model& model_;
+  State& state_;
+#if USE_CUDA
+  cuda_host_unique_ptr<uint8_t> buffer_;
+  std::unique_ptr<cuda_event_holder> event_;
+#endif
+};
+
 struct KV_Cache_Combined {
   KV_Cache_Combined(const Model& model, State& state);
 
   void Add();  // Add to state inputs/outputs
-  void Update(std::span<const int32_t> beam_indices, int current_length);
+  void Update(RoamingArray<int32_t> beam_indices, int current_length);  // beam_indices may stay on the device, see BeamSearch_Cuda
+  void Rewind(int length);  // Drops the present entries after the first 'length' sequence positions, before an Update()
+  void SwapOut();           // See KV_Cache::SwapOut
+  void SwapIn();
 
   template <typename ScoreType>
   void PickPastState(std::span<const int32_t> beam_indices, int index);
   void PickPastState(std::span<const int32_t> beam_indices, int index);
 
  private:
+#if USE_CUDA
+  void PickPastStatesOnDevice(RoamingArray<int32_t>& beam_indices);
+#endif
+
   const Model& model_;
   State& state_;
   int layer_count_;
   size_t input_index_{~0U}, output_index_{~0U};
 
+  // Like KV_Cache's, the presents are allocated for max_length once and are the pasts too. The attention then only takes
+  // how many of their entries are valid, as the past_sequence_length input
+  bool past_present_share_buffer_;
+  std::unique_ptr<OrtValue> past_sequence_length_;
+  size_t past_sequence_length_index_{~0U};
+
   std::array<int64_t, 5> shape_;
   ONNXTensorElementDataType type_;
 
   std::unique_ptr<OrtValue> empty_past_;
   std::vector<std::unique_ptr<OrtValue>> pasts_, presents_;
   std::vector<std::string> input_name_strings_, output_name_strings_;
+  KV_ByteCount byte_count_;
+  KV_SwapBuffer swap_buffer_{model_, state_};
+};
+
+// The kv caches of a decoder with static shapes, see DecoderOnly_WindowedState. The pasts are {1, num_kv_heads,
+// context_length - window_size, head_size} and the presents are the pasts followed by the window, {1, num_kv_heads,
+// context_length, head_size}. After every run the valid entries of the window are written in place into the pasts, right
+// after the past_length ones already there, so nothing is shifted or regrown from run to run
+struct KV_Cache_Windowed {
+  KV_Cache_Windowed(const Model& model, State& state);
+
+  void Add();
+  void SetWindowSize(size_t window_size);  // Before the first run
+  // After a run of token_count tokens with past_length entries in the pasts, moves them to the pasts of runs of
+  // next_window_size tokens. Entries past the end are dropped, a run with as many in its past can't happen anyway
+  void Update(size_t past_length, size_t token_count, size_t next_window_size);
+
+ private:
+  std::unique_ptr<OrtValue> CreateZeroed(std::span<const int64_t> shape) const;  // So empty slots never hold NaNs
+  void SetTensors(size_t window_size);
+
+  const Model& model_;
+  State& state_;
+  int layer_count_;
+  int64_t context_length_;
+  size_t input_index_{~0U}, output_index_{~0U};
+  size_t window_size_{};
+
+  ONNXTensorElementDataType type_;
+  std::vector<std::unique_ptr<OrtValue>> pasts_, presents_;
+  std::vector<std::string> input_name_strings_, output_name_strings_;
+  KV_ByteCount byte_count_;
 };
 
 struct KV_Cache {
   KV_Cache(const Model& model, State& state);
 
   void AddEncoder();  // If model has an initial encoder step, this is used
-  void Add();
-  void Update(std::span<const int32_t> beam_indices, int current_length);
+  void Add();         // After AddEncoder(), the pasts continue from the encoder step's presents
+  void Update(RoamingArray<int32_t> beam_indices, int current_length);  // beam_indices may stay on the device, see BeamSearch_Cuda
+
+  // Returns copies of the first 'length' sequence positions of every present, used to fill the PrefixCache
+  // For int8 kv caches they're followed by copies of the present scales
+  std::vector<std::unique_ptr<OrtValue>> CopyPresents(int length) const;
+  // Copies the first 'length' sequence positions of the presents of source, a single sequence's kv caches, into batch beam
+  // batch_beam_index of the presents
+  void CopyBatchEntry(const KV_Cache& source, int batch_beam_index, int length);
+  void Rewind(int length);  // Drops the present entries after the first 'length' sequence positions, before an Update()
+  void DropRows(std::span<const int32_t> rows);  // After an Update(), keeps only the given rows of the batch, in that order
   template <typename ScoreType>
   void PickPastState(std::span<const int32_t> beam_indices, int index);
   void PickPastState(std::span<const int32_t> beam_indices, int index);
 
+  // After a run, copies the presents (the whole cache) to pinned host memory on the model's copy stream and frees their
+  // device memory. SwapIn queues the copies back into new presents, the next run on the model's stream waits for them
+  void SwapOut();
+  void SwapIn();
+
  private:
+  // With past_present_share_buffer, the sequence length of the presents for sequences of up to length tokens. It is a
+  // multiple of search.kv_block_size when that's set, so a short sequence doesn't hold a max_length cache
+  int64_t GetSharedLength(int64_t length) const;
+  void GrowSharedPresents(int length);  // Moves the presents to bigger ones once GetSharedLength(length) outgrows them
+
+  // With past_present_share_buffer and beams, moves the first 'length' positions of each beam's presents to their new beams
+  void ReorderBeams(RoamingArray<int32_t>& beam_indices, int length);
+  void SetPastSequenceLength(int length);
+  void MoveEncoderPresents();  // Into the start of the shared presents
+
   const Model& model_;
   State& state_;
   int layer_count_;
   size_t input_index_{~0U}, output_index_{~0U};
-  bool past_present_share_buffer_;  // True if model.decoder.past_present_share_buffer is set to true, and we're using cuda, and not beam search
+  bool past_present_share_buffer_;  // True if the past_present_share_buffer search option is set, see GetSharedLength
 
   std::array<int64_t, 4> shape_;
   ONNXTensorElementDataType type_;
@@ -52,11 +179,51 @@ struct KV_Cache {
   std::vector<std::unique_ptr<OrtValue>> pasts_, presents_;
   std::vector<std::string> input_name_strings_, output_name_strings_;
   std::vector<StaticBuffer*> sb_kv_caches_;
+
+  // With past_present_share_buffer, models without an attention mask (like Whisper's decoder) take the valid entries of
+  // the presents as a past_sequence_length input, on the host
+  std::unique_ptr<OrtValue> past_sequence_length_;
+
+  // With past_present_share_buffer, the encoder step only outputs the prompt's entries, Add() moves them to the presents
+  std::vector<std::unique_ptr<OrtValue>> encoder_presents_;
+
+  // When search.kv_block_size is set, two block buffers per kv tensor that the past and present alternate between
+  std::vector<KV_BlockBuffer> block_buffers_;
+  std::vector<int> present_block_buffer_;  // Index (0 or 1) of the block buffer the present is currently on
+
+  // When search.kv_window_size is set, the past never holds more than window_length_ entries, the first sink_length_ of
+  // the sequence followed by the most recent ones. Set to 0 otherwise
+  int64_t sink_length_{};
+  int64_t window_length_{};
+
+  // With int8 kv caches, every past & present also has a scale per head, shape {batch_beams, num_kv_heads, 1, 1}
+  bool quantized_{};
+  size_t scale_input_index_{~0U}, scale_output_index_{~0U};
+  std::array<int64_t, 4> scale_shape_{};
+  ONNXTensorElementDataType scale_type_{};
+  std::unique_ptr<OrtValue> empty_past_scale_;
+  std::vector<std::unique_ptr<OrtValue>> past_scales_, present_scales_;
+  std::vector<std::string> scale_input_name_strings_, scale_output_name_strings_;
+  KV_ByteCount byte_count_;
+
+  KV_SwapBuffer swap_buffer_{model_, state_};  // Every present followed by every present scale, while swapped out
+
+  std::unique_ptr<OrtValue> CreatePresent(int index, OrtAllocator& allocator);  // allocator is used without block buffers
+  std::unique_ptr<OrtValue> CreatePast(int index);  // For a reordered past, on the block buffer the present isn't using
+#if USE_CUDA
+  void PickPastStatesOnDevice(RoamingArray<int32_t>& beam_indices);  // Every layer's PickPastState & PickPastScale in a few kernel launches
+#endif
+  std::unique_ptr<OrtValue> CopyPresent(int index, int length) const;
+  void PickPastScale(std::span<const int32_t> beam_indices, int index);
+  void UpdateByteCount();
+  void DropPastEntries();  // Shrinks the pasts to their sink entries followed by the most recent ones, window_length_ in all
 };
 
-// Very similar to the KV_Cache, but is only created once at the encoder step, then used without modification for every decoder step
+// Very similar to the KV_Cache, but is only created once at the encoder step, then used without modification for every decoder step.
+// With graph capture it's on the static buffers of the graph, so every replay reads it from the same place
 struct Cross_Cache {
-  Cross_Cache(const Model& model, State& state);
+  // encoder_sequence_length is the number of encoder frames the cross attention keys & values cover
+  Cross_Cache(const Model& model, State& state, int64_t encoder_sequence_length);
 
   void AddOutputs();
   void AddInputs();
@@ -71,5 +238,6 @@ struct Cross_Cache {
 
   std::vector<std::unique_ptr<OrtValue>> values_;
   std::vector<std::string> input_name_strings_, output_name_strings_;
+  KV_ByteCount byte_count_;
 };
 }  // namespace Generators
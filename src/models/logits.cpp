@@ -12,10 +12,11 @@ namespace Generators {
 Logits::Logits(const Model& model, State& state)
     : model_{model},
       state_{state},
-      shape_{static_cast<int64_t>(state_.params_->batch_size) * state_.params_->search.num_beams, state_.params_->sequence_length, state_.params_->vocab_size},
-      type_{model_.session_info_->GetOutputDataType(model_.config_->model.decoder.outputs.logits)} {
-  output_raw_ = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
-
+      shape_{static_cast<int64_t>(state_.params_->batch_size) * state_.params_->search.num_beams,
+             static_cast<int64_t>(state_.GetFirstRunEnd() - state_.GetCachedPrefixLength()), state_.params_->vocab_size},
+      type_{model_.session_info_->GetOutputDataType(model_.config_->model.decoder.outputs.logits)},
+      prompt_start_{state_.GetCachedPrefixLength()},
+      last_token_only_{model_.config_->model.decoder.last_token_logits} {
   if (state_.GetCapturedGraphInfo()) {
     if (type_ == Ort::TypeToTensorType<float>::type) {
       sb_logits32_ = state_.GetCapturedGraphInfo()->sb_logits32_.get();
@@ -25,11 +26,36 @@ Logits::Logits(const Model& model, State& state)
     }
   }
 
+  // The model already gathers the last token of every sequence, so even the prompt logits are {batch_beams, 1, vocab_size}
+  if (last_token_only_) {
+    shape_[1] = 1;
+    StaticBuffer* sb_logits = type_ == Ort::TypeToTensorType<Ort::Float16_t>::type ? sb_logits16_ : sb_logits32_;
+    output_raw_ = !sb_logits ? OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::Logits), shape_, type_)
+                             : sb_logits->CreateTensorOnStaticBuffer(shape_, type_);
+  } else if (auto* prompt_graph = state_.GetCapturedPromptGraph())
+    output_raw_ = prompt_graph->sb_logits_->CreateTensorOnStaticBuffer(shape_, type_);
+  else
+    output_raw_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::Logits), shape_, type_);
+
+  const auto& decoder = model_.config_->model.decoder;
+  if (decoder.draft_heads > 0) {
+    if (sb_logits16_ || sb_logits32_)
+      throw std::runtime_error("draft_heads don't support graph capture");
+    for (int i = 0; i < decoder.draft_heads; i++) {
+      draft_output_names_.push_back(FormatIndexedName(decoder.outputs.draft_logits_names, i));
+      if (!model_.session_info_->HasOutput(draft_output_names_.back()))
+        throw std::runtime_error("The decoder has no " + draft_output_names_.back() + " output for draft head " + std::to_string(i));
+    }
+    draft_outputs_.resize(decoder.draft_heads);
+    draft_outputs_fp32_.resize(decoder.draft_heads);
+    UpdateDraftOutputs();
+  }
+
 #if USE_CUDA
-  if (model_.device_type_ == DeviceType::CUDA && !model_.config_->model.eos_token_ids.empty()) {
-    auto& cpu_ids = model_.config_->model.eos_token_ids;
+  if (model_.device_type_ == DeviceType::CUDA && !state_.params_->eos_token_ids.empty()) {
+    auto cpu_ids = state_.params_->eos_token_ids;
     cuda_eos_token_ids_ptr_ = CudaMallocArray<int32_t>(cpu_ids.size(), &cuda_eos_token_ids_);
-    cudaMemcpyAsync(cuda_eos_token_ids_.data(), cpu_ids.data(), cpu_ids.size() * sizeof(int32_t), ::cudaMemcpyHostToDevice, model_.cuda_stream_);
+    cudaMemcpyAsync(cuda_eos_token_ids_.data(), cpu_ids.data(), cpu_ids.size() * sizeof(int32_t), ::cudaMemcpyHostToDevice, state_.cuda_stream_);
   }
 #endif
 }
@@ -38,8 +64,13 @@ Logits::Logits(const Model& model, State& state)
 #pragma warning(disable : 4189)  // local variable is initialized but not referenced
 
 RoamingArray<float> Logits::Get() {
+  TraceSpan span{"Logits::Get"};
   size_t element_count = shape_[0] * shape_[1] * shape_[2];
 
+  // The cuda search converts fp16 logits in its first pass over them instead, see Search::SetFp16Logits
+  const bool search_converts = model_.device_type_ == DeviceType::CUDA && !(g_log.enabled && g_log.model_logits);
+  bool converted_fp32{};  // The gather of the last token logits already wrote them to output_fp32_
+
   // First iteration? Then copy the logits over to a {batch_beams, 1, vocab_size} tensor
   // The model's output logits are {batch_size*num_beams, input_seq_len, vocab_size}
   OrtValue* logits_of_last_token = output_raw_.get();
@@ -52,13 +83,12 @@ RoamingArray<float> Logits::Get() {
     shape_[1] = 1;
 
     // create new OrtValue for logits_of_last_token and use output_last_tokens_ to hold it
-    output_last_tokens_ = OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_);
+    state_.ReleaseAfterQueuedWork(std::exchange(output_last_tokens_, OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::Logits), shape_, type_)));
     logits_of_last_token = output_last_tokens_.get();
 
-    size_t element_size = type_ == Ort::TypeToTensorType<float>::type ? 4 : 2;
-    size_t vocab_index = 0;  // Simpler math to have this index go up by vocab_size for every logit chunk we process
-
-    const auto* input_ids = state_.params_->input_ids.data();
+    // The element offset in output_raw_ of every batch beam row's last token logits, the last one before its padding
+    last_token_offsets_.resize(shape_[0]);
+    const auto* input_ids = state_.params_->input_ids.data() + prompt_start_;  // Logits only cover the prompt tokens of the last run
     for (int batch_index = 0; batch_index < state_.params_->batch_size; batch_index++) {
       // Find the first non pad token from the end
       size_t token_index = seq_length;
@@ -67,81 +97,115 @@ RoamingArray<float> Logits::Get() {
           break;
       }
 
-      for (int beam_index = 0; beam_index < num_beams; beam_index++) {
-        switch (model_.device_type_) {
-#if USE_DML
-          case DeviceType::DML: {
-            ComPtr<ID3D12Resource> source_resource;
-            Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, output_raw_->GetTensorMutableRawData(), &source_resource));
-
-            ComPtr<ID3D12Resource> target_resource;
-            Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, logits_of_last_token->GetTensorMutableRawData(), &target_resource));
-
-            uint64_t source_offset = (vocab_index * seq_length + token_index * vocab_size) * element_size;
-            uint64_t target_offset = vocab_index * element_size;
-            uint64_t size_in_bytes = vocab_size * element_size;
-
-            model_.GetDmlExecutionContext()->CopyBufferRegion(
-                target_resource.Get(),
-                target_offset,
-                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-                source_resource.Get(),
-                source_offset,
-                D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-                size_in_bytes);
-          } break;
-#endif
+      for (size_t beam_index = 0; beam_index < num_beams; beam_index++) {
+        const size_t row = batch_index * num_beams + beam_index;
+        last_token_offsets_[row] = static_cast<int64_t>((row * seq_length + token_index) * vocab_size);
+      }
+
+      input_ids += seq_length;
+    }
 
-          case DeviceType::CPU:
-          case DeviceType::CUDA: {
-            auto logits_raw = std::span<const uint8_t>{output_raw_->GetTensorMutableData<uint8_t>(), element_count * element_size};
-            auto logits_last_tokens = std::span<uint8_t>{logits_of_last_token->GetTensorMutableData<uint8_t>(), element_count_last_token * element_size};
-            auto target = logits_last_tokens.subspan(vocab_index * element_size, vocab_size * element_size);
-            auto source = logits_raw.subspan((vocab_index * seq_length + token_index * vocab_size) * element_size, vocab_size * element_size);
-            if (model_.device_type_ == DeviceType::CUDA)
+    const size_t element_size = SizeOf(type_);
+    switch (model_.device_type_) {
 #if USE_CUDA
-              CudaCheck() == cudaMemcpyAsync(target.data(), source.data(), source.size_bytes(), cudaMemcpyDeviceToDevice, state_.params_->cuda_stream);
-#else
-              throw std::runtime_error("Unexpected CUDA device usage");
+      case DeviceType::CUDA: {
+        // A single kernel gathers every row, and converts fp16 logits in the same pass when the search won't
+        if (cuda_last_token_offsets_.size() != last_token_offsets_.size())
+          cuda_last_token_offsets_ptr_ = CudaMallocArray<int64_t>(last_token_offsets_.size(), &cuda_last_token_offsets_);
+        CudaCheck() == cudaMemcpyAsync(cuda_last_token_offsets_.data(), last_token_offsets_.data(), last_token_offsets_.size() * sizeof(int64_t),
+                                       cudaMemcpyHostToDevice, state_.cuda_stream_);
+
+        const int rows = static_cast<int>(shape_[0]);
+        if (type_ == Ort::TypeToTensorType<float>::type) {
+          cuda::LaunchGatherLastTokenLogits(output_raw_->GetTensorData<float>(), cuda_last_token_offsets_.data(),
+                                            logits_of_last_token->GetTensorMutableData<float>(), nullptr,
+                                            rows, static_cast<int>(vocab_size), state_.cuda_stream_);
+        } else {
+          float* fp32 = nullptr;
+          if (!search_converts && run_rows_.empty()) {
+            if (!output_fp32_ || output_fp32_->GetTensorTypeAndShapeInfo()->GetElementCount() != element_count_last_token)
+              output_fp32_ = OrtValue::CreateTensor<float>(model_.GetDeviceAllocator(AllocationSite::Logits), shape_);
+            fp32 = output_fp32_->GetTensorMutableData<float>();
+            converted_fp32 = true;
+          }
+          cuda::LaunchGatherLastTokenLogits(output_raw_->GetTensorData<uint16_t>(), cuda_last_token_offsets_.data(),
+                                            logits_of_last_token->GetTensorMutableData<uint16_t>(), fp32,
+                                            rows, static_cast<int>(vocab_size), state_.cuda_stream_);
+        }
+      } break;
 #endif
-            else
-              copy(source, target);
-          } break;
+
+#if USE_DML
+      case DeviceType::DML: {
+        ComPtr<ID3D12Resource> source_resource;
+        Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, output_raw_->GetTensorMutableRawData(), &source_resource));
+
+        ComPtr<ID3D12Resource> target_resource;
+        Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, logits_of_last_token->GetTensorMutableRawData(), &target_resource));
+
+        // Recorded one after the other, and executed along with the cast or top k that follows
+        for (size_t row = 0; row < last_token_offsets_.size(); row++) {
+          model_.GetDmlExecutionContext()->CopyBufferRegion(
+              target_resource.Get(),
+              row * vocab_size * element_size,
+              D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+              source_resource.Get(),
+              last_token_offsets_[row] * element_size,
+              D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+              vocab_size * element_size);
         }
+      } break;
+#endif
 
-        vocab_index += vocab_size;
-      }
+      case DeviceType::CPU: {
+        auto logits_raw = std::span<const uint8_t>{output_raw_->GetTensorMutableData<uint8_t>(), element_count * element_size};
+        auto logits_last_tokens = std::span<uint8_t>{logits_of_last_token->GetTensorMutableData<uint8_t>(), element_count_last_token * element_size};
+        for (size_t row = 0; row < last_token_offsets_.size(); row++)
+          copy(logits_raw.subspan(last_token_offsets_[row] * element_size, vocab_size * element_size),
+               logits_last_tokens.subspan(row * vocab_size * element_size, vocab_size * element_size));
+      } break;
 
-      input_ids += seq_length;
+      default:
+        throw std::runtime_error("Unexpected device type for the last token logits");
     }
 
     element_count = shape_[0] * shape_[2];  // shape_[1] is now 1, so the element count must be updated
   }
 
-  // Convert from float16 to float32 if necessary
+  if (!run_rows_.empty()) {
+    if (!output_batch_)
+      output_batch_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::Logits), std::array<int64_t, 3>{static_cast<int64_t>(run_rows_.size()), 1, shape_[2]}, type_);
+    GatherRows(model_, logits_of_last_token->GetTensorRawData(), output_batch_->GetTensorMutableRawData(), run_rows_, SizeOf(type_) * shape_[2], state_.cuda_stream_);
+    logits_of_last_token = output_batch_.get();
+    element_count = run_rows_.size() * shape_[2];
+  }
+
+  // Convert from float16 to float32 if necessary, into the same output_fp32_ every step
   if (type_ == Ort::TypeToTensorType<Ort::Float16_t>::type) {
-    std::unique_ptr<OrtValue> logits_of_last_token_fp32;
-#if USE_DML
     if (model_.device_type_ == DeviceType::DML) {
+#if USE_DML
       DmlHelpers::DmlCastInputToOutput(
           model_.GetDmlExecutionContext(),
           *model_.allocator_device_,
           *logits_of_last_token,
-          logits_of_last_token_fp32,
+          output_fp32_,
           model_.GetDmlDevice(),
           model_.GetOrtDmlApi(),
           logits_cast_command_list_state_);
-    } else
 #endif
-      ConvertFp16ToFp32(*model_.allocator_device_, *logits_of_last_token, logits_of_last_token_fp32, model_.device_type_, model_.cuda_stream_);
-
-    output_last_tokens_ = std::move(logits_of_last_token_fp32);  // use output_last_tokens_ to hold the fp32 logits
-    logits_of_last_token = output_last_tokens_.get();
+    } else if (search_converts) {
+      if (!output_fp32_ || output_fp32_->GetTensorTypeAndShapeInfo()->GetElementCount() != element_count)
+        state_.ReleaseAfterQueuedWork(std::exchange(output_fp32_, OrtValue::CreateTensor<float>(model_.GetDeviceAllocator(AllocationSite::Logits), logits_of_last_token->GetTensorTypeAndShapeInfo()->GetShape())));
+      state_.pending_fp16_logits_ = logits_of_last_token->GetTensorData<uint16_t>();
+    } else if (!converted_fp32)
+      ConvertFp16ToFp32(model_.GetDeviceAllocator(AllocationSite::Logits), *logits_of_last_token, output_fp32_, model_.device_type_, state_.cuda_stream_);
+
+    logits_of_last_token = output_fp32_.get();
   }
 
 #if USE_DML
   // DML doesn't support on-device scoring yet, so we need to download some data to the CPU
-  if (model_.device_type_ == DeviceType::DML) {
+  if (model_.device_type_ == DeviceType::DML && !value32_cpu_) {
     value32_cpu_ = OrtValue::CreateTensor<float>(model_.allocator_cpu_, shape_);
   }
 #endif
@@ -150,19 +214,14 @@ RoamingArray<float> Logits::Get() {
 
 #if USE_CUDA
   if (model_.device_type_ == DeviceType::CUDA) {
-    auto batched_logits_gpu = gpu_span<float>{logits_of_last_token->GetTensorMutableData<float>(), element_count};
-    if (cuda_eos_token_ids_ptr_)
-      cuda::LaunchHandleEOSArray(
-          batched_logits_gpu.data(),
-          static_cast<int>(shape_[0]) /* batch_beam_size*/,
-          static_cast<int>(shape_[2]) /* vocab_size */,
-          cuda_eos_token_ids_.data(),
-          static_cast<int>(cuda_eos_token_ids_.size()),
-          model_.cuda_stream_);
-    return batched_logits_gpu;
+    // The eos tokens are handled by the search's logits processing, in the same pass as the rest of it
+    return {gpu_span<float>{logits_of_last_token->GetTensorMutableData<float>(), element_count}, state_.cuda_stream_};
   }
 #elif USE_DML
   if (model_.device_type_ == DeviceType::DML) {
+    if (size_t k = GetDeviceTopK())
+      return ReadbackTopK(*logits_of_last_token, k);
+
     // DML doesn't support on-device scoring yet, so we transfer the data to the CPU
     ComPtr<ID3D12Resource> gpu_resource;
     Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(
@@ -171,11 +230,14 @@ RoamingArray<float> Logits::Get() {
         &gpu_resource));
     auto cpu_tensor = value32_cpu_->GetTensorMutableData<float>();
 
-    model_.GetDmlReadbackHeap()->ReadbackFromGpu(
-        std::span(reinterpret_cast<uint8_t*>(cpu_tensor), element_count * sizeof(float)),
-        gpu_resource.Get(),
-        0,
-        D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    {
+      TraceSpan readback_span{"DmlReadbackHeap::ReadbackFromGpu"};
+      model_.GetDmlReadbackHeap()->ReadbackFromGpu(
+          std::span(reinterpret_cast<uint8_t*>(cpu_tensor), element_count * sizeof(float)),
+          gpu_resource.Get(),
+          0,
+          D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    }
 
     auto batched_logits_cpu = cpu_span<float>{cpu_tensor, element_count};
     HandleEOSArray(batched_logits_cpu);
@@ -190,33 +252,218 @@ RoamingArray<float> Logits::Get() {
 
 #pragma warning(pop)
 
+#if USE_DML
+// How many of the top logits of each row the search needs, or 0 if it needs all of them. Greedy search only needs the
+// top one and top k sampling the top k, as long as nothing changes the scores after Get()
+size_t Logits::GetDeviceTopK() const {
+  const auto& search = state_.params_->search;
+  if (search.num_beams != 1 || search.repetition_penalty != 1.0f || search.presence_penalty != 0.0f || search.frequency_penalty != 0.0f || search.no_repeat_ngram_size > 0 || search.min_length > 0 || !state_.params_->guidance_type.empty() || !state_.params_->row_search.empty() ||
+      !state_.params_->logits_processors.empty())
+    return 0;
+  if (g_log.enabled && g_log.model_logits)
+    return 0;  // The logged logits should be the model's
+
+  size_t k;
+  if (!search.do_sample || search.top_k == 1)
+    k = 1;
+  else if (search.top_k > 1 && !(search.top_p > 0.0f && search.top_p < 1.0f))
+    k = search.top_k;
+  else
+    return 0;  // Top p needs the softmax over the whole vocabulary
+
+  // HandleEOSArray merges the eos tokens into the primary one, so extra candidates keep the merged top k complete
+  const auto eos_token_ids = state_.params_->eos_token_ids;
+  if (!eos_token_ids.empty())
+    k += eos_token_ids.size() - 1;
+  return std::min(k, static_cast<size_t>(shape_[2]));
+}
+
+// Runs top k over the fp32 {batch_beams, 1, vocab_size} logits on the device, then reads back only the k values and
+// indices of each row. Every other logit of value32_cpu_ is set to the lowest float, so the search picks the same tokens
+cpu_span<float> Logits::ReadbackTopK(OrtValue& logits, size_t k) {
+  TraceSpan span{"Logits::ReadbackTopK"};
+  const size_t batch_beams = shape_[0];
+  const size_t vocab_size = shape_[2];
+
+  std::array<int64_t, 2> top_k_shape{static_cast<int64_t>(batch_beams), static_cast<int64_t>(k)};
+  if (!top_k_values_ || top_k_values_->GetTensorTypeAndShapeInfo()->GetShape()[1] != top_k_shape[1]) {
+    top_k_values_ = OrtValue::CreateTensor<float>(model_.GetDeviceAllocator(AllocationSite::Logits), top_k_shape);
+    top_k_indices_ = OrtValue::CreateTensor<uint32_t>(model_.GetDeviceAllocator(AllocationSite::Logits), top_k_shape);
+    top_k_values_cpu_.resize(batch_beams * k);
+    top_k_indices_cpu_.resize(batch_beams * k);
+    top_k_command_list_state_ = {};  // The operator is compiled for a single k
+  }
+
+  DmlHelpers::DmlTopK(
+      model_.GetDmlExecutionContext(),
+      *model_.allocator_device_,
+      logits,
+      *top_k_values_,
+      *top_k_indices_,
+      model_.GetDmlDevice(),
+      model_.GetOrtDmlApi(),
+      top_k_command_list_state_);
+
+  ComPtr<ID3D12Resource> values_resource;
+  Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, top_k_values_->GetTensorMutableRawData(), &values_resource));
+  ComPtr<ID3D12Resource> indices_resource;
+  Ort::ThrowOnError(model_.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model_.allocator_device_, top_k_indices_->GetTensorMutableRawData(), &indices_resource));
+
+  std::array<uint32_t, 2> sizes{static_cast<uint32_t>(top_k_values_cpu_.size() * sizeof(float)),
+                                static_cast<uint32_t>(top_k_indices_cpu_.size() * sizeof(uint32_t))};
+  std::array<ID3D12Resource*, 2> src{values_resource.Get(), indices_resource.Get()};
+  auto readback = model_.GetDmlReadbackHeap()->BeginReadbackFromGpu(sizes, src, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+
+  // Clear the CPU logits while the GPU runs the top k and the copies
+  auto batched_logits_cpu = cpu_span<float>{value32_cpu_->GetTensorMutableData<float>(), batch_beams * vocab_size};
+  std::fill(batched_logits_cpu.begin(), batched_logits_cpu.end(), std::numeric_limits<float>::lowest());
+
+  {
+    TraceSpan readback_span{"DmlReadbackHeap::EndReadbackFromGpu"};
+    std::array<void*, 2> dst{top_k_values_cpu_.data(), top_k_indices_cpu_.data()};
+    model_.GetDmlReadbackHeap()->EndReadbackFromGpu(readback, dst, sizes);
+  }
+
+  for (size_t row = 0; row < batch_beams; row++) {
+    auto logits_row = batched_logits_cpu.subspan(row * vocab_size, vocab_size);
+    for (size_t i = row * k; i < (row + 1) * k; i++)
+      logits_row[top_k_indices_cpu_[i]] = top_k_values_cpu_[i];
+  }
+
+  HandleEOSArray(batched_logits_cpu);
+  return batched_logits_cpu;
+}
+#endif
+
 void Logits::Update() {
   if (output_raw_.get()->GetTensorTypeAndShapeInfo()->GetShape()[1] == 1) {
     return;
   }
 
   StaticBuffer* sb_logits = type_ == Ort::TypeToTensorType<Ort::Float16_t>::type ? sb_logits16_ : sb_logits32_;
-  output_raw_ = !sb_logits ? OrtValue::CreateTensor(*model_.allocator_device_, shape_, type_)
-                           : sb_logits->CreateTensorOnStaticBuffer(shape_, type_);
+  state_.ReleaseAfterQueuedWork(std::exchange(output_raw_, !sb_logits ? OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::Logits), shape_, type_)
+                                                                       : sb_logits->CreateTensorOnStaticBuffer(shape_, type_)));
+  state_.outputs_[output_index_] = output_raw_.get();
+  UpdateDraftOutputs();
+}
+
+void Logits::UpdateDraftOutputs() {
+  const auto shape = output_raw_->GetTensorTypeAndShapeInfo()->GetShape();
+  for (size_t i = 0; i < draft_outputs_.size(); i++) {
+    if (draft_outputs_[i] && draft_outputs_[i]->GetTensorTypeAndShapeInfo()->GetShape() == shape)
+      continue;
+    state_.ReleaseAfterQueuedWork(std::exchange(draft_outputs_[i], OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::Logits), shape, type_)));
+    if (draft_output_index_ != ~0U)
+      state_.outputs_[draft_output_index_ + i] = draft_outputs_[i].get();
+  }
+}
+
+void Logits::AdvancePrompt(size_t start, size_t end) {
+  prompt_start_ = start;
+  if (last_token_only_)
+    return;  // Every run only outputs the logits of its last token, so the existing output is reused
+
+  // Get() changes shape_ to its single token output, so check the shape of the actual output
+  shape_[1] = end - start;
+  if (output_raw_->GetTensorTypeAndShapeInfo()->GetShape()[1] != shape_[1]) {
+    state_.ReleaseAfterQueuedWork(std::exchange(output_raw_, OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::Logits), shape_, type_)));
+    state_.outputs_[output_index_] = output_raw_.get();
+    UpdateDraftOutputs();
+  }
+}
+
+void Logits::CopyPromptEntry(const Logits& source, size_t batch_beam_index, size_t token_index) {
+  // Like Get(), the source logits are only copied when its last run had more than one token
+  const auto& source_logits = source.output_raw_->GetTensorTypeAndShapeInfo()->GetShape()[1] == 1 ? *source.output_raw_ : *source.output_last_tokens_;
+  const size_t bytes = shape_[2] * SizeOf(type_);
+  const size_t row = shape_[1] == 1 ? batch_beam_index : batch_beam_index * shape_[1] + token_index;
+  auto* target = output_raw_->GetTensorMutableData<uint8_t>() + row * bytes;
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    CudaCheck() == cudaMemcpyAsync(target, source_logits.GetTensorRawData(), bytes, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+    return;
+  }
+#endif
+  std::memcpy(target, source_logits.GetTensorRawData(), bytes);
+}
+
+void Logits::DropRows(std::span<const int32_t> batch_beam_indices) {
+  assert(shape_[1] == 1 && !sb_logits16_ && !sb_logits32_);
+  run_rows_.assign(state_.params_->BatchBeamSize(), 0);
+  for (size_t row = 0; row < batch_beam_indices.size(); row++)
+    run_rows_[batch_beam_indices[row]] = static_cast<int32_t>(row);
+
+  shape_[0] = static_cast<int64_t>(batch_beam_indices.size());
+  state_.ReleaseAfterQueuedWork(std::exchange(output_raw_, OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::Logits), shape_, type_)));
   state_.outputs_[output_index_] = output_raw_.get();
+  UpdateDraftOutputs();
+}
+
+RoamingArray<float> Logits::GetAll() {
+  TraceSpan span{"Logits::GetAll"};
+  return GetAllOf(*output_raw_, output_last_tokens_);  // use output_last_tokens_ to hold the fp32 logits
+}
+
+RoamingArray<float> Logits::GetDraftAll(size_t head) {
+  if (head >= draft_outputs_.size())
+    throw std::runtime_error("Draft head " + std::to_string(head) + " is past the decoder's draft_heads (" + std::to_string(draft_outputs_.size()) + ")");
+  return GetAllOf(*draft_outputs_[head], draft_outputs_fp32_[head]);
+}
+
+RoamingArray<float> Logits::GetAllOf(OrtValue& logits_raw, std::unique_ptr<OrtValue>& logits_fp32) {
+  // The draft outputs of the prompt run keep every token, even once Get() has gathered the last token logits
+  const size_t element_count = logits_raw.GetTensorTypeAndShapeInfo()->GetElementCount();
+  OrtValue* logits = &logits_raw;
+
+  if (type_ == Ort::TypeToTensorType<Ort::Float16_t>::type) {
+    std::unique_ptr<OrtValue> converted;
+    ConvertFp16ToFp32(model_.GetDeviceAllocator(AllocationSite::Logits), *logits, converted, model_.device_type_, state_.cuda_stream_);
+    logits_fp32 = std::move(converted);
+    logits = logits_fp32.get();
+  }
+
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    auto batched_logits_gpu = gpu_span<float>{logits->GetTensorMutableData<float>(), element_count};
+    if (cuda_eos_token_ids_ptr_)
+      cuda::LaunchHandleEOSArray(
+          batched_logits_gpu.data(),
+          static_cast<int>(element_count / shape_[2]) /* every token of every batch_beam */,
+          static_cast<int>(shape_[2]) /* vocab_size */,
+          cuda_eos_token_ids_.data(),
+          static_cast<int>(cuda_eos_token_ids_.size()),
+          state_.cuda_stream_);
+    return {batched_logits_gpu, state_.cuda_stream_};
+  }
+#endif
+  if (model_.device_type_ == DeviceType::DML)
+    throw std::runtime_error("Logits of every token are not supported on DML");
+
+  auto batched_logits_cpu = cpu_span<float>{logits->GetTensorMutableData<float>(), element_count};
+  HandleEOSArray(batched_logits_cpu);
+  return batched_logits_cpu;
 }
 
 void Logits::HandleEOSArray(cpu_span<float> batched_logits) {
-  if (model_.config_->model.eos_token_ids.empty())
+  MergeEOSLogits(*state_.params_, batched_logits, shape_[2]);
+}
+
+void MergeEOSLogits(const GeneratorParams& params, cpu_span<float> batched_logits, size_t vocab_size) {
+  const auto eos_token_ids = params.eos_token_ids;
+  if (eos_token_ids.empty())
     return;
 
-  const size_t vocab_size = shape_[2];
   size_t vocab_index = 0;  // Simpler math to have this index go up by vocab_size for every logit chunk we process
 
-  for (int index = 0; index < shape_[0]; index++) {
+  for (size_t index = 0; index < batched_logits.size() / vocab_size; index++) {
     auto logits = batched_logits.subspan(vocab_index, vocab_size);
     float max = std::numeric_limits<float>::lowest();
-    for (auto id : model_.config_->model.eos_token_ids) {
+    for (auto id : eos_token_ids) {
       max = std::max(max, logits[id]);
       logits[id] = std::numeric_limits<float>::lowest();  // Set all EOS token options to never happen (the first will get the max of all)
     }
 
-    logits[model_.config_->model.eos_token_id] = max;  // Set the score of the primary EOS token to the highest of any of the EOS tokens
+    logits[params.eos_logits_index] = max;  // Set the score of the primary EOS token to the highest of any of the EOS tokens
     vocab_index += vocab_size;
   }
 }
@@ -226,6 +473,12 @@ void Logits::Add() {
 
   state_.output_names_.push_back(model_.config_->model.decoder.outputs.logits.c_str());
   state_.outputs_.push_back(output_raw_.get());
+
+  draft_output_index_ = state_.outputs_.size();
+  for (size_t i = 0; i < draft_outputs_.size(); i++) {
+    state_.output_names_.push_back(draft_output_names_[i].c_str());
+    state_.outputs_.push_back(draft_outputs_[i].get());
+  }
 }
 
 }  // namespace Generators
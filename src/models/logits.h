@@ -6,16 +6,36 @@
 
 namespace Generators {
 
+// Gives the primary eos token of every row the highest logit of any of the eos tokens, and the other eos tokens the lowest
+void MergeEOSLogits(const GeneratorParams& params, cpu_span<float> batched_logits, size_t vocab_size);
+
 struct Logits {
   Logits(const Model& model, State& state);
 
   void Add();
   RoamingArray<float> Get();
+  RoamingArray<float> GetAll();  // Logits of every token of the last run, {batch_beams * sequence_length, vocab_size}, for speculative decoding
+  RoamingArray<float> GetDraftAll(size_t head);  // Like GetAll, of one of the decoder's draft_heads
 
   void Update();
+  void AdvancePrompt(size_t start, size_t end);  // Switch to the logits of tokens [start, end) for a multi token run (a chunked prefill or speculative decoding)
+
+  // Before the first Get(), copies the last token logits of source, a single sequence's after its Get(), to where the
+  // prompt logits of batch beam batch_beam_index have its last token token_index
+  void CopyPromptEntry(const Logits& source, size_t batch_beam_index, size_t token_index);
+
+  // Runs from now on are only for the given batch beam entries, in that order. Get() still returns the logits of every
+  // entry, the dropped ones get those of the first row run, as the search only pads them
+  void DropRows(std::span<const int32_t> batch_beam_indices);
 
  private:
   void HandleEOSArray(cpu_span<float> logits);
+  RoamingArray<float> GetAllOf(OrtValue& logits, std::unique_ptr<OrtValue>& logits_fp32);
+  void UpdateDraftOutputs();  // Gives the draft head outputs the shape of output_raw_
+#if USE_DML
+  size_t GetDeviceTopK() const;
+  cpu_span<float> ReadbackTopK(OrtValue& logits, size_t k);
+#endif
 
   const Model& model_;
   State& state_;
@@ -23,13 +43,27 @@ struct Logits {
 
   std::array<int64_t, 3> shape_{};
   ONNXTensorElementDataType type_;
+  size_t prompt_start_{};  // Index of the first prompt token the prompt logits are for
+  bool last_token_only_{};  // The model only outputs the logits of the last token, see Config::Model::Decoder::last_token_logits
 
   // Tensor to keep the logits of the last tokens. It is used in the 2 cases below. Otherwhise, it is not used.
   // 1. prompt: store the last tokens logits from output_raw_
-  // 2. token gen: store the converted fp32 logits if output_raw_ is fp16.
+  // 2. GetAll: store the converted fp32 logits if output_raw_ is fp16.
   std::unique_ptr<OrtValue> output_last_tokens_;
 
   std::unique_ptr<OrtValue> output_raw_;  // Raw logits output from model
+  std::unique_ptr<OrtValue> output_fp32_;  // The fp32 last token logits of fp16 models, reused every step
+  std::vector<int64_t> last_token_offsets_;  // Element offset in output_raw_ of every row's last token logits, for a multi token run
+
+  // The outputs of the draft heads, each the shape of output_raw_, and their fp32 conversions for GetDraftAll
+  size_t draft_output_index_{~0U};
+  std::vector<std::string> draft_output_names_;
+  std::vector<std::unique_ptr<OrtValue>> draft_outputs_;
+  std::vector<std::unique_ptr<OrtValue>> draft_outputs_fp32_;
+
+  // Once rows are dropped, the row of the run each batch beam entry gets its logits from, and the logits of every entry
+  std::vector<int32_t> run_rows_;
+  std::unique_ptr<OrtValue> output_batch_;
 
   // Used for decoding runs with cuda graphs.
   StaticBuffer* sb_logits32_{};
@@ -38,11 +72,19 @@ struct Logits {
 #if USE_CUDA
   cuda_unique_ptr<int32_t> cuda_eos_token_ids_ptr_;  // eos_token_ids from params, but in cuda accessible memory
   gpu_span<int32_t> cuda_eos_token_ids_;
+  cuda_unique_ptr<int64_t> cuda_last_token_offsets_ptr_;  // last_token_offsets_ on the device, for the gather kernel
+  gpu_span<int64_t> cuda_last_token_offsets_;
 #endif
 
 #if USE_DML
   DmlReusedCommandListState logits_cast_command_list_state_{};
   std::unique_ptr<OrtValue> value32_cpu_;
+
+  // When the search only needs the top k logits of each row, they're picked on the device and only they are read back
+  DmlReusedCommandListState top_k_command_list_state_{};
+  std::unique_ptr<OrtValue> top_k_values_, top_k_indices_;  // {batch_beams, k} on the device
+  std::vector<float> top_k_values_cpu_;
+  std::vector<uint32_t> top_k_indices_cpu_;
 #endif
 };
 
@@ -1,13 +1,19 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 #include <algorithm>
+#include <random>
 #include <thread>
 
 #include "../generators.h"
 #include "../search.h"
+#include "../float16.h"
+#include "../constrained_decoding.h"
+#include "../cpu_affinity.h"
+#include "../thread_pool.h"
 #include "model.h"
 #include "gpt.h"
 #include "decoder_only.h"
+#include "decoder_pipeline.h"
 #include "whisper.h"
 #include "kernels.h"
 #include "multi_modal_vision_model.h"
@@ -38,19 +44,75 @@ namespace Generators {
 
 State::State(const GeneratorParams& params, const Model& model)
     : params_{params.shared_from_this()},
-      model_{model} {}
+      run_options_{OrtRunOptions::Create()},
+      cuda_stream_{params.cuda_stream},
+      model_{model} {
+  if (model.device_type_ != DeviceType::DML) {
+    for (auto& arena : step_arenas_)
+      arena = std::make_unique<StepArena>(model.GetDeviceAllocator(AllocationSite::StepArena));
+  }
+}
+
+State::~State() {
+#if USE_CUDA
+  if (!pending_releases_.empty() || !queued_releases_.empty())
+    cudaStreamSynchronize(cuda_stream_);
+#endif
+}
+
+void State::ReleaseAfterQueuedWork([[maybe_unused]] std::unique_ptr<OrtValue> value) {
+#if USE_CUDA
+  if (value && model_.device_type_ == DeviceType::CUDA)
+    pending_releases_.push_back(std::move(value));
+#endif
+}
+
+#if USE_CUDA
+void State::QueueReleases() {
+  queued_releases_.erase(std::remove_if(queued_releases_.begin(), queued_releases_.end(), [](auto& queued) { return cudaEventQuery(*queued.first) == cudaSuccess; }), queued_releases_.end());
+  if (pending_releases_.empty())
+    return;
+  auto& queued = queued_releases_.emplace_back(std::make_unique<cuda_event_holder>(cudaEventDisableTiming), std::move(pending_releases_));
+  cudaEventRecord(*queued.first, cuda_stream_);
+  pending_releases_.clear();
+}
+#endif
+
+void State::ReleaseBinding() {
+  io_binding_.reset();
+  bound_session_ = nullptr;
+}
+
+void State::ReleaseStepArenas() {
+  // The binding keeps the tensors it was last given alive, which would hold on to the memory being given up
+  ReleaseBinding();
+  if (step_arenas_[0]) {
+    for (auto& arena : step_arenas_)
+      arena->Release();
+  }
+}
+
+OrtAllocator& State::GetStepAllocator() {
+  if (!step_arenas_[0])
+    return model_.GetDeviceAllocator(AllocationSite::StepArena);
+  return *step_arenas_[step_arena_index_];
+}
 
 void State::Run(OrtSession& session, OrtRunOptions& run_options, int new_batch_size) {
+  TraceSpan span{"State::Run"};
   if (first_run_) {
-    if (params_->use_cuda_graph) {
-      model_.run_options_->AddConfigEntry("gpu_graph_id", "-1");
+    if (auto* prompt_graph = GetCapturedPromptGraph()) {
+      auto annotation_id = std::to_string(prompt_graph->GenerateUniqueAnnotationID(new_batch_size));
+      run_options_->AddConfigEntry("gpu_graph_id", annotation_id.c_str());
+    } else if (params_->use_cuda_graph) {
+      run_options_->AddConfigEntry("gpu_graph_id", "-1");
     }
     first_run_ = false;
   } else if (params_->use_cuda_graph && new_batch_size != current_batch_size_) {
     assert(GetCapturedGraphInfo() != nullptr);
     current_batch_size_ = new_batch_size;
     auto annotation_id = std::to_string(GetCapturedGraphInfo()->GenerateUniqueAnnotationID(new_batch_size));
-    model_.run_options_->AddConfigEntry("gpu_graph_id", annotation_id.c_str());
+    run_options_->AddConfigEntry("gpu_graph_id", annotation_id.c_str());
   }
 
   if (g_log.enabled && g_log.model_input_values) {
@@ -65,7 +127,52 @@ void State::Run(OrtSession& session, OrtRunOptions& run_options, int new_batch_s
     DumpTensors(stream, outputs_.data(), output_names_.data(), output_names_.size(), false);
   }
 
-  session.Run(&run_options, input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data(), outputs_.data(), output_names_.size());
+#if USE_CUDA
+  // ORT takes one compute stream per session, so the run goes on the model's stream after what the state queued on its
+  // own, and the state's work after it waits for the run. Other generators' work on the model's stream isn't waited for
+  const bool own_stream = cuda_stream_ && cuda_stream_ != model_.cuda_stream_.get();
+  if (own_stream) {
+    if (!run_event_)
+      run_event_ = std::make_unique<cuda_event_holder>(cudaEventDisableTiming);
+    cudaEventRecord(*run_event_, cuda_stream_);
+    cudaStreamWaitEvent(model_.cuda_stream_, *run_event_);
+  }
+#endif
+
+#if USE_DML
+  // The step's own work on the command queue (the input updates, copies and casts) is submitted as one bundle, which
+  // ORT's work on the same queue then follows
+  if (model_.device_type_ == DeviceType::DML)
+    model_.GetDmlExecutionContext()->Flush();
+#endif
+
+  {
+    TraceSpan span{"OrtSession::Run"};
+    // Outputs left unset are allocated by ORT, which only the name & value arrays can hand back
+    if (std::find(outputs_.begin(), outputs_.end(), nullptr) != outputs_.end())
+      session.Run(&run_options, input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data(), outputs_.data(), output_names_.size());
+    else
+      session.Run(&run_options, Bind(session));
+  }
+
+#if USE_CUDA
+  if (own_stream) {
+    cudaEventRecord(*run_event_, model_.cuda_stream_);
+    cudaStreamWaitEvent(cuda_stream_, *run_event_);
+  }
+  QueueReleases();
+#endif
+
+  // The other arena's tensors were created before the previous run, so nothing uses them anymore. On CUDA the next
+  // step only writes to them on a stream ordered after this run
+  if (step_arenas_[0]) {
+    step_arena_index_ ^= 1;
+    step_arenas_[step_arena_index_]->Reset();
+  }
+
+  model_.run_count_++;
+  if (g_log.enabled && g_log.trace)
+    model_.TraceAllocations();
 
   if (g_log.enabled && g_log.model_output_values) {
     auto& stream = Log("model_output_values");
@@ -83,6 +190,49 @@ OrtValue* State::GetOutput(const char* name) {
   return nullptr;
 }
 
+State::BoundValue State::BoundValue::Of(const OrtValue* value) {
+  return {value, value->GetTensorRawData(), value->GetTensorTypeAndShapeInfo()->GetShape()};
+}
+
+// A value is rebound when the state points at another OrtValue, or when a new OrtValue took the place of the bound one
+// with other memory or another shape (the binding holds on to the tensor of the old one, not to the pointer)
+OrtIoBinding& State::Bind(OrtSession& session) {
+  TraceSpan span{"State::Bind"};
+  if (bound_session_ != &session || bound_input_names_ != input_names_ || bound_output_names_ != output_names_) {
+    io_binding_ = OrtIoBinding::Create(session);
+    bound_session_ = &session;
+    bound_input_names_ = input_names_;
+    bound_output_names_ = output_names_;
+    bound_inputs_.clear();
+    bound_outputs_.clear();
+    for (size_t i = 0; i < inputs_.size(); i++) {
+      io_binding_->BindInput(input_names_[i], *inputs_[i]);
+      bound_inputs_.push_back(BoundValue::Of(inputs_[i]));
+    }
+    for (size_t i = 0; i < outputs_.size(); i++) {
+      io_binding_->BindOutput(output_names_[i], *outputs_[i]);
+      bound_outputs_.push_back(BoundValue::Of(outputs_[i]));
+    }
+    return *io_binding_;
+  }
+
+  for (size_t i = 0; i < inputs_.size(); i++) {
+    auto current = BoundValue::Of(inputs_[i]);
+    if (current != bound_inputs_[i]) {
+      io_binding_->BindInput(input_names_[i], *inputs_[i]);
+      bound_inputs_[i] = std::move(current);
+    }
+  }
+  for (size_t i = 0; i < outputs_.size(); i++) {
+    auto current = BoundValue::Of(outputs_[i]);
+    if (current != bound_outputs_[i]) {
+      io_binding_->BindOutput(output_names_[i], *outputs_[i]);
+      bound_outputs_[i] = std::move(current);
+    }
+  }
+  return *io_binding_;
+}
+
 void State::ClearIO() {
   input_names_.clear();
   output_names_.clear();
@@ -131,12 +281,64 @@ TokenizerStream::TokenizerStream(const Tokenizer& tokenizer)
 const std::string& TokenizerStream::Decode(int32_t token) {
   const char* string;
   CheckResult(OrtxDetokenizeCached(tokenizer_->tokenizer_, cache_, token, &string));
-  chunk_ = string;
+  chunk_.assign(pending_).append(string);
+  pending_.clear();
   return chunk_;
 }
 
-Tokenizer::Tokenizer(Config& config) : pad_token_id_{config.model.pad_token_id} {
+void TokenizerStream::DecodeNext(std::span<TokenizerStream* const> streams, std::span<const int32_t> tokens, std::span<char> buffer, std::span<size_t> offsets) {
+  TraceSpan span{"TokenizerStream::DecodeNext"};
+  if (tokens.size() != streams.size())
+    throw std::runtime_error("DecodeNext needs one token per stream, got " + std::to_string(tokens.size()) + " for " + std::to_string(streams.size()) + " streams");
+  if (offsets.size() != streams.size() + 1)
+    throw std::runtime_error("DecodeNext needs the stream count + 1 offsets, got " + std::to_string(offsets.size()));
+
+  // Everything that can throw is done before a chunk is written and taken out of its stream, so on an error every chunk
+  // is still in its stream for the next call
+  for (size_t i = 0; i < streams.size(); i++) {
+    auto& stream = *streams[i];
+    if (tokens[i] != -1) {
+      const char* string;
+      CheckResult(OrtxDetokenizeCached(stream.tokenizer_->tokenizer_, stream.cache_, tokens[i], &string));
+      stream.pending_.append(string);
+    }
+  }
+  for (auto* stream : streams) {
+    if (stream->pending_.size() > buffer.size())
+      throw std::runtime_error("DecodeNext buffer of " + std::to_string(buffer.size()) + " bytes is smaller than a chunk of " + std::to_string(stream->pending_.size()) + ", it stays in its stream for a call with a larger buffer");
+  }
+
+  size_t offset = 0;
+  for (size_t i = 0; i < streams.size(); i++) {
+    auto& stream = *streams[i];
+    offsets[i] = offset;
+    if (stream.pending_.size() <= buffer.size() - offset) {
+      std::memcpy(buffer.data() + offset, stream.pending_.data(), stream.pending_.size());
+      offset += stream.pending_.size();
+      stream.pending_.clear();
+    }
+  }
+  offsets[streams.size()] = offset;
+}
+
+Tokenizer::Tokenizer(Config& config)
+    : pad_token_id_{config.model.pad_token_id},
+      cache_size_{static_cast<size_t>(std::max(config.model.tokenizer_cache_size, 0))} {
   CheckResult(OrtxCreateTokenizer(tokenizer_.Address(), config.config_path.string().c_str()));
+  leading_tokens_ = EncodeUncached("");
+}
+
+void Tokenizer::AddExternalOwner() {
+  std::lock_guard<std::mutex> lock{external_owner_mutex_};
+  if (external_owner_count_++ == 0)
+    external_owner_ = shared_from_this();
+}
+
+void Tokenizer::ReleaseExternalOwner() {
+  std::shared_ptr<Tokenizer> last_owner;  // Released after the lock, as it can be what keeps the mutex alive
+  std::lock_guard<std::mutex> lock{external_owner_mutex_};
+  if (--external_owner_count_ == 0)
+    last_owner = std::move(external_owner_);
 }
 
 std::unique_ptr<TokenizerStream> Tokenizer::CreateStream() const {
@@ -144,6 +346,51 @@ std::unique_ptr<TokenizerStream> Tokenizer::CreateStream() const {
 }
 
 std::vector<int32_t> Tokenizer::Encode(const char* text) const {
+  if (cache_size_ == 0)
+    return EncodeUncached(text);
+
+  const std::string_view key{text};
+  {
+    std::lock_guard<std::mutex> lock{cache_mutex_};
+    auto it = cache_lookup_.find(key);
+    if (it != cache_lookup_.end()) {
+      cache_.splice(cache_.begin(), cache_, it->second);
+      return it->second->second;
+    }
+  }
+
+  // Encoded without the lock, so a string another thread is encoding too is only stored once
+  auto tokens = EncodeUncached(text);
+  std::lock_guard<std::mutex> lock{cache_mutex_};
+  if (cache_lookup_.count(key))
+    return tokens;
+  cache_.emplace_front(std::string{key}, tokens);
+  cache_lookup_.emplace(cache_.front().first, cache_.begin());
+  if (cache_.size() > cache_size_) {
+    cache_lookup_.erase(cache_.back().first);
+    cache_.pop_back();
+  }
+  return tokens;
+}
+
+std::unique_ptr<Tokenizer::EncodedPrefix> Tokenizer::EncodePrefix(const char* prefix) const {
+  return std::make_unique<EncodedPrefix>(EncodedPrefix{Encode(prefix)});
+}
+
+std::vector<int32_t> Tokenizer::EncodeWithPrefix(const EncodedPrefix& prefix, const char* suffix) const {
+  auto suffix_tokens = Encode(suffix);
+  const bool has_leading_tokens = suffix_tokens.size() >= leading_tokens_.size() &&
+                                  std::equal(leading_tokens_.begin(), leading_tokens_.end(), suffix_tokens.begin());
+
+  std::vector<int32_t> tokens;
+  tokens.reserve(prefix.tokens.size() + suffix_tokens.size());
+  tokens.insert(tokens.end(), prefix.tokens.begin(), prefix.tokens.end());
+  tokens.insert(tokens.end(), suffix_tokens.begin() + (has_leading_tokens ? leading_tokens_.size() : 0), suffix_tokens.end());
+  return tokens;
+}
+
+std::vector<int32_t> Tokenizer::EncodeUncached(const char* text) const {
+  TraceSpan span{"Tokenizer::Encode"};
   OrtxPtr<OrtxTokenId2DArray> ids;
   CheckResult(OrtxTokenize(tokenizer_, &text, 1, ids.Address()));
 
@@ -154,6 +401,7 @@ std::vector<int32_t> Tokenizer::Encode(const char* text) const {
 }
 
 std::string Tokenizer::Decode(std::span<const int32_t> tokens) const {
+  TraceSpan span{"Tokenizer::Decode"};
   OrtxPtr<OrtxStringArray> ortx_string_array;
   CheckResult(OrtxDetokenize1D(tokenizer_, reinterpret_cast<const uint32_t*>(tokens.data()), tokens.size(), ortx_string_array.Address()));
 
@@ -163,23 +411,54 @@ std::string Tokenizer::Decode(std::span<const int32_t> tokens) const {
 }
 
 std::vector<int32_t> Tokenizer::EncodeBatch(std::span<const std::string> strings) const {
-  std::vector<std::vector<int32_t>> sequences;
-  std::vector<std::span<const int32_t>> span_sequences;
-  for (size_t i = 0; i < strings.size(); i++) {
-    sequences.emplace_back(Encode(strings[i].c_str()));
-    span_sequences.emplace_back(sequences.back());
-  }
+  TraceSpan span{"Tokenizer::EncodeBatch"};
+  // The strings are tokenized in chunks on the thread pool, a few chunks per thread to even out the string lengths
+  auto& thread_pool = GetThreadPool();
+  const size_t chunk_size = std::max<size_t>(1, strings.size() / (thread_pool.GetThreadCount() * 4));
+  const size_t chunk_count = (strings.size() + chunk_size - 1) / chunk_size;
+
+  // The token arrays stay with the tokenizer's results until they're copied into the padded inputs
+  std::vector<OrtxPtr<OrtxTokenId2DArray>> chunk_ids(chunk_count);
+  std::vector<std::span<const int32_t>> sequences(strings.size());
+  thread_pool.ParallelFor(chunk_count, [&](size_t chunk, size_t /*thread_index*/) {
+    const size_t start = chunk * chunk_size;
+    const size_t count = std::min(chunk_size, strings.size() - start);
+    std::vector<const char*> texts(count);
+    for (size_t i = 0; i < count; i++)
+      texts[i] = strings[start + i].c_str();
+    CheckResult(OrtxTokenize(tokenizer_, texts.data(), count, chunk_ids[chunk].Address()));
+
+    for (size_t i = 0; i < count; i++) {
+      const extTokenId_t* tokens;
+      size_t token_count;
+      CheckResult(OrtxTokenId2DArrayGetItem(chunk_ids[chunk], i, &tokens, &token_count));
+      sequences[start + i] = {reinterpret_cast<const int32_t*>(tokens), token_count};
+    }
+  });
+
+  size_t max_length = 0;
+  for (auto& sequence : sequences)
+    max_length = std::max(max_length, sequence.size());
 
-  return PadInputs(span_sequences, pad_token_id_);
+  // Same layout as PadInputs, each sequence padded on the right to the longest one
+  std::vector<int32_t> result(max_length * sequences.size());
+  thread_pool.ParallelFor(sequences.size(), [&](size_t i, size_t /*thread_index*/) {
+    auto* output = result.data() + i * max_length;
+    std::copy(sequences[i].begin(), sequences[i].end(), output);
+    std::fill(output + sequences[i].size(), output + max_length, pad_token_id_);
+  });
+  return result;
 }
 
 std::vector<std::string> Tokenizer::DecodeBatch(std::span<const int32_t> sequences, size_t count) const {
+  TraceSpan span{"Tokenizer::DecodeBatch"};
   if (sequences.size() % count != 0)
     throw std::runtime_error("DecodeBatch: sequences must be evenly divisible by the count");
   size_t sequence_length = sequences.size() / count;
-  std::vector<std::string> strings;
-  for (size_t i = 0; i < count; i++)
-    strings.emplace_back(Decode(sequences.subspan(sequence_length * i, sequence_length)));
+  std::vector<std::string> strings(count);
+  GetThreadPool().ParallelFor(count, [&](size_t i, size_t /*thread_index*/) {
+    strings[i] = Decode(sequences.subspan(sequence_length * i, sequence_length));
+  });
   return strings;
 }
 
@@ -188,16 +467,34 @@ std::vector<std::string> Tokenizer::DecodeBatch(std::span<const int32_t> sequenc
 // the allocator used is not destroyed until last. This keeps the allocator around until exit, after all other memory
 // has been destroyed. Without this, we will crash in the Onnxruntime BFCArena code when deleting tensors due to the
 // arena already being destroyed.
-Ort::Allocator* GetCudaAllocator(OrtSession& session) {
+Ort::Allocator* GetCudaAllocator(OrtSession& session, int device_id) {
   auto& globals = *GetOrtGlobals();
-  if (!globals.allocator_cuda_) {
-    globals.memory_info_cuda_ = OrtMemoryInfo::Create("Cuda", OrtAllocatorType::OrtDeviceAllocator, 0, OrtMemType::OrtMemTypeDefault);
-    globals.allocator_cuda_ = Ort::Allocator::Create(session, *globals.memory_info_cuda_);
+  if (globals.allocator_cuda_.size() <= static_cast<size_t>(device_id)) {
+    globals.memory_info_cuda_.resize(device_id + 1);
+    globals.allocator_cuda_.resize(device_id + 1);
+  }
+  if (!globals.allocator_cuda_[device_id]) {
+#if USE_ROCM
+    constexpr const char* device_name = "Hip";  // The ROCm provider's name for device memory
+#else
+    constexpr const char* device_name = "Cuda";
+#endif
+    globals.memory_info_cuda_[device_id] = OrtMemoryInfo::Create(device_name, OrtAllocatorType::OrtDeviceAllocator, device_id, OrtMemType::OrtMemTypeDefault);
+    globals.allocator_cuda_[device_id] = Ort::Allocator::Create(session, *globals.memory_info_cuda_[device_id]);
   }
-  return globals.allocator_cuda_.get();
+  return globals.allocator_cuda_[device_id].get();
 }
 #endif
 
+// The first of the environment variables that's set, as set by Open MPI, MPICH / Intel MPI, Slurm or torchrun
+static std::optional<int> GetLauncherValue(std::initializer_list<const char*> names) {
+  for (auto* name : names) {
+    if (const char* value = std::getenv(name))
+      return std::stoi(value);
+  }
+  return std::nullopt;
+}
+
 SessionInfo::SessionInfo(OrtSession& session) {
   Add(session);
 }
@@ -243,20 +540,141 @@ ONNXTensorElementDataType SessionInfo::GetOutputDataType(const std::string& name
   return result->second;
 }
 
-Model::Model(std::unique_ptr<Config> config) : config_{std::move(config)} {
-  // TODO: add function to create run options
-  run_options_ = OrtRunOptions::Create();
-
+Model::Model(std::unique_ptr<Config> config)
+    : config_{std::move(config)},
+      device_memory_budget_{std::make_shared<DeviceMemoryBudget>(static_cast<size_t>(config_->model.device_memory_budget_mb) << 20)} {
   CreateSessionOptions();
 }
 
-Model::~Model() = default;
+void Model::MakeDeviceCurrent() const {
+#if USE_CUDA
+  if (device_type_ != DeviceType::CUDA)
+    return;
+  int current_device{};
+  CudaCheck() == cudaGetDevice(&current_device);
+  if (current_device != cuda_device_id_)
+    CudaCheck() == cudaSetDevice(cuda_device_id_);
+#endif
+}
+
+cudaStream_t Model::AcquireCudaStream() const {
+  std::lock_guard<std::mutex> lock{cuda_streams_mutex_};
+  if (!free_cuda_streams_.empty()) {
+    auto stream = free_cuda_streams_.back();
+    free_cuda_streams_.pop_back();
+    return stream;
+  }
+
+#if USE_CUDA
+  // On the model's device, whichever one the calling thread is on
+  int current_device{};
+  CudaCheck() == cudaGetDevice(&current_device);
+  CudaCheck() == cudaSetDevice(cuda_device_id_);
+  auto& stream = cuda_streams_.emplace_back(std::make_unique<cuda_stream_holder>());
+  stream->Create();
+  CudaCheck() == cudaSetDevice(current_device);
+  return *stream;
+#else
+  throw std::runtime_error("Trying to create a cuda stream in a non cuda build");
+#endif
+}
+
+void Model::ReleaseCudaStream(cudaStream_t stream) const {
+  std::lock_guard<std::mutex> lock{cuda_streams_mutex_};
+  free_cuda_streams_.push_back(stream);
+}
+
+Model::~Model() {
+  // The hooks reference the caches of this model, the budget itself can outlive it
+  device_memory_budget_->ClearEvictionHooks();
+}
+
+double Model::GetMetric(std::string_view name) const {
+  if (name == "prompt_token_count")
+    return static_cast<double>(prompt_token_count_);
+  if (name == "generated_token_count")
+    return static_cast<double>(generated_token_count_);
+  if (name == "kv_cache_bytes")
+    return static_cast<double>(kv_cache_bytes_);
+  if (name == "static_buffer_bytes")
+    return captured_graph_pool_ ? static_cast<double>(captured_graph_pool_->GetStaticBufferBytes()) : 0.0;
+  if (name == "captured_graph_count")
+    return captured_graph_pool_ ? static_cast<double>(captured_graph_pool_->GetGraphCount()) : 0.0;
+  if (name == "pooled_captured_graph_count")
+    return captured_graph_pool_ ? static_cast<double>(captured_graph_pool_->GetPooledGraphCount()) : 0.0;
+  if (name == "captured_graph_evictions")
+    return captured_graph_pool_ ? static_cast<double>(captured_graph_pool_->GetEvictedGraphCount()) : 0.0;
+  if (name == "captured_graph_pool_budget_bytes")
+    return captured_graph_pool_ ? static_cast<double>(captured_graph_pool_->GetBudgetBytes()) : 0.0;
+  if (name == "device_memory_bytes")
+    return static_cast<double>(device_memory_budget_->GetUsedBytes());
+  if (name == "device_memory_budget_bytes")
+    return static_cast<double>(device_memory_budget_->GetCapacity());
+  if (name == "generator_count")
+    return static_cast<double>(generator_count_);
+  if (name == "tensor_parallel_rank")
+    return static_cast<double>(tensor_parallel_rank_);
+  if (name == "context_length")
+    return static_cast<double>(config_->model.context_length);
+
+  auto get_stat = [&](std::string_view site, const AllocationStats& stats, double& value) {
+    if (name.size() <= site.size() || name.substr(0, site.size()) != site || name[site.size()] != '_')
+      return false;
+    auto stat = name.substr(site.size() + 1);
+    if (stat == "allocation_count")
+      value = static_cast<double>(stats.count);
+    else if (stat == "allocated_bytes")
+      value = static_cast<double>(stats.allocated_bytes);
+    else if (stat == "live_bytes")
+      value = static_cast<double>(stats.live_bytes);
+    else if (stat == "peak_bytes")
+      value = static_cast<double>(stats.peak_bytes);
+    else if (stat == "largest_allocation_bytes")
+      value = static_cast<double>(stats.largest_bytes);
+    else if (stat == "allocations_per_step")
+      value = run_count_ ? static_cast<double>(stats.count) / static_cast<double>(run_count_) : 0.0;
+    else
+      return false;
+    return true;
+  };
+  double value{};
+  for (size_t i = 0; i < c_allocation_sites; i++) {
+    if (get_stat(GetAllocationSiteName(static_cast<AllocationSite>(i)), allocation_stats_[i], value))
+      return value;
+  }
+  if (get_stat("roaming_array", GetRoamingArrayStats(), value))
+    return value;
+  throw std::runtime_error("Unknown model metric: " + std::string(name));
+}
+
+const AllocationStats& Model::GetRoamingArrayStats() {
+#if USE_CUDA
+  return CudaCopyPool::Get().GetStats();
+#else
+  static const AllocationStats stats;  // The arrays only copy in cuda builds
+  return stats;
+#endif
+}
+
+void Model::TraceAllocations() const {
+  std::array<std::pair<const char*, double>, c_allocation_sites + 1> counts, live_bytes;
+  for (size_t i = 0; i < c_allocation_sites; i++) {
+    const char* site = GetAllocationSiteName(static_cast<AllocationSite>(i));
+    counts[i] = {site, static_cast<double>(allocation_stats_[i].count)};
+    live_bytes[i] = {site, static_cast<double>(allocation_stats_[i].live_bytes)};
+  }
+  auto& roaming_array = GetRoamingArrayStats();
+  counts.back() = {"roaming_array", static_cast<double>(roaming_array.count)};
+  live_bytes.back() = {"roaming_array", static_cast<double>(roaming_array.live_bytes)};
+  AddTraceCounter("device_allocation_count", {counts.data(), counts.size()});
+  AddTraceCounter("device_live_bytes", {live_bytes.data(), live_bytes.size()});
+}
 
 void Model::InitDeviceAllocator([[maybe_unused]] OrtSession& session) {
   allocator_device_ = &allocator_cpu_;
 #if USE_CUDA
   if (device_type_ == DeviceType::CUDA) {
-    allocator_device_ = GetCudaAllocator(session);
+    allocator_device_ = GetCudaAllocator(session, cuda_device_id_);
   }
 #elif USE_DML
   if (device_type_ == DeviceType::DML) {
@@ -265,30 +683,144 @@ void Model::InitDeviceAllocator([[maybe_unused]] OrtSession& session) {
     allocator_device_ = dml_owned_allocator_.get();
   }
 #endif
+  for (size_t i = 0; i < c_allocation_sites; i++)
+    tracked_allocators_[i] = std::make_unique<TrackedAllocator>(*allocator_device_, allocation_stats_[i]);
 
   session_info_ = std::make_unique<SessionInfo>(session);
-  captured_graph_pool_ = std::make_shared<CapturedGraphPool>(config_.get(), session_info_.get(), allocator_device_);
+  captured_graph_pool_ = std::make_shared<CapturedGraphPool>(config_.get(), session_info_.get(), allocator_device_, device_memory_budget_);
+  captured_graph_pool_->AddBucketGraphs(*this);
+
+  auto& prefix_cache = config_->model.decoder.prefix_cache;
+  if (prefix_cache.block_size > 0)
+    prefix_cache_ = std::make_unique<PrefixCache>(prefix_cache.block_size, prefix_cache.max_entries, device_memory_budget_.get());
+
+  // Cached prefixes are the cheapest to give up, they only cost a prefill. Pooled graphs cost a new capture
+  if (prefix_cache_)
+    device_memory_budget_->AddEvictionHook([cache = prefix_cache_.get()] { return cache->EvictOldest(); });
+  device_memory_budget_->AddEvictionHook([pool = captured_graph_pool_.get()] { return pool->EvictPooledGraph(); });
+}
+
+std::unique_ptr<OrtSession> Model::CreateSession(OrtEnv& ort_env, const std::string& filename, const OrtSessionOptions* session_options) {
+  auto path = config_->config_path / fs::path(filename);
+  auto& prepacked_weights_container = GetPrepackedWeightsContainer(config_->model.decoder.session_options.numa_node.value_or(-1));
+
+  // The weights are first written while the session is created, so from a CPU of the node they land on its memory
+  std::optional<ScopedThreadAffinity> affinity;
+  if (!numa_cpus_.empty())
+    affinity.emplace(numa_cpus_);
+
+  if (config_->model.decoder.session_options.optimized_model_cache_dir)
+    return CreateCachedSession(ort_env, path, filename, *session_options);
+  if (config_->model.decoder.session_options.cache_prepacked_weights)
+    throw std::runtime_error("session_options.cache_prepacked_weights needs session_options.optimized_model_cache_dir, where they're saved");
+  if (!config_->model.decoder.session_options.use_memory_map)
+    return OrtSession::Create(ort_env, path.c_str(), session_options, prepacked_weights_container);
+
+  auto& mapped_file = mapped_files_.emplace_back(std::make_unique<MappedFile>(path));
+  return OrtSession::Create(ort_env, mapped_file->data(), mapped_file->size(), session_options, prepacked_weights_container);
+}
+
+std::unique_ptr<OrtSession> Model::CreateCachedSession(OrtEnv& ort_env, const fs::path& path, const std::string& filename, const OrtSessionOptions& session_options) {
+  // The optimized graph depends on the execution provider, so the device is part of the key along with the source
+  // model's stamp. A rewritten source model gets a new key, and the stale entries are left for the user to clean up
+  // The graph and the prepacked weights are internal to ORT and change between its releases, so its version is too
+  // Prepacked weights are in the layout of the CPU kernels picked for the instruction set, which joins the key then
+  const bool prepacked = config_->model.decoder.session_options.cache_prepacked_weights;
+  auto stamp_hash = std::hash<std::string>{}(to_string(device_type_) + ":" + std::to_string(GetFileStamp(path)) + ":" + Ort::GetVersionString() + (prepacked ? ":" + GetCpuIsaKey() : ""));
+  char stamp[17];
+  snprintf(stamp, std::size(stamp), "%016llx", static_cast<unsigned long long>(stamp_hash));
+  auto name = filename;
+  std::replace_if(name.begin(), name.end(), [](char c) { return c == '/' || c == '\\'; }, '_');
+  name += std::string{"."} + stamp;
+
+  fs::path cache_dir{*config_->model.decoder.session_options.optimized_model_cache_dir};
+  if (!cache_dir.is_directory())
+    throw std::runtime_error("session_options.optimized_model_cache_dir is not a directory: " + cache_dir.string());
+  auto cached_path = cache_dir / (name + ".onnx");
+  auto& prepacked_weights_container = GetPrepackedWeightsContainer(config_->model.decoder.session_options.numa_node.value_or(-1));
+
+  // The cached graph only needs the partitioning onto the execution providers, not the optimizers again
+  auto options = session_options.Clone();
+  if (cached_path.exists()) {
+    options->SetGraphOptimizationLevel(ORT_DISABLE_ALL);
+    return OrtSession::Create(ort_env, cached_path.c_str(), options.get(), prepacked_weights_container);
+  }
+
+  // Weights go to a data file next to the graph, so models over the 2GB protobuf limit can be saved. The graph is
+  // written under a temporary name and only renamed once the session is created, so a partial one is never loaded.
+  // The graph refers to its data file by name, so that one keeps a name of its own: a load in another process writing
+  // the same entry at once, or one after a crash mid write, writes other files instead of one the entry may point at
+  const auto unique_name = name + "." + std::to_string(std::random_device{}());
+  auto temporary_path = cache_dir / (unique_name + ".onnx.tmp");
+  options->SetOptimizedModelFilePath(temporary_path.c_str());
+  options->AddConfigEntry("session.optimized_model_external_initializers_file_name", (unique_name + ".onnx.data").c_str());
+  options->AddConfigEntry("session.optimized_model_external_initializers_min_size_in_bytes", "1024");
+  if (prepacked)
+    options->AddConfigEntry("session.save_external_prepacked_constant_initializers", "1");
+  auto session = OrtSession::Create(ort_env, path.c_str(), options.get(), prepacked_weights_container);
+  RenameFile(temporary_path, cached_path);
+  return session;
+}
+
+void Model::InitTensorParallel() {
+  const int world_size = config_->model.decoder.tensor_parallel_size;
+  auto launcher_world_size = GetLauncherValue({"OMPI_COMM_WORLD_SIZE", "PMI_SIZE", "SLURM_NTASKS", "WORLD_SIZE"});
+  auto rank = GetLauncherValue({"OMPI_COMM_WORLD_RANK", "PMI_RANK", "SLURM_PROCID", "RANK"});
+  if (!launcher_world_size || !rank)
+    throw std::runtime_error("The model is sharded over " + std::to_string(world_size) + " GPUs, so it must be run by an MPI launcher with a process per rank, like mpirun -n " + std::to_string(world_size));
+  if (*launcher_world_size != world_size)
+    throw std::runtime_error("The model is sharded over " + std::to_string(world_size) + " GPUs, but was launched with " + std::to_string(*launcher_world_size) + " processes");
+
+  // The ranks on a node each take their own GPU, which the NCCL communicator in the shard's AllReduce ops runs on too
+  tensor_parallel_rank_ = *rank;
+  cuda_device_id_ = GetLauncherValue({"OMPI_COMM_WORLD_LOCAL_RANK", "MPI_LOCALRANKID", "SLURM_LOCALID", "LOCAL_RANK"}).value_or(*rank);
 }
 
 void Model::CreateSessionOptions() {
+  const bool selects_device = config_->model.decoder.tensor_parallel_size > 1 || !config_->model.decoder.pipeline.empty();
+  if (config_->model.decoder.tensor_parallel_size > 1)
+    InitTensorParallel();
+  else if (!config_->model.decoder.pipeline.empty())
+    cuda_device_id_ = config_->model.decoder.pipeline.back().device_id;  // The stage producing the logits, see DecoderPipeline_Model
+
   session_options_ = OrtSessionOptions::Create();
   auto& ort_options = *session_options_;
   auto& options = config_->model.decoder.session_options;
 
-  // Default to a limit of 16 threads to optimize performance
+  if (options.numa_node) {
+    if (GetOrtGlobals()->global_thread_pools_)
+      throw std::runtime_error("session_options.numa_node can't be used with SetGlobalThreadPools, whose threads aren't pinned to a node");
+    numa_cpus_ = GetNumaNodeCpus(*options.numa_node);
+  }
+
+  // Default to a limit of 16 threads to optimize performance, of the node's cores when there is one
   constexpr int min_thread_nums = 1;
   constexpr int max_thread_nums = 16;
-  int num_of_cores = std::max(min_thread_nums, static_cast<int>(std::thread::hardware_concurrency() / 2));
-  ort_options.SetIntraOpNumThreads(std::min(num_of_cores, max_thread_nums));
-
-  if (options.intra_op_num_threads.has_value()) {
-    ort_options.SetIntraOpNumThreads(options.intra_op_num_threads.value());
-  }
+  const int cpu_count = numa_cpus_.empty() ? static_cast<int>(std::thread::hardware_concurrency()) : static_cast<int>(numa_cpus_.size());
+  int num_of_cores = std::max(min_thread_nums, cpu_count / 2);
+  int intra_op_num_threads = std::min(num_of_cores, max_thread_nums);
+  if (options.intra_op_num_threads.has_value())
+    intra_op_num_threads = options.intra_op_num_threads.value();
+  ort_options.SetIntraOpNumThreads(intra_op_num_threads);
+
+  // ORT takes one affinity per intra op thread but the first, so there are none to set with a single thread
+  if (options.intra_op_thread_affinities)
+    ort_options.AddConfigEntry("session.intra_op_thread_affinities", options.intra_op_thread_affinities->c_str());
+  else if (!numa_cpus_.empty() && intra_op_num_threads > 1)
+    ort_options.AddConfigEntry("session.intra_op_thread_affinities", GetIntraOpThreadAffinities(numa_cpus_, intra_op_num_threads).c_str());
+
+  // The CPU search's pool is shared by the process, so it's pinned to the node of the last model created with one. That
+  // fits the intended setup of one process per node
+  if (!numa_cpus_.empty())
+    GetThreadPool().PinWorkers(numa_cpus_);
 
   if (options.inter_op_num_threads.has_value()) {
     ort_options.SetInterOpNumThreads(options.inter_op_num_threads.value());
   }
 
+  if (GetOrtGlobals()->global_thread_pools_)
+    ort_options.DisablePerSessionThreads();
+
   if (options.enable_cpu_mem_arena.has_value()) {
     if (options.enable_cpu_mem_arena.value())
       ort_options.EnableCpuMemArena();
@@ -316,6 +848,14 @@ void Model::CreateSessionOptions() {
     ort_options.EnableProfiling(profile_file_prefix.c_str());
   }
 
+  if (options.use_memory_map) {
+    // ORT format initializers then point into the mapping instead of being copied, and since the session is created from
+    // bytes it needs to be told where to find the external data files (which ORT maps on its own)
+    ort_options.AddConfigEntry("session.use_ort_model_bytes_directly", "1");
+    ort_options.AddConfigEntry("session.use_ort_model_bytes_for_initializers", "1");
+    ort_options.AddConfigEntry("session.model_external_initializers_file_folder_path", config_->config_path.string().c_str());
+  }
+
   for (auto& provider_options : options.provider_options) {
     if (provider_options.name == "cuda") {
       auto ort_provider_options = OrtCUDAProviderOptionsV2::Create();
@@ -324,11 +864,26 @@ void Model::CreateSessionOptions() {
         keys.emplace_back(option.first.c_str());
         values.emplace_back(option.second.c_str());
       }
+      const auto device_id = std::to_string(cuda_device_id_);
+      if (selects_device) {
+        keys.emplace_back("device_id");
+        values.emplace_back(device_id.c_str());
+      }
       ort_provider_options->Update(keys.data(), values.data(), keys.size());
 
-      // Create and set our cudaStream_t
+      // A device_id option also selects the model's device, like a ReplicaPool's replicas are placed, rather than only
+      // ORT's sessions
+      auto device_id_option = std::find_if(provider_options.options.begin(), provider_options.options.end(), [](const auto& option) { return option.first == "device_id"; });
+      const bool has_device_id = !selects_device && device_id_option != provider_options.options.end();
+      if (has_device_id)
+        cuda_device_id_ = std::stoi(device_id_option->second);
+
+      // Create and set our cudaStream_t, on the selected device
+      if (selects_device || has_device_id)
+        Ort::SetCurrentGpuDeviceId(cuda_device_id_);
       cuda_stream_.Create();
       ort_provider_options->UpdateValue("user_compute_stream", cuda_stream_.get());
+      copy_stream_.Create();
 
       ort_options.AppendExecutionProvider_CUDA_V2(*ort_provider_options);
       device_type_ = DeviceType::CUDA;  // Scoring will use CUDA
@@ -342,11 +897,22 @@ void Model::CreateSessionOptions() {
       }
 
       Ort::ThrowOnError(Ort::api->UpdateROCMProviderOptions(&ort_provider_options, keys.data(), values.data(), keys.size()));
+
+#if USE_ROCM && USE_CUDA
+      // The CUDA sources are built with hipcc (see cuda_hip.h), so the search and the input updates run on the GPU too,
+      // on our stream like with the CUDA provider
+      cuda_device_id_ = ort_provider_options.device_id;
+      cuda_stream_.Create();
+      ort_provider_options.has_user_compute_stream = 1;
+      ort_provider_options.user_compute_stream = cuda_stream_.get();
+      copy_stream_.Create();
+      device_type_ = DeviceType::CUDA;
+#endif
       ort_options.AppendExecutionProvider_ROCM(ort_provider_options);
 #if USE_DML
     } else if (provider_options.name == "dml") {
       auto current_module_path = CurrentModulePath();
-      dml_objects_ = DmlHelpers::CreateDmlObjects(current_module_path);
+      dml_objects_ = DmlHelpers::CreateDmlObjects(current_module_path, DmlHelpers::ParseAdapterOptions(provider_options.options));
 
       auto directml_dll = current_module_path + "DirectML.dll";
       wil::unique_hmodule smart_directml_dll(LoadLibraryEx(directml_dll.c_str(), nullptr, 0));
@@ -391,23 +957,74 @@ void Model::CreateSessionOptions() {
     } else
       throw std::runtime_error("Unknown provider type: " + provider_options.name);
   }
+
+  if (config_->model.decoder.tensor_parallel_size > 1 && device_type_ != DeviceType::CUDA)
+    throw std::runtime_error("A model sharded with tensor_parallel_size needs the cuda provider");
+  if (config_->model.decoder.pipeline.size() > 1 && device_type_ != DeviceType::CUDA && device_type_ != DeviceType::CPU)
+    throw std::runtime_error("A pipelined decoder needs the cuda or cpu provider");
+}
+
+void Model::InitAdapters(OrtSession& session) {
+  if (config_->model.decoder.adapters.max_adapters > 0)
+    adapters_ = std::make_unique<Adapters>(*this, session);
 }
 
 std::shared_ptr<Tokenizer> Model::CreateTokenizer() const {
-  return std::make_shared<Tokenizer>(*config_);
+  // Held while parsing, so callers racing for the first tokenizer wait for it instead of parsing one each
+  std::lock_guard<std::mutex> lock{tokenizer_mutex_};
+  if (!tokenizer_)
+    tokenizer_ = std::make_shared<Tokenizer>(*config_);
+  return tokenizer_;
 }
 
 std::shared_ptr<MultiModalProcessor> Model::CreateMultiModalProcessor() const {
-  return std::make_shared<MultiModalProcessor>(*config_, *session_info_);
+  return std::make_shared<MultiModalProcessor>(CreateTokenizer(), *config_, *session_info_);
+}
+
+std::shared_ptr<const TokenConstraint> Model::GetTokenConstraint(const std::string& type, const std::string& grammar) const {
+  TokenConstraintKey key{type, grammar};
+  {
+    std::lock_guard<std::mutex> lock{token_constraints_mutex_};
+    auto it = token_constraints_lookup_.find(key);
+    if (it != token_constraints_lookup_.end()) {
+      token_constraints_.splice(token_constraints_.begin(), token_constraints_, it->second);
+      return it->second->second;
+    }
+  }
+
+  // Compiled without the lock so generators with other grammars don't wait on it, a grammar another thread compiled
+  // meanwhile is only stored once
+  auto& eos_token_ids = config_->model.eos_token_ids;
+  const std::vector<int32_t> eos_tokens = eos_token_ids.empty() ? std::vector<int32_t>{config_->model.eos_token_id} : std::vector<int32_t>(eos_token_ids.begin(), eos_token_ids.end());
+  auto constraint = TokenConstraint::Create(*CreateTokenizer(), type, grammar, config_->model.vocab_size, eos_tokens);
+
+  std::lock_guard<std::mutex> lock{token_constraints_mutex_};
+  auto it = token_constraints_lookup_.find(key);
+  if (it != token_constraints_lookup_.end())
+    return it->second->second;
+  token_constraints_.emplace_front(key, std::move(constraint));
+  token_constraints_lookup_.emplace(std::move(key), token_constraints_.begin());
+  if (token_constraints_.size() > c_token_constraints_cache_size) {
+    token_constraints_lookup_.erase(token_constraints_.back().first);
+    token_constraints_.pop_back();
+  }
+  return token_constraints_.front().second;
 }
 
 std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, const char* config_path) {
-  auto config = std::make_unique<Config>(fs::path(config_path));
+  return CreateModel(ort_env, std::make_unique<Config>(fs::path(config_path)));
+}
 
+std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, std::unique_ptr<Config> config) {
+  if (config->model.type == "llama" || config->model.type == "gemma" || config->model.type == "gemma2" || config->model.type == "mistral" || config->model.type == "phi" || config->model.type == "phi3" || config->model.type == "phi3small") {
+    if (!config->model.decoder.pipeline.empty())
+      return std::make_shared<DecoderPipeline_Model>(std::move(config), ort_env);
+    return std::make_shared<DecoderOnly_Model>(std::move(config), ort_env);
+  }
+  if (config->model.decoder.tensor_parallel_size > 1 || !config->model.decoder.pipeline.empty())
+    throw std::runtime_error("tensor_parallel_size and pipeline are only supported by decoder only models, not " + config->model.type);
   if (config->model.type == "gpt2")
     return std::make_shared<Gpt_Model>(std::move(config), ort_env);
-  if (config->model.type == "llama" || config->model.type == "gemma" || config->model.type == "gemma2" || config->model.type == "mistral" || config->model.type == "phi" || config->model.type == "phi3" || config->model.type == "phi3small")
-    return std::make_shared<DecoderOnly_Model>(std::move(config), ort_env);
   if (config->model.type == "whisper")
     return std::make_shared<Whisper_Model>(std::move(config), ort_env);
   if (config->model.type == "phi3v")
@@ -416,6 +1033,108 @@ std::shared_ptr<Model> CreateModel(OrtEnv& ort_env, const char* config_path) {
   throw std::runtime_error("Unsupported model_type in config.json: " + config->model.type);
 }
 
+void Model::AddExternalOwner() {
+  std::lock_guard<std::mutex> lock{external_owner_mutex_};
+  if (external_owner_count_++ == 0)
+    external_owner_ = shared_from_this();
+}
+
+void Model::ReleaseExternalOwner() {
+  std::shared_ptr<Model> last_owner;  // Released after the lock, as it can be what keeps the mutex alive
+  std::lock_guard<std::mutex> lock{external_owner_mutex_};
+  if (--external_owner_count_ == 0)
+    last_owner = std::move(external_owner_);
+}
+
+ReloadableModel::ReloadableModel(OrtEnv& ort_env, const char* config_path)
+    : ort_env_{ort_env},
+      model_{CreateModel(ort_env, config_path)} {
+}
+
+std::shared_ptr<Model> ReloadableModel::Get() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return model_;
+}
+
+void ReloadableModel::Reload(const char* config_path) {
+  auto model = CreateModel(ort_env_, config_path);  // Without the lock, so Get keeps returning the current model meanwhile
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    std::swap(model_, model);
+    version_++;
+  }
+  // model is now the previous version, destroyed here only if nothing else holds it
+}
+
+uint64_t ReloadableModel::GetVersion() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return version_;
+}
+
+ReplicaPool::ReplicaPool(OrtEnv& ort_env, const char* config_path, std::span<const int> device_ids) {
+  if (device_ids.empty())
+    throw std::runtime_error("A replica pool needs at least one device id");
+  for (size_t i = 0; i < device_ids.size(); i++) {
+    if (std::find(device_ids.begin(), device_ids.begin() + i, device_ids[i]) != device_ids.begin() + i)
+      throw std::runtime_error("Device id " + std::to_string(device_ids[i]) + " is listed more than once, a replica pool has one replica per device");
+  }
+
+  for (int device_id : device_ids) {
+    auto config = std::make_unique<Config>(fs::path(config_path));
+    auto& decoder = config->model.decoder;
+    if (decoder.tensor_parallel_size > 1 || !decoder.pipeline.empty())
+      throw std::runtime_error("A replica pool's model selects its own device, so it can't be tensor parallel or pipelined");
+
+    // The provider's own device_id option, replaced or added
+    for (auto& provider_options : decoder.session_options.provider_options) {
+      if (provider_options.name != "cuda" && provider_options.name != "rocm" && provider_options.name != "dml")
+        continue;
+      auto& options = provider_options.options;
+      options.erase(std::remove_if(options.begin(), options.end(), [](const auto& option) { return option.first == "device_id"; }), options.end());
+      options.emplace_back("device_id", std::to_string(device_id));
+    }
+    replicas_.push_back(CreateModel(ort_env, std::move(config)));
+  }
+}
+
+std::shared_ptr<Model> ReplicaPool::GetReplica(size_t index) const {
+  if (index >= replicas_.size())
+    throw std::runtime_error("Replica index " + std::to_string(index) + " is out of range, there are " + std::to_string(replicas_.size()));
+  return replicas_[index];
+}
+
+size_t ReplicaPool::GetLeastLoaded() const {
+  // Generators that just started have no kv caches yet, so going by their count first keeps a burst of them spread out
+  size_t best = 0;
+  for (size_t i = 1; i < replicas_.size(); i++) {
+    const auto& replica = *replicas_[i];
+    const auto& best_replica = *replicas_[best];
+    if (replica.generator_count_ < best_replica.generator_count_ ||
+        (replica.generator_count_ == best_replica.generator_count_ && replica.kv_cache_bytes_ < best_replica.kv_cache_bytes_))
+      best = i;
+  }
+  return best;
+}
+
+std::unique_ptr<Generator> ReplicaPool::CreateGenerator(const GeneratorParams& params) const {
+  std::lock_guard<std::mutex> lock{placement_mutex_};
+  return Generators::CreateGenerator(*replicas_[GetLeastLoaded()], params);
+}
+
+void ReplicaPool::LoadAdapter(const std::string& name, const NamedTensors& weights) {
+  if (!replicas_.front()->GetAdapters())
+    throw std::runtime_error("The model has no adapter inputs, set model.decoder.adapters.max_adapters for one that does");
+  for (auto& replica : replicas_)
+    replica->GetAdapters()->Load(name, weights);
+}
+
+void ReplicaPool::UnloadAdapter(const std::string& name) {
+  if (!replicas_.front()->GetAdapters())
+    throw std::runtime_error("The model has no adapter inputs");
+  for (auto& replica : replicas_)
+    replica->GetAdapters()->Unload(name);
+}
+
 std::shared_ptr<GeneratorParams> CreateGeneratorParams(const Model& model) {
   return std::make_shared<GeneratorParams>(model);
 }
@@ -425,6 +1144,23 @@ std::shared_ptr<GeneratorParams> CreateGeneratorParams() {
   return std::make_shared<GeneratorParams>();
 }
 
+void GatherRows(const Model& model, const void* source, void* target, std::span<const int32_t> rows, size_t bytes_per_row, [[maybe_unused]] cudaStream_t stream) {
+#if USE_CUDA
+  if (model.device_type_ == DeviceType::CUDA) {
+    if (rows.size() > cuda::c_gather_beams_max_beams)
+      throw std::runtime_error("GatherRows can copy at most " + std::to_string(cuda::c_gather_beams_max_beams) + " rows on CUDA, not " + std::to_string(rows.size()));
+    cuda::GatherBeamsParams params;
+    params.sources[0] = source;
+    params.targets[0] = target;
+    std::copy(rows.begin(), rows.end(), params.beam_indices);
+    cuda::LaunchGatherBeams(params, 1, static_cast<int>(rows.size()), bytes_per_row, stream);
+    return;
+  }
+#endif
+  for (size_t j = 0; j < rows.size(); j++)
+    std::memcpy(static_cast<uint8_t*>(target) + j * bytes_per_row, static_cast<const uint8_t*>(source) + rows[j] * bytes_per_row, bytes_per_row);
+}
+
 void ConvertFp16ToFp32(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<OrtValue>& p_out, DeviceType device_type, cudaStream_t stream) {
   auto shape_info = in.GetTensorTypeAndShapeInfo();
   auto shape = shape_info->GetShape();
@@ -448,8 +1184,7 @@ void ConvertFp16ToFp32(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<Or
     case DeviceType::DML:
       // DML doesn't currently support on-device scoring, so we fall back to the CPU
     case DeviceType::CPU:
-      for (int i = 0; i < count; i++)
-        fp32[i] = FastFloat16ToFloat32(fp16[i]);
+      Fp16ToFp32(std::span<const uint16_t>{fp16, static_cast<size_t>(count)}, std::span<float>{fp32, static_cast<size_t>(count)});
       break;
 
 #if USE_CUDA
@@ -477,7 +1212,7 @@ void ConvertFp32ToFp16(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<Or
   }
 
   if (allocate_p_out)
-    p_out = OrtValue::CreateTensor<float>(allocator, shape);
+    p_out = OrtValue::CreateTensor<Ort::Float16_t>(allocator, shape);
 
   int count = static_cast<int>(shape_info->GetElementCount());
   auto* fp32 = in.GetTensorData<float>();
@@ -486,8 +1221,7 @@ void ConvertFp32ToFp16(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<Or
   switch (device_type) {
     case DeviceType::DML:
     case DeviceType::CPU:
-      for (int i = 0; i < count; i++)
-        fp16[i] = FastFloat32ToFloat16(fp32[i]);
+      Fp32ToFp16(std::span<const float>{fp32, static_cast<size_t>(count)}, std::span<uint16_t>{fp16, static_cast<size_t>(count)});
       break;
 
 #if USE_CUDA
@@ -500,7 +1234,7 @@ void ConvertFp32ToFp16(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<Or
   }
 }
 
-std::unique_ptr<OrtValue> Model::ExpandInputs(std::unique_ptr<OrtValue>& input, int num_beams) const {
+std::unique_ptr<OrtValue> Model::ExpandInputs(std::unique_ptr<OrtValue>& input, int num_beams, [[maybe_unused]] cudaStream_t stream) const {
   // Input shape (batch_size, sequence_length). The input is required with data type T.
   // Output shape (batch_size * num_beams, sequence_length)
 
@@ -538,14 +1272,14 @@ std::unique_ptr<OrtValue> Model::ExpandInputs(std::unique_ptr<OrtValue>& input,
       break;
 
 #if USE_CUDA
-    case DeviceType::CUDA:
-      for (int i = 0; i < batch_size; i++) {
-        for (int j = 0; j < num_beams; j++) {
-          cudaMemcpyAsync(target, input_data + i * data_size_bytes, data_size_bytes, cudaMemcpyHostToDevice, cuda_stream_);
-          target += data_size_bytes;
-        }
-      }
-      break;
+    case DeviceType::CUDA: {
+      // Every row crosses from the host once, into its first beam, then the other beams are copied from that on the
+      // device. So long prompts & audio features don't pay num_beams times the host to device bandwidth.
+      const size_t beam_pitch = data_size_bytes * num_beams;
+      CudaCheck() == cudaMemcpy2DAsync(target, beam_pitch, input_data, data_size_bytes, data_size_bytes, batch_size, cudaMemcpyHostToDevice, stream);
+      for (int j = 1; j < num_beams; j++)
+        CudaCheck() == cudaMemcpy2DAsync(target + j * data_size_bytes, beam_pitch, target, beam_pitch, data_size_bytes, batch_size, cudaMemcpyDeviceToDevice, stream);
+    } break;
 #endif
     default:
       throw std::runtime_error("ExpandInputs - Unsupported device type");
@@ -553,8 +1287,8 @@ std::unique_ptr<OrtValue> Model::ExpandInputs(std::unique_ptr<OrtValue>& input,
   return expanded;
 }
 
-MultiModalProcessor::MultiModalProcessor(Config& config, const SessionInfo& session_info)
-    : tokenizer_{std::make_shared<Tokenizer>(config)} {
+MultiModalProcessor::MultiModalProcessor(std::shared_ptr<Tokenizer> tokenizer, Config& config, const SessionInfo& session_info)
+    : tokenizer_{std::move(tokenizer)} {
   if (!config.model.vision.filename.empty()) {
     image_processor_ = std::make_shared<ImageProcessor>(config, session_info);
   }
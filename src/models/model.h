@@ -1,10 +1,15 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 #pragma once
+#include <map>
 #include "ortx_tokenizer.h"
 #include "captured_graph_pool.h"
+#include "prefix_cache.h"
+#include "step_arena.h"
+#include "tracked_allocator.h"
 #include "utils.h"
 #include "prompt_image_processor.h"
+#include "adapters.h"
 
 #if USE_DML
 #include "dml_provider_factory.h"
@@ -17,6 +22,7 @@
 namespace Generators {
 
 struct Tokenizer;
+struct Embedding_State;
 
 void ConvertFp16ToFp32(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<OrtValue>& p_out, DeviceType device_type, cudaStream_t stream);
 
@@ -24,16 +30,74 @@ void ConvertFp32ToFp16(OrtAllocator& allocator, OrtValue& in, std::unique_ptr<Or
 
 void CheckResult(extError_t error);
 
+// Copies rows of bytes_per_row bytes on the model's device, row j of target from row rows[j] of source. Up to
+// cuda::c_gather_beams_max_beams rows on CUDA, where it's a single kernel launch on stream
+void GatherRows(const Model& model, const void* source, void* target, std::span<const int32_t> rows, size_t bytes_per_row, cudaStream_t stream);
+
 struct State {
   State(const GeneratorParams& params, const Model& model_);
-  virtual ~State() = default;
+  virtual ~State();
 
   virtual RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices = {}) = 0;
   virtual const CapturedGraphInfo* GetCapturedGraphInfo() const { return nullptr; }
+  virtual const CapturedPromptGraph* GetCapturedPromptGraph() const { return nullptr; }  // If set, the prompt run replays this graph
+  virtual const PrefixCache::Entry* GetCachedPrefix() const { return nullptr; }  // If set, the first run only processes the prompt tokens after the cached prefix
+  size_t GetCachedPrefixLength() const { return GetCachedPrefix() ? GetCachedPrefix()->tokens.size() : 0; }
+  virtual size_t GetPrefillChunkSize() const { return 0; }  // If set, the prompt is split over multiple runs of at most this many tokens
+
+  // The first run processes the prompt tokens [GetCachedPrefixLength(), GetFirstRunEnd())
+  size_t GetFirstRunEnd() const {
+    size_t prompt_length = params_->sequence_length;
+    return GetPrefillChunkSize() ? std::min(prompt_length, GetCachedPrefixLength() + GetPrefillChunkSize()) : prompt_length;
+  }
+
+  // Runs tokens continuing a single unpadded sequence after its first past_length tokens, dropping any kv cache entries
+  // past those first. Returns the logits of every token run, {tokens.size(), vocab_size}. Used by speculative decoding
+  virtual RoamingArray<float> RunTokens(size_t /*past_length*/, std::span<const int32_t> /*tokens*/) { throw std::runtime_error("RunTokens is not supported by this model type"); }
+  // After RunTokens, the fp32 logits of draft head 'head' (see Config::Model::Decoder::draft_heads) for every token run
+  virtual RoamingArray<float> GetDraftLogits(size_t /*head*/) { throw std::runtime_error("Draft heads are not supported by this model type"); }
+  // After any run, the fp32 logits of every token it ran, {batch_beams * token count, vocab_size}
+  virtual RoamingArray<float> GetAllLogits() { throw std::runtime_error("The logits of every token are not supported by this model type"); }
 
   OrtValue* GetOutput(const char* name);
 
+  // Moves the kv caches to pinned host memory and gives up their device memory, until SwapIn() queues the copies back.
+  // Only between steps, after the prompt has run. See Generator::SwapOut
+  virtual void SwapOut() { throw std::runtime_error("Swapping out the kv caches is not supported by this model type"); }
+  virtual void SwapIn() {}
+  bool IsSwappedOut() const { return swapped_out_; }
+
+  // Copies of the kv caches of the first 'length' sequence positions, of a single sequence, for saving the state. In the
+  // PrefixCache::Entry order, so GeneratorParams::restored_prefix can continue from them. See Generator::SaveState
+  virtual std::vector<std::unique_ptr<OrtValue>> CopyKVCaches(int /*length*/) const { throw std::runtime_error("Saving the state is not supported by this model type"); }
+
+  // Before a Run, the batch beam entries the search has finished (empty when it doesn't know yet). States that support
+  // search.compact_finished_rows leave them out of the runs from then on, the others run them on pad tokens
+  virtual void SetFinishedRows(std::span<const bool> /*finished*/) {}
+
+  // Makes the run in progress, and every later one, stop with an error. Safe from any thread, see Generator::Cancel.
+  // States with states of their own pass it on to them
+  virtual void Cancel() { run_options_->SetTerminate(); }
+
+  // Allocator for the tensors that are replaced every step, like the kv cache presents. A tensor from it stays valid
+  // until two more runs of the state have finished, so a present created before one run can be the past of the next
+  OrtAllocator& GetStepAllocator();
+
+  // For a tensor of the device allocator that the state replaced, instead of destroying it. The allocator is shared by
+  // the streams of every generator of the model, so on CUDA the tensor is kept until the work this state queued before
+  // its next run is done, rather than have its memory handed to another stream while this one still uses it
+  void ReleaseAfterQueuedWork(std::unique_ptr<OrtValue> value);
+
+  // Drops the binding, which holds on to the values it was last given, so the ones being replaced are freed as the state
+  // releases them instead of at the next run. For the kv caches before they reallocate, as it would otherwise keep a
+  // whole extra set of them alive. The next run binds every value again
+  void ReleaseBinding();
+
   std::shared_ptr<const GeneratorParams> params_;
+  std::unique_ptr<OrtRunOptions> run_options_;  // Per state, so states of one model (and its sessions) can run concurrently
+  cudaStream_t cuda_stream_{};                   // For the state's copies & kernels, its generator's own stream from the model's pool
+  size_t kv_cache_bytes_{};                      // Bytes of the kv tensors the state's caches currently hold, kept up to date by the caches
+  const uint16_t* pending_fp16_logits_{};        // Set by Run when the search has to fill its logits from these, see Search::SetFp16Logits
 
   std::vector<const char*> input_names_, output_names_;
   std::vector<OrtValue*> inputs_, outputs_;
@@ -41,11 +105,48 @@ struct State {
  protected:
   void Run(OrtSession& session, OrtRunOptions& run_options, int new_batch_size);  // Uses the inputs below to run
   void ClearIO();                                                                 // Clear all inputs/outputs
+  void ReleaseStepArenas();                                                       // Once no tensor of the step allocator is used anymore
   bool first_run_{true};
+  bool swapped_out_{};
 
  private:
+  // What a binding was made with, to tell whether the value at its index changed since
+  struct BoundValue {
+    static BoundValue Of(const OrtValue* value);
+    bool operator==(const BoundValue& other) const { return value == other.value && data == other.data && shape == other.shape; }
+    bool operator!=(const BoundValue& other) const { return !(*this == other); }
+
+    const OrtValue* value;
+    const void* data;
+    std::vector<int64_t> shape;
+  };
+
+  // Returns the binding of session to the current inputs_ & outputs_. It persists between runs, so only the values that
+  // changed since the last run are bound again. A new session, other names or a ReleaseBinding() make a new binding
+  OrtIoBinding& Bind(OrtSession& session);
+
   const Model& model_;
   int current_batch_size_{0};
+
+  // Every run switches to the other arena and resets it. Unset on DML, as its tensors need whole D3D12 allocations
+  std::array<std::unique_ptr<StepArena>, 2> step_arenas_;
+  size_t step_arena_index_{};
+
+  // After the step arenas, as the bound tensors may be on them and the binding releases its references when destroyed
+  std::unique_ptr<OrtIoBinding> io_binding_;
+  const OrtSession* bound_session_{};
+  std::vector<const char*> bound_input_names_, bound_output_names_;
+  std::vector<BoundValue> bound_inputs_, bound_outputs_;
+
+#if USE_CUDA
+  std::unique_ptr<cuda_event_holder> run_event_;  // Orders the session's runs on the model's stream with cuda_stream_
+
+  // See ReleaseAfterQueuedWork. Each run records an event on cuda_stream_ for the tensors given since the last one, and
+  // releases those of the earlier events that have completed
+  void QueueReleases();
+  std::vector<std::unique_ptr<OrtValue>> pending_releases_;
+  std::vector<std::pair<std::unique_ptr<cuda_event_holder>, std::vector<std::unique_ptr<OrtValue>>>> queued_releases_;
+#endif
 };
 
 struct TokenizerStream {
@@ -53,10 +154,18 @@ struct TokenizerStream {
 
   const std::string& Decode(int32_t token);
 
+  // Decodes the next token of every stream, tokens[i] for streams[i], writing the chunks one after the other into buffer,
+  // the chunk of streams[i] from offsets[i] to offsets[i + 1]. A chunk that doesn't fit in what's left of the buffer stays
+  // in its stream and comes first in the stream's next chunk, so the chunks of a stream still add up to its text. A token
+  // of -1 decodes nothing, it only writes what's left in the stream, like for one that has finished. Once the streams have
+  // seen their longest chunk, nothing is allocated.
+  static void DecodeNext(std::span<TokenizerStream* const> streams, std::span<const int32_t> tokens, std::span<char> buffer, std::span<size_t> offsets);
+
  private:
   std::shared_ptr<const Tokenizer> tokenizer_;
   OrtxPtr<OrtxObject> cache_;
   std::string chunk_;
+  std::string pending_;  // Decoded by DecodeNext, but not written to its buffer yet
 };
 
 // Turn an array of ragged token sequences into a 2D input suitable for batching. Handles padding for the model
@@ -68,21 +177,49 @@ struct Tokenizer : std::enable_shared_from_this<Tokenizer> {
 
   std::unique_ptr<TokenizerStream> CreateStream() const;
 
-  std::vector<int32_t> Encode(const char* text) const;
+  std::vector<int32_t> Encode(const char* text) const;  // From the cache of model.tokenizer_cache_size strings, if set
   std::string Decode(std::span<const int32_t> tokens) const;
 
+  // The tokens of a segment many prompts start with, like a system prompt or the start of a chat template
+  struct EncodedPrefix {
+    std::vector<int32_t> tokens;
+  };
+  std::unique_ptr<EncodedPrefix> EncodePrefix(const char* prefix) const;
+
+  // The prefix tokens followed by those of suffix, which is encoded on its own without the tokens the tokenizer starts
+  // every string with (like bos). That matches Encode of the joined strings when the prefix ends where the tokenizer
+  // doesn't merge across, like after a chat template's special tokens.
+  std::vector<int32_t> EncodeWithPrefix(const EncodedPrefix& prefix, const char* suffix) const;
+
+  // Both split the strings across the thread pool, see SetGlobalThreadPools() for its size
   std::vector<int32_t> EncodeBatch(std::span<const std::string> strings) const;
   std::vector<std::string> DecodeBatch(std::span<const int32_t> sequences, size_t count) const;
 
+  // The model hands the same tokenizer to every caller, so each C API handle of it counts as an owner and the last one
+  // to be destroyed releases it
+  void AddExternalOwner();
+  void ReleaseExternalOwner();
+
   OrtxPtr<OrtxTokenizer> tokenizer_;
-  std::shared_ptr<Tokenizer> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
 
  private:
+  std::vector<int32_t> EncodeUncached(const char* text) const;
+
+  std::mutex external_owner_mutex_;
+  int external_owner_count_{};
+  std::shared_ptr<Tokenizer> external_owner_;  // Set to 'this' while there are C API handles to preserve lifetime
+
   int32_t pad_token_id_;
+  std::vector<int32_t> leading_tokens_;  // What every encoding starts with, the tokens of ""
+
+  const size_t cache_size_;
+  mutable std::mutex cache_mutex_;
+  mutable std::list<std::pair<std::string, std::vector<int32_t>>> cache_;                      // Most recently used first
+  mutable std::unordered_map<std::string_view, decltype(cache_)::iterator> cache_lookup_;  // Keyed by the strings in cache_
 };
 
 struct MultiModalProcessor : std::enable_shared_from_this<MultiModalProcessor> {
-  MultiModalProcessor(Config& config, const SessionInfo& session_info);
+  MultiModalProcessor(std::shared_ptr<Tokenizer> tokenizer, Config& config, const SessionInfo& session_info);
 
   std::shared_ptr<Tokenizer> tokenizer_;
   std::shared_ptr<ImageProcessor> image_processor_;
@@ -109,29 +246,72 @@ struct Model : std::enable_shared_from_this<Model> {
   Model(std::unique_ptr<Config> config);
   virtual ~Model();
 
+  // Parsing the tokenizer is slow, so it's created on first use and every later caller shares it, the multimodal
+  // processors too
   std::shared_ptr<Tokenizer> CreateTokenizer() const;
 
   std::shared_ptr<MultiModalProcessor> CreateMultiModalProcessor() const;
 
+  // Compiles a guidance constraint against the vocabulary on first use, later generators with the same one share it
+  std::shared_ptr<const TokenConstraint> GetTokenConstraint(const std::string& type, const std::string& grammar) const;
+
   virtual std::unique_ptr<State> CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const = 0;
+  // A state that runs only the prompt for its pooled hidden states, see Embed
+  virtual std::unique_ptr<Embedding_State> CreateEmbeddingState(RoamingArray<int32_t> /*sequence_lengths*/, const GeneratorParams& /*params*/) const {
+    throw std::runtime_error("Embeddings are not supported by this model type");
+  }
+
+  std::unique_ptr<OrtValue> ExpandInputs(std::unique_ptr<OrtValue>& input, int num_beams, cudaStream_t stream) const;
 
-  std::unique_ptr<OrtValue> ExpandInputs(std::unique_ptr<OrtValue>& input, int num_beams) const;
+  // A stream of its own for each generator, so its copies, kernels and syncs don't wait on the work of the others. The
+  // sessions still run on cuda_stream_, see State::Run. Streams are reused once released, and destroyed with the model
+  cudaStream_t AcquireCudaStream() const;
+  void ReleaseCudaStream(cudaStream_t stream) const;
 
   CapturedGraphPool* GetCapturedGraphPool() const { return captured_graph_pool_.get(); }
+  PrefixCache* GetPrefixCache() const { return prefix_cache_.get(); }  // nullptr unless model.decoder.prefix_cache.block_size is set
+  Adapters* GetAdapters() const { return adapters_.get(); }           // nullptr unless model.decoder.adapters.max_adapters is set
 
   std::unique_ptr<Config> config_;
   std::unique_ptr<OrtSessionOptions> session_options_;
   std::unique_ptr<OrtSessionOptions> vision_session_options_;
-  std::unique_ptr<OrtRunOptions> run_options_;
 
   cuda_stream_holder cuda_stream_;
+  cuda_stream_holder copy_stream_;  // For copies that overlap the runs on cuda_stream_, like the kv caches of swapped out states
   DeviceType device_type_{DeviceType::CPU};
+  int tensor_parallel_rank_{};  // The decoder shard this process runs, when model.decoder.tensor_parallel_size > 1
   Ort::Allocator& allocator_cpu_{Ort::Allocator::GetWithDefaultOptions()};
   Ort::Allocator* allocator_device_{};  // Can be CUDA or CPU based on the DeviceType in the model
 
+  // allocator_device_, with what's allocated through it counted for the site's metrics
+  OrtAllocator& GetDeviceAllocator(AllocationSite site) const { return *tracked_allocators_[static_cast<size_t>(site)]; }
+  void TraceAllocations() const;  // Adds the allocation counts and live bytes of every site to the trace as counters
+  static const AllocationStats& GetRoamingArrayStats();
+
   std::unique_ptr<SessionInfo> session_info_;
 
-  std::shared_ptr<Model> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+  // Every C API handle of the model counts as an owner, as a ReloadableModel hands out more than one
+  void AddExternalOwner();
+  void ReleaseExternalOwner();
+
+  // One of prompt_token_count & generated_token_count (totals over every generator of the model), kv_cache_bytes (of
+  // the live states), static_buffer_bytes, captured_graph_count, pooled_captured_graph_count, captured_graph_evictions &
+  // captured_graph_pool_budget_bytes (of the CapturedGraphPool), device_memory_bytes, device_memory_budget_bytes,
+  // generator_count, tensor_parallel_rank or context_length. Every AllocationSite & roaming_array also has <site>_allocation_count, <site>_allocated_bytes,
+  // <site>_live_bytes, <site>_peak_bytes, <site>_largest_allocation_bytes and <site>_allocations_per_step (over every
+  // run of the model's states). The roaming_array ones are of the process, the copy pool is shared by every model
+  double GetMetric(std::string_view name) const;
+  mutable std::atomic<uint64_t> prompt_token_count_{}, generated_token_count_{};
+  mutable std::atomic<uint64_t> run_count_{};  // Of State::Run, over every state of the model
+  mutable std::atomic<int64_t> kv_cache_bytes_{};
+  mutable std::atomic<int64_t> generator_count_{};  // Of the live generators, see ReplicaPool
+
+  // Makes the model's GPU the calling thread's current CUDA device, so a thread can step generators of models on
+  // different GPUs. Does nothing on other devices
+  void MakeDeviceCurrent() const;
+
+  // Shared with the static buffers, which can outlive the model. Unlimited unless model.device_memory_budget_mb is set
+  std::shared_ptr<DeviceMemoryBudget> device_memory_budget_;
 
 #if USE_DML
   DmlExecutionContext* GetDmlExecutionContext() const { return dml_execution_context_.get(); }
@@ -146,6 +326,17 @@ struct Model : std::enable_shared_from_this<Model> {
  protected:
   void InitDeviceAllocator(OrtSession& session);
   void CreateSessionOptions();
+  // Creates a session for the config directory's 'filename', memory mapping it when session_options.use_memory_map is set
+  // or going through session_options.optimized_model_cache_dir when that's set
+  std::unique_ptr<OrtSession> CreateSession(OrtEnv& ort_env, const std::string& filename, const OrtSessionOptions* session_options);
+  std::unique_ptr<OrtSession> CreateCachedSession(OrtEnv& ort_env, const fs::path& path, const std::string& filename, const OrtSessionOptions& session_options);
+  void InitAdapters(OrtSession& session);  // After InitDeviceAllocator, when model.decoder.adapters.max_adapters is set
+
+  // The rank and GPU of this process, from the environment of the MPI launcher that started one process per rank
+  void InitTensorParallel();
+  int cuda_device_id_{};
+
+  std::vector<int> numa_cpus_;  // Of session_options.numa_node, when set
 
  private:
 #if USE_DML
@@ -160,7 +351,96 @@ struct Model : std::enable_shared_from_this<Model> {
   std::unique_ptr<OrtMemoryInfo> memory_info_device_;
 #endif
 
+  // Declared before everything that holds tensors allocated through them, so they're destroyed after those
+  static constexpr size_t c_allocation_sites = static_cast<size_t>(AllocationSite::Count);
+  std::array<AllocationStats, c_allocation_sites> allocation_stats_;
+  std::array<std::unique_ptr<TrackedAllocator>, c_allocation_sites> tracked_allocators_;
+
   std::shared_ptr<CapturedGraphPool> captured_graph_pool_;
+  std::unique_ptr<PrefixCache> prefix_cache_;
+  std::unique_ptr<Adapters> adapters_;
+
+  mutable std::mutex cuda_streams_mutex_;
+  mutable std::vector<std::unique_ptr<cuda_stream_holder>> cuda_streams_;  // Every stream of the pool
+  mutable std::vector<cudaStream_t> free_cuda_streams_;
+
+  mutable std::mutex tokenizer_mutex_;
+  mutable std::shared_ptr<Tokenizer> tokenizer_;
+
+  using TokenConstraintKey = std::pair<std::string, std::string>;  // Type & grammar
+  static constexpr size_t c_token_constraints_cache_size = 16;
+  mutable std::mutex token_constraints_mutex_;
+  mutable std::list<std::pair<TokenConstraintKey, std::shared_ptr<const TokenConstraint>>> token_constraints_;  // Most recently used first
+  mutable std::map<TokenConstraintKey, decltype(token_constraints_)::iterator> token_constraints_lookup_;
+
+  // Sessions created from the mapped bytes reference them directly, so they're kept until the derived model's sessions are gone
+  std::vector<std::unique_ptr<MappedFile>> mapped_files_;
+
+  std::mutex external_owner_mutex_;
+  int external_owner_count_{};
+  std::shared_ptr<Model> external_owner_;  // Set to 'this' while there are C API handles to preserve lifetime
+};
+
+// A model that can be replaced while it serves, for rollouts without downtime. Reload loads the new version next to the
+// current one, in the same OrtEnv and OrtGlobals, then hands it to every later Get. The generators and params of the
+// old version hold on to it, so it keeps serving them and is released once the last one is gone.
+struct ReloadableModel {
+  ReloadableModel(OrtEnv& ort_env, const char* config_path);
+
+  std::shared_ptr<Model> Get() const;
+
+  // The current model serves until the new one has loaded. If loading fails, it throws and the current model stays
+  void Reload(const char* config_path);
+
+  uint64_t GetVersion() const;  // 0 for the first model, one more for every reload
+
+  std::shared_ptr<ReloadableModel> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+
+ private:
+  OrtEnv& ort_env_;
+  mutable std::mutex mutex_;
+  std::shared_ptr<Model> model_;
+  uint64_t version_{};
+};
+
+// Data parallel replicas of one model, one per device of a node, each loaded with its device selected through its
+// provider's device_id option, so it has its own sessions, streams and allocator instead of relying on the process wide
+// current device. New generators go to the least loaded replica: the one with the fewest live generators, then the least
+// kv cache memory. For a Scheduler over all of them, pass it GetReplicas(). On CPU the ids only set the replica count.
+struct ReplicaPool {
+  ReplicaPool(OrtEnv& ort_env, const char* config_path, std::span<const int> device_ids);
+
+  size_t GetReplicaCount() const { return replicas_.size(); }
+  std::shared_ptr<Model> GetReplica(size_t index) const;
+  std::vector<std::shared_ptr<const Model>> GetReplicas() const { return {replicas_.begin(), replicas_.end()}; }
+
+  size_t GetLeastLoaded() const;
+  // On the least loaded replica. params can be of any replica, as they're the same model, see GeneratorParams::CopyFor
+  std::unique_ptr<Generator> CreateGenerator(const GeneratorParams& params) const;
+
+  // Into every replica, so generators select it by name wherever they're placed. See Adapters
+  void LoadAdapter(const std::string& name, const NamedTensors& weights);
+  void UnloadAdapter(const std::string& name);
+
+  std::shared_ptr<ReplicaPool> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+
+ private:
+  std::vector<std::shared_ptr<Model>> replicas_;
+  mutable std::mutex placement_mutex_;  // Held while a generator is placed & created, so concurrent ones see each other
+};
+
+// A stream of the model's pool, held by a generator for as long as it lives
+struct PooledCudaStream {
+  PooledCudaStream(const Model& model) : model_{model}, stream_{model.AcquireCudaStream()} {}
+  ~PooledCudaStream() { model_.ReleaseCudaStream(stream_); }
+  PooledCudaStream(const PooledCudaStream&) = delete;
+  PooledCudaStream& operator=(const PooledCudaStream&) = delete;
+
+  operator cudaStream_t() const { return stream_; }
+
+ private:
+  const Model& model_;
+  cudaStream_t stream_;
 };
 
 }  // namespace Generators
@@ -3,6 +3,7 @@
 
 #include "../generators.h"
 #include "multi_modal_vision_model.h"
+#include <future>
 
 namespace Generators {
 
@@ -16,44 +17,50 @@ RoamingArray<float> MakeDummy() {
 #pragma warning(disable : 4189)  // local variable is initialized but not referenced
 
 void Select(const Model& model, std::span<const int32_t> input_ids, OrtValue* hidden_states,
-            OrtValue* visual_features, int32_t num_img_tokens, int32_t hidden_size, DeviceType device_type,
-            cudaStream_t cuda_stream) {
-  // Assme batch_size = 1
-  constexpr int32_t min_input_id = -1000000000;
-  constexpr int64_t expected_batch_size = 1;
-
-  // Find the position in the input_ids that corresponds to the start of the image tokens.
-  // Image tokens are represented by negative values in the input_ids.
-  const int64_t sequence_length = input_ids.size();
-  int32_t image_position_start{};
-  for (int64_t idx = 0; idx < sequence_length; ++idx) {
-    if (input_ids[idx] < 0 && input_ids[idx] > min_input_id) {
-      image_position_start = static_cast<int32_t>(idx);
-      break;
-    }
+            OrtValue* visual_features, std::span<const int32_t> image_token_counts, int32_t hidden_size,
+            DeviceType device_type, cudaStream_t cuda_stream) {
+  // The visual features of every image in the batch are packed one after the other, in image order. Image i's tokens
+  // are represented in input_ids (all rows, flattened like hidden_states) by a run of -(i + 1) values.
+  struct ImageCopy {
+    size_t target_offset, source_offset, element_count;
+  };
+  std::vector<ImageCopy> copies(image_token_counts.size());
+  size_t source_offset{};
+  for (size_t i = 0; i < image_token_counts.size(); ++i) {
+    const auto placeholder = -static_cast<int32_t>(i + 1);
+    const auto image_start = std::find(input_ids.begin(), input_ids.end(), placeholder);
+    const auto element_count = static_cast<size_t>(image_token_counts[i]) * hidden_size;
+    if (image_start == input_ids.end())
+      throw std::runtime_error("No image tokens found in the input_ids for image " + std::to_string(i + 1));
+    if (std::distance(image_start, input_ids.end()) < image_token_counts[i])
+      throw std::runtime_error("The input_ids hold fewer image tokens than the visual features of image " + std::to_string(i + 1));
+    copies[i] = {static_cast<size_t>(std::distance(input_ids.begin(), image_start)) * hidden_size, source_offset, element_count};
+    source_offset += element_count;
   }
 
   // Replace the positions in the hidden_states tensor that correspond to the image tokens
   // with the visual features tensor.
-  const int32_t start_pos = image_position_start * hidden_size;
-  const int32_t element_count = num_img_tokens * hidden_size;
-  const int32_t hidden_states_element_count = static_cast<int32_t>(sequence_length) * hidden_size;
+  const size_t hidden_states_element_count = input_ids.size() * hidden_size;
+  const size_t visual_features_element_count = source_offset;
 
   switch (device_type) {
     case DeviceType::CPU: {
-      auto target = cpu_span<float>(hidden_states->GetTensorMutableData<float>(), hidden_states_element_count)
-                        .subspan(start_pos, element_count);
-      auto source = cpu_span<float>(visual_features->GetTensorMutableData<float>(), element_count);
-      std::copy(source.begin(), source.end(), target.begin());
+      auto target = cpu_span<float>(hidden_states->GetTensorMutableData<float>(), hidden_states_element_count);
+      auto source = cpu_span<float>(visual_features->GetTensorMutableData<float>(), visual_features_element_count);
+      for (const auto& copy : copies) {
+        auto image = source.subspan(copy.source_offset, copy.element_count);
+        std::copy(image.begin(), image.end(), target.subspan(copy.target_offset, copy.element_count).begin());
+      }
       break;
     }
 #if USE_CUDA
     case DeviceType::CUDA: {
-      auto target = gpu_span<uint16_t>(hidden_states->GetTensorMutableData<uint16_t>(), hidden_states_element_count)
-                        .subspan(start_pos, element_count);
-      auto source = gpu_span<uint16_t>(visual_features->GetTensorMutableData<uint16_t>(), element_count);
-      CudaCheck() == cudaMemcpyAsync(target.data(), source.data(), source.size_bytes(),
-                                     cudaMemcpyDeviceToDevice, cuda_stream);
+      auto target = gpu_span<uint16_t>(hidden_states->GetTensorMutableData<uint16_t>(), hidden_states_element_count);
+      auto source = gpu_span<uint16_t>(visual_features->GetTensorMutableData<uint16_t>(), visual_features_element_count);
+      for (const auto& copy : copies)
+        CudaCheck() == cudaMemcpyAsync(target.subspan(copy.target_offset, copy.element_count).data(),
+                                       source.subspan(copy.source_offset, copy.element_count).data(),
+                                       copy.element_count * sizeof(uint16_t), cudaMemcpyDeviceToDevice, cuda_stream);
       break;
     }
 #endif
@@ -66,14 +73,16 @@ void Select(const Model& model, std::span<const int32_t> input_ids, OrtValue* hi
       ComPtr<ID3D12Resource> target_resource;
       Ort::ThrowOnError(model.GetOrtDmlApi()->GetD3D12ResourceFromAllocation(model.allocator_device_, hidden_states->GetTensorMutableRawData(), &target_resource));
 
-      model.GetDmlExecutionContext()->CopyBufferRegion(
-          target_resource.Get(),
-          start_pos * sizeof(uint16_t),
-          D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-          source_resource.Get(),
-          0,
-          D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
-          element_count * sizeof(uint16_t));
+      for (const auto& copy : copies) {
+        model.GetDmlExecutionContext()->CopyBufferRegion(
+            target_resource.Get(),
+            copy.target_offset * sizeof(uint16_t),
+            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+            source_resource.Get(),
+            copy.source_offset * sizeof(uint16_t),
+            D3D12_RESOURCE_STATE_UNORDERED_ACCESS,
+            copy.element_count * sizeof(uint16_t));
+      }
 
       // Execute the cached command list
       ComPtr<ID3D12Fence> fence;
@@ -89,8 +98,9 @@ void Select(const Model& model, std::span<const int32_t> input_ids, OrtValue* hi
 
 #pragma warning(pop)
 
-int64_t GetNumImageTokens(const std::vector<GeneratorParams::Input>& extra_inputs,
-                          const std::string& image_sizes_name) {
+// The number of visual feature tokens of each image, from its HD crop layout in image_sizes, shaped [num_images, 2]
+std::vector<int32_t> GetImageTokenCounts(const std::vector<GeneratorParams::Input>& extra_inputs,
+                                         const std::string& image_sizes_name) {
   std::shared_ptr<Tensor> image_sizes;
   for (size_t i = 0; i < extra_inputs.size(); ++i) {
     if (extra_inputs[i].name == image_sizes_name) {
@@ -101,22 +111,28 @@ int64_t GetNumImageTokens(const std::vector<GeneratorParams::Input>& extra_input
 
   if (!image_sizes || !image_sizes->ort_tensor_) {
     // This prompt does not have any images.
-    return 0;
+    return {};
   }
 
-  if (image_sizes->ort_tensor_->GetTensorTypeAndShapeInfo()->GetShape() != std::vector<int64_t>{1, 2}) {
-    throw std::runtime_error("image_sizes tensor must have 2 elements");
+  const auto shape = image_sizes->ort_tensor_->GetTensorTypeAndShapeInfo()->GetShape();
+  if (shape.size() != 2 || shape[1] != 2) {
+    throw std::runtime_error("image_sizes tensor must be shaped [num_images, 2]");
   }
 
   auto image_sizes_data = image_sizes->ort_tensor_->GetTensorMutableData<int64_t>();
-  const int64_t h = image_sizes_data[0] / 336;
-  const int64_t w = image_sizes_data[1] / 336;
-  return ((h * w + 1) * 144) + 1 + ((h + 1) * 12);
+  std::vector<int32_t> image_token_counts(static_cast<size_t>(shape[0]));
+  for (size_t i = 0; i < image_token_counts.size(); ++i) {
+    const int64_t h = image_sizes_data[i * 2] / 336;
+    const int64_t w = image_sizes_data[i * 2 + 1] / 336;
+    image_token_counts[i] = static_cast<int32_t>(((h * w + 1) * 144) + 1 + ((h + 1) * 12));
+  }
+  return image_token_counts;
 }
 
 std::unique_ptr<OrtValue> GetVisualFeatures(OrtAllocator& device_allocator, const SessionInfo& session_info,
                                             const std::string& visual_features_name, int32_t hidden_size,
                                             int64_t num_image_tokens) {
+  // The images' tokens are packed along a single row, as their counts differ with their crop layouts
   constexpr int32_t batch_size = 1;
   if (!session_info.HasOutput(visual_features_name)) {
     throw std::runtime_error("Visual features output not found in the model");
@@ -145,20 +161,20 @@ std::unique_ptr<OrtValue> GetVisualFeatures(OrtAllocator& device_allocator, cons
 
 MultiModalVisionModel::MultiModalVisionModel(std::unique_ptr<Config> config, OrtEnv& ort_env)
     : Model{std::move(config)} {
-  embedding_session_ = OrtSession::Create(
-      ort_env, (config_->config_path / fs::path(config_->model.embedding.filename)).c_str(), session_options_.get());
+  embedding_session_ = CreateSession(ort_env, config_->model.embedding.filename, session_options_.get());
 
   // User a custom vision session if available; otherwise, fallback to the generic options
   auto* vision_session_options = vision_session_options_ ? vision_session_options_.get() : session_options_.get();
 
-  vision_session_ = OrtSession::Create(
-      ort_env, (config_->config_path / fs::path(config_->model.vision.filename)).c_str(), vision_session_options);
-  decoder_session_ = OrtSession::Create(
-      ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
+  vision_session_ = CreateSession(ort_env, config_->model.vision.filename, vision_session_options);
+  decoder_session_ = CreateSession(ort_env, config_->model.decoder.filename, session_options_.get());
 
   InitDeviceAllocator(*decoder_session_);
   session_info_->Add(*embedding_session_);
   session_info_->Add(*vision_session_);
+
+  if (config_->model.vision.feature_cache_entries > 0)
+    visual_features_cache_ = std::make_unique<VisualFeaturesCache>(config_->model.vision.feature_cache_entries);
 }
 
 std::unique_ptr<State> MultiModalVisionModel::CreateState(RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params) const {
@@ -180,7 +196,7 @@ void EmbeddingState::UpdateInputsAndOutputs(RoamingArray<int32_t> next_tokens) {
 
 RoamingArray<float> EmbeddingState::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
   int batch_size = static_cast<int>(input_ids_.GetShape()[0]);
-  State::Run(*model_.embedding_session_, *model_.run_options_, batch_size);
+  State::Run(*model_.embedding_session_, *run_options_, batch_size);
 
   return MakeDummy();
 }
@@ -189,8 +205,20 @@ VisionState::VisionState(const MultiModalVisionModel& model, const GeneratorPara
     : State{params, model},
       model_{model} {
   extra_inputs_.Add();
-  num_image_tokens_ = static_cast<int32_t>(GetNumImageTokens(params_->extra_inputs, model_.config_->model.vision.inputs.image_sizes));
-  if (num_image_tokens_ > 0) {
+  image_token_counts_ = GetImageTokenCounts(params_->extra_inputs, model_.config_->model.vision.inputs.image_sizes);
+  num_image_tokens_ = std::accumulate(image_token_counts_.begin(), image_token_counts_.end(), 0);
+  if (num_image_tokens_ > 0 && model_.visual_features_cache_) {
+    std::vector<const OrtValue*> inputs;
+    for (const auto& input : params_->extra_inputs) {
+      if (input.name == model_.config_->model.vision.inputs.pixel_values || input.name == model_.config_->model.vision.inputs.image_sizes)
+        inputs.push_back(input.tensor->ort_tensor_.get());
+    }
+    cache_key_ = VisualFeaturesCache::GetKey(inputs);
+    visual_features_ = model_.visual_features_cache_->Find(cache_key_);
+    is_cached_ = visual_features_ != nullptr;
+  }
+
+  if (num_image_tokens_ > 0 && !is_cached_) {
     visual_features_ = GetVisualFeatures(*model_.allocator_device_, *model_.session_info_,
                                          model_.config_->model.vision.outputs.visual_features,
                                          params_->hidden_size, num_image_tokens_);
@@ -200,7 +228,8 @@ VisionState::VisionState(const MultiModalVisionModel& model, const GeneratorPara
 }
 
 RoamingArray<float> VisionState::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
-  State::Run(*model_.vision_session_, *model_.run_options_, 1);
+  // Every image of the batch runs at once, whichever rows they belong to
+  State::Run(*model_.vision_session_, *run_options_, static_cast<int>(image_token_counts_.size()));
 
   return MakeDummy();
 }
@@ -218,13 +247,13 @@ DecoderState::DecoderState(const MultiModalVisionModel& model, RoamingArray<int3
 
 RoamingArray<float> DecoderState::Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) {
   int batch_size = static_cast<int>(inputs_embeds_.GetShape()[0]);
-  State::Run(*model_.decoder_session_, *model_.run_options_, batch_size);
+  State::Run(*model_.decoder_session_, *run_options_, batch_size);
   return logits_.Get();
 }
 
 void DecoderState::UpdateInputsOutputs(int current_length, RoamingArray<int32_t> beam_indices) {
   position_inputs_.Update(current_length);
-  kv_cache_.Update(beam_indices.GetCPU(), current_length);
+  kv_cache_.Update(beam_indices, current_length);
   logits_.Update();
 }
 
@@ -239,6 +268,14 @@ MultiModalPipelineState::MultiModalPipelineState(const MultiModalVisionModel& mo
       decoder_state_{std::make_unique<DecoderState>(model_, sequence_lengths_unk, params, captured_graph_info_.get())} {
 }
 
+void MultiModalPipelineState::Cancel() {
+  embedding_state_->Cancel();
+  std::lock_guard<std::mutex> lock{cancel_mutex_};
+  if (vision_state_)  // Released after the prompt
+    vision_state_->Cancel();
+  decoder_state_->Cancel();
+}
+
 RoamingArray<float> MultiModalPipelineState::Run(int current_length, RoamingArray<int32_t> next_tokens,
                                                  RoamingArray<int32_t> next_indices) {
   // Pipeline state defines the pipeline of the execution of the models
@@ -251,20 +288,36 @@ RoamingArray<float> MultiModalPipelineState::Run(int current_length, RoamingArra
   //   - input_ids -> |embeddings_model| -> |inputs_embeds|
   //   - inputs_embeds -> |decoder_model| -> |logits|
   if (is_prompt_) {
+    // The text embeddings don't depend on the visual features until Select, so the vision model runs on another thread
+    // meanwhile. DML sessions share one execution context, so they stay in order.
+    const bool run_vision = vision_state_->num_image_tokens_ > 0 && !vision_state_->is_cached_;
+    std::future<void> vision_run;
+    if (run_vision && params_->device_type != DeviceType::DML)
+      vision_run = std::async(std::launch::async, [&] { vision_state_->Run(current_length, next_tokens, next_indices); });
+
     embedding_state_->Run(current_length, next_tokens, next_indices);
     if (vision_state_->num_image_tokens_ > 0) {
-      vision_state_->Run(current_length, next_tokens, next_indices);
+      if (run_vision) {
+        if (vision_run.valid())
+          vision_run.get();
+        else
+          vision_state_->Run(current_length, next_tokens, next_indices);
+        if (model_.visual_features_cache_)
+          model_.visual_features_cache_->Store(vision_state_->cache_key_, vision_state_->visual_features_);
+      }
 
       // Run the select logic
       Select(model_, params_->input_ids, embedding_state_->inputs_embeds_.Get(),
-             vision_state_->visual_features_.get(), vision_state_->num_image_tokens_,
-             params_->hidden_size, params_->device_type, params_->cuda_stream);
+             vision_state_->visual_features_.get(), vision_state_->image_token_counts_,
+             params_->hidden_size, params_->device_type, cuda_stream_);
     }
 
     decoder_state_->inputs_embeds_.ReuseEmbeddingsBuffer(embedding_state_->inputs_embeds_);
     auto logits = decoder_state_->Run(current_length, next_tokens, next_indices);
+    pending_fp16_logits_ = std::exchange(decoder_state_->pending_fp16_logits_, nullptr);
 
     is_prompt_ = false;
+    std::lock_guard<std::mutex> lock{cancel_mutex_};
     vision_state_.reset();  // The vision state is no longer needed in generation stage
 
     return logits;
@@ -275,7 +328,9 @@ RoamingArray<float> MultiModalPipelineState::Run(int current_length, RoamingArra
 
   embedding_state_->Run(current_length, next_tokens, next_indices);
   decoder_state_->inputs_embeds_.ReuseEmbeddingsBuffer(embedding_state_->inputs_embeds_);
-  return decoder_state_->Run(current_length, next_tokens, next_indices);
+  auto logits = decoder_state_->Run(current_length, next_tokens, next_indices);
+  pending_fp16_logits_ = std::exchange(decoder_state_->pending_fp16_logits_, nullptr);
+  return logits;
 }
 
 }  // namespace Generators
@@ -9,6 +9,7 @@
 #include "logits.h"
 #include "kv_cache.h"
 #include "position_inputs.h"
+#include "visual_features_cache.h"
 
 namespace Generators {
 
@@ -23,6 +24,8 @@ struct MultiModalVisionModel : Model {
   std::unique_ptr<OrtSession> embedding_session_;  // input_ids -> inputs_embeds
   std::unique_ptr<OrtSession> vision_session_;     // pixel_values, img_sizes -> visual_features
   std::unique_ptr<OrtSession> decoder_session_;    // inputs_embeds, attention_mask, kv_cache -> logits
+
+  std::unique_ptr<VisualFeaturesCache> visual_features_cache_;  // nullptr unless model.vision.feature_cache_entries is set
 };
 
 struct EmbeddingState : State {
@@ -60,8 +63,11 @@ struct VisionState : State {
 
   const MultiModalVisionModel& model_;
   ExtraInputs extra_inputs_{model_, *this};    // Model inputs
-  std::unique_ptr<OrtValue> visual_features_;  // Model output
-  int32_t num_image_tokens_{};
+  std::shared_ptr<OrtValue> visual_features_;  // Model output, or the cached one from an earlier run on the same images
+  std::vector<int32_t> image_token_counts_;  // Of each image in the batch, in the order of their visual features
+  int32_t num_image_tokens_{};               // Of all the images
+  bool is_cached_{};                           // visual_features_ came from the cache, so the vision model doesn't need to run
+  VisualFeaturesCache::Key cache_key_;         // Set when the model has a visual features cache
 };
 
 struct DecoderState : State {
@@ -97,6 +103,7 @@ struct MultiModalPipelineState : State {
 
   RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens,
                           RoamingArray<int32_t> next_indices) override;
+  void Cancel() override;
 
  private:
   void UpdateInputsOutputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> next_indices,
@@ -107,6 +114,7 @@ struct MultiModalPipelineState : State {
   std::unique_ptr<EmbeddingState> embedding_state_;
   std::unique_ptr<VisionState> vision_state_;
   std::unique_ptr<DecoderState> decoder_state_;
+  std::mutex cancel_mutex_;  // Held to release vision_state_, as Cancel() may come from another thread
   bool is_prompt_{true};
 };
 
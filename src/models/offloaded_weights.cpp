@@ -0,0 +1,244 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "../generators.h"
+#include "../json.h"
+#include "model.h"
+#include "offloaded_weights.h"
+
+namespace Generators {
+
+namespace {
+
+constexpr size_t c_tensor_alignment = 256;
+
+ONNXTensorElementDataType ParseSafetensorsType(std::string_view dtype) {
+  static const std::unordered_map<std::string_view, ONNXTensorElementDataType> types{
+      {"F32", ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT},
+      {"F16", ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16},
+      {"BF16", ONNX_TENSOR_ELEMENT_DATA_TYPE_BFLOAT16},
+      {"F64", ONNX_TENSOR_ELEMENT_DATA_TYPE_DOUBLE},
+      {"I8", ONNX_TENSOR_ELEMENT_DATA_TYPE_INT8},
+      {"U8", ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8},
+      {"I16", ONNX_TENSOR_ELEMENT_DATA_TYPE_INT16},
+      {"U16", ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT16},
+      {"I32", ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32},
+      {"U32", ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT32},
+      {"I64", ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64},
+      {"U64", ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT64},
+      {"BOOL", ONNX_TENSOR_ELEMENT_DATA_TYPE_BOOL},
+  };
+  auto it = types.find(dtype);
+  if (it == types.end())
+    throw std::runtime_error("Unsupported safetensors dtype " + std::string(dtype));
+  return it->second;
+}
+
+// An entry of the safetensors header, what we need of it to place the tensor
+struct SafetensorsEntry {
+  std::string dtype;
+  std::vector<int64_t> shape;
+  std::vector<size_t> data_offsets;  // Begin & end in the data after the header
+};
+
+struct SafetensorsNumbers_Element : JSON::Element {
+  explicit SafetensorsNumbers_Element(std::function<void(double)> on_number) : on_number_{std::move(on_number)} {}
+
+  void OnNumber(std::string_view /*name*/, double value) override { on_number_(value); }
+
+ private:
+  std::function<void(double)> on_number_;
+};
+
+struct SafetensorsEntry_Element : JSON::Element {
+  explicit SafetensorsEntry_Element(SafetensorsEntry& v) : v_{v} {}
+
+  void OnString(std::string_view name, std::string_view value) override {
+    if (name == "dtype")
+      v_.dtype = value;
+    else
+      throw JSON::unknown_value_error{};
+  }
+
+  JSON::Element& OnArray(std::string_view name) override {
+    if (name == "shape")
+      return shape_;
+    if (name == "data_offsets")
+      return data_offsets_;
+    throw JSON::unknown_value_error{};
+  }
+
+ private:
+  SafetensorsEntry& v_;
+  SafetensorsNumbers_Element shape_{[this](double value) { v_.shape.push_back(static_cast<int64_t>(value)); }};
+  SafetensorsNumbers_Element data_offsets_{[this](double value) { v_.data_offsets.push_back(static_cast<size_t>(value)); }};
+};
+
+// The __metadata__ entry holds free form strings, which are skipped
+struct SafetensorsMetadata_Element : JSON::Element {
+  void OnString(std::string_view /*name*/, std::string_view /*value*/) override {}
+};
+
+struct SafetensorsHeader_Element : JSON::Element {
+  JSON::Element& OnObject(std::string_view name) override {
+    if (name == "__metadata__")
+      return metadata_;
+    auto& entry = entries_.emplace_back(std::string(name), SafetensorsEntry{});
+    entry_element_ = std::make_unique<SafetensorsEntry_Element>(entry.second);
+    return *entry_element_;
+  }
+
+  std::vector<std::pair<std::string, SafetensorsEntry>> entries_;
+
+ private:
+  SafetensorsMetadata_Element metadata_;
+  std::unique_ptr<SafetensorsEntry_Element> entry_element_;
+};
+
+}  // namespace
+
+OffloadedWeights::OffloadedWeights(const Model& model, const fs::path& path) {
+  std::ifstream file = path.open(std::ios::binary);
+  if (!file.is_open())
+    throw std::runtime_error("Error opening " + path.string());
+
+  file.seekg(0, std::ios::end);
+  const uint64_t file_size = static_cast<uint64_t>(file.tellg());
+  file.seekg(0);
+
+  // An 8 byte little endian header size, the JSON header, then the data the header's offsets are relative to
+  uint8_t header_size_bytes[8];
+  if (!file.read(reinterpret_cast<char*>(header_size_bytes), sizeof(header_size_bytes)))
+    throw std::runtime_error("Error reading the safetensors header of " + path.string());
+  uint64_t header_size = 0;
+  for (int i = 7; i >= 0; i--)
+    header_size = header_size << 8 | header_size_bytes[i];
+  // Checked before allocating the header, as a corrupt size could ask for any amount of memory
+  if (header_size > file_size - sizeof(header_size_bytes))
+    throw std::runtime_error("The safetensors header size of " + path.string() + " is past the end of the file");
+  const uint64_t data_size = file_size - sizeof(header_size_bytes) - header_size;
+  std::string header(header_size, '\0');
+  if (!file.read(header.data(), header.size()))
+    throw std::runtime_error("Error reading the safetensors header of " + path.string());
+  const std::streamoff data_start = sizeof(header_size_bytes) + header_size;
+
+  SafetensorsHeader_Element root;
+  JSON::Parse(root, header);
+
+  // The tensors are packed at aligned offsets, in the order of their data in the file so it's read front to back
+  std::sort(root.entries_.begin(), root.entries_.end(), [](const auto& a, const auto& b) { return a.second.data_offsets < b.second.data_offsets; });
+  std::vector<std::pair<size_t, size_t>> file_ranges;
+  for (auto& [name, entry] : root.entries_) {
+    if (entry.data_offsets.size() != 2 || entry.data_offsets[1] < entry.data_offsets[0] || entry.data_offsets[1] > data_size)
+      throw std::runtime_error("Invalid data_offsets for " + name + " in " + path.string());
+    Tensor tensor{name, ParseSafetensorsType(entry.dtype), std::move(entry.shape), bytes_};
+    const size_t tensor_bytes = entry.data_offsets[1] - entry.data_offsets[0];
+    const size_t element_count = std::accumulate(tensor.shape.begin(), tensor.shape.end(), size_t{1}, [](size_t a, int64_t b) { return a * static_cast<size_t>(b); });
+    if (element_count * SizeOf(tensor.type) != tensor_bytes)
+      throw std::runtime_error("The shape of " + name + " doesn't match its data size in " + path.string());
+    file_ranges.emplace_back(entry.data_offsets[0], tensor_bytes);
+    bytes_ = (tensor.offset + tensor_bytes + c_tensor_alignment - 1) / c_tensor_alignment * c_tensor_alignment;
+    tensors_.push_back(std::move(tensor));
+  }
+  if (tensors_.empty())
+    throw std::runtime_error("No offloaded weights in " + path.string());
+
+#if USE_CUDA
+  if (model.device_type_ == DeviceType::CUDA) {
+    pinned_data_ = CudaMallocHostArray<uint8_t>(bytes_);
+    data_ = pinned_data_.get();
+  }
+#endif
+  if (!data_) {
+    cpu_data_ = std::make_unique<uint8_t[]>(bytes_);
+    data_ = cpu_data_.get();
+  }
+
+  for (size_t i = 0; i < tensors_.size(); i++) {
+    file.seekg(data_start + static_cast<std::streamoff>(file_ranges[i].first));
+    if (!file.read(reinterpret_cast<char*>(data_ + tensors_[i].offset), static_cast<std::streamsize>(file_ranges[i].second)))
+      throw std::runtime_error("Error reading " + tensors_[i].name + " from " + path.string());
+  }
+}
+
+WeightStream::WeightStream(const Model& model, std::vector<std::unique_ptr<OffloadedWeights>> stages)
+    : model_{model}, stages_{std::move(stages)} {
+  if (model_.device_type_ != DeviceType::CPU && model_.device_type_ != DeviceType::CUDA)
+    throw std::runtime_error("Offloaded weights are only supported on CPU and CUDA, not " + to_string(model_.device_type_));
+
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA) {
+    size_t largest_bytes = 0;
+    for (auto& weights : stages_) {
+      if (weights)
+        largest_bytes = std::max(largest_bytes, weights->bytes_);
+    }
+    const std::array<int64_t, 1> shape{static_cast<int64_t>(largest_bytes)};
+    for (auto& buffer : buffers_) {
+      buffer.memory = OrtValue::CreateTensor<uint8_t>(*model_.allocator_device_, shape);
+      buffer.copied = std::make_unique<cuda_event_holder>(cudaEventDisableTiming);
+      buffer.released = std::make_unique<cuda_event_holder>(cudaEventDisableTiming);
+    }
+  }
+#endif
+}
+
+WeightStream::Buffer* WeightStream::Find(size_t stage) {
+  for (auto& buffer : buffers_) {
+    if (buffer.stage == stage)
+      return &buffer;
+  }
+  return nullptr;
+}
+
+void WeightStream::CreateTensors(Buffer& buffer, const OffloadedWeights& weights, uint8_t* data) {
+  buffer.tensors.clear();
+  buffer.tensor_pointers.clear();
+  for (auto& tensor : weights.tensors_) {
+    const size_t bytes = SizeOf(tensor.type) * std::accumulate(tensor.shape.begin(), tensor.shape.end(), size_t{1}, [](size_t a, int64_t b) { return a * static_cast<size_t>(b); });
+    buffer.tensors.push_back(OrtValue::CreateTensor(model_.allocator_device_->GetInfo(), data + tensor.offset, bytes, tensor.shape, tensor.type));
+    buffer.tensor_pointers.push_back(buffer.tensors.back().get());
+  }
+}
+
+void WeightStream::Prefetch(size_t stage) {
+  if (!IsOffloaded(stage) || Find(stage))
+    return;
+
+  auto& weights = *stages_[stage];
+  Buffer& buffer = bound_ == &buffers_[0] ? buffers_[1] : buffers_[0];
+  buffer.stage = stage;
+
+  if (model_.device_type_ == DeviceType::CPU) {
+    CreateTensors(buffer, weights, weights.data_);
+    return;
+  }
+
+#if USE_CUDA
+  // The runs of the stage the buffer held have to be done with it first
+  auto* data = buffer.memory->GetTensorMutableData<uint8_t>();
+  cudaStreamWaitEvent(model_.copy_stream_, *buffer.released);
+  CudaCheck() == cudaMemcpyAsync(data, weights.data_, weights.bytes_, cudaMemcpyHostToDevice, model_.copy_stream_);
+  cudaEventRecord(*buffer.copied, model_.copy_stream_);
+  CreateTensors(buffer, weights, data);
+#endif
+}
+
+std::span<OrtValue* const> WeightStream::Bind(size_t stage, [[maybe_unused]] cudaStream_t stream) {
+  Prefetch(stage);
+  bound_ = Find(stage);
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA)
+    cudaStreamWaitEvent(stream, *bound_->copied);
+#endif
+  return bound_->tensor_pointers;
+}
+
+void WeightStream::Release([[maybe_unused]] size_t stage, [[maybe_unused]] cudaStream_t stream) {
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA)
+    cudaEventRecord(*Find(stage)->released, stream);
+#endif
+}
+
+}  // namespace Generators
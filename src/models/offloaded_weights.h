@@ -0,0 +1,71 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// The weights of a pipeline stage that its graph takes as inputs rather than initializers, read from a safetensors file
+// into host memory (pinned on CUDA) for as long as the model. See Config::Model::Decoder::PipelineStage::offloaded_weights
+struct OffloadedWeights {
+  OffloadedWeights(const Model& model, const fs::path& path);
+
+  struct Tensor {
+    std::string name;
+    ONNXTensorElementDataType type;
+    std::vector<int64_t> shape;
+    size_t offset;  // In data_, aligned so a copy of the whole block keeps every tensor aligned on the device
+  };
+
+  std::vector<Tensor> tensors_;
+  size_t bytes_{};
+  uint8_t* data_{};
+
+ private:
+  std::unique_ptr<uint8_t[]> cpu_data_;
+#if USE_CUDA
+  cuda_host_unique_ptr<uint8_t> pinned_data_;
+#endif
+};
+
+// Streams the offloaded weights of a pipeline's stages onto the device, for decoders larger than its memory. There are
+// two device buffers, each the size of the largest stage's weights: while a stage runs from one, the weights of the next
+// are copied into the other on the model's copy stream. A stage whose weights are still in a buffer isn't copied again,
+// so a pipeline of two offloaded stages only copies them on the first step.
+//
+// On CPU the stages run from the host memory of their weights, nothing is copied.
+struct WeightStream {
+  WeightStream(const Model& model, std::vector<std::unique_ptr<OffloadedWeights>> stages);  // nullptr for the stages without
+
+  bool IsOffloaded(size_t stage) const { return stages_[stage] != nullptr; }
+  const OffloadedWeights& GetWeights(size_t stage) const { return *stages_[stage]; }
+
+  // Queues the copy of the stage's weights into the buffer the stage bound last isn't using, unless they're already in one
+  void Prefetch(size_t stage);
+
+  // Returns the stage's weights on the device, in the OffloadedWeights::tensors_ order, after queueing their copy if
+  // Prefetch didn't. The work queued on stream after this waits for the copy. Stays valid until the next Bind
+  std::span<OrtValue* const> Bind(size_t stage, cudaStream_t stream);
+  // Once the runs of the bound stage are queued on stream, so the copy that replaces its weights waits for them
+  void Release(size_t stage, cudaStream_t stream);
+
+ private:
+  struct Buffer {
+    std::unique_ptr<OrtValue> memory;
+    size_t stage{SIZE_MAX};  // Whose weights it holds, or is being copied
+    std::vector<std::unique_ptr<OrtValue>> tensors;
+    std::vector<OrtValue*> tensor_pointers;
+#if USE_CUDA
+    std::unique_ptr<cuda_event_holder> copied, released;
+#endif
+  };
+
+  Buffer* Find(size_t stage);
+  void CreateTensors(Buffer& buffer, const OffloadedWeights& weights, uint8_t* data);
+
+  const Model& model_;
+  std::vector<std::unique_ptr<OffloadedWeights>> stages_;
+  std::array<Buffer, 2> buffers_;
+  Buffer* bound_{};
+};
+
+}  // namespace Generators
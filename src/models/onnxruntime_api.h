@@ -84,6 +84,7 @@ namespace Ort {
 
 /// Before using this C++ wrapper API, you MUST call Ort::InitApi to set the below 'api' variable
 inline const OrtApi* api{};
+inline const OrtApiBase* api_base{};
 inline void InitApi() {
 #if defined(__ANDROID__)
   // If the GenAI library links against the onnxruntime library, it will have a dependency on a specific
@@ -127,6 +128,7 @@ inline void InitApi() {
   if (ort_api_base == nullptr) {
     __android_log_assert("ort_api_base != nullptr", "GenAI", "OrtGetApiBase() returned nullptr");
   }
+  api_base = ort_api_base;
 
   // loop from the ORT version GenAI was built with, down to the minimum ORT version we require.
   // as long as the libonnxruntime.so we loaded supports one of those we're good.
@@ -147,7 +149,8 @@ inline void InitApi() {
                          path.c_str(), ORT_API_VERSION, genai_min_ort_api_version);
   }
 #else   // defined(__ANDROID__)
-  api = OrtGetApiBase()->GetApi(ORT_API_VERSION);
+  api_base = OrtGetApiBase();
+  api = api_base->GetApi(ORT_API_VERSION);
   if (!api)
     throw std::runtime_error("Onnxruntime is installed but is too old, please install a newer version");
 #endif  // defined(__ANDROID__)
@@ -171,6 +174,9 @@ struct Exception : std::exception {
 /// This is a C++ wrapper for OrtApi::GetAvailableProviders() and returns a vector of strings representing the available execution providers.
 std::vector<std::string> GetAvailableProviders();
 
+/// The version of the ONNX Runtime library that was loaded, like "1.19.0"
+inline const char* GetVersionString() { return api_base->GetVersionString(); }
+
 inline void SetCurrentGpuDeviceId(int device_id);
 inline int GetCurrentGpuDeviceId();
 
@@ -357,6 +363,18 @@ struct OrtThreadingOptions {
   Ort::Abstract make_abstract;
 };
 
+/** \brief Wrapper around ::OrtPrepackedWeightsContainer
+ *
+ * Sessions created with the same container share their prepacked weights instead of each keeping a copy
+ */
+struct OrtPrepackedWeightsContainer {
+  /// \brief Wraps OrtApi::CreatePrepackedWeightsContainer
+  static std::unique_ptr<OrtPrepackedWeightsContainer> Create();
+
+  static void operator delete(void* p) { Ort::api->ReleasePrepackedWeightsContainer(reinterpret_cast<OrtPrepackedWeightsContainer*>(p)); }
+  Ort::Abstract make_abstract;
+};
+
 /** \brief Custom Op Domain
  *
  */
@@ -361,6 +361,12 @@ inline std::unique_ptr<OrtThreadingOptions> OrtThreadingOptions::Create() {
   return std::unique_ptr<OrtThreadingOptions>{p};
 }
 
+inline std::unique_ptr<OrtPrepackedWeightsContainer> OrtPrepackedWeightsContainer::Create() {
+  OrtPrepackedWeightsContainer* p;
+  Ort::ThrowOnError(Ort::api->CreatePrepackedWeightsContainer(&p));
+  return std::unique_ptr<OrtPrepackedWeightsContainer>{p};
+}
+
 inline void OrtThreadingOptions::SetGlobalIntraOpNumThreads(int intra_op_num_threads) {
   Ort::ThrowOnError(Ort::api->SetGlobalIntraOpNumThreads(this, intra_op_num_threads));
 }
@@ -15,6 +15,12 @@ PositionInputs::PositionInputs(const Model& model, State& state, RoamingArray<in
   has_mask_input_ = model_.session_info_->HasInput(model_.config_->model.decoder.inputs.attention_mask);
   has_posid_input_ = model_.session_info_->HasInput(model_.config_->model.decoder.inputs.position_ids);
 
+  // The attention mask matches the kv cache, which only keeps the window's entries once it's full
+  if (const auto& search = state_.params_->search; search.kv_window_size > 0) {
+    mask_sink_length_ = search.kv_sink_tokens;
+    mask_window_length_ = search.kv_sink_tokens + search.kv_window_size;
+  }
+
   type_ = Ort::TypeToTensorType<int32_t>::type;
   if (has_mask_input_) {
     type_ = model_.session_info_->GetInputDataType(model_.config_->model.decoder.inputs.attention_mask);
@@ -32,23 +38,44 @@ PositionInputs::PositionInputs(const Model& model, State& state, RoamingArray<in
     throw std::runtime_error("position_ids & attention_mask only support int32 or int64 types");
 
   std::array<int64_t, 2> shape{state_.params_->batch_size, state_.params_->sequence_length};  // Only batch_size initially, as we haven't expanded over the beams yet
-  position_ids_ = OrtValue::CreateTensor(model.allocator_cpu_, shape, type_);
-  position_ids_next_ = OrtValue::CreateTensor(model.allocator_cpu_, std::array<int64_t, 2>{shape[0], 1}, type_);
-  attention_mask_ = OrtValue::CreateTensor(model.allocator_cpu_, shape, type_);
-
   initial_sequence_lengths_.resize(state_.params_->BatchBeamSize());
 
-  if (type_ == Ort::TypeToTensorType<int32_t>::type)
-    InitializeTensors<int32_t>(shape, sequence_lengths_unk);
-  else
-    InitializeTensors<int64_t>(shape, sequence_lengths_unk);
+  const auto prompt_start = state_.GetCachedPrefixLength();
+  const auto prompt_end = state_.GetFirstRunEnd();
+  const bool runs_whole_prompt = prompt_start == 0 && prompt_end == static_cast<size_t>(shape[1]);
 
-  position_ids_ = model_.ExpandInputs(position_ids_, state_.params_->search.num_beams);
-  position_ids_next_ = model_.ExpandInputs(position_ids_next_, state_.params_->search.num_beams);
-  attention_mask_ = model_.ExpandInputs(attention_mask_, state_.params_->search.num_beams);
-  shape[0] *= state_.params_->search.num_beams;
-  position_ids_shape_ = shape;
-  attention_mask_shape_ = shape;
+#if USE_CUDA
+  // Left padded prompts only need their lengths to build the inputs, so build them on the GPU instead of copying them over
+  if (model_.device_type_ == DeviceType::CUDA && runs_whole_prompt && InitializeSequenceLengths(shape, sequence_lengths_unk)) {
+    InitializeTensorsOnDevice(shape);
+  } else
+#endif
+  {
+    position_ids_ = OrtValue::CreateTensor(model.allocator_cpu_, shape, type_);
+    position_ids_next_ = OrtValue::CreateTensor(model.allocator_cpu_, std::array<int64_t, 2>{shape[0], 1}, type_);
+    attention_mask_ = OrtValue::CreateTensor(model.allocator_cpu_, shape, type_);
+
+    if (type_ == Ort::TypeToTensorType<int32_t>::type)
+      InitializeTensors<int32_t>(shape, sequence_lengths_unk);
+    else
+      InitializeTensors<int64_t>(shape, sequence_lengths_unk);
+
+    position_ids_next_ = model_.ExpandInputs(position_ids_next_, state_.params_->search.num_beams, state_.cuda_stream_);
+
+    if (!runs_whole_prompt) {
+      // The first run doesn't cover the whole prompt, so keep the whole prompt's values to slice each run's inputs from
+      assert(state_.params_->BatchBeamSize() == 1);
+      prompt_position_ids_ = std::move(position_ids_);
+      prompt_attention_mask_ = std::move(attention_mask_);
+      SetPromptRange(prompt_start, prompt_end);
+    } else {
+      position_ids_ = model_.ExpandInputs(position_ids_, state_.params_->search.num_beams, state_.cuda_stream_);
+      attention_mask_ = model_.ExpandInputs(attention_mask_, state_.params_->search.num_beams, state_.cuda_stream_);
+      shape[0] *= state_.params_->search.num_beams;
+      position_ids_shape_ = shape;
+      attention_mask_shape_ = shape;
+    }
+  }
 
   if (state_.GetCapturedGraphInfo()) {
     if (has_posid_input_) {
@@ -64,6 +91,13 @@ PositionInputs::PositionInputs(const Model& model, State& state, RoamingArray<in
 #endif
     }
   }
+
+  if (auto* prompt_graph = state_.GetCapturedPromptGraph()) {
+    if (has_posid_input_)
+      position_ids_ = CopyToStaticBuffer(*prompt_graph->sb_position_ids_, *position_ids_, state_.cuda_stream_);
+    if (has_mask_input_)
+      attention_mask_ = CopyToStaticBuffer(*prompt_graph->sb_attention_mask_, *attention_mask_, state_.cuda_stream_);
+  }
 }
 
 void PositionInputs::Add() {
@@ -84,6 +118,85 @@ void PositionInputs::Update(int current_length) {
   }
 }
 
+void PositionInputs::SetPromptRange(size_t start, size_t end) {
+  // Positions are only for the tokens being run, the attention mask covers everything up to the last of them
+  auto slice = [this](const OrtValue& prompt_value, size_t offset, size_t count) {
+    auto value = OrtValue::CreateTensor(model_.allocator_cpu_, std::array<int64_t, 2>{1, static_cast<int64_t>(count)}, type_);
+    const auto element_size = SizeOf(type_);
+    std::memcpy(value->GetTensorMutableRawData(), static_cast<const uint8_t*>(prompt_value.GetTensorRawData()) + offset * element_size, count * element_size);
+    return model_.ExpandInputs(value, 1, state_.cuda_stream_);
+  };
+
+  position_ids_ = slice(*prompt_position_ids_, start, end - start);
+  attention_mask_ = slice(*prompt_attention_mask_, 0, end);
+  mask_buffer_in_use_ = -1;
+  position_ids_shape_ = {1, static_cast<int64_t>(end - start)};
+  attention_mask_shape_ = {1, static_cast<int64_t>(end)};
+}
+
+void PositionInputs::AdvancePrompt(size_t start, size_t end) {
+  SetPromptRange(start, end);
+  if (has_posid_input_)
+    state_.inputs_[posid_input_index_] = position_ids_.get();
+  if (has_mask_input_)
+    state_.inputs_[mask_input_index_] = attention_mask_.get();
+}
+
+void PositionInputs::MoveOffStepArena() {
+  // Only the masks made by Update() come from the step allocator
+  if (!has_mask_input_ || sb_attention_mask_ || is_first_mask_update_ || mask_buffer_in_use_ >= 0)
+    return;
+
+  auto attention_mask = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::PositionInputs), attention_mask_shape_, type_);
+  const size_t bytes = SizeOf(type_) * attention_mask_shape_[0] * attention_mask_shape_[1];
+#if USE_CUDA
+  if (model_.device_type_ == DeviceType::CUDA)
+    CudaCheck() == cudaMemcpyAsync(attention_mask->GetTensorMutableRawData(), attention_mask_->GetTensorRawData(), bytes, cudaMemcpyDeviceToDevice, state_.cuda_stream_);
+  else
+#endif
+    std::memcpy(attention_mask->GetTensorMutableRawData(), attention_mask_->GetTensorRawData(), bytes);
+  state_.ReleaseAfterQueuedWork(std::exchange(attention_mask_, std::move(attention_mask)));
+  attention_mask_next_.reset();
+  state_.inputs_[mask_input_index_] = attention_mask_.get();
+}
+
+void PositionInputs::DropRows(std::span<const int32_t> rows) {
+  // The positions are incremented and the mask grown from these from now on, so they go on the device allocator
+  assert(!sb_position_ids_ && !sb_attention_mask_);
+  auto drop_rows = [&](std::unique_ptr<OrtValue>& value, std::array<int64_t, 2>& shape) {
+    const size_t bytes_per_row = SizeOf(type_) * shape[1];
+    shape[0] = static_cast<int64_t>(rows.size());
+    auto kept = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::PositionInputs), shape, type_);
+    GatherRows(model_, value->GetTensorRawData(), kept->GetTensorMutableRawData(), rows, bytes_per_row, state_.cuda_stream_);
+    state_.ReleaseAfterQueuedWork(std::exchange(value, std::move(kept)));
+  };
+
+  if (has_posid_input_) {
+    assert(!is_first_posid_update_);
+    drop_rows(position_ids_, position_ids_shape_);
+    state_.inputs_[posid_input_index_] = position_ids_.get();
+  }
+  if (has_mask_input_) {
+    assert(!is_first_mask_update_);
+    drop_rows(attention_mask_, attention_mask_shape_);
+    mask_buffer_in_use_ = -1;
+    state_.inputs_[mask_input_index_] = attention_mask_.get();
+  }
+}
+
+void PositionInputs::AdvanceSequence(size_t start, size_t end) {
+  assert(state_.params_->BatchBeamSize() == 1);
+  if (type_ == Ort::TypeToTensorType<int32_t>::type)
+    SetSequenceRangeImpl<int32_t>(start, end);
+  else
+    SetSequenceRangeImpl<int64_t>(start, end);
+
+  if (has_posid_input_)
+    state_.inputs_[posid_input_index_] = position_ids_.get();
+  if (has_mask_input_)
+    state_.inputs_[mask_input_index_] = attention_mask_.get();
+}
+
 void PositionInputs::AddAttentionMask() {
   mask_input_index_ = state_.inputs_.size();
 
@@ -113,13 +226,13 @@ void PositionInputs::UpdatePositionIDs(int current_length) {
                         position_ids_next_->GetTensorData<int32_t>(),
                         sizeof(int32_t) * position_ids_shape_[0],
                         cudaMemcpyDeviceToDevice,
-                        model_.cuda_stream_);
+                        state_.cuda_stream_);
       } else {
         cudaMemcpyAsync(position_ids_->GetTensorMutableRawData(),
                         position_ids_next_->GetTensorData<int64_t>(),
                         sizeof(int64_t) * position_ids_shape_[0],
                         cudaMemcpyDeviceToDevice,
-                        model_.cuda_stream_);
+                        state_.cuda_stream_);
       }
 #elif USE_DML
       position_ids_ = sb_position_ids_->CreateTensorOnStaticBuffer(position_ids_shape_, type_);
@@ -182,9 +295,9 @@ void PositionInputs::UpdatePositionIDs(int current_length) {
 #if USE_CUDA
       case DeviceType::CUDA:
         if (type_ == Ort::TypeToTensorType<int32_t>::type)
-          cuda::Launch_UpdatePositionIds(position_ids_->GetTensorMutableData<int32_t>(), static_cast<int>(position_ids_shape_[0]), model_.cuda_stream_);
+          cuda::Launch_UpdatePositionIds(position_ids_->GetTensorMutableData<int32_t>(), static_cast<int>(position_ids_shape_[0]), state_.cuda_stream_);
         else
-          cuda::Launch_UpdatePositionIds(position_ids_->GetTensorMutableData<int64_t>(), static_cast<int>(position_ids_shape_[0]), model_.cuda_stream_);
+          cuda::Launch_UpdatePositionIds(position_ids_->GetTensorMutableData<int64_t>(), static_cast<int>(position_ids_shape_[0]), state_.cuda_stream_);
         break;
 #endif
       default:
@@ -194,6 +307,11 @@ void PositionInputs::UpdatePositionIDs(int current_length) {
 }
 
 void PositionInputs::UpdateAttentionMask(int current_length) {
+  if (!sb_attention_mask_ && model_.device_type_ != DeviceType::DML) {
+    UpdateAttentionMaskInBuffer(current_length);
+    return;
+  }
+
   // Update attention mask
   if (sb_attention_mask_) {
 #if USE_CUDA
@@ -204,12 +322,12 @@ void PositionInputs::UpdateAttentionMask(int current_length) {
         cudaMemsetAsync(attention_mask_next_->GetTensorMutableRawData(),
                         0,
                         sizeof(int32_t) * attention_mask_shape_[0] * attention_mask_shape_[1],
-                        model_.cuda_stream_);
+                        state_.cuda_stream_);
       } else {
         cudaMemsetAsync(attention_mask_next_->GetTensorMutableRawData(),
                         0,
                         sizeof(int64_t) * attention_mask_shape_[0] * attention_mask_shape_[1],
-                        model_.cuda_stream_);
+                        state_.cuda_stream_);
       }
     }
 #elif USE_DML
@@ -218,16 +336,20 @@ void PositionInputs::UpdateAttentionMask(int current_length) {
     attention_mask_next_ = sb_attention_mask_next_->CreateTensorOnStaticBuffer(attention_mask_shape_, type_);
 #endif
   } else {
-    assert(attention_mask_shape_[1] == current_length - 1);  // We should always be growing by 1
-    attention_mask_shape_[1] = current_length;
+    // The DML kernel is built for the mask tensors of its first updates, so DML keeps a new mask every step
+    const int old_mask_length = static_cast<int>(attention_mask_shape_[1]);
+    int past_mask_length = current_length - 1;
+    if (mask_window_length_)
+      past_mask_length = std::min(old_mask_length, mask_window_length_);
+    else
+      assert(old_mask_length == current_length - 1);  // We should always be growing by 1
+    attention_mask_shape_[1] = past_mask_length + 1;
 
 #if USE_DML
-    if (model_.device_type_ == DeviceType::DML) {
-      attention_mask_ = OrtValue::CreateTensor(*model_.allocator_device_, attention_mask_shape_, type_);
-    }
+    attention_mask_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::PositionInputs), attention_mask_shape_, type_);
 #endif
 
-    attention_mask_next_ = OrtValue::CreateTensor(*model_.allocator_device_, attention_mask_shape_, type_);
+    attention_mask_next_ = OrtValue::CreateTensor(state_.GetStepAllocator(), attention_mask_shape_, type_);
   }
 
   switch (model_.device_type_) {
@@ -269,21 +391,10 @@ void PositionInputs::UpdateAttentionMask(int current_length) {
       break;
     }
 #endif
-    case DeviceType::CPU: {
-      if (type_ == Ort::TypeToTensorType<int32_t>::type)
-        UpdateAttentionMaskImpl(attention_mask_next_->GetTensorMutableData<int32_t>(),
-                                attention_mask_->GetTensorData<int32_t>(),
-                                current_length);
-      else
-        UpdateAttentionMaskImpl(attention_mask_next_->GetTensorMutableData<int64_t>(),
-                                attention_mask_->GetTensorData<int64_t>(),
-                                current_length);
-      break;
-    }
 #if USE_CUDA
     case DeviceType::CUDA: {
-      int max_seq_len = sb_attention_mask_ ? state_.params_->search.max_length : current_length;
-      bool update_only = sb_attention_mask_ && !is_first_mask_update_;
+      const int max_seq_len = state_.params_->search.max_length;
+      const bool update_only = !is_first_mask_update_;
       if (type_ == Ort::TypeToTensorType<int32_t>::type) {
         cuda::Launch_UpdateAttentionMask(attention_mask_next_->GetTensorMutableData<int32_t>(),
                                          attention_mask_->GetTensorData<int32_t>(),
@@ -291,7 +402,7 @@ void PositionInputs::UpdateAttentionMask(int current_length) {
                                          current_length,
                                          max_seq_len,
                                          update_only,
-                                         model_.cuda_stream_);
+                                         state_.cuda_stream_);
       } else {
         cuda::Launch_UpdateAttentionMask(attention_mask_next_->GetTensorMutableData<int64_t>(),
                                          attention_mask_->GetTensorData<int64_t>(),
@@ -299,7 +410,7 @@ void PositionInputs::UpdateAttentionMask(int current_length) {
                                          current_length,
                                          max_seq_len,
                                          update_only,
-                                         model_.cuda_stream_);
+                                         state_.cuda_stream_);
       }
       break;
     }
@@ -321,6 +432,79 @@ void PositionInputs::UpdateAttentionMask(int current_length) {
   is_first_mask_update_ = false;
 }
 
+void PositionInputs::UpdateAttentionMaskInBuffer(int current_length) {
+  const int64_t rows = attention_mask_shape_[0];
+  const int old_mask_length = static_cast<int>(attention_mask_shape_[1]);
+  int past_mask_length = current_length - 1;  // How many of the old mask's entries the new one keeps
+  if (mask_window_length_) {
+    // Drops the same entries as the kv cache, positions are unaffected as they keep counting the whole sequence
+    past_mask_length = std::min(old_mask_length, mask_window_length_);
+  } else
+    assert(old_mask_length == current_length - 1);  // We should always be growing by 1
+  attention_mask_shape_[1] = past_mask_length + 1;
+
+  // The mask of every step is a view of one of the buffers. A single row stays where it is, as long as none of its
+  // entries move it only needs the new one set. The rows of a batch move with every step, so they're copied to the
+  // other buffer with the longer rows
+  const bool in_place = mask_buffer_in_use_ >= 0 && rows == 1 && past_mask_length == old_mask_length;
+  const int buffer = in_place ? mask_buffer_in_use_ : (mask_buffer_in_use_ == 0 ? 1 : 0);
+  if (!mask_buffers_[buffer])
+    mask_buffers_[buffer] = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::PositionInputs), std::array<int64_t, 1>{rows * state_.params_->search.max_length}, type_);
+
+  void* data = mask_buffers_[buffer]->GetTensorMutableRawData();
+  const size_t bytes = SizeOf(type_) * rows * attention_mask_shape_[1];
+  auto attention_mask = OrtValue::CreateTensor(model_.allocator_device_->GetInfo(), data, bytes, attention_mask_shape_, type_);
+
+  switch (model_.device_type_) {
+    case DeviceType::CPU: {
+      if (in_place) {
+        if (type_ == Ort::TypeToTensorType<int32_t>::type)
+          static_cast<int32_t*>(data)[past_mask_length] = 1;
+        else
+          static_cast<int64_t*>(data)[past_mask_length] = 1;
+      } else if (type_ == Ort::TypeToTensorType<int32_t>::type)
+        UpdateAttentionMaskImpl(static_cast<int32_t*>(data), attention_mask_->GetTensorData<int32_t>(), old_mask_length, past_mask_length);
+      else
+        UpdateAttentionMaskImpl(static_cast<int64_t*>(data), attention_mask_->GetTensorData<int64_t>(), old_mask_length, past_mask_length);
+      break;
+    }
+#if USE_CUDA
+    case DeviceType::CUDA: {
+      const bool is_int32 = type_ == Ort::TypeToTensorType<int32_t>::type;
+      if (in_place) {
+        // Sets the entry after the first past_mask_length of the row
+        if (is_int32)
+          cuda::Launch_UpdateAttentionMask(static_cast<int32_t*>(data), static_cast<const int32_t*>(nullptr), 1, past_mask_length, past_mask_length + 1, true, state_.cuda_stream_);
+        else
+          cuda::Launch_UpdateAttentionMask(static_cast<int64_t*>(data), static_cast<const int64_t*>(nullptr), 1, past_mask_length, past_mask_length + 1, true, state_.cuda_stream_);
+      } else if (past_mask_length != old_mask_length) {
+        if (is_int32)
+          cuda::Launch_SlideAttentionMask(static_cast<int32_t*>(data), attention_mask_->GetTensorData<int32_t>(), static_cast<int>(rows),
+                                          old_mask_length, past_mask_length, mask_sink_length_, state_.cuda_stream_);
+        else
+          cuda::Launch_SlideAttentionMask(static_cast<int64_t*>(data), attention_mask_->GetTensorData<int64_t>(), static_cast<int>(rows),
+                                          old_mask_length, past_mask_length, mask_sink_length_, state_.cuda_stream_);
+      } else {
+        if (is_int32)
+          cuda::Launch_UpdateAttentionMask(static_cast<int32_t*>(data), attention_mask_->GetTensorData<int32_t>(), static_cast<int>(rows),
+                                           current_length, current_length, false, state_.cuda_stream_);
+        else
+          cuda::Launch_UpdateAttentionMask(static_cast<int64_t*>(data), attention_mask_->GetTensorData<int64_t>(), static_cast<int>(rows),
+                                           current_length, current_length, false, state_.cuda_stream_);
+      }
+      break;
+    }
+#endif
+    default:
+      throw std::runtime_error("PositionIDs::Update - Unsupported device type");
+  }
+
+  attention_mask_ = std::move(attention_mask);
+  mask_buffer_in_use_ = buffer;
+  state_.inputs_[mask_input_index_] = attention_mask_.get();
+  is_first_mask_update_ = false;
+}
+
 template <typename T>
 void PositionInputs::InitializeTensors(std::array<int64_t, 2> shape, cpu_span<int32_t> sequence_lengths) {
   // Set attention mask to be 0 for pad tokens, and 1 for all other tokens.
@@ -351,6 +535,70 @@ void PositionInputs::InitializeTensors(std::array<int64_t, 2> shape, cpu_span<in
   }
 }
 
+bool PositionInputs::InitializeSequenceLengths(std::array<int64_t, 2> shape, cpu_span<int32_t> sequence_lengths) {
+  // A row's length is its count of non pad tokens, which only describes its inputs when all of the pad tokens lead
+  const auto* word_id = state_.params_->input_ids.data();
+  bool left_padded = true;
+  for (int i = 0; i < shape[0]; i++) {
+    int32_t length = 0;
+    for (int j = 0; j < shape[1]; j++, word_id++) {
+      if (*word_id != state_.params_->pad_token_id)
+        length++;
+      else if (length != 0)
+        left_padded = false;
+    }
+
+    for (int k = 0; k < state_.params_->search.num_beams; k++) {
+      sequence_lengths[i * state_.params_->search.num_beams + k] = length;
+      initial_sequence_lengths_[i * state_.params_->search.num_beams + k] = length;
+    }
+  }
+  return left_padded;
+}
+
+#if USE_CUDA
+void PositionInputs::InitializeTensorsOnDevice(std::array<int64_t, 2> shape) {
+  shape[0] *= state_.params_->search.num_beams;
+  position_ids_shape_ = shape;
+  attention_mask_shape_ = shape;
+
+  position_ids_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::PositionInputs), shape, type_);
+  position_ids_next_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::PositionInputs), std::array<int64_t, 2>{shape[0], 1}, type_);
+  attention_mask_ = OrtValue::CreateTensor(model_.GetDeviceAllocator(AllocationSite::PositionInputs), shape, type_);
+
+  // The lengths are the only thing copied over, and stay alive with the inputs as the kernel runs asynchronously
+  sequence_lengths_device_ = OrtValue::CreateTensor<int32_t>(model_.GetDeviceAllocator(AllocationSite::PositionInputs), std::array<int64_t, 1>{shape[0]});
+  cudaMemcpyAsync(sequence_lengths_device_->GetTensorMutableData<int32_t>(), initial_sequence_lengths_.data(),
+                  sizeof(int32_t) * shape[0], cudaMemcpyHostToDevice, state_.cuda_stream_);
+
+  const auto* lengths = sequence_lengths_device_->GetTensorData<int32_t>();
+  if (type_ == Ort::TypeToTensorType<int32_t>::type)
+    cuda::Launch_InitPositionInputs(position_ids_->GetTensorMutableData<int32_t>(), attention_mask_->GetTensorMutableData<int32_t>(),
+                                    position_ids_next_->GetTensorMutableData<int32_t>(), lengths,
+                                    static_cast<int>(shape[0]), static_cast<int>(shape[1]), state_.cuda_stream_);
+  else
+    cuda::Launch_InitPositionInputs(position_ids_->GetTensorMutableData<int64_t>(), attention_mask_->GetTensorMutableData<int64_t>(),
+                                    position_ids_next_->GetTensorMutableData<int64_t>(), lengths,
+                                    static_cast<int>(shape[0]), static_cast<int>(shape[1]), state_.cuda_stream_);
+}
+#endif
+
+template <typename T>
+void PositionInputs::SetSequenceRangeImpl(size_t start, size_t end) {
+  // Without padding, a token's position is its index and the attention mask is all ones
+  position_ids_shape_ = {1, static_cast<int64_t>(end - start)};
+  attention_mask_shape_ = {1, static_cast<int64_t>(end)};
+
+  auto position_ids = OrtValue::CreateTensor(model_.allocator_cpu_, position_ids_shape_, type_);
+  std::iota(position_ids->GetTensorMutableData<T>(), position_ids->GetTensorMutableData<T>() + (end - start), static_cast<T>(start));
+  auto attention_mask = OrtValue::CreateTensor(model_.allocator_cpu_, attention_mask_shape_, type_);
+  std::fill_n(attention_mask->GetTensorMutableData<T>(), end, T{1});
+
+  position_ids_ = model_.ExpandInputs(position_ids, 1, state_.cuda_stream_);
+  attention_mask_ = model_.ExpandInputs(attention_mask, 1, state_.cuda_stream_);
+  mask_buffer_in_use_ = -1;
+}
+
 template <typename T>
 void PositionInputs::UpdatePositionIDsImpl() {
   // Increment position IDs
@@ -361,13 +609,89 @@ void PositionInputs::UpdatePositionIDsImpl() {
 };
 
 template <typename T>
-void PositionInputs::UpdateAttentionMaskImpl(T* data, const T* old_data, int current_length) {
+void PositionInputs::UpdateAttentionMaskImpl(T* data, const T* old_data, int old_length, int past_length) {
+  // Keeps the sink entries and the most recent ones of the old mask, which is all of it unless the kv window is full
+  const int dropped = old_length - past_length;
+  const int length = past_length + 1;
   for (int i = 0; i < attention_mask_shape_[0]; i++) {
-    for (int j = 0; j < current_length - 1; j++) {
-      data[i * current_length + j] = old_data[i * (current_length - 1) + j];
+    for (int j = 0; j < past_length; j++) {
+      data[i * length + j] = old_data[i * old_length + (j < mask_sink_length_ ? j : j + dropped)];
     }
-    data[i * current_length + current_length - 1] = 1;
+    data[i * length + past_length] = 1;
   }
 };
 
+WindowedPositionInputs::WindowedPositionInputs(const Model& model, State& state)
+    : model_{model},
+      state_{state},
+      context_length_{static_cast<size_t>(model_.config_->model.context_length)} {
+  has_mask_input_ = model_.session_info_->HasInput(model_.config_->model.decoder.inputs.attention_mask);
+  has_posid_input_ = model_.session_info_->HasInput(model_.config_->model.decoder.inputs.position_ids);
+
+  type_ = Ort::TypeToTensorType<int32_t>::type;
+  if (has_mask_input_)
+    type_ = model_.session_info_->GetInputDataType(model_.config_->model.decoder.inputs.attention_mask);
+  if (has_posid_input_) {
+    if (has_mask_input_ && model_.session_info_->GetInputDataType(model_.config_->model.decoder.inputs.position_ids) != type_)
+      throw std::runtime_error("position_ids & attention_mask must have the same data type");
+    type_ = model_.session_info_->GetInputDataType(model_.config_->model.decoder.inputs.position_ids);
+  }
+
+  if (type_ != Ort::TypeToTensorType<int32_t>::type && type_ != Ort::TypeToTensorType<int64_t>::type)
+    throw std::runtime_error("position_ids & attention_mask only support int32 or int64 types");
+
+  // With a fixed size mask, it is the only way the model can tell the valid past slots from the rest
+  if (!has_mask_input_)
+    throw std::runtime_error("model.decoder.static_window_size needs a model with an attention_mask input");
+}
+
+void WindowedPositionInputs::Add() {
+  if (has_posid_input_) {
+    posid_input_index_ = state_.inputs_.size();
+    state_.inputs_.push_back(position_ids_.get());
+    state_.input_names_.push_back(model_.config_->model.decoder.inputs.position_ids.c_str());
+  }
+  if (has_mask_input_) {
+    mask_input_index_ = state_.inputs_.size();
+    state_.inputs_.push_back(attention_mask_.get());
+    state_.input_names_.push_back(model_.config_->model.decoder.inputs.attention_mask.c_str());
+  }
+}
+
+void WindowedPositionInputs::SetWindow(size_t window_size, size_t past_length, size_t token_count) {
+  if (type_ == Ort::TypeToTensorType<int32_t>::type)
+    SetWindowImpl<int32_t>(window_size, past_length, token_count);
+  else
+    SetWindowImpl<int64_t>(window_size, past_length, token_count);
+}
+
+template <typename T>
+void WindowedPositionInputs::SetWindowImpl(size_t window_size, size_t past_length, size_t token_count) {
+  assert(token_count <= window_size && past_length + window_size <= context_length_);
+
+  if (has_posid_input_) {
+    const std::array<int64_t, 2> shape{1, static_cast<int64_t>(window_size)};
+    if (!position_ids_ || position_ids_->GetTensorTypeAndShapeInfo()->GetShape()[1] != shape[1]) {
+      position_ids_ = OrtValue::CreateTensor(model_.allocator_cpu_, shape, type_);
+      if (posid_input_index_ != ~0U)
+        state_.inputs_[posid_input_index_] = position_ids_.get();
+    }
+    // The pad tokens after the window's tokens are masked out, they just continue the positions
+    auto* position_ids = position_ids_->GetTensorMutableData<T>();
+    std::iota(position_ids, position_ids + window_size, static_cast<T>(past_length));
+  }
+
+  if (!attention_mask_) {
+    attention_mask_ = OrtValue::CreateTensor(model_.allocator_cpu_, std::array<int64_t, 2>{1, static_cast<int64_t>(context_length_)}, type_);
+    if (mask_input_index_ != ~0U)
+      state_.inputs_[mask_input_index_] = attention_mask_.get();
+  }
+  auto* mask = attention_mask_->GetTensorMutableData<T>();
+  const size_t window_start = context_length_ - window_size;
+  std::fill(mask, mask + past_length, T{1});
+  std::fill(mask + past_length, mask + window_start, T{0});
+  std::fill(mask + window_start, mask + window_start + token_count, T{1});
+  std::fill(mask + window_start + token_count, mask + context_length_, T{0});
+}
+
 }  // namespace Generators
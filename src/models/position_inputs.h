@@ -14,21 +14,34 @@ struct PositionInputs {
 
   void Add();
   void Update(int current_length);
+  void AdvancePrompt(size_t start, size_t end);  // Switch to the prompt tokens [start, end) for the next chunk of a chunked prefill
+  void AdvanceSequence(size_t start, size_t end);  // Switch to the positions [start, end) of a single unpadded sequence, as run by speculative decoding
+  void MoveOffStepArena();  // Copies the attention mask off the state's step allocator, so its arenas can be released
+  void DropRows(std::span<const int32_t> rows);  // After an Update(), keeps only the given rows of the batch, in that order
 
  private:
+  void SetPromptRange(size_t start, size_t end);
   void AddAttentionMask();
   void AddPositionIDs();
 
   void UpdatePositionIDs(int current_length);
   void UpdateAttentionMask(int current_length);
+  void UpdateAttentionMaskInBuffer(int current_length);  // Without a static buffer, on CPU & CUDA
 
+  bool InitializeSequenceLengths(std::array<int64_t, 2> shape, cpu_span<int32_t> sequence_lengths);  // Returns true if every row is left padded
+#if USE_CUDA
+  void InitializeTensorsOnDevice(std::array<int64_t, 2> shape);
+#endif
   template <typename T>
   void InitializeTensors(std::array<int64_t, 2> shape, cpu_span<int32_t> sequence_lengths);
 
+  template <typename T>
+  void SetSequenceRangeImpl(size_t start, size_t end);
+
   template <typename T>
   void UpdatePositionIDsImpl();
   template <typename T>
-  void UpdateAttentionMaskImpl(T* data, const T* old_data, int current_length);
+  void UpdateAttentionMaskImpl(T* data, const T* old_data, int old_length, int past_length);
 
   const Model& model_;
   State& state_;
@@ -41,6 +54,10 @@ struct PositionInputs {
   bool has_mask_input_{false};
   bool has_posid_input_{false};
 
+  // Set from search.kv_window_size, the attention mask then keeps at most mask_window_length_ past entries like the kv cache
+  int mask_sink_length_{};
+  int mask_window_length_{};
+
   std::array<int64_t, 2> position_ids_shape_{};  // {params.batch_size*params.beam_size, params.sequence_length}
   std::unique_ptr<OrtValue> position_ids_;
   std::array<int64_t, 2> attention_mask_shape_{};  // {params.batch_size*params.beam_size, params.sequence_length}
@@ -48,7 +65,18 @@ struct PositionInputs {
 
   std::unique_ptr<OrtValue> position_ids_next_;    // Replaces position_ids_ after the first Run() call
   std::unique_ptr<OrtValue> attention_mask_next_;  // Replaces attention_mask_ after the first Run() call
+
+  // Allocated once with max_length columns for every row, attention_mask_ is a view of one of them after an update
+  std::array<std::unique_ptr<OrtValue>, 2> mask_buffers_;
+  int mask_buffer_in_use_{-1};  // The one attention_mask_ is a view of, -1 for none
+
+  // Values for the whole prompt on the CPU, when the prompt is run after a cached prefix or in chunks
+  std::unique_ptr<OrtValue> prompt_position_ids_;
+  std::unique_ptr<OrtValue> prompt_attention_mask_;
   std::vector<int32_t> initial_sequence_lengths_;
+#if USE_CUDA
+  std::unique_ptr<OrtValue> sequence_lengths_device_;  // Source of the inputs built on the GPU
+#endif
 
   // Used for decoding runs with cuda graphs.
   StaticBuffer* sb_position_ids_{};
@@ -65,4 +93,33 @@ struct PositionInputs {
 #endif
 };
 
+// The position ids, {1, window_size}, and attention mask, {1, context_length}, of a decoder with static shapes. The mask
+// covers the past slots of the kv caches, context_length - window_size of them, followed by the window, and only the
+// first past_length slots and the window's tokens are attended to. See DecoderOnly_WindowedState
+struct WindowedPositionInputs {
+  WindowedPositionInputs(const Model& model, State& state);
+  WindowedPositionInputs(const WindowedPositionInputs&) = delete;
+  WindowedPositionInputs& operator=(const WindowedPositionInputs&) = delete;
+
+  void Add();
+  void SetWindow(size_t window_size, size_t past_length, size_t token_count);
+
+ private:
+  template <typename T>
+  void SetWindowImpl(size_t window_size, size_t past_length, size_t token_count);
+
+  const Model& model_;
+  State& state_;
+  size_t context_length_;
+
+  size_t mask_input_index_{~0U};
+  size_t posid_input_index_{~0U};
+  bool has_mask_input_{false};
+  bool has_posid_input_{false};
+
+  ONNXTensorElementDataType type_;  // Common type for position_ids and attention_mask
+  std::unique_ptr<OrtValue> position_ids_;
+  std::unique_ptr<OrtValue> attention_mask_;
+};
+
 }  // namespace Generators
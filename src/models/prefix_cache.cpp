@@ -0,0 +1,530 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "model.h"
+#include "prefix_cache.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Generators {
+
+namespace {
+
+// Hash of every block_size aligned prefix of tokens, in a single pass. Index i is the hash of the first (i+1)*block_size tokens
+std::vector<size_t> HashPrefixes(std::span<const int32_t> tokens, size_t block_size, size_t max_length) {
+  std::vector<size_t> hashes;
+  uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+  for (size_t i = 0; i < max_length; i++) {
+    hash = (hash ^ static_cast<uint32_t>(tokens[i])) * 1099511628211ULL;
+    if ((i + 1) % block_size == 0)
+      hashes.push_back(static_cast<size_t>(hash));
+  }
+  return hashes;
+}
+
+size_t GetValueBytes(const OrtValue& value) {
+  auto info = value.GetTensorTypeAndShapeInfo();
+  return info->GetElementCount() * SizeOf(info->GetElementType());
+}
+
+size_t GetKVBytes(const PrefixCache::Entry& entry) {
+  if (entry.shared_block)
+    return 0;  // Allocated by the process that exported it
+  size_t bytes = 0;
+  for (auto& value : entry.kv)
+    bytes += GetValueBytes(*value);
+  return bytes;
+}
+
+constexpr uint32_t c_serialized_magic = 0x564B474F;  // "OGKV"
+constexpr uint32_t c_serialized_version = 1;
+
+constexpr uint32_t c_shared_magic = 0x534B474F;  // "OGKS"
+constexpr uint32_t c_shared_version = 1;
+constexpr size_t c_shared_alignment = 256;
+
+enum struct SharedBlockKind : uint32_t {
+  Host,
+  Cuda,
+};
+
+// Memory that other processes can map, which the kv caches of exported and imported entries are in
+struct SharedBlock {
+  SharedBlock(const SharedBlock&) = delete;
+  SharedBlock& operator=(const SharedBlock&) = delete;
+  virtual ~SharedBlock() = default;
+
+  uint8_t* data{};
+  size_t bytes{};
+  std::vector<uint8_t> handle;  // What another process opens it with
+
+ protected:
+  SharedBlock() = default;
+};
+
+struct HostSharedBlock : SharedBlock {
+  // Creates a new block for export, or maps an exported one read only
+  HostSharedBlock(size_t bytes, std::string_view import_name = {}) {
+    this->bytes = bytes;
+    owned_ = import_name.empty();
+    if (owned_) {
+      static std::atomic<uint32_t> count;
+#ifdef _WIN32
+      name_ = "Local\\oga_kv_" + std::to_string(GetCurrentProcessId()) + "_" + std::to_string(count++);
+#else
+      name_ = "/oga_kv_" + std::to_string(getpid()) + "_" + std::to_string(count++);
+#endif
+    } else
+      name_ = import_name;
+
+#ifdef _WIN32
+    mapping_ = owned_ ? CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(uint64_t{bytes} >> 32), static_cast<DWORD>(bytes), name_.c_str())
+                      : OpenFileMappingA(FILE_MAP_READ, FALSE, name_.c_str());
+    if (!mapping_)
+      throw std::runtime_error("Couldn't " + std::string(owned_ ? "create" : "open") + " the shared memory " + name_);
+    data = static_cast<uint8_t*>(MapViewOfFile(mapping_, owned_ ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, bytes));
+    MEMORY_BASIC_INFORMATION info{};
+    const bool fits = owned_ || !data || (VirtualQuery(data, &info, sizeof(info)) && info.RegionSize >= bytes);
+#else
+    const int fd = owned_ ? shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600) : shm_open(name_.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+      throw std::runtime_error("Couldn't " + std::string(owned_ ? "create" : "open") + " the shared memory " + name_);
+    struct stat info {};
+    const bool fits = owned_ || (fstat(fd, &info) == 0 && static_cast<uint64_t>(info.st_size) >= bytes);
+    void* mapped = MAP_FAILED;
+    if (owned_ ? ftruncate(fd, static_cast<off_t>(bytes)) == 0 : fits)
+      mapped = mmap(nullptr, bytes, owned_ ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    data = mapped == MAP_FAILED ? nullptr : static_cast<uint8_t*>(mapped);
+#endif
+    // Reading past the end of a smaller segment would fault in the session instead of throwing here
+    if (!fits) {
+      Close();
+      throw std::runtime_error("The shared memory " + name_ + " is smaller than the " + std::to_string(bytes) + " bytes of its description");
+    }
+    if (!data) {
+      Close();
+      throw std::runtime_error("Couldn't map " + std::to_string(bytes) + " bytes of the shared memory " + name_);
+    }
+    handle.assign(name_.begin(), name_.end());
+  }
+
+  ~HostSharedBlock() override { Close(); }
+
+ private:
+  void Close() {
+#ifdef _WIN32
+    if (data)
+      UnmapViewOfFile(data);
+    if (mapping_)
+      CloseHandle(mapping_);
+#else
+    if (data)
+      munmap(data, bytes);
+    if (owned_)
+      shm_unlink(name_.c_str());  // The processes that mapped it keep their mappings
+#endif
+    data = nullptr;
+  }
+
+  std::string name_;
+  bool owned_;
+#ifdef _WIN32
+  HANDLE mapping_{};
+#endif
+};
+
+#if USE_CUDA
+struct CudaSharedBlock : SharedBlock {
+  // Allocates a new block for export, or opens an exported one
+  CudaSharedBlock(size_t bytes, std::span<const uint8_t> import_handle = {}) {
+    this->bytes = bytes;
+    owned_ = import_handle.empty();
+    cudaIpcMemHandle_t ipc_handle;
+    if (owned_) {
+      CudaCheck() == cudaMalloc(&data, bytes);
+      CudaCheck() == cudaIpcGetMemHandle(&ipc_handle, data);
+      auto* handle_bytes = reinterpret_cast<const uint8_t*>(&ipc_handle);
+      handle.assign(handle_bytes, handle_bytes + sizeof(ipc_handle));
+    } else {
+      if (import_handle.size() != sizeof(ipc_handle))
+        throw std::runtime_error("The shared prefix has a CUDA IPC handle of the wrong size");
+      std::memcpy(&ipc_handle, import_handle.data(), sizeof(ipc_handle));
+      void* opened;
+      CudaCheck() == cudaIpcOpenMemHandle(&opened, ipc_handle, cudaIpcMemLazyEnablePeerAccess);
+      data = static_cast<uint8_t*>(opened);
+      handle.assign(import_handle.begin(), import_handle.end());
+    }
+  }
+
+  ~CudaSharedBlock() override {
+    if (owned_)
+      (void)cudaFree(data);
+    else
+      (void)cudaIpcCloseMemHandle(data);
+  }
+
+ private:
+  bool owned_;
+};
+#endif
+
+std::unique_ptr<SharedBlock> CreateSharedBlock(const Model& model, size_t bytes) {
+#if USE_CUDA
+  if (model.device_type_ == DeviceType::CUDA)
+    return std::make_unique<CudaSharedBlock>(bytes);
+#endif
+  if (model.device_type_ != DeviceType::CPU)
+    throw std::runtime_error("Sharing prefixes between processes is only supported on the CPU and CUDA, not " + to_string(model.device_type_));
+  return std::make_unique<HostSharedBlock>(bytes);
+}
+
+template <typename T>
+void Append(std::vector<uint8_t>& data, const T& value) {
+  auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+  data.insert(data.end(), bytes, bytes + sizeof(T));
+}
+
+struct Reader {
+  std::span<const uint8_t> data;
+  size_t offset{};
+
+  const uint8_t* Skip(size_t bytes) {
+    if (bytes > data.size() - offset)
+      throw std::runtime_error("Saved generator state is truncated");
+    auto* start = data.data() + offset;
+    offset += bytes;
+    return start;
+  }
+
+  size_t Remaining() const { return data.size() - offset; }
+
+  template <typename T>
+  T Read() {
+    T value;
+    std::memcpy(&value, Skip(sizeof(T)), sizeof(T));
+    return value;
+  }
+
+  // The tensor's element count, after checking the rank and every dim so its bytes can't overflow or exceed max_bytes
+  std::vector<int64_t> ReadShape(size_t element_size, size_t max_bytes, size_t& element_count) {
+    const size_t rank = Read<uint32_t>();
+    if (rank > Remaining() / sizeof(int64_t))
+      throw std::runtime_error("Saved generator state is truncated");
+    std::vector<int64_t> shape(rank);
+    element_count = 1;
+    for (auto& dim : shape) {
+      dim = Read<int64_t>();
+      if (dim < 0 || (dim > 0 && element_count > max_bytes / element_size / static_cast<size_t>(dim)))
+        throw std::runtime_error("Saved generator state has a kv cache shape that is invalid or larger than its data");
+      element_count *= static_cast<size_t>(dim);
+    }
+    return shape;
+  }
+};
+
+}  // namespace
+
+std::vector<uint8_t> PrefixCache::Entry::Serialize(const Model& model, [[maybe_unused]] cudaStream_t stream) const {
+  std::vector<uint8_t> data;
+  Append(data, c_serialized_magic);
+  Append(data, c_serialized_version);
+  Append(data, static_cast<uint32_t>(tokens.size()));
+  data.insert(data.end(), reinterpret_cast<const uint8_t*>(tokens.data()), reinterpret_cast<const uint8_t*>(tokens.data() + tokens.size()));
+  Append(data, static_cast<uint32_t>(kv.size()));
+
+  data.reserve(data.size() + GetKVBytes(*this) + kv.size() * 64);
+  for (auto& value : kv) {
+    auto info = value->GetTensorTypeAndShapeInfo();
+    auto shape = info->GetShape();
+    const size_t bytes = info->GetElementCount() * SizeOf(info->GetElementType());
+    Append(data, static_cast<int32_t>(info->GetElementType()));
+    Append(data, static_cast<uint32_t>(shape.size()));
+    for (auto dim : shape)
+      Append(data, dim);
+    Append(data, static_cast<uint64_t>(bytes));
+
+    const size_t offset = data.size();
+    data.resize(offset + bytes);
+#if USE_CUDA
+    if (model.device_type_ == DeviceType::CUDA) {
+      CudaCheck() == cudaMemcpyAsync(data.data() + offset, value->GetTensorRawData(), bytes, cudaMemcpyDeviceToHost, stream);
+      continue;
+    }
+#endif
+    std::memcpy(data.data() + offset, value->GetTensorRawData(), bytes);
+  }
+#if USE_CUDA
+  if (model.device_type_ == DeviceType::CUDA)
+    CudaCheck() == cudaStreamSynchronize(stream);
+#endif
+  return data;
+}
+
+std::shared_ptr<const PrefixCache::Entry> PrefixCache::Entry::Deserialize(const Model& model, std::span<const uint8_t> data, [[maybe_unused]] cudaStream_t stream) {
+  Reader reader{data};
+  if (reader.Read<uint32_t>() != c_serialized_magic)
+    throw std::runtime_error("Not a saved generator state");
+  if (auto version = reader.Read<uint32_t>(); version != c_serialized_version)
+    throw std::runtime_error("Saved generator state has version " + std::to_string(version) + ", this build reads version " + std::to_string(c_serialized_version));
+
+  // The data can come from another process or the network, so every count and size is checked against the bytes left
+  // before anything is sized by it
+  auto entry = std::make_shared<Entry>();
+  const size_t token_count = reader.Read<uint32_t>();
+  const auto* tokens = reader.Skip(token_count * sizeof(int32_t));
+  entry->tokens.resize(token_count);
+  std::memcpy(entry->tokens.data(), tokens, token_count * sizeof(int32_t));
+
+  const auto count = reader.Read<uint32_t>();
+  for (uint32_t i = 0; i < count; i++) {
+    const auto type = static_cast<ONNXTensorElementDataType>(reader.Read<int32_t>());
+    const size_t element_size = SizeOf(type);  // Throws for types that aren't tensor element types
+    size_t element_count;
+    auto shape = reader.ReadShape(element_size, reader.Remaining(), element_count);
+    const auto bytes = reader.Read<uint64_t>();
+    if (bytes != element_count * element_size)
+      throw std::runtime_error("Saved generator state has a kv cache of " + std::to_string(bytes) + " bytes that doesn't match its shape");
+    const auto* source = reader.Skip(bytes);
+
+    auto value = OrtValue::CreateTensor(*model.allocator_device_, shape, type);
+#if USE_CUDA
+    if (model.device_type_ == DeviceType::CUDA)
+      CudaCheck() == cudaMemcpyAsync(value->GetTensorMutableRawData(), source, bytes, cudaMemcpyHostToDevice, stream);
+    else
+#endif
+      std::memcpy(value->GetTensorMutableRawData(), source, bytes);
+    entry->kv.push_back(std::move(value));
+  }
+  if (reader.offset != data.size())
+    throw std::runtime_error("Saved generator state has trailing data");
+
+  // data belongs to the caller, so the copies have to be done before returning
+#if USE_CUDA
+  if (model.device_type_ == DeviceType::CUDA)
+    CudaCheck() == cudaStreamSynchronize(stream);
+#endif
+  return entry;
+}
+
+std::vector<uint8_t> PrefixCache::Export(const Model& model, std::span<const int32_t> tokens, [[maybe_unused]] cudaStream_t stream) {
+  auto entry = Find(tokens, (tokens.size() / block_size_) * block_size_);
+  if (!entry)
+    throw std::runtime_error("No prefix of the tokens is in the prefix cache to export");
+
+  std::lock_guard<std::mutex> lock{exports_mutex_};
+  for (auto& exported : exports_) {
+    if (exported.tokens == entry->tokens)
+      return exported.descriptor;
+  }
+
+  std::vector<size_t> offsets;
+  size_t block_bytes = 0;
+  for (auto& value : entry->kv) {
+    offsets.push_back(block_bytes);
+    block_bytes += (GetValueBytes(*value) + c_shared_alignment - 1) / c_shared_alignment * c_shared_alignment;
+  }
+  std::shared_ptr<SharedBlock> block = CreateSharedBlock(model, block_bytes);
+
+  std::vector<uint8_t> descriptor;
+  Append(descriptor, c_shared_magic);
+  Append(descriptor, c_shared_version);
+  Append(descriptor, model.device_type_ == DeviceType::CUDA ? SharedBlockKind::Cuda : SharedBlockKind::Host);
+  Append(descriptor, static_cast<uint32_t>(block->handle.size()));
+  descriptor.insert(descriptor.end(), block->handle.begin(), block->handle.end());
+  Append(descriptor, static_cast<uint64_t>(block_bytes));
+  Append(descriptor, static_cast<uint32_t>(entry->tokens.size()));
+  descriptor.insert(descriptor.end(), reinterpret_cast<const uint8_t*>(entry->tokens.data()), reinterpret_cast<const uint8_t*>(entry->tokens.data() + entry->tokens.size()));
+  Append(descriptor, static_cast<uint32_t>(entry->kv.size()));
+
+  for (size_t i = 0; i < entry->kv.size(); i++) {
+    auto& value = *entry->kv[i];
+    auto info = value.GetTensorTypeAndShapeInfo();
+    auto shape = info->GetShape();
+    Append(descriptor, static_cast<int32_t>(info->GetElementType()));
+    Append(descriptor, static_cast<uint32_t>(shape.size()));
+    for (auto dim : shape)
+      Append(descriptor, dim);
+    Append(descriptor, static_cast<uint64_t>(offsets[i]));
+
+#if USE_CUDA
+    if (model.device_type_ == DeviceType::CUDA) {
+      CudaCheck() == cudaMemcpyAsync(block->data + offsets[i], value.GetTensorRawData(), GetValueBytes(value), cudaMemcpyDeviceToDevice, stream);
+      continue;
+    }
+#endif
+    std::memcpy(block->data + offsets[i], value.GetTensorRawData(), GetValueBytes(value));
+  }
+#if USE_CUDA
+  if (model.device_type_ == DeviceType::CUDA)
+    CudaCheck() == cudaStreamSynchronize(stream);
+#endif
+
+  exports_.push_back({entry->tokens, std::move(block), descriptor});
+  return descriptor;
+}
+
+void PrefixCache::Import(const Model& model, std::span<const uint8_t> descriptor) {
+  Reader reader{descriptor};
+  if (reader.Read<uint32_t>() != c_shared_magic)
+    throw std::runtime_error("Not a shared prefix");
+  if (auto version = reader.Read<uint32_t>(); version != c_shared_version)
+    throw std::runtime_error("Shared prefix has version " + std::to_string(version) + ", this build reads version " + std::to_string(c_shared_version));
+
+  const auto kind = reader.Read<SharedBlockKind>();
+  if (kind != (model.device_type_ == DeviceType::CUDA ? SharedBlockKind::Cuda : SharedBlockKind::Host) ||
+      (model.device_type_ != DeviceType::CPU && model.device_type_ != DeviceType::CUDA))
+    throw std::runtime_error("The shared prefix was exported by a model on another kind of device than " + to_string(model.device_type_));
+  const auto handle_size = reader.Read<uint32_t>();
+  const auto* handle = reader.Skip(handle_size);
+  const auto block_bytes = static_cast<size_t>(reader.Read<uint64_t>());
+
+  auto entry = std::make_shared<Entry>();
+  const size_t token_count = reader.Read<uint32_t>();
+  const auto* tokens = reader.Skip(token_count * sizeof(int32_t));
+  entry->tokens.resize(token_count);
+  std::memcpy(entry->tokens.data(), tokens, token_count * sizeof(int32_t));
+  if (entry->tokens.empty() || entry->tokens.size() % block_size_ != 0)
+    throw std::runtime_error("The shared prefix has " + std::to_string(entry->tokens.size()) + " tokens, not a multiple of model.decoder.prefix_cache.block_size");
+  if (auto cached = Find(entry->tokens, entry->tokens.size()); cached && cached->tokens.size() == entry->tokens.size())
+    return;  // Already cached here
+
+  std::shared_ptr<SharedBlock> block;
+#if USE_CUDA
+  if (kind == SharedBlockKind::Cuda)
+    block = std::make_shared<CudaSharedBlock>(block_bytes, std::span<const uint8_t>{handle, handle_size});
+  else
+#endif
+    block = std::make_shared<HostSharedBlock>(block_bytes, std::string_view{reinterpret_cast<const char*>(handle), handle_size});
+
+  auto& info = model.allocator_device_->GetInfo();
+  const auto count = reader.Read<uint32_t>();
+  for (uint32_t i = 0; i < count; i++) {
+    const auto type = static_cast<ONNXTensorElementDataType>(reader.Read<int32_t>());
+    const size_t element_size = SizeOf(type);
+    size_t element_count;
+    auto shape = reader.ReadShape(element_size, block_bytes, element_count);
+    const auto offset = static_cast<size_t>(reader.Read<uint64_t>());
+    const size_t bytes = element_count * element_size;
+    if (offset > block_bytes || bytes > block_bytes - offset)
+      throw std::runtime_error("The shared prefix has a kv cache outside of its block");
+    // The kv caches are only ever past inputs, the sessions don't write to them
+    entry->kv.push_back(OrtValue::CreateTensor(info, block->data + offset, bytes, shape, type));
+  }
+  if (reader.offset != descriptor.size())
+    throw std::runtime_error("Shared prefix has trailing data");
+
+  entry->shared_block = std::move(block);
+  Store(std::move(entry));
+}
+
+PrefixCache::PrefixCache(int block_size, int max_entries, DeviceMemoryBudget* budget)
+    : block_size_{static_cast<size_t>(block_size)},
+      max_entries_{static_cast<size_t>(std::max(max_entries, 1))},
+      budget_{budget} {
+}
+
+size_t PrefixCache::GetAlignedLength(size_t length, size_t block_size) {
+  // At least one token of the prompt has to be run to produce the logits
+  return length == 0 ? 0 : ((length - 1) / block_size) * block_size;
+}
+
+std::shared_ptr<const PrefixCache::Entry> PrefixCache::Find(std::span<const int32_t> tokens) {
+  return Find(tokens, GetAlignedLength(tokens.size(), block_size_));
+}
+
+std::vector<size_t> PrefixCache::HashPrompt(std::span<const int32_t> tokens) const {
+  return HashPrefixes(tokens, block_size_, GetAlignedLength(tokens.size(), block_size_));
+}
+
+size_t PrefixCache::GetCachedLength(std::span<const int32_t> tokens, std::span<const size_t> hashes) {
+  auto entry = Find(tokens, hashes, false);
+  return entry ? entry->tokens.size() : 0;
+}
+
+std::shared_ptr<const PrefixCache::Entry> PrefixCache::Find(std::span<const int32_t> tokens, size_t max_length) {
+  return Find(tokens, HashPrefixes(tokens, block_size_, max_length), true);
+}
+
+std::shared_ptr<const PrefixCache::Entry> PrefixCache::Find(std::span<const int32_t> tokens, std::span<const size_t> hashes, bool use) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  for (size_t i = hashes.size(); i-- > 0;) {
+    auto prefix = tokens.subspan(0, (i + 1) * block_size_);
+    auto [begin, end] = lookup_.equal_range(hashes[i]);
+    for (auto it = begin; it != end; ++it) {
+      auto& entry = *it->second;
+      if (std::equal(entry->tokens.begin(), entry->tokens.end(), prefix.begin(), prefix.end())) {
+        if (use)
+          entries_.splice(entries_.begin(), entries_, it->second);
+        return entry;
+      }
+    }
+  }
+  return nullptr;
+}
+
+size_t PrefixCache::GetStoreLength(std::span<const int32_t> tokens) {
+  auto length = GetAlignedLength(tokens.size(), block_size_);
+  if (length == 0)
+    return 0;
+
+  auto hashes = HashPrefixes(tokens, block_size_, length);
+  auto prefix = tokens.subspan(0, length);
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  auto [begin, end] = lookup_.equal_range(hashes.back());
+  for (auto it = begin; it != end; ++it) {
+    auto& entry = *it->second;
+    if (std::equal(entry->tokens.begin(), entry->tokens.end(), prefix.begin(), prefix.end()))
+      return 0;
+  }
+  return length;
+}
+
+void PrefixCache::Store(std::shared_ptr<const Entry> entry) {
+  assert(!entry->tokens.empty() && entry->tokens.size() % block_size_ == 0);  // Only GetStoreLength() lengths are stored
+  auto hash = HashPrefixes(entry->tokens, block_size_, entry->tokens.size()).back();
+
+  // Reserved before locking, as making room can evict entries of this cache
+  if (budget_ && !budget_->TryReserve(GetKVBytes(*entry)))
+    return;
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  entries_.push_front(std::move(entry));
+  lookup_.emplace(hash, entries_.begin());
+
+  while (entries_.size() > max_entries_)
+    EraseLast();
+}
+
+bool PrefixCache::EvictOldest() {
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (entries_.empty())
+    return false;
+  EraseLast();
+  return true;
+}
+
+void PrefixCache::EraseLast() {
+  auto last = std::prev(entries_.end());
+  auto last_hash = HashPrefixes((*last)->tokens, block_size_, (*last)->tokens.size()).back();
+  auto [begin, end] = lookup_.equal_range(last_hash);
+  for (auto it = begin; it != end; ++it) {
+    if (it->second == last) {
+      lookup_.erase(it);
+      break;
+    }
+  }
+  if (budget_)
+    budget_->Release(GetKVBytes(**last));
+  entries_.erase(last);
+}
+
+}  // namespace Generators
@@ -0,0 +1,81 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <list>
+#include <mutex>
+
+namespace Generators {
+
+struct DeviceMemoryBudget;
+struct Model;
+
+// Model level cache of prompt kv caches, keyed by the token ids of the prompt prefix.
+// Prefixes are stored in multiples of block_size tokens so that prompts that only share a leading part (like a
+// common system prompt) still hit. Entries are shared, so one that's evicted stays alive while a State uses it.
+// The kv bytes of the entries are reserved from the budget, if set, while they're in the cache
+struct PrefixCache {
+  PrefixCache(int block_size, int max_entries, DeviceMemoryBudget* budget = nullptr);
+
+  struct Entry {
+    std::vector<int32_t> tokens;
+    std::vector<std::unique_ptr<OrtValue>> kv;  // Same order as the KV_Cache past inputs, each [1, num_key_value_heads, tokens.size(), head_size]
+    std::shared_ptr<void> shared_block;         // If set, kv are views into memory another process exported, see Import()
+
+    // A host copy of the tokens and kv caches, to be read back by Deserialize() with the same model on the same kind of
+    // machine, for a saved generator state. Only the used sequence positions are written, not a preallocated max_length.
+    // The copies are on stream, the one the kv caches were written on
+    std::vector<uint8_t> Serialize(const Model& model, cudaStream_t stream) const;
+    static std::shared_ptr<const Entry> Deserialize(const Model& model, std::span<const uint8_t> data, cudaStream_t stream);  // kv on the model's device
+  };
+
+  // Returns the longest cached prefix of tokens that still leaves at least one token to run, or nullptr
+  std::shared_ptr<const Entry> Find(std::span<const int32_t> tokens);
+
+  // The token count of the prefix Find() would return, 0 for none, without making it the most recently used. For
+  // deciding where a prompt should run. The hashes are of HashPrompt(), so one prompt is hashed once to look it up in
+  // the caches of several instances with the same block_size
+  std::vector<size_t> HashPrompt(std::span<const int32_t> tokens) const;
+  size_t GetCachedLength(std::span<const int32_t> tokens, std::span<const size_t> hashes);
+  size_t GetBlockSize() const { return block_size_; }
+
+  // Returns the prefix length of tokens that should be stored, or 0 if it is too short or already cached
+  size_t GetStoreLength(std::span<const int32_t> tokens);
+  void Store(std::shared_ptr<const Entry> entry);  // Not stored if it doesn't fit the budget
+
+  bool EvictOldest();  // Returns false if the cache is empty, a DeviceMemoryBudget eviction hook
+
+  // Copies the kv caches of the longest cached prefix of tokens into a block other processes on the machine can map, CUDA
+  // IPC memory on CUDA and named shared memory on the CPU, and returns a descriptor of it for Import() there. The block
+  // lives as long as this cache, exporting the same prefix again returns the same descriptor. Its bytes aren't counted
+  // by the budget. The copies are on stream
+  std::vector<uint8_t> Export(const Model& model, std::span<const int32_t> tokens, cudaStream_t stream);
+  // Maps the block of an Export() by another process with the same model and stores it as an entry, so the processes
+  // share one copy of the prefix's kv caches. It is read only here and the exporting process must outlive its use
+  void Import(const Model& model, std::span<const uint8_t> descriptor);
+
+ private:
+  static size_t GetAlignedLength(size_t length, size_t block_size);
+  std::shared_ptr<const Entry> Find(std::span<const int32_t> tokens, size_t max_length);  // Of a prefix of at most max_length tokens
+  std::shared_ptr<const Entry> Find(std::span<const int32_t> tokens, std::span<const size_t> hashes, bool use);  // hashes of HashPrefixes
+  void EraseLast();  // With mutex_ locked, releasing the entry's bytes
+
+
+  const size_t block_size_;
+  const size_t max_entries_;
+  DeviceMemoryBudget* budget_;
+
+  std::mutex mutex_;
+  std::list<std::shared_ptr<const Entry>> entries_;  // Most recently used first
+  std::unordered_multimap<size_t, std::list<std::shared_ptr<const Entry>>::iterator> lookup_;  // Hash of Entry::tokens
+
+  struct Exported {
+    std::vector<int32_t> tokens;
+    std::shared_ptr<void> block;
+    std::vector<uint8_t> descriptor;
+  };
+  std::mutex exports_mutex_;
+  std::vector<Exported> exports_;
+};
+
+}  // namespace Generators
@@ -2,6 +2,7 @@
 // Licensed under the MIT License.
 
 #include "../generators.h"
+#include "../float16.h"
 #include "model.h"
 
 #include <regex>
@@ -10,17 +11,30 @@ namespace Generators {
 
 namespace {
 
-std::unique_ptr<OrtValue> ProcessImagePrompt(const Generators::Tokenizer& tokenizer, const std::string& prompt,
-                                             ortc::Tensor<int64_t>* num_img_tokens, Ort::Allocator& allocator) {
-  const size_t num_images = num_img_tokens ? num_img_tokens->NumberOfElement() : 0U;
-  auto* num_img_tokens_data = num_img_tokens ? num_img_tokens->Data() : nullptr;
+// Matches the "<|image_<number>|>" tags, where <number> is the image id. Compiled once instead of for every prompt
+const std::regex& GetImageTagPattern() {
+  static const std::regex pattern("<\\|image_(\\d+)\\|>");
+  return pattern;
+}
 
-  // Split the prompt string based on the occurrences of the pattern "<|image_<numder>|>"
-  // Here the <number> represents the image id.
-  const std::regex pattern("<\\|image_\\d+\\|>");
-  const std::vector<std::string> prompt_chunks(
-      std::sregex_token_iterator(prompt.begin(), prompt.end(), pattern, -1),
-      std::sregex_token_iterator());
+// The prompt's image tags are numbered from 1 among its own images, num_img_tokens. Their placeholders are numbered
+// from first_image_id, so that the prompts of a batch sharing one pixel_values tensor refer to distinct images.
+std::vector<int32_t> ProcessImagePrompt(const Generators::Tokenizer& tokenizer, const std::string& prompt,
+                                        std::span<const int64_t> num_img_tokens, int32_t first_image_id) {
+  const size_t num_images = num_img_tokens.size();
+
+  // Split the prompt string around the image tags and extract their image ids, in a single pass. Like splitting with
+  // a regex token iterator, a tag at the very end leaves no empty chunk after it.
+  std::vector<std::string> prompt_chunks;
+  std::vector<int32_t> image_ids;
+  auto chunk_begin = prompt.begin();
+  for (std::sregex_iterator it{prompt.begin(), prompt.end(), GetImageTagPattern()}, end; it != end; ++it) {
+    prompt_chunks.emplace_back(chunk_begin, (*it)[0].first);
+    image_ids.push_back(std::stoi((*it)[1].str()));
+    chunk_begin = (*it)[0].second;
+  }
+  if (chunk_begin != prompt.end() || image_ids.empty())
+    prompt_chunks.emplace_back(chunk_begin, prompt.end());
 
   // Each chunk of the prompt string obtained after splitting is then tokenized using the tokenizer.
   std::vector<std::vector<int32_t>> input_ids_chunks(prompt_chunks.size());
@@ -28,21 +42,6 @@ std::unique_ptr<OrtValue> ProcessImagePrompt(const Generators::Tokenizer& tokeni
     input_ids_chunks[i] = tokenizer.Encode(prompt_chunks[i].c_str());
   }
 
-  // Extract the image tags from the prompt string.
-  // Here the image tags are of the form "<|image_<number>|>"
-  const std::vector<std::string> image_tags(
-      std::sregex_token_iterator(prompt.begin(), prompt.end(), pattern),
-      std::sregex_token_iterator());
-
-  // Extract the image ids from the image tags.
-  std::vector<int32_t> image_ids(image_tags.size());
-  constexpr size_t image_id_position_begin = 8;  // <|image_ : Character at idx 8 is the beginning of the image_id
-  for (size_t i = 0; i < image_tags.size(); ++i) {
-    const size_t image_id_position_end = image_tags[i].size() - 2;  // |> : Character at idx size() - 2 is '|' which marks the end of the image_id
-    image_ids[i] = std::stoi(image_tags[i].substr(image_id_position_begin,
-                                                  image_id_position_end - image_id_position_begin));
-  }
-
   if (std::set<int32_t>(image_ids.begin(), image_ids.end()).size() != num_images) {
     throw std::runtime_error("Number of unique image tags does not match the number of images.");
   }
@@ -50,7 +49,7 @@ std::unique_ptr<OrtValue> ProcessImagePrompt(const Generators::Tokenizer& tokeni
   // Construct the input_ids tensor by interleaving the input_ids_chunks and the image tokens placeholder
   // The image tokens placeholder is represented by a sequence of negative value of the image_ids.
   // For example, the placeholder for image_id 1 is represented by the value [-1, -1, -1, -1]. The
-  // length of the sequence is determined by the value of num_img_tokens_data[image_id - 1].
+  // length of the sequence is determined by the value of num_img_tokens[image_id - 1].
   std::vector<int32_t> input_ids;
   for (size_t i = 0; i < input_ids_chunks.size(); ++i) {
     input_ids.insert(input_ids.end(), input_ids_chunks[i].begin(), input_ids_chunks[i].end());
@@ -60,17 +59,20 @@ std::unique_ptr<OrtValue> ProcessImagePrompt(const Generators::Tokenizer& tokeni
                                     std::to_string(num_images) + ". Actual value: " + std::to_string(image_ids[i]);
         throw std::runtime_error(error_message);
       }
-      for (int64_t j = 0; j < num_img_tokens_data[image_ids[i] - 1]; ++j) {
-        input_ids.push_back(-image_ids[i]);
-      }
+      input_ids.insert(input_ids.end(), num_img_tokens[image_ids[i] - 1], -(first_image_id + image_ids[i] - 1));
     }
   }
 
-  // input_ids is created. Pack it into an allocated OrtValue to avoid managing the memory.
-  const std::vector<int64_t> shape{1, static_cast<int64_t>(input_ids.size())};
-  auto input_ids_value = OrtValue::CreateTensor<int32_t>(allocator, shape);
-  std::copy(input_ids.begin(), input_ids.end(), input_ids_value->GetTensorMutableData<int32_t>());
-  return input_ids_value;
+  return input_ids;
+}
+
+// The pixel values hold every crop of every image, millions of floats, so they're copied or converted in chunks on the
+// thread pool
+void ForEachChunk(size_t count, const std::function<void(size_t begin, size_t end)>& fn) {
+  constexpr size_t chunk_size = 1 << 16;
+  GetThreadPool().ParallelFor((count + chunk_size - 1) / chunk_size, [&](size_t i, size_t /*thread_index*/) {
+    fn(i * chunk_size, std::min(count, (i + 1) * chunk_size));
+  });
 }
 
 std::unique_ptr<OrtValue> ProcessPixelValues(ortc::Tensor<float>* pixel_values, ONNXTensorElementDataType expected_type,
@@ -81,15 +83,17 @@ std::unique_ptr<OrtValue> ProcessPixelValues(ortc::Tensor<float>* pixel_values,
   auto pixel_values_value = expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT
                                 ? OrtValue::CreateTensor<float>(allocator, pixel_values->Shape())
                                 : OrtValue::CreateTensor<Ort::Float16_t>(allocator, pixel_values->Shape());
+  const float* source = pixel_values->Data();
   if (expected_type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
-    std::copy(pixel_values->Data(), pixel_values->Data() + pixel_values->NumberOfElement(),
-              pixel_values_value->GetTensorMutableData<float>());
+    auto* target = pixel_values_value->GetTensorMutableData<float>();
+    ForEachChunk(pixel_values->NumberOfElement(), [&](size_t begin, size_t end) {
+      std::copy(source + begin, source + end, target + begin);
+    });
   } else {
-    auto pixel_values_fp32 = OrtValue::CreateTensor<float>(
-        allocator.GetInfo(),
-        std::span<float>(const_cast<float*>(pixel_values->Data()), pixel_values->NumberOfElement()),
-        pixel_values->Shape());
-    ConvertFp32ToFp16(allocator, *pixel_values_fp32, pixel_values_value, DeviceType::CPU, nullptr);
+    auto* target = pixel_values_value->GetTensorMutableData<uint16_t>();
+    ForEachChunk(pixel_values->NumberOfElement(), [&](size_t begin, size_t end) {
+      Fp32ToFp16(std::span<const float>{source + begin, end - begin}, std::span<uint16_t>{target + begin, end - begin});
+    });
   }
 
   return pixel_values_value;
@@ -105,15 +109,25 @@ std::unique_ptr<OrtValue> ProcessImageSizes(ortc::Tensor<int64_t>* image_sizes,
 }  // namespace
 
 std::unique_ptr<Images> LoadImageImpl(const char* image_path) {
-  if (!fs::path(image_path).exists()) {
-    throw std::runtime_error("Image path does not exist: " + std::string(image_path));
+  return LoadImagesImpl({&image_path, 1});
+}
+
+std::unique_ptr<Images> LoadImagesImpl(std::span<const char* const> image_paths) {
+  if (image_paths.empty()) {
+    throw std::runtime_error("No images provided");
+  }
+  for (const char* image_path : image_paths) {
+    if (!fs::path(image_path).exists()) {
+      throw std::runtime_error("Image path does not exist: " + std::string(image_path));
+    }
   }
-  auto [images, num_images] = ort_extensions::LoadRawImages({image_path});
+  auto [images, num_images] = ort_extensions::LoadRawImages({image_paths.begin(), image_paths.end()});
   return std::make_unique<Images>(std::move(images), num_images);
 }
 
 ImageProcessor::ImageProcessor(Config& config, const SessionInfo& session_info)
-    : pixel_values_type_{session_info.GetInputDataType(config.model.vision.inputs.pixel_values)} {
+    : pixel_values_type_{session_info.GetInputDataType(config.model.vision.inputs.pixel_values)},
+      pad_token_id_{config.model.pad_token_id} {
   const std::string default_processor_file_name = "processor_config.json";
   auto processor_config = (config.config_path / fs::path(default_processor_file_name)).string();
   CheckResult(OrtxCreateProcessor(processor_.Address(), processor_config.c_str()));
@@ -123,17 +137,71 @@ ImageProcessor::ImageProcessor(Config& config, const SessionInfo& session_info)
   config.AddMapping(std::string(Config::Defaults::ImageSizesName), config.model.vision.inputs.image_sizes);
 }
 
+std::vector<size_t> DefaultImageCounts(size_t prompt_count, const Images* images) {
+  std::vector<size_t> image_counts(prompt_count);
+  if (!images || prompt_count == 0)
+    return image_counts;
+  if (prompt_count == 1) {
+    image_counts[0] = images->num_images_;
+    return image_counts;
+  }
+  if (images->num_images_ != prompt_count) {
+    throw std::runtime_error("Without image counts every one of the " + std::to_string(prompt_count) +
+                             " prompts owns one image, but " + std::to_string(images->num_images_) + " images were given.");
+  }
+  std::fill(image_counts.begin(), image_counts.end(), size_t{1});
+  return image_counts;
+}
+
 std::unique_ptr<NamedTensors> ImageProcessor::Process(const Tokenizer& tokenizer, const std::string& prompt,
                                                       const Images* images) {
+  const size_t image_count = images ? images->num_images_ : 0U;
+  return Process(tokenizer, {&prompt, 1}, images, {&image_count, 1});
+}
+
+std::unique_ptr<NamedTensors> ImageProcessor::Process(const Tokenizer& tokenizer, std::span<const std::string> prompts,
+                                                      const Images* images, std::span<const size_t> image_counts) {
+  if (prompts.empty()) {
+    throw std::runtime_error("No prompts provided");
+  }
+  if (image_counts.size() != prompts.size()) {
+    throw std::runtime_error("Expected an image count for each of the " + std::to_string(prompts.size()) +
+                             " prompts. Actual: " + std::to_string(image_counts.size()));
+  }
+  const size_t num_images = std::accumulate(image_counts.begin(), image_counts.end(), size_t{});
+  if (num_images != (images ? images->num_images_ : 0U)) {
+    throw std::runtime_error("The image counts of the prompts add up to " + std::to_string(num_images) +
+                             ", but " + std::to_string(images ? images->num_images_ : 0U) + " images were given.");
+  }
+
   Ort::Allocator& allocator{Ort::Allocator::GetWithDefaultOptions()};
   auto named_tensors = std::make_unique<NamedTensors>();
 
+  // One row of input_ids per prompt, padded on the right like Tokenizer::EncodeBatch
+  auto add_input_ids = [&](std::span<const int64_t> num_img_tokens) {
+    std::vector<std::vector<int32_t>> prompt_input_ids(prompts.size());
+    std::vector<size_t> first_images(prompts.size());
+    std::exclusive_scan(image_counts.begin(), image_counts.end(), first_images.begin(), size_t{});
+    GetThreadPool().ParallelFor(prompts.size(), [&](size_t i, size_t /*thread_index*/) {
+      prompt_input_ids[i] = ProcessImagePrompt(tokenizer, prompts[i], num_img_tokens.subspan(first_images[i], image_counts[i]),
+                                               static_cast<int32_t>(first_images[i]) + 1);
+    });
+
+    std::vector<std::span<const int32_t>> sequences(prompt_input_ids.begin(), prompt_input_ids.end());
+    auto input_ids = PadInputs(sequences, pad_token_id_);
+    const std::vector<int64_t> shape{static_cast<int64_t>(prompts.size()), static_cast<int64_t>(input_ids.size() / prompts.size())};
+    auto input_ids_value = OrtValue::CreateTensor<int32_t>(allocator, shape);
+    std::copy(input_ids.begin(), input_ids.end(), input_ids_value->GetTensorMutableData<int32_t>());
+    named_tensors->emplace(std::string(Config::Defaults::InputIdsName), std::make_shared<Tensor>(std::move(input_ids_value)));
+  };
+
   if (!images) {
-    named_tensors->emplace(Config::Defaults::InputIdsName,
-                           std::make_shared<Tensor>(ProcessImagePrompt(tokenizer, prompt, nullptr, allocator)));
+    add_input_ids({});
     return named_tensors;
   }
 
+  // Every image of every prompt is preprocessed together, so the vision model sees them as a single batch with their
+  // crops padded to the same count, and image_sizes tells it how many of them each image really has
   ort_extensions::ImageProcessor* processor = static_cast<ort_extensions::ImageProcessor*>(processor_.p_);
 
   ortc::Tensor<float>* pixel_values = nullptr;
@@ -145,8 +213,7 @@ std::unique_ptr<NamedTensors> ImageProcessor::Process(const Tokenizer& tokenizer
     throw std::runtime_error(status.ToString());
   }
 
-  named_tensors->emplace(std::string(Config::Defaults::InputIdsName),
-                         std::make_shared<Tensor>(ProcessImagePrompt(tokenizer, prompt, num_img_tokens, allocator)));
+  add_input_ids({num_img_tokens->Data(), static_cast<size_t>(num_img_tokens->NumberOfElement())});
   named_tensors->emplace(std::string(Config::Defaults::PixelValuesName),
                          std::make_shared<Tensor>(ProcessPixelValues(pixel_values, pixel_values_type_, allocator)));
   named_tensors->emplace(std::string(Config::Defaults::ImageSizesName),
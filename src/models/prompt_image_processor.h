@@ -17,6 +17,11 @@ struct Images {
 };
 
 std::unique_ptr<Images> LoadImageImpl(const char* image_path);
+std::unique_ptr<Images> LoadImagesImpl(std::span<const char* const> image_paths);
+
+// The image counts of a batch of prompts that doesn't give them: a single prompt owns all the images, otherwise each
+// prompt owns one
+std::vector<size_t> DefaultImageCounts(size_t prompt_count, const Images* images);
 
 struct ImageProcessor {
   ImageProcessor(Config& config, const SessionInfo& session_info);
@@ -25,6 +30,11 @@ struct ImageProcessor {
   // OrtValue memory will be released when the NamedTensors are destroyed.
   std::unique_ptr<NamedTensors> Process(const Tokenizer& tokenizer, const std::string& prompt, const Images* images);
 
+  // A batch of prompts, one row of input_ids each, whose images are all run through the vision model at once. Prompt i
+  // owns the next image_counts[i] of the images, which its image tags number from 1.
+  std::unique_ptr<NamedTensors> Process(const Tokenizer& tokenizer, std::span<const std::string> prompts,
+                                        const Images* images, std::span<const size_t> image_counts);
+
  private:
   OrtxPtr<OrtxProcessor> processor_;
 
@@ -32,6 +42,7 @@ struct ImageProcessor {
   std::string pixel_values_name_;
   ONNXTensorElementDataType pixel_values_type_;
   std::string image_sizes_name_;
+  int32_t pad_token_id_;
 };
 
 }  // namespace Generators
@@ -6,7 +6,42 @@
 
 namespace Generators {
 
-StaticBuffer::StaticBuffer(Ort::Allocator* allocator, size_t max_beam_batch_size) : allocator_{allocator}, info_{allocator_->GetInfo()}, max_beam_batch_size_{max_beam_batch_size} {
+void DeviceMemoryBudget::AddEvictionHook(EvictionHook hook) {
+  std::lock_guard lock{mutex_};
+  eviction_hooks_.push_back(std::move(hook));
+}
+
+void DeviceMemoryBudget::ClearEvictionHooks() {
+  std::lock_guard lock{mutex_};
+  eviction_hooks_.clear();
+}
+
+bool DeviceMemoryBudget::TryReserve(size_t bytes) {
+  if (capacity_ == 0) {
+    used_ += bytes;
+    return true;
+  }
+
+  std::lock_guard lock{mutex_};
+  for (size_t hook = 0; used_ + bytes > capacity_;) {
+    if (hook == eviction_hooks_.size())
+      return false;
+    if (!eviction_hooks_[hook]())
+      hook++;
+  }
+  used_ += bytes;
+  return true;
+}
+
+void DeviceMemoryBudget::Reserve(size_t bytes) {
+  if (!TryReserve(bytes))
+    throw std::runtime_error("Allocating " + std::to_string(bytes) + " bytes would exceed model.device_memory_budget_mb, " +
+                             std::to_string(used_) + " of " + std::to_string(capacity_) + " bytes are in use");
+}
+
+StaticBuffer::StaticBuffer(Ort::Allocator* allocator, size_t max_beam_batch_size, std::shared_ptr<std::atomic<int64_t>> allocated_bytes,
+                           std::shared_ptr<DeviceMemoryBudget> budget)
+    : allocator_{allocator}, info_{allocator_->GetInfo()}, max_beam_batch_size_{max_beam_batch_size}, allocated_bytes_{std::move(allocated_bytes)}, budget_{std::move(budget)} {
 }
 
 std::unique_ptr<OrtValue> StaticBuffer::CreateTensorOnStaticBuffer(std::span<const int64_t> shape,
@@ -15,11 +50,15 @@ std::unique_ptr<OrtValue> StaticBuffer::CreateTensorOnStaticBuffer(std::span<con
   if (buffer_ == nullptr) {
     // Assuming the first dimension is the batch size
     bytes_ = new_bytes * (max_beam_batch_size_ / shape[0]);
+    if (budget_)
+      budget_->Reserve(bytes_);
     buffer_ = allocator_->Alloc(bytes_);
+    if (allocated_bytes_)
+      *allocated_bytes_ += bytes_;
     return OrtValue::CreateTensor(info_, buffer_, new_bytes, shape, type);
   }
   if (new_bytes > bytes_) {
-    std::runtime_error("StaticBuffer: new_bytes > bytes_");
+    throw std::runtime_error("StaticBuffer: a tensor of " + std::to_string(new_bytes) + " bytes doesn't fit the buffer's " + std::to_string(bytes_));
   }
   return OrtValue::CreateTensor(info_, buffer_, new_bytes, shape, type);
 }
@@ -35,6 +74,10 @@ size_t StaticBuffer::GetNumElements(std::span<const int64_t> shape) {
 StaticBuffer::~StaticBuffer() {
   if (buffer_ != nullptr) {
     allocator_->Free(buffer_);
+    if (allocated_bytes_)
+      *allocated_bytes_ -= bytes_;
+    if (budget_)
+      budget_->Release(bytes_);
   }
 }
 
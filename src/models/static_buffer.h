@@ -2,7 +2,10 @@
 // Licensed under the MIT License.
 #pragma once
 
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include "onnxruntime_api.h"
 #include "../span.h"
 
@@ -12,9 +15,38 @@ struct Allocator;
 
 namespace Generators {
 
+// Model wide accounting of the device memory genai allocates itself: kv caches, the static buffers of captured graphs
+// and cached prefixes. What ORT allocates for the weights & activations of the sessions isn't included.
+// With a capacity, reservations that don't fit first call the eviction hooks to free cached memory, in the order they
+// were added, and fail if that isn't enough
+struct DeviceMemoryBudget {
+  DeviceMemoryBudget(size_t capacity) : capacity_{capacity} {}  // 0 for no limit
+
+  // Hooks free some of the memory the budget accounts for and return true, or return false once there is nothing left
+  // to free. They're called with the budget locked, so they must not reserve
+  using EvictionHook = std::function<bool()>;
+  void AddEvictionHook(EvictionHook hook);
+  void ClearEvictionHooks();
+
+  bool TryReserve(size_t bytes);
+  void Reserve(size_t bytes);  // Throws if the bytes don't fit
+  void Release(size_t bytes) { used_ -= bytes; }
+
+  size_t GetCapacity() const { return capacity_; }
+  size_t GetUsedBytes() const { return used_; }
+
+ private:
+  const size_t capacity_;
+  std::atomic<size_t> used_{};
+  std::mutex mutex_;  // Serializes the reservations that have to check the capacity, releases don't need it
+  std::vector<EvictionHook> eviction_hooks_;
+};
+
 struct StaticBuffer {
   // Add max_beam_batch_size to the constructor
-  StaticBuffer(Ort::Allocator* allocator, size_t max_beam_batch_size);
+  // allocated_bytes, if set, has the bytes of the buffer added while it's allocated, and budget, if set, has them reserved
+  StaticBuffer(Ort::Allocator* allocator, size_t max_beam_batch_size, std::shared_ptr<std::atomic<int64_t>> allocated_bytes = {},
+               std::shared_ptr<DeviceMemoryBudget> budget = {});
   StaticBuffer(const StaticBuffer&) = delete;
   StaticBuffer& operator=(const StaticBuffer&) = delete;
   ~StaticBuffer();
@@ -30,6 +62,8 @@ struct StaticBuffer {
   void* buffer_{};
   size_t bytes_{};
   size_t max_beam_batch_size_{};
+  std::shared_ptr<std::atomic<int64_t>> allocated_bytes_;
+  std::shared_ptr<DeviceMemoryBudget> budget_;
 };
 
 }  // namespace Generators
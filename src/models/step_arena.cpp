@@ -0,0 +1,63 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "step_arena.h"
+
+namespace Generators {
+
+StepArena::StepArena(OrtAllocator& allocator) : OrtAllocator{}, allocator_{allocator} {
+  version = ORT_API_VERSION;
+  OrtAllocator::Alloc = [](OrtAllocator* this_, size_t size) { return static_cast<StepArena*>(this_)->Allocate(size); };
+  OrtAllocator::Free = [](OrtAllocator* /*this_*/, void* /*p*/) {};
+  OrtAllocator::Info = [](const OrtAllocator* this_) {
+    auto& allocator = static_cast<const StepArena*>(this_)->allocator_;
+    return allocator.Info(&allocator);
+  };
+}
+
+StepArena::~StepArena() {
+  FreeBlocks();
+}
+
+void* StepArena::Allocate(size_t size) {
+  size = (size + c_alignment - 1) / c_alignment * c_alignment;
+  requested_ += size;
+  if (used_ + size <= capacity_) {
+    void* p = static_cast<std::byte*>(block_) + used_;
+    used_ += size;
+    return p;
+  }
+
+  overflow_.push_back(allocator_.Alloc(&allocator_, size));
+  return overflow_.back();
+}
+
+void StepArena::Reset() {
+  // Only a step that overflowed asked for more than the capacity. The sequences grow every step, so leave some room
+  // for the next ones before the block has to grow again
+  if (requested_ > capacity_) {
+    FreeBlocks();
+    capacity_ = requested_ + requested_ / 4;
+    block_ = allocator_.Alloc(&allocator_, capacity_);
+  }
+  used_ = 0;
+  requested_ = 0;
+}
+
+void StepArena::Release() {
+  FreeBlocks();
+  used_ = 0;
+  requested_ = 0;
+}
+
+void StepArena::FreeBlocks() {
+  for (auto* p : overflow_)
+    allocator_.Free(&allocator_, p);
+  overflow_.clear();
+  if (block_)
+    allocator_.Free(&allocator_, block_);
+  block_ = nullptr;
+  capacity_ = 0;
+}
+
+}  // namespace Generators
@@ -0,0 +1,37 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// Bump allocator for tensors that only live for a couple of runs, like the kv cache presents and pasts that are
+// replaced every step. Allocations are carved out of one block of the underlying allocator and Free does nothing, so a
+// step's tensors don't take the (possibly shared) underlying allocator's lock or fragment it. Reset() makes the whole
+// block available again. When a step needs more than the block holds the rest gets its own allocations, and the next
+// Reset() grows the block to fit everything the step asked for
+struct StepArena : OrtAllocator {
+  StepArena(OrtAllocator& allocator);
+  StepArena(const StepArena&) = delete;
+  StepArena& operator=(const StepArena&) = delete;
+  ~StepArena();
+
+  void Reset();    // Everything allocated since the last Reset() must no longer be used
+  void Release();  // Frees the block, nothing allocated from the arena may be used anymore
+
+  size_t GetCapacity() const { return capacity_; }
+
+ private:
+  void* Allocate(size_t size);
+  void FreeBlocks();
+
+  static constexpr size_t c_alignment = 256;  // Matches what the CUDA allocator hands out
+
+  OrtAllocator& allocator_;
+  void* block_{};
+  size_t capacity_{};
+  size_t used_{};       // Bytes of the block handed out since the last Reset()
+  size_t requested_{};  // Bytes asked for since the last Reset(), including the overflow allocations
+  std::vector<void*> overflow_;
+};
+
+}  // namespace Generators
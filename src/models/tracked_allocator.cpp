@@ -0,0 +1,59 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "tracked_allocator.h"
+
+namespace Generators {
+
+const char* GetAllocationSiteName(AllocationSite site) {
+  switch (site) {
+    case AllocationSite::KV_Cache:
+      return "kv_cache";
+    case AllocationSite::Logits:
+      return "logits";
+    case AllocationSite::InputIDs:
+      return "input_ids";
+    case AllocationSite::PositionInputs:
+      return "position_inputs";
+    case AllocationSite::StepArena:
+      return "step_arena";
+    default:
+      throw std::runtime_error("Unknown allocation site");
+  }
+}
+
+TrackedAllocator::TrackedAllocator(OrtAllocator& allocator, AllocationStats& stats) : OrtAllocator{}, allocator_{allocator}, stats_{stats} {
+  version = ORT_API_VERSION;
+  OrtAllocator::Alloc = [](OrtAllocator* this_, size_t size) { return static_cast<TrackedAllocator*>(this_)->Allocate(size); };
+  OrtAllocator::Free = [](OrtAllocator* this_, void* p) { static_cast<TrackedAllocator*>(this_)->Release(p); };
+  OrtAllocator::Info = [](const OrtAllocator* this_) {
+    auto& allocator = static_cast<const TrackedAllocator*>(this_)->allocator_;
+    return allocator.Info(&allocator);
+  };
+}
+
+void* TrackedAllocator::Allocate(size_t size) {
+  void* p = allocator_.Alloc(&allocator_, size);
+  if (!p)
+    return nullptr;
+  stats_.OnAllocate(size);
+  std::lock_guard lock{mutex_};
+  sizes_[p] = size;
+  return p;
+}
+
+void TrackedAllocator::Release(void* p) {
+  if (!p)
+    return;
+  {
+    std::lock_guard lock{mutex_};
+    auto it = sizes_.find(p);
+    if (it != sizes_.end()) {
+      stats_.OnFree(it->second);
+      sizes_.erase(it);
+    }
+  }
+  allocator_.Free(&allocator_, p);
+}
+
+}  // namespace Generators
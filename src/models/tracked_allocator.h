@@ -0,0 +1,36 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// The subsystems whose device allocations are counted, see Model::GetDeviceAllocator. RoamingArray isn't one, its
+// copies come from the CudaCopyPool that keeps its own stats
+enum class AllocationSite {
+  KV_Cache,
+  Logits,
+  InputIDs,
+  PositionInputs,
+  StepArena,  // The blocks of the state's step arenas, whatever is carved out of them
+  Count,
+};
+
+const char* GetAllocationSiteName(AllocationSite site);  // As used in the metric names, like kv_cache
+
+// Passes every allocation on to the underlying allocator, counting it in stats
+struct TrackedAllocator : OrtAllocator {
+  TrackedAllocator(OrtAllocator& allocator, AllocationStats& stats);
+  TrackedAllocator(const TrackedAllocator&) = delete;
+  TrackedAllocator& operator=(const TrackedAllocator&) = delete;
+
+ private:
+  void* Allocate(size_t size);
+  void Release(void* p);
+
+  OrtAllocator& allocator_;
+  AllocationStats& stats_;
+  std::mutex mutex_;
+  std::unordered_map<void*, size_t> sizes_;  // Free isn't given the size of the allocation
+};
+
+}  // namespace Generators
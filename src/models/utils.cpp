@@ -1,9 +1,93 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // Licensed under the MIT License.
 #include "../generators.h"
+#include "utils.h"
+#include <cstdio>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 namespace Generators {
 
+MappedFile::MappedFile(const fs::path& path) {
+#ifdef _WIN32
+  file_ = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file_ == INVALID_HANDLE_VALUE)
+    throw std::runtime_error("Failed to open " + path.string() + " for memory mapping");
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+    CloseHandle(file_);
+    throw std::runtime_error("Failed to get the size of " + path.string());
+  }
+  size_ = static_cast<size_t>(size.QuadPart);
+
+  mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping_)
+    data_ = MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+  if (!data_) {
+    if (mapping_)
+      CloseHandle(mapping_);
+    CloseHandle(file_);
+    throw std::runtime_error("Failed to memory map " + path.string());
+  }
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    throw std::runtime_error("Failed to open " + path.string() + " for memory mapping");
+
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size == 0) {
+    close(fd);
+    throw std::runtime_error("Failed to get the size of " + path.string());
+  }
+  size_ = static_cast<size_t>(info.st_size);
+
+  // The mapping stays valid after the file is closed
+  data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data_ == MAP_FAILED) {
+    data_ = nullptr;
+    throw std::runtime_error("Failed to memory map " + path.string());
+  }
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+  UnmapViewOfFile(data_);
+  CloseHandle(mapping_);
+  CloseHandle(file_);
+#else
+  munmap(data_, size_);
+#endif
+}
+
+uint64_t GetFileStamp(const fs::path& path) {
+#ifdef _WIN32
+  struct _stat64 info;
+  if (_wstat64(path.c_str(), &info) != 0)
+    return 0;
+#else
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0)
+    return 0;
+#endif
+  return (static_cast<uint64_t>(info.st_mtime) * 1099511628211ULL) ^ static_cast<uint64_t>(info.st_size);
+}
+
+void RenameFile(const fs::path& from, const fs::path& to) {
+#ifdef _WIN32
+  const bool renamed = MoveFileExW(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+  const bool renamed = std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+  if (!renamed)
+    throw std::runtime_error("Failed to rename " + from.string() + " to " + to.string());
+}
+
 size_t SizeOf(ONNXTensorElementDataType type) {
   switch (type) {
     case Ort::TypeToTensorType<uint8_t>::type:
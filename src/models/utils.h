@@ -19,6 +19,32 @@ struct OrtxPtr {
   T* p_{};
 };
 
+// A read only mapping of a whole file, so the OS pages it in on demand and shares the pages between processes
+struct MappedFile {
+  MappedFile(const fs::path& path);
+  ~MappedFile();
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const void* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  void* data_{};
+  size_t size_{};
+#ifdef _WIN32
+  HANDLE file_{INVALID_HANDLE_VALUE};
+  HANDLE mapping_{};
+#endif
+};
+
+// Changes whenever the file is rewritten, as it combines the size & modification time. 0 if the file doesn't exist
+uint64_t GetFileStamp(const fs::path& path);
+
+// Replaces 'to' if it exists, throws on failure
+void RenameFile(const fs::path& from, const fs::path& to);
+
 size_t SizeOf(ONNXTensorElementDataType type);
 
 // Slower fp16 to fp32 conversion that handles NaN and Inf (useful for debugging vs runtime conversion)
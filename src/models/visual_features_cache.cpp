@@ -0,0 +1,59 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#include "../generators.h"
+#include "model.h"
+#include "visual_features_cache.h"
+
+namespace Generators {
+
+namespace {
+
+bool operator==(const VisualFeaturesCache::Key& a, const VisualFeaturesCache::Key& b) {
+  return a.hash == b.hash && a.bytes == b.bytes;
+}
+
+}  // namespace
+
+VisualFeaturesCache::VisualFeaturesCache(int max_entries)
+    : max_entries_{static_cast<size_t>(std::max(max_entries, 1))} {
+}
+
+VisualFeaturesCache::Key VisualFeaturesCache::GetKey(std::span<const OrtValue* const> inputs) {
+  Key key;
+  for (const auto* input : inputs) {
+    auto type_info = input->GetTensorTypeAndShapeInfo();
+    const size_t byte_count = type_info->GetElementCount() * SizeOf(type_info->GetElementType());
+    const std::string_view bytes{static_cast<const char*>(input->GetTensorRawData()), byte_count};
+
+    // Shapes are covered by the image sizes input, so the bytes are enough
+    key.hash = (key.hash ^ std::hash<std::string_view>{}(bytes)) * 1099511628211ULL;
+    key.bytes += bytes;
+  }
+  return key;
+}
+
+std::shared_ptr<OrtValue> VisualFeaturesCache::Find(const Key& key) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (it->first == key) {
+      entries_.splice(entries_.begin(), entries_, it);
+      return entries_.front().second;
+    }
+  }
+  return nullptr;
+}
+
+void VisualFeaturesCache::Store(const Key& key, std::shared_ptr<OrtValue> visual_features) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  // Two generators with the same image can both miss and run it, the first one stored is kept
+  for (auto& entry : entries_) {
+    if (entry.first == key)
+      return;
+  }
+
+  entries_.emplace_front(key, std::move(visual_features));
+  if (entries_.size() > max_entries_)
+    entries_.pop_back();
+}
+
+}  // namespace Generators
@@ -0,0 +1,34 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+#include <list>
+#include <mutex>
+
+namespace Generators {
+
+// Model level cache of the vision model's visual features, keyed by the contents of its inputs, so prompts repeating an
+// image (a product photo, a document page in a multi turn chat) don't run the vision model again. Entries are shared, so
+// one that's evicted stays alive while a State uses it.
+struct VisualFeaturesCache {
+  VisualFeaturesCache(int max_entries);
+
+  struct Key {
+    size_t hash{};
+    std::string bytes;  // Of all the inputs, compared on a hash match so a collision can't return another image's features
+  };
+
+  // The inputs must be on the CPU, like the ones the MultiModalProcessor creates
+  static Key GetKey(std::span<const OrtValue* const> inputs);
+
+  std::shared_ptr<OrtValue> Find(const Key& key);
+  void Store(const Key& key, std::shared_ptr<OrtValue> visual_features);
+
+ private:
+  const size_t max_entries_;
+
+  std::mutex mutex_;
+  std::list<std::pair<Key, std::shared_ptr<OrtValue>>> entries_;  // Most recently used first
+};
+
+}  // namespace Generators
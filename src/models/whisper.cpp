@@ -5,10 +5,27 @@
 
 namespace Generators {
 
+namespace {
+
+// The encoder's strided convolution halves the mel frames, so a full 30 second window of 3000 frames has 1500 encoder
+// frames. Shorter windows, like the chunks of live audio given to encoders exported with a dynamic frame count, have
+// fewer, and the encoder outputs & cross attention caches are sized to match instead of always covering 30 seconds.
+int64_t GetEncoderSequenceLength(const GeneratorParams& params) {
+  const auto& inputs = std::get<GeneratorParams::Whisper>(params.inputs);
+  if (!inputs.input_features)
+    throw std::runtime_error("Whisper models need input_features");
+  const auto shape = inputs.input_features->ort_tensor_->GetTensorTypeAndShapeInfo()->GetShape();
+  if (shape.size() != 3 || shape[2] < 1)
+    throw std::runtime_error("Whisper input_features must be shaped [batch_size, number_of_mels, number_of_frames]");
+  return (shape[2] + 1) / 2;
+}
+
+}  // namespace
+
 Whisper_Model::Whisper_Model(std::unique_ptr<Config> config, OrtEnv& ort_env)
     : Model{std::move(config)} {
-  session_decoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.decoder.filename)).c_str(), session_options_.get());
-  session_encoder_ = OrtSession::Create(ort_env, (config_->config_path / fs::path(config_->model.encoder_decoder_init.filename)).c_str(), session_options_.get());
+  session_decoder_ = CreateSession(ort_env, config_->model.decoder.filename, session_options_.get());
+  session_encoder_ = CreateSession(ort_env, config_->model.encoder_decoder_init.filename, session_options_.get());
 
   InitDeviceAllocator(*session_decoder_);
   session_encoder_info_ = std::make_unique<SessionInfo>(*session_encoder_);
@@ -20,13 +37,15 @@ std::unique_ptr<State> Whisper_Model::CreateState(RoamingArray<int32_t> sequence
 
 Whisper_State::Whisper_State(const Whisper_Model& model, RoamingArray<int32_t> sequence_lengths_unk, const GeneratorParams& params)
     : State{params, model},
-      model_{model} {
+      model_{model},
+      captured_graph_info_{model.GetCapturedGraphPool()->ReserveCapturedGraph(model, params, GetEncoderSequenceLength(params))},
+      cross_cache_{model, *this, GetEncoderSequenceLength(params)} {
   auto& inputs = const_cast<GeneratorParams::Whisper&>(std::get<GeneratorParams::Whisper>(params.inputs));
 
-  encoder_input_ids_ = model_.ExpandInputs(inputs.input_features->ort_tensor_, params_->search.num_beams);
+  encoder_input_ids_ = model_.ExpandInputs(inputs.input_features->ort_tensor_, params_->search.num_beams, cuda_stream_);
 
   auto hidden_states_type = model_.session_encoder_info_->GetOutputDataType("encoder_hidden_states");
-  auto encoder_hidden_states_shape = std::array<int64_t, 3>{decoder_input_ids_.GetShape()[0], 1500, static_cast<int64_t>(model_.config_->model.decoder.num_key_value_heads) * model_.config_->model.decoder.head_size};
+  auto encoder_hidden_states_shape = std::array<int64_t, 3>{decoder_input_ids_.GetShape()[0], GetEncoderSequenceLength(params), static_cast<int64_t>(model_.config_->model.decoder.num_key_value_heads) * model_.config_->model.decoder.head_size};
   encoder_hidden_states_ = OrtValue::CreateTensor(*model_.allocator_device_, encoder_hidden_states_shape, hidden_states_type);
 
   auto sequence_lengths = sequence_lengths_unk.GetCPU();
@@ -52,7 +71,7 @@ RoamingArray<float> Whisper_State::Run(int current_length, RoamingArray<int32_t>
 
   switch (run_state_) {
     case RunState::Encoder_Decoder_Init:
-      State::Run(*model_.session_encoder_, *model_.run_options_, batch_size);
+      State::Run(*model_.session_encoder_, *run_options_, batch_size);
 
       run_state_ = RunState::Decoder_First;
       return logits_.Get();
@@ -73,13 +92,13 @@ RoamingArray<float> Whisper_State::Run(int current_length, RoamingArray<int32_t>
       break;
   }
 
-  State::Run(*model_.session_decoder_, *model_.run_options_, batch_size);
+  State::Run(*model_.session_decoder_, *run_options_, batch_size);
   return logits_.Get();
 }
 
 void Whisper_State::UpdateInputsOutputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> beam_indices, int current_length) {
   decoder_input_ids_.Update(next_tokens);
-  kv_cache_.Update(beam_indices.GetCPU(), current_length);
+  kv_cache_.Update(beam_indices, current_length);
   logits_.Update();
 }
 
@@ -22,6 +22,7 @@ struct Whisper_Model : Model {
 struct Whisper_State : State {
   Whisper_State(const Whisper_Model& model, RoamingArray<int32_t> sequence_lengths, const GeneratorParams& params);
   RoamingArray<float> Run(int current_length, RoamingArray<int32_t> next_tokens, RoamingArray<int32_t> next_indices) override;
+  const CapturedGraphInfo* GetCapturedGraphInfo() const override { return captured_graph_info_.get(); };
 
  private:
   void UpdateInputsOutputs(const RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t> next_indices, int current_length);
@@ -33,10 +34,13 @@ struct Whisper_State : State {
     Decoder,
   } run_state_{RunState::Encoder_Decoder_Init};
 
+  // Only the decoder steps are captured, the encoder step runs once. Initialized before the inputs below, as they use it
+  CapturedGraphInfoPtr captured_graph_info_;
+
   InputIDs decoder_input_ids_{model_, *this};
   Logits logits_{model_, *this};
   KV_Cache kv_cache_{model_, *this};
-  Cross_Cache cross_cache_{model_, *this};
+  Cross_Cache cross_cache_;
   ExtraInputs extra_inputs_{model_, *this};
   std::unique_ptr<OrtValue> encoder_input_ids_;
   std::unique_ptr<OrtValue> encoder_hidden_states_;
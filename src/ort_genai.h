@@ -72,9 +72,90 @@ struct OgaModel : OgaAbstract {
     return std::unique_ptr<OgaSequences>(p);
   }
 
+  // out_logprobs holds as many floats as there are continuation tokens, see OgaModel_Score
+  void Score(const OgaSequences& prompts, const OgaSequences& continuations, float* out_logprobs) const {
+    OgaCheckResult(OgaModel_Score(this, &prompts, &continuations, out_logprobs));
+  }
+
+  // Empty batch_sizes or prompt_lengths use the model's graph capture buckets, see OgaModelWarmup
+  void Warmup(const OgaGeneratorParams& params, const int32_t* batch_sizes = nullptr, size_t batch_size_count = 0,
+              const int32_t* prompt_lengths = nullptr, size_t prompt_length_count = 0) const {
+    OgaCheckResult(OgaModelWarmup(this, &params, batch_sizes, batch_size_count, prompt_lengths, prompt_length_count));
+  }
+
+#if __cplusplus >= 202002L
+  void Warmup(const OgaGeneratorParams& params, std::span<const int32_t> batch_sizes, std::span<const int32_t> prompt_lengths = {}) const {
+    Warmup(params, batch_sizes.data(), batch_sizes.size(), prompt_lengths.data(), prompt_lengths.size());
+  }
+#endif
+
+  size_t GetEmbeddingSize() const {
+    size_t size;
+    OgaCheckResult(OgaModel_GetEmbeddingSize(this, &size));
+    return size;
+  }
+
+  // out_embeddings holds prompts.Count() * GetEmbeddingSize() floats, see OgaModel_Embed
+  void Embed(const OgaSequences& prompts, const char* pooling, size_t max_batch_tokens, float* out_embeddings) const {
+    OgaCheckResult(OgaModel_Embed(this, &prompts, pooling, max_batch_tokens, out_embeddings));
+  }
+
+  double GetMetric(const char* name) const {
+    double value;
+    OgaCheckResult(OgaModel_GetMetric(this, name, &value));
+    return value;
+  }
+
+  void LoadAdapter(const char* adapter_name, const char* const* weight_names, OgaTensor* const* weights, size_t weight_count) {
+    OgaCheckResult(OgaModelLoadAdapter(this, adapter_name, weight_names, weights, weight_count));
+  }
+
+  void UnloadAdapter(const char* adapter_name) {
+    OgaCheckResult(OgaModelUnloadAdapter(this, adapter_name));
+  }
+
+  // A descriptor of the kv caches of the longest cached prefix of tokens, for ImportPrefix in other processes
+  std::vector<uint8_t> ExportPrefix(const int32_t* tokens, size_t token_count) {
+    const uint8_t* data;
+    size_t size;
+    OgaCheckResult(OgaModelExportPrefix(this, tokens, token_count, &data, &size));
+    std::vector<uint8_t> descriptor(data, data + size);
+    OgaDestroyBuffer(data);
+    return descriptor;
+  }
+
+  void ImportPrefix(const uint8_t* data, size_t size) {
+    OgaCheckResult(OgaModelImportPrefix(this, data, size));
+  }
+
   static void operator delete(void* p) { OgaDestroyModel(reinterpret_cast<OgaModel*>(p)); }
 };
 
+struct OgaReloadableModel : OgaAbstract {
+  static std::unique_ptr<OgaReloadableModel> Create(const char* config_path) {
+    OgaReloadableModel* p;
+    OgaCheckResult(OgaCreateReloadableModel(config_path, &p));
+    return std::unique_ptr<OgaReloadableModel>(p);
+  }
+
+  // The current version, call it for every new request so requests move to a reloaded model
+  std::unique_ptr<OgaModel> GetModel() const {
+    OgaModel* p;
+    OgaCheckResult(OgaReloadableModelGetModel(this, &p));
+    return std::unique_ptr<OgaModel>(p);
+  }
+
+  void Reload(const char* config_path) {
+    OgaCheckResult(OgaReloadableModelReload(this, config_path));
+  }
+
+  uint64_t GetVersion() const {
+    return OgaReloadableModelGetVersion(this);
+  }
+
+  static void operator delete(void* p) { OgaDestroyReloadableModel(reinterpret_cast<OgaReloadableModel*>(p)); }
+};
+
 struct OgaString {
   OgaString(const char* p) : p_{p} {}
   ~OgaString() { OgaDestroyString(p_); }
@@ -103,6 +184,10 @@ struct OgaSequences : OgaAbstract {
     return OgaSequencesGetSequenceData(this, index);
   }
 
+  void Append(const int32_t* tokens, size_t token_count) {
+    OgaCheckResult(OgaAppendTokenSequence(tokens, token_count, this));
+  }
+
 #if __cplusplus >= 202002L
   std::span<const int32_t> Get(size_t index) const {
     return {SequenceData(index), SequenceCount(index)};
@@ -112,6 +197,10 @@ struct OgaSequences : OgaAbstract {
   static void operator delete(void* p) { OgaDestroySequences(reinterpret_cast<OgaSequences*>(p)); }
 };
 
+struct OgaEncodedPrefix : OgaAbstract {
+  static void operator delete(void* p) { OgaDestroyEncodedPrefix(reinterpret_cast<OgaEncodedPrefix*>(p)); }
+};
+
 struct OgaTokenizer : OgaAbstract {
   static std::unique_ptr<OgaTokenizer> Create(const OgaModel& model) {
     OgaTokenizer* p;
@@ -123,6 +212,16 @@ struct OgaTokenizer : OgaAbstract {
     OgaCheckResult(OgaTokenizerEncode(this, str, &sequences));
   }
 
+  std::unique_ptr<OgaEncodedPrefix> EncodePrefix(const char* prefix) const {
+    OgaEncodedPrefix* p;
+    OgaCheckResult(OgaTokenizerEncodePrefix(this, prefix, &p));
+    return std::unique_ptr<OgaEncodedPrefix>(p);
+  }
+
+  void EncodeWithPrefix(const OgaEncodedPrefix& prefix, const char* suffix, OgaSequences& sequences) const {
+    OgaCheckResult(OgaTokenizerEncodeWithPrefix(this, &prefix, suffix, &sequences));
+  }
+
   OgaString Decode(const int32_t* tokens_data, size_t tokens_length) const {
     const char* p;
     OgaCheckResult(OgaTokenizerDecode(this, tokens_data, tokens_length, &p));
@@ -164,6 +263,22 @@ struct OgaTokenizerStream : OgaAbstract {
     return out;
   }
 
+  /*
+   * Decodes the next token of every stream into buffer, see OgaTokenizerStreamDecodeNext.
+   * chunk_offsets must hold stream_count + 1 offsets
+   */
+  static void DecodeNext(OgaTokenizerStream* const* streams, const int32_t* tokens, size_t stream_count, char* buffer, size_t buffer_size, size_t* chunk_offsets) {
+    OgaCheckResult(OgaTokenizerStreamDecodeNext(streams, tokens, stream_count, buffer, buffer_size, chunk_offsets));
+  }
+
+#if __cplusplus >= 202002L
+  static void DecodeNext(std::span<OgaTokenizerStream* const> streams, std::span<const int32_t> tokens, std::span<char> buffer, std::span<size_t> chunk_offsets) {
+    if (tokens.size() != streams.size() || chunk_offsets.size() != streams.size() + 1)
+      throw std::runtime_error("DecodeNext needs one token per stream and the stream count + 1 chunk offsets");
+    DecodeNext(streams.data(), tokens.data(), streams.size(), buffer.data(), buffer.size(), chunk_offsets.data());
+  }
+#endif
+
   static void operator delete(void* p) { OgaDestroyTokenizerStream(reinterpret_cast<OgaTokenizerStream*>(p)); }
 };
 
@@ -182,6 +297,34 @@ struct OgaGeneratorParams : OgaAbstract {
     OgaCheckResult(OgaGeneratorParamsSetSearchBool(this, name, value));
   }
 
+  void SetAdapters(const char* const* adapter_names, size_t adapter_count) {
+    OgaCheckResult(OgaGeneratorParamsSetAdapters(this, adapter_names, adapter_count));
+  }
+
+  void AddLogitsProcessor(OgaLogitsProcessorCallback callback, void* user_data) {
+    OgaCheckResult(OgaGeneratorParamsAddLogitsProcessor(this, callback, user_data));
+  }
+
+  void SetGuidance(const char* type, const char* data) {
+    OgaCheckResult(OgaGeneratorParamsSetGuidance(this, type, data));
+  }
+
+  void AddStopSequence(const int32_t* tokens, size_t token_count) {
+    OgaCheckResult(OgaGeneratorParamsAddStopSequence(this, tokens, token_count));
+  }
+
+  void SetTimeout(double seconds) {
+    OgaCheckResult(OgaGeneratorParamsSetTimeout(this, seconds));
+  }
+
+  void SetRowSearchOption(size_t row, const char* name, double value) {
+    OgaCheckResult(OgaGeneratorParamsSetRowSearchNumber(this, row, name, value));
+  }
+
+  void SetRowSearchOptionBool(size_t row, const char* name, bool value) {
+    OgaCheckResult(OgaGeneratorParamsSetRowSearchBool(this, row, name, value));
+  }
+
   void SetInputIDs(const int32_t* input_ids, size_t input_ids_count, size_t sequence_length, size_t batch_size) {
     OgaCheckResult(OgaGeneratorParamsSetInputIDs(this, input_ids, input_ids_count, sequence_length, batch_size));
   }
@@ -190,10 +333,27 @@ struct OgaGeneratorParams : OgaAbstract {
     OgaCheckResult(OgaGeneratorParamsSetInputSequences(this, &sequences));
   }
 
+  // A state saved by OgaGenerator::SaveState to continue from, the input ids must start with its tokens
+  void SetRestoredState(const uint8_t* data, size_t size) {
+    OgaCheckResult(OgaGeneratorParamsSetRestoredState(this, data, size));
+  }
+
   void SetModelInput(const char* name, OgaTensor& tensor) {
     OgaCheckResult(OgaGeneratorParamsSetModelInput(this, name, &tensor));
   }
 
+  void SetWhisperInputFeatures(OgaTensor& tensor) {
+    OgaCheckResult(OgaGeneratorParamsSetWhisperInputFeatures(this, &tensor));
+  }
+
+  void SetWhisperInputFeaturesBatch(const OgaTensor* const* clips, size_t clip_count) {
+    OgaCheckResult(OgaGeneratorParamsSetWhisperInputFeaturesBatch(this, clips, clip_count));
+  }
+
+  void SetWhisperAudio(const float* const* clips, const size_t* sample_counts, size_t clip_count, int32_t sample_rate, int32_t mel_count = 80, bool pad_to_30_seconds = true) {
+    OgaCheckResult(OgaGeneratorParamsSetWhisperAudio(this, clips, sample_counts, clip_count, sample_rate, mel_count, pad_to_30_seconds));
+  }
+
   void SetInputs(OgaNamedTensors& named_tensors) {
     OgaCheckResult(OgaGeneratorParamsSetInputs(this, &named_tensors));
   }
@@ -216,6 +376,10 @@ struct OgaGenerator : OgaAbstract {
     return OgaGenerator_IsDone(this);
   }
 
+  void Cancel() {
+    OgaGenerator_Cancel(this);
+  }
+
   void ComputeLogits() {
     OgaCheckResult(OgaGenerator_ComputeLogits(this));
   }
@@ -224,6 +388,50 @@ struct OgaGenerator : OgaAbstract {
     OgaCheckResult(OgaGenerator_GenerateNextToken(this));
   }
 
+  void SwapOut() {
+    OgaCheckResult(OgaGenerator_SwapOut(this));
+  }
+
+  void SwapIn() {
+    OgaCheckResult(OgaGenerator_SwapIn(this));
+  }
+
+  bool IsSwappedOut() const {
+    return OgaGenerator_IsSwappedOut(this);
+  }
+
+  std::vector<uint8_t> SaveState() {
+    const uint8_t* data;
+    size_t size;
+    OgaCheckResult(OgaGenerator_SaveState(this, &data, &size));
+    std::vector<uint8_t> state(data, data + size);
+    OgaDestroyBuffer(data);
+    return state;
+  }
+
+  // Before the first ComputeLogits, the input_ids must start with the saved tokens
+  void RestoreState(const uint8_t* data, size_t size) {
+    OgaCheckResult(OgaGenerator_RestoreState(this, data, size));
+  }
+
+  // Continues the sequence in a new generator that shares the kv caches run so far, see OgaGenerator_Fork
+  std::unique_ptr<OgaGenerator> Fork() {
+    OgaGenerator* p;
+    OgaCheckResult(OgaGenerator_Fork(this, &p));
+    return std::unique_ptr<OgaGenerator>(p);
+  }
+
+  // Returns the number of steps run, their batch_size next tokens each are written one step after another to tokens
+  size_t GenerateTokens(size_t max_steps, int32_t* tokens, size_t tokens_count) {
+    size_t step_count;
+    OgaCheckResult(OgaGenerator_GenerateTokens(this, max_steps, tokens, tokens_count, &step_count));
+    return step_count;
+  }
+
+  void GenerateNextTokenAsync(OgaGeneratorCallback callback, void* user_data) {
+    OgaCheckResult(OgaGenerator_GenerateNextTokenAsync(this, callback, user_data));
+  }
+
   size_t GetSequenceCount(size_t index) const {
     return OgaGenerator_GetSequenceCount(this, index);
   }
@@ -238,9 +446,131 @@ struct OgaGenerator : OgaAbstract {
   }
 #endif
 
+  // Valid until the next step, see OgaGenerator_GetNextTokens
+  void GetNextTokens(const int32_t*& tokens, size_t& count) {
+    OgaCheckResult(OgaGenerator_GetNextTokens(this, &tokens, &count));
+  }
+
+#if __cplusplus >= 202002L
+  std::span<const int32_t> GetNextTokens() {
+    const int32_t* tokens;
+    size_t count;
+    GetNextTokens(tokens, count);
+    return {tokens, count};
+  }
+#endif
+
+  // See OgaGenerator_GetLogProbs for the sizes
+  void GetLogProbs(float* logprobs, int32_t* top_tokens = nullptr, float* top_logprobs = nullptr) {
+    OgaCheckResult(OgaGenerator_GetLogProbs(this, logprobs, top_tokens, top_logprobs));
+  }
+
+  double GetMetric(const char* name) const {
+    double value;
+    OgaCheckResult(OgaGenerator_GetMetric(this, name, &value));
+    return value;
+  }
+
+  // counts has bucket_count entries, upper_bounds_ms one less
+  void GetDecodeTimeHistogram(const double*& upper_bounds_ms, const uint64_t*& counts, size_t& bucket_count) const {
+    OgaCheckResult(OgaGenerator_GetDecodeTimeHistogram(this, &upper_bounds_ms, &counts, &bucket_count));
+  }
+
   static void operator delete(void* p) { OgaDestroyGenerator(reinterpret_cast<OgaGenerator*>(p)); }
 };
 
+struct OgaScheduler : OgaAbstract {
+  static std::unique_ptr<OgaScheduler> Create(const OgaModel& model, int32_t max_active_requests, size_t max_kv_cache_bytes = 0, bool stream_tokens = false) {
+    OgaScheduler* p;
+    OgaCheckResult(OgaCreateScheduler(&model, max_active_requests, max_kv_cache_bytes, stream_tokens, &p));
+    return std::unique_ptr<OgaScheduler>(p);
+  }
+
+  uint64_t AddRequest(const OgaGeneratorParams& params, int32_t priority = 0) {
+    uint64_t id;
+    OgaCheckResult(OgaSchedulerAddRequest(this, &params, priority, &id));
+    return id;
+  }
+
+  void Step() {
+    OgaCheckResult(OgaSchedulerStep(this));
+  }
+
+  void Cancel(uint64_t request_id) {
+    OgaCheckResult(OgaSchedulerCancel(this, request_id));
+  }
+
+  bool IsDone() const {
+    return OgaScheduler_IsDone(this);
+  }
+
+  size_t GetStepTokenCount() const {
+    return OgaScheduler_GetStepTokenCount(this);
+  }
+
+  // The tokens are the scheduler's until the next Step()
+  void GetStepTokens(size_t index, uint64_t& request_id, const int32_t*& tokens, size_t& token_count) const {
+    OgaCheckResult(OgaScheduler_GetStepTokens(this, index, &request_id, &tokens, &token_count));
+  }
+
+  // errors gets nullptr or an error to destroy with OgaDestroyString for each request, see OgaSchedulerTakeFinished
+  size_t TakeFinished(uint64_t* request_ids, const char** errors, size_t capacity, OgaSequences* sequences = nullptr) {
+    size_t count;
+    OgaCheckResult(OgaSchedulerTakeFinished(this, request_ids, errors, capacity, &count, sequences));
+    return count;
+  }
+
+  double GetMetric(const char* name) const {
+    double value;
+    OgaCheckResult(OgaScheduler_GetMetric(this, name, &value));
+    return value;
+  }
+
+  static void operator delete(void* p) { OgaDestroyScheduler(reinterpret_cast<OgaScheduler*>(p)); }
+};
+
+struct OgaReplicaPool : OgaAbstract {
+  static std::unique_ptr<OgaReplicaPool> Create(const char* config_path, const int32_t* device_ids, size_t device_count) {
+    OgaReplicaPool* p;
+    OgaCheckResult(OgaCreateReplicaPool(config_path, device_ids, device_count, &p));
+    return std::unique_ptr<OgaReplicaPool>(p);
+  }
+
+  size_t GetReplicaCount() const {
+    return OgaReplicaPool_GetReplicaCount(this);
+  }
+
+  std::unique_ptr<OgaModel> GetReplica(size_t index) const {
+    OgaModel* p;
+    OgaCheckResult(OgaReplicaPoolGetReplica(this, index, &p));
+    return std::unique_ptr<OgaModel>(p);
+  }
+
+  // On the least loaded replica, params can be of any of them
+  std::unique_ptr<OgaGenerator> CreateGenerator(const OgaGeneratorParams& params) const {
+    OgaGenerator* p;
+    OgaCheckResult(OgaReplicaPoolCreateGenerator(this, &params, &p));
+    return std::unique_ptr<OgaGenerator>(p);
+  }
+
+  std::unique_ptr<OgaScheduler> CreateScheduler(int32_t max_active_requests, size_t max_kv_cache_bytes = 0, bool stream_tokens = false, bool prefix_affinity = false) const {
+    OgaScheduler* p;
+    OgaCheckResult(OgaReplicaPoolCreateScheduler(this, max_active_requests, max_kv_cache_bytes, stream_tokens, prefix_affinity, &p));
+    return std::unique_ptr<OgaScheduler>(p);
+  }
+
+  // Into every replica
+  void LoadAdapter(const char* adapter_name, const char* const* weight_names, OgaTensor* const* weights, size_t weight_count) {
+    OgaCheckResult(OgaReplicaPoolLoadAdapter(this, adapter_name, weight_names, weights, weight_count));
+  }
+
+  void UnloadAdapter(const char* adapter_name) {
+    OgaCheckResult(OgaReplicaPoolUnloadAdapter(this, adapter_name));
+  }
+
+  static void operator delete(void* p) { OgaDestroyReplicaPool(reinterpret_cast<OgaReplicaPool*>(p)); }
+};
+
 struct OgaTensor : OgaAbstract {
 #if __cplusplus >= 202002L
   static std::unique_ptr<OgaTensor> Create(void* data, std::span<const int64_t> shape, OgaElementType element_type) {
@@ -255,6 +585,13 @@ struct OgaTensor : OgaAbstract {
     return std::unique_ptr<OgaTensor>(p);
   }
 
+  // data is device memory on CUDA device device_id, written on the cudaStream_t stream, see OgaCreateTensorFromDeviceBuffer
+  static std::unique_ptr<OgaTensor> CreateOnDevice(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, int device_id, void* stream) {
+    OgaTensor* p;
+    OgaCheckResult(OgaCreateTensorFromDeviceBuffer(data, shape_dims, shape_dims_count, element_type, device_id, stream, &p));
+    return std::unique_ptr<OgaTensor>(p);
+  }
+
   OgaElementType Type() {
     OgaElementType type;
     OgaCheckResult(OgaTensorGetType(this, &type));
@@ -285,6 +622,12 @@ struct OgaImages : OgaAbstract {
     return std::unique_ptr<OgaImages>(p);
   }
 
+  static std::unique_ptr<OgaImages> Load(const char* const* image_paths, size_t image_count) {
+    OgaImages* p;
+    OgaCheckResult(OgaLoadImages(image_paths, image_count, &p));
+    return std::unique_ptr<OgaImages>(p);
+  }
+
   static void operator delete(void* p) { OgaDestroyImages(reinterpret_cast<OgaImages*>(p)); }
 };
 
@@ -305,6 +648,13 @@ struct OgaMultiModalProcessor : OgaAbstract {
     return std::unique_ptr<OgaNamedTensors>(p);
   }
 
+  std::unique_ptr<OgaNamedTensors> ProcessImages(const char* const* prompts, size_t prompt_count, const OgaImages* images = nullptr,
+                                                 const size_t* image_counts = nullptr) const {
+    OgaNamedTensors* p;
+    OgaCheckResult(OgaProcessorProcessImagesBatch(this, prompts, prompt_count, images, image_counts, &p));
+    return std::unique_ptr<OgaNamedTensors>(p);
+  }
+
   OgaString Decode(const int32_t* tokens_data, size_t tokens_length) const {
     const char* p;
     OgaCheckResult(OgaProcessorDecode(this, tokens_data, tokens_length, &p));
@@ -340,6 +690,14 @@ void SetLogString(const char* name, const char* value) {
   OgaCheckResult(OgaSetLogString(name, value));
 }
 
+void SetAsyncThreadCount(int thread_count) {
+  OgaCheckResult(OgaSetAsyncThreadCount(thread_count));
+}
+
+void SetGlobalThreadPools(int intra_op_num_threads, int inter_op_num_threads) {
+  OgaCheckResult(OgaSetGlobalThreadPools(intra_op_num_threads, inter_op_num_threads));
+}
+
 void SetCurrentGpuDeviceId(int device_id) {
   OgaCheckResult(OgaSetCurrentGpuDeviceId(device_id));
 }
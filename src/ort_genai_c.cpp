@@ -8,6 +8,7 @@
 #include "ort_genai_c.h"
 #include "generators.h"
 #include "models/model.h"
+#include "scheduler.h"
 #include "search.h"
 
 namespace Generators {
@@ -51,6 +52,13 @@ OgaResult* OGA_API_CALL OgaSetLogString(const char* name, const char* value) {
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaSetGlobalThreadPools(int intra_op_num_threads, int inter_op_num_threads) {
+  OGA_TRY
+  Generators::SetGlobalThreadPools(intra_op_num_threads, inter_op_num_threads);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateSequences(OgaSequences** out) {
   OGA_TRY
   *out = reinterpret_cast<OgaSequences*>(std::make_unique<Generators::TokenSequences>().release());
@@ -70,6 +78,13 @@ const int32_t* OGA_API_CALL OgaSequencesGetSequenceData(const OgaSequences* p, s
   return (*reinterpret_cast<const Generators::TokenSequences*>(p))[sequence].data();
 }
 
+OgaResult* OGA_API_CALL OgaAppendTokenSequence(const int32_t* tokens, size_t token_count, OgaSequences* sequences) {
+  OGA_TRY
+  reinterpret_cast<Generators::TokenSequences*>(sequences)->emplace_back(tokens, tokens + token_count);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaLoadImage(const char* image_path, OgaImages** images) {
   OGA_TRY
   *images = reinterpret_cast<OgaImages*>(Generators::LoadImageImpl(image_path).release());
@@ -77,15 +92,158 @@ OgaResult* OGA_API_CALL OgaLoadImage(const char* image_path, OgaImages** images)
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaLoadImages(const char* const* image_paths, size_t image_count, OgaImages** images) {
+  OGA_TRY
+  *images = reinterpret_cast<OgaImages*>(Generators::LoadImagesImpl({image_paths, image_count}).release());
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateModel(const char* config_path, OgaModel** out) {
   OGA_TRY
   auto model = Generators::CreateModel(Generators::GetOrtEnv(), config_path);
-  model->external_owner_ = model;
+  model->AddExternalOwner();
   *out = reinterpret_cast<OgaModel*>(model.get());
   return nullptr;
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaCreateReloadableModel(const char* config_path, OgaReloadableModel** out) {
+  OGA_TRY
+  auto model = std::make_shared<Generators::ReloadableModel>(Generators::GetOrtEnv(), config_path);
+  model->external_owner_ = model;
+  *out = reinterpret_cast<OgaReloadableModel*>(model.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaReloadableModelGetModel(const OgaReloadableModel* model, OgaModel** out) {
+  OGA_TRY
+  auto current = reinterpret_cast<const Generators::ReloadableModel*>(model)->Get();
+  current->AddExternalOwner();
+  *out = reinterpret_cast<OgaModel*>(current.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaReloadableModelReload(OgaReloadableModel* model, const char* config_path) {
+  OGA_TRY
+  reinterpret_cast<Generators::ReloadableModel*>(model)->Reload(config_path);
+  return nullptr;
+  OGA_CATCH
+}
+
+uint64_t OGA_API_CALL OgaReloadableModelGetVersion(const OgaReloadableModel* model) {
+  return reinterpret_cast<const Generators::ReloadableModel*>(model)->GetVersion();
+}
+
+OgaResult* OGA_API_CALL OgaCreateReplicaPool(const char* config_path, const int32_t* device_ids, size_t device_count, OgaReplicaPool** out) {
+  OGA_TRY
+  auto pool = std::make_shared<Generators::ReplicaPool>(Generators::GetOrtEnv(), config_path, std::span<const int>{device_ids, device_count});
+  pool->external_owner_ = pool;
+  *out = reinterpret_cast<OgaReplicaPool*>(pool.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+size_t OGA_API_CALL OgaReplicaPool_GetReplicaCount(const OgaReplicaPool* pool) {
+  return reinterpret_cast<const Generators::ReplicaPool*>(pool)->GetReplicaCount();
+}
+
+OgaResult* OGA_API_CALL OgaReplicaPoolGetReplica(const OgaReplicaPool* pool, size_t index, OgaModel** out) {
+  OGA_TRY
+  auto replica = reinterpret_cast<const Generators::ReplicaPool*>(pool)->GetReplica(index);
+  replica->AddExternalOwner();
+  *out = reinterpret_cast<OgaModel*>(replica.get());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaReplicaPoolCreateGenerator(const OgaReplicaPool* pool, const OgaGeneratorParams* generator_params, OgaGenerator** out) {
+  OGA_TRY
+  *out = reinterpret_cast<OgaGenerator*>(reinterpret_cast<const Generators::ReplicaPool*>(pool)->CreateGenerator(*reinterpret_cast<const Generators::GeneratorParams*>(generator_params)).release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaReplicaPoolCreateScheduler(const OgaReplicaPool* pool, int32_t max_active_requests, size_t max_kv_cache_bytes, bool stream_tokens, bool prefix_affinity, OgaScheduler** out) {
+  OGA_TRY
+  Generators::SchedulerOptions options;
+  options.max_active_requests = max_active_requests;
+  options.max_kv_cache_bytes = max_kv_cache_bytes;
+  options.stream_tokens = stream_tokens;
+  options.prefix_affinity = prefix_affinity;
+  *out = reinterpret_cast<OgaScheduler*>(std::make_unique<Generators::Scheduler>(reinterpret_cast<const Generators::ReplicaPool*>(pool)->GetReplicas(), options).release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModelLoadAdapter(OgaModel* model, const char* adapter_name, const char* const* weight_names, OgaTensor* const* weights, size_t weight_count) {
+  OGA_TRY
+  auto* adapters = reinterpret_cast<Generators::Model*>(model)->GetAdapters();
+  if (!adapters)
+    throw std::runtime_error("The model has no adapter inputs, set model.decoder.adapters.max_adapters for one that does");
+  Generators::NamedTensors named_weights;
+  for (size_t i = 0; i < weight_count; i++)
+    named_weights.emplace(weight_names[i], reinterpret_cast<Generators::Tensor*>(weights[i])->shared_from_this());
+  adapters->Load(adapter_name, named_weights);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModelUnloadAdapter(OgaModel* model, const char* adapter_name) {
+  OGA_TRY
+  auto* adapters = reinterpret_cast<Generators::Model*>(model)->GetAdapters();
+  if (!adapters)
+    throw std::runtime_error("The model has no adapter inputs");
+  adapters->Unload(adapter_name);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaReplicaPoolLoadAdapter(OgaReplicaPool* pool, const char* adapter_name, const char* const* weight_names, OgaTensor* const* weights, size_t weight_count) {
+  OGA_TRY
+  Generators::NamedTensors named_weights;
+  for (size_t i = 0; i < weight_count; i++)
+    named_weights.emplace(weight_names[i], reinterpret_cast<Generators::Tensor*>(weights[i])->shared_from_this());
+  reinterpret_cast<Generators::ReplicaPool*>(pool)->LoadAdapter(adapter_name, named_weights);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaReplicaPoolUnloadAdapter(OgaReplicaPool* pool, const char* adapter_name) {
+  OGA_TRY
+  reinterpret_cast<Generators::ReplicaPool*>(pool)->UnloadAdapter(adapter_name);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModelExportPrefix(OgaModel* model, const int32_t* tokens, size_t token_count, const uint8_t** out_data, size_t* out_size) {
+  OGA_TRY
+  auto& cpp_model = *reinterpret_cast<Generators::Model*>(model);
+  auto* prefix_cache = cpp_model.GetPrefixCache();
+  if (!prefix_cache)
+    throw std::runtime_error("The model has no prefix cache, set model.decoder.prefix_cache.block_size for one");
+  auto descriptor = prefix_cache->Export(cpp_model, {tokens, token_count}, cpp_model.cuda_stream_);
+  auto buffer = std::make_unique<uint8_t[]>(descriptor.size());
+  std::copy(descriptor.begin(), descriptor.end(), buffer.get());
+  *out_size = descriptor.size();
+  *out_data = buffer.release();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModelImportPrefix(OgaModel* model, const uint8_t* data, size_t size) {
+  OGA_TRY
+  auto& cpp_model = *reinterpret_cast<Generators::Model*>(model);
+  auto* prefix_cache = cpp_model.GetPrefixCache();
+  if (!prefix_cache)
+    throw std::runtime_error("The model has no prefix cache, set model.decoder.prefix_cache.block_size for one");
+  prefix_cache->Import(cpp_model, {data, size});
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateGeneratorParams(const OgaModel* model, OgaGeneratorParams** out) {
   OGA_TRY
   auto params = std::make_shared<Generators::GeneratorParams>(*reinterpret_cast<const Generators::Model*>(model));
@@ -117,6 +275,80 @@ OgaResult* OGA_API_CALL OgaGeneratorParamsTryGraphCaptureWithMaxBatchSize(OgaGen
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetAdapters(OgaGeneratorParams* generator_params, const char* const* adapter_names, size_t adapter_count) {
+  OGA_TRY
+  auto* params = reinterpret_cast<Generators::GeneratorParams*>(generator_params);
+  params->adapter_names.assign(adapter_names, adapter_names + adapter_count);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsAddLogitsProcessor(OgaGeneratorParams* generator_params, OgaLogitsProcessorCallback callback, void* user_data) {
+  OGA_TRY
+  if (!callback)
+    throw std::runtime_error("The logits processor callback can't be null");
+  auto* params = reinterpret_cast<Generators::GeneratorParams*>(generator_params);
+  params->logits_processors.emplace_back([callback, user_data](Generators::LogitsProcessorContext& context) {
+    float* scores;
+    const int32_t* sequences;
+#if USE_CUDA
+    if (context.device_type == Generators::DeviceType::CUDA) {
+      scores = context.scores.GetGPU().data();
+      sequences = context.sequences.GetGPU().data();
+    } else
+#endif
+    {
+      scores = context.scores.GetCPU().data();
+      sequences = context.sequences.GetCPU().data();
+    }
+    callback(scores, context.batch_beam_size, context.vocab_size, sequences, context.max_length, context.sequence_length, context.stream, user_data);
+  });
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetGuidance(OgaGeneratorParams* generator_params, const char* type, const char* data) {
+  OGA_TRY
+  auto* params = reinterpret_cast<Generators::GeneratorParams*>(generator_params);
+  params->guidance_type = type;
+  params->guidance_data = data;
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsAddStopSequence(OgaGeneratorParams* generator_params, const int32_t* tokens, size_t token_count) {
+  OGA_TRY
+  if (token_count == 0)
+    throw std::runtime_error("A stop sequence must have at least one token");
+  auto* params = reinterpret_cast<Generators::GeneratorParams*>(generator_params);
+  params->stop_sequences.emplace_back(tokens, tokens + token_count);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetTimeout(OgaGeneratorParams* generator_params, double seconds) {
+  OGA_TRY
+  if (seconds < 0)
+    throw std::runtime_error("The timeout must be 0 or greater");
+  reinterpret_cast<Generators::GeneratorParams*>(generator_params)->timeout_seconds = seconds;
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchNumber(OgaGeneratorParams* generator_params, size_t row, const char* name, double value) {
+  OGA_TRY
+  Generators::SetSearchNumber(reinterpret_cast<Generators::GeneratorParams*>(generator_params)->GetMutableRowSearch(row), name, value);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchBool(OgaGeneratorParams* generator_params, size_t row, const char* name, bool value) {
+  OGA_TRY
+  Generators::SetSearchBool(reinterpret_cast<Generators::GeneratorParams*>(generator_params)->GetMutableRowSearch(row), name, value);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaGeneratorParamsSetInputIDs(OgaGeneratorParams* oga_params, const int32_t* input_ids, size_t input_ids_count, size_t sequence_length, size_t batch_size) {
   OGA_TRY
   auto& params = *reinterpret_cast<Generators::GeneratorParams*>(oga_params);
@@ -175,6 +407,25 @@ OgaResult* OGA_API_CALL OgaGeneratorParamsSetWhisperInputFeatures(OgaGeneratorPa
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetWhisperInputFeaturesBatch(OgaGeneratorParams* oga_params, const OgaTensor* const* clips, size_t clip_count) {
+  OGA_TRY
+  auto& params = *reinterpret_cast<Generators::GeneratorParams*>(oga_params);
+  params.SetWhisperInputFeatures(std::span<const Generators::Tensor* const>(reinterpret_cast<const Generators::Tensor* const*>(clips), clip_count));
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetWhisperAudio(OgaGeneratorParams* oga_params, const float* const* clips, const size_t* sample_counts,
+                                                           size_t clip_count, int32_t sample_rate, int32_t mel_count, bool pad_to_30_seconds) {
+  OGA_TRY
+  std::vector<std::span<const float>> clip_spans;
+  for (size_t i = 0; i < clip_count; i++)
+    clip_spans.emplace_back(clips[i], sample_counts[i]);
+  reinterpret_cast<Generators::GeneratorParams*>(oga_params)->SetWhisperAudio(clip_spans, sample_rate, mel_count, pad_to_30_seconds);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaGenerate(const OgaModel* model, const OgaGeneratorParams* generator_params, OgaSequences** out) {
   OGA_TRY
   auto result = Generators::Generate(*reinterpret_cast<const Generators::Model*>(model), *reinterpret_cast<const Generators::GeneratorParams*>(generator_params));
@@ -183,6 +434,45 @@ OgaResult* OGA_API_CALL OgaGenerate(const OgaModel* model, const OgaGeneratorPar
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaModel_Score(const OgaModel* model, const OgaSequences* prompts, const OgaSequences* continuations, float* out_logprobs) {
+  OGA_TRY
+  const auto as_spans = [](const Generators::TokenSequences& sequences) {
+    return std::vector<std::span<const int32_t>>(sequences.begin(), sequences.end());
+  };
+  auto prompt_spans = as_spans(*reinterpret_cast<const Generators::TokenSequences*>(prompts));
+  auto continuation_spans = as_spans(*reinterpret_cast<const Generators::TokenSequences*>(continuations));
+  auto logprobs = Generators::Score(*reinterpret_cast<const Generators::Model*>(model), prompt_spans, continuation_spans);
+  std::copy(logprobs.begin(), logprobs.end(), out_logprobs);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModelWarmup(const OgaModel* model, const OgaGeneratorParams* generator_params, const int32_t* batch_sizes, size_t batch_size_count,
+                                       const int32_t* prompt_lengths, size_t prompt_length_count) {
+  OGA_TRY
+  Generators::WarmUp(*reinterpret_cast<const Generators::Model*>(model), *reinterpret_cast<const Generators::GeneratorParams*>(generator_params),
+                     std::span<const int>(batch_sizes, batch_size_count), std::span<const int>(prompt_lengths, prompt_length_count));
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModel_GetEmbeddingSize(const OgaModel* model, size_t* out) {
+  OGA_TRY
+  *out = reinterpret_cast<const Generators::Model*>(model)->config_->model.decoder.hidden_size;
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModel_Embed(const OgaModel* model, const OgaSequences* prompts, const char* pooling, size_t max_batch_tokens, float* out_embeddings) {
+  OGA_TRY
+  auto& sequences = *reinterpret_cast<const Generators::TokenSequences*>(prompts);
+  std::vector<std::span<const int32_t>> prompt_spans(sequences.begin(), sequences.end());
+  auto embeddings = Generators::Embed(*reinterpret_cast<const Generators::Model*>(model), prompt_spans, Generators::ParseEmbeddingPooling(pooling), max_batch_tokens);
+  std::copy(embeddings.begin(), embeddings.end(), out_embeddings);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OgaCreateGenerator(const OgaModel* model, const OgaGeneratorParams* generator_params, OgaGenerator** out) {
   OGA_TRY
   *out = reinterpret_cast<OgaGenerator*>(CreateGenerator(*reinterpret_cast<const Generators::Model*>(model), *reinterpret_cast<const Generators::GeneratorParams*>(generator_params)).release());
@@ -194,6 +484,61 @@ bool OGA_API_CALL OgaGenerator_IsDone(const OgaGenerator* generator) {
   return reinterpret_cast<const Generators::Generator*>(generator)->IsDone();
 }
 
+void OGA_API_CALL OgaGenerator_Cancel(OgaGenerator* generator) {
+  reinterpret_cast<Generators::Generator*>(generator)->Cancel();
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_SwapOut(OgaGenerator* generator) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->SwapOut();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_SwapIn(OgaGenerator* generator) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->SwapIn();
+  return nullptr;
+  OGA_CATCH
+}
+
+bool OGA_API_CALL OgaGenerator_IsSwappedOut(const OgaGenerator* generator) {
+  return reinterpret_cast<const Generators::Generator*>(generator)->IsSwappedOut();
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_SaveState(OgaGenerator* generator, const uint8_t** out_data, size_t* out_size) {
+  OGA_TRY
+  auto state = reinterpret_cast<Generators::Generator*>(generator)->SaveState();
+  auto buffer = std::make_unique<uint8_t[]>(state.size());
+  std::copy(state.begin(), state.end(), buffer.get());
+  *out_size = state.size();
+  *out_data = buffer.release();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_RestoreState(OgaGenerator* generator, const uint8_t* data, size_t size) {
+  OGA_TRY
+  reinterpret_cast<Generators::Generator*>(generator)->RestoreState({data, size});
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_Fork(OgaGenerator* generator, OgaGenerator** out) {
+  OGA_TRY
+  *out = reinterpret_cast<OgaGenerator*>(reinterpret_cast<Generators::Generator*>(generator)->Fork().release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGeneratorParamsSetRestoredState(OgaGeneratorParams* generator_params, const uint8_t* data, size_t size) {
+  OGA_TRY
+  auto& params = *reinterpret_cast<Generators::GeneratorParams*>(generator_params);
+  params.SetRestoredState({data, size});
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaGenerator_ComputeLogits(OgaGenerator* generator) {
   OGA_TRY
   reinterpret_cast<Generators::Generator*>(generator)->ComputeLogits();
@@ -208,20 +553,198 @@ OgaResult* OGA_API_CALL OgaGenerator_GenerateNextToken(OgaGenerator* generator)
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaGenerator_GenerateTokens(OgaGenerator* generator, size_t max_steps, int32_t* tokens, size_t tokens_count, size_t* step_count) {
+  OGA_TRY
+  *step_count = reinterpret_cast<Generators::Generator*>(generator)->GenerateTokens(max_steps, std::span<int32_t>(tokens, tokens_count));
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_GenerateNextTokenAsync(OgaGenerator* generator, OgaGeneratorCallback callback, void* user_data) {
+  OGA_TRY
+  if (!callback)
+    throw std::runtime_error("callback must not be null");
+  reinterpret_cast<Generators::Generator*>(generator)->GenerateNextTokenAsync([generator, callback, user_data](std::exception_ptr error) {
+    OgaResult* result{};
+    if (error) {
+      try {
+        std::rethrow_exception(error);
+      } catch (const std::exception& e) {
+        result = reinterpret_cast<OgaResult*>(std::make_unique<Generators::Result>(e.what()).release());
+      } catch (...) {
+        result = reinterpret_cast<OgaResult*>(std::make_unique<Generators::Result>("Unknown error").release());
+      }
+    }
+    callback(generator, result, user_data);
+  });
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaSetAsyncThreadCount(int thread_count) {
+  OGA_TRY
+  Generators::SetAsyncThreadCount(thread_count);
+  return nullptr;
+  OGA_CATCH
+}
+
 size_t OGA_API_CALL OgaGenerator_GetSequenceCount(const OgaGenerator* oga_generator, size_t index) {
   auto& generator = *reinterpret_cast<const Generators::Generator*>(oga_generator);
   return generator.GetSequence(static_cast<int>(index)).GetCPU().size();
 }
 
+OgaResult* OGA_API_CALL OgaGenerator_GetNextTokens(OgaGenerator* oga_generator, const int32_t** out, size_t* count) {
+  OGA_TRY
+  auto next_tokens = reinterpret_cast<Generators::Generator*>(oga_generator)->GetNextTokens();
+  *out = next_tokens.data();
+  *count = next_tokens.size();
+  return nullptr;
+  OGA_CATCH
+}
+
 const int32_t* OGA_API_CALL OgaGenerator_GetSequenceData(const OgaGenerator* oga_generator, size_t index) {
   auto& generator = *reinterpret_cast<const Generators::Generator*>(oga_generator);
   return generator.GetSequence(static_cast<int>(index)).GetCPU().data();
 }
 
+OgaResult* OGA_API_CALL OgaGenerator_GetLogProbs(OgaGenerator* oga_generator, float* out_logprobs, int32_t* out_top_tokens, float* out_top_logprobs) {
+  OGA_TRY
+  auto& search = *reinterpret_cast<Generators::Generator*>(oga_generator)->search_;
+  const size_t batch_size = search.params_->batch_size;
+  const size_t top_count = batch_size * search.params_->search.top_logprobs;
+  search.GetLogProbs({out_logprobs, batch_size}, {out_top_tokens, top_count}, {out_top_logprobs, top_count});
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_GetMetric(const OgaGenerator* generator, const char* name, double* out) {
+  OGA_TRY
+  *out = reinterpret_cast<const Generators::Generator*>(generator)->GetMetric(name);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaGenerator_GetDecodeTimeHistogram(const OgaGenerator* generator, const double** upper_bounds_ms, const uint64_t** counts, size_t* bucket_count) {
+  OGA_TRY
+  auto& metrics = reinterpret_cast<const Generators::Generator*>(generator)->GetMetrics();
+  *upper_bounds_ms = Generators::GeneratorMetrics::c_decode_time_bounds_ms.data();
+  *counts = metrics.decode_time_histogram.data();
+  *bucket_count = metrics.decode_time_histogram.size();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaCreateScheduler(const OgaModel* model, int32_t max_active_requests, size_t max_kv_cache_bytes, bool stream_tokens, OgaScheduler** out) {
+  OGA_TRY
+  Generators::SchedulerOptions options;
+  options.max_active_requests = max_active_requests;
+  options.max_kv_cache_bytes = max_kv_cache_bytes;
+  options.stream_tokens = stream_tokens;
+  *out = reinterpret_cast<OgaScheduler*>(std::make_unique<Generators::Scheduler>(*reinterpret_cast<const Generators::Model*>(model), options).release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaSchedulerAddRequest(OgaScheduler* scheduler, const OgaGeneratorParams* generator_params, int32_t priority, uint64_t* out_id) {
+  OGA_TRY
+  // A copy with its own input ids, so the caller can change & reuse its params and buffers for the next request
+  auto params = std::make_shared<Generators::GeneratorParams>(*reinterpret_cast<const Generators::GeneratorParams*>(generator_params));
+  params->external_owner_ = nullptr;
+  params->input_ids_owner.assign(params->input_ids.begin(), params->input_ids.end());
+  params->input_ids = params->input_ids_owner;
+  Generators::RequestOptions options;
+  options.priority = priority;
+  *out_id = reinterpret_cast<Generators::Scheduler*>(scheduler)->AddRequest(std::move(params), options);
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaSchedulerStep(OgaScheduler* scheduler) {
+  OGA_TRY
+  reinterpret_cast<Generators::Scheduler*>(scheduler)->Step();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaSchedulerCancel(OgaScheduler* scheduler, uint64_t request_id) {
+  OGA_TRY
+  reinterpret_cast<Generators::Scheduler*>(scheduler)->Cancel(request_id);
+  return nullptr;
+  OGA_CATCH
+}
+
+bool OGA_API_CALL OgaScheduler_IsDone(const OgaScheduler* scheduler) {
+  return reinterpret_cast<const Generators::Scheduler*>(scheduler)->IsDone();
+}
+
+size_t OGA_API_CALL OgaScheduler_GetStepTokenCount(const OgaScheduler* scheduler) {
+  return reinterpret_cast<const Generators::Scheduler*>(scheduler)->GetStepTokens().size();
+}
+
+OgaResult* OGA_API_CALL OgaScheduler_GetStepTokens(const OgaScheduler* scheduler, size_t index, uint64_t* request_id, const int32_t** tokens, size_t* token_count) {
+  OGA_TRY
+  auto& step_tokens = reinterpret_cast<const Generators::Scheduler*>(scheduler)->GetStepTokens();
+  if (index >= step_tokens.size())
+    throw std::runtime_error("Step token index " + std::to_string(index) + " is out of range, there are " + std::to_string(step_tokens.size()));
+  *request_id = step_tokens[index].id;
+  *tokens = step_tokens[index].tokens.data();
+  *token_count = step_tokens[index].tokens.size();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaSchedulerTakeFinished(OgaScheduler* scheduler, uint64_t* request_ids, const char** errors, size_t capacity, size_t* count, OgaSequences* sequences) {
+  OGA_TRY
+  auto finished = reinterpret_cast<Generators::Scheduler*>(scheduler)->TakeFinished(capacity);
+  for (size_t i = 0; i < finished.size(); i++) {
+    request_ids[i] = finished[i].id;
+    if (errors) {
+      errors[i] = nullptr;
+      if (!finished[i].error.empty()) {
+        auto& error = finished[i].error;
+        auto cstr_buffer = std::make_unique<char[]>(error.size() + 1);
+        std::copy(error.c_str(), error.c_str() + error.size() + 1, cstr_buffer.get());
+        errors[i] = cstr_buffer.release();
+      }
+    }
+    if (sequences) {
+      auto& token_sequences = *reinterpret_cast<Generators::TokenSequences*>(sequences);
+      for (auto& sequence : finished[i].sequences)
+        token_sequences.emplace_back(std::move(sequence));
+    }
+  }
+  *count = finished.size();
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaScheduler_GetMetric(const OgaScheduler* scheduler, const char* name, double* out) {
+  OGA_TRY
+  auto& s = *reinterpret_cast<const Generators::Scheduler*>(scheduler);
+  const std::string_view metric{name};
+  if (metric == "active_count")
+    *out = static_cast<double>(s.GetActiveCount());
+  else if (metric == "waiting_count")
+    *out = static_cast<double>(s.GetWaitingCount());
+  else if (metric == "preempted_count")
+    *out = static_cast<double>(s.GetPreemptedCount());
+  else
+    throw std::runtime_error("Unknown scheduler metric " + std::string{metric} + ", it can be active_count, waiting_count or preempted_count");
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaModel_GetMetric(const OgaModel* model, const char* name, double* out) {
+  OGA_TRY
+  *out = reinterpret_cast<const Generators::Model*>(model)->GetMetric(name);
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateTokenizer(const OgaModel* model, OgaTokenizer** out) {
   OGA_TRY
   auto tokenizer = reinterpret_cast<const Generators::Model*>(model)->CreateTokenizer();
-  tokenizer->external_owner_ = tokenizer;
+  tokenizer->AddExternalOwner();
   *out = reinterpret_cast<OgaTokenizer*>(tokenizer.get());
   return nullptr;
   OGA_CATCH
@@ -236,6 +759,22 @@ OgaResult* OGA_API_CALL OgaTokenizerEncode(const OgaTokenizer* p, const char* st
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaTokenizerEncodePrefix(const OgaTokenizer* p, const char* prefix, OgaEncodedPrefix** out) {
+  OGA_TRY
+  *out = reinterpret_cast<OgaEncodedPrefix*>(reinterpret_cast<const Generators::Tokenizer*>(p)->EncodePrefix(prefix).release());
+  return nullptr;
+  OGA_CATCH
+}
+
+OgaResult* OGA_API_CALL OgaTokenizerEncodeWithPrefix(const OgaTokenizer* p, const OgaEncodedPrefix* prefix, const char* suffix, OgaSequences* sequences) {
+  OGA_TRY
+  auto& tokenizer = *reinterpret_cast<const Generators::Tokenizer*>(p);
+  auto& token_sequences = *reinterpret_cast<Generators::TokenSequences*>(sequences);
+  token_sequences.emplace_back(tokenizer.EncodeWithPrefix(*reinterpret_cast<const Generators::Tokenizer::EncodedPrefix*>(prefix), suffix));
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaTokenizerDecode(const OgaTokenizer* p, const int32_t* tokens, size_t token_count, const char** out_string) {
   OGA_TRY
   auto& tokenizer = *reinterpret_cast<const Generators::Tokenizer*>(p);
@@ -297,6 +836,14 @@ OgaResult* OGA_API_CALL OgaTokenizerStreamDecode(OgaTokenizerStream* p, int32_t
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaTokenizerStreamDecodeNext(OgaTokenizerStream* const* streams, const int32_t* tokens, size_t stream_count, char* buffer, size_t buffer_size, size_t* chunk_offsets) {
+  OGA_TRY
+  Generators::TokenizerStream::DecodeNext({reinterpret_cast<Generators::TokenizerStream* const*>(streams), stream_count}, {tokens, stream_count},
+                                          {buffer, buffer_size}, {chunk_offsets, stream_count + 1});
+  return nullptr;
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaCreateTensorFromBuffer(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, OgaTensor** out) {
   OGA_TRY
   auto tensor = std::make_shared<Generators::Tensor>();
@@ -312,6 +859,32 @@ OgaResult* OGA_API_CALL OgaCreateTensorFromBuffer(void* data, const int64_t* sha
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaCreateTensorFromDeviceBuffer(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type,
+                                                        int device_id, void* stream, OgaTensor** out) {
+  OGA_TRY
+#if USE_CUDA
+#if USE_ROCM
+  constexpr const char* device_name = "Hip";
+#else
+  constexpr const char* device_name = "Cuda";
+#endif
+  auto tensor = std::make_shared<Generators::Tensor>();
+  auto p_memory_info = OrtMemoryInfo::Create(device_name, OrtAllocatorType::OrtDeviceAllocator, device_id, OrtMemType::OrtMemTypeDefault);
+  auto ort_element_type = static_cast<ONNXTensorElementDataType>(element_type);
+  size_t byte_count = Generators::SizeOf(ort_element_type);
+  for (size_t i = 0; i < shape_dims_count; i++)
+    byte_count *= shape_dims[i];
+  tensor->ort_tensor_ = OrtValue::CreateTensor(*p_memory_info, data, byte_count, std::span<const int64_t>{shape_dims, shape_dims_count}, ort_element_type);
+  tensor->stream_ = stream;
+  tensor->external_owner_ = tensor;
+  *out = reinterpret_cast<OgaTensor*>(tensor.get());
+  return nullptr;
+#else
+  throw std::runtime_error("Tensors in device memory need a build with CUDA");
+#endif
+  OGA_CATCH
+}
+
 OgaResult* OGA_API_CALL OgaTensorGetType(OgaTensor* tensor, OgaElementType* out) {
   OGA_TRY
   *out = static_cast<OgaElementType>(reinterpret_cast<Generators::Tensor*>(tensor)->ort_tensor_->GetTensorTypeAndShapeInfo()->GetElementType());
@@ -376,6 +949,20 @@ OgaResult* OGA_API_CALL OgaProcessorProcessImages(const OgaMultiModalProcessor*
   OGA_CATCH
 }
 
+OgaResult* OGA_API_CALL OgaProcessorProcessImagesBatch(const OgaMultiModalProcessor* p, const char* const* prompts, size_t prompt_count,
+                                                      const OgaImages* images_p, const size_t* image_counts, OgaNamedTensors** input_tensors) {
+  OGA_TRY
+  auto& processor = *reinterpret_cast<const Generators::MultiModalProcessor*>(p);
+  auto* images = images_p ? reinterpret_cast<const Generators::Images*>(images_p) : nullptr;
+  std::vector<std::string> prompt_strings(prompts, prompts + prompt_count);
+  auto prompt_image_counts = image_counts ? std::vector<size_t>(image_counts, image_counts + prompt_count)
+                                          : Generators::DefaultImageCounts(prompt_count, images);
+  auto named_tensors = processor.image_processor_->Process(*processor.tokenizer_, prompt_strings, images, prompt_image_counts);
+  *input_tensors = reinterpret_cast<OgaNamedTensors*>(named_tensors.release());
+  return nullptr;
+  OGA_CATCH
+}
+
 void OGA_API_CALL OgaDestroyResult(OgaResult* p) {
   delete reinterpret_cast<Generators::Result*>(p);
 }
@@ -384,12 +971,24 @@ void OGA_API_CALL OgaDestroyString(const char* p) {
   delete p;
 }
 
+void OGA_API_CALL OgaDestroyBuffer(const uint8_t* p) {
+  delete[] p;
+}
+
 void OGA_API_CALL OgaDestroySequences(OgaSequences* p) {
   delete reinterpret_cast<Generators::Sequences*>(p);
 }
 
 void OGA_API_CALL OgaDestroyModel(OgaModel* p) {
-  reinterpret_cast<Generators::Model*>(p)->external_owner_ = nullptr;
+  reinterpret_cast<Generators::Model*>(p)->ReleaseExternalOwner();
+}
+
+void OGA_API_CALL OgaDestroyReloadableModel(OgaReloadableModel* p) {
+  reinterpret_cast<Generators::ReloadableModel*>(p)->external_owner_ = nullptr;
+}
+
+void OGA_API_CALL OgaDestroyReplicaPool(OgaReplicaPool* p) {
+  reinterpret_cast<Generators::ReplicaPool*>(p)->external_owner_ = nullptr;
 }
 
 void OGA_API_CALL OgaDestroyGeneratorParams(OgaGeneratorParams* p) {
@@ -400,14 +999,22 @@ void OGA_API_CALL OgaDestroyGenerator(OgaGenerator* p) {
   delete reinterpret_cast<Generators::Generator*>(p);
 }
 
+void OGA_API_CALL OgaDestroyScheduler(OgaScheduler* p) {
+  delete reinterpret_cast<Generators::Scheduler*>(p);
+}
+
 void OGA_API_CALL OgaDestroyTokenizer(OgaTokenizer* p) {
-  reinterpret_cast<Generators::Tokenizer*>(p)->external_owner_ = nullptr;
+  reinterpret_cast<Generators::Tokenizer*>(p)->ReleaseExternalOwner();
 }
 
 void OGA_API_CALL OgaDestroyTokenizerStream(OgaTokenizerStream* p) {
   delete reinterpret_cast<Generators::TokenizerStream*>(p);
 }
 
+void OGA_API_CALL OgaDestroyEncodedPrefix(OgaEncodedPrefix* p) {
+  delete reinterpret_cast<Generators::Tokenizer::EncodedPrefix*>(p);
+}
+
 void OGA_API_CALL OgaDestroyTensor(OgaTensor* p) {
   reinterpret_cast<Generators::Tensor*>(p)->external_owner_ = nullptr;
 }
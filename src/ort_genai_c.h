@@ -28,7 +28,7 @@ extern "C" {
 #endif
 
 // ONNX Runtime Generative AI C API
-// This API is not thread safe.
+// This API is not thread safe, except that OgaGenerator_GenerateNextTokenAsync steps of different generators run in parallel.
 
 typedef enum OgaElementType {
   OgaElementType_undefined,
@@ -51,15 +51,23 @@ typedef struct OgaResult OgaResult;
 typedef struct OgaGeneratorParams OgaGeneratorParams;
 typedef struct OgaGenerator OgaGenerator;
 typedef struct OgaModel OgaModel;
+// OgaReloadableModel is a model that can be replaced by a new version while generators run, see OgaReloadableModelReload
+typedef struct OgaReloadableModel OgaReloadableModel;
+// OgaReplicaPool is one model loaded once per GPU of a node, that places generators on the least loaded one
+typedef struct OgaReplicaPool OgaReplicaPool;
 // OgaSequences is an array of token arrays where the number of token arrays can be obtained using
 // OgaSequencesCount and the number of tokens in each token array can be obtained using OgaSequencesGetSequenceCount.
 typedef struct OgaSequences OgaSequences;
 typedef struct OgaTokenizer OgaTokenizer;
 typedef struct OgaTokenizerStream OgaTokenizerStream;
+// OgaEncodedPrefix is the tokens of a prompt segment many prompts start with, see OgaTokenizerEncodeWithPrefix
+typedef struct OgaEncodedPrefix OgaEncodedPrefix;
 typedef struct OgaTensor OgaTensor;
 typedef struct OgaImages OgaImages;
 typedef struct OgaNamedTensors OgaNamedTensors;
 typedef struct OgaMultiModalProcessor OgaMultiModalProcessor;
+// OgaScheduler runs many generation requests through a fixed number of slots of one model, see OgaCreateScheduler
+typedef struct OgaScheduler OgaScheduler;
 
 /* \brief Call this on process exit to cleanly shutdown the genai library & its onnxruntime usage
  */
@@ -78,11 +86,21 @@ OGA_EXPORT const char* OGA_API_CALL OgaResultGetError(const OgaResult* result);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaSetLogBool(const char* name, bool value);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaSetLogString(const char* name, const char* value);
 
+/*
+ * \brief Makes every model share one set of onnxruntime intra & inter op thread pools instead of each session creating
+ *        its own, and sizes the thread pool used by CPU sampling to match. Must be called before any model is created.
+ * \param[in] intra_op_num_threads Number of intra op threads, 0 for the default
+ * \param[in] inter_op_num_threads Number of inter op threads, 0 for the default
+ * \return OgaResult containing the error message if it was called too late.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaSetGlobalThreadPools(int intra_op_num_threads, int inter_op_num_threads);
+
 /*
  * \param[in] result OgaResult to be destroyed.
  */
 OGA_EXPORT void OGA_API_CALL OgaDestroyResult(OgaResult*);
 OGA_EXPORT void OGA_API_CALL OgaDestroyString(const char*);
+OGA_EXPORT void OGA_API_CALL OgaDestroyBuffer(const uint8_t*);
 OGA_EXPORT void OGA_API_CALL OgaDestroyNamedTensors(OgaNamedTensors*);
 
 OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateSequences(OgaSequences** out);
@@ -114,8 +132,26 @@ OGA_EXPORT size_t OGA_API_CALL OgaSequencesGetSequenceCount(const OgaSequences*
  */
 OGA_EXPORT const int32_t* OGA_API_CALL OgaSequencesGetSequenceData(const OgaSequences* sequences, size_t sequence_index);
 
+/*
+ * \brief Appends a sequence of tokens to the OgaSequences, like the tokens of a request that was tokenized elsewhere.
+ * \param[in] tokens The tokens, which are copied.
+ * \param[in] token_count The number of tokens.
+ * \param[in] sequences The OgaSequences to append to.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaAppendTokenSequence(const int32_t* tokens, size_t token_count, OgaSequences* sequences);
+
 OGA_EXPORT OgaResult* OGA_API_CALL OgaLoadImage(const char* image_path, OgaImages** images);
 
+/*
+ * \brief Loads several images into a single OgaImages, for prompts that refer to more than one image or for
+ *        OgaProcessorProcessImagesBatch.
+ * \param[in] image_paths The paths of the images, in the order their image tags number them.
+ * \param[in] image_count The number of paths.
+ * \param[out] images The loaded images. Must be destroyed with OgaDestroyImages.
+ * \return OgaResult containing the error message if any of the images could not be loaded.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaLoadImages(const char* const* image_paths, size_t image_count, OgaImages** images);
+
 OGA_EXPORT void OGA_API_CALL OgaDestroyImages(OgaImages* images);
 
 /*
@@ -133,6 +169,131 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateModel(const char* config_path, OgaMo
  */
 OGA_EXPORT void OGA_API_CALL OgaDestroyModel(OgaModel* model);
 
+/*
+ * \brief Creates a reloadable model from the given configuration directory, for replacing the model with a new version
+ *        without stopping the generators that run on the old one.
+ * \param[in] config_path The path to the model configuration directory. The path is expected to be encoded in UTF-8.
+ * \param[out] out The created reloadable model, destroyed with OgaDestroyReloadableModel.
+ * \return OgaResult containing the error message if the model creation failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateReloadableModel(const char* config_path, OgaReloadableModel** out);
+OGA_EXPORT void OGA_API_CALL OgaDestroyReloadableModel(OgaReloadableModel* model);
+
+/*
+ * \brief Gets the current version of the model, to create generator params, generators and tokenizers with. Route new
+ *        requests by calling this for each one, since the handle stays on its version after a reload.
+ * \param[out] out A handle of the current model, destroyed with OgaDestroyModel.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaReloadableModelGetModel(const OgaReloadableModel* model, OgaModel** out);
+
+/*
+ * \brief Loads the model from config_path next to the current one, sharing the process's onnxruntime environment and
+ *        thread pools, then makes it the model OgaReloadableModelGetModel returns. The generators and params of the
+ *        previous version keep it alive and running, it's released once they and its model handles are destroyed.
+ *        There's no need for OgaShutdown.
+ * \return OgaResult containing the error message if loading failed, in which case the current model stays.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaReloadableModelReload(OgaReloadableModel* model, const char* config_path);
+
+/*
+ * \brief Returns 0 for the first model, and one more after every successful reload.
+ */
+OGA_EXPORT uint64_t OGA_API_CALL OgaReloadableModelGetVersion(const OgaReloadableModel* model);
+
+/*
+ * \brief Loads the model from the given configuration directory once per device, each replica with its provider's
+ *        device_id option set to the device, so it has its own sessions, streams and allocator. This replaces calling
+ *        OgaSetCurrentGpuDeviceId before creating each model. The model can't be tensor parallel or pipelined.
+ * \param[in] config_path The path to the model configuration directory. The path is expected to be encoded in UTF-8.
+ * \param[in] device_ids The devices, each listed once. On CPU only their count matters.
+ * \param[out] out The created replica pool, destroyed with OgaDestroyReplicaPool.
+ * \return OgaResult containing the error message if any replica failed to load.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateReplicaPool(const char* config_path, const int32_t* device_ids, size_t device_count, OgaReplicaPool** out);
+OGA_EXPORT void OGA_API_CALL OgaDestroyReplicaPool(OgaReplicaPool* pool);
+
+OGA_EXPORT size_t OGA_API_CALL OgaReplicaPool_GetReplicaCount(const OgaReplicaPool* pool);
+
+/*
+ * \brief Gets the replica on the index'th device, like to create generator params or a tokenizer with, which any replica
+ *        can do for all of them.
+ * \param[out] out A handle of the replica, destroyed with OgaDestroyModel.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaReplicaPoolGetReplica(const OgaReplicaPool* pool, size_t index, OgaModel** out);
+
+/*
+ * \brief Creates a generator on the least loaded replica, the one with the fewest live generators, then the least kv
+ *        cache memory. The generator's steps run on its replica's device from any thread.
+ * \param[in] params Generator params created with any replica of the pool, including a restored state, which is copied
+ *            to the device of the replica the generator is placed on.
+ * \param[out] out The created generator, destroyed with OgaDestroyGenerator.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaReplicaPoolCreateGenerator(const OgaReplicaPool* pool, const OgaGeneratorParams* params, OgaGenerator** out);
+
+/*
+ * \brief Creates a scheduler with every replica as an instance, see OgaCreateScheduler. Each replica has
+ *        max_active_requests slots and max_kv_cache_bytes of its own, and the replicas decode at the same time.
+ * \param[in] prefix_affinity With model.decoder.prefix_cache, place a new single sequence request by how much of its
+ *            prompt a replica has cached as well as by its free slots, so requests sharing a system prompt reuse its kv
+ *            caches on the replicas that ran it.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaReplicaPoolCreateScheduler(const OgaReplicaPool* pool, int32_t max_active_requests, size_t max_kv_cache_bytes, bool stream_tokens, bool prefix_affinity, OgaScheduler** out);
+
+/*
+ * \brief Loads a LoRA adapter into a free adapter slot of the model, or replaces the adapter of the same name. The base
+ *        weights are untouched, and generators already running with a replaced adapter keep its old weights.
+ *        The model needs model.decoder.adapters.max_adapters in its config, and stacked LoRA weight inputs.
+ * \param[in] model The model to load the adapter into.
+ * \param[in] adapter_name The name generator params select the adapter by.
+ * \param[in] weight_names The names of the model's stacked weight inputs the weights are for.
+ * \param[in] weights The weights, without the slot dimension. Smaller dimensions (a lower rank) are zero padded.
+ *            They are copied, so they can be destroyed after the call.
+ * \param[in] weight_count The number of weight_names and weights.
+ * \return OgaResult containing the error message if loading the adapter failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelLoadAdapter(OgaModel* model, const char* adapter_name, const char* const* weight_names, OgaTensor* const* weights, size_t weight_count);
+
+/*
+ * \brief Unloads a LoRA adapter. Its slot is reused once no generator uses it.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelUnloadAdapter(OgaModel* model, const char* adapter_name);
+
+/*
+ * \brief Loads a LoRA adapter into every replica of the pool, like OgaModelLoadAdapter, so generators placed on any of
+ *        them can select it.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaReplicaPoolLoadAdapter(OgaReplicaPool* pool, const char* adapter_name, const char* const* weight_names, OgaTensor* const* weights, size_t weight_count);
+
+/*
+ * \brief Unloads a LoRA adapter from every replica of the pool.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaReplicaPoolUnloadAdapter(OgaReplicaPool* pool, const char* adapter_name);
+
+/*
+ * \brief Shares the kv caches of a cached prompt prefix, like a common system prompt, with other processes on the machine
+ *        that load the same model, so they're kept once for all of them. The kv caches of the longest prefix of tokens in the
+ *        model's prefix cache are copied once into CUDA IPC memory for CUDA models or named shared memory on the CPU,
+ *        which stays allocated until the model is destroyed. The model needs model.decoder.prefix_cache.block_size.
+ * \param[in] model The model whose prefix cache holds the prefix, after a generator has run a prompt starting with it.
+ * \param[in] tokens The tokens of the prefix, or of a prompt starting with it.
+ * \param[in] token_count The number of tokens.
+ * \param[out] out_data A descriptor of the shared kv caches for OgaModelImportPrefix, must be freed with OgaDestroyBuffer.
+ * \param[out] out_size The size of the descriptor in bytes.
+ * \return OgaResult containing the error message if no prefix of the tokens is cached or the device can't share memory.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelExportPrefix(OgaModel* model, const int32_t* tokens, size_t token_count, const uint8_t** out_data, size_t* out_size);
+
+/*
+ * \brief Adds a prefix exported by OgaModelExportPrefix in another process to the model's prefix cache, mapping its kv
+ *        caches read only instead of copying them. The exporting process must keep its model until this model's
+ *        generators are done with the prefix.
+ * \param[in] model A model with the same config as the exporting one, on the same kind of device.
+ * \param[in] data The descriptor, it can be freed once this returns.
+ * \param[in] size The size of the descriptor in bytes.
+ * \return OgaResult containing the error message if the descriptor doesn't fit the model or the memory can't be mapped.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelImportPrefix(OgaModel* model, const uint8_t* data, size_t size);
+
 /*
  * \brief Generates an array of token arrays from the model execution based on the given generator params.
  * \param[in] model The model to use for generation.
@@ -143,6 +304,51 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyModel(OgaModel* model);
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerate(const OgaModel* model, const OgaGeneratorParams* generator_params, OgaSequences** out);
 
+/*
+ * \brief Scores continuations of prompts in a single run of the model, without generating anything.
+ * \param[in] model The model to score with. Its logits output must hold every token, not just the last.
+ * \param[in] prompts The prompts, none of them empty.
+ * \param[in] continuations The continuation of each prompt, as many as there are prompts.
+ * \param[out] out_logprobs The log probability of every continuation token given the tokens before it, the tokens of
+ *             the first continuation followed by those of the next. The caller sizes it to the total continuation tokens.
+ * \return OgaResult containing the error message if the scoring failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModel_Score(const OgaModel* model, const OgaSequences* prompts, const OgaSequences* continuations, float* out_logprobs);
+
+/*
+ * \brief Warms the model up for the given shapes, by running a prompt and a few decode steps of each batch size and
+ *        prompt length pair. Kernel selection, autotuning, arena growth and graph capture then happen before the first
+ *        real request.
+ * \param[in] model The model to warm up.
+ * \param[in] generator_params The search options to run with, like max_length and num_beams, which the captured graphs
+ *             are kept for.
+ * \param[in] batch_sizes The batch sizes to run, model.decoder.graph_capture_batch_sizes (or the params' batch size)
+ *             when batch_size_count is 0.
+ * \param[in] prompt_lengths The prompt lengths to run, each below max_length, model.decoder.graph_capture_prompt_lengths
+ *             (or a single token) when prompt_length_count is 0.
+ * \return OgaResult containing the error message if the warm-up failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModelWarmup(const OgaModel* model, const OgaGeneratorParams* generator_params, const int32_t* batch_sizes, size_t batch_size_count,
+                                                  const int32_t* prompt_lengths, size_t prompt_length_count);
+
+/*
+ * \brief Gets the size of each embedding OgaModel_Embed puts out, the model's hidden size.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModel_GetEmbeddingSize(const OgaModel* model, size_t* out);
+
+/*
+ * \brief Embeds prompts with the pooled last layer hidden states of a decoder built without its lm_head, by running only
+ *        the prompts, in batches of similar lengths and without kv caches.
+ * \param[in] model The model to embed with.
+ * \param[in] prompts The prompts to embed, none of them empty.
+ * \param[in] pooling "mean" for the mean of every prompt token's hidden state, "last_token" for the last one's.
+ * \param[in] max_batch_tokens The most tokens (padding included) of each run, 0 to run every prompt in one batch.
+ * \param[out] out_embeddings The fp32 embedding of each prompt one after another, the caller sizes it to the prompt count
+ *             times OgaModel_GetEmbeddingSize.
+ * \return OgaResult containing the error message if the embedding failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModel_Embed(const OgaModel* model, const OgaSequences* prompts, const char* pooling, size_t max_batch_tokens, float* out_embeddings);
+
 /*
  * \brief Creates a OgaGeneratorParams from the given model.
  * \param[in] model The model to use for generation.
@@ -161,6 +367,81 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetSearchNumber(OgaGenerato
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetSearchBool(OgaGeneratorParams* generator_params, const char* name, bool value);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsTryGraphCaptureWithMaxBatchSize(OgaGeneratorParams* generator_params, int32_t max_batch_size);
 
+/*
+ * \brief Selects the LoRA adapter of each batch entry, which must be loaded with OgaModelLoadAdapter.
+ * \param[in] generator_params The generator params to set the adapters on.
+ * \param[in] adapter_names One name for every batch entry, or a single name for all of them. An empty name is the base model.
+ * \param[in] adapter_count The number of adapter_names.
+ * \return OgaResult containing the error message if setting the adapters failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetAdapters(OgaGeneratorParams* generator_params, const char* const* adapter_names, size_t adapter_count);
+
+/*
+ * \brief A custom logits processor, called every step with the scores to change in place.
+ * \param[in] scores The (batch_beam_size, vocab_size) scores, in device memory for CUDA models and CPU memory otherwise.
+ * \param[in] sequences The (batch_beam_size, max_length) sequences on the same device, the first sequence_length tokens of each are valid.
+ * \param[in] max_length The length of the rows of sequences. On the CPU they grow as the sequences get longer, so it can be less than the
+ *            search's max_length and change between calls.
+ * \param[in] stream The model's cudaStream_t for CUDA models, or nullptr. Kernels launched on it run before the next tokens are picked.
+ * \param[in] user_data The user_data given to OgaGeneratorParamsAddLogitsProcessor.
+ */
+typedef void(OGA_API_CALL* OgaLogitsProcessorCallback)(float* scores, int32_t batch_beam_size, int32_t vocab_size, const int32_t* sequences,
+                                                       int32_t max_length, int32_t sequence_length, void* stream, void* user_data);
+
+/*
+ * \brief Adds a logits processor that runs after the built in processing (min length, repetition penalty, guidance),
+ *        so custom biasing or banning can work on the scores where they are without copying them to the host.
+ *        Processors run in the order they were added.
+ * \param[in] generator_params The generator params to add the logits processor to.
+ * \param[in] callback Called from the thread running the step.
+ * \param[in] user_data Passed through to the callback, it must stay valid while generators created from these params are alive.
+ * \return OgaResult containing the error message if adding the logits processor failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsAddLogitsProcessor(OgaGeneratorParams* generator_params, OgaLogitsProcessorCallback callback, void* user_data);
+
+/*
+ * \brief Constrains the generated text to match a grammar. The grammar is compiled against the model's vocabulary when the
+ *        first generator uses it, later generators of the same model share the compiled masks.
+ * \param[in] generator_params The generator params to set the guidance on.
+ * \param[in] type "regex" or "json_schema", or an empty string for no guidance. Beam search isn't supported with guidance.
+ * \param[in] data The regex or the JSON schema.
+ * \return OgaResult containing the error message if the setting of the guidance failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetGuidance(OgaGeneratorParams* generator_params, const char* type, const char* data);
+
+/*
+ * \brief Adds a stop sequence, the generation of a sequence ends once it generates these tokens (which it then ends with), like
+ *        it does for the eos token. The stop sequences are matched in the search, without waiting for the generated tokens.
+ * \param[in] generator_params The generator params to add the stop sequence to.
+ * \param[in] tokens The tokens of the stop sequence, like the encoding of a stop string.
+ * \param[in] token_count The number of tokens, at least one. Beam search isn't supported with stop sequences.
+ * \return OgaResult containing the error message if adding the stop sequence failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsAddStopSequence(OgaGeneratorParams* generator_params, const int32_t* tokens, size_t token_count);
+
+/*
+ * \brief Sets a deadline for the generators created with these params. Once the time has passed since a generator was
+ *        created, it's cancelled like by OgaGenerator_Cancel, even in the middle of a model run.
+ * \param[in] generator_params The generator params to set the timeout on.
+ * \param[in] seconds The time each generator has, 0 (the default) for no deadline.
+ * \return OgaResult containing the error message if the timeout is negative.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetTimeout(OgaGeneratorParams* generator_params, double seconds);
+
+/*
+ * \brief Sets a search option of one batch entry, so the requests batched together can sample differently. The first one set
+ *        for an entry starts it (and any entries before it without their own options) as a copy of the search options
+ *        set so far. Only do_sample, top_k, top_p, temperature, repetition_penalty, presence_penalty, frequency_penalty and max_length (at most the batch's
+ *        max_length) are per entry, and beam search isn't supported with them.
+ * \param[in] generator_params The generator params to set the option on.
+ * \param[in] row The batch entry, less than the batch size.
+ * \param[in] name The name of the search option, like OgaGeneratorParamsSetSearchNumber takes.
+ * \param[in] value The value of the option.
+ * \return OgaResult containing the error message if setting the option failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchNumber(OgaGeneratorParams* generator_params, size_t row, const char* name, double value);
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetRowSearchBool(OgaGeneratorParams* generator_params, size_t row, const char* name, bool value);
+
 /*
  * \brief Sets the input ids for the generator params. The input ids are used to seed the generation.
  * \param[in] generator_params The generator params to set the input ids on.
@@ -194,6 +475,32 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetModelInput(OgaGeneratorP
 
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetWhisperInputFeatures(OgaGeneratorParams*, OgaTensor* tensor);
 
+/*
+ * \brief Sets the whisper input features to a batch of audio clips of different lengths, padded to the longest one
+ *        instead of to 30 seconds. The input_ids need one row per clip.
+ * \param[in] generator_params The generator params to set the input features on.
+ * \param[in] clips The float32 input features of each clip, shaped [1, number_of_mels, number_of_frames]. They are copied.
+ * \param[in] clip_count The number of clips.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetWhisperInputFeaturesBatch(OgaGeneratorParams* generator_params, const OgaTensor* const* clips, size_t clip_count);
+
+/*
+ * \brief Sets the whisper input features from raw audio, computing its log mel spectrogram natively the way Whisper's
+ *        feature extractor does: resampling to 16 kHz, a 25 ms STFT every 10 ms, a mel filterbank and log10, on the
+ *        CPU's vector instructions and threads. The input_ids need one row per clip.
+ * \param[in] generator_params The generator params to set the input features on.
+ * \param[in] clips The mono float32 samples of each clip, in [-1, 1]. They can be freed once this returns.
+ * \param[in] sample_counts The number of samples of each clip.
+ * \param[in] clip_count The number of clips.
+ * \param[in] sample_rate The sample rate of the clips in Hz, they're resampled if it isn't 16000.
+ * \param[in] mel_count The number of mel bins the model takes, 80 for most whisper models and 128 for large-v3.
+ * \param[in] pad_to_30_seconds Pads every clip with silence to the encoder's 30 second window, which they can't be longer
+ *            than. Otherwise they're padded to the longest clip, for encoders with a dynamic frame count like the chunks
+ *            of live audio transcription.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetWhisperAudio(OgaGeneratorParams* generator_params, const float* const* clips, const size_t* sample_counts,
+                                                                     size_t clip_count, int32_t sample_rate, int32_t mel_count, bool pad_to_30_seconds);
+
 /*
  * \brief Creates a generator from the given model and generator params.
  * \param[in] model The model to use for generation.
@@ -216,6 +523,15 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyGenerator(OgaGenerator* generator);
  */
 OGA_EXPORT bool OGA_API_CALL OgaGenerator_IsDone(const OgaGenerator* generator);
 
+/*
+ * \brief Stops the generator for good. Can be called from any thread, except from a callback of the generator's own step.
+ *        A model run in progress is terminated and its step fails, and the generator's kv caches and other buffers are
+ *        released, right away or once that step returns. Every later step fails, and OgaGenerator_IsDone returns true.
+ *        The generator still has to be destroyed.
+ * \param[in] generator The generator to cancel.
+ */
+OGA_EXPORT void OGA_API_CALL OgaGenerator_Cancel(OgaGenerator* generator);
+
 /*
  * \brief Computes the logits from the model based on the input ids and the past state. The computed logits are stored in the generator.
  * \param[in] generator The generator to compute the logits for.
@@ -224,6 +540,109 @@ OGA_EXPORT bool OGA_API_CALL OgaGenerator_IsDone(const OgaGenerator* generator);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_ComputeLogits(OgaGenerator* generator);
 OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GenerateNextToken(OgaGenerator* generator);
 
+/*
+ * \brief Moves the kv caches of the generator to pinned host memory and gives their device memory back, so an idle or
+ *        preempted generator doesn't hold on to it. The next OgaGenerator_ComputeLogits swaps them back in. Only
+ *        supported on CUDA, between steps once the prompt has run.
+ * \param[in] generator The generator to swap out.
+ * \return OgaResult containing the error message if the kv caches couldn't be swapped out.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SwapOut(OgaGenerator* generator);
+
+/*
+ * \brief Queues the copies of the swapped out kv caches back to the device ahead of the next step, without waiting for them.
+ * \param[in] generator The generator to swap in.
+ * \return OgaResult containing the error message if the kv caches don't fit on the device.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SwapIn(OgaGenerator* generator);
+OGA_EXPORT bool OGA_API_CALL OgaGenerator_IsSwappedOut(const OgaGenerator* generator);
+
+/*
+ * \brief Saves the tokens of the generator's single sequence and the kv caches that cover them into a buffer, to continue
+ *        the sequence in another generator later, like the next turn of a chat. The buffer can be kept anywhere, but is
+ *        only read back by the same model and library version on the same kind of machine. Between steps or once done,
+ *        after the prompt has run.
+ * \param[in] generator The generator to save the state of.
+ * \param[out] out_data The saved state, must be freed with OgaDestroyBuffer.
+ * \param[out] out_size The size of the saved state in bytes.
+ * \return OgaResult containing the error message if the state couldn't be saved.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_SaveState(OgaGenerator* generator, const uint8_t** out_data, size_t* out_size);
+
+/*
+ * \brief Continues from a state saved by OgaGenerator_SaveState, before the generator's first OgaGenerator_ComputeLogits.
+ *        The input_ids of the generator must start with the saved tokens, only the tokens after them are run by the model.
+ *        Only for batch size 1 without beams, graph capture, past_present_share_buffer or kv_window_size.
+ * \param[in] generator The new generator.
+ * \param[in] data The saved state, it can be freed once this returns.
+ * \param[in] size The size of the saved state in bytes.
+ * \return OgaResult containing the error message if the state doesn't fit the generator.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_RestoreState(OgaGenerator* generator, const uint8_t* data, size_t size);
+
+/*
+ * \brief Creates a generator that continues the generator's single sequence from here, on kv caches shared with it
+ *        instead of running its tokens again, so n sampled continuations of a prompt take one prefill. Once the prompt
+ *        has run, between steps or after OgaGenerator_ComputeLogits: forking n times right after the first
+ *        OgaGenerator_ComputeLogits lets every continuation pick its own first token. Each fork samples with its own
+ *        random numbers, also with the same random_seed. Same limits as OgaGenerator_RestoreState.
+ * \param[in] generator The generator to fork.
+ * \param[out] out The new generator, must be destroyed with OgaDestroyGenerator.
+ * \return OgaResult containing the error message if the generator can't be forked.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_Fork(OgaGenerator* generator, OgaGenerator** out);
+
+/*
+ * \brief Makes the generators created with the params continue from a state saved by OgaGenerator_SaveState, like
+ *        OgaGenerator_RestoreState does for one generator. For the generators a scheduler creates, so a prompt can run on
+ *        one model instance (or machine) and the generation continue on another: the input_ids must start with the saved
+ *        tokens, and only the tokens after them are run by the model. Set the input ids first.
+ * \param[in] generator_params The params to set the state on.
+ * \param[in] data The saved state, it can be freed once this returns.
+ * \param[in] size The size of the saved state in bytes.
+ * \return OgaResult containing the error message if the state can't be read.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGeneratorParamsSetRestoredState(OgaGeneratorParams* generator_params, const uint8_t* data, size_t size);
+
+/*
+ * \brief Runs up to max_steps OgaGenerator_ComputeLogits & OgaGenerator_GenerateNextToken steps in one call, stopping
+ *        early once the generator is done, so bindings don't cross into the library two or three times per token.
+ *        Beam search isn't supported.
+ * \param[in] generator The generator to run the steps on.
+ * \param[in] max_steps The most steps to run.
+ * \param[out] tokens Receives the batch_size next tokens of each step run, one step after another.
+ * \param[in] tokens_count The size of tokens, at least max_steps * batch_size.
+ * \param[out] step_count The number of steps run, 0 if the generator was already done.
+ * \return OgaResult containing the error message if a step failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GenerateTokens(OgaGenerator* generator, size_t max_steps, int32_t* tokens, size_t tokens_count, size_t* step_count);
+
+/*
+ * \brief Called when an OgaGenerator_GenerateNextTokenAsync step completes, on the thread that ran it.
+ * \param[in] generator The generator the step ran on, it can be used again from here on.
+ * \param[in] result nullptr on success, otherwise the error. It is owned by the callback and must be destroyed with OgaDestroyResult.
+ * \param[in] user_data The user_data passed to OgaGenerator_GenerateNextTokenAsync.
+ */
+typedef void(OGA_API_CALL* OgaGeneratorCallback)(OgaGenerator* generator, OgaResult* result, void* user_data);
+
+/*
+ * \brief Queues an OgaGenerator_ComputeLogits & OgaGenerator_GenerateNextToken step to run on a background thread
+ *        and returns right away, so a few threads can drive many generators. Steps of different generators run at the
+ *        same time, up to the count set by OgaSetAsyncThreadCount. The generator must not be used or destroyed until
+ *        the callback is called, but the callback can queue the next step itself.
+ * \param[in] generator The generator to run the step on.
+ * \param[in] callback Called once the step completes.
+ * \param[in] user_data Passed through to the callback.
+ * \return OgaResult containing the error message if the step couldn't be queued, in which case the callback isn't called.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GenerateNextTokenAsync(OgaGenerator* generator, OgaGeneratorCallback callback, void* user_data);
+
+/*
+ * \brief Sets the number of threads that run OgaGenerator_GenerateNextTokenAsync steps, 0 for one per core.
+ *        Must be called before the first asynchronous step.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaSetAsyncThreadCount(int thread_count);
+
 /*
  * \brief Returns the number of tokens in the sequence at the given index.
  * \param[in] generator The generator to get the count of the tokens for the sequence at the given index.
@@ -231,6 +650,17 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GenerateNextToken(OgaGenerator*
  */
 OGA_EXPORT size_t OGA_API_CALL OgaGenerator_GetSequenceCount(const OgaGenerator* generator, size_t index);
 
+/*
+ * \brief Returns the tokens the last OgaGenerator_GenerateNextToken appended, one for each batch_size * num_beams
+ *        sequence. Streaming reads them instead of the whole sequence, on CUDA the copy to the host is queued at the end
+ *        of the step, and only the tokens are copied.
+ * \param[in] generator The generator to get the next tokens of.
+ * \param[out] out Receives a pointer to the tokens, owned by the generator and valid until its next step.
+ * \param[out] count Receives the number of tokens.
+ * \return OgaResult containing the error message if no step has run yet.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetNextTokens(OgaGenerator* generator, const int32_t** out, size_t* count);
+
 /*
  * \brief Returns a pointer to the sequence data at the given index. The number of tokens in the sequence
  *        is given by OgaGenerator_GetSequenceCount
@@ -241,6 +671,133 @@ OGA_EXPORT size_t OGA_API_CALL OgaGenerator_GetSequenceCount(const OgaGenerator*
  */
 OGA_EXPORT const int32_t* OGA_API_CALL OgaGenerator_GetSequenceData(const OgaGenerator* generator, size_t index);
 
+/*
+ * \brief Gets the log probabilities of the last generated tokens, with the search option logprobs set. They're of the
+ *        scores the tokens were picked from, after the logits processing and before any temperature.
+ * \param[in] generator The generator to get the log probabilities of.
+ * \param[out] out_logprobs The log probability of each batch entry's token, batch_size of them.
+ * \param[out] out_top_tokens The top_logprobs most likely tokens of each batch entry, most likely first,
+ *             batch_size * top_logprobs of them. Can be null when top_logprobs is 0.
+ * \param[out] out_top_logprobs The log probability of each of out_top_tokens. Can be null when top_logprobs is 0.
+ * \return OgaResult containing the error message if the generator doesn't keep log probabilities.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetLogProbs(OgaGenerator* generator, float* out_logprobs, int32_t* out_top_tokens, float* out_top_logprobs);
+
+/*
+ * \brief Gets one of the generator's metrics, which are always collected.
+ * \param[in] generator The generator to get the metric of.
+ * \param[in] name One of prompt_token_count, generated_token_count, step_count, prefill_seconds,
+ *            time_to_first_token_seconds, decode_seconds, tokens_per_second (after the first token) or kv_cache_bytes.
+ * \param[out] out The value of the metric.
+ * \return OgaResult containing the error message if the name is unknown.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetMetric(const OgaGenerator* generator, const char* name, double* out);
+
+/*
+ * \brief Gets the histogram of the step times after the first token. Bucket i counts the steps that took at most
+ *        upper_bounds_ms[i] milliseconds (and more than the bound before it), the last bucket the slower ones.
+ * \param[in] generator The generator to get the histogram of.
+ * \param[out] upper_bounds_ms The bucket_count - 1 upper bounds, owned by the library.
+ * \param[out] counts The bucket_count step counts, owned by the OgaGenerator and updated by every step.
+ * \param[out] bucket_count The number of buckets.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaGenerator_GetDecodeTimeHistogram(const OgaGenerator* generator, const double** upper_bounds_ms, const uint64_t** counts, size_t* bucket_count);
+
+/*
+ * \brief Creates a scheduler, a queue of requests that run in up to max_active_requests slots. Between steps the finished
+ *        ones leave their slot and waiting ones take it. Each active request is a generator of its own, the requests
+ *        aren't batched into one model run. A scheduler isn't thread safe, it's meant to be stepped by one thread that
+ *        also adds and cancels the requests.
+ * \param[in] model The model the requests run on.
+ * \param[in] max_active_requests The requests that run at once.
+ * \param[in] max_kv_cache_bytes If not 0, a request only gets a slot while the kv caches of the active requests, each
+ *            grown to its max_length, and its own fit in this many bytes.
+ * \param[in] stream_tokens Keep the tokens of every step for OgaSchedulerGetStepTokens. Beam search isn't supported then.
+ * \param[out] out The created scheduler, destroyed with OgaDestroyScheduler.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateScheduler(const OgaModel* model, int32_t max_active_requests, size_t max_kv_cache_bytes, bool stream_tokens, OgaScheduler** out);
+OGA_EXPORT void OGA_API_CALL OgaDestroyScheduler(OgaScheduler* scheduler);
+
+/*
+ * \brief Queues a request, which is admitted by priority (higher first) and then in the order they were added.
+ *        The scheduler keeps a copy of the generator params and their input ids, so both can be reused or destroyed
+ *        after the call.
+ * \param[out] out_id The id of the request, for OgaSchedulerCancel and the step tokens and finished requests.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaSchedulerAddRequest(OgaScheduler* scheduler, const OgaGeneratorParams* generator_params, int32_t priority, uint64_t* out_id);
+
+/*
+ * \brief Generates one token for every active request, then admits waiting requests into free slots and runs their
+ *        prompts.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaSchedulerStep(OgaScheduler* scheduler);
+
+/*
+ * \brief Drops the request wherever it is, without a result, like once its client has gone.
+ * \return OgaResult containing the error message if there's no such request, or it was already taken as finished.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaSchedulerCancel(OgaScheduler* scheduler, uint64_t request_id);
+
+/*
+ * \brief Returns true once no request is waiting or active.
+ */
+OGA_EXPORT bool OGA_API_CALL OgaScheduler_IsDone(const OgaScheduler* scheduler);
+
+/*
+ * \brief Gets the number of requests that generated tokens in the last step, when created with stream_tokens.
+ */
+OGA_EXPORT size_t OGA_API_CALL OgaScheduler_GetStepTokenCount(const OgaScheduler* scheduler);
+
+/*
+ * \brief Gets the tokens one of the requests generated in the last step, the first token of a prompt run in it included.
+ * \param[in] index In [0, OgaScheduler_GetStepTokenCount).
+ * \param[out] request_id The request.
+ * \param[out] tokens The next token of each of its batch_size sequences, owned by the scheduler until the next step.
+ * \param[out] token_count The batch_size of the request.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaScheduler_GetStepTokens(const OgaScheduler* scheduler, size_t index, uint64_t* request_id, const int32_t** tokens, size_t* token_count);
+
+/*
+ * \brief Takes up to capacity of the requests finished since the last call, the rest stay for the next one.
+ * \param[out] request_ids Receives the ids of the finished requests.
+ * \param[out] errors If not null, receives nullptr for each request that finished, or the error of one that failed (like
+ *              a prompt longer than the context), to destroy with OgaDestroyString. A failed request has no sequences.
+ * \param[in] capacity The size of request_ids, and of errors.
+ * \param[out] count The number of finished requests taken.
+ * \param[out] sequences If not null, gets the batch_size * num_return_sequences sequences of each request appended, one
+ *              request after the other, in the order of request_ids.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaSchedulerTakeFinished(OgaScheduler* scheduler, uint64_t* request_ids, const char** errors, size_t capacity, size_t* count, OgaSequences* sequences);
+
+/*
+ * \brief Gets one of active_count, waiting_count or preempted_count, the requests in each state right now.
+ * \return OgaResult containing the error message if the name is unknown.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaScheduler_GetMetric(const OgaScheduler* scheduler, const char* name, double* out);
+
+/*
+ * \brief Gets one of the model's metrics, which are always collected.
+ * \param[in] model The model to get the metric of.
+ * \param[in] name One of prompt_token_count & generated_token_count (totals over every generator of the model),
+ *            kv_cache_bytes (of the live generators), static_buffer_bytes (of the captured graphs), captured_graph_count
+ *            (the graphs that haven't been evicted), pooled_captured_graph_count (those of them no generator is using),
+ *            captured_graph_evictions, captured_graph_pool_budget_bytes (model.decoder.graph_capture_pool_budget_mb, 0
+ *            when unlimited), device_memory_bytes
+ *            (the kv caches, static buffers and cached prefixes counted by model.device_memory_budget_mb),
+ *            device_memory_budget_bytes (0 when unlimited), tensor_parallel_rank (the shard this process runs, so
+ *            only rank 0 needs to print the output) or context_length (model.context_length, the largest max_length). The device allocations of each of kv_cache, logits, input_ids,
+ *            position_inputs, step_arena and roaming_array (for the whole process) are counted too, as
+ *            <site>_allocation_count, <site>_allocated_bytes, <site>_live_bytes, <site>_peak_bytes,
+ *            <site>_largest_allocation_bytes and <site>_allocations_per_step.
+ * \param[out] out The value of the metric.
+ * \return OgaResult containing the error message if the name is unknown.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaModel_GetMetric(const OgaModel* model, const char* name, double* out);
+
+/*
+ * \brief Gets the tokenizer of the model. It's parsed on the first call, later calls return the same tokenizer, which is
+ *        safe to use from any thread. Each handle must still be destroyed with OgaDestroyTokenizer.
+ */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateTokenizer(const OgaModel* model, OgaTokenizer** out);
 OGA_EXPORT void OGA_API_CALL OgaDestroyTokenizer(OgaTokenizer*);
 
@@ -253,8 +810,47 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyMultiModalProcessor(OgaMultiModalProcesso
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerEncode(const OgaTokenizer*, const char* str, OgaSequences* sequences);
 
+/*
+ * \brief Encodes a segment many prompts start with, like a system prompt, once for OgaTokenizerEncodeWithPrefix.
+ * \param[in] tokenizer The tokenizer to encode with.
+ * \param[in] prefix The segment to encode.
+ * \param[out] out The encoded prefix, which must be freed with OgaDestroyEncodedPrefix.
+ * \return OgaResult containing the error message if the encoding failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerEncodePrefix(const OgaTokenizer* tokenizer, const char* prefix, OgaEncodedPrefix** out);
+OGA_EXPORT void OGA_API_CALL OgaDestroyEncodedPrefix(OgaEncodedPrefix*);
+
+/*
+ * \brief Adds the tokens of the prefix followed by those of suffix to the OgaSequences, encoding only the suffix.
+ * The suffix is encoded on its own, without the tokens the tokenizer starts every string with (like bos), so this matches
+ * OgaTokenizerEncode of the joined strings when the prefix ends where the tokenizer doesn't merge across, like after the
+ * special tokens of a chat template.
+ * \param[in] tokenizer The tokenizer the prefix was encoded with.
+ * \param[in] prefix The encoded prefix.
+ * \param[in] suffix The rest of the prompt.
+ * \param[in] sequences The OgaSequences to add the encoded sequence to.
+ * \return OgaResult containing the error message if the encoding failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerEncodeWithPrefix(const OgaTokenizer* tokenizer, const OgaEncodedPrefix* prefix, const char* suffix, OgaSequences* sequences);
+
 OGA_EXPORT OgaResult* OGA_API_CALL OgaProcessorProcessImages(const OgaMultiModalProcessor*, const char* prompt, const OgaImages* images, OgaNamedTensors** input_tensors);
 
+/*
+ * \brief Processes a batch of prompts into input tensors for a single generator, with one row of input_ids per prompt.
+ *        The images of all the prompts go through the vision model in one run, each with its own number of crops.
+ * \param[in] processor The multi-modal processor.
+ * \param[in] prompts The prompts of the batch.
+ * \param[in] prompt_count The number of prompts, which becomes the batch size.
+ * \param[in] images The images of all the prompts, in prompt order. Can be null when no prompt has images.
+ * \param[in] image_counts How many of the images each prompt owns, prompt_count values adding up to the number of
+ *            images. The image tags of each prompt number its own images from <|image_1|>. Can be null, then a single
+ *            prompt owns all the images and otherwise each prompt owns one.
+ * \param[out] input_tensors The input tensors for OgaGeneratorParamsSetInputs. Must be destroyed with OgaDestroyNamedTensors.
+ * \return OgaResult containing the error message if the processing failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaProcessorProcessImagesBatch(const OgaMultiModalProcessor* processor, const char* const* prompts, size_t prompt_count,
+                                                                  const OgaImages* images, const size_t* image_counts, OgaNamedTensors** input_tensors);
+
 /* Decode a single token sequence and returns a null terminated utf8 string. out_string must be freed with OgaDestroyString
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerDecode(const OgaTokenizer*, const int32_t* tokens, size_t token_count, const char** out_string);
@@ -273,6 +869,21 @@ OGA_EXPORT void OGA_API_CALL OgaDestroyTokenizerStream(OgaTokenizerStream*);
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerStreamDecode(OgaTokenizerStream*, int32_t token, const char** out);
 
+/*
+ * \brief Decodes the next token of many streams in one call, writing the chunks into a caller owned buffer.
+ * The chunks are not null terminated. A chunk that doesn't fit in what's left of the buffer stays in its stream and comes
+ * first in that stream's next chunk, so the chunks of a stream still add up to its whole text. A token of -1 decodes
+ * nothing and only writes what's left in the stream, for a stream that has finished.
+ * \param[in] streams The streams to decode the next token of
+ * \param[in] tokens The next token of each stream
+ * \param[in] stream_count The number of streams and tokens
+ * \param[out] buffer Where the chunks are written one after the other
+ * \param[in] buffer_size The size of buffer in bytes
+ * \param[out] chunk_offsets stream_count + 1 offsets into buffer, the chunk of streams[i] is from chunk_offsets[i] to chunk_offsets[i + 1]
+ * \return OgaResult containing the error message if the decoding failed.
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerStreamDecodeNext(OgaTokenizerStream* const* streams, const int32_t* tokens, size_t stream_count, char* buffer, size_t buffer_size, size_t* chunk_offsets);
+
 /* Create an OgaTensor from a user owned buffer. The OgaTensor does not own the memory (as it has no way to free it) so
  * the 'data' parameter must be valid for the lifetime of the OgaTensor.
  *
@@ -283,6 +894,20 @@ OGA_EXPORT OgaResult* OGA_API_CALL OgaTokenizerStreamDecode(OgaTokenizerStream*,
  * \param[out] out Writes the newly created OgaTensor into this, must be destroyed with OgaDestroyTensor
  */
 OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateTensorFromBuffer(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type, OgaTensor** out);
+
+/* Create an OgaTensor from a user owned buffer in CUDA device memory, that is used as a model input without being copied
+ * to the host. Like OgaCreateTensorFromBuffer the OgaTensor does not own the memory.
+ *
+ * \param[in] data User supplied device memory pointer, must remain valid for lifetime of the OgaTensor
+ * \param[in] shape_dims Pointer to array of int64_t values that define the tensor shape
+ * \param[in] shape_dims_count Count of elements in the shape_dims array
+ * \param[in] element_type The data type that 'data' points to.
+ * \param[in] device_id The CUDA device the memory is on
+ * \param[in] stream The cudaStream_t the data is written on, which the model's runs wait for. Null for the default stream
+ * \param[out] out Writes the newly created OgaTensor into this, must be destroyed with OgaDestroyTensor
+ */
+OGA_EXPORT OgaResult* OGA_API_CALL OgaCreateTensorFromDeviceBuffer(void* data, const int64_t* shape_dims, size_t shape_dims_count, OgaElementType element_type,
+                                                                   int device_id, void* stream, OgaTensor** out);
 OGA_EXPORT void OGA_API_CALL OgaDestroyTensor(OgaTensor* tensor);
 
 /* Get the OgaElementType of the data stored in the OgaTensor
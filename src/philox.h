@@ -0,0 +1,48 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <cstdint>
+
+// Used by both the CPU search and the CUDA sampling kernels
+#if defined(__CUDACC__) || defined(__HIPCC__)
+#define PHILOX_HOST_DEVICE __host__ __device__
+#else
+#define PHILOX_HOST_DEVICE
+#endif
+
+namespace Generators {
+
+// The random numbers of one batch entry: the seed of its request, and its index among the batch entries with that seed,
+// so entries only get different draws from each other when they share a seed. The fork tells apart the generators
+// Generator::Fork made from one seeded generator.
+struct RandomStream {
+  uint64_t seed;
+  uint32_t index;
+  uint32_t fork{};
+};
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3"). A counter based generator: each draw is a
+// function of the key and the counter alone, so there's no state to initialize or keep, and a batch entry's draws don't
+// depend on the other entries of its batch or on the order they're made in
+PHILOX_HOST_DEVICE inline void Philox4x32(uint32_t counter[4], uint32_t key0, uint32_t key1) {
+  for (int round = 0; round < 10; round++) {
+    const uint64_t product0 = static_cast<uint64_t>(0xD2511F53U) * counter[0];
+    const uint64_t product1 = static_cast<uint64_t>(0xCD9E8D57U) * counter[2];
+    const uint32_t c1 = counter[1], c3 = counter[3];
+    counter[0] = static_cast<uint32_t>(product1 >> 32) ^ c1 ^ key0;
+    counter[1] = static_cast<uint32_t>(product1);
+    counter[2] = static_cast<uint32_t>(product0 >> 32) ^ c3 ^ key1;
+    counter[3] = static_cast<uint32_t>(product0);
+    key0 += 0x9E3779B9U;
+    key1 += 0xBB67AE85U;
+  }
+}
+
+// The uniform [0, 1) draw of a batch entry for a sampling step
+PHILOX_HOST_DEVICE inline float RandomUniform(RandomStream stream, uint64_t step) {
+  uint32_t counter[4] = {static_cast<uint32_t>(step), static_cast<uint32_t>(step >> 32), stream.index, stream.fork};
+  Philox4x32(counter, static_cast<uint32_t>(stream.seed), static_cast<uint32_t>(stream.seed >> 32));
+  return static_cast<float>(counter[0] >> 8) * (1.0f / 16777216.0f);  // 24 bits, all a float holds below 1
+}
+
+}  // namespace Generators
@@ -14,12 +14,35 @@ import numpy as np
 import torch
 
 import argparse
+import concurrent.futures
 import gc
 import json
 import os
+import shutil
 import textwrap
 
 
+def quantize_int4_columns(weight, block_size):
+    """
+    Quantize the K x N weight of a MatMul to the symmetric int4 blocks of MatMulNBits, like MatMul4BitsQuantizer does.
+    Returns the N x k_blocks x (block_size / 2) packed weight and the N * k_blocks scales. Columns are quantized independently,
+    so the results of column slices can be concatenated.
+    """
+    from onnxruntime.capi._pybind_state import quantize_matmul_4bits
+
+    rows, cols = weight.shape
+    k_blocks = (rows + block_size - 1) // block_size
+    pad_len = k_blocks * block_size - rows
+    if pad_len > 0:
+        weight = np.pad(weight, ((0, pad_len), (0, 0)), "constant")
+
+    packed = np.zeros((cols, k_blocks, block_size // 2), dtype="uint8")
+    scales = np.zeros((cols * k_blocks), dtype=weight.dtype)
+    zero_point = np.zeros(cols * ((k_blocks + 1) // 2), dtype="uint8")
+    quantize_matmul_4bits(packed, np.ascontiguousarray(weight), scales, zero_point, block_size, cols, rows, True)
+    return packed, scales
+
+
 class Model:
     def __init__(self, config, io_dtype, onnx_dtype, ep, cache_dir, extra_options):
         self.context_length = config.max_position_embeddings
@@ -34,14 +57,87 @@ class Model:
         self.vocab_size = config.vocab_size
         self.activation = config.hidden_activation if hasattr(config, "hidden_activation") else config.hidden_act
 
+        # Mixture of experts (each token runs through the top k of the experts' MLPs, as picked by a router, in a fused MoE op)
+        self.moe_attrs = {
+            "num_experts": config.num_local_experts if hasattr(config, "num_local_experts") else 0,
+            "top_k": config.num_experts_per_tok if hasattr(config, "num_experts_per_tok") else 0,
+            "normalize_routing_weights": 1,  # Rescale the routing weights of the top k experts to add up to 1
+            "expert_weight_bits": 4,         # Bits of the expert weights in QMoE, for int4 precision
+            "expert_parallel": "expert_parallel" in extra_options and extra_options["expert_parallel"] == "1",
+        }
+        if self.moe_attrs["num_experts"] > 0 and ep != "cuda":
+            raise NotImplementedError(f"Mixture of experts models are not currently supported with the {ep} execution provider.")
+        if self.moe_attrs["expert_parallel"] and self.moe_attrs["num_experts"] == 0:
+            raise ValueError("expert_parallel needs a mixture of experts model.")
+
+        # Tensor parallelism (each rank keeps a slice of the attention heads and MLP, and AllReduce sums their partial outputs)
+        #
+        # With expert_parallel, each rank keeps all of its experts' MLPs instead, for a slice of the experts
+        self.tp_world_size = int(extra_options["tp_world_size"]) if "tp_world_size" in extra_options else 1
+        self.tp_rank = int(extra_options["tp_rank"]) if "tp_rank" in extra_options else 0
+        if self.moe_attrs["expert_parallel"] and self.tp_world_size == 1:
+            raise ValueError("expert_parallel needs tp_world_size, the number of ranks to split the experts over.")
+        if self.tp_world_size > 1:
+            if ep != "cuda":
+                raise NotImplementedError(f"Tensor parallelism is not currently supported with the {ep} execution provider.")
+            if self.num_kv_heads % self.tp_world_size != 0:
+                raise ValueError(f"The {self.num_kv_heads} KV heads must divide by tp_world_size = {self.tp_world_size}.")
+            if self.moe_attrs["expert_parallel"] and self.moe_attrs["num_experts"] % self.tp_world_size != 0:
+                raise ValueError(f"The {self.moe_attrs['num_experts']} experts must divide by tp_world_size = {self.tp_world_size}.")
+            if not self.moe_attrs["expert_parallel"] and self.intermediate_size % self.tp_world_size != 0:
+                raise ValueError(f"The intermediate size of {self.intermediate_size} must divide by tp_world_size = {self.tp_world_size}.")
+            if self.moe_attrs["num_experts"] > 0 and onnx_dtype != "fp16":
+                raise NotImplementedError("Sharded mixture of experts models are only supported with fp16 precision, there's no sharded QMoE op.")
+            self.num_attn_heads //= self.tp_world_size
+            self.num_kv_heads //= self.tp_world_size
+            if not self.moe_attrs["expert_parallel"]:
+                self.intermediate_size //= self.tp_world_size
+
+        # Pipeline parallelism (each stage runs a consecutive range of the layers on its own device, and passes the hidden states on)
+        self.total_num_layers = self.num_layers
+        self.pp_stages = int(extra_options["pp_stages"]) if "pp_stages" in extra_options else 1
+        self.pp_stage = int(extra_options["pp_stage"]) if "pp_stage" in extra_options else 0
+        # Offloaded stages take their layer weights as inputs, which GenAI streams onto a single device from host memory
+        self.pp_offload_weights = "pp_offload_weights" in extra_options and extra_options["pp_offload_weights"] == "1"
+        self.pp_device_ids = [int(device_id) for device_id in extra_options["pp_device_ids"].split(",")] if "pp_device_ids" in extra_options else [0] * self.pp_stages if self.pp_offload_weights else list(range(self.pp_stages))
+        if self.pp_stages > 1:
+            if ep not in {"cpu", "cuda"}:
+                raise NotImplementedError(f"Pipeline parallelism is not currently supported with the {ep} execution provider.")
+            if self.tp_world_size > 1:
+                raise NotImplementedError("Tensor and pipeline parallelism can't currently be combined.")
+            if len(self.pp_device_ids) != self.pp_stages:
+                raise ValueError(f"pp_device_ids must have a device for each of the {self.pp_stages} stages.")
+            if self.pp_offload_weights and len(set(self.pp_device_ids)) > 1:
+                raise ValueError("pp_offload_weights runs the stages one after another, so they all need the same device.")
+            if self.total_num_layers < self.pp_stages:
+                raise ValueError(f"The {self.total_num_layers} layers can't be split into {self.pp_stages} stages.")
+            # The first stages take the extra layers. Each stage numbers its KV caches from 0
+            self.pp_stage_layers = [self.total_num_layers // self.pp_stages + (1 if i < self.total_num_layers % self.pp_stages else 0) for i in range(self.pp_stages)]
+            self.pp_layer_offset = sum(self.pp_stage_layers[:self.pp_stage])
+            self.num_layers = self.pp_stage_layers[self.pp_stage]
+        else:
+            if self.pp_offload_weights:
+                raise ValueError("pp_offload_weights needs the layers split into pp_stages > 1.")
+            self.pp_layer_offset = 0
+
         self.model_name_or_path = config._name_or_path
         self.model_type = config.architectures[0]
         self.io_dtype = io_dtype      # {'fp16', 'fp32'}
-        self.onnx_dtype = onnx_dtype  # {"int4", "fp16", "fp32"}
+        self.onnx_dtype = onnx_dtype  # {"int4", "int8", "fp16", "fp32"}
         self.quant_type = config.quantization_config["quant_method"] if hasattr(config, "quantization_config") else None
 
         self.cache_dir = cache_dir
         self.filename = extra_options["filename"] if "filename" in extra_options else "model.onnx"
+        if self.tp_world_size > 1:
+            # GenAI fills in each process's rank
+            root, ext = os.path.splitext(self.filename)
+            self.tp_filename = f"{root}_rank_%d{ext}"
+            self.filename = self.tp_filename % self.tp_rank
+        if self.pp_stages > 1:
+            root, ext = os.path.splitext(self.filename)
+            self.pp_filenames = [f"{root}_stage_{i}{ext}" for i in range(self.pp_stages)]
+            self.pp_weights_filenames = [f"{root}_stage_{i}.safetensors" for i in range(self.pp_stages)]
+            self.filename = self.pp_filenames[self.pp_stage]
         self.extra_options = extra_options
 
         self.inputs = []
@@ -84,7 +180,7 @@ class Model:
             "past_key_values.key": ["batch_size", self.num_kv_heads, "past_sequence_length", self.head_size],    # For standard models (note that `past_key_values.key` is written this way to match Hugging Face format)
             "past_key_values.value": ["batch_size", self.num_kv_heads, "past_sequence_length", self.head_size],  # For standard models (note that `past_key_values.value` is written this way to match Hugging Face format)
         }
-        self.exclude_embeds = "exclude_embeds" in extra_options
+        self.exclude_embeds = "exclude_embeds" in extra_options or self.pp_stage > 0
         if self.exclude_embeds:
             self.input_names = [name.replace("input_ids", "inputs_embeds") for name in self.input_names]
 
@@ -102,9 +198,34 @@ class Model:
             "present.key": ["batch_size", self.num_kv_heads, "total_sequence_length", self.head_size],           # For standard models (note that `present.key` is written this way to match Hugging Face format)
             "present.value": ["batch_size", self.num_kv_heads, "total_sequence_length", self.head_size],         # For standard models (note that `present.value` is written this way to match Hugging Face format)
         }
-        self.exclude_lm_head = "exclude_lm_head" in extra_options
+        self.exclude_lm_head = "exclude_lm_head" in extra_options or self.pp_stage < self.pp_stages - 1
         if self.exclude_lm_head:
             self.output_names = [name.replace("logits", "hidden_states") for name in self.output_names]
+        self.last_token_logits = "last_token_logits" in extra_options and extra_options["last_token_logits"] == "1"
+        if self.last_token_logits:
+            self.output_shapes["logits"] = ["batch_size", 1, self.vocab_size]
+
+        # Medusa style draft heads, each guessing a token further ahead from the same hidden states as the LM head
+        self.draft_heads = self.load_draft_heads(extra_options["draft_heads"]) if "draft_heads" in extra_options else []
+        if self.draft_heads:
+            if self.exclude_lm_head:
+                raise NotImplementedError("Draft heads are not currently supported without the LM head.")
+            if self.tp_world_size > 1:
+                raise NotImplementedError("Draft heads are not currently supported with tensor parallelism.")
+            for i in range(len(self.draft_heads)):
+                self.output_names.append(f"draft_logits.{i}")
+                self.output_types[f"draft_logits.{i}"] = self.io_dtype
+                self.output_shapes[f"draft_logits.{i}"] = self.output_shapes["logits"]
+
+        # Only the LM head rows of these tokens are computed, for workloads that only ever emit a few (like classification)
+        self.allowed_token_ids = self.load_allowed_token_ids(extra_options["allowed_token_ids"], config) if "allowed_token_ids" in extra_options else []
+        self.lm_head_size = len(self.allowed_token_ids) if self.allowed_token_ids else self.vocab_size
+        if self.allowed_token_ids:
+            if self.exclude_lm_head:
+                raise ValueError("allowed_token_ids needs the LM head, it can't be used with exclude_lm_head.")
+            if self.draft_heads:
+                raise NotImplementedError("Draft heads are not currently supported with allowed_token_ids.")
+            self.output_shapes["logits"] = self.output_shapes["logits"][:-1] + [self.lm_head_size]
 
         # Store names of nodes already created
         self.node_names = set()
@@ -231,10 +352,45 @@ class Model:
 
         self.past_present_share_buffer = self.attention_attrs["op_type"] == "GroupQueryAttention"
 
+        # KV cache quantization (int8 past/present with a scale per head, dequantized before the attention op)
+        self.quantize_kv_cache = "kv_cache_dtype" in extra_options
+        if self.quantize_kv_cache:
+            if extra_options["kv_cache_dtype"] != "int8":
+                raise NotImplementedError(f"The {extra_options['kv_cache_dtype']} KV cache dtype is not currently supported.")
+            if self.ep_attrs["cuda"]["enable_cuda_graph"] == "1":
+                raise NotImplementedError("Quantized KV caches are not currently supported with CUDA graph capture.")
+
+            # The whole present is requantized every run, so the past and present can't share a buffer
+            self.past_present_share_buffer = False
+            for name in ["past_key_values.key", "past_key_values.value"]:
+                self.input_types[name] = TensorProto.INT8
+            for name in ["present.key", "present.value"]:
+                self.output_types[name] = TensorProto.INT8
+
+        # LoRA adapter serving (each projection adds x * A * B, gathered from stacked adapter inputs by each sequence's slot)
+        self.lora_max_adapters = int(extra_options["lora_max_adapters"]) if "lora_max_adapters" in extra_options else 0
+        if self.lora_max_adapters > 0:
+            if self.ep not in {"cpu", "cuda"}:
+                raise NotImplementedError(f"LoRA adapters are not currently supported with the {self.ep} execution provider.")
+            if self.ep_attrs["cuda"]["enable_cuda_graph"] == "1":
+                raise NotImplementedError("LoRA adapters are not currently supported with CUDA graph capture.")
+            if self.tp_world_size > 1:
+                raise NotImplementedError("LoRA adapters are not currently supported with tensor parallelism.")
+
+            self.lora_max_rank = int(extra_options["lora_max_rank"]) if "lora_max_rank" in extra_options else 16
+            self.lora_targets = set(extra_options["lora_targets"].split(",")) if "lora_targets" in extra_options else {"q_proj", "k_proj", "v_proj", "o_proj"}
+
+            # Q, K and V need their own adapter weights
+            self.attention_attrs["use_packed_matmul"] = False
+            self.input_names.append("lora_adapter_ids")
+            self.input_types["lora_adapter_ids"] = TensorProto.INT32
+            self.input_shapes["lora_adapter_ids"] = ["batch_size"]
+
         # MLP-specific variables
         self.mlp_attrs = {
             "use_proj": True,           # Use projection style for MLP (GateProj/UpProj/DownProj)
             "use_fc": False,            # Use fully-connected style for MLP (FC1/FC2)
+            "use_moe": False,           # Use mixture of experts for MLP (router and experts in a MoE op)
             "output_0": "",             # Output 0 for MLP layer
         }
 
@@ -254,8 +410,35 @@ class Model:
             "int4": {
                 "block_size": int(extra_options["int4_block_size"]) if "int4_block_size" in extra_options else 32,
                 "accuracy_level": int(extra_options["int4_accuracy_level"]) if "int4_accuracy_level" in extra_options else None,
+                # The embedding table quantized like the MatMuls and read with GatherBlockQuantized, shared with a tied LM head
+                "embeddings": self.onnx_dtype == "int4" and "int4_embeddings" in extra_options and extra_options["int4_embeddings"] == "1",
+                "tied_lm_head": None,  # The (qweight, scales) of the embedding table that the LM head uses too
             }
         }
+        self.tie_word_embeddings = getattr(config, "tie_word_embeddings", False) and not self.exclude_embeds and not self.exclude_lm_head and not self.allowed_token_ids
+        if self.quant_attrs["int4"]["embeddings"] and self.quant_type is not None:
+            raise NotImplementedError("int4_embeddings can't currently be used with pre-quantized models.")
+        if self.onnx_dtype == "int8" and self.ep != "cpu":
+            raise NotImplementedError(f"The int8 precision is not currently supported with the {self.ep} execution provider.")
+        if self.onnx_dtype == "int8" and self.quant_type is not None:
+            raise NotImplementedError("The int8 precision can't currently be used with pre-quantized models.")
+
+        # Streaming export (each module's weights are read from the checkpoint, quantized and written out on their own)
+        self.stream_weights = "stream_weights" in extra_options and extra_options["stream_weights"] == "1"
+        self.int4_workers = int(extra_options["int4_workers"]) if "int4_workers" in extra_options else os.cpu_count()
+        self.int4_pool = None
+        self.data_file = None
+        if self.stream_weights and self.quant_type is not None:
+            raise NotImplementedError("stream_weights can't currently be used with pre-quantized models.")
+
+        # GGUF weights referenced in place (the model's external data points into the GGUF file instead of a copy of it)
+        self.gguf_external_data = "gguf_external_data" in extra_options and extra_options["gguf_external_data"] == "1"
+        self.gguf_model = None
+        if self.gguf_external_data and (self.onnx_dtype not in {"fp16", "fp32"} or self.stream_weights):
+            raise NotImplementedError("gguf_external_data can only be used with FP16 or FP32 precision and without stream_weights.")
+        if self.pp_offload_weights and (self.stream_weights or self.gguf_external_data):
+            raise NotImplementedError("pp_offload_weights can't currently be used with stream_weights or gguf_external_data.")
+
         if self.quant_type is not None:
             # Create quantized attributes from quantization config
             self.quant_attrs["bits"] = config.quantization_config["bits"]
@@ -314,6 +497,50 @@ class Model:
             },
         }
 
+        if self.last_token_logits:
+            genai_config["model"]["decoder"]["last_token_logits"] = True
+
+        if self.allowed_token_ids:
+            genai_config["model"]["logits_token_ids"] = self.allowed_token_ids
+
+        if self.draft_heads:
+            genai_config["model"]["decoder"]["draft_heads"] = len(self.draft_heads)
+            genai_config["model"]["decoder"]["outputs"]["draft_logits_names"] = "draft_logits.%d"
+
+        if self.tp_world_size > 1:
+            # The head counts are already the ones of a single shard, which is what the KV caches of each rank hold
+            genai_config["model"]["decoder"]["filename"] = self.tp_filename
+            genai_config["model"]["decoder"]["tensor_parallel_size"] = self.tp_world_size
+
+        if self.pp_stages > 1:
+            genai_config["model"]["decoder"]["filename"] = self.pp_filenames[-1]
+            genai_config["model"]["decoder"]["num_hidden_layers"] = self.total_num_layers
+            genai_config["model"]["decoder"]["pipeline"] = [
+                {"filename": filename, "num_hidden_layers": num_layers, "device_id": device_id}
+                for filename, num_layers, device_id in zip(self.pp_filenames, self.pp_stage_layers, self.pp_device_ids)
+            ]
+            if self.pp_offload_weights:
+                for stage, weights_filename in zip(genai_config["model"]["decoder"]["pipeline"], self.pp_weights_filenames):
+                    stage["offloaded_weights"] = weights_filename
+            genai_config["model"]["decoder"]["pipeline_micro_batches"] = int(self.extra_options["pp_micro_batches"]) if "pp_micro_batches" in self.extra_options else self.pp_stages
+
+        if self.lora_max_adapters > 0:
+            genai_config["model"]["decoder"]["inputs"]["adapter_ids"] = genai_config["model"]["decoder"]["inputs"].pop("lora_adapter_ids")
+            genai_config["model"]["decoder"]["adapters"] = {
+                "max_adapters": self.lora_max_adapters,
+                "max_rank": self.lora_max_rank,
+            }
+
+        if self.quantize_kv_cache:
+            genai_config["model"]["decoder"]["inputs"].update({
+                "past_key_scale_names": "past_key_values.%d.key_scale",
+                "past_value_scale_names": "past_key_values.%d.value_scale",
+            })
+            genai_config["model"]["decoder"]["outputs"].update({
+                "present_key_scale_names": "present.%d.key_scale",
+                "present_value_scale_names": "present.%d.value_scale",
+            })
+
         if self.ep != "cpu":
             ep_options = { self.ep : self.ep_attrs[self.ep] }
             genai_config["model"]["decoder"]["session_options"]["provider_options"].append(ep_options)
@@ -331,6 +558,10 @@ class Model:
         print(f"Saving ONNX model in {out_dir}")
         gc.collect()
 
+        if self.stream_weights:
+            self.save_streamed_model(out_dir)
+            return
+
         # Create ONNX model
         model = helper.make_model(
             opset_imports=[self.clear_field(helper.make_operatorsetid('', 14), 'domain'), helper.make_operatorsetid('com.microsoft', 1)],
@@ -347,8 +578,15 @@ class Model:
             )
         )
 
-        # Load external data into ONNX model
-        external_data_helper.load_external_data_for_model(model, self.cache_dir)
+        # Load external data into ONNX model, except for the weights read in place from the GGUF file
+        if self.gguf_model is None:
+            external_data_helper.load_external_data_for_model(model, self.cache_dir)
+        else:
+            for tensor in external_data_helper._get_all_tensors(model):
+                if external_data_helper.uses_external_data(tensor) and not self.is_gguf_location(tensor):
+                    external_data_helper.load_external_data_for_tensor(tensor, self.cache_dir)
+                    tensor.data_location = TensorProto.DEFAULT
+                    del tensor.external_data[:]
 
         # Delete external data files on disk before re-saving
         for path in os.listdir(self.cache_dir):
@@ -364,6 +602,9 @@ class Model:
         if self.onnx_dtype == "int4" and self.quant_type is None:
             model = self.to_int4(model)
 
+        if self.pp_offload_weights:
+            self.offload_layer_weights(model, out_dir)
+
         # Save ONNX model with only one external data file and delete any existing duplicate copies
         out_path = os.path.join(out_dir, self.filename)
         data_path = os.path.join(out_dir, os.path.basename(out_path) + ".data")
@@ -384,6 +625,107 @@ class Model:
             convert_attribute=False,
         )
 
+        if self.gguf_model is not None:
+            self.link_gguf_file(out_dir)
+
+    def is_gguf_view(self, np_data):
+        # Whether np_data is stored as is in the GGUF file, so it can be read from there rather than copied
+        if self.gguf_model is None or not np_data.flags.c_contiguous or np_data.dtype.byteorder == ">":
+            return False
+        base = self.gguf_model.data.ctypes.data
+        start = np_data.ctypes.data
+        return base <= start and start + np_data.nbytes <= base + self.gguf_model.data.nbytes
+
+    def is_gguf_location(self, tensor):
+        return any(entry.key == "location" and entry.value == os.path.basename(self.gguf_model.path) for entry in tensor.external_data)
+
+    def link_gguf_file(self, out_dir):
+        # The weights read in place are located relative to the ONNX model, so the GGUF file has to be next to it.
+        # A hard link (or a symbolic one across file systems) keeps it from being copied
+        link_path = os.path.join(out_dir, os.path.basename(self.gguf_model.path))
+        if os.path.exists(link_path):
+            if os.path.samefile(link_path, self.gguf_model.path):
+                return
+            print(f"Overwriting {link_path}")
+            os.remove(link_path)
+        try:
+            os.link(self.gguf_model.path, link_path)
+        except OSError:
+            os.symlink(os.path.abspath(self.gguf_model.path), link_path)
+
+    def save_streamed_model(self, out_dir):
+        # The weights are already in the data file, quantized as they were made, so only the graph is left to save
+        if self.int4_pool is not None:
+            self.int4_pool.shutdown()
+            self.int4_pool = None
+
+        model = helper.make_model(
+            opset_imports=[self.clear_field(helper.make_operatorsetid('', 14), 'domain'), helper.make_operatorsetid('com.microsoft', 1)],
+            ir_version=7,
+            producer_name="onnxruntime-genai",
+            producer_version="0.0.0",
+            graph=self.make_graph(
+                name="main_graph",
+                inputs=self.inputs,
+                outputs=self.outputs,
+                initializer=self.initializers,
+                value_info=self.value_infos,
+                nodes=self.nodes,
+            )
+        )
+
+        out_path = os.path.join(out_dir, self.filename)
+        data_path = os.path.join(out_dir, os.path.basename(out_path) + ".data")
+        if os.path.exists(out_path):
+            print(f"Overwriting {out_path}")
+            os.remove(out_path)
+        if os.path.exists(data_path):
+            print(f"Overwriting {data_path}")
+            os.remove(data_path)
+
+        self.data_file.close()
+        shutil.move(self.data_file.name, data_path)
+        self.data_file = None
+
+        # Delete temporary cache dir if empty
+        if len(os.listdir(self.cache_dir)) == 0:
+            os.rmdir(self.cache_dir)
+
+        save_model(model, out_path)
+
+    def offload_layer_weights(self, model, out_dir):
+        # The decoder layer weights become graph inputs, saved in a safetensors file of the stage that GenAI keeps in host memory
+        safetensors_dtypes = {
+            TensorProto.FLOAT: "F32", TensorProto.FLOAT16: "F16", TensorProto.BFLOAT16: "BF16", TensorProto.DOUBLE: "F64",
+            TensorProto.INT8: "I8", TensorProto.UINT8: "U8", TensorProto.INT16: "I16", TensorProto.UINT16: "U16",
+            TensorProto.INT32: "I32", TensorProto.UINT32: "U32", TensorProto.INT64: "I64", TensorProto.UINT64: "U64", TensorProto.BOOL: "BOOL",
+        }
+        header, data = {}, []
+        offset = 0
+        kept = []
+        for tensor in model.graph.initializer:
+            if not tensor.name.startswith("model.layers."):
+                kept.append(tensor)
+                continue
+            raw_data = numpy_helper.to_array(tensor).tobytes() if tensor.data_type != TensorProto.BFLOAT16 else tensor.raw_data
+            header[tensor.name] = {"dtype": safetensors_dtypes[tensor.data_type], "shape": list(tensor.dims), "data_offsets": [offset, offset + len(raw_data)]}
+            data.append(raw_data)
+            offset += len(raw_data)
+            model.graph.input.append(helper.make_tensor_value_info(tensor.name, tensor.data_type, list(tensor.dims)))
+        del model.graph.initializer[:]
+        model.graph.initializer.extend(kept)
+
+        # An 8 byte little endian header size, then the JSON header padded to 8 bytes, then the data
+        header_bytes = json.dumps(header, separators=(",", ":")).encode("utf-8")
+        header_bytes += b" " * (-len(header_bytes) % 8)
+        weights_path = os.path.join(out_dir, self.pp_weights_filenames[self.pp_stage])
+        print(f"Saving the offloaded layer weights in {weights_path}")
+        with open(weights_path, "wb") as f:
+            f.write(len(header_bytes).to_bytes(8, "little"))
+            f.write(header_bytes)
+            for raw_data in data:
+                f.write(raw_data)
+
     def to_int4(self, model):
         quant = MatMul4BitsQuantizer(
             model=model,
@@ -404,13 +746,32 @@ class Model:
         repeated_proto.sort(key=lambda x: order.index(getattr(x, key_name)))
 
     def make_external_tensor(self, np_data, name, **kwargs):
+        if self.is_gguf_view(np_data):
+            # Points at the tensor's bytes in the GGUF file, which ONNX Runtime memory maps instead of loading a copy
+            tensor = TensorProto(name=name, data_type=helper.np_dtype_to_tensor_dtype(np_data.dtype), dims=np_data.shape)
+            offset = np_data.ctypes.data - self.gguf_model.data.ctypes.data
+            external_data_helper.set_external_data(tensor, location=os.path.basename(self.gguf_model.path), offset=offset, length=np_data.nbytes)
+            tensor.data_location = TensorProto.EXTERNAL
+            self.initializers.append(tensor)
+            return
+
         tensor = numpy_helper.from_array(np_data)
         tensor.name = name
 
-        filename = f"{name}.bin"
-        external_data_helper.set_external_data(tensor, location=filename)
-        with open(os.path.join(self.cache_dir, filename), "wb") as f:
-            f.write(tensor.raw_data)
+        if self.stream_weights:
+            # Appended to the model's data file right away, so no weight stays in memory once it's made. Large tensors are
+            # aligned to the allocation granularity, so ONNX Runtime can memory map them
+            if self.data_file is None:
+                self.data_file = open(os.path.join(self.cache_dir, os.path.basename(self.filename) + ".data"), "wb")
+            if len(tensor.raw_data) >= 1024 * 1024:
+                self.data_file.write(b"\0" * (-self.data_file.tell() % 65536))
+            external_data_helper.set_external_data(tensor, location=os.path.basename(self.filename) + ".data", offset=self.data_file.tell(), length=len(tensor.raw_data))
+            self.data_file.write(tensor.raw_data)
+        else:
+            filename = f"{name}.bin"
+            external_data_helper.set_external_data(tensor, location=filename)
+            with open(os.path.join(self.cache_dir, filename), "wb") as f:
+                f.write(tensor.raw_data)
         tensor.ClearField("raw_data")
         tensor.data_location = TensorProto.EXTERNAL
 
@@ -480,6 +841,14 @@ class Model:
             value_name = f"present.{i}.value"
             outputs.append(helper.make_tensor_value_info(value_name, self.output_types["present.value"], shape=self.output_shapes["present.value"]))
 
+            if self.quantize_kv_cache:
+                # Add scales of quantized KV cache to inputs and outputs
+                scale_shape = ["batch_size", self.num_kv_heads, 1, 1]
+                for kv_name in [f"past_key_values.{i}.key", f"past_key_values.{i}.value"]:
+                    inputs.append(helper.make_tensor_value_info(f"{kv_name}_scale", self.io_dtype, shape=scale_shape))
+                for kv_name in [f"present.{i}.key", f"present.{i}.value"]:
+                    outputs.append(helper.make_tensor_value_info(f"{kv_name}_scale", self.io_dtype, shape=scale_shape))
+
         self.inputs = inputs
         self.outputs = outputs
 
@@ -623,24 +992,124 @@ class Model:
 
     def make_matmul(self, matmul, basename, root_input, **kwargs):
         if self.onnx_dtype in {"fp16", "fp32"}:
-            return self.make_matmul_fp16_or_fp32(matmul, basename, root_input, **kwargs)
+            name = self.make_matmul_fp16_or_fp32(matmul, basename, root_input, **kwargs)
         elif self.onnx_dtype == "int4":
-            return self.make_matmul_int4(matmul, basename, root_input, **kwargs)
+            name = self.make_matmul_int4(matmul, basename, root_input, **kwargs)
+        elif self.onnx_dtype == "int8":
+            name = self.make_matmul_int8(matmul, basename, root_input, **kwargs)
         else:
             raise NotImplementedError(f"The {self.onnx_dtype} precision is not currently supported.")
 
+        if self.lora_max_adapters > 0 and "/layers." in basename and basename.split("/")[-2] in self.lora_targets:
+            name = self.make_lora(matmul, basename, root_input, f"{name}/output_0")
+        if self.tp_world_size > 1 and "/layers." in basename and basename.split("/")[-2] in {"o_proj", "down_proj"}:
+            # Row parallel projections only have this rank's part of the sum, any bias is added after the AllReduce
+            name = self.make_all_reduce(f"{basename[ : basename.rfind('/')]}/AllReduce", f"{name}/output_0")
+        return name
+
+    def make_all_reduce(self, name, root_input):
+        output = f"{name}/output_0"
+        self.make_node("AllReduce", inputs=[root_input], outputs=[output], name=name, domain="com.microsoft")
+        self.make_value_info(output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+        return name
+
+    def make_tensor_parallel_shard(self, layer):
+        # Keep this rank's slice of a decoder layer
+        #
+        # Column parallel: Q, K, V (whole heads) and the gate & up projections (their outputs)
+        # Row parallel: the O & down projections (their inputs), followed by an AllReduce
+        #
+        # The embedding, norms and LM head stay whole on every rank, so every rank computes the same logits.
+        #
+        # Mixture of experts: the router stays whole, and each expert's w1 & w3 (column) and w2 (row) inputs are split like the
+        # MLP projections, or with expert_parallel, this rank's slice of the experts is kept whole. ShardedMoE adds up the outputs.
+        attention = layer.self_attn
+        linears = [(getattr(attention, name, None), 0) for name in ["q_proj", "k_proj", "v_proj"]] + [(getattr(attention, "o_proj", None), 1)]
+        if self.mlp_attrs["use_moe"]:
+            moe = layer.block_sparse_moe
+            if self.moe_attrs["expert_parallel"]:
+                size = len(moe.experts) // self.tp_world_size
+                moe.experts = moe.experts[self.tp_rank * size : (self.tp_rank + 1) * size]
+            else:
+                linears += [(getattr(expert, name, None), dim) for expert in moe.experts for name, dim in [("w1", 0), ("w3", 0), ("w2", 1)]]
+        else:
+            mlp = layer.mlp
+            linears += [(getattr(mlp, name, None), 0) for name in ["gate_proj", "up_proj"]] + [(getattr(mlp, "down_proj", None), 1)]
+        if not all(isinstance(linear, torch.nn.Linear) for linear, _ in linears):
+            raise NotImplementedError(f"Tensor parallelism is only supported for unquantized models with separate Q/K/V and gate/up/down projections, not {self.model_type}.")
+
+        for linear, dim in linears:
+            size = linear.weight.shape[dim] // self.tp_world_size
+            linear.weight = torch.nn.Parameter(linear.weight.detach().narrow(dim, self.tp_rank * size, size).contiguous(), requires_grad=False)
+            if dim == 0 and linear.bias is not None:
+                linear.bias = torch.nn.Parameter(linear.bias.detach().narrow(0, self.tp_rank * size, size).contiguous(), requires_grad=False)
+            linear.out_features, linear.in_features = linear.weight.shape
+
+    def make_lora(self, matmul, basename, root_input, base_output):
+        # Make nodes for the LoRA adapters of a projection
+        #
+        #   lora.*.A    lora_adapter_ids    lora.*.B
+        #         \     /            \      /
+        #         Gather              Gather
+        #           |                   |
+        # root_input--MatMul------------MatMul
+        #                                 |
+        # base_output-------------------Add
+        #
+        # Each input stacks the weights of every adapter slot, like [lora_max_adapters + 1, in_features, rank] for A, and the
+        # Gathers pick the weights of each sequence's slot, so a single batch can mix adapters. Slot 0 is kept zero for the base
+        # model, and the rank is left dynamic so adapters are zero padded to lora_max_rank when loaded. Any scaling (alpha / r)
+        # must be folded into B.
+        module = basename[ : basename.rfind("/")]
+        slots = self.lora_max_adapters + 1
+        rank = "lora_rank"
+        in_features, out_features = matmul.in_features, matmul.out_features
+
+        outputs = []
+        for weight_name, shape in [("A", [slots, in_features, rank]), ("B", [slots, rank, out_features])]:
+            weight = f"lora{module.replace('/', '.')}.{weight_name}"
+            self.inputs.append(helper.make_tensor_value_info(weight, self.io_dtype, shape=shape))
+
+            gather_name = f"{module}/lora/{weight_name}/Gather"
+            gather_output = f"{gather_name}/output_0"
+            self.make_node("Gather", inputs=[weight, "lora_adapter_ids"], outputs=[gather_output], name=gather_name, axis=0)
+            self.make_value_info(gather_output, self.io_dtype, shape=["batch_size"] + shape[1:])
+            outputs.append(gather_output)
+
+        a_matmul_name = f"{module}/lora/A/MatMul"
+        self.make_node("MatMul", inputs=[root_input, outputs[0]], outputs=[f"{a_matmul_name}/output_0"], name=a_matmul_name)
+        self.make_value_info(f"{a_matmul_name}/output_0", self.io_dtype, shape=["batch_size", "sequence_length", rank])
+        b_matmul_name = f"{module}/lora/B/MatMul"
+        self.make_node("MatMul", inputs=[f"{a_matmul_name}/output_0", outputs[1]], outputs=[f"{b_matmul_name}/output_0"], name=b_matmul_name)
+        self.make_value_info(f"{b_matmul_name}/output_0", self.io_dtype, shape=["batch_size", "sequence_length", out_features])
+
+        add_name = f"{module}/lora/Add"
+        self.make_add(add_name, [base_output, f"{b_matmul_name}/output_0"], dtype=self.io_dtype, shape=["batch_size", "sequence_length", out_features])
+        return add_name
+
     def make_matmul_fp16_or_fp32(self, matmul, name, root_input, **kwargs):
         weight = name[1:].replace("/", ".") + ".weight"
-        self.make_external_tensor(matmul.weight.detach().numpy().transpose().astype(self.to_numpy_dtype[self.io_dtype]), weight)
-
+        weight_data = matmul.weight.detach().numpy()
         last_dim = matmul.weight.shape[0]
         output = "logits" if kwargs.get("logits", False) else f"{name}/output_0"
+
+        if self.is_gguf_view(weight_data) and weight_data.dtype == self.to_numpy_dtype[self.io_dtype]:
+            # GGUF stores the N x K weight, which FusedMatMul takes as it is with transB
+            self.make_external_tensor(weight_data, weight)
+            self.make_node("FusedMatMul", inputs=[root_input, weight], outputs=[output], name=name, domain="com.microsoft", transB=1)
+            self.make_value_info(output, self.io_dtype, shape=['batch_size', 'sequence_length', last_dim])
+            return name
+
+        self.make_external_tensor(weight_data.transpose().astype(self.to_numpy_dtype[self.io_dtype]), weight)
         self.make_node("MatMul", inputs=[root_input, weight], outputs=[output], name=name)
         self.make_value_info(output, self.io_dtype, shape=['batch_size', 'sequence_length', last_dim])
 
         return name
 
     def make_matmul_int4(self, matmul, basename, root_input, **kwargs):
+        if not hasattr(matmul, "qweight") and self.stream_weights:
+            # Streamed weights aren't kept until the end, so they're quantized as they're made
+            return self.make_matmul_int4_from_float(matmul, basename, root_input, **kwargs)
         if not hasattr(matmul, "qweight"):
             # TODO: quantize weights, then save new MatMul numpy weights for onnx model
             # print(f"Quantizing to {self.onnx_dtype} on-the-fly is not currently supported.")
@@ -676,8 +1145,68 @@ class Model:
 
         return name
 
+    def make_matmul_int4_from_float(self, matmul, basename, root_input, **kwargs):
+        name = f"{basename}NBits"
+        block_size = self.quant_attrs["int4"]["block_size"]
+        weight = matmul.weight.detach().cpu().numpy().transpose().astype(self.to_numpy_dtype[self.io_dtype])
+        K, N = weight.shape
+        packed, scales = self.quantize_int4(weight, block_size)
+
+        qweight = name[1:].replace("/", ".") + ".qweight"
+        self.make_external_tensor(packed, qweight)
+        scales_name = name[1:].replace("/", ".") + ".scales"
+        self.make_external_tensor(scales, scales_name)
+
+        return self.make_matmul_nbits(name, root_input, qweight, scales_name, K, N, block_size, **kwargs)
+
+    def make_matmul_nbits(self, name, root_input, qweight, scales, K, N, block_size, **kwargs):
+        output = "logits" if kwargs.get("logits", False) else f"{name}/output_0"
+        accuracy_level = self.quant_attrs["int4"]["accuracy_level"]
+        self.make_node(
+            "MatMulNBits", inputs=[root_input, qweight, scales], outputs=[output], name=name, domain="com.microsoft",
+            bits=4, block_size=block_size, K=K, N=N, **({"accuracy_level": accuracy_level} if accuracy_level is not None else {}),
+        )
+        self.make_value_info(output, self.io_dtype, shape=['batch_size', 'sequence_length', N])
+
+        return name
+
+    def make_matmul_int8(self, matmul, basename, root_input, **kwargs):
+        # The weights are quantized symmetrically per output column, and DynamicQuantizeMatMul quantizes the activations
+        # to uint8 at runtime, so the MatMul itself runs on the int8 dot product instructions (VNNI, AMX, etc.)
+        name = f"{basename}Integer"
+        weight = matmul.weight.detach().cpu().numpy().transpose().astype(np.float32)
+        K, N = weight.shape
+        scales = np.abs(weight).max(axis=0) / 127.0
+        scales[scales == 0] = 1.0
+        qweight = np.clip(np.rint(weight / scales), -127, 127).astype(np.int8)
+
+        qweight_name = name[1:].replace("/", ".") + ".qweight"
+        self.make_external_tensor(qweight, qweight_name)
+        scales_name = name[1:].replace("/", ".") + ".scales"
+        self.make_external_tensor(scales.astype(np.float32), scales_name)
+
+        output = "logits" if kwargs.get("logits", False) else f"{name}/output_0"
+        self.make_node("DynamicQuantizeMatMul", inputs=[root_input, qweight_name, scales_name], outputs=[output], name=name, domain="com.microsoft")
+        self.make_value_info(output, self.io_dtype, shape=['batch_size', 'sequence_length', N])
+
+        return name
+
+    def quantize_int4(self, weight, block_size):
+        # Large weights are split by columns over worker processes
+        N = weight.shape[1]
+        workers = min(self.int4_workers, N // 256)
+        if workers <= 1:
+            return quantize_int4_columns(weight, block_size)
+
+        if self.int4_pool is None:
+            self.int4_pool = concurrent.futures.ProcessPoolExecutor(max_workers=self.int4_workers)
+        bounds = np.linspace(0, N, workers + 1, dtype=np.int64)
+        slices = [np.ascontiguousarray(weight[:, bounds[i] : bounds[i + 1]]) for i in range(workers)]
+        results = list(self.int4_pool.map(quantize_int4_columns, slices, [block_size] * workers))
+        return np.concatenate([packed for packed, _ in results], axis=0), np.concatenate([scales for _, scales in results])
+
     def make_packed_matmul(self, q_matmul, k_matmul, v_matmul, basename, root_input, **kwargs):
-        if self.onnx_dtype in {"fp16", "fp32"}:
+        if self.onnx_dtype in {"int8", "fp16", "fp32"}:
             return self.make_packed_matmul_fp16_or_fp32(q_matmul, k_matmul, v_matmul, basename, root_input, **kwargs)
         elif self.onnx_dtype == "int4":
             return self.make_packed_matmul_int4(q_matmul, k_matmul, v_matmul, basename, root_input, **kwargs)
@@ -771,14 +1300,17 @@ class Model:
         self.make_add_bias(add, name, root_input, **kwargs)
 
     def make_embedding(self, embedding):
-        weight = "model.embed_tokens.weight"
-        self.make_external_tensor(embedding.astype(self.to_numpy_dtype[self.io_dtype]), weight)
-
         basename = "/model/embed_tokens"
-        gather_name = f"{basename}/Gather"
-        gather_output = f"{gather_name}/output_0"
-        self.make_node('Gather', inputs=[weight, 'input_ids'], outputs=[gather_output], name=gather_name)
-        self.make_value_info(gather_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+        if self.quant_attrs["int4"]["embeddings"]:
+            gather_output = self.make_embedding_int4(embedding, basename)
+        else:
+            weight = "model.embed_tokens.weight"
+            self.make_external_tensor(embedding.astype(self.to_numpy_dtype[self.io_dtype], copy=False), weight)
+
+            gather_name = f"{basename}/Gather"
+            gather_output = f"{gather_name}/output_0"
+            self.make_node('Gather', inputs=[weight, 'input_ids'], outputs=[gather_output], name=gather_name)
+            self.make_value_info(gather_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
 
         if self.embed_attrs["scale"] != 1:
             # Scale the embeddings
@@ -795,6 +1327,39 @@ class Model:
         self.layernorm_attrs["root_input"] = layernorm_attrs_value
         self.layernorm_attrs["skip_input"] = layernorm_attrs_value
 
+    def make_embedding_int4(self, embedding, basename):
+        # Make nodes for an int4 embedding table
+        #
+        #   qweight  input_ids  scales
+        #       \        |       /
+        #       GatherBlockQuantized
+        #
+        # Each token's row is quantized along the hidden size, into the blocks MatMulNBits would make of the LM head's
+        # weight (the table transposed), so a tied LM head runs on the same initializers instead of a second copy of the
+        # table. They're stored as the rows GatherBlockQuantized takes, which only dequantizes the rows of input_ids, and
+        # the LM head reshapes them into the blocks of MatMulNBits (see make_lm_head).
+        block_size = self.quant_attrs["int4"]["block_size"]
+        if self.hidden_size % block_size != 0:
+            raise NotImplementedError(f"int4_embeddings needs a hidden_size ({self.hidden_size}) divisible by int4_block_size ({block_size}).")
+        vocab_size = embedding.shape[0]
+        k_blocks = self.hidden_size // block_size
+        packed, scales = self.quantize_int4(np.ascontiguousarray(embedding.astype(self.to_numpy_dtype[self.io_dtype]).transpose()), block_size)
+
+        qweight, scales_name = "model.embed_tokens.qweight", "model.embed_tokens.scales"
+        self.make_external_tensor(packed.reshape(vocab_size, self.hidden_size // 2), qweight)
+        self.make_external_tensor(scales.reshape(vocab_size, k_blocks), scales_name)
+        if self.tie_word_embeddings:
+            self.quant_attrs["int4"]["tied_lm_head"] = (qweight, scales_name)
+
+        gather_name = f"{basename}/GatherBlockQuantized"
+        gather_output = f"{gather_name}/output_0"
+        self.make_node(
+            "GatherBlockQuantized", inputs=[qweight, "input_ids", scales_name], outputs=[gather_output],
+            name=gather_name, domain="com.microsoft", bits=4, block_size=block_size, gather_axis=0, quantize_axis=1,
+        )
+        self.make_value_info(gather_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+        return gather_output
+
     def make_layernorm(self, layer_id, layernorm, skip, simple, location):
         root_input = self.layernorm_attrs["root_input"]
         skip_input = self.layernorm_attrs["skip_input"]
@@ -871,7 +1436,7 @@ class Model:
         sin_cache_name = kwargs.get("sin_cache_name", "sin_cache")
 
         if self.rotemb_attrs["create_rotary_embedding_caches"]:
-            if not hasattr(rotemb, "cos_cached"):
+            if not hasattr(rotemb, "cos_cached") or rotemb.cos_cached.is_meta:
                 # Create cos/sin caches if not already created
                 cos_cache, sin_cache = self.make_rotary_embedding_caches_from_scratch()
             else:
@@ -1220,6 +1785,70 @@ class Model:
             do_rotary=self.attention_attrs["use_rotemb_in_attn"], rotary_interleaved=self.rotemb_attrs["interleaved"],
         )
 
+    def make_kv_dequantize(self, past_kv):
+        # Make nodes that dequantize an int8 past KV cache with its scale per head
+        #
+        #   past_kv       past_kv_scale
+        #      |                |
+        #    Cast               |
+        #       \              /
+        #        +---- Mul ---+
+        basename = f"/model/{past_kv}/dequantize"
+        cast_name = f"{basename}/Cast"
+        self.make_cast(cast_name, past_kv, dtype=self.io_dtype, shape=self.input_shapes["past_key_values.key"])
+        mul_name = f"{basename}/Mul"
+        mul_inputs = [f"{cast_name}/output_0", f"{past_kv}_scale"]
+        self.make_mul(mul_name, mul_inputs, dtype=self.io_dtype, shape=self.input_shapes["past_key_values.key"])
+        return f"{mul_name}/output_0"
+
+    def make_kv_quantize(self, present_kv, quantized_present_kv):
+        # Make nodes that quantize a present KV cache to int8 with a scale per head (its max absolute value / 127)
+        #
+        #        present_kv
+        #       /          \
+        #      |           Abs
+        #      |            |
+        #      |        ReduceMax (over sequence_length and head_size)
+        #      |            |
+        #      |           Div (by 127)
+        #      |            |
+        #      |           Max (with a tiny scale so an all zero head doesn't divide by zero)
+        #      |            |   \
+        #       \           |    quantized_present_kv_scale
+        #        +--- Div --+
+        #              |
+        #            Round
+        #              |
+        #            Cast
+        #              |
+        #     quantized_present_kv
+        basename = f"/model/{quantized_present_kv}/quantize"
+        io_dtype_str = self.to_str_dtype[self.io_dtype]
+        present_shape = self.output_shapes["present.key"]
+        scale_shape = ["batch_size", self.num_kv_heads, 1, 1]
+        self.make_value_info(present_kv, self.io_dtype, shape=present_shape)
+
+        abs_name = f"{basename}/Abs"
+        self.make_node("Abs", inputs=[present_kv], outputs=[f"{abs_name}/output_0"], name=abs_name)
+        self.make_value_info(f"{abs_name}/output_0", self.io_dtype, shape=present_shape)
+        reduce_max_name = f"{basename}/ReduceMax"
+        self.make_node("ReduceMax", inputs=[f"{abs_name}/output_0"], outputs=[f"{reduce_max_name}/output_0"], name=reduce_max_name, axes=[2, 3], keepdims=1)
+        self.make_value_info(f"{reduce_max_name}/output_0", self.io_dtype, shape=scale_shape)
+        div_1_name = f"{basename}/Div_1"
+        div_1_inputs = [f"{reduce_max_name}/output_0", f"/model/constants/{io_dtype_str}/0D/127"]
+        self.make_div(div_1_name, div_1_inputs, dtype=self.io_dtype, shape=scale_shape)
+        max_name = f"{basename}/Max"
+        scale_output = f"{quantized_present_kv}_scale"
+        self.make_node("Max", inputs=[f"{div_1_name}/output_0", f"/model/constants/{io_dtype_str}/0D/1e-05"], outputs=[scale_output], name=max_name)
+
+        div_2_name = f"{basename}/Div_2"
+        self.make_div(div_2_name, [present_kv, scale_output], dtype=self.io_dtype, shape=present_shape)
+        round_name = f"{basename}/Round"
+        self.make_node("Round", inputs=[f"{div_2_name}/output_0"], outputs=[f"{round_name}/output_0"], name=round_name)
+        self.make_value_info(f"{round_name}/output_0", self.io_dtype, shape=present_shape)
+        cast_name = f"{basename}/Cast"
+        self.make_node("Cast", inputs=[f"{round_name}/output_0"], outputs=[quantized_present_kv], name=cast_name, to=TensorProto.INT8)
+
     def make_attention(self, layer_id, attention, root_input, **kwargs):
         # Make nodes for the Attention subgraph
         #
@@ -1318,6 +1947,13 @@ class Model:
         past_v = f"past_key_values.{layer_id}.value"
         present_k = f"present.{layer_id}.key"
         present_v = f"present.{layer_id}.value"
+        quantized_presents = []
+        if self.quantize_kv_cache:
+            # The attention op works on dequantized past KV caches, and its presents are quantized afterwards
+            past_k, past_v = self.make_kv_dequantize(past_k), self.make_kv_dequantize(past_v)
+            quantized_presents = [(f"/model/layers.{layer_id}/attn/present_k", present_k), (f"/model/layers.{layer_id}/attn/present_v", present_v)]
+            present_k, present_v = quantized_presents[0][0], quantized_presents[1][0]
+
         if self.num_attn_heads != self.num_kv_heads and self.attention_attrs["op_type"] == "MultiHeadAttention":
             k_input_to_attention = self.make_repeat_kv(layer_id, root_input=k_input_to_attention, past_kv=past_k, present_kv=present_k)
             v_input_to_attention = self.make_repeat_kv(layer_id, root_input=v_input_to_attention, past_kv=past_v, present_kv=present_v)
@@ -1330,6 +1966,8 @@ class Model:
             past_k=past_k, past_v=past_v, present_k=present_k, present_v=present_v,
             cos_cache=cos_cache_name, sin_cache=sin_cache_name, **kwargs,
         )
+        for present_kv, quantized_present_kv in quantized_presents:
+            self.make_kv_quantize(present_kv, quantized_present_kv)
 
         # Make MatMul node (output projection weight node)
         o_proj = 'o_proj' if hasattr(attention, 'o_proj') else 'dense'
@@ -1378,6 +2016,8 @@ class Model:
             self.make_mlp_proj(layer_id, mlp, root_input)
         elif self.mlp_attrs["use_fc"]:
             self.make_mlp_fc(layer_id, mlp, root_input)
+        elif self.mlp_attrs["use_moe"]:
+            self.make_moe(layer_id, mlp, root_input)
         else:
             raise NotImplementedError(f"The MLP layer type is not set.")
 
@@ -1458,6 +2098,80 @@ class Model:
         # Assign output 0 of MLP layer as output of last layer
         self.mlp_attrs["output_0"] = f"{fc2_add_name}/output_0"
 
+    def make_moe(self, layer_id, moe, root_input):
+        # Make nodes for the MoE subgraph
+        #
+        #       root_input
+        #        /      \
+        #       |    GateMatMul
+        #       |        |
+        #       |     Reshape (router logits of each token)
+        #        \      /
+        #      MoE, QMoE or ShardedMoE
+        #
+        # The op softmaxes the router logits, runs each token through its top k experts' act(w1(x)) * w3(x) --> w2, and adds
+        # up their outputs by routing weight. The experts' weights are stacked, w1 & w3 as fc1 & fc3 and w2 as fc2.
+        basename = f"/model/layers.{layer_id}/moe"
+        num_experts = self.moe_attrs["num_experts"]
+        gate_name = self.make_matmul(moe.gate, f"{basename}/gate/MatMul", root_input)
+        reshape_name = f"{basename}/gate/Reshape"
+        reshape_inputs = [f"{gate_name}/output_0", f"/model/constants/TensorProto.INT64/1D/-1, {num_experts}"]
+        self.make_reshape(reshape_name, reshape_inputs, dtype=self.io_dtype, shape=["num_tokens", num_experts])
+
+        activation_types = {"silu": "silu", "swish": "silu", "gelu": "gelu", "relu": "relu"}
+        if self.activation not in activation_types:
+            raise NotImplementedError(f"The {self.activation} activation function is not currently supported in MoE.")
+        attrs = {"activation_type": activation_types[self.activation], "k": self.moe_attrs["top_k"], "normalize_routing_weights": self.moe_attrs["normalize_routing_weights"]}
+
+        # The experts' fc weights are stacked as (num_experts, in_features, out_features)
+        weights = {
+            fc: torch.stack([getattr(expert, w).weight.detach().cpu().transpose(0, 1) for expert in moe.experts])
+            for fc, w in [("fc1", "w1"), ("fc2", "w2"), ("fc3", "w3")]
+        }
+        inputs = [root_input, f"{reshape_name}/output_0"]
+        if self.onnx_dtype == "int4":
+            op_type = "QMoE"
+            attrs["expert_weight_bits"] = self.moe_attrs["expert_weight_bits"]
+            for fc in ["fc1", "fc2", "fc3"]:
+                qweight, scales = self.make_qmoe_weights(weights[fc])
+                self.make_external_tensor(qweight, f"model.layers.{layer_id}.moe.experts.{fc}.qweight")
+                self.make_external_tensor(scales.astype(self.to_numpy_dtype[self.io_dtype]), f"model.layers.{layer_id}.moe.experts.{fc}.scales")
+                inputs += [f"model.layers.{layer_id}.moe.experts.{fc}.qweight", f"model.layers.{layer_id}.moe.experts.{fc}.scales", ""]
+        elif self.onnx_dtype in {"fp16", "fp32"}:
+            op_type = "MoE"
+            if self.tp_world_size > 1:
+                # Each rank runs its slice, and the op sums the ranks' outputs with an AllReduce
+                op_type = "ShardedMoE"
+                if self.moe_attrs["expert_parallel"]:
+                    attrs["local_experts_start_index"] = self.tp_rank * len(moe.experts)
+                else:
+                    attrs["tensor_shards"] = self.tp_world_size
+            for fc in ["fc1", "fc2", "fc3"]:
+                self.make_external_tensor(weights[fc].numpy().astype(self.to_numpy_dtype[self.io_dtype]), f"model.layers.{layer_id}.moe.experts.{fc}.weight")
+                inputs += [f"model.layers.{layer_id}.moe.experts.{fc}.weight", ""]
+        else:
+            raise NotImplementedError(f"The {self.onnx_dtype} precision is not currently supported in MoE.")
+
+        while inputs[-1] == "":
+            inputs.pop()  # No trailing optional inputs (the biases)
+
+        moe_name = f"{basename}/{op_type}"
+        output = f"{moe_name}/output_0"
+        self.make_node(op_type, inputs=inputs, outputs=[output], name=moe_name, domain="com.microsoft", **attrs)
+        self.make_value_info(output, self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+
+        # Assign output 0 of MoE as skip input to next SkipLayerNorm
+        self.layernorm_attrs["skip_input"] = output
+
+    def make_qmoe_weights(self, weights):
+        # QMoE's CUTLASS kernels take the int4 weights interleaved in their own layout, which TensorRT-LLM's quantizer makes
+        try:
+            import tensorrt_llm  # Registers torch.ops.trtllm
+        except ImportError:
+            raise ImportError("int4 mixture of experts models need TensorRT-LLM installed, to quantize the experts for the QMoE op.")
+        _, qweight, scales = torch.ops.trtllm._symmetric_quantize_last_axis_of_batched_matrix(weights.to(torch.float16).contiguous(), torch.quint4x2)
+        return qweight.view(torch.uint8).numpy(), scales.numpy()
+
     def make_activation_with_mul(self, layer_id, root_input, activation, domain):
         # Make nodes for this activation subgraph
         #
@@ -1503,14 +2217,113 @@ class Model:
             raise NotImplementedError(f"The {self.activation} activation function is not currently supported.")
         return output_name
 
+    def make_last_token_gather(self):
+        # Gather the hidden states of the last unpadded token of each sequence so that the LM head only
+        # computes {batch_size, 1, vocab_size} logits instead of {batch_size, sequence_length, vocab_size}
+        #
+        #        root_input             attention_mask
+        #        /         \                  |
+        #       |        Shape               Slice (last sequence_length columns)
+        #       |          |                   |
+        #       |        Slice --> Sub(0) --> (starts)
+        #       |                              |
+        #       |                             Cast
+        #       |                              |
+        #       |                     ArgMax (select_last_index)
+        #        \                             |
+        #         +-----------> GatherND <-----+
+        #                           |
+        #                       Unsqueeze
+        basename = "/model/last_token"
+        root_input = self.layernorm_attrs["output_0"]
+
+        shape_name = f"{basename}/Shape"
+        self.make_shape(shape_name, root_input, shape=[3])
+        slice_1_name = f"{basename}/Slice_1"
+        slice_1_inputs = [f"{shape_name}/output_0", "/model/constants/TensorProto.INT64/1D/1", "/model/constants/TensorProto.INT64/1D/2", "/model/constants/TensorProto.INT64/1D/0"]
+        self.make_slice(slice_1_name, slice_1_inputs, dtype=TensorProto.INT64, shape=[1])
+        sub_name = f"{basename}/Sub"
+        sub_inputs = ["/model/constants/TensorProto.INT64/1D/0", f"{slice_1_name}/output_0"]
+        self.make_sub(sub_name, sub_inputs, dtype=TensorProto.INT64, shape=[1])
+
+        # The attention mask covers the past tokens too, so only its last sequence_length columns belong to root_input
+        slice_2_name = f"{basename}/Slice_2"
+        slice_2_inputs = ["attention_mask", f"{sub_name}/output_0", f"/model/constants/TensorProto.INT64/1D/{np.iinfo(np.int64).max}", "/model/constants/TensorProto.INT64/1D/1"]
+        self.make_slice(slice_2_name, slice_2_inputs, dtype=self.input_types["attention_mask"], shape=["batch_size", "sequence_length"])
+        cast_name = f"{basename}/Cast"
+        self.make_cast(cast_name, f"{slice_2_name}/output_0", dtype=TensorProto.FLOAT, shape=["batch_size", "sequence_length"])
+
+        argmax_name = f"{basename}/ArgMax"
+        argmax_output = f"{argmax_name}/output_0"
+        self.make_node("ArgMax", inputs=[f"{cast_name}/output_0"], outputs=[argmax_output], name=argmax_name, axis=1, keepdims=1, select_last_index=1)
+        self.make_value_info(argmax_output, TensorProto.INT64, shape=["batch_size", 1])
+
+        gather_name = f"{basename}/GatherND"
+        gather_output = f"{gather_name}/output_0"
+        self.make_node("GatherND", inputs=[root_input, argmax_output], outputs=[gather_output], name=gather_name, batch_dims=1)
+        self.make_value_info(gather_output, self.io_dtype, shape=["batch_size", self.hidden_size])
+        unsqueeze_name = f"{basename}/Unsqueeze"
+        unsqueeze_inputs = [gather_output, "/model/constants/TensorProto.INT64/1D/1"]
+        self.make_unsqueeze(unsqueeze_name, unsqueeze_inputs, dtype=self.io_dtype, shape=["batch_size", 1, self.hidden_size])
+
+        # Update LayerNorm attributes so the LM head reads from the gathered hidden states
+        self.layernorm_attrs["output_0"] = f"{unsqueeze_name}/output_0"
+
+    def load_allowed_token_ids(self, value, config):
+        # A JSON file with a list of token ids, or the ids separated by commas
+        if os.path.isfile(value):
+            with open(value) as f:
+                token_ids = [int(token_id) for token_id in json.load(f)]
+        else:
+            token_ids = [int(token_id) for token_id in value.split(",")]
+
+        # The eos tokens are always allowed, so generation can end
+        eos_token_ids = config.eos_token_id if isinstance(config.eos_token_id, list) else [config.eos_token_id]
+        token_ids += [token_id for token_id in eos_token_ids if token_id is not None]
+        token_ids = list(dict.fromkeys(token_ids))
+        if any(token_id < 0 or token_id >= self.vocab_size for token_id in token_ids):
+            raise ValueError(f"allowed_token_ids must be between 0 and the vocab_size ({self.vocab_size}).")
+        return token_ids
+
+    def make_lm_head_subset(self, lm_head):
+        # The rows of the allowed tokens, in order, so the logits are only of them. GenAI maps each row back to its token
+        if not isinstance(getattr(lm_head, "weight", None), torch.Tensor):
+            raise NotImplementedError("allowed_token_ids is not currently supported with a pre-quantized LM head.")
+        rows = torch.tensor(self.allowed_token_ids)
+        subset = torch.nn.Linear(self.hidden_size, self.lm_head_size, bias=lm_head.bias is not None)
+        subset.weight = torch.nn.Parameter(lm_head.weight.detach()[rows], requires_grad=False)
+        if lm_head.bias is not None:
+            subset.bias = torch.nn.Parameter(lm_head.bias.detach()[rows], requires_grad=False)
+        if self.lm_head_attrs["mask"] is not None:
+            self.lm_head_attrs["mask"] = self.lm_head_attrs["mask"][rows]
+        return subset
+
     def make_lm_head(self, lm_head):
+        if self.allowed_token_ids:
+            lm_head = self.make_lm_head_subset(lm_head)
         bias_exists = lm_head.bias is not None
         scale_exists = self.lm_head_attrs["scale"] != 1
         mask_exists = self.lm_head_attrs["mask"] is not None
 
         matmul_basename = "/lm_head/MatMul"
         root_input = self.layernorm_attrs["output_0"]
-        matmul_name = self.make_matmul(lm_head, matmul_basename, root_input, logits=not bias_exists and not scale_exists)
+        if self.quant_attrs["int4"]["tied_lm_head"] is not None:
+            # The weights tied to the embedding table are already quantized, and saved once for both as its rows
+            qweight, scales = self.quant_attrs["int4"]["tied_lm_head"]
+            block_size = self.quant_attrs["int4"]["block_size"]
+            k_blocks = self.hidden_size // block_size
+            qweight_reshape_name = f"{matmul_basename}/qweight/Reshape"
+            qweight_reshape_inputs = [qweight, f"/model/constants/TensorProto.INT64/1D/{self.vocab_size}, {k_blocks}, {block_size // 2}"]
+            self.make_reshape(qweight_reshape_name, qweight_reshape_inputs, dtype=TensorProto.UINT8, shape=[self.vocab_size, k_blocks, block_size // 2])
+            scales_reshape_name = f"{matmul_basename}/scales/Reshape"
+            scales_reshape_inputs = [scales, f"/model/constants/TensorProto.INT64/1D/{self.vocab_size * k_blocks}"]
+            self.make_reshape(scales_reshape_name, scales_reshape_inputs, dtype=self.io_dtype, shape=[self.vocab_size * k_blocks])
+            matmul_name = self.make_matmul_nbits(
+                f"{matmul_basename}NBits", root_input, f"{qweight_reshape_name}/output_0", f"{scales_reshape_name}/output_0",
+                K=self.hidden_size, N=self.vocab_size, block_size=block_size, logits=not bias_exists and not scale_exists,
+            )
+        else:
+            matmul_name = self.make_matmul(lm_head, matmul_basename, root_input, logits=not bias_exists and not scale_exists)
 
         if bias_exists:
             add_name = "/lm_head/Add"
@@ -1521,7 +2334,7 @@ class Model:
             mul_inputs = [f"{matmul_name if not bias_exists else add_name}/output_0", f"/model/constants/{self.to_str_dtype[self.io_dtype]}/0D/{self.lm_head_attrs['scale']}"]
             mul_output = "logits" if not mask_exists else f"{mul_name}/output_0"
             self.make_node('Mul', inputs=mul_inputs, outputs=[mul_output], name=mul_name)
-            self.make_value_info(mul_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.vocab_size])
+            self.make_value_info(mul_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.lm_head_size])
 
         if mask_exists:
             # Save logits mask as initializer
@@ -1532,7 +2345,59 @@ class Model:
             where_inputs = [logits_mask_name, f"/model/constants/{self.to_str_dtype[self.io_dtype]}/0D/{np.finfo(self.to_numpy_dtype[self.io_dtype]).min}", f"{mul_name}/output_0"]
             where_output = "logits"
             self.make_node('Where', inputs=where_inputs, outputs=[where_output], name=where_name)
-            self.make_value_info(where_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.vocab_size])
+            self.make_value_info(where_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.lm_head_size])
+
+    def load_draft_heads(self, path):
+        # A Medusa checkpoint of heads like {"<i>.0.linear.weight", "<i>.0.linear.bias", "<i>.1.weight"}, saved with torch or safetensors
+        if path.endswith(".safetensors"):
+            from safetensors.torch import load_file
+            state_dict = load_file(path)
+        else:
+            state_dict = torch.load(path, map_location="cpu")
+
+        draft_heads = []
+        while f"{len(draft_heads)}.1.weight" in state_dict:
+            i = len(draft_heads)
+            res_block = torch.nn.Linear(self.hidden_size, self.hidden_size)
+            res_block.weight = torch.nn.Parameter(state_dict[f"{i}.0.linear.weight"].float())
+            res_block.bias = torch.nn.Parameter(state_dict[f"{i}.0.linear.bias"].float())
+            lm_head = torch.nn.Linear(self.hidden_size, self.vocab_size, bias=False)
+            lm_head.weight = torch.nn.Parameter(state_dict[f"{i}.1.weight"].float())
+            draft_heads.append((res_block, lm_head))
+        if not draft_heads:
+            raise ValueError(f"No draft heads found in {path}, expected weights named like '0.0.linear.weight' and '0.1.weight'.")
+        return draft_heads
+
+    def make_draft_head(self, head_id, draft_head):
+        # Make nodes for the draft head subgraph
+        #
+        #   root_input (same as the LM head's)
+        #       |    \
+        #       |   MatMul --> Add (bias) --> Sigmoid --> Mul (SiLU)
+        #       |                                          |
+        #       +----------------> Add <-------------------+
+        #                           |
+        #                         MatMul
+        #                           |
+        #                   draft_logits.<head_id>
+        res_block, lm_head = draft_head
+        basename = f"/draft_heads.{head_id}"
+        root_input = self.layernorm_attrs["output_0"]
+        shape = ["batch_size", "sequence_length", self.hidden_size]
+
+        matmul_name = self.make_matmul(res_block, f"{basename}/0/linear/MatMul", root_input)
+        add_bias_name = f"{basename}/0/linear/Add"
+        self.make_add_bias(res_block.bias.detach().numpy(), add_bias_name, root_input=f"{matmul_name}/output_0")
+        sigmoid_name = f"{basename}/0/act/Sigmoid"
+        self.make_node("Sigmoid", inputs=[f"{add_bias_name}/output_0"], outputs=[f"{sigmoid_name}/output_0"], name=sigmoid_name)
+        self.make_value_info(f"{sigmoid_name}/output_0", self.io_dtype, shape=shape)
+        mul_name = f"{basename}/0/act/Mul"
+        self.make_mul(mul_name, [f"{add_bias_name}/output_0", f"{sigmoid_name}/output_0"], dtype=self.io_dtype, shape=shape)
+        residual_name = f"{basename}/0/Add"
+        self.make_add(residual_name, [root_input, f"{mul_name}/output_0"], dtype=self.io_dtype, shape=shape)
+
+        lm_head_name = self.make_matmul(lm_head, f"{basename}/1/MatMul", f"{residual_name}/output_0")
+        self.make_node("Identity", inputs=[f"{lm_head_name}/output_0"], outputs=[f"draft_logits.{head_id}"], name=f"{basename}/Identity")
 
     def make_layer(self, layer_id, layer):
         # Each LLM decoder layer is typically defined as:
@@ -1540,7 +2405,7 @@ class Model:
         self.make_layernorm(layer_id, layer.input_layernorm, skip=not self.layernorm_attrs["first_layernorm"], simple=self.layernorm_attrs["simple"], location="input")
         self.make_attention(layer_id, layer.self_attn, root_input=self.layernorm_attrs["output_0"])
         self.make_layernorm(layer_id, layer.post_attention_layernorm, skip=True, simple=self.layernorm_attrs["simple"], location="post_attention")
-        self.make_mlp(layer_id, layer.mlp, root_input=self.layernorm_attrs["output_0"])
+        self.make_mlp(layer_id, layer.block_sparse_moe if self.mlp_attrs["use_moe"] else layer.mlp, root_input=self.layernorm_attrs["output_0"])
 
         self.layernorm_attrs["first_layernorm"] = False
         if layer_id == self.num_layers - 1:
@@ -1563,6 +2428,10 @@ class Model:
                 from onnxruntime_genai.models.gguf_model import GGUFModel
             model = GGUFModel.from_pretrained(self.model_type, input_path, self.head_size, self.hidden_size, self.intermediate_size, self.num_attn_heads, self.num_kv_heads, self.vocab_size)
             self.layernorm_attrs["add_offset"] = 0  # add offset already done for GGUF models
+            if self.gguf_external_data:
+                # Separate Q/K/V MatMuls, as packing them would copy the weights out of the GGUF file
+                self.gguf_model = model
+                self.attention_attrs["use_packed_matmul"] = False
         elif self.quant_type is not None:
             # Load quantized PyTorch model
             try:
@@ -1572,9 +2441,12 @@ class Model:
             q_size = self.num_attn_heads * self.head_size
             kv_size = self.num_kv_heads * self.head_size
             model = QuantModel.from_pretrained(self.quant_type, input_path, self.quant_attrs["bits"], self.quant_attrs["group_size"], self.quant_attrs["use_g_idx"], q_size, kv_size, self.intermediate_size)
+        elif self.stream_weights:
+            # Make the PyTorch model without its weights, they're read from the checkpoint module by module
+            model = self.make_empty_model()
         else:
             # Load PyTorch model
-            extra_kwargs = {} if os.path.exists(self.model_name_or_path) else {"num_hidden_layers": self.num_layers} if "num_hidden_layers" in self.extra_options else {"cache_dir": self.cache_dir}
+            extra_kwargs = {} if os.path.exists(self.model_name_or_path) else {"num_hidden_layers": self.total_num_layers} if "num_hidden_layers" in self.extra_options else {"cache_dir": self.cache_dir}
             model = AutoModelForCausalLM.from_pretrained(self.model_name_or_path, use_auth_token=True, trust_remote_code=True, **extra_kwargs)
 
         # Loop through model and map each module to ONNX/ORT ops
@@ -1585,32 +2457,124 @@ class Model:
                 if not self.exclude_embeds:
                     # Embedding layer
                     print("Reading embedding layer")
+                    self.load_module_weights(module)
                     self.make_embedding(module.weight.detach().numpy())
+                    self.free_module_weights(module)
                 else:
                     # Exclude embedding layer from model
                     self.layernorm_attrs["root_input"] = "inputs_embeds"
                     self.layernorm_attrs["skip_input"] = "inputs_embeds"
 
-            elif module.__class__.__name__.endswith("DecoderLayer") and self.layer_id < self.num_layers:
+            elif module.__class__.__name__.endswith("DecoderLayer") and self.layer_id < self.pp_layer_offset + self.num_layers:
+                if self.layer_id < self.pp_layer_offset:
+                    # Layer of an earlier pipeline stage
+                    self.layer_id += 1
+                    continue
+
                 # Each decoder layer of model
                 print(f"Reading decoder layer {self.layer_id}")
-                self.make_layer(self.layer_id, module)
+                self.load_module_weights(module)
+                if self.tp_world_size > 1:
+                    self.make_tensor_parallel_shard(module)
+                self.make_layer(self.layer_id - self.pp_layer_offset, module)
+                self.free_module_weights(module)
                 self.layer_id += 1
+                if self.pp_stage < self.pp_stages - 1 and self.layer_id == self.pp_layer_offset + self.num_layers:
+                    self.make_pipeline_output()
 
-            elif self.layer_id == self.num_layers and self.has_final_norm(module, model):
+            elif self.layer_id == self.total_num_layers and self.has_final_norm(module, model):
                 # SkipLayerNorm after last decoder layer (MatMul --> SkipLayerNorm)
                 print("Reading final norm")
+                self.load_module_weights(module)
                 self.make_layernorm(self.layer_id, module, skip=True, simple=self.layernorm_attrs["simple"], location="final_norm")
+                self.free_module_weights(module)
 
             elif (isinstance(module, torch.nn.Linear) and module.out_features == self.vocab_size) or (hasattr(model, "lm_head") and module == model.lm_head):
                 # Checks (Hugging Face logic) or (GGUF logic)
                 if not self.exclude_lm_head:
                     # Language modeling head (SkipLayerNorm --> logits)
                     print("Reading LM head")
+                    if self.last_token_logits:
+                        self.make_last_token_gather()
+                    self.load_module_weights(module)
                     self.make_lm_head(module)
+                    self.free_module_weights(module)
+                    for i, draft_head in enumerate(self.draft_heads):
+                        print(f"Reading draft head {i}")
+                        self.make_draft_head(i, draft_head)
 
         del model
 
+    def make_empty_model(self):
+        from safetensors import safe_open
+
+        config = AutoConfig.from_pretrained(self.model_name_or_path, use_auth_token=True, trust_remote_code=True)
+        if "num_hidden_layers" in self.extra_options:
+            config.num_hidden_layers = self.total_num_layers
+
+        path = self.model_name_or_path
+        if not os.path.isdir(path):
+            from huggingface_hub import snapshot_download
+            path = snapshot_download(path, allow_patterns=["*.safetensors", "*.json"], cache_dir=self.cache_dir)
+        index_path = os.path.join(path, "model.safetensors.index.json")
+        if os.path.exists(index_path):
+            with open(index_path) as f:
+                weight_map = json.load(f)["weight_map"]
+        elif os.path.exists(os.path.join(path, "model.safetensors")):
+            with safe_open(os.path.join(path, "model.safetensors"), framework="pt") as f:
+                weight_map = {key: "model.safetensors" for key in f.keys()}
+        else:
+            raise ValueError(f"stream_weights needs a checkpoint saved as safetensors, which {path} doesn't have.")
+        self.weight_files = {key: os.path.join(path, file) for key, file in weight_map.items()}
+
+        with torch.device("meta"):
+            model = AutoModelForCausalLM.from_config(config, trust_remote_code=True)
+        self.module_names = {module: name for name, module in model.named_modules()}
+
+        # A tied LM head reads the embedding weights, which checkpoints only save once
+        self.tied_weights = {}
+        if getattr(config, "tie_word_embeddings", False) and model.get_output_embeddings() is not None:
+            self.tied_weights[f"{self.module_names[model.get_output_embeddings()]}.weight"] = f"{self.module_names[model.get_input_embeddings()]}.weight"
+        return model
+
+    def load_module_weights(self, module):
+        # Replaces the meta tensors of the module with its weights from the checkpoint, as fp32 like from_pretrained loads them
+        if not self.stream_weights:
+            return
+        from safetensors import safe_open
+
+        prefix = self.module_names[module]
+        tensors_by_file = {}
+        for name, tensor in list(module.named_parameters()) + list(module.named_buffers()):
+            key = f"{prefix}.{name}" if prefix else name
+            key = self.tied_weights.get(key, key) if key not in self.weight_files else key
+            if key not in self.weight_files:
+                if isinstance(tensor, torch.nn.Parameter):
+                    raise ValueError(f"The checkpoint has no weight {key}.")
+                continue  # Buffers that aren't saved, like rotary embedding frequencies, are computed by the builder
+            tensors_by_file.setdefault(self.weight_files[key], []).append((name, key))
+
+        for file, names in tensors_by_file.items():
+            with safe_open(file, framework="pt") as f:
+                for name, key in names:
+                    value = f.get_tensor(key)
+                    if value.is_floating_point():
+                        value = value.float()
+                    parent_name, _, leaf = name.rpartition(".")
+                    parent = module.get_submodule(parent_name) if parent_name else module
+                    setattr(parent, leaf, torch.nn.Parameter(value, requires_grad=False) if leaf in parent._parameters else value)
+
+    def free_module_weights(self, module):
+        if self.stream_weights:
+            module.to("meta")
+            gc.collect()
+
+    def make_pipeline_output(self):
+        # The stages before the last pass on the residual stream after their last layer, the sum the next SkipLayerNorm would take
+        name = f"/model/pipeline_stage_{self.pp_stage}/Add"
+        self.make_add(name, [self.layernorm_attrs["root_input"], self.layernorm_attrs["skip_input"]], dtype=self.io_dtype, shape=['batch_size', 'sequence_length', self.hidden_size])
+        self.make_node("Identity", inputs=[f"{name}/output_0"], outputs=["hidden_states"], name=f"/model/pipeline_stage_{self.pp_stage}/Identity")
+
     def has_final_norm(self, module, model):
         # Hugging Face names
         hf_norm = hasattr(model, "model") and hasattr(model.model, "norm") and module == model.model.norm
@@ -2074,6 +3038,12 @@ class MistralModel(Model):
         super().make_attention(layer_id, attention, root_input, position_ids=self.position_ids_name, **kwargs)
 
 
+class MixtralModel(MistralModel):
+    def __init__(self, config, io_dtype, onnx_dtype, ep, cache_dir, extra_options):
+        super().__init__(config, io_dtype, onnx_dtype, ep, cache_dir, extra_options)
+        self.mlp_attrs["use_proj"], self.mlp_attrs["use_moe"] = False, True
+
+
 class PhiModel(Model):
     def __init__(self, config, io_dtype, onnx_dtype, ep, cache_dir, extra_options):
         super().__init__(config, io_dtype, onnx_dtype, ep, cache_dir, extra_options)
@@ -2156,6 +3126,8 @@ class Gemma2Model(GemmaModel):
         self.window_size = original_window_size
 
     def make_lm_head(self, lm_head):
+        if self.allowed_token_ids:
+            lm_head = self.make_lm_head_subset(lm_head)
         matmul_basename = "/lm_head/MatMul"
         root_input = self.layernorm_attrs["output_0"]
         matmul_name = self.make_matmul(lm_head, matmul_basename, root_input, logits=False)
@@ -2163,16 +3135,16 @@ class Gemma2Model(GemmaModel):
         # Add final logit softcapping (Div --> Tanh --> Mul)
         div_name = "/lm_head/Div"
         div_inputs = [f"{matmul_name}/output_0", f"/model/constants/{self.to_str_dtype[self.io_dtype]}/0D/{self.lm_head_attrs['scale']}"]
-        self.make_div(div_name, div_inputs, dtype=self.io_dtype, shape=["batch_size", "sequence_length", self.vocab_size])
+        self.make_div(div_name, div_inputs, dtype=self.io_dtype, shape=["batch_size", "sequence_length", self.lm_head_size])
 
         tanh_name = "/lm_head/Tanh"
-        self.make_tanh(tanh_name, f"{div_name}/output_0", dtype=self.io_dtype, shape=["batch_size", "sequence_length", self.vocab_size])
+        self.make_tanh(tanh_name, f"{div_name}/output_0", dtype=self.io_dtype, shape=["batch_size", "sequence_length", self.lm_head_size])
 
         mul_name = "/lm_head/Mul"
         mul_inputs = [f"{tanh_name}/output_0", f"/model/constants/{self.to_str_dtype[self.io_dtype]}/0D/{self.lm_head_attrs['scale']}"]
         mul_output = "logits"
         self.make_node('Mul', inputs=mul_inputs, outputs=[mul_output], name=mul_name)
-        self.make_value_info(mul_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.vocab_size])
+        self.make_value_info(mul_output, self.io_dtype, shape=['batch_size', 'sequence_length', self.lm_head_size])
 
 
 class Phi3Mini4KModel(MistralModel):
@@ -2444,6 +3416,8 @@ def create_model(model_name, input_path, output_dir, precision, execution_provid
             onnx_model = LlamaModel(config, io_dtype, precision, execution_provider, cache_dir, extra_options)
         elif config.architectures[0] == "MistralForCausalLM":
             onnx_model = MistralModel(config, io_dtype, precision, execution_provider, cache_dir, extra_options)
+        elif config.architectures[0] == "MixtralForCausalLM":
+            onnx_model = MixtralModel(config, io_dtype, precision, execution_provider, cache_dir, extra_options)
         elif config.architectures[0] == "PhiForCausalLM":
             onnx_model = PhiModel(config, io_dtype, precision, execution_provider, cache_dir, extra_options)
         elif config.architectures[0] == "Phi3ForCausalLM" and config.max_position_embeddings == 4096:
@@ -2470,6 +3444,18 @@ def create_model(model_name, input_path, output_dir, precision, execution_provid
 
         # Save ONNX model
         onnx_model.save_model(output_dir)
+
+        # Make the shards of the other ranks (the config is the same for all of them)
+        for tp_rank in range(1, onnx_model.tp_world_size):
+            rank_model = type(onnx_model)(config, io_dtype, precision, execution_provider, cache_dir, {**extra_options, "tp_rank": tp_rank})
+            rank_model.make_model(input_path)
+            rank_model.save_model(output_dir)
+
+        # Make the other pipeline stages (the config lists all of them)
+        for pp_stage in range(1, onnx_model.pp_stages):
+            stage_model = type(onnx_model)(config, io_dtype, precision, execution_provider, cache_dir, {**extra_options, "pp_stage": pp_stage})
+            stage_model.make_model(input_path)
+            stage_model.save_model(output_dir)
     else:
         onnx_model = Model(config, io_dtype, precision, execution_provider, cache_dir, extra_options)
 
@@ -2514,8 +3500,8 @@ def get_args():
         "-p",
         "--precision",
         required=True,
-        choices=["int4", "fp16", "fp32"],
-        help="Precision of model",
+        choices=["int4", "int8", "fp16", "fp32"],
+        help="Precision of model. int8 (CPU only) quantizes the MatMul weights per channel and the activations at runtime.",
     )
 
     parser.add_argument(
@@ -2543,11 +3529,13 @@ def get_args():
         help=textwrap.dedent("""\
             Key value pairs for various options. Currently supports:
                 int4_block_size = 16/32/64/128/256: Specify the block_size for int4 quantization.
-                int4_accuracy_level = 1/2/3/4: Specify the minimum accuracy level for activation of MatMul in int4 quantization.
+                int4_accuracy_level = 1/2/3/4: Specify the minimum accuracy level for activation of MatMul in int4 quantization. On CPU, 4 runs the MatMuls on the int8 dot product instructions.
                     4 is int8, which means input A of int4 quantized MatMul is quantized to int8 and input B is upcasted to int8 for computation.
                     3 is bf16.
                     2 is fp16.
                     1 is fp32.
+                int4_embeddings = 1 : With INT4 precision, quantize the embedding table too and read it with GatherBlockQuantized (needs ONNX Runtime 1.20 or later).
+                    If the model ties its word embeddings, the LM head's MatMulNBits uses the same int4 weights, so the table is saved once.
                 num_hidden_layers = Manually specify the number of layers in your ONNX model (for unit testing purposes).
                 filename = Filename for ONNX model (default is 'model.onnx').
                     For models with multiple components, each component is exported to its own ONNX model.
@@ -2560,6 +3548,43 @@ def get_args():
                 exclude_lm_head = Remove language modeling head from your ONNX model.
                     Use this option when you want to remove the language modeling head from within your ONNX model.
                     Instead of `logits`, you will have `hidden_states` as the output to your ONNX model.
+                kv_cache_dtype = int8 : Store the KV caches quantized to int8 with a scale per head.
+                    The attention op consumes the dequantized past KV caches, and the presents are quantized after it.
+                    This halves the KV cache memory kept between runs compared to FP16, but disables past_present_share_buffer.
+                last_token_logits = 1 : Only compute the logits of the last token of each sequence.
+                    Use this option to avoid the {batch_size, sequence_length, vocab_size} logits of long prompts.
+                    Instead of all positions, `logits` will have shape {batch_size, 1, vocab_size}.
+                allowed_token_ids = The only tokens the model can generate, as a path to a JSON list of token ids or the ids separated by commas.
+                    The LM head only computes the logits of these (and the eos tokens), for workloads like classification that only emit a few tokens.
+                    `logits` will have shape {batch_size, sequence_length, <token count>}, which GenAI maps back to the token ids.
+                draft_heads = Path to Medusa style draft heads ('medusa_lm_head.pt' or '.safetensors') to add to the model.
+                    Each head adds a `draft_logits.<i>` output shaped like `logits`, guessing the token i + 2 places after each one,
+                    which GenAI's speculative generator proposes and verifies without a separate draft model.
+                lora_max_adapters = Serve up to this many LoRA adapters at once, selected per sequence at runtime (default is 0, without adapters).
+                    Every adapted projection takes its stacked A and B weights as `lora.*.A` and `lora.*.B` inputs, which GenAI
+                    fills as adapters are loaded, plus the `lora_adapter_ids` input with the adapter slot of each sequence.
+                lora_max_rank = The highest LoRA rank an adapter can have (default is 16). Adapters of a lower rank are zero padded.
+                lora_targets = The comma separated projections to adapt (default is 'q_proj,k_proj,v_proj,o_proj').
+                tp_world_size = Shard the model over this many GPUs with tensor parallelism (default is 1, unsharded). Requires the CUDA execution provider.
+                    Each rank's shard is saved as '<filename>_rank_<rank>.onnx', with AllReduce ops that need ONNX Runtime built with NCCL (--use_mpi).
+                    Run it with a process per rank, like `mpirun -n <tp_world_size> python generate.py`. GenAI reads each process's rank from MPI.
+                expert_parallel = 1 : With tp_world_size, split the experts of a mixture of experts model over the ranks, each rank keeping whole experts,
+                    instead of splitting every expert's MLP. Fewer, larger GEMMs per rank, but the ranks' loads depend on the routing.
+                pp_stages = Split the layers into this many pipeline stages, each run on its own device (default is 1, unsplit).
+                    Each stage is saved as '<filename>_stage_<stage>.onnx'. The stages before the last output their hidden states,
+                    which the next stage takes as its inputs_embeds.
+                pp_device_ids = The comma separated device of each stage (default is '0,1,...').
+                pp_micro_batches = Split each batch into this many micro batches at runtime, so the stages can run at once (default is pp_stages).
+                pp_offload_weights = 1 : With pp_stages, run a model larger than the device's memory. Each stage's decoder layer weights are graph inputs,
+                    saved as '<filename>_stage_<stage>.safetensors'. GenAI keeps them in pinned host memory and copies each stage's weights onto the device
+                    while the stage before it runs. All stages are on one device (pp_device_ids defaults to '0,0,...').
+                stream_weights = 1 : Export a safetensors checkpoint one module at a time, to keep the peak memory near a single decoder layer.
+                    Each module's weights are read just before its ONNX ops are made, written to the model's data file right away, and freed.
+                    With INT4 precision the MatMuls are quantized as they're made instead of at the end, in int4_workers processes.
+                int4_workers = The processes quantizing each MatMul with stream_weights and INT4 precision (default is the CPU count).
+                gguf_external_data = 1 : Read the weights of a GGUF model in place, with FP16 or FP32 precision. The F16/F32 tensors already in the
+                    precision are referenced at their offsets in the GGUF file, which is linked next to the ONNX model, and memory mapped by ONNX Runtime
+                    instead of being copied into its data file. The MatMul weights stay N x K and are run by FusedMatMul with transB.
                 enable_cuda_graph = 1 : The model can use CUDA graph capture for CUDA execution provider. If enabled, all nodes being placed on the CUDA EP
                     is the prerequisite for the CUDA graph to be used correctly. It is not guaranteed that cuda graph be enabled as it depends on the model
                     and the graph structure.
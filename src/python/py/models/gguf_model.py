@@ -75,6 +75,10 @@ class GGUFModel:
         # Load GGUF model and read its info
         reader = GGUFReader(input_path)
 
+        # The memory map of the whole file, which the tensors below are views into where they aren't converted
+        self.path = input_path
+        self.data = reader.data
+
         self.embedding = GGUFTensorModule()
         self.final_norm = GGUFTensorModule()
         self.lm_head = GGUFTensorModule()
@@ -4,9 +4,11 @@
 #include <pybind11/stl.h>
 #include <pybind11/numpy.h>
 #include <iostream>
+#include <mutex>
 #include "../generators.h"
 #include "../json.h"
 #include "../search.h"
+#include "../scheduler.h"
 #include "../models/model.h"
 #include "../logging.h"
 
@@ -207,6 +209,154 @@ pybind11::array ToNumpy(OrtValue* v, const Generators::Model& model) {
 
   return pybind11::array{bufinfo};
 }
+// The DLPack ABI (https://github.com/dmlc/dlpack, version 0.8), only what's needed to hand tensors out through __dlpack__
+namespace DLPack {
+constexpr int32_t kDLCPU = 1;
+constexpr int32_t kDLCUDA = 2;
+constexpr uint8_t kDLInt = 0, kDLUInt = 1, kDLFloat = 2, kDLBool = 6;
+
+struct Device {
+  int32_t device_type;
+  int32_t device_id;
+};
+
+struct DataType {
+  uint8_t code;
+  uint8_t bits;
+  uint16_t lanes;
+};
+
+struct Tensor {
+  void* data;
+  Device device;
+  int32_t ndim;
+  DataType dtype;
+  int64_t* shape;
+  int64_t* strides;
+  uint64_t byte_offset;
+};
+
+struct ManagedTensor {
+  Tensor dl_tensor;
+  void* manager_ctx;
+  void (*deleter)(ManagedTensor* self);
+};
+
+DataType ToDataType(ONNXTensorElementDataType type) {
+  const auto bits = static_cast<uint8_t>(Generators::SizeOf(type) * 8);
+  switch (type) {
+    case Ort::TypeToTensorType<bool>::type:
+      return {kDLBool, bits, 1};
+    case Ort::TypeToTensorType<int8_t>::type:
+    case Ort::TypeToTensorType<int16_t>::type:
+    case Ort::TypeToTensorType<int32_t>::type:
+    case Ort::TypeToTensorType<int64_t>::type:
+      return {kDLInt, bits, 1};
+    case Ort::TypeToTensorType<uint8_t>::type:
+    case Ort::TypeToTensorType<uint16_t>::type:
+    case Ort::TypeToTensorType<uint32_t>::type:
+    case Ort::TypeToTensorType<uint64_t>::type:
+      return {kDLUInt, bits, 1};
+    case Ort::TypeToTensorType<Ort::Float16_t>::type:
+    case Ort::TypeToTensorType<float>::type:
+    case Ort::TypeToTensorType<double>::type:
+      return {kDLFloat, bits, 1};
+    default:
+      throw std::runtime_error("Unsupported onnx type");
+  }
+}
+}  // namespace DLPack
+
+// A view of a tensor the generator's State holds, where it is (CPU or CUDA memory), so numpy, CuPy, PyTorch and others
+// can use it without a copy through __array_interface__, __cuda_array_interface__ or __dlpack__. Like the arrays from
+// DeviceArray.get_array() it's only valid until the generator's next step, as the State replaces its outputs
+struct PyTensorView {
+  PyTensorView(OrtValue& value, const Generators::Model& model) : data_{value.GetTensorMutableRawData()}, cuda_stream_{model.cuda_stream_.get()} {
+    auto type_info = value.GetTensorTypeAndShapeInfo();
+    shape_ = type_info->GetShape();
+    type_ = type_info->GetElementType();
+
+    auto& memory_info = value.GetTensorMemoryInfo();
+    if (memory_info.GetDeviceType() == OrtMemoryInfoDeviceType_GPU) {
+      if (model.device_type_ != Generators::DeviceType::CUDA)
+        throw std::runtime_error("Only CPU and CUDA tensors can be viewed, the model is on " + Generators::to_string(model.device_type_));
+      on_cuda_ = true;
+      device_id_ = memory_info.GetDeviceId();
+    }
+  }
+
+  pybind11::tuple GetShape() const { return pybind11::cast(shape_); }
+  pybind11::dtype GetDtype() const { return pybind11::dtype(ToNumpyType(type_)); }
+  std::string GetDevice() const { return on_cuda_ ? "cuda:" + std::to_string(device_id_) : "cpu"; }
+
+  pybind11::dict GetArrayInterface(bool cuda) const {
+    if (cuda != on_cuda_)
+      throw pybind11::attribute_error(cuda ? "__cuda_array_interface__ is only available for CUDA tensors" : "__array_interface__ is only available for CPU tensors");
+
+    pybind11::dict interface;
+    interface["shape"] = GetShape();
+    interface["typestr"] = GetDtype().attr("str");
+    interface["data"] = pybind11::make_tuple(reinterpret_cast<uintptr_t>(data_), false);
+    interface["version"] = 3;
+    if (cuda)  // The consumer synchronizes with the stream the model writes its outputs on, 1 is the legacy default stream
+      interface["stream"] = cuda_stream_ ? reinterpret_cast<uintptr_t>(cuda_stream_) : uintptr_t{1};
+    return interface;
+  }
+
+  pybind11::tuple GetDLPackDevice() const {
+    return pybind11::make_tuple(on_cuda_ ? DLPack::kDLCUDA : DLPack::kDLCPU, device_id_);
+  }
+
+  // The stream argument is the consumer's, rather than making it wait on the model's stream this waits for the model's
+  pybind11::capsule GetDLPack(pybind11::object self, [[maybe_unused]] pybind11::object stream) const {
+#if USE_CUDA
+    if (on_cuda_ && cuda_stream_)
+      Generators::CudaCheck() == cudaStreamSynchronize(cuda_stream_);
+#endif
+
+    // The capsule's tensor holds a reference to the view, so the generator it refers to stays alive with it
+    struct Context {
+      std::vector<int64_t> shape;
+      pybind11::object owner;
+    };
+    auto context = std::make_unique<Context>(Context{shape_, std::move(self)});
+    auto managed = std::make_unique<DLPack::ManagedTensor>();
+    managed->dl_tensor.data = data_;
+    managed->dl_tensor.device = {on_cuda_ ? DLPack::kDLCUDA : DLPack::kDLCPU, device_id_};
+    managed->dl_tensor.ndim = static_cast<int32_t>(shape_.size());
+    managed->dl_tensor.dtype = DLPack::ToDataType(type_);
+    managed->dl_tensor.shape = context->shape.data();
+    managed->dl_tensor.strides = nullptr;  // Compact and row major
+    managed->dl_tensor.byte_offset = 0;
+    managed->manager_ctx = context.release();
+    managed->deleter = [](DLPack::ManagedTensor* self) {
+      pybind11::gil_scoped_acquire gil;
+      delete static_cast<Context*>(self->manager_ctx);
+      delete self;
+    };
+
+    // Consumers rename the capsule to 'used_dltensor' and call the deleter themselves, otherwise it's deleted here
+    auto* capsule = PyCapsule_New(managed.get(), "dltensor", [](PyObject* capsule) {
+      if (PyCapsule_IsValid(capsule, "dltensor")) {
+        auto* managed = static_cast<DLPack::ManagedTensor*>(PyCapsule_GetPointer(capsule, "dltensor"));
+        managed->deleter(managed);
+      }
+    });
+    if (!capsule)
+      throw pybind11::error_already_set();
+    managed.release();
+    return pybind11::reinterpret_steal<pybind11::capsule>(capsule);
+  }
+
+ private:
+  void* data_;
+  std::vector<int64_t> shape_;
+  ONNXTensorElementDataType type_;
+  bool on_cuda_{};
+  int device_id_{};
+  cudaStream_t cuda_stream_;
+};
+
 namespace Generators {
 
 // A roaming array is one that can be in CPU or GPU memory, and will copy the memory as needed to be used from anywhere
@@ -260,21 +410,58 @@ struct PyGeneratorParams {
     }
   }
 
+  // The clips are copied into one padded batch, so they don't need to be kept alive
+  void SetWhisperInputFeaturesBatch(std::vector<pybind11::array_t<float, pybind11::array::c_style | pybind11::array::forcecast>> clips) {
+    std::vector<Tensor> tensors;
+    tensors.reserve(clips.size());
+    for (auto& clip : clips)
+      tensors.emplace_back(ToOrtValue(clip));
+
+    std::vector<const Tensor*> clip_pointers;
+    for (auto& tensor : tensors)
+      clip_pointers.push_back(&tensor);
+    params_->SetWhisperInputFeatures(clip_pointers);
+    py_whisper_input_features_ = {};
+  }
+
+  // Mono float32 pcm clips, their input features are computed natively without the GIL
+  void SetWhisperAudio(std::vector<pybind11::array_t<float, pybind11::array::c_style | pybind11::array::forcecast>> clips, int sample_rate, int mel_count, bool pad_to_30_seconds) {
+    std::vector<std::span<const float>> clip_spans;
+    for (auto& clip : clips) {
+      if (clip.ndim() != 1)
+        throw std::runtime_error("Audio clips must be 1 dimensional arrays of mono samples");
+      clip_spans.emplace_back(clip.data(), static_cast<size_t>(clip.size()));
+    }
+    {
+      pybind11::gil_scoped_release release;
+      params_->SetWhisperAudio(clip_spans, sample_rate, mel_count, pad_to_30_seconds);
+    }
+    py_whisper_input_features_ = {};
+  }
+
   void SetModelInput(const std::string& name, pybind11::array& value) {
     params_->extra_inputs.push_back({name, std::make_shared<Tensor>(ToOrtValue(value))});
     refs_.emplace_back(value);
   }
 
   void SetSearchOptions(const pybind11::kwargs& dict) {
+    SetSearchOptionsOf(params_->search, dict);
+  }
+
+  void SetRowSearchOptions(size_t row, const pybind11::kwargs& dict) {
+    SetSearchOptionsOf(params_->GetMutableRowSearch(row), dict);
+  }
+
+  static void SetSearchOptionsOf(Config::Search& search, const pybind11::kwargs& dict) {
     for (auto& entry : dict) {
       auto name = entry.first.cast<std::string>();
       try {
         if (pybind11::isinstance<pybind11::float_>(entry.second)) {
-          SetSearchNumber(params_->search, name, entry.second.cast<double>());
+          SetSearchNumber(search, name, entry.second.cast<double>());
         } else if (pybind11::isinstance<pybind11::bool_>(entry.second)) {
-          SetSearchBool(params_->search, name, entry.second.cast<bool>());
+          SetSearchBool(search, name, entry.second.cast<bool>());
         } else if (pybind11::isinstance<pybind11::int_>(entry.second)) {
-          SetSearchNumber(params_->search, name, entry.second.cast<int>());
+          SetSearchNumber(search, name, entry.second.cast<int>());
         } else
           throw std::runtime_error("Unknown search option type, can be float/bool/int:" + name);
       } catch (JSON::unknown_value_error&) {
@@ -305,46 +492,260 @@ struct PyNamedTensors {
   std::unique_ptr<NamedTensors> named_tensors_;
 };
 
+// The asyncio future of a GenerateNextTokenAsync() step, resolved from the thread that ran the step. It holds the python
+// generator, so it isn't destroyed before its step completes
+struct PyAsyncStep {
+  pybind11::object generator, loop, future;
+
+  // With the GIL. The future is resolved on its loop's thread, unless it was cancelled meanwhile
+  void Resolve(std::exception_ptr error, pybind11::object result) {
+    pybind11::object exception = pybind11::none();
+    if (error) {
+      try {
+        std::rethrow_exception(error);
+      } catch (const std::exception& e) {
+        exception = pybind11::module_::import("builtins").attr("RuntimeError")(e.what());
+      } catch (...) {
+        exception = pybind11::module_::import("builtins").attr("RuntimeError")("Unknown error in generate_next_token_async");
+      }
+    }
+
+    try {
+      loop.attr("call_soon_threadsafe")(pybind11::cpp_function([future = future, result, exception]() {
+        if (future.attr("done")().cast<bool>())
+          return;
+        if (exception.is_none())
+          future.attr("set_result")(result);
+        else
+          future.attr("set_exception")(exception);
+      }));
+    } catch (pybind11::error_already_set&) {
+      // The loop was closed, so nothing awaits the future anymore
+    }
+  }
+};
+
+// The model runs and searches release the GIL, so python threads can step different generators at the same time. Each
+// generator has a lock so threads sharing one take turns, which it always takes without holding the GIL to not deadlock
+// with a thread that holds the lock and waits for the GIL
 struct PyGenerator {
   PyGenerator(Model& model, PyGeneratorParams& params) {
     params.Prepare();
+    pybind11::gil_scoped_release release;
     generator_ = CreateGenerator(model, params);
   }
 
+  PyGenerator(std::unique_ptr<Generator> generator) : generator_{std::move(generator)} {}
+
   pybind11::array_t<int32_t> GetNextTokens() {
-    py_tokens_.Assign(generator_->search_->GetNextTokens());
-    return ToPython(py_tokens_.GetCPU());
+    return Locked([&] { return ToPython(generator_->GetNextTokens()); });
   }
 
   pybind11::array_t<int32_t> GetSequence(int index) {
-    py_sequence_.Assign(generator_->search_->GetSequence(index));
-    return ToPython(py_sequence_.GetCPU());
+    return Locked([&] {
+      py_sequence_.Assign(generator_->search_->GetSequence(index));
+      return ToPython(py_sequence_.GetCPU());
+    });
+  }
+
+  // The log probability of each batch entry's last token, then its top_logprobs most likely tokens and theirs, shaped
+  // (batch_size, top_logprobs)
+  pybind11::tuple GetLogProbs() {
+    return Locked([&] {
+      auto& search = *generator_->search_;
+      const size_t batch_size = search.params_->batch_size;
+      const size_t top_logprobs = search.params_->search.top_logprobs;
+      pybind11::array_t<float> logprobs(batch_size);
+      pybind11::array_t<int32_t> top_tokens({batch_size, top_logprobs});
+      pybind11::array_t<float> top_token_logprobs({batch_size, top_logprobs});
+      search.GetLogProbs({logprobs.mutable_data(), batch_size}, {top_tokens.mutable_data(), batch_size * top_logprobs},
+                         {top_token_logprobs.mutable_data(), batch_size * top_logprobs});
+      return pybind11::make_tuple(logprobs, top_tokens, top_token_logprobs);
+    });
   }
 
   void ComputeLogits() {
+    pybind11::gil_scoped_release release;
+    std::lock_guard lock{mutex_};
     generator_->ComputeLogits();
   }
 
   pybind11::array GetOutput(const std::string& name) {
-    return ToNumpy(generator_->state_->GetOutput(name.c_str()), *(generator_->model_));
+    return Locked([&] {
+      return generator_->WithState([&](State& state) { return ToNumpy(state.GetOutput(name.c_str()), *(generator_->model_)); });
+    });
+  }
+
+  PyTensorView GetOutputView(const std::string& name) {
+    return Locked([&] {
+      return generator_->WithState([&](State& state) {
+        auto* output = state.GetOutput(name.c_str());
+        if (!output)
+          throw std::runtime_error("Unknown output: " + name);
+        return PyTensorView{*output, *generator_->model_};
+      });
+    });
   }
 
   void GenerateNextToken() {
+    pybind11::gil_scoped_release release;
+    std::lock_guard lock{mutex_};
     generator_->GenerateNextToken();
   }
 
-  bool IsDone() const {
-    return generator_->IsDone();
+  // Returns the next tokens of the steps run, shaped (steps, batch_size)
+  pybind11::array_t<int32_t> GenerateTokens(size_t max_steps) {
+    const size_t batch_size = generator_->search_->params_->batch_size;
+    std::vector<int32_t> tokens(max_steps * batch_size);
+    size_t step_count;
+    {
+      pybind11::gil_scoped_release release;
+      std::lock_guard lock{mutex_};
+      step_count = generator_->GenerateTokens(max_steps, tokens);
+    }
+    pybind11::array_t<int32_t> result({step_count, batch_size});
+    std::copy_n(tokens.data(), step_count * batch_size, result.mutable_data());
+    return result;
+  }
+
+  // Runs ComputeLogits() & GenerateNextToken() on the async task queue and returns an asyncio future of the running loop,
+  // so an event loop can step many generators without blocking. after_step, if set, runs on the step's thread once it's
+  // done, without the GIL, and gives the future's result, which is None otherwise. Until the future is done the
+  // generator must not be used.
+  static pybind11::object GenerateNextTokenAsync(pybind11::object self, std::function<std::string(Generator&)> after_step) {
+    auto& generator = self.cast<PyGenerator&>();
+    auto loop = pybind11::module_::import("asyncio").attr("get_running_loop")();
+    auto step = std::make_unique<PyAsyncStep>(PyAsyncStep{self, loop, loop.attr("create_future")()});
+    auto future = step->future;
+    {
+      pybind11::gil_scoped_release release;
+      std::lock_guard lock{generator.mutex_};
+      generator.generator_->GenerateNextTokenAsync([step = step.get(), &generator, after_step = std::move(after_step)](std::exception_ptr error) {
+        std::optional<std::string> result;
+        if (!error && after_step) {
+          try {
+            result = after_step(*generator.generator_);
+          } catch (...) {
+            error = std::current_exception();
+          }
+        }
+        pybind11::gil_scoped_acquire acquire;
+        std::unique_ptr<PyAsyncStep> owner{step};
+        owner->Resolve(error, result ? pybind11::str(*result) : pybind11::none());
+      });
+    }
+    step.release();  // Now owned by the step's callback
+    return future;
+  }
+
+  bool IsDone() {
+    return Locked([&] { return generator_->IsDone(); });
+  }
+
+  // Without the generator's lock, as a step running on another thread holds it
+  void Cancel() {
+    pybind11::gil_scoped_release release;
+    generator_->Cancel();
+  }
+
+  void SwapOut() {
+    pybind11::gil_scoped_release release;
+    std::lock_guard lock{mutex_};
+    generator_->SwapOut();
+  }
+
+  void SwapIn() {
+    Locked([&] { generator_->SwapIn(); });
+  }
+
+  bool IsSwappedOut() {
+    return Locked([&] { return generator_->IsSwappedOut(); });
+  }
+
+  pybind11::bytes SaveState() {
+    std::vector<uint8_t> state;
+    {
+      pybind11::gil_scoped_release release;
+      std::lock_guard lock{mutex_};
+      state = generator_->SaveState();
+    }
+    return pybind11::bytes(reinterpret_cast<const char*>(state.data()), state.size());
+  }
+
+  void RestoreState(const pybind11::bytes& state) {
+    std::string_view data = state;  // The bytes object outlives the call and never changes, so it's read without the GIL
+    pybind11::gil_scoped_release release;
+    std::lock_guard lock{mutex_};
+    generator_->RestoreState({reinterpret_cast<const uint8_t*>(data.data()), data.size()});
+  }
+
+  std::unique_ptr<PyGenerator> Fork() {
+    pybind11::gil_scoped_release release;
+    std::lock_guard lock{mutex_};
+    return std::make_unique<PyGenerator>(generator_->Fork());
+  }
+
+  pybind11::dict GetMetrics() {
+    return Locked([&] { return GetMetricsLocked(); });
   }
 
  private:
+  // Runs fn with the generator's lock and the GIL, for the calls that make python objects
+  template <typename Fn>
+  auto Locked(Fn&& fn) {
+    pybind11::gil_scoped_release release;
+    std::lock_guard lock{mutex_};
+    pybind11::gil_scoped_acquire acquire;
+    return fn();
+  }
+
+  pybind11::dict GetMetricsLocked() const {
+    pybind11::dict metrics;
+    for (const char* name : {"prompt_token_count", "generated_token_count", "step_count", "prefill_seconds",
+                             "time_to_first_token_seconds", "decode_seconds", "tokens_per_second", "kv_cache_bytes"})
+      metrics[name] = generator_->GetMetric(name);
+
+    const auto& bounds = GeneratorMetrics::c_decode_time_bounds_ms;
+    const auto& counts = generator_->GetMetrics().decode_time_histogram;
+    metrics["decode_time_bounds_ms"] = std::vector<double>(bounds.begin(), bounds.end());
+    metrics["decode_time_histogram"] = std::vector<uint64_t>(counts.begin(), counts.end());
+    return metrics;
+  }
+
+  std::mutex mutex_;
   std::unique_ptr<Generator> generator_;
-  PyRoamingArray<int32_t> py_tokens_;
   PyRoamingArray<int32_t> py_indices_;
   PyRoamingArray<int32_t> py_sequence_;
   PyRoamingArray<int32_t> py_sequencelengths_;
 };
 
+// Iterated with async for, every item runs a step of the generator and is the text chunk of its token, decoded with a
+// TokenizerStream. For generators of a single sequence
+struct PyGeneratorStream {
+  PyGeneratorStream(pybind11::object generator, const Tokenizer& tokenizer)
+      : generator_{std::move(generator)},
+        tokenizer_stream_{tokenizer.CreateStream()} {}
+
+  pybind11::object Next() {
+    if (generator_.cast<PyGenerator&>().IsDone()) {
+      PyErr_SetNone(PyExc_StopAsyncIteration);
+      throw pybind11::error_already_set();
+    }
+
+    // Shared with the step, as the stream may be dropped before it completes
+    return PyGenerator::GenerateNextTokenAsync(generator_, [tokenizer_stream = tokenizer_stream_](Generator& generator) {
+      const auto& params = *generator.search_->params_;
+      if (params.batch_size != 1 || params.search.num_beams != 1)
+        throw std::runtime_error("Generator.stream needs a batch of one sequence and no beam search");
+      return tokenizer_stream->Decode(generator.GetNextTokens()[0]);
+    });
+  }
+
+ private:
+  pybind11::object generator_;
+  std::shared_ptr<TokenizerStream> tokenizer_stream_;
+};
+
 void SetLogOptions(const pybind11::kwargs& dict) {
   for (auto& entry : dict) {
     auto name = entry.first.cast<std::string>();
@@ -401,30 +802,62 @@ PYBIND11_MODULE(onnxruntime_genai, m) {
         generator_params.params_->SetInputs(*named_tensors->named_tensors_);
       })
       .def("set_model_input", &PyGeneratorParams::SetModelInput)
+      .def("set_whisper_input_features_batch", &PyGeneratorParams::SetWhisperInputFeaturesBatch)
+      .def("set_whisper_audio", &PyGeneratorParams::SetWhisperAudio, pybind11::arg("clips"), pybind11::arg("sample_rate"),
+           pybind11::arg("mel_count") = 80, pybind11::arg("pad_to_30_seconds") = true)
       .def("set_search_options", &PyGeneratorParams::SetSearchOptions)                                     // See config.h 'struct Search' for the options
+      .def("set_row_search_options", &PyGeneratorParams::SetRowSearchOptions)                              // Of one batch entry, see GeneratorParams::row_search
+      .def("set_adapters", [](PyGeneratorParams& generator_params, const std::vector<std::string>& names) {
+        generator_params.params_->adapter_names = names;
+      })
+      .def("set_guidance", [](PyGeneratorParams& generator_params, const std::string& type, const std::string& data) {
+        generator_params.params_->guidance_type = type;
+        generator_params.params_->guidance_data = data;
+      })
+      .def("add_stop_sequence", [](PyGeneratorParams& generator_params, const std::vector<int32_t>& tokens) {
+        if (tokens.empty())
+          throw std::runtime_error("A stop sequence must have at least one token");
+        generator_params.params_->stop_sequences.push_back(tokens);
+      })
+      .def("set_timeout", [](PyGeneratorParams& generator_params, double seconds) {
+        if (seconds < 0)
+          throw std::runtime_error("The timeout must be 0 or greater");
+        generator_params.params_->timeout_seconds = seconds;
+      })
       .def("try_use_cuda_graph_with_max_batch_size", &PyGeneratorParams::TryUseCudaGraphWithMaxBatchSize)  // will be deprecated
       .def("try_graph_capture_with_max_batch_size", &PyGeneratorParams::TryGraphCaptureWithMaxBatchSize);
 
   pybind11::class_<TokenizerStream>(m, "TokenizerStream")
       .def("decode", [](TokenizerStream& t, int32_t token) { return t.Decode(token); });
 
+  pybind11::class_<Tokenizer::EncodedPrefix>(m, "EncodedPrefix");
+
   pybind11::class_<Tokenizer, std::shared_ptr<Tokenizer>>(m, "Tokenizer")
       .def(pybind11::init([](Model& model) { return model.CreateTokenizer(); }))
-      .def("encode", &Tokenizer::Encode)
-      .def("decode", [](const Tokenizer& t, pybind11::array_t<int32_t> tokens) { return t.Decode(ToSpan(tokens)); })
+      .def("encode", &Tokenizer::Encode, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("encode_prefix", &Tokenizer::EncodePrefix, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("encode_with_prefix", &Tokenizer::EncodeWithPrefix, pybind11::call_guard<pybind11::gil_scoped_release>())
+      .def("decode", [](const Tokenizer& t, pybind11::array_t<int32_t> tokens) {
+        auto span = ToSpan(tokens);  // ToSpan copies the array reference, so it needs the GIL
+        pybind11::gil_scoped_release release;
+        return t.Decode(span);
+      })
       .def("encode_batch", [](const Tokenizer& t, std::vector<std::string> strings) {
-        auto result = t.EncodeBatch(strings);
+        std::vector<int32_t> result;
+        {
+          pybind11::gil_scoped_release release;
+          result = t.EncodeBatch(strings);
+        }
         return pybind11::array_t<int32_t>({strings.size(), result.size() / strings.size()}, result.data());
       })
       .def("decode_batch", [](const Tokenizer& t, pybind11::array_t<int32_t> tokens) {
-        if (tokens.ndim() == 1) {  // Just a 1D array
-          return t.DecodeBatch(ToSpan(tokens), 1);
-        } else {
-          if (tokens.ndim() != 2)
-            throw std::runtime_error("token shape can only be 1 or 2 dimensional");
+        if (tokens.ndim() != 1 && tokens.ndim() != 2)
+          throw std::runtime_error("token shape can only be 1 or 2 dimensional");
 
-          return t.DecodeBatch(ToSpan(tokens), tokens.shape(0));
-        }
+        const size_t count = tokens.ndim() == 1 ? 1 : tokens.shape(0);  // 1D is just one sequence
+        auto span = ToSpan(tokens);
+        pybind11::gil_scoped_release release;
+        return t.DecodeBatch(span, count);
       })
       .def("create_stream", [](const Tokenizer& t) { return t.CreateStream(); });
 
@@ -432,30 +865,229 @@ PYBIND11_MODULE(onnxruntime_genai, m) {
       .def(pybind11::init([](const std::string& config_path) {
         return CreateModel(GetOrtEnv(), config_path.c_str());
       }))
-      .def("generate", [](Model& model, PyGeneratorParams& params) { params.Prepare(); return Generate(model, params); })
+      .def("generate", [](Model& model, PyGeneratorParams& params) {
+        params.Prepare();
+        pybind11::gil_scoped_release release;
+        return Generate(model, params);
+      })
+      .def(
+          "generate_batch", [](Model& model, PyGeneratorParams& params, std::vector<pybind11::array_t<int32_t>> prompts, int max_active_requests, int max_batch_size, size_t max_batch_tokens, int max_new_tokens) {
+            params.Prepare();
+            std::vector<std::span<const int32_t>> spans;
+            for (auto& prompt : prompts)
+              spans.push_back(ToSpan(prompt));
+            BatchGenerateOptions options{max_active_requests, max_batch_size, max_batch_tokens, max_new_tokens};
+            pybind11::gil_scoped_release release;
+            return GenerateBatch(model, params, spans, options);
+          },
+          pybind11::arg("params"), pybind11::arg("prompts"), pybind11::arg("max_active_requests") = 1, pybind11::arg("max_batch_size") = 8,
+          pybind11::arg("max_batch_tokens") = 0, pybind11::arg("max_new_tokens") = 0)
+      .def(
+          "warmup", [](Model& model, PyGeneratorParams& params, std::vector<int> batch_sizes, std::vector<int> prompt_lengths) {
+            params.Prepare();
+            pybind11::gil_scoped_release release;
+            WarmUp(model, params, batch_sizes, prompt_lengths);
+          },
+          pybind11::arg("params"), pybind11::arg("batch_sizes") = std::vector<int>{}, pybind11::arg("prompt_lengths") = std::vector<int>{})
+      .def(
+          "score", [](Model& model, std::vector<pybind11::array_t<int32_t>> prompts, std::vector<pybind11::array_t<int32_t>> continuations) {
+            std::vector<std::span<const int32_t>> prompt_spans, continuation_spans;
+            for (auto& prompt : prompts)
+              prompt_spans.push_back(ToSpan(prompt));
+            for (auto& continuation : continuations)
+              continuation_spans.push_back(ToSpan(continuation));
+            std::vector<float> logprobs;
+            {
+              pybind11::gil_scoped_release release;
+              logprobs = Score(model, prompt_spans, continuation_spans);
+            }
+            // One array per continuation, of the log probability of each of its tokens
+            std::vector<pybind11::array_t<float>> result;
+            size_t offset = 0;
+            for (auto& continuation : continuation_spans) {
+              result.emplace_back(continuation.size(), logprobs.data() + offset);
+              offset += continuation.size();
+            }
+            return result;
+          },
+          pybind11::arg("prompts"), pybind11::arg("continuations"))
+      .def(
+          "embed", [](Model& model, std::vector<pybind11::array_t<int32_t>> prompts, const std::string& pooling, size_t max_batch_tokens) {
+            std::vector<std::span<const int32_t>> spans;
+            for (auto& prompt : prompts)
+              spans.push_back(ToSpan(prompt));
+            std::vector<float> embeddings;
+            {
+              pybind11::gil_scoped_release release;
+              embeddings = Embed(model, spans, ParseEmbeddingPooling(pooling), max_batch_tokens);
+            }
+            // Shaped (prompt count, hidden_size)
+            const size_t hidden_size = model.config_->model.decoder.hidden_size;
+            pybind11::array_t<float> result({prompts.size(), hidden_size});
+            std::copy(embeddings.begin(), embeddings.end(), result.mutable_data());
+            return result;
+          },
+          pybind11::arg("prompts"), pybind11::arg("pooling") = "mean", pybind11::arg("max_batch_tokens") = 0)
       .def_property_readonly(
           "device_type", [](const Model& model) { return to_string(model.device_type_); }, "The device type the model is running on")
-      .def("create_multimodal_processor", [](const Model& model) { return model.CreateMultiModalProcessor(); });
+      .def("create_multimodal_processor", [](const Model& model) { return model.CreateMultiModalProcessor(); })
+      .def("load_adapter", [](Model& model, const std::string& name, const pybind11::dict& weights) {
+        if (!model.GetAdapters())
+          throw std::runtime_error("The model has no adapter inputs, set model.decoder.adapters.max_adapters for one that does");
+        NamedTensors named_weights;
+        for (auto& weight : weights) {
+          auto array = weight.second.cast<pybind11::array>();
+          named_weights.emplace(weight.first.cast<std::string>(), std::make_shared<Tensor>(ToOrtValue(array)));
+        }
+        model.GetAdapters()->Load(name, named_weights);
+      })
+      .def("unload_adapter", [](Model& model, const std::string& name) {
+        if (!model.GetAdapters())
+          throw std::runtime_error("The model has no adapter inputs");
+        model.GetAdapters()->Unload(name);
+      })
+      .def("export_prefix", [](Model& model, pybind11::array_t<int32_t> tokens) {
+        if (!model.GetPrefixCache())
+          throw std::runtime_error("The model has no prefix cache, set model.decoder.prefix_cache.block_size for one");
+        auto descriptor = model.GetPrefixCache()->Export(model, ToSpan(tokens), model.cuda_stream_);
+        return pybind11::bytes(reinterpret_cast<const char*>(descriptor.data()), descriptor.size());
+      })
+      .def("import_prefix", [](Model& model, const pybind11::bytes& descriptor) {
+        if (!model.GetPrefixCache())
+          throw std::runtime_error("The model has no prefix cache, set model.decoder.prefix_cache.block_size for one");
+        std::string_view data = descriptor;
+        model.GetPrefixCache()->Import(model, {reinterpret_cast<const uint8_t*>(data.data()), data.size()});
+      })
+      .def("get_metrics", [](const Model& model) {
+        pybind11::dict metrics;
+        for (const char* name : {"prompt_token_count", "generated_token_count", "kv_cache_bytes", "static_buffer_bytes", "captured_graph_count", "pooled_captured_graph_count",
+                                 "captured_graph_evictions", "captured_graph_pool_budget_bytes", "device_memory_bytes", "device_memory_budget_bytes"})
+          metrics[name] = model.GetMetric(name);
+        std::vector<std::string> sites{"roaming_array"};
+        for (size_t i = 0; i < static_cast<size_t>(AllocationSite::Count); i++)
+          sites.push_back(GetAllocationSiteName(static_cast<AllocationSite>(i)));
+        for (auto& site : sites) {
+          for (const char* stat : {"allocation_count", "allocated_bytes", "live_bytes", "peak_bytes", "largest_allocation_bytes", "allocations_per_step"}) {
+            auto name = site + "_" + stat;
+            metrics[name.c_str()] = model.GetMetric(name);
+          }
+        }
+        return metrics;
+      });
+
+  pybind11::class_<ReloadableModel, std::shared_ptr<ReloadableModel>>(m, "ReloadableModel")
+      .def(pybind11::init([](const std::string& config_path) {
+        return std::make_shared<ReloadableModel>(GetOrtEnv(), config_path.c_str());
+      }))
+      .def("get_model", &ReloadableModel::Get)
+      .def("reload", [](ReloadableModel& model, const std::string& config_path) {
+        pybind11::gil_scoped_release release;  // The current model keeps serving other threads while the new one loads
+        model.Reload(config_path.c_str());
+      })
+      .def_property_readonly("version", &ReloadableModel::GetVersion);
+
+  pybind11::class_<ReplicaPool, std::shared_ptr<ReplicaPool>>(m, "ReplicaPool")
+      .def(pybind11::init([](const std::string& config_path, const std::vector<int>& device_ids) {
+        return std::make_shared<ReplicaPool>(GetOrtEnv(), config_path.c_str(), device_ids);
+      }))
+      .def_property_readonly("replica_count", &ReplicaPool::GetReplicaCount)
+      .def("get_replica", &ReplicaPool::GetReplica)
+      .def("create_generator", [](const ReplicaPool& pool, PyGeneratorParams& params) {
+        params.Prepare();
+        pybind11::gil_scoped_release release;
+        return std::make_unique<PyGenerator>(pool.CreateGenerator(params));
+      })
+      .def("load_adapter", [](ReplicaPool& pool, const std::string& name, const pybind11::dict& weights) {
+        NamedTensors named_weights;
+        for (auto& weight : weights) {
+          auto array = weight.second.cast<pybind11::array>();
+          named_weights.emplace(weight.first.cast<std::string>(), std::make_shared<Tensor>(ToOrtValue(array)));
+        }
+        pool.LoadAdapter(name, named_weights);
+      })
+      .def("unload_adapter", &ReplicaPool::UnloadAdapter)
+      .def(
+          "create_scheduler", [](const ReplicaPool& pool, int max_active_requests, size_t max_kv_cache_bytes, bool prefix_affinity) {
+            SchedulerOptions options{max_active_requests};
+            options.max_kv_cache_bytes = max_kv_cache_bytes;
+            options.prefix_affinity = prefix_affinity;
+            return std::make_unique<Scheduler>(pool.GetReplicas(), options);
+          },
+          pybind11::arg("max_active_requests"), pybind11::arg("max_kv_cache_bytes") = 0, pybind11::arg("prefix_affinity") = false);
+
+  pybind11::class_<Scheduler>(m, "Scheduler")
+      .def(
+          "add_request", [](Scheduler& scheduler, PyGeneratorParams& params, int priority) {
+            params.Prepare();
+            // A copy with its own input ids, so the params can be changed for the next request
+            auto request = std::make_shared<GeneratorParams>(*params.params_);
+            request->input_ids_owner.assign(request->input_ids.begin(), request->input_ids.end());
+            request->input_ids = request->input_ids_owner;
+            RequestOptions options;
+            options.priority = priority;
+            return scheduler.AddRequest(std::move(request), options);
+          },
+          pybind11::arg("params"), pybind11::arg("priority") = 0)
+      .def("step", [](Scheduler& scheduler) {
+        pybind11::gil_scoped_release release;
+        scheduler.Step();
+      })
+      .def("cancel", &Scheduler::Cancel)
+      .def("is_done", &Scheduler::IsDone)
+      .def("take_finished", [](Scheduler& scheduler) {
+        // (request id, sequences, error) of each request that finished since the last call
+        std::vector<std::tuple<Scheduler::RequestId, TokenSequences, std::string>> finished;
+        for (auto& result : scheduler.TakeFinished())
+          finished.emplace_back(result.id, std::move(result.sequences), std::move(result.error));
+        return finished;
+      });
+
+  pybind11::class_<PyTensorView>(m, "TensorView")
+      .def_property_readonly("shape", &PyTensorView::GetShape)
+      .def_property_readonly("dtype", &PyTensorView::GetDtype)
+      .def_property_readonly("device", &PyTensorView::GetDevice)
+      .def_property_readonly("__array_interface__", [](const PyTensorView& v) { return v.GetArrayInterface(false); })
+      .def_property_readonly("__cuda_array_interface__", [](const PyTensorView& v) { return v.GetArrayInterface(true); })
+      .def("__dlpack_device__", &PyTensorView::GetDLPackDevice)
+      .def(
+          "__dlpack__", [](pybind11::object self, pybind11::object stream) { return self.cast<const PyTensorView&>().GetDLPack(self, stream); },
+          pybind11::arg("stream") = pybind11::none());
 
   pybind11::class_<PyGenerator>(m, "Generator")
       .def(pybind11::init<Model&, PyGeneratorParams&>())
       .def("is_done", &PyGenerator::IsDone)
+      .def("cancel", &PyGenerator::Cancel)
       .def("compute_logits", &PyGenerator::ComputeLogits)
       .def("get_output", &PyGenerator::GetOutput)
+      .def("get_output_view", &PyGenerator::GetOutputView, pybind11::keep_alive<0, 1>())
       .def("generate_next_token", &PyGenerator::GenerateNextToken)
+      .def("generate_tokens", &PyGenerator::GenerateTokens, pybind11::arg("max_steps"))
+      .def("generate_next_token_async", [](pybind11::object self) { return PyGenerator::GenerateNextTokenAsync(std::move(self), {}); })
+      .def("stream", [](pybind11::object self, const Tokenizer& tokenizer) { return PyGeneratorStream{std::move(self), tokenizer}; })
       .def("get_next_tokens", &PyGenerator::GetNextTokens)
-      .def("get_sequence", &PyGenerator::GetSequence);
+      .def("get_sequence", &PyGenerator::GetSequence)
+      .def("get_logprobs", &PyGenerator::GetLogProbs)
+      .def("swap_out", &PyGenerator::SwapOut)
+      .def("swap_in", &PyGenerator::SwapIn)
+      .def("is_swapped_out", &PyGenerator::IsSwappedOut)
+      .def("save_state", &PyGenerator::SaveState)
+      .def("restore_state", &PyGenerator::RestoreState)
+      .def("fork", &PyGenerator::Fork)
+      .def("get_metrics", &PyGenerator::GetMetrics);
+
+  pybind11::class_<PyGeneratorStream>(m, "GeneratorStream")
+      .def("__aiter__", [](pybind11::object self) { return self; })
+      .def("__anext__", &PyGeneratorStream::Next);
 
   pybind11::class_<Images>(m, "Images")
       .def_static("open", [](pybind11::args image_paths) {
-        if (image_paths.empty())
-          throw std::runtime_error("No images provided");
-
-        if (image_paths.size() > 1U)
-          throw std::runtime_error("Loading multiple images is not supported");
-
-        auto image_path = image_paths[0].cast<std::string>();
-        return LoadImageImpl(image_path.c_str());
+        std::vector<std::string> paths;
+        for (const auto& image_path : image_paths)
+          paths.push_back(image_path.cast<std::string>());
+        std::vector<const char*> path_strings;
+        for (const auto& path : paths)
+          path_strings.push_back(path.c_str());
+        return LoadImagesImpl(path_strings);
       });
 
   pybind11::class_<PyNamedTensors>(m, "NamedTensors");
@@ -472,15 +1104,27 @@ PYBIND11_MODULE(onnxruntime_genai, m) {
           throw std::runtime_error("Image processor is not available.");
         }
       })
+      .def("__call__", [](MultiModalProcessor& processor, const std::vector<std::string>& prompts, const pybind11::kwargs& kwargs) -> std::unique_ptr<PyNamedTensors> {
+        // A batch of prompts, where image_counts says how many of the images each one owns, in order
+        if (!processor.image_processor_)
+          throw std::runtime_error("Image processor is not available.");
+        const Images* images = nullptr;
+        if (kwargs.contains("images"))
+          images = kwargs["images"].cast<const Images*>();
+        auto image_counts = kwargs.contains("image_counts") ? kwargs["image_counts"].cast<std::vector<size_t>>()
+                                                            : DefaultImageCounts(prompts.size(), images);
+        return std::make_unique<PyNamedTensors>(processor.image_processor_->Process(*processor.tokenizer_, prompts, images, image_counts));
+      })
       .def("create_stream", [](MultiModalProcessor& processor) { return processor.tokenizer_->CreateStream(); })
       .def("decode", [](MultiModalProcessor& processor, pybind11::array_t<int32_t> tokens) {
         return processor.tokenizer_->Decode(ToSpan(tokens));
       });
 
   m.def("set_log_options", &SetLogOptions);
+  m.def("set_global_thread_pools", &SetGlobalThreadPools, pybind11::arg("intra_op_num_threads") = 0, pybind11::arg("inter_op_num_threads") = 0);
 
   m.def("is_cuda_available", []() {
-#if USE_CUDA
+#if USE_CUDA && !USE_ROCM
     return true;
 #else
         return false;
@@ -0,0 +1,470 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "scheduler.h"
+#include "search.h"
+#include "models/model.h"
+
+namespace Generators {
+
+namespace {
+
+// The kv cache bytes of one sequence position, over the keys & values of every layer, or 0 when the model has no kv
+// cache inputs named by decoder.inputs.past_key_names
+size_t GetKVBytesPerPosition(const Model& model) {
+  const auto& decoder = model.config_->model.decoder;
+  char name[64];
+  snprintf(name, std::size(name), decoder.inputs.past_key_names.c_str(), 0);
+  if (!model.session_info_ || !model.session_info_->HasInput(name))
+    return 0;
+  return SizeOf(model.session_info_->GetInputDataType(name)) * 2 * decoder.num_hidden_layers * decoder.num_key_value_heads * decoder.head_size;
+}
+
+double Seconds(Scheduler::Clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+size_t GetPromptTokens(const GeneratorParams& params) {
+  return static_cast<size_t>(params.batch_size) * params.sequence_length;
+}
+
+}  // namespace
+
+Scheduler::Scheduler(std::vector<std::shared_ptr<const Model>> models, const SchedulerOptions& options)
+    : options_{options} {
+  if (models.empty())
+    throw std::runtime_error("A scheduler needs a model");
+  if (options.max_active_requests < 1)
+    throw std::runtime_error("max_active_requests must be 1 or greater, is " + std::to_string(options.max_active_requests));
+  for (auto& model : models) {
+    if (!model)
+      throw std::runtime_error("A scheduler's model can't be null");
+    if (model->config_->model.vocab_size != models.front()->config_->model.vocab_size || model->device_type_ != models.front()->device_type_)
+      throw std::runtime_error("The models of a scheduler must be instances of one model, on the same type of device");
+    instances_.push_back({std::move(model)});
+  }
+  // The DML sessions of a model share its execution context and readback heap, so its runs can't overlap
+  const auto device_type = instances_.front().model->device_type_;
+  if (options.ping_pong && device_type != DeviceType::CPU && device_type != DeviceType::CUDA)
+    throw std::runtime_error("ping_pong is only supported on CPU and CUDA, not " + to_string(device_type));
+  decode_threads_ = std::make_unique<ThreadPool>(instances_.size() * (options.ping_pong ? 2 : 1));
+  if (options.max_kv_cache_bytes) {
+    kv_bytes_per_position_ = GetKVBytesPerPosition(*instances_.front().model);
+    if (kv_bytes_per_position_ == 0)
+      throw std::runtime_error("max_kv_cache_bytes needs a model with kv cache inputs named by decoder.inputs.past_key_names");
+  }
+}
+
+Scheduler::Scheduler(const Model& model, const SchedulerOptions& options)
+    : Scheduler{std::vector<std::shared_ptr<const Model>>{model.shared_from_this()}, options} {
+}
+
+Scheduler::RequestId Scheduler::AddRequest(std::shared_ptr<GeneratorParams> params, const RequestOptions& options) {
+  if (!params)
+    throw std::runtime_error("AddRequest called with null GeneratorParams");
+  if (options.ttft_slo_seconds < 0 || options.itl_slo_seconds < 0)
+    throw std::runtime_error("The SLO targets must be 0 or greater");
+  if (options_.stream_tokens && params->search.num_beams != 1)
+    throw std::runtime_error("stream_tokens doesn't support beam search, the next tokens of the beams aren't the final sequences");
+
+  const auto now = Clock::now();
+  Request request{next_id_, std::move(params), options, nullptr, now, now};
+  request.kv_cache_bytes = kv_bytes_per_position_ * request.params->BatchBeamSize() * request.params->search.max_length;
+  if (options_.max_kv_cache_bytes && request.kv_cache_bytes > options_.max_kv_cache_bytes)
+    throw std::runtime_error("The request's kv caches need " + std::to_string(request.kv_cache_bytes) + " bytes at max_length, more than max_kv_cache_bytes (" + std::to_string(options_.max_kv_cache_bytes) + ")");
+
+  waiting_.push_back(std::move(request));
+  return next_id_++;
+}
+
+void Scheduler::Preempt(RequestId id) {
+  auto it = std::find_if(active_.begin(), active_.end(), [id](const Request& request) { return request.id == id; });
+  if (it == active_.end())
+    throw std::runtime_error("Request " + std::to_string(id) + " isn't active, so it can't be preempted");
+
+  it->generator->SwapOut();
+  auto& instance = instances_[it->instance];
+  instance.active_count--;
+  instance.kv_reserved_bytes -= it->kv_cache_bytes;  // On the host until it's admitted again
+  preempted_.push_back(std::move(*it));
+  active_.erase(it);
+}
+
+bool Scheduler::Before(const Request& a, bool a_preempted, const Request& b, bool b_preempted) const {
+  if (a.options.priority != b.options.priority)
+    return a.options.priority > b.options.priority;
+  if (a_preempted != b_preempted)
+    return a_preempted;  // It waited for its first token already
+
+  const auto deadline = [](const Request& request) {
+    if (request.options.ttft_slo_seconds <= 0)
+      return Clock::time_point::max();
+    return request.added + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(request.options.ttft_slo_seconds));
+  };
+  const auto a_deadline = deadline(a), b_deadline = deadline(b);
+  if (a_deadline != b_deadline)
+    return a_deadline < b_deadline;
+  return a.id < b.id;
+}
+
+std::optional<size_t> Scheduler::Fit(const Request& request) const {
+  // Only a single sequence's prompt can start from a cached prefix (see State::GetCachedPrefix)
+  const bool by_prefix = options_.prefix_affinity && !request.generator && instances_.size() > 1 && request.params->batch_size == 1;
+  const auto prompt = request.params->input_ids;
+  std::vector<size_t> hashes;  // Of the prompt, hashed again only for an instance with another block size
+  size_t hashes_block_size{};
+  const auto cached_length = [&](size_t i) -> size_t {
+    auto* prefix_cache = instances_[i].model->GetPrefixCache();
+    if (!by_prefix || !prefix_cache)
+      return 0;
+    if (prefix_cache->GetBlockSize() != hashes_block_size) {
+      hashes = prefix_cache->HashPrompt(prompt);
+      hashes_block_size = prefix_cache->GetBlockSize();
+    }
+    return prefix_cache->GetCachedLength(prompt, hashes);
+  };
+  // The share of the prompt a cached prefix saves, less the share of the slots in use
+  const auto score = [&](size_t i) {
+    const size_t length = cached_length(i);
+    const double cached = length ? static_cast<double>(length) / static_cast<double>(prompt.size()) : 0.0;
+    return cached - static_cast<double>(instances_[i].active_count) / options_.max_active_requests;
+  };
+
+  std::optional<size_t> best;
+  double best_score{};
+  for (size_t i = 0; i < instances_.size(); i++) {
+    if (request.generator && i != request.instance)
+      continue;  // A preempted request's kv caches are of its instance
+    auto& instance = instances_[i];
+    if (instance.active_count >= static_cast<size_t>(options_.max_active_requests))
+      continue;
+    if (options_.max_kv_cache_bytes && instance.kv_reserved_bytes + request.kv_cache_bytes > options_.max_kv_cache_bytes)
+      continue;
+    const double instance_score = score(i);
+    if (!best || instance_score > best_score || (instance_score == best_score && instance.active_count < instances_[*best].active_count))
+      best = i, best_score = instance_score;
+  }
+  return best;
+}
+
+std::optional<size_t> Scheduler::MakeRoom(const Request& request) {
+  if (auto instance = Fit(request))
+    return instance;
+  if (!options_.preempt_lower_priority)
+    return std::nullopt;
+
+  // Only on an instance where preempting all of its lower priority requests lets the request fit, so none are swapped
+  // out for nothing
+  const auto can_preempt = [&](const Request& active) { return active.options.priority < request.options.priority; };
+  std::optional<size_t> target;
+  for (size_t i = 0; i < instances_.size() && !target; i++) {
+    if (request.generator && i != request.instance)
+      continue;  // A preempted request's kv caches are of its instance
+    size_t active_count = instances_[i].active_count, kv_reserved_bytes = instances_[i].kv_reserved_bytes;
+    for (auto& active : active_) {
+      if (active.instance == i && can_preempt(active))
+        active_count--, kv_reserved_bytes -= active.kv_cache_bytes;
+    }
+    if (active_count < static_cast<size_t>(options_.max_active_requests) &&
+        (!options_.max_kv_cache_bytes || kv_reserved_bytes + request.kv_cache_bytes <= options_.max_kv_cache_bytes))
+      target = i;
+  }
+  if (!target)
+    return std::nullopt;
+
+  for (;;) {
+    // Of the lowest priority, the one admitted last, as it has made the least progress
+    auto victim = active_.end();
+    for (auto it = active_.begin(); it != active_.end(); ++it) {
+      if (it->instance == *target && can_preempt(*it) && (victim == active_.end() || it->options.priority <= victim->options.priority))
+        victim = it;
+    }
+    if (victim == active_.end())
+      return std::nullopt;
+    Preempt(victim->id);
+    if (auto instance = Fit(request))
+      return instance;
+  }
+}
+
+bool Scheduler::CanPrefill(const Request& request) const {
+  const size_t tokens = GetPromptTokens(*request.params);
+  if (options_.max_prefill_tokens && prefill_tokens_ > 0 && prefill_tokens_ + tokens > options_.max_prefill_tokens)
+    return false;
+
+  // The next decode step comes after the prefills of this one
+  const double next_token_seconds = decode_seconds_ + prefill_seconds_ + tokens * prefill_seconds_per_token_;
+  for (auto& active : active_) {
+    const auto& options = active.options;
+    if (options.itl_slo_seconds <= 0 || next_token_seconds <= options.itl_slo_seconds || options.priority < request.options.priority)
+      continue;
+    if (options.priority > request.options.priority || prefill_tokens_ > 0)
+      return false;
+  }
+  return true;
+}
+
+bool Scheduler::AdmitNext() {
+  const Request* next = nullptr;
+  bool preempted = false;
+  for (auto& request : preempted_) {
+    if (!next || Before(request, true, *next, preempted))
+      next = &request, preempted = true;
+  }
+  for (auto& request : waiting_) {
+    if (!next || Before(request, false, *next, preempted))
+      next = &request, preempted = false;
+  }
+
+  // Strictly in order, so a long prompt isn't passed over for good by shorter ones
+  if (!next || (!preempted && !CanPrefill(*next)))
+    return false;
+  const auto instance = MakeRoom(*next);
+  if (!instance)
+    return false;
+
+  auto& queue = preempted ? preempted_ : waiting_;
+  auto it = std::find_if(queue.begin(), queue.end(), [id = next->id](const Request& request) { return request.id == id; });
+  Request request = std::move(*it);
+  queue.erase(it);
+
+  request.instance = *instance;
+  try {
+    if (preempted) {
+      request.generator->SwapIn();  // Queued now, the copies overlap with the rest of the step
+    } else {
+      // The generator (and with it the kv cache) is only created once the request has a slot
+      const auto start = Clock::now();
+      request.generator = CreateGenerator(*instances_[*instance].model, *request.params);
+      RunStep(request);
+      const auto now = Clock::now();
+      if (options_.stream_tokens)
+        step_tokens_.push_back({request.id, request.next_tokens});
+
+      const size_t tokens = GetPromptTokens(*request.params);
+      const double seconds = Seconds(now - start);
+      prefill_tokens_ += tokens;
+      prefill_seconds_ += seconds;
+      prefill_seconds_per_token_ = prefill_seconds_per_token_ > 0 ? (prefill_seconds_per_token_ + seconds / tokens) / 2 : seconds / tokens;
+      request.ttft_seconds = Seconds(now - request.added);
+      request.last_token = now;
+    }
+  } catch (const std::exception& e) {
+    request.error = e.what();
+  }
+
+  instances_[*instance].active_count++;
+  instances_[*instance].kv_reserved_bytes += request.kv_cache_bytes;
+  active_.push_back(std::move(request));
+  return true;
+}
+
+void Scheduler::Retire() {
+  for (auto& request : active_) {
+    if (!request.error.empty() || request.generator->IsDone())
+      Finish(request);
+  }
+  active_.erase(std::remove_if(active_.begin(), active_.end(), [](const Request& request) { return !request.generator; }), active_.end());
+}
+
+void Scheduler::Finish(Request& request) {
+  auto& result = finished_.emplace_back();
+  result.id = request.id;
+  result.error = std::move(request.error);
+  std::vector<RoamingArray<int32_t>> sequences;  // Every copy is queued before the first is waited on
+  for (int i = 0; result.error.empty() && i < request.params->batch_size * request.params->search.num_return_sequences; i++) {
+    sequences.push_back(request.generator->GetSequence(i));
+    sequences.back().PrefetchToCPU();
+  }
+  for (auto& sequence : sequences) {
+    auto sequence_cpu = sequence.GetCPU();
+    result.sequences.emplace_back(sequence_cpu.begin(), sequence_cpu.end());
+  }
+  const auto& options = request.options;
+  result.ttft_seconds = request.ttft_seconds;
+  result.max_itl_seconds = request.max_itl_seconds;
+  result.met_slo = result.error.empty() && (options.ttft_slo_seconds <= 0 || request.ttft_seconds <= options.ttft_slo_seconds) &&
+                   (options.itl_slo_seconds <= 0 || request.max_itl_seconds <= options.itl_slo_seconds);
+
+  request.generator.reset();  // Release the slot's state right away
+  auto& instance = instances_[request.instance];
+  instance.active_count--;
+  instance.kv_reserved_bytes -= request.kv_cache_bytes;
+}
+
+void Scheduler::RunStep(Request& request) {
+  if (!options_.stream_tokens) {
+    request.generator->ComputeLogits();
+    request.generator->GenerateNextToken();
+    return;
+  }
+  request.next_tokens.resize(request.params->batch_size);
+  request.generator->GenerateTokens(1, request.next_tokens);
+}
+
+std::vector<std::vector<Scheduler::Request*>> Scheduler::GetDecodeLanes() {
+  std::vector<std::vector<Request*>> lanes;
+  for (size_t instance = 0; instance < instances_.size(); instance++) {
+    std::vector<Request*> requests;
+    for (auto& request : active_) {
+      if (request.instance == instance)
+        requests.push_back(&request);
+    }
+    if (requests.empty())
+      continue;
+    if (!options_.ping_pong || requests.size() < 2) {
+      lanes.push_back(std::move(requests));
+      continue;
+    }
+
+    // Every other request goes to the second half, so the halves stay even as requests come and go
+    std::vector<Request*> halves[2];
+    for (size_t i = 0; i < requests.size(); i++)
+      halves[i % 2].push_back(requests[i]);
+    lanes.push_back(std::move(halves[0]));
+    lanes.push_back(std::move(halves[1]));
+  }
+  return lanes;
+}
+
+void Scheduler::Decode(std::span<Request* const> requests) {
+  for (auto* request : requests) {
+    try {
+      RunStep(*request);
+    } catch (const std::exception& e) {
+      request->error = e.what();
+      continue;
+    }
+    const auto now = Clock::now();
+    request->max_itl_seconds = std::max(request->max_itl_seconds, Seconds(now - request->last_token));
+    request->last_token = now;
+  }
+}
+
+void Scheduler::Step() {
+  // Decode first, the prompts wait for the tokens of the running requests
+  const auto start = Clock::now();
+  const auto lanes = GetDecodeLanes();
+  decode_threads_->ParallelFor(lanes.size(), [&](size_t lane, size_t /*thread_index*/) { Decode(lanes[lane]); });
+  decode_seconds_ = Seconds(Clock::now() - start);
+  step_tokens_.clear();
+  if (options_.stream_tokens) {
+    for (auto& request : active_) {
+      if (request.error.empty())
+        step_tokens_.push_back({request.id, request.next_tokens});
+    }
+  }
+  Retire();
+
+  prefill_tokens_ = 0;
+  prefill_seconds_ = 0;
+  while (AdmitNext()) {
+  }
+  Retire();  // The ones done after their first token
+}
+
+std::vector<Scheduler::Result> Scheduler::TakeFinished(size_t max_count) {
+  if (finished_.size() <= max_count)
+    return std::exchange(finished_, {});
+
+  std::vector<Result> taken(std::make_move_iterator(finished_.begin()), std::make_move_iterator(finished_.begin() + max_count));
+  finished_.erase(finished_.begin(), finished_.begin() + max_count);
+  return taken;
+}
+
+void Scheduler::Cancel(RequestId id) {
+  const auto matches = [id](const Request& request) { return request.id == id; };
+  if (auto it = std::find_if(active_.begin(), active_.end(), matches); it != active_.end()) {
+    auto& instance = instances_[it->instance];
+    instance.active_count--;
+    instance.kv_reserved_bytes -= it->kv_cache_bytes;
+    active_.erase(it);
+    return;
+  }
+  for (auto* queue : {&waiting_, &preempted_}) {
+    if (auto it = std::find_if(queue->begin(), queue->end(), matches); it != queue->end()) {
+      queue->erase(it);
+      return;
+    }
+  }
+  // Done, but not taken yet
+  if (auto it = std::find_if(finished_.begin(), finished_.end(), [id](const Result& result) { return result.id == id; }); it != finished_.end()) {
+    finished_.erase(it);
+    return;
+  }
+  throw std::runtime_error("Request " + std::to_string(id) + " isn't waiting, active or finished, so it can't be cancelled");
+}
+
+TokenSequences GenerateBatch(const Model& model, const GeneratorParams& params, std::span<const std::span<const int32_t>> prompts, const BatchGenerateOptions& options) {
+  if (options.max_batch_size < 1)
+    throw std::runtime_error("max_batch_size must be 1 or greater, is " + std::to_string(options.max_batch_size));
+  if (!params.extra_inputs.empty() || params.adapter_names.size() > 1)
+    throw std::runtime_error("GenerateBatch can't split extra_inputs or per sequence adapter_names over its batches");
+
+  const auto max_length = [&](size_t longest_prompt) {
+    if (options.max_new_tokens < 1)
+      return params.search.max_length;
+    return static_cast<int>(std::min<size_t>(longest_prompt + options.max_new_tokens, model.config_->model.context_length));
+  };
+
+  // Sorted by length, every batch is some of the shortest prompts that are left
+  std::vector<size_t> order(prompts.size());
+  std::iota(order.begin(), order.end(), size_t{0});
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return prompts[a].size() < prompts[b].size(); });
+
+  struct Batch {
+    size_t start, end;  // In order
+    size_t sequence_length;
+  };
+  std::vector<Batch> batches;
+  std::unordered_map<Scheduler::RequestId, size_t> batch_of_request;
+  Scheduler scheduler{model, options.max_active_requests};
+
+  for (size_t start = 0; start < order.size();) {
+    size_t end = start + 1;
+    for (; end < order.size() && end - start < static_cast<size_t>(options.max_batch_size); end++) {
+      const size_t tokens = (end - start + 1) * max_length(prompts[order[end]].size());
+      if (options.max_batch_tokens && tokens > options.max_batch_tokens)
+        break;
+    }
+
+    std::vector<std::span<const int32_t>> batch_prompts;
+    for (size_t i = start; i < end; i++)
+      batch_prompts.push_back(prompts[order[i]]);
+    const size_t sequence_length = batch_prompts.back().size();
+
+    auto request = std::make_shared<GeneratorParams>(params);
+    request->input_ids_owner = PadInputs(batch_prompts, params.pad_token_id);
+    request->input_ids = request->input_ids_owner;
+    request->batch_size = static_cast<int>(end - start);
+    request->sequence_length = static_cast<int>(sequence_length);
+    request->search.max_length = max_length(sequence_length);
+    request->external_owner_ = nullptr;
+
+    batch_of_request.emplace(scheduler.AddRequest(std::move(request)), batches.size());
+    batches.push_back({start, end, sequence_length});
+    start = end;
+  }
+
+  const size_t num_return_sequences = params.search.num_return_sequences;
+  TokenSequences results(prompts.size() * num_return_sequences);
+  while (!scheduler.IsDone()) {
+    scheduler.Step();
+    for (auto& finished : scheduler.TakeFinished()) {
+      if (!finished.error.empty())
+        throw std::runtime_error(finished.error);
+      auto& batch = batches[batch_of_request.at(finished.id)];
+      for (size_t i = 0; i < finished.sequences.size(); i++) {
+        auto& sequence = finished.sequences[i];
+        auto& result = results[order[batch.start + i / num_return_sequences] * num_return_sequences + i % num_return_sequences];
+        result.assign(sequence.begin() + std::min(batch.sequence_length, sequence.size()), sequence.end());
+        while (!result.empty() && result.back() == params.pad_token_id)
+          result.pop_back();
+      }
+    }
+  }
+  return results;
+}
+
+}  // namespace Generators
@@ -0,0 +1,182 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <chrono>
+#include <deque>
+#include <optional>
+
+namespace Generators {
+
+struct SchedulerOptions {
+  int max_active_requests{1};  // Slots, the requests that run at once on each model instance
+
+  // Admission control: a request only gets a slot while the kv caches of the active requests of its instance, each
+  // grown to its max_length, and its own fit in this many bytes. 0 for no limit
+  size_t max_kv_cache_bytes{};
+
+  // Prompt tokens prefilled per Step(), after the decode step of the running requests. A prompt longer than this still
+  // gets a step of its own. 0 for no limit
+  size_t max_prefill_tokens{};
+
+  // A waiting request of a higher priority that finds no free slot or kv memory preempts the lowest priority active
+  // request instead of waiting (see Preempt, so only on CUDA)
+  bool preempt_lower_priority{};
+
+  // Keep the next tokens of the requests every Step(), see GetStepTokens, to stream them. Not for beam search
+  bool stream_tokens{};
+
+  // Splits the active requests of each instance into two halves that decode on threads of their own. On CUDA every
+  // generator runs on its own stream, so while one half's model runs keep the GPU busy, the other does the host work
+  // of its step (the search, done checks and input updates), instead of the GPU idling through it. CPU and CUDA only
+  bool ping_pong{};
+
+  // With several instances and model.decoder.prefix_cache, a new request leans to the instances whose prefix cache holds
+  // a prefix of its prompt: each instance is scored by the share of the prompt its cache holds, less the share of its
+  // slots in use, instead of by its free slots alone. Requests sharing a system prompt then gather on the instances that
+  // already ran it and share its cached kv caches there, rather than each instance prefilling a copy of its own, until
+  // those fill up enough that an idle instance is worth the prefill
+  bool prefix_affinity{};
+};
+
+struct RequestOptions {
+  int priority{};  // Higher goes first, like 1 for interactive and 0 for batch traffic
+
+  // Target from AddRequest() to the first token, 0 for none. The waiting requests of a priority are admitted earliest
+  // deadline first, then oldest first
+  double ttft_slo_seconds{};
+
+  // Target between two tokens, 0 for none. While the request decodes, the prefills of lower priority requests wait
+  // for the steps whose decode time leaves them room, and those of its priority get one prefill per step
+  double itl_slo_seconds{};
+};
+
+// A request queue that runs independent generation requests through a fixed number of active slots. Between steps,
+// finished requests leave their slot and waiting requests take it, so a long request no longer keeps the slots of
+// shorter ones idle the way a fixed batch_size Generator does.
+//
+// It doesn't batch requests together: every active request is a Generator of its own, with kv caches of its own, and
+// the active requests of an instance step one after the other (or in two lanes, see ping_pong). A step of n requests
+// is n model runs, not one run of a batch of n.
+//
+// Every step decodes first and prefills after, within a budget: the requests already generating get their next token
+// before new prompts run, so a burst of long prompts doesn't stall their inter token latency. Requests are admitted by
+// priority, so interactive traffic keeps its latency while batch traffic soaks up the slots and steps it leaves.
+//
+// With several instances of one model, like one per GPU (see the dml device_id "next"), every instance has slots and kv
+// memory of its own. A new request goes to the instance with the most free slots (or the longest cached prefix of its
+// prompt, see SchedulerOptions::prefix_affinity), and the instances decode at the same time, each on a thread of its own.
+struct Scheduler {
+  using RequestId = uint64_t;
+  using Clock = std::chrono::steady_clock;
+
+  Scheduler(std::vector<std::shared_ptr<const Model>> models, const SchedulerOptions& options);
+  Scheduler(const Model& model, const SchedulerOptions& options);
+  Scheduler(const Model& model, int max_active_requests) : Scheduler{model, SchedulerOptions{max_active_requests}} {}
+
+  RequestId AddRequest(std::shared_ptr<GeneratorParams> params, const RequestOptions& options = {});
+
+  // Generate one token for every active request, then admit waiting requests into free slots and prefill their prompts
+  void Step();
+
+  // Takes the active request out of its slot, with its kv caches swapped out to host memory (see Generator::SwapOut),
+  // so a more urgent request can have the slot and the device memory. Preempted requests are admitted before the
+  // waiting ones of their priority and continue where they left off
+  void Preempt(RequestId id);
+
+  bool IsDone() const { return active_.empty() && waiting_.empty() && preempted_.empty(); }
+  size_t GetActiveCount() const { return active_.size(); }
+  size_t GetWaitingCount() const { return waiting_.size(); }
+  size_t GetPreemptedCount() const { return preempted_.size(); }
+
+  struct Result {
+    RequestId id;
+    TokenSequences sequences;  // batch_size * num_return_sequences entries, like Generate()
+    double ttft_seconds;       // From AddRequest() to the first token
+    double max_itl_seconds;    // The longest time between two of its tokens
+    bool met_slo;              // Both within the request's targets
+    std::string error;         // Set when it failed, like a prompt over the context length, with no sequences
+  };
+
+  // Returns the requests that finished since the last call, up to max_count of them, the rest wait for the next call
+  std::vector<Result> TakeFinished(size_t max_count = SIZE_MAX);
+
+  // Drops the request wherever it is, without a result, like once the client waiting for it has gone. A finished request's
+  // result is dropped if it wasn't taken yet
+  void Cancel(RequestId id);
+
+  struct StepTokens {
+    RequestId id;
+    std::vector<int32_t> tokens;  // The next token of each of its batch_size sequences
+  };
+  // With SchedulerOptions::stream_tokens, the tokens the requests generated in the last Step(), the first tokens of the
+  // prompts it prefilled included
+  const std::vector<StepTokens>& GetStepTokens() const { return step_tokens_; }
+
+ private:
+  struct Request {
+    RequestId id;
+    std::shared_ptr<GeneratorParams> params;
+    RequestOptions options;
+    std::unique_ptr<Generator> generator;
+    size_t instance{};  // Of the generator, once it has one
+    Clock::time_point added, last_token;
+    size_t kv_cache_bytes{};  // What its kv caches can grow to, reserved while it's active
+    double ttft_seconds{}, max_itl_seconds{};
+    std::vector<int32_t> next_tokens;  // Of its last step, with stream_tokens
+    std::string error;                 // Retired with it once set, the step goes on for the others
+  };
+
+  // Admits the best of the preempted & waiting requests, and prefills a waiting one, if the slots, kv memory and prefill
+  // budget allow it. Returns false once none can go this step
+  bool AdmitNext();
+  // The instance the request fits on, after preempting lower priority requests until it does if allowed, and only if it
+  // then can
+  std::optional<size_t> MakeRoom(const Request& request);
+  std::optional<size_t> Fit(const Request& request) const;  // The one with the most free slots, see prefix_affinity
+  bool CanPrefill(const Request& request) const;  // Within the prefill budget and the itl_slo_seconds of the active requests
+  bool Before(const Request& a, bool a_preempted, const Request& b, bool b_preempted) const;  // Admission order
+  void Retire();
+  void Finish(Request& request);  // Moves its result to finished_ and releases its generator, which Retire then drops
+  // The active requests of each instance, or its two halves with ping_pong, which decode at the same time
+  std::vector<std::vector<Request*>> GetDecodeLanes();
+  void Decode(std::span<Request* const> requests);  // Their next token
+  void RunStep(Request& request);
+
+  struct Instance {
+    std::shared_ptr<const Model> model;
+    size_t active_count{};
+    size_t kv_reserved_bytes{};  // Of its active requests
+  };
+  std::vector<Instance> instances_;
+  SchedulerOptions options_;
+  size_t kv_bytes_per_position_{};  // Of one sequence, over all layers' keys & values
+  RequestId next_id_{};
+
+  std::deque<Request> waiting_;
+  std::deque<Request> preempted_;  // Their generators are swapped out
+  std::vector<Request> active_;
+  std::vector<Result> finished_;
+  std::vector<StepTokens> step_tokens_;
+  std::unique_ptr<ThreadPool> decode_threads_;  // A thread per decode lane, kept from step to step
+
+  // Of the current step, to keep the prefills inside the budget & the decoding requests' itl_slo_seconds
+  double decode_seconds_{};
+  double prefill_seconds_{};
+  size_t prefill_tokens_{};
+  double prefill_seconds_per_token_{};  // Measured over the earlier prefills
+};
+
+struct BatchGenerateOptions {
+  int max_active_requests{1};  // Requests the scheduler runs at once, see Scheduler
+  int max_batch_size{8};       // Prompts batched into one request
+  size_t max_batch_tokens{};   // If set, a request's batch_size * max_length (the kv cache positions it can grow to) stays within this
+  int max_new_tokens{};        // If set, a request's max_length is its longest prompt plus this, instead of search.max_length
+};
+
+// Generates for every prompt of an offline job, with the search options of params. The prompts are sorted by length and
+// batched with the ones closest in length, so the batches pad little, and the batches run through a Scheduler so one
+// that finishes early makes room for the next. Returns num_return_sequences sequences per prompt, in prompt order, of the
+// generated tokens only, without the trailing pad tokens of the ones that finished before the rest of their batch.
+TokenSequences GenerateBatch(const Model& model, const GeneratorParams& params, std::span<const std::span<const int32_t>> prompts, const BatchGenerateOptions& options);
+
+}  // namespace Generators
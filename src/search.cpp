@@ -1,12 +1,31 @@
 #include "generators.h"
 #include "softmax.h"
 #include "search.h"
+#include "constrained_decoding.h"
 #include "beam_search_scorer.h"
 #include <queue>
 #include <algorithm>
 
 namespace Generators {
 
+namespace {
+
+// Batch rows are spread over the shared thread pool once they're large enough to be worth waking it up for
+constexpr size_t c_min_parallel_row_size = 1 << 14;
+
+// fn(row, thread_index). Rows run in place without a type erased call, only those on the thread pool go through one
+template <typename Fn>
+void ForEachRow(size_t rows, size_t row_size, const Fn& fn) {
+  if (row_size < c_min_parallel_row_size) {
+    for (size_t row = 0; row < rows; row++)
+      fn(row, 0);
+    return;
+  }
+  GetThreadPool().ParallelFor(rows, fn);
+}
+
+}  // namespace
+
 Search_Cpu::Search_Cpu(const GeneratorParams& params)
     : Search{params},
       sequences_{params.input_ids, params.batch_size, params.search.num_beams, params_->search.max_length} {
@@ -14,29 +33,57 @@ Search_Cpu::Search_Cpu(const GeneratorParams& params)
   sequence_lengths_buffer_ = AllocateArray<int32_t>(batch_beam_size, &sequence_lengths_);
 }
 
-GreedySearch_Cpu::GreedySearch_Cpu(const GeneratorParams& params)
-    : Search_Cpu(params) {
-  if (params_->search.random_seed != -1)
-    gen_.seed(params_->search.random_seed);
-  else {
-    std::random_device rd;
-    std::array<uint32_t, decltype(gen_)::state_size> data;
-    std::generate(std::begin(data), std::end(data), std::ref(rd));
-    std::seed_seq seq(data.begin(), data.end());
-    gen_.seed(seq);
+std::vector<RandomStream> GetRandomStreams(const GeneratorParams& params) {
+  std::optional<uint64_t> device_seed;
+  std::vector<RandomStream> streams;
+  for (int batch_id = 0; batch_id < params.batch_size; batch_id++) {
+    const int seed = params.GetRowSearch(batch_id).random_seed;
+    if (seed == -1 && !device_seed) {
+      std::random_device rd;
+      device_seed = (static_cast<uint64_t>(rd()) << 32) | rd();
+    }
+    RandomStream stream{seed == -1 ? *device_seed : static_cast<uint32_t>(seed), 0, params.fork_index};
+    stream.index = static_cast<uint32_t>(std::count_if(streams.begin(), streams.end(), [&](const RandomStream& other) { return other.seed == stream.seed; }));
+    streams.push_back(stream);
   }
+  return streams;
+}
+
+GreedySearch_Cpu::GreedySearch_Cpu(const GeneratorParams& params)
+    : Search_Cpu(params),
+      random_streams_{GetRandomStreams(params)} {
 
   next_tokens_buffer_ = AllocateArray<int32_t>(params.batch_size, &next_tokens_);
   memset(next_tokens_.data(), 0, next_tokens_.size_bytes());
 
   eos_seen_buffer_ = AllocateArray<bool>(params.batch_size, &eos_seen_);
   memset(eos_seen_.data(), 0, eos_seen_.size_bytes());
+
+  random_values_buffer_ = AllocateArray<float>(params.batch_size, &random_values_);
+
+  if (!params.stop_sequences.empty()) {
+    stop_sequences_.emplace(params.stop_sequences);
+    stop_states_.assign(params.batch_size, StopSequences::c_initial_state);
+  }
+
+  if (params.search.logprobs) {
+    top_logprobs_count_ = params.search.top_logprobs;
+    logprob_rows_ = std::make_unique<float[]>(GetThreadPool().GetThreadCount() * params.vocab_size);
+    token_logprobs_.resize(params.batch_size);
+    top_tokens_.resize(params.batch_size * top_logprobs_count_);
+    top_logprobs_.resize(params.batch_size * top_logprobs_count_);
+  }
 }
 
 BeamSearch_Cpu::BeamSearch_Cpu(const GeneratorParams& params)
     : Search_Cpu(params) {
   assert(params_->search.num_beams > 1);  // If 1, use GreedySearch
   beam_scorer_ = std::make_unique<BeamSearchScorer>(*params_);
+
+  const size_t top_k_size = 2 * params_->search.num_beams * params_->batch_size;
+  next_scores_buffer_ = AllocateArray<float>(top_k_size, &next_scores_);
+  next_indices_buffer_ = AllocateArray<int32_t>(top_k_size, &next_indices_);
+  next_tokens_topk_buffer_ = AllocateArray<int32_t>(top_k_size, &next_tokens_topk_);
 }
 
 BeamSearch_Cpu::~BeamSearch_Cpu() = default;
@@ -62,71 +109,60 @@ int Search_Cpu::GetSequenceLength() const {
 }
 
 void BeamSearch_Cpu::SelectTop() {
-  // Normalize next token scores
-  for (int i = 0; i < params_->BatchBeamSize(); i++) {
-    std::span<float> const scores = next_token_scores_.subspan(static_cast<size_t>(i) * static_cast<size_t>(params_->vocab_size), params_->vocab_size);
-    LogSoftMax(scores, 1.0);
-  }
-
+  const size_t num_beams = static_cast<size_t>(params_->search.num_beams);
+  const size_t vocab_size = static_cast<size_t>(params_->vocab_size);
+  const size_t num_beam_groups = static_cast<size_t>(params_->search.num_beam_groups);
+  const size_t group_size = num_beams / num_beam_groups;
+  const size_t top_k = 2 * group_size;
+  const float diversity_penalty = params_->search.diversity_penalty;
   auto beam_scores = beam_scorer_->GetNextScores();
-
-  // Add beam score to next token scores. Corresponding python code is like:
-  //    next_token_scores = next_token_scores + beam_scores[:, None].expand_as(next_token_scores)
-  // TODO(aciddelgado): use thread pool to parallel
-  int offset = 0;
-  int batch_beam_index = 0;
-  for (int i = 0; i < params_->batch_size; i++) {
-    for (int j = 0; j < params_->search.num_beams; j++, batch_beam_index++) {
-      for (int k = 0; k < params_->vocab_size; k++, offset++) {
-        next_token_scores_[offset] += beam_scores[batch_beam_index];
+  auto beam_tokens = beam_scorer_->GetNextTokens();
+
+  // Diverse beam search picks the groups one after another, each penalizing the tokens the groups before it picked for
+  // the same batch entry. Without groups it's a single pass
+  for (size_t group = 0; group < num_beam_groups; group++) {
+    // Each batch entry is independent, so they're split across threads
+    ForEachRow(params_->batch_size, group_size * vocab_size, [&](size_t batch_index, size_t /*thread_index*/) {
+      const size_t first_beam = batch_index * num_beams + group * group_size;
+      auto token_scores_sub = next_token_scores_.subspan(first_beam * vocab_size, group_size * vocab_size);
+
+      // Normalize next token scores and add the beam score. Corresponding python code is like:
+      //    next_token_scores = log_softmax(next_token_scores) + beam_scores[:, None].expand_as(next_token_scores)
+      for (size_t beam_index = 0; beam_index < group_size; beam_index++) {
+        std::span<float> const scores = token_scores_sub.subspan(beam_index * vocab_size, vocab_size);
+        LogSoftMax(scores, 1.0);
+        if (diversity_penalty != 0.0f) {
+          for (size_t picked = batch_index * num_beams; picked < first_beam; picked++)
+            scores[beam_tokens[picked]] -= diversity_penalty;
+        }
+        float const beam_score = beam_scores[first_beam + beam_index];
+        for (float& score : scores)
+          score += beam_score;
       }
-    }
-  }
-
-  const size_t top_k = 2 * params_->search.num_beams;
-
-  struct ScoreIndex {
-    float score;
-    int32_t index;
-
-    bool operator<(const ScoreIndex& s) const { return score < s.score; }
-  };
 
-  auto scores = std::make_unique<float[]>(top_k * params_->batch_size);     // Score of top_k tokens
-  auto indices = std::make_unique<int32_t[]>(top_k * params_->batch_size);  // beam index of top_k tokens
-  auto tokens = std::make_unique<int32_t[]>(top_k * params_->batch_size);   // token id of top_k tokens
-
-  auto next_scores = std::span<float>(scores.get(), top_k * params_->batch_size);
-  auto next_indices = std::span<int32_t>(indices.get(), top_k * params_->batch_size);
-  auto next_tokens = std::span<int32_t>(tokens.get(), top_k * params_->batch_size);
-
-  // TODO(aciddelgado): Optimize this top k with partial sort
-  for (size_t batch_index = 0; batch_index < static_cast<size_t>(params_->batch_size); batch_index++) {
-    std::priority_queue<ScoreIndex, std::vector<ScoreIndex>> queue;
-    auto token_scores_sub = next_token_scores_.subspan(batch_index * params_->search.num_beams * params_->vocab_size, static_cast<size_t>(params_->search.num_beams) * params_->vocab_size);
-    for (int i = 0; i < token_scores_sub.size(); i++) {
-      queue.push({token_scores_sub[i], i});
-    }
+      // The top_k indices into all of this group's beams go in next_tokens_topk_, then get split into beam & token
+      const size_t scorer_batch_index = batch_index * num_beam_groups + group;
+      auto next_indices_sub = next_indices_.subspan(top_k * scorer_batch_index, top_k);
+      auto next_tokens_sub = next_tokens_topk_.subspan(top_k * scorer_batch_index, top_k);
+      auto next_scores_sub = next_scores_.subspan(top_k * scorer_batch_index, top_k);
+      top_k_indices(next_tokens_sub, token_scores_sub);
+      for (size_t i = 0; i < top_k; i++) {
+        auto const index = next_tokens_sub[i];
+        next_scores_sub[i] = token_scores_sub[index];
+        next_indices_sub[i] = index / params_->vocab_size;
+        next_tokens_sub[i] = index % params_->vocab_size;
+      }
+    });
 
-    auto next_indices_sub = next_indices.subspan(top_k * batch_index, top_k);
-    auto next_tokens_sub = next_tokens.subspan(top_k * batch_index, top_k);
-    auto next_scores_sub = next_scores.subspan(top_k * batch_index, top_k);
-    for (unsigned i = 0; i < top_k; i++) {
-      auto v = queue.top();
-      next_indices_sub[i] = v.index / params_->vocab_size;
-      next_tokens_sub[i] = v.index % params_->vocab_size;
-      next_scores_sub[i] = v.score;
-      queue.pop();
-    }
+    beam_scorer_->Process(sequences_, next_scores_, next_tokens_topk_, next_indices_, num_beam_groups > 1 ? static_cast<int>(group) : -1);
   }
 
 #if 0
-  DumpSpan(std::cout, next_tokens);
+  DumpSpan(std::cout, next_tokens_topk_);
   DumpSpan(std::cout, next_indices_);
   DumpSpan(std::cout, next_scores_);
 #endif
 
-  beam_scorer_->Process(sequences_, next_scores, next_tokens, next_indices);
   next_tokens_ = beam_scorer_->GetNextTokens();
 
   AppendNextTokensToSequences();
@@ -134,90 +170,255 @@ void BeamSearch_Cpu::SelectTop() {
 
 void GreedySearch_Cpu::SelectTop() {
   // next_tokens = torch.argmax(scores, dim=-1)
+  PickNextTokens([&](size_t batch_id, size_t /*thread_index*/) { return PickTop(batch_id); });
+}
+
+namespace {
+
+// Probabilities are non negative floats, so their bit patterns order the same way their values do. The exponent and
+// top 3 mantissa bits split [0, 1] into bins that each cover an 8th of an octave
+constexpr int c_top_p_bin_shift = 20;
+constexpr size_t c_top_p_bin_count = 1024;
+
+size_t GetTopPBin(float probability) {
+  uint32_t bits;
+  std::memcpy(&bits, &probability, sizeof(bits));
+  return std::min<size_t>(bits >> c_top_p_bin_shift, c_top_p_bin_count - 1);
+}
+
+// Orders by descending score, with ties going to the lower token id so the order is deterministic
+auto GreaterScore(const float* scores) {
+  return [scores](int32_t i, int32_t j) { return scores[i] > scores[j] || (scores[i] == scores[j] && i < j); };
+}
+
+}  // namespace
+
+template <typename PickToken>
+void GreedySearch_Cpu::PickNextTokens(PickToken pick_token) {
+  // The latency path of interactive traffic, without the row loops or the copies for the log probabilities
+  if (params_->batch_size == 1 && !logprob_rows_) {
+    if (!PadIfAlreadyEOS(0)) {
+      const int32_t pick = pick_token(0, 0);
+      SetNextToken(0, params_->logits_token_ids.empty() ? pick : params_->logits_token_ids[pick]);
+    }
+    AppendNextTokensToSequences();
+    return;
+  }
+
+  ForEachRow(params_->batch_size, params_->vocab_size, [&](size_t batch_id, size_t thread_index) {
+    if (eos_seen_[batch_id]) {
+      if (logprob_rows_)
+        KeepLogProbs(batch_id, {});
+      return;
+    }
+    if (!logprob_rows_) {
+      next_tokens_[batch_id] = pick_token(batch_id, thread_index);
+      return;
+    }
+    auto scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
+    auto* row = logprob_rows_.get() + thread_index * params_->vocab_size;
+    std::copy(scores.begin(), scores.end(), row);
+    next_tokens_[batch_id] = pick_token(batch_id, thread_index);
+    KeepLogProbs(batch_id, {row, scores.size()});
+  });
+
+  // SetNextToken updates the EOS state shared by every batch entry, so this part runs in order on this thread
   for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
     if (PadIfAlreadyEOS(batch_id)) {
       continue;
     }
-
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    auto const token = static_cast<int32_t>(std::distance(scores.begin(), std::max_element(scores.begin(), scores.end())));
-    SetNextToken(batch_id, token);
+    const int32_t pick = next_tokens_[batch_id];
+    SetNextToken(batch_id, params_->logits_token_ids.empty() ? pick : params_->logits_token_ids[pick]);  // Else the pick is a logits row
   }
-
   AppendNextTokensToSequences();
 }
 
-void GreedySearch_Cpu::SampleTopK(int k, float temperature) {
+void GreedySearch_Cpu::PrepareSampling() {
+  // One set of scratch buffers per thread pool thread
+  if (!sample_indices_buffer_) {
+    const size_t thread_count = GetThreadPool().GetThreadCount();
+    sample_indices_buffer_ = AllocateArray<int32_t>(thread_count * params_->vocab_size, &sample_indices_);
+    top_p_bin_mass_ = std::make_unique<float[]>(thread_count * c_top_p_bin_count);
+  }
+
   for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    SoftMax(scores, temperature);
-    // Find the top K scores
-    std::vector<int> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::partial_sort(indices.begin(), indices.begin() + k, indices.end(), [scores = scores.data()](int i, int j) { return scores[i] > scores[j]; });
-    // Sample a token from the top K
-    std::discrete_distribution<> dis(scores.begin(), scores.begin() + k);
-    SetNextToken(batch_id, indices[dis(gen_)]);
+    if (!eos_seen_[batch_id])
+      random_values_[batch_id] = RandomUniform(random_streams_[batch_id], random_step_);
   }
-  AppendNextTokensToSequences();
+  random_step_++;
 }
 
-void GreedySearch_Cpu::SampleTopP(float p, float temperature) {
-  std::uniform_real_distribution<float> dis(0, p);
-  for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
-    if (PadIfAlreadyEOS(batch_id)) {
+// Returns the indices of the k highest scores in descending order, in sample_indices_. nth_element partitions the
+// vocab in linear time, so only the k winners get sorted.
+std::span<int32_t> GreedySearch_Cpu::SelectTopK(std::span<const float> scores, int k, size_t thread_index) {
+  auto indices = sample_indices_.subspan(thread_index * params_->vocab_size, scores.size());
+  std::iota(indices.begin(), indices.end(), 0);
+  auto top_k = indices.subspan(0, std::min(static_cast<size_t>(k), indices.size()));
+  std::nth_element(indices.begin(), top_k.end(), indices.end(), GreaterScore(scores.data()));
+  std::sort(top_k.begin(), top_k.end(), GreaterScore(scores.data()));
+  return top_k;
+}
+
+// Returns the first token in descending probability order where the cumulative probability reaches the threshold.
+// Instead of sorting the vocab, one pass builds a histogram of the probability mass by bin. Walking the bins from the top
+// finds the bin the threshold lands in, and only the tokens of that bin get sorted.
+int32_t GreedySearch_Cpu::SelectTopP(std::span<const float> probabilities, float threshold, size_t thread_index) {
+  std::span<float> bin_mass{top_p_bin_mass_.get() + thread_index * c_top_p_bin_count, c_top_p_bin_count};
+  std::fill(bin_mass.begin(), bin_mass.end(), 0.0f);
+  for (float probability : probabilities)
+    bin_mass[GetTopPBin(probability)] += probability;
+
+  // If rounding keeps the threshold from being reached, this ends on the lowest bin, same as running off the end of a sort
+  size_t target_bin = c_top_p_bin_count;
+  for (size_t bin = c_top_p_bin_count; bin-- > 0;) {
+    if (bin_mass[bin] == 0.0f)
       continue;
-    }
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    SoftMax(scores, temperature);
-    // Sort an array of indices into the scores
-    std::vector<int32_t> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::sort(indices.begin(), indices.end(), [scores = scores.data()](int32_t i, int32_t j) { return scores[i] > scores[j]; });
-    // Sample a probability threshold
-    float threshold = dis(gen_);
-    int32_t token = 0;
-    // Find the first token where the cumulative probability exceeds the threshold
-    for (int i = 0; i < scores.size(); i++) {
-      threshold -= scores[indices[i]];
-      if (threshold > 0) {
-        continue;
-      }
-      token = indices[i];
+    target_bin = bin;
+    if (threshold <= bin_mass[bin])
       break;
-    }
-    SetNextToken(batch_id, token);
+    threshold -= bin_mass[bin];
   }
-  AppendNextTokensToSequences();
+  if (target_bin == c_top_p_bin_count)
+    return 0;
+
+  auto indices = sample_indices_.subspan(thread_index * params_->vocab_size, probabilities.size());
+  size_t count = 0;
+  for (size_t i = 0; i < probabilities.size(); i++) {
+    if (GetTopPBin(probabilities[i]) == target_bin)
+      indices[count++] = static_cast<int32_t>(i);
+  }
+  auto candidates = indices.subspan(0, count);
+  std::sort(candidates.begin(), candidates.end(), GreaterScore(probabilities.data()));
+
+  for (int32_t token : candidates) {
+    threshold -= probabilities[token];
+    if (threshold <= 0)
+      return token;
+  }
+  return candidates.back();
 }
 
-void GreedySearch_Cpu::SampleTopKTopP(int k, float p, float temperature) {
-  std::uniform_real_distribution<float> dis(0, p);
-  for (size_t batch_id = 0; batch_id < params_->batch_size; batch_id++) {
-    if (PadIfAlreadyEOS(batch_id)) {
+int32_t GreedySearch_Cpu::PickTop(size_t batch_id) const {
+  std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
+  return static_cast<int32_t>(std::distance(scores.begin(), std::max_element(scores.begin(), scores.end())));
+}
+
+int32_t GreedySearch_Cpu::PickTopK(size_t batch_id, size_t thread_index, int k, float temperature) {
+  std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
+  // Find the top K scores, the softmax over just them gives the same distribution as over the whole vocab
+  auto const top_k = SelectTopK(scores, k, thread_index);
+  float const max_score = scores[top_k[0]];
+  float weight_sum = 0.0f;
+  for (int32_t token : top_k) {
+    scores[token] = std::exp((scores[token] - max_score) / temperature);
+    weight_sum += scores[token];
+  }
+  // Sample a token from the top K
+  float threshold = random_values_[batch_id] * weight_sum;
+  for (int32_t token : top_k) {
+    threshold -= scores[token];
+    if (threshold > 0) {
       continue;
     }
-    std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
-    SoftMax(scores, temperature);
-    // Find the top K scores
-    std::vector<int> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::partial_sort(indices.begin(), indices.begin() + k, indices.end(), [scores = scores.data()](int i, int j) { return scores[i] > scores[j]; });
-    // Sample a probability threshold
-    float threshold = dis(gen_);
-    int32_t token = indices[k - 1];
-    // Find the first token where the cumulative probability exceeds the threshold
-    for (int i = 0; i < k; i++) {
-      threshold -= scores[indices[i]];
-      if (threshold > 0) {
-        continue;
-      }
-      token = indices[i];
-      break;
+    return token;
+  }
+  return top_k.back();
+}
+
+int32_t GreedySearch_Cpu::PickTopP(size_t batch_id, size_t thread_index, float p, float temperature) {
+  std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
+  SoftMax(scores, temperature);
+  // Sample a probability threshold, then find the first token where the cumulative probability exceeds it
+  return SelectTopP(scores, random_values_[batch_id] * p, thread_index);
+}
+
+int32_t GreedySearch_Cpu::PickTopKTopP(size_t batch_id, size_t thread_index, int k, float p, float temperature) {
+  std::span<float> const scores = next_token_scores_.subspan(batch_id * params_->vocab_size, params_->vocab_size);
+  SoftMax(scores, temperature);
+  // Find the top K scores
+  auto const top_k = SelectTopK(scores, k, thread_index);
+  // Sample a probability threshold
+  float threshold = random_values_[batch_id] * p;
+  // Find the first token where the cumulative probability exceeds the threshold
+  for (int32_t token : top_k) {
+    threshold -= scores[token];
+    if (threshold > 0) {
+      continue;
     }
-    SetNextToken(batch_id, token);
+    return token;
   }
-  AppendNextTokensToSequences();
+  return top_k.back();
+}
+
+void GreedySearch_Cpu::SampleTopK(int k, float temperature) {
+  PrepareSampling();
+  PickNextTokens([&](size_t batch_id, size_t thread_index) { return PickTopK(batch_id, thread_index, k, temperature); });
+}
+
+void GreedySearch_Cpu::SampleTopP(float p, float temperature) {
+  PrepareSampling();
+  PickNextTokens([&](size_t batch_id, size_t thread_index) { return PickTopP(batch_id, thread_index, p, temperature); });
+}
+
+void GreedySearch_Cpu::SampleTopKTopP(int k, float p, float temperature) {
+  PrepareSampling();
+  PickNextTokens([&](size_t batch_id, size_t thread_index) { return PickTopKTopP(batch_id, thread_index, k, p, temperature); });
+}
+
+void GreedySearch_Cpu::SampleRows() {
+  PrepareSampling();
+  PickNextTokens([&](size_t batch_id, size_t thread_index) {
+    // The same choice Generator::GenerateNextToken makes for the whole batch
+    const auto& search = params_->GetRowSearch(batch_id);
+    if (!search.do_sample || search.top_k == 1)
+      return PickTop(batch_id);
+    if (search.top_p > 0.0f && search.top_p < 1.0f && search.top_k > 1)
+      return PickTopKTopP(batch_id, thread_index, search.top_k, search.top_p, search.temperature);
+    if (search.top_k > 1)
+      return PickTopK(batch_id, thread_index, search.top_k, search.temperature);
+    return PickTopP(batch_id, thread_index, search.top_p, search.temperature);
+  });
+}
+
+void GreedySearch_Cpu::KeepLogProbs(size_t batch_id, std::span<const float> scores) {
+  auto top_tokens = std::span<int32_t>{top_tokens_}.subspan(batch_id * top_logprobs_count_, top_logprobs_count_);
+  auto top_logprobs = std::span<float>{top_logprobs_}.subspan(batch_id * top_logprobs_count_, top_logprobs_count_);
+  if (scores.empty()) {
+    token_logprobs_[batch_id] = 0.0f;
+    std::fill(top_tokens.begin(), top_tokens.end(), params_->pad_token_id);
+    std::fill(top_logprobs.begin(), top_logprobs.end(), 0.0f);
+    return;
+  }
+
+  const float max = *std::max_element(scores.begin(), scores.end());
+  float sum = 0.0f;
+  for (auto score : scores)
+    sum += std::exp(score - max);
+  const float log_sum = max + std::log(sum);
+  token_logprobs_[batch_id] = scores[next_tokens_[batch_id]] - log_sum;
+
+  // The few most likely tokens are kept sorted by inserting each better one, in GreaterScore order
+  size_t count = 0;
+  const auto greater = GreaterScore(scores.data());
+  for (int32_t token = 0; !top_tokens.empty() && token < static_cast<int32_t>(scores.size()); token++) {
+    if (count == top_tokens.size() && !greater(token, top_tokens[count - 1]))
+      continue;
+    size_t i = std::min(count, top_tokens.size() - 1);
+    for (; i > 0 && greater(token, top_tokens[i - 1]); i--)
+      top_tokens[i] = top_tokens[i - 1];
+    top_tokens[i] = token;
+    count = std::min(count + 1, top_tokens.size());
+  }
+  for (size_t i = 0; i < top_tokens.size(); i++)
+    top_logprobs[i] = scores[top_tokens[i]] - log_sum;
+}
+
+void GreedySearch_Cpu::GetLogProbs(std::span<float> token_logprobs, std::span<int32_t> top_tokens, std::span<float> top_logprobs) {
+  if (!logprob_rows_)
+    Search::GetLogProbs(token_logprobs, top_tokens, top_logprobs);
+  std::copy(token_logprobs_.begin(), token_logprobs_.end(), token_logprobs.begin());
+  std::copy(top_tokens_.begin(), top_tokens_.end(), top_tokens.begin());
+  std::copy(top_logprobs_.begin(), top_logprobs_.end(), top_logprobs.begin());
 }
 
 bool GreedySearch_Cpu::PadIfAlreadyEOS(size_t batch_id) {
@@ -232,7 +433,15 @@ bool GreedySearch_Cpu::PadIfAlreadyEOS(size_t batch_id) {
 
 void GreedySearch_Cpu::SetNextToken(size_t batch_id, int32_t token) {
   next_tokens_[batch_id] = token;
-  if (token == params_->eos_token_id) {
+  bool stopped = false;
+  if (stop_sequences_) {
+    stop_states_[batch_id] = stop_sequences_->Advance(stop_states_[batch_id], token);
+    stopped = stop_sequences_->IsMatch(stop_states_[batch_id]);
+  }
+  // A batch entry with a max_length of its own is done once this token reaches it
+  if (!params_->row_search.empty() && sequences_.GetSequenceLength() + 1 == params_->GetRowSearch(batch_id).max_length)
+    stopped = true;
+  if (token == params_->eos_token_id || stopped) {
     eos_seen_[batch_id] = true;
     if (g_log.enabled && g_log.hit_eos)
       Log("hit_eos", "EOS seen on batch " + std::to_string(batch_id));
@@ -244,6 +453,10 @@ void GreedySearch_Cpu::SetNextToken(size_t batch_id, int32_t token) {
 
 void GreedySearch_Cpu::AppendNextTokensToSequences() {
   sequences_.AppendNextTokenToSequences(next_tokens_);
+  if (token_counts_)
+    token_counts_->Append(next_tokens_);
+  if (ngram_index_)
+    ngram_index_->Append(next_tokens_);
 
   if (sequences_.GetSequenceLength() == params_->search.max_length) {
     if (g_log.enabled && g_log.hit_max_length)
@@ -263,6 +476,10 @@ bool BeamSearch_Cpu::IsDone() const {
 
 void BeamSearch_Cpu::AppendNextTokensToSequences() {
   sequences_.AppendNextTokenToSequences(beam_scorer_->GetNextIndicesCPU(), beam_scorer_->GetNextTokens());
+  if (token_counts_)
+    token_counts_->Append(beam_scorer_->GetNextIndicesCPU(), beam_scorer_->GetNextTokens());
+  if (ngram_index_)
+    ngram_index_->Append(beam_scorer_->GetNextIndicesCPU(), beam_scorer_->GetNextTokens());
 
   if (sequences_.GetSequenceLength() == params_->search.max_length) {
     if (g_log.enabled && g_log.hit_max_length)
@@ -282,15 +499,13 @@ RoamingArray<int32_t> BeamSearch_Cpu::GetSequence(size_t index) {
   size_t batch_id = index / params_->search.num_return_sequences;
   size_t beam_id = index % params_->search.num_return_sequences;
   Finalize(params_->search.num_return_sequences);
-  BeamHypotheses beam_hyp = beam_scorer_->GetBeamHypotheses(batch_id);
-  return beam_hyp.GetHypothesis(beam_id);
+  return beam_scorer_->GetHypothesis(batch_id, beam_id);
 }
 
 // TODO(aciddelgado): my question is, should this return copy or reference?
 RoamingArray<int32_t> BeamSearch_Cpu::GetSequence(size_t batch_id, size_t beam_id) {
   Finalize(params_->search.num_return_sequences);
-  BeamHypotheses beam_hyp = beam_scorer_->GetBeamHypotheses(batch_id);
-  return beam_hyp.GetHypothesis(beam_id);
+  return beam_scorer_->GetHypothesis(batch_id, beam_id);
 }
 
 std::span<float> Search_Cpu::GetScores(int batch_beam_index) const {
@@ -306,33 +521,220 @@ void Search_Cpu::ApplyMinLength(int min_length) {
   const int batch_beam_size = params_->BatchBeamSize();
   for (int i = 0; i < batch_beam_size; i++) {
     std::span<float> const beam_token_scores = GetScores(i);
-    beam_token_scores[params_->eos_token_id] = std::numeric_limits<float>::lowest();
+    beam_token_scores[params_->eos_logits_index] = std::numeric_limits<float>::lowest();
   }
 }
 
-void Search_Cpu::ApplyRepetitionPenalty(float penalty) {
-  if (penalty == 1.0f)
+void Search_Cpu::ApplyPenalties(float repetition_penalty, float presence_penalty, float frequency_penalty) {
+  if (repetition_penalty == 1.0f && presence_penalty == 0.0f && frequency_penalty == 0.0f)
     return;
 
+  auto& token_counts = GetTokenCounts();
+  const int batch_beam_size = params_->BatchBeamSize();
+  for (int i = 0; i < batch_beam_size; i++)
+    token_counts.Penalize(i, GetScores(i), repetition_penalty, presence_penalty, frequency_penalty);
+}
+
+void Search_Cpu::ApplyRowPenalties() {
   const int batch_beam_size = params_->BatchBeamSize();
   for (int i = 0; i < batch_beam_size; i++) {
-    std::span<float> const beam_token_scores = GetScores(i);
-    std::span<const int32_t> const sequence = sequences_.GetSequence(i);
+    const auto& search = params_->GetRowSearch(i);
+    if (search.repetition_penalty != 1.0f || search.presence_penalty != 0.0f || search.frequency_penalty != 0.0f)
+      GetTokenCounts().Penalize(i, GetScores(i), search.repetition_penalty, search.presence_penalty, search.frequency_penalty);
+  }
+}
 
-    // Find unique word IDs in sequence.
-    std::unordered_set<int32_t> unique_word_ids;
-    for (const auto& word_id : sequence) {
-      unique_word_ids.insert(word_id);
-    }
+TokenCounts& Search_Cpu::GetTokenCounts() {
+  if (!token_counts_)
+    token_counts_.emplace(sequences_, params_->BatchBeamSize(), params_->vocab_size, params_->sequence_length);
+  return *token_counts_;
+}
+
+TokenCounts::TokenCounts(Sequences& sequences, int batch_beam_size, int vocab_size, int prompt_length)
+    : vocab_size_{static_cast<size_t>(vocab_size)},
+      counts_(batch_beam_size * vocab_size_),
+      tokens_(batch_beam_size) {
+  for (int i = 0; i < batch_beam_size; i++) {
+    std::span<const int32_t> sequence = sequences.GetSequence(i);
+    for (size_t j = 0; j < sequence.size(); j++)
+      Add(i, sequence[j], j >= static_cast<size_t>(prompt_length));
+  }
+}
 
-    for (const int32_t word_id : unique_word_ids) {
-      float const score = beam_token_scores[word_id];
+void TokenCounts::Add(size_t batch_beam_index, int32_t token, int generated) {
+  auto& count = counts_[batch_beam_index * vocab_size_ + token];
+  if (count == 0) {
+    tokens_[batch_beam_index].push_back(token);
+    count = 1;
+  }
+  count += generated;
+}
+
+void TokenCounts::Append(std::span<const int32_t> next_tokens) {
+  for (size_t i = 0; i < next_tokens.size(); i++)
+    Add(i, next_tokens[i], 1);
+}
+
+void TokenCounts::Append(std::span<const int32_t> batch_beam_indices, std::span<const int32_t> batch_beam_next_tokens) {
+  if (next_counts_.empty()) {
+    next_counts_.resize(counts_.size());
+    next_tokens_.resize(tokens_.size());
+  }
+
+  // Each slot's next row only has to clear the tokens it had and copy those of the slot it continues
+  for (size_t i = 0; i < batch_beam_indices.size(); i++) {
+    auto* next_row = next_counts_.data() + i * vocab_size_;
+    for (auto token : next_tokens_[i])
+      next_row[token] = 0;
+
+    const size_t parent = batch_beam_indices[i];
+    const auto* row = counts_.data() + parent * vocab_size_;
+    next_tokens_[i] = tokens_[parent];
+    for (auto token : next_tokens_[i])
+      next_row[token] = row[token];
+  }
+  counts_.swap(next_counts_);
+  tokens_.swap(next_tokens_);
+
+  for (size_t i = 0; i < batch_beam_next_tokens.size(); i++)
+    Add(i, batch_beam_next_tokens[i], 1);
+}
 
-      // If score < 0, then repetition penalty > 1.0 has to multiplied to reduce the previous token probability,
-      // This assumes that scores are either positive (like ctrl) or negative (like GPT-2), but not a mixture.
-      beam_token_scores[word_id] = (score < 0 ? score * penalty : score / penalty);
+void TokenCounts::Penalize(size_t batch_beam_index, std::span<float> scores, float repetition_penalty, float presence_penalty, float frequency_penalty) const {
+  const auto* row = counts_.data() + batch_beam_index * vocab_size_;
+  for (const int32_t token : tokens_[batch_beam_index]) {
+    float score = scores[token];
+
+    // If score < 0, then repetition penalty > 1.0 has to multiplied to reduce the previous token probability,
+    // This assumes that scores are either positive (like ctrl) or negative (like GPT-2), but not a mixture.
+    if (repetition_penalty != 1.0f)
+      score = score < 0 ? score * repetition_penalty : score / repetition_penalty;
+    if (const int generated = row[token] - 1; generated > 0)
+      score -= presence_penalty + generated * frequency_penalty;
+    scores[token] = score;
+  }
+}
+
+void Search_Cpu::ApplyNoRepeatNgram(int ngram_size) {
+  if (ngram_size < 1)
+    return;
+
+  if (!ngram_index_)
+    ngram_index_.emplace(sequences_, params_->BatchBeamSize(), ngram_size);
+  const int batch_beam_size = params_->BatchBeamSize();
+  for (int i = 0; i < batch_beam_size; i++)
+    ngram_index_->Ban(i, GetScores(i));
+}
+
+NgramIndex::NgramIndex(Sequences& sequences, int batch_beam_size, int ngram_size)
+    : prefix_size_{static_cast<size_t>(ngram_size - 1)},
+      rows_(batch_beam_size) {
+  if (prefix_size_ > 0) {
+    oldest_weight_ = 1;
+    for (size_t i = 1; i < prefix_size_; i++)
+      oldest_weight_ *= c_hash_base;
+  }
+  for (int i = 0; i < batch_beam_size; i++) {
+    std::span<const int32_t> sequence = sequences.GetSequence(i);
+    for (int32_t token : sequence)
+      Add(rows_[i], token);
+  }
+}
+
+void NgramIndex::Add(Row& row, int32_t token) const {
+  // The token completes the n-gram of the last n - 1 tokens, then the hash rolls over to end with it
+  const size_t length = row.tokens.size();
+  if (length >= prefix_size_)
+    row.ngrams[row.hash].push_back(length - prefix_size_);
+  if (prefix_size_ > 0) {
+    if (length >= prefix_size_)
+      row.hash -= static_cast<uint32_t>(row.tokens[length - prefix_size_]) * oldest_weight_;
+    row.hash = row.hash * c_hash_base + static_cast<uint32_t>(token);
+  }
+  row.tokens.push_back(token);
+}
+
+void NgramIndex::Append(std::span<const int32_t> next_tokens) {
+  for (size_t i = 0; i < next_tokens.size(); i++)
+    Add(rows_[i], next_tokens[i]);
+}
+
+void NgramIndex::Append(std::span<const int32_t> batch_beam_indices, std::span<const int32_t> batch_beam_next_tokens) {
+  // Rows continuing themselves stay in place. A replaced row that other slots continue is set aside first, and its last
+  // slot takes it over, so only the rows continued by more than one slot are copied
+  std::vector<size_t> remaining(rows_.size());
+  std::vector<std::optional<Row>> replaced(rows_.size());
+  for (size_t i = 0; i < batch_beam_indices.size(); i++) {
+    const size_t parent = batch_beam_indices[i];
+    if (parent == i)
+      continue;
+    remaining[parent]++;
+    if (static_cast<size_t>(batch_beam_indices[parent]) != parent && !replaced[parent])
+      replaced[parent] = std::move(rows_[parent]);
+  }
+  for (size_t i = 0; i < batch_beam_indices.size(); i++) {
+    const size_t parent = batch_beam_indices[i];
+    if (parent == i)
+      continue;
+    if (!replaced[parent])
+      rows_[i] = rows_[parent];
+    else if (--remaining[parent] > 0)
+      rows_[i] = *replaced[parent];
+    else
+      rows_[i] = std::move(*replaced[parent]);
+  }
+
+  for (size_t i = 0; i < batch_beam_next_tokens.size(); i++)
+    Add(rows_[i], batch_beam_next_tokens[i]);
+}
+
+void NgramIndex::Ban(size_t batch_beam_index, std::span<float> scores) const {
+  const Row& row = rows_[batch_beam_index];
+  const size_t length = row.tokens.size();
+  if (length < prefix_size_)
+    return;
+  auto ngrams = row.ngrams.find(row.hash);
+  if (ngrams == row.ngrams.end())
+    return;
+
+  // Hashes can collide, so the n-grams are checked to really start with the last n - 1 tokens
+  const auto* last = row.tokens.data() + length - prefix_size_;
+  for (size_t start : ngrams->second) {
+    if (std::equal(last, last + prefix_size_, row.tokens.data() + start))
+      scores[row.tokens[start + prefix_size_]] = std::numeric_limits<float>::lowest();
+  }
+}
+
+void Search_Cpu::ApplyTokenConstraint(const TokenConstraint& constraint, std::span<const int32_t> states) {
+  const int batch_beam_size = params_->BatchBeamSize();
+  const size_t vocab_size = params_->vocab_size;
+  for (int i = 0; i < batch_beam_size; i++) {
+    std::span<float> const beam_token_scores = GetScores(i);
+    auto mask = constraint.GetMask(states[i]);
+
+    // Most words of a mask allow all or none of their tokens, so those skip the per token bit checks
+    for (size_t word = 0; word < mask.size(); word++) {
+      const uint32_t bits = mask[word];
+      if (bits == ~0U)
+        continue;
+      const size_t start = word * 32, end = std::min(start + 32, vocab_size);
+      if (bits == 0) {
+        std::fill(beam_token_scores.begin() + start, beam_token_scores.begin() + end, std::numeric_limits<float>::lowest());
+        continue;
+      }
+      for (size_t token = start; token < end; token++) {
+        if (!(bits & (1U << (token - start))))
+          beam_token_scores[token] = std::numeric_limits<float>::lowest();
+      }
     }
   }
 }
 
-}  // namespace Generators
\ No newline at end of file
+void Search_Cpu::ApplyLogitsProcessors(std::span<const LogitsProcessor> processors) {
+  LogitsProcessorContext context{cpu_span<float>{next_token_scores_}, sequences_.GetSequences(), params_->BatchBeamSize(), params_->vocab_size,
+                                 sequences_.GetCapacity(), GetSequenceLength(), DeviceType::CPU, nullptr};
+  for (auto& processor : processors)
+    processor(context);
+}
+
+}  // namespace Generators
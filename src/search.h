@@ -1,10 +1,16 @@
 #include "sequences.h"
 #include <random>
 #include "beam_search_scorer.h"
+#include "stop_sequences.h"
+#include "philox.h"
 #pragma once
 
 namespace Generators {
 
+// The random streams of the batch entries, from their search.random_seed. The entries without one share a seed from the
+// random device, so a batch entry that sets its own is sampled the same whatever it's batched with
+std::vector<RandomStream> GetRandomStreams(const GeneratorParams& params);
+
 struct Search {
   Search(const GeneratorParams& params) : params_{params.shared_from_this()} {}
   virtual ~Search() = default;
@@ -16,20 +22,95 @@ struct Search {
   virtual RoamingArray<int32_t> GetSequence(size_t index) = 0;
 
   virtual void SetLogits(RoamingArray<float> logits) = 0;
+  // Called after SetLogits when its (device) logits still have to be filled from these fp16 ones, which the cuda search
+  // does in its first pass over them
+  virtual void SetFp16Logits(const uint16_t* /*logits_fp16*/) { assert(false); }
   virtual bool IsDone() const = 0;
+  // Which batch beam entries have finished, if the search knows without waiting for the device, otherwise empty. Only
+  // greedy searches track them, see Config::Search::compact_finished_rows
+  virtual std::span<const bool> GetFinishedRows() const { return {}; }
 
   virtual void SelectTop() = 0;
   virtual void SampleTopP(float /*p*/, float /*temperature*/) { assert(false); }
   virtual void SampleTopK(int /*k*/, float /*temperature*/) { assert(false); }
   virtual void SampleTopKTopP(int /*k*/, float /*p*/, float /*temperature*/) { assert(false); }
+  // Picks every batch entry's token by its own GeneratorParams::row_search settings, like the calls above would for it
+  virtual void SampleRows() { assert(false); }
+
+  // With search.logprobs, copies out the log probabilities of the last step's tokens, of the scores they were picked from
+  // after the logits processing and before any temperature. token_logprobs has one per batch entry, top_tokens and
+  // top_logprobs have search.top_logprobs per batch entry, most likely first. Finished entries get 0 and pad tokens.
+  virtual void GetLogProbs(std::span<float> /*token_logprobs*/, std::span<int32_t> /*top_tokens*/, std::span<float> /*top_logprobs*/) {
+    throw std::runtime_error("Log probabilities are only kept by greedy searches with search.logprobs set");
+  }
 
   // Scoring features
   virtual void ApplyMinLength(int min_length) = 0;
-  virtual void ApplyRepetitionPenalty(float penalty) = 0;
+  // The repetition penalty scales the score of every token already in the sequence, the presence and frequency penalties
+  // are subtracted from the scores of the tokens generated after the prompt, the latter once per time it was generated
+  virtual void ApplyPenalties(float repetition_penalty, float presence_penalty, float frequency_penalty) = 0;
+  virtual void ApplyRowPenalties() { assert(false); }  // With the penalties of each GeneratorParams::row_search
+  // Bans the tokens that would repeat an n-gram of ngram_size tokens already in the sequence
+  virtual void ApplyNoRepeatNgram(int ngram_size) = 0;
+  // Leaves only the tokens the mask of each sequence's constraint state allows, states has one per batch_beam entry
+  virtual void ApplyTokenConstraint(const TokenConstraint& constraint, std::span<const int32_t> states) = 0;
+  virtual void ApplyLogitsProcessors(std::span<const LogitsProcessor> processors) = 0;
 
   std::shared_ptr<const GeneratorParams> params_;
 };
 
+// How often each token is in each batch_beam's sequence, kept up to date as tokens are appended, so the penalties only
+// visit the distinct tokens of a sequence instead of going through the whole of it every step
+struct TokenCounts {
+  // Counts what the sequences have so far, the tokens from prompt_length on as generated ones
+  TokenCounts(Sequences& sequences, int batch_beam_size, int vocab_size, int prompt_length);
+
+  // Greedy search, each sequence gets its next token
+  void Append(std::span<const int32_t> next_tokens);
+  // Beam search, each slot continues the counts of slot batch_beam_indices[i] with batch_beam_next_tokens[i]
+  void Append(std::span<const int32_t> batch_beam_indices, std::span<const int32_t> batch_beam_next_tokens);
+
+  void Penalize(size_t batch_beam_index, std::span<float> scores, float repetition_penalty, float presence_penalty, float frequency_penalty) const;
+
+ private:
+  void Add(size_t batch_beam_index, int32_t token, int generated);
+
+  size_t vocab_size_;
+  // Shape (batch_beam_size, vocab_size), 0 for the tokens not in the sequence, otherwise 1 + how often it was generated
+  std::vector<int32_t> counts_;
+  std::vector<std::vector<int32_t>> tokens_;  // The distinct tokens of each sequence, the non zero entries of its counts_ row
+
+  // Beam search only, where the next counts are built from the slots the beams continue, then swapped in
+  std::vector<int32_t> next_counts_;
+  std::vector<std::vector<int32_t>> next_tokens_;
+};
+
+// The n-grams of each batch_beam's sequence, by a rolling hash of their first n - 1 tokens, kept up to date as tokens are
+// appended. Banning the tokens that would repeat an n-gram only looks up the hash of the sequence's last n - 1 tokens.
+struct NgramIndex {
+  NgramIndex(Sequences& sequences, int batch_beam_size, int ngram_size);
+
+  // Like TokenCounts::Append
+  void Append(std::span<const int32_t> next_tokens);
+  void Append(std::span<const int32_t> batch_beam_indices, std::span<const int32_t> batch_beam_next_tokens);
+
+  void Ban(size_t batch_beam_index, std::span<float> scores) const;
+
+ private:
+  struct Row {
+    std::vector<int32_t> tokens;                                // The sequence
+    std::unordered_map<uint64_t, std::vector<size_t>> ngrams;  // The start of every n-gram by the hash of its first n - 1 tokens
+    uint64_t hash{};                                            // Of the last n - 1 tokens
+  };
+
+  void Add(Row& row, int32_t token) const;
+
+  static constexpr uint64_t c_hash_base = 0x100000001b3;
+  size_t prefix_size_;        // n - 1
+  uint64_t oldest_weight_{};  // c_hash_base ^ (n - 2), the weight of the oldest token in a hash
+  std::vector<Row> rows_;
+};
+
 struct Search_Cpu : Search {
   Search_Cpu(const GeneratorParams& params);
 
@@ -41,7 +122,11 @@ struct Search_Cpu : Search {
   void SetLogits(RoamingArray<float> logits) override;
 
   void ApplyMinLength(int min_length) override;
-  void ApplyRepetitionPenalty(float penalty) override;
+  void ApplyPenalties(float repetition_penalty, float presence_penalty, float frequency_penalty) override;
+  void ApplyRowPenalties() override;
+  void ApplyNoRepeatNgram(int ngram_size) override;
+  void ApplyTokenConstraint(const TokenConstraint& constraint, std::span<const int32_t> states) override;
+  void ApplyLogitsProcessors(std::span<const LogitsProcessor> processors) override;
 
   std::span<float> GetScores(int batch_beam_index) const;
   Sequences& GetSequences() { return sequences_; }
@@ -55,6 +140,13 @@ struct Search_Cpu : Search {
 
   Sequences sequences_;
   bool done_{};
+
+ protected:
+  std::optional<TokenCounts> token_counts_;  // Made by the first penalty, then kept up to date by the appends
+  std::optional<NgramIndex> ngram_index_;    // Likewise, by the first ApplyNoRepeatNgram
+
+ private:
+  TokenCounts& GetTokenCounts();
 };
 
 struct GreedySearch_Cpu : Search_Cpu {
@@ -62,25 +154,66 @@ struct GreedySearch_Cpu : Search_Cpu {
 
   RoamingArray<int32_t> GetNextTokens() override;
   RoamingArray<int32_t> GetNextIndices() override { return cpu_span<int32_t>{}; }
+  std::span<const bool> GetFinishedRows() const override { return eos_seen_; }
 
   void SelectTop() override;
   void SampleTopK(int k, float temperature) override;
   void SampleTopP(float p, float temperature) override;
   void SampleTopKTopP(int /*k*/, float /*p*/, float /*temperature*/) override;
+  void SampleRows() override;
+
+  void GetLogProbs(std::span<float> token_logprobs, std::span<int32_t> top_tokens, std::span<float> top_logprobs) override;
 
  private:
   bool PadIfAlreadyEOS(size_t batch_id);
   void SetNextToken(size_t batch_id, int32_t token);
   void AppendNextTokensToSequences();
 
+  // Runs pick_token(batch_id, thread_index) for every batch entry that hasn't seen EOS, spread over the thread pool, then
+  // appends the tokens. A template, so every way of picking gets a loop of its own with the pick inlined, and a single
+  // sequence skips the row loops altogether
+  template <typename PickToken>
+  void PickNextTokens(PickToken pick_token);
+
+  // Sampling helpers, they work in the scratch buffers below so no token allocates
+  void PrepareSampling();
+  std::span<int32_t> SelectTopK(std::span<const float> scores, int k, size_t thread_index);
+  int32_t SelectTopP(std::span<const float> probabilities, float threshold, size_t thread_index);
+
+  // The token of a batch entry for each way of picking it, the sampling ones after PrepareSampling
+  int32_t PickTop(size_t batch_id) const;
+  int32_t PickTopK(size_t batch_id, size_t thread_index, int k, float temperature);
+  int32_t PickTopP(size_t batch_id, size_t thread_index, float p, float temperature);
+  int32_t PickTopKTopP(size_t batch_id, size_t thread_index, int k, float p, float temperature);
+
+  // Fills the log probabilities of a batch entry's token from scores, the copy of its row from before the pick
+  void KeepLogProbs(size_t batch_id, std::span<const float> scores);
+
   std::unique_ptr<int32_t[]> next_tokens_buffer_;
-  std::unique_ptr<int32_t[]> temp_topk_buffer_;
+
+  // With search.logprobs, the sampling picks work in place, so each thread copies its row before the pick
+  int top_logprobs_count_{};
+  std::unique_ptr<float[]> logprob_rows_;  // shape (thread_count, vocab_size)
+  std::vector<float> token_logprobs_;      // shape (batch_size)
+  std::vector<int32_t> top_tokens_;        // shape (batch_size, top_logprobs)
+  std::vector<float> top_logprobs_;        // shape (batch_size, top_logprobs)
+
+  std::span<int32_t> sample_indices_;  // shape (thread_count, vocab_size), allocated on the first sample
+  std::unique_ptr<int32_t[]> sample_indices_buffer_;
+  std::unique_ptr<float[]> top_p_bin_mass_;  // Probability mass of each SelectTopP histogram bin, per thread
+
+  std::span<float> random_values_;  // shape (batch_size), the uniform [0, 1) draw of each batch entry for this token
+  std::unique_ptr<float[]> random_values_buffer_;
 
   std::span<bool> eos_seen_;  // shape (batch_size)
   std::unique_ptr<bool[]> eos_seen_buffer_;
   int not_done_count_{params_->batch_size};  // When zero, every batch entry is done (starts at batch_size_)
 
-  std::mt19937 gen_;
+  std::optional<StopSequences> stop_sequences_;  // From params.stop_sequences, if any
+  std::vector<int32_t> stop_states_;             // The stop sequence state of each batch entry
+
+  std::vector<RandomStream> random_streams_;  // shape (batch_size)
+  uint64_t random_step_{};                    // Counts the sampling steps, the counter of each batch entry's draw
 };
 
 struct BeamSearch_Cpu : Search_Cpu {
@@ -104,6 +237,14 @@ struct BeamSearch_Cpu : Search_Cpu {
   bool finalized_{};  // To avoid calling Finalize multiple times
 
   std::unique_ptr<BeamSearchScorer> beam_scorer_;
+
+  // The top 2*num_beams candidates of every batch entry, shape (batch_size, 2*num_beams)
+  std::span<float> next_scores_;
+  std::unique_ptr<float[]> next_scores_buffer_;
+  std::span<int32_t> next_indices_;  // Beam index of each candidate
+  std::unique_ptr<int32_t[]> next_indices_buffer_;
+  std::span<int32_t> next_tokens_topk_;  // Token id of each candidate
+  std::unique_ptr<int32_t[]> next_tokens_topk_buffer_;
 };
 
 }  // namespace Generators
\ No newline at end of file
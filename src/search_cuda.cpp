@@ -1,6 +1,7 @@
 #include "generators.h"
 #include "search.h"
 #include "search_cuda.h"
+#include "constrained_decoding.h"
 #include "beam_search_scorer_cuda.cuh"
 #include "beam_search_scorer_cuda.h"
 #include "beam_search_topk.h"
@@ -17,7 +18,11 @@ void OnCudaError(cudaError_t error) {
 
 Search_Cuda::Search_Cuda(const GeneratorParams& params)
     : Search{params},
+      done_check_interval_{params.search.done_check_interval},
       sequences_{params.input_ids, params.batch_size, params.search.num_beams, params_->search.max_length, params_->cuda_stream} {
+  if (done_check_interval_ < 1)
+    throw std::runtime_error("search.done_check_interval must be 1 or greater, is " + std::to_string(done_check_interval_));
+
   auto batch_beam_size = params.BatchBeamSize();
   sequence_lengths_buffer_ = std::make_unique<int32_t[]>(batch_beam_size);
   sequence_lengths_ = cpu_span<int32_t>(sequence_lengths_buffer_.get(), batch_beam_size);
@@ -27,6 +32,15 @@ Search_Cuda::Search_Cuda(const GeneratorParams& params)
 
   done_cpu_ = CudaMallocHostArray<bool>(1);
   *done_cpu_ = false;
+
+  // With several eos tokens, the model's logits leave choosing between them to the logits processing
+  if (!params.eos_token_ids.empty()) {
+    gpu_span<int32_t> eos_token_ids;
+    eos_token_ids_ = CudaMallocArray<int32_t>(params.eos_token_ids.size(), &eos_token_ids);
+    cudaMemcpyAsync(eos_token_ids.data(), params.eos_token_ids.data(), eos_token_ids.size_bytes(), cudaMemcpyHostToDevice, params_->cuda_stream);
+    logits_processor_.eos_token_ids = eos_token_ids.data();
+    eos_token_ids_count_ = static_cast<int>(eos_token_ids.size());
+  }
 }
 
 GreedySearch_Cuda::GreedySearch_Cuda(const GeneratorParams& params)
@@ -34,17 +48,82 @@ GreedySearch_Cuda::GreedySearch_Cuda(const GeneratorParams& params)
   next_tokens_buffer_ = CudaMallocArray<int32_t>(params.batch_size, &next_tokens_);
   cudaMemsetAsync(next_tokens_.data(), 0, next_tokens_.size_bytes(), params_->cuda_stream);
 
-  unsigned long long random_seed;
-  if (params_->search.random_seed != -1)
-    random_seed = params_->search.random_seed;
-  else
-    random_seed = std::random_device{}();
-  samplingdata_ = std::make_unique<cuda::SamplingData>(random_seed, params_->batch_size, params_->vocab_size, params_->cuda_stream);
+  const auto random_streams = GetRandomStreams(params);
+  samplingdata_ = std::make_unique<cuda::SamplingData>(random_streams, params_->batch_size, params_->vocab_size, params_->cuda_stream);
+
+  if (!params.stop_sequences.empty()) {
+    const StopSequences stop_sequences{params.stop_sequences};
+    const std::array<std::span<const int32_t>, 5> arrays{stop_sequences.GetEdgeOffsets(), stop_sequences.GetEdgeTokens(), stop_sequences.GetEdgeTargets(),
+                                                         stop_sequences.GetFailures(), stop_sequences.GetMatches()};
+    std::vector<int32_t> flat;
+    std::array<size_t, 5> offsets;
+    for (size_t i = 0; i < arrays.size(); i++) {
+      offsets[i] = flat.size();
+      flat.insert(flat.end(), arrays[i].begin(), arrays[i].end());
+    }
+    stop_sequences_ = CudaMallocArray<int32_t>(flat.size());
+    cudaMemcpyAsync(stop_sequences_.get(), flat.data(), flat.size() * sizeof(int32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+    stop_sequences_params_ = {stop_sequences_.get() + offsets[0], stop_sequences_.get() + offsets[1], stop_sequences_.get() + offsets[2],
+                              stop_sequences_.get() + offsets[3], stop_sequences_.get() + offsets[4]};
+
+    stop_states_ = CudaMallocArray<int32_t>(params.batch_size);
+    cudaMemsetAsync(stop_states_.get(), 0, params.batch_size * sizeof(int32_t), params_->cuda_stream);
+    cudaStreamSynchronize(params_->cuda_stream);  // Before flat goes away
+  }
+
+  if (!params.logits_token_ids.empty()) {
+    logits_token_ids_ = CudaMallocArray<int32_t>(params.logits_token_ids.size());
+    cudaMemcpyAsync(logits_token_ids_.get(), params.logits_token_ids.data(), params.logits_token_ids.size_bytes(), cudaMemcpyHostToDevice, params_->cuda_stream);
+  }
+
+  if (!params.row_search.empty()) {
+    std::vector<int32_t> ks, max_lengths;
+    std::vector<float> ps, temperatures;
+    for (int i = 0; i < params.batch_size; i++) {
+      const auto& search = params.GetRowSearch(i);
+      // The same choice Generator::GenerateNextToken makes for the whole batch
+      int k = search.top_k;
+      float p = search.top_p > 0.0f && search.top_p < 1.0f ? search.top_p : 0.0f;
+      if (!search.do_sample || search.top_k == 1 || (search.top_k == 0 && search.top_p <= 0.0f))
+        k = 1;
+      else if (search.top_k >= params.vocab_size)
+        k = 0;
+      ks.push_back(k);
+      ps.push_back(k == 1 ? 0.0f : p);
+      temperatures.push_back(k == 1 ? 1.0f : search.temperature);
+      max_lengths.push_back(search.max_length);
+    }
+    row_ks_ = CudaMallocArray<int32_t>(params.batch_size);
+    row_ps_ = CudaMallocArray<float>(params.batch_size);
+    row_temperatures_ = CudaMallocArray<float>(params.batch_size);
+    row_max_lengths_ = CudaMallocArray<int32_t>(params.batch_size);
+    cudaMemcpyAsync(row_ks_.get(), ks.data(), ks.size() * sizeof(int32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+    cudaMemcpyAsync(row_ps_.get(), ps.data(), ps.size() * sizeof(float), cudaMemcpyHostToDevice, params_->cuda_stream);
+    cudaMemcpyAsync(row_temperatures_.get(), temperatures.data(), temperatures.size() * sizeof(float), cudaMemcpyHostToDevice, params_->cuda_stream);
+    cudaMemcpyAsync(row_max_lengths_.get(), max_lengths.data(), max_lengths.size() * sizeof(int32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+    cudaStreamSynchronize(params_->cuda_stream);  // Before the vectors go away
+  }
+
+  if (params_->search.compact_finished_rows) {
+    eos_meet_cpu_ = CudaMallocHostArray<bool>(params.batch_size, &eos_meet_cpu_span_);
+    std::fill(eos_meet_cpu_span_.begin(), eos_meet_cpu_span_.end(), false);
+  }
+
+  if (params_->search.logprobs) {
+    top_logprobs_count_ = params_->search.top_logprobs;
+    const size_t top_count = std::max(params.batch_size * top_logprobs_count_, 1);
+    logprobs_ = CudaMallocArray<float>(params.batch_size + top_count);
+    top_tokens_ = CudaMallocArray<int32_t>(top_count);
+    logprobs_cpu_ = CudaMallocHostArray<float>(params.batch_size + top_count);
+    top_tokens_cpu_ = CudaMallocHostArray<int32_t>(top_count);
+  }
 }
 
 BeamSearch_Cuda::BeamSearch_Cuda(const GeneratorParams& params)
     : Search_Cuda{params} {
   assert(params_->search.num_beams > 1);  // If 1, use GreedySearch
+  if (params_->search.num_beam_groups > 1)
+    throw std::runtime_error("Diverse beam search (num_beam_groups > 1) is only supported by the cpu search");
   auto batch_beam_size = params_->BatchBeamSize();
   beam_scorer_ = std::make_unique<BeamSearchScorer_Cuda>(*params_);
 
@@ -65,18 +144,63 @@ BeamSearch_Cuda::~BeamSearch_Cuda() = default;
 
 void Search_Cuda::SetLogits(RoamingArray<float> logits_unk) {
   next_token_scores_ = logits_unk.GetGPU();
+  logits_processor_.fp16_logits = nullptr;
+  logits_processor_.eos_token_ids_count = eos_token_ids_count_;
+}
+
+void Search_Cuda::SetFp16Logits(const uint16_t* logits_fp16) {
+  logits_processor_.fp16_logits = logits_fp16;
+}
+
+void Search_Cuda::ProcessLogits(float* log_softmax_output) {
+  auto& processor = logits_processor_;
+  if (!processor.fp16_logits && processor.eos_token_ids_count == 0 && processor.min_length_eos_token_id < 0 && !processor.token_counts && processor.no_repeat_ngram_size == 0 && !processor.token_masks && !log_softmax_output)
+    return;
+
+  processor.log_softmax_output = log_softmax_output;
+  cuda::LaunchLogitsProcessor(next_token_scores_.data(), params_->BatchBeamSize(), params_->vocab_size, processor, params_->cuda_stream);
+  // Each step processes the logits only once
+  processor.fp16_logits = nullptr;
+  processor.eos_token_ids_count = 0;
+  processor.min_length_eos_token_id = -1;
+  processor.token_counts = nullptr;
+  processor.no_repeat_ngram_size = 0;
+  processor.token_masks = nullptr;
 }
 
 RoamingArray<int32_t> GreedySearch_Cuda::GetNextTokens() {
-  return next_tokens_;
+  return {next_tokens_, params_->cuda_stream};
 }
 
 RoamingArray<int32_t> BeamSearch_Cuda::GetNextTokens() {
-  return beam_scorer_->GetNextTokens();
+  return {beam_scorer_->GetNextTokens(), params_->cuda_stream};
 }
 
 RoamingArray<int32_t> BeamSearch_Cuda::GetNextIndices() {
-  return beam_scorer_->GetNextIndicesCPU();
+  // Left on the device, where the kv caches gather the beams with them, so no step waits to copy them to the host
+  return {beam_scorer_->GetNextIndicesGPU(), params_->cuda_stream};
+}
+
+bool Search_Cuda::IsDone() const {
+  // Hitting max_length is set on the CPU, and the eos check only ever sets the flag, so a true value needs no wait
+  if (*done_cpu_)
+    return true;
+  if (step_count_ % done_check_interval_ != 0)
+    return false;
+
+  TraceSpan span{"cudaEventSynchronize"};
+  cudaEventSynchronize(done_event_);
+  return *done_cpu_;
+}
+
+std::span<const bool> GreedySearch_Cuda::GetFinishedRows() const {
+  // Only read on the steps IsDone waits for anyway, so dropping finished rows never adds a wait
+  if (!eos_meet_cpu_ || step_count_ % done_check_interval_ != 0)
+    return {};
+
+  TraceSpan span{"cudaEventSynchronize"};
+  cudaEventSynchronize(done_event_);
+  return eos_meet_cpu_span_;
 }
 
 int Search_Cuda::GetSequenceLength() const {
@@ -84,13 +208,7 @@ int Search_Cuda::GetSequenceLength() const {
 }
 
 void BeamSearch_Cuda::SelectTop() {
-  cuda::DispatchBlockwiseSoftmaxForward<true>(const_cast<cudaStream_t*>(&params_->cuda_stream), softmax_buffer_.get(), next_token_scores_.data(), params_->vocab_size,
-                                              params_->vocab_size, params_->vocab_size, params_->BatchBeamSize());
-
-  // Copy next_token_scores to CPU
-  auto next_token_scores_cpu = CudaMallocHostArray<float>(params_->BatchBeamSize() * params_->vocab_size);
-  cudaMemcpyAsync(next_token_scores_cpu.get(), softmax_buffer_.get(), params_->BatchBeamSize() * params_->vocab_size * sizeof(float), cudaMemcpyDeviceToHost, params_->cuda_stream);
-  CudaCheck() == cudaStreamSynchronize(params_->cuda_stream);
+  ProcessLogits(softmax_buffer_.get());
 
   auto beam_scores = beam_scorer_->GetNextScores();
 
@@ -124,8 +242,7 @@ void BeamSearch_Cuda::SelectTop() {
   } else
     assert(false);
 
-  CudaCheck() == cudaStreamSynchronize(params_->cuda_stream);
-
+  // Everything from here on is queued on the stream too, so the step never waits for the device
   size_t size = params_->BatchBeamSize() * 2;
   std::span<float> next_scores{topk_next_scores_.get(), size};
   std::span<int32_t> next_tokens{topk_next_tokens_.get(), size};
@@ -139,50 +256,107 @@ void BeamSearch_Cuda::SelectTop() {
 
   beam_scorer_->Process(sequences_, next_scores, next_tokens, next_indices);
   next_tokens_ = beam_scorer_->GetNextTokens();
+  step_count_++;
 
   // TODO(aciddelgado): do we need to keep track of sequences both here and in beam hypotheses?
   AppendNextTokensToSequences();
 }
 
 void GreedySearch_Cuda::SelectTop() {
+  ProcessLogits();
   std::span<float> scores = next_token_scores_.subspan(0, params_->batch_size * params_->vocab_size);
   cuda::GetSample(samplingdata_.get(), params_->cuda_stream, next_tokens_.data(), scores.data(), int(scores.size() / params_->batch_size),
                   params_->batch_size, 1, 0.0, 1.0);
+  KeepLogProbs();
   CheckForEOS();
   AppendNextTokensToSequences();
 }
 
 void GreedySearch_Cuda::SampleTopP(float p, float temperature) {
+  ProcessLogits();
   std::span<float> scores = next_token_scores_.subspan(0, params_->batch_size * params_->vocab_size);
   cuda::GetSample(samplingdata_.get(), params_->cuda_stream, next_tokens_.data(), scores.data(), int(scores.size() / params_->batch_size),
                   params_->batch_size, -1, p, temperature);
+  KeepLogProbs();
   CheckForEOS();
   AppendNextTokensToSequences();
 }
 
 void GreedySearch_Cuda::SampleTopK(int k, float temperature) {
+  ProcessLogits();
   std::span<float> scores = next_token_scores_.subspan(0, params_->batch_size * params_->vocab_size);
   cuda::GetSample(samplingdata_.get(), params_->cuda_stream, next_tokens_.data(), scores.data(), int(scores.size() / params_->batch_size),
                   params_->batch_size, k, 0.0, temperature);
+  KeepLogProbs();
   CheckForEOS();
   AppendNextTokensToSequences();
 }
 
 void GreedySearch_Cuda::SampleTopKTopP(int k, float p, float temperature) {
+  ProcessLogits();
   std::span<float> scores = next_token_scores_.subspan(0, params_->batch_size * params_->vocab_size);
   cuda::GetSample(samplingdata_.get(), params_->cuda_stream, next_tokens_.data(), scores.data(), int(scores.size() / params_->batch_size),
                   params_->batch_size, k, p, temperature);
+  KeepLogProbs();
   CheckForEOS();
   AppendNextTokensToSequences();
 }
 
+void GreedySearch_Cuda::SampleRows() {
+  ProcessLogits();
+  std::span<float> scores = next_token_scores_.subspan(0, params_->batch_size * params_->vocab_size);
+  cuda::GetSampleRows(samplingdata_.get(), params_->cuda_stream, next_tokens_.data(), scores.data(), int(scores.size() / params_->batch_size),
+                      params_->batch_size, row_ks_.get(), row_ps_.get(), row_temperatures_.get());
+  KeepLogProbs();
+  CheckForEOS();
+  AppendNextTokensToSequences();
+}
+
+void GreedySearch_Cuda::KeepLogProbs() {
+  if (!logprobs_)
+    return;
+
+  const int batch_size = params_->batch_size;
+  const size_t top_count = static_cast<size_t>(batch_size) * top_logprobs_count_;
+  cuda::LaunchTokenLogProbs(next_token_scores_.data(), next_tokens_.data(), eos_meet_.data(), params_->vocab_size, batch_size,
+                            top_logprobs_count_, params_->pad_token_id, logprobs_.get(), logprobs_.get() + batch_size, top_tokens_.get(),
+                            params_->cuda_stream);
+  // Only these few values come back to the host, never the scores
+  cudaMemcpyAsync(logprobs_cpu_.get(), logprobs_.get(), (batch_size + top_count) * sizeof(float), cudaMemcpyDeviceToHost, params_->cuda_stream);
+  if (top_count)
+    cudaMemcpyAsync(top_tokens_cpu_.get(), top_tokens_.get(), top_count * sizeof(int32_t), cudaMemcpyDeviceToHost, params_->cuda_stream);
+}
+
+void GreedySearch_Cuda::GetLogProbs(std::span<float> token_logprobs, std::span<int32_t> top_tokens, std::span<float> top_logprobs) {
+  if (!logprobs_)
+    Search::GetLogProbs(token_logprobs, top_tokens, top_logprobs);
+
+  cudaStreamSynchronize(params_->cuda_stream);
+  const size_t batch_size = params_->batch_size;
+  const size_t top_count = batch_size * top_logprobs_count_;
+  std::copy_n(logprobs_cpu_.get(), batch_size, token_logprobs.begin());
+  std::copy_n(logprobs_cpu_.get() + batch_size, top_count, top_logprobs.begin());
+  std::copy_n(top_tokens_cpu_.get(), top_count, top_tokens.begin());
+}
+
 void GreedySearch_Cuda::CheckForEOS() {
   assert(next_tokens_.size() == eos_meet_.size());
-  cuda::Launch_CheckForEOS(next_tokens_.data(), static_cast<int>(next_tokens_.size()), eos_meet_.data(), params_->eos_token_id, params_->pad_token_id, done_cpu_.get(), params_->cuda_stream);
+  if (logits_token_ids_)  // The picks are logits rows until here
+    cuda::LaunchMapLogitsRows(next_tokens_.data(), static_cast<int>(next_tokens_.size()), logits_token_ids_.get(), params_->cuda_stream);
+  cuda::Launch_CheckForEOS(next_tokens_.data(), static_cast<int>(next_tokens_.size()), eos_meet_.data(), params_->eos_token_id, params_->pad_token_id, done_cpu_.get(),
+                           row_max_lengths_.get(), GetSequenceLength() + 1, params_->cuda_stream);
+  if (stop_sequences_)
+    cuda::Launch_MatchStopSequences(next_tokens_.data(), static_cast<int>(next_tokens_.size()), stop_states_.get(), eos_meet_.data(), stop_sequences_params_, done_cpu_.get(), params_->cuda_stream);
+  if (eos_meet_cpu_)
+    cudaMemcpyAsync(eos_meet_cpu_span_.data(), eos_meet_.data(), eos_meet_.size_bytes(), cudaMemcpyDeviceToHost, params_->cuda_stream);
+  cudaEventRecord(done_event_, params_->cuda_stream);
+  step_count_++;
 }
 
 void GreedySearch_Cuda::AppendNextTokensToSequences() {
   sequences_.AppendNextTokenToSequences(next_tokens_);
+  if (token_counts_)
+    cuda::LaunchAppendTokenCounts(token_counts_.get(), next_tokens_.data(), static_cast<int>(next_tokens_.size()), params_->vocab_size, params_->cuda_stream);
 
   if (sequences_.GetSequenceLength() == params_->search.max_length) {
     if (g_log.enabled && g_log.hit_max_length)
@@ -192,7 +366,8 @@ void GreedySearch_Cuda::AppendNextTokensToSequences() {
 }
 
 bool BeamSearch_Cuda::IsDone() const {
-  if (beam_scorer_->IsDoneLater())
+  // Like the greedy search, only every done_check_interval steps waits for the scorer, the steps between pad finished beams
+  if (beam_scorer_->IsDoneLater(step_count_ % done_check_interval_ == 0))
     return true;
 
   if (sequences_.GetSequenceLength() == params_->search.max_length) {
@@ -205,6 +380,14 @@ bool BeamSearch_Cuda::IsDone() const {
 
 void BeamSearch_Cuda::AppendNextTokensToSequences() {
   sequences_.AfterDeviceAppendedNextToken();
+  if (token_counts_) {
+    const int batch_beam_size = params_->BatchBeamSize();
+    if (!next_token_counts_)
+      next_token_counts_ = CudaMallocArray<int32_t>(batch_beam_size * params_->vocab_size);
+    cuda::LaunchReorderTokenCounts(next_token_counts_.get(), token_counts_.get(), beam_scorer_->GetNextIndicesGPU().data(), beam_scorer_->GetNextTokens().data(),
+                                   batch_beam_size, params_->vocab_size, params_->cuda_stream);
+    std::swap(token_counts_, next_token_counts_);
+  }
 }
 
 void BeamSearch_Cuda::Finalize(size_t num_return_sequences) {
@@ -246,10 +429,14 @@ void GreedySearch::Finalize(size_t num_return_sequences, std::span<int32_t> outp
 
 std::span<float> Search_Cuda::GetScores(int batch_beam_index) {
   assert(batch_beam_index >= 0 && batch_beam_index < params_->BatchBeamSize());
+  if (logits_processor_.fp16_logits)
+    ProcessLogits();  // The scores aren't filled in until then
   return next_token_scores_.subspan(batch_beam_index * params_->vocab_size, params_->vocab_size);
 }
 
 std::span<float> Search_Cuda::GetScores() {
+  if (logits_processor_.fp16_logits)
+    ProcessLogits();  // The scores aren't filled in until then
   return next_token_scores_;
 }
 
@@ -257,16 +444,92 @@ void Search_Cuda::ApplyMinLength(int min_length) {
   if (sequences_.GetSequenceLength() >= min_length)
     return;
 
-  cuda::LaunchSetScoreProcessor(GetScores().data(), params_->BatchBeamSize(), params_->vocab_size, params_->eos_token_id, std::numeric_limits<float>::lowest(), params_->cuda_stream);
+  logits_processor_.min_length_eos_token_id = params_->eos_logits_index;
+}
+
+void Search_Cuda::ApplyPenalties(float repetition_penalty, float presence_penalty, float frequency_penalty) {
+  if (repetition_penalty == 1.0f && presence_penalty == 0.0f && frequency_penalty == 0.0f)
+    return;
+
+  SetTokenCounts();
+  logits_processor_.repetition_penalty = repetition_penalty;
+  logits_processor_.presence_penalty = presence_penalty;
+  logits_processor_.frequency_penalty = frequency_penalty;
+  logits_processor_.row_penalties = nullptr;
+}
+
+void Search_Cuda::ApplyRowPenalties() {
+  const int batch_beam_size = params_->BatchBeamSize();
+  if (!row_penalties_) {
+    std::vector<float> penalties;
+    bool any_penalty = false;
+    for (int i = 0; i < batch_beam_size; i++) {
+      const auto& search = params_->GetRowSearch(i);
+      penalties.insert(penalties.end(), {search.repetition_penalty, search.presence_penalty, search.frequency_penalty});
+      any_penalty = any_penalty || search.repetition_penalty != 1.0f || search.presence_penalty != 0.0f || search.frequency_penalty != 0.0f;
+    }
+    if (!any_penalty)
+      return;
+    row_penalties_ = CudaMallocArray<float>(penalties.size());
+    cudaMemcpyAsync(row_penalties_.get(), penalties.data(), penalties.size() * sizeof(float), cudaMemcpyHostToDevice, params_->cuda_stream);
+    cudaStreamSynchronize(params_->cuda_stream);  // Before penalties goes away
+  }
+
+  SetTokenCounts();
+  logits_processor_.row_penalties = row_penalties_.get();
 }
 
-void Search_Cuda::ApplyRepetitionPenalty(float penalty) {
-  if (penalty == 1.0f)
+void Search_Cuda::ApplyNoRepeatNgram(int ngram_size) {
+  if (ngram_size < 1)
     return;
 
-  cuda::LaunchRepetitionPenaltyProcessor(sequences_.GetSequences().data(),
-                                         GetScores().data(), params_->batch_size, params_->search.num_beams, params_->vocab_size,
-                                         params_->search.max_length, GetSequenceLength(), penalty, params_->cuda_stream);
+  logits_processor_.no_repeat_ngram_size = ngram_size;
+  logits_processor_.sequences = sequences_.GetSequences().data();
+  logits_processor_.max_sequence_length = params_->search.max_length;
+  logits_processor_.sequence_length = GetSequenceLength();
+}
+
+void Search_Cuda::SetTokenCounts() {
+  if (!token_counts_) {
+    const int batch_beam_size = params_->BatchBeamSize();
+    token_counts_ = CudaMallocArray<int32_t>(batch_beam_size * params_->vocab_size);
+    cuda::LaunchInitTokenCounts(token_counts_.get(), sequences_.GetSequences().data(), batch_beam_size, params_->vocab_size, params_->search.max_length,
+                                GetSequenceLength(), params_->sequence_length, params_->cuda_stream);
+  }
+  logits_processor_.token_counts = token_counts_.get();
+}
+
+void Search_Cuda::ApplyTokenConstraint(const TokenConstraint& constraint, std::span<const int32_t> states) {
+  const size_t batch_beam_size = params_->BatchBeamSize();
+
+  // The masks of every state are uploaded once, after that only the states change each step
+  if (token_constraint_ != &constraint) {
+    auto masks = constraint.GetMasks();
+    token_masks_ = CudaMallocArray<uint32_t>(masks.size());
+    cudaMemcpyAsync(token_masks_.get(), masks.data(), masks.size_bytes(), cudaMemcpyHostToDevice, params_->cuda_stream);
+    token_constraint_ = &constraint;
+  }
+  if (!token_mask_states_) {
+    token_mask_states_ = CudaMallocArray<int32_t>(batch_beam_size);
+    token_mask_states_cpu_ = CudaMallocHostArray<int32_t>(batch_beam_size);
+  }
+
+  // The last step's copy is done, as its tokens were read back before these states were advanced
+  std::copy(states.begin(), states.end(), token_mask_states_cpu_.get());
+  cudaMemcpyAsync(token_mask_states_.get(), token_mask_states_cpu_.get(), batch_beam_size * sizeof(int32_t), cudaMemcpyHostToDevice, params_->cuda_stream);
+
+  logits_processor_.token_masks = token_masks_.get();
+  logits_processor_.token_mask_states = token_mask_states_.get();
+  logits_processor_.token_mask_words = static_cast<int>(constraint.GetMaskWords());
+}
+
+void Search_Cuda::ApplyLogitsProcessors(std::span<const LogitsProcessor> processors) {
+  ProcessLogits();  // So the custom processors see the scores after the built in processing
+
+  LogitsProcessorContext context{next_token_scores_, sequences_.GetSequences(), params_->BatchBeamSize(), params_->vocab_size,
+                                 params_->search.max_length, GetSequenceLength(), DeviceType::CUDA, params_->cuda_stream};
+  for (auto& processor : processors)
+    processor(context);
 }
 
-}  // namespace Generators
\ No newline at end of file
+}  // namespace Generators
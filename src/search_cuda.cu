@@ -1,6 +1,6 @@
-#include <cuda_runtime.h>
-#include <cub/cub.cuh>
+#include "cuda_hip.cuh"
 #include <algorithm>
+#include <limits>
 #include "generators.h"
 #include "search_cuda.cuh"
 
@@ -38,13 +38,17 @@ struct ArgMaxDataImpl : ArgMaxData {
   cuda_unique_ptr<cub::KeyValuePair<int, float>> argmaxen_owner_;
 };
 
-__global__ void CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, bool* done_cpu) {
+__global__ void CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, bool* done_cpu,
+                            const int32_t* max_lengths, int next_length) {
   // Look for EOS tokens, if seen set EOS flag and replace with pad token
   for (size_t batch_id = 0; batch_id < next_tokens_count; ++batch_id) {
     if (next_tokens[batch_id] == eos_token_id || eos_meet[batch_id] == true) {
       eos_meet[batch_id] = true;
       next_tokens[batch_id] = pad_token_id;
     }
+    // A sequence reaching its own max length keeps this token and is done after it
+    if (max_lengths && next_length >= max_lengths[batch_id])
+      eos_meet[batch_id] = true;
   }
 
   // When all batches are finished, stop earlier to avoid wasting computation.
@@ -64,8 +68,58 @@ __global__ void CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* e
   }
 }
 
-void Launch_CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, bool* done_cpu, cudaStream_t stream) {
-  CheckForEOS<<<1, 1, 0, stream>>>(next_tokens, next_tokens_count, eos_meet, eos_token_id, pad_token_id, done_cpu);
+void Launch_CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, bool* done_cpu,
+                        const int32_t* max_lengths, int next_length, cudaStream_t stream) {
+  CheckForEOS<<<1, 1, 0, stream>>>(next_tokens, next_tokens_count, eos_meet, eos_token_id, pad_token_id, done_cpu, max_lengths, next_length);
+}
+
+__global__ void MapLogitsRows(int32_t* next_tokens, int next_tokens_count, const int32_t* row_tokens) {
+  const int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index < next_tokens_count)
+    next_tokens[index] = row_tokens[next_tokens[index]];
+}
+
+void LaunchMapLogitsRows(int32_t* next_tokens, int next_tokens_count, const int32_t* row_tokens, cudaStream_t stream) {
+  MapLogitsRows<<<(next_tokens_count + 255) / 256, 256, 0, stream>>>(next_tokens, next_tokens_count, row_tokens);
+}
+
+__global__ void MatchStopSequences(const int32_t* next_tokens, int next_tokens_count, int32_t* states, bool* eos_meet, StopSequencesParams stop_sequences, bool* done_cpu) {
+  bool all_done = true;
+  for (int batch_id = 0; batch_id < next_tokens_count; batch_id++) {
+    if (!eos_meet[batch_id]) {
+      const int32_t token = next_tokens[batch_id];
+      int32_t state = states[batch_id];
+      for (;;) {
+        // The edges of a state are sorted by token
+        int begin = stop_sequences.edge_offsets[state];
+        int end = stop_sequences.edge_offsets[state + 1];
+        while (begin < end) {
+          const int middle = (begin + end) / 2;
+          if (stop_sequences.edge_tokens[middle] < token)
+            begin = middle + 1;
+          else
+            end = middle;
+        }
+        if (begin < stop_sequences.edge_offsets[state + 1] && stop_sequences.edge_tokens[begin] == token) {
+          state = stop_sequences.edge_targets[begin];
+          break;
+        }
+        if (state == 0)
+          break;
+        state = stop_sequences.failures[state];
+      }
+      states[batch_id] = state;
+      eos_meet[batch_id] = stop_sequences.matches[state] != 0;
+    }
+    all_done = all_done && eos_meet[batch_id];
+  }
+
+  if (all_done)
+    *done_cpu = true;
+}
+
+void Launch_MatchStopSequences(const int32_t* next_tokens, int next_tokens_count, int32_t* states, bool* eos_meet, StopSequencesParams stop_sequences, bool* done_cpu, cudaStream_t stream) {
+  MatchStopSequences<<<1, 1, 0, stream>>>(next_tokens, next_tokens_count, states, eos_meet, stop_sequences, done_cpu);
 }
 
 __global__ void AddProbsKernel(float* log_probs,
@@ -91,50 +145,160 @@ void LaunchAddProbsKernel(float* log_probs,
   AddProbsKernel<<<gridSize, blockSize, 0, stream>>>(log_probs, cum_log_probs, vocab_size, total_elements);
 }
 
-__global__ void SetScoreProcessor(float* next_token_scores, int batch_beam_size, int vocab_size, int token, float score) {
-  int index = blockIdx.x * blockDim.x + threadIdx.x;
-  if (index >= batch_beam_size)
-    return;
+template <int kBlockSize>
+__global__ void LogitsProcessorKernel(float* next_token_scores, int vocab_size, LogitsProcessorParams params) {
+  float* scores = next_token_scores + static_cast<size_t>(blockIdx.x) * vocab_size;
 
-  next_token_scores[index * vocab_size + token] = score;
-}
+  if (params.fp16_logits) {
+    const half* logits = reinterpret_cast<const half*>(params.fp16_logits) + static_cast<size_t>(blockIdx.x) * vocab_size;
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+      scores[i] = __half2float(logits[i]);
+    __syncthreads();
+  }
 
-void LaunchSetScoreProcessor(float* next_token_scores, int batch_beam_size, int vocab_size, int token, float score, cudaStream_t stream) {
-  int total_elements = batch_beam_size;
-  constexpr int blockSize = 256;
-  const int gridSize = (total_elements + blockSize - 1) / blockSize;
+  if (threadIdx.x == 0) {
+    if (params.eos_token_ids_count != 0) {
+      float max = std::numeric_limits<float>::lowest();
+      for (int i = 0; i < params.eos_token_ids_count; i++) {
+        max = fmaxf(max, scores[params.eos_token_ids[i]]);
+        scores[params.eos_token_ids[i]] = std::numeric_limits<float>::lowest();
+      }
+      scores[params.eos_token_ids[0]] = max;
+    }
+    if (params.min_length_eos_token_id >= 0)
+      scores[params.min_length_eos_token_id] = std::numeric_limits<float>::lowest();
+  }
+  __syncthreads();
 
-  SetScoreProcessor<<<gridSize, blockSize, 0, stream>>>(next_token_scores, batch_beam_size, vocab_size, token, score);
-}
+  if (params.token_counts) {
+    const float* penalties = params.row_penalties ? params.row_penalties + static_cast<size_t>(blockIdx.x) * 3 : nullptr;
+    const float repetition_penalty = penalties ? penalties[0] : params.repetition_penalty;
+    const float presence_penalty = penalties ? penalties[1] : params.presence_penalty;
+    const float frequency_penalty = penalties ? penalties[2] : params.frequency_penalty;
 
-__global__ void RepetitionPenaltyProcessor(const int32_t* sequences, float* next_token_scores, int max_sequence_length, int vocab_size, int total_elements, int current_sequence_length, float repetition_penalty) {
-  int index = blockIdx.x * blockDim.x + threadIdx.x;
-  if (index >= total_elements)
-    return;
+    const int32_t* counts = params.token_counts + static_cast<size_t>(blockIdx.x) * vocab_size;
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+      const int32_t count = counts[i];
+      if (count == 0)
+        continue;
+      float score = scores[i];
+      if (repetition_penalty != 1.0f)
+        score = score < 0 ? score * repetition_penalty : score / repetition_penalty;
+      if (count > 1)
+        score -= presence_penalty + (count - 1) * frequency_penalty;
+      scores[i] = score;
+    }
+    __syncthreads();
+  }
 
-  int batch_beam_index = index / vocab_size;
-  int word_id = index % vocab_size;
-
-  const int32_t* current_sequence = sequences + batch_beam_index * max_sequence_length;
-  bool found = false;
-  for (int i = 0; i < current_sequence_length; i++) {
-    if (current_sequence[i] == word_id) {
-      found = true;
-      break;
+  if (params.no_repeat_ngram_size > 0) {
+    // Each thread takes some of the earlier n-grams, and those starting with the sequence's last n - 1 tokens ban their
+    // last one. Most differ in their first token, so there's little to gain from an index of them on the device.
+    const int prefix_size = params.no_repeat_ngram_size - 1;
+    const int32_t* sequence = params.sequences + static_cast<size_t>(blockIdx.x) * params.max_sequence_length;
+    const int32_t* last = sequence + params.sequence_length - prefix_size;
+    for (int start = threadIdx.x; start + prefix_size < params.sequence_length; start += kBlockSize) {
+      int i = 0;
+      while (i < prefix_size && sequence[start + i] == last[i])
+        i++;
+      if (i == prefix_size)
+        scores[sequence[start + prefix_size]] = std::numeric_limits<float>::lowest();
+    }
+    __syncthreads();
+  }
+
+  if (params.token_masks) {
+    const uint32_t* mask = params.token_masks + static_cast<size_t>(params.token_mask_states[blockIdx.x]) * params.token_mask_words;
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize) {
+      if (!(mask[i >> 5] & (1U << (i & 31))))
+        scores[i] = std::numeric_limits<float>::lowest();
     }
+    __syncthreads();
   }
-  if (found) {
-    float score = next_token_scores[index];
-    next_token_scores[index] = score < 0 ? score * repetition_penalty : score / repetition_penalty;
+
+  if (params.log_softmax_output) {
+    using BlockReduce = cub::BlockReduce<float, kBlockSize>;
+    __shared__ typename BlockReduce::TempStorage temp_storage;
+    __shared__ float row_max;
+    __shared__ float row_log_sum;
+
+    float max = std::numeric_limits<float>::lowest();
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+      max = fmaxf(max, scores[i]);
+    max = BlockReduce(temp_storage).Reduce(max, cub::Max());
+    if (threadIdx.x == 0)
+      row_max = max;
+    __syncthreads();
+
+    const float scale = 1.0f / params.temperature;
+    float sum = 0.0f;
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+      sum += expf((scores[i] - row_max) * scale);
+    sum = BlockReduce(temp_storage).Sum(sum);
+    if (threadIdx.x == 0)
+      row_log_sum = logf(sum);
+    __syncthreads();
+
+    float* output = params.log_softmax_output + static_cast<size_t>(blockIdx.x) * vocab_size;
+    for (int i = threadIdx.x; i < vocab_size; i += kBlockSize)
+      output[i] = (scores[i] - row_max) * scale - row_log_sum;
   }
 }
 
-void LaunchRepetitionPenaltyProcessor(const int32_t* sequences, float* next_token_scores, int batch_size, int num_beams, int vocab_size, int max_sequence_length, int current_sequence_length, float repetition_penalty, cudaStream_t stream) {
-  int total_elements = batch_size * num_beams * vocab_size;
+void LaunchLogitsProcessor(float* next_token_scores, int batch_beam_size, int vocab_size, const LogitsProcessorParams& params, cudaStream_t stream) {
   constexpr int blockSize = 256;
-  const int gridSize = (total_elements + blockSize - 1) / blockSize;
+  LogitsProcessorKernel<blockSize><<<batch_beam_size, blockSize, 0, stream>>>(next_token_scores, vocab_size, params);
+}
+
+__global__ void InitTokenCounts(int32_t* token_counts, const int32_t* sequences, int vocab_size, int max_sequence_length, int sequence_length, int prompt_length) {
+  int32_t* counts = token_counts + static_cast<size_t>(blockIdx.x) * vocab_size;
+  const int32_t* sequence = sequences + static_cast<size_t>(blockIdx.x) * max_sequence_length;
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x)
+    counts[i] = 0;
+  __syncthreads();
+
+  // Every token in the sequence starts at 1 before the generated ones are added, so the two can't race
+  for (int i = threadIdx.x; i < sequence_length; i += blockDim.x)
+    counts[sequence[i]] = 1;
+  __syncthreads();
+  for (int i = prompt_length + threadIdx.x; i < sequence_length; i += blockDim.x)
+    atomicAdd(&counts[sequence[i]], 1);
+}
+
+void LaunchInitTokenCounts(int32_t* token_counts, const int32_t* sequences, int batch_beam_size, int vocab_size, int max_sequence_length,
+                           int sequence_length, int prompt_length, cudaStream_t stream) {
+  InitTokenCounts<<<batch_beam_size, 256, 0, stream>>>(token_counts, sequences, vocab_size, max_sequence_length, sequence_length, prompt_length);
+}
+
+__global__ void AppendTokenCounts(int32_t* token_counts, const int32_t* next_tokens, int batch_beam_size, int vocab_size) {
+  const int index = blockIdx.x * blockDim.x + threadIdx.x;
+  if (index >= batch_beam_size)
+    return;
+  int32_t& count = token_counts[static_cast<size_t>(index) * vocab_size + next_tokens[index]];
+  count = count == 0 ? 2 : count + 1;
+}
+
+void LaunchAppendTokenCounts(int32_t* token_counts, const int32_t* next_tokens, int batch_beam_size, int vocab_size, cudaStream_t stream) {
+  constexpr int blockSize = 256;
+  AppendTokenCounts<<<(batch_beam_size + blockSize - 1) / blockSize, blockSize, 0, stream>>>(token_counts, next_tokens, batch_beam_size, vocab_size);
+}
+
+__global__ void ReorderTokenCounts(int32_t* next_token_counts, const int32_t* token_counts, const int32_t* batch_beam_indices, const int32_t* batch_beam_next_tokens, int vocab_size) {
+  int32_t* next_counts = next_token_counts + static_cast<size_t>(blockIdx.x) * vocab_size;
+  const int32_t* counts = token_counts + static_cast<size_t>(batch_beam_indices[blockIdx.x]) * vocab_size;
+  for (int i = threadIdx.x; i < vocab_size; i += blockDim.x)
+    next_counts[i] = counts[i];
+  __syncthreads();
+
+  if (threadIdx.x == 0) {
+    int32_t& count = next_counts[batch_beam_next_tokens[blockIdx.x]];
+    count = count == 0 ? 2 : count + 1;
+  }
+}
 
-  RepetitionPenaltyProcessor<<<gridSize, blockSize, 0, stream>>>(sequences, next_token_scores, max_sequence_length, vocab_size, total_elements, current_sequence_length, repetition_penalty);
+void LaunchReorderTokenCounts(int32_t* next_token_counts, const int32_t* token_counts, const int32_t* batch_beam_indices, const int32_t* batch_beam_next_tokens,
+                              int batch_beam_size, int vocab_size, cudaStream_t stream) {
+  ReorderTokenCounts<<<batch_beam_size, 256, 0, stream>>>(next_token_counts, token_counts, batch_beam_indices, batch_beam_next_tokens, vocab_size);
 }
 
 }  // namespace cuda
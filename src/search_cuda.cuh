@@ -6,10 +6,74 @@ struct ArgMaxData {
   virtual ~ArgMaxData() = default;
 };
 
-void Launch_CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, bool* done_cpu, cudaStream_t stream);
+// The logits processing of a step, done by LaunchLogitsProcessor in a single pass over each batch_beam's scores.
+// Every stage is skipped when left at its default, and they run in the order of the members below.
+struct LogitsProcessorParams {
+  // Fills the scores from these fp16 logits of the same shape first, so fp16 models don't need a separate conversion
+  const uint16_t* fp16_logits{};
+
+  // Moves the highest score of the eos tokens to the first of them, so only that one can be picked
+  const int32_t* eos_token_ids{};
+  int eos_token_ids_count{};
+
+  // Set while under the minimum length, so the eos token can't be picked
+  int min_length_eos_token_id{-1};
+
+  // Penalizes the tokens already in each sequence like Search::ApplyPenalties, by the row_penalties of the batch_beam when set
+  const int32_t* token_counts{};  // (batch_beam_size, vocab_size), like TokenCounts: 0 if not in the sequence, otherwise 1 + times generated
+  float repetition_penalty{1.0f};
+  float presence_penalty{};
+  float frequency_penalty{};
+  const float* row_penalties{};  // (batch_beam_size, 3), the repetition, presence and frequency penalty of each
+
+  // Bans the tokens that would repeat an n-gram of no_repeat_ngram_size tokens already in the sequence
+  int no_repeat_ngram_size{};
+  const int32_t* sequences{};
+  int max_sequence_length{};
+  int sequence_length{};
+
+  // Leaves only the tokens whose bit is set in the token_masks row of each batch_beam's state, see TokenConstraint
+  const uint32_t* token_masks{};  // (state_count, token_mask_words)
+  const int32_t* token_mask_states{};  // (batch_beam_size)
+  int token_mask_words{};
+
+  // Writes the log softmax of scores / temperature here
+  float* log_softmax_output{};
+  float temperature{1.0f};
+};
+
+void LaunchLogitsProcessor(float* next_token_scores, int batch_beam_size, int vocab_size, const LogitsProcessorParams& params, cudaStream_t stream);
+
+// The token counts of the logits processing, kept up to date with every append so no step goes through the sequences.
+// Init counts the first sequence_length tokens of the sequences, those from prompt_length on as generated ones
+void LaunchInitTokenCounts(int32_t* token_counts, const int32_t* sequences, int batch_beam_size, int vocab_size, int max_sequence_length,
+                           int sequence_length, int prompt_length, cudaStream_t stream);
+// Counts the next token of each sequence
+void LaunchAppendTokenCounts(int32_t* token_counts, const int32_t* next_tokens, int batch_beam_size, int vocab_size, cudaStream_t stream);
+// Beam search, the next counts of each slot are those of slot batch_beam_indices[i] with batch_beam_next_tokens[i]
+void LaunchReorderTokenCounts(int32_t* next_token_counts, const int32_t* token_counts, const int32_t* batch_beam_indices, const int32_t* batch_beam_next_tokens,
+                              int batch_beam_size, int vocab_size, cudaStream_t stream);
+// Pads the next token of every sequence already done and marks the ones that are done with it: those with the eos token,
+// and the ones reaching their max_lengths entry with next_length, if given. Sets done_cpu once every sequence is
+void Launch_CheckForEOS(int32_t* next_tokens, int next_tokens_count, bool* eos_meet, int eos_token_id, int pad_token_id, bool* done_cpu,
+                        const int32_t* max_lengths, int next_length, cudaStream_t stream);
+
+// Replaces the logits row the search picked for each sequence by its token, with GeneratorParams::logits_token_ids
+void LaunchMapLogitsRows(int32_t* next_tokens, int next_tokens_count, const int32_t* row_tokens, cudaStream_t stream);
+
+// The device arrays of a StopSequences automaton
+struct StopSequencesParams {
+  const int32_t* edge_offsets{};
+  const int32_t* edge_tokens{};
+  const int32_t* edge_targets{};
+  const int32_t* failures{};
+  const int32_t* matches{};
+};
+
+// After Launch_CheckForEOS, advances the stop sequence state of every sequence that isn't done with its next token, and
+// marks the ones that end a stop sequence as done. Sets done_cpu once every sequence is
+void Launch_MatchStopSequences(const int32_t* next_tokens, int next_tokens_count, int32_t* states, bool* eos_meet, StopSequencesParams stop_sequences, bool* done_cpu, cudaStream_t stream);
 void LaunchAddProbsKernel(float* log_probs, float* cum_log_probs, const int batch_size, const int num_beams, const int vocab_size, cudaStream_t stream);
-void LaunchSetScoreProcessor(float* next_token_scores, int batch_beam_size, int vocab_size, int token, float score, cudaStream_t stream);
-void LaunchRepetitionPenaltyProcessor(const int32_t* sequences, float* next_token_scores, int batch_size, int num_beams, int vocab_size, int max_sequence_length, int current_sequence_length, float repetition_penalty, cudaStream_t stream);
 
 void TopPSampling(int32_t* next_token, float* scores, int size, float p, float temperature);
 }  // namespace cuda
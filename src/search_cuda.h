@@ -14,14 +14,19 @@ struct Search_Cuda : Search {
   RoamingArray<int32_t> GetSequenceLengths() override { return sequence_lengths_; }
   RoamingArray<int32_t> GetSequence(size_t index) override { return sequences_.GetSequence(index); }
 
-  bool IsDone() const {
-    cudaStreamSynchronize(params_->cuda_stream);
-    return *done_cpu_;
-  }  // TODO: Use an event
+  bool IsDone() const;
   void SetLogits(RoamingArray<float> logits);
+  void SetFp16Logits(const uint16_t* logits_fp16) override;
 
   void ApplyMinLength(int min_length) override;
-  void ApplyRepetitionPenalty(float penalty) override;
+  void ApplyPenalties(float repetition_penalty, float presence_penalty, float frequency_penalty) override;
+  void ApplyRowPenalties() override;
+  void ApplyNoRepeatNgram(int ngram_size) override;
+  void ApplyTokenConstraint(const TokenConstraint& constraint, std::span<const int32_t> states) override;
+  void ApplyLogitsProcessors(std::span<const LogitsProcessor> processors) override;
+
+  // Runs the logits processing recorded since SetLogits, optionally writing the log softmax of the scores too
+  void ProcessLogits(float* log_softmax_output = nullptr);
 
   std::span<float> GetScores(int batch_beam_index);
   std::span<float> GetScores();
@@ -39,7 +44,27 @@ struct Search_Cuda : Search {
 
   cuda_host_unique_ptr<bool> done_cpu_;
 
+  // Recorded after every step's eos check, so IsDone only waits for that check and not for work queued after it
+  mutable cuda_event_holder done_event_{cudaEventDisableTiming};
+  int done_check_interval_;  // From search.done_check_interval, IsDone skips the wait on all other steps
+  int step_count_{};
+
+  // Min length and repetition penalty only record what to do, then ProcessLogits does it in one pass
+  cuda::LogitsProcessorParams logits_processor_;
+  int eos_token_ids_count_{};  // Restored into logits_processor_ by SetLogits, as the eos stage also runs once per step
+  cuda_unique_ptr<int32_t> eos_token_ids_;
+  cuda_unique_ptr<int32_t> token_counts_;       // Made by the first penalty, then kept up to date by the appends
+  cuda_unique_ptr<int32_t> next_token_counts_;  // Beam search, where the reordered counts are built before being swapped in
+  cuda_unique_ptr<float> row_penalties_;        // Of each GeneratorParams::row_search, uploaded by the first ApplyRowPenalties
+  const TokenConstraint* token_constraint_{};  // The one whose masks are in token_masks_
+  cuda_unique_ptr<uint32_t> token_masks_;
+  cuda_unique_ptr<int32_t> token_mask_states_;
+  cuda_host_unique_ptr<int32_t> token_mask_states_cpu_;
+
   Sequences_Cuda sequences_;
+
+ private:
+  void SetTokenCounts();  // Points the logits processing at token_counts_, making them first
 };
 
 struct GreedySearch_Cuda : Search_Cuda {
@@ -47,19 +72,44 @@ struct GreedySearch_Cuda : Search_Cuda {
 
   RoamingArray<int32_t> GetNextTokens() override;
   RoamingArray<int32_t> GetNextIndices() override { return gpu_span<int32_t>{}; }
+  std::span<const bool> GetFinishedRows() const override;
 
   void SelectTop() override;
   void SampleTopK(int k, float t) override;
   void SampleTopP(float p, float t) override;
   void SampleTopKTopP(int k, float p, float t) override;
+  void SampleRows() override;
+
+  void GetLogProbs(std::span<float> token_logprobs, std::span<int32_t> top_tokens, std::span<float> top_logprobs) override;
 
  private:
+  void KeepLogProbs();  // After the pick and before the eos check, while eos_meet_ is still the previous step's
   void CheckForEOS();
   void AppendNextTokensToSequences();
 
   cuda_unique_ptr<int32_t> next_tokens_buffer_;
+  cuda_unique_ptr<int32_t> logits_token_ids_;  // GeneratorParams::logits_token_ids on the device, if set
+  cuda_host_unique_ptr<bool> eos_meet_cpu_;  // Copied from eos_meet_ with every eos check, with search.compact_finished_rows
+  cpu_span<bool> eos_meet_cpu_span_;
+  cuda_unique_ptr<int32_t> stop_sequences_;  // The arrays of the params' StopSequences one after another, if any
+  cuda::StopSequencesParams stop_sequences_params_;
+  cuda_unique_ptr<int32_t> stop_states_;
   std::unique_ptr<cuda::ArgMaxData> argmaxdata_;
   std::unique_ptr<cuda::SamplingData> samplingdata_;
+
+  // The sampling settings of each GeneratorParams::row_search as GetSampleRows takes them, and their max lengths
+  cuda_unique_ptr<int32_t> row_ks_;
+  cuda_unique_ptr<float> row_ps_;
+  cuda_unique_ptr<float> row_temperatures_;
+  cuda_unique_ptr<int32_t> row_max_lengths_;
+
+  // With search.logprobs, each batch entry's token log probability followed by the top_logprobs ones of every entry, and
+  // the top tokens, copied to the host with every step
+  int top_logprobs_count_{};
+  cuda_unique_ptr<float> logprobs_;
+  cuda_unique_ptr<int32_t> top_tokens_;
+  cuda_host_unique_ptr<float> logprobs_cpu_;
+  cuda_host_unique_ptr<int32_t> top_tokens_cpu_;
 };
 
 struct BeamSearch_Cuda : Search_Cuda {
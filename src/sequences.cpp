@@ -6,57 +6,93 @@
 
 namespace Generators {
 
+// The rows start this many tokens past the prompt and grow by at least as much
+constexpr int c_capacity_chunk = 256;
+
 Sequences::Sequences(std::span<const int32_t> input_sequences, int batch_size, int beam_size, int max_length)
     : batch_beam_size_{batch_size * beam_size},
       max_length_{max_length},
-      current_length_{static_cast<int>(input_sequences.size()) / batch_size} {
+      prompt_length_{static_cast<int>(input_sequences.size()) / batch_size},
+      current_length_{prompt_length_} {
   assert(current_length_ * batch_size == input_sequences.size());  // Ensure size divided perfectly
-  const size_t sequences_size = static_cast<size_t>(batch_beam_size_) * max_length;
-
-  if (beam_size == 1) {
-    sequences_buffer_ = std::make_unique<int32_t[]>(sequences_size);
-    sequences_ = cpu_span<int32_t>(sequences_buffer_.get(), sequences_size);
-  } else {
-    sequences_buffer_ = std::make_unique<int32_t[]>(2 * sequences_size);
-    sequences_ = cpu_span<int32_t>(sequences_buffer_.get(), sequences_size);
-    sequences_next_ = cpu_span<int32_t>(sequences_buffer_.get() + sequences_size, sequences_size);
-  }
+  capacity_ = std::min(max_length, std::max(prompt_length_ + c_capacity_chunk, 1));
+  const size_t sequences_size = static_cast<size_t>(batch_beam_size_) * capacity_;
 
-  // The original inputs are not expanded, this expands them in place into the sequences
+  sequences_buffer_ = std::make_unique<int32_t[]>(sequences_size);
+  sequences_ = cpu_span<int32_t>(sequences_buffer_.get(), sequences_size);
+  if (beam_size > 1)
+    materialized_lengths_.assign(batch_beam_size_, current_length_);
+
+  // The original inputs are not expanded, this expands them in place into the sequences. Beams only ever continue the
+  // beams of their own batch entry, so the prompts in the rows are never rewritten.
   for (size_t batch = 0; batch < batch_size; batch++) {
     for (size_t beam = 0; beam < beam_size; beam++) {
       for (int j = 0; j < current_length_; j++) {
-        sequences_[(batch * beam_size + beam) * max_length + j] =
+        sequences_[(batch * beam_size + beam) * capacity_ + j] =
             static_cast<int32_t>(input_sequences[batch * current_length_ + j]);
       }
     }
   }
 }
 
+void Sequences::MaterializeSequence(size_t batch_beam_index) {
+  if (materialized_lengths_.empty() || materialized_lengths_[batch_beam_index] == current_length_)
+    return;
+
+  // Walk the parents from the last token back to the prompt
+  auto* row = sequences_.data() + batch_beam_index * capacity_;
+  size_t slot = batch_beam_index;
+  for (int step = current_length_ - prompt_length_; step-- > 0;) {
+    const size_t tree_index = static_cast<size_t>(step) * batch_beam_size_ + slot;
+    row[prompt_length_ + step] = tree_tokens_[tree_index];
+    slot = tree_parents_[tree_index];
+  }
+  materialized_lengths_[batch_beam_index] = current_length_;
+}
+
 cpu_span<int32_t> Sequences::GetSequence(size_t batch_beam_index) {
-  auto span = sequences_.subspan(batch_beam_index * max_length_, current_length_);
+  MaterializeSequence(batch_beam_index);
+  auto span = sequences_.subspan(batch_beam_index * capacity_, current_length_);
   return cpu_span<int32_t>{span.data(), span.size()};
 }
 
+cpu_span<int32_t> Sequences::GetSequences() {
+  for (size_t i = 0; i < static_cast<size_t>(batch_beam_size_); i++)
+    MaterializeSequence(i);
+  return sequences_;
+}
+
 int Sequences::GetSequenceLength() const {
   return current_length_;
 }
 
+void Sequences::Grow() {
+  if (current_length_ >= max_length_)
+    throw std::runtime_error("The sequences can't grow past max_length (" + std::to_string(max_length_) + ")");
+
+  const int capacity = std::min(max_length_, capacity_ + std::max(c_capacity_chunk, capacity_ / 2));
+  const size_t sequences_size = static_cast<size_t>(batch_beam_size_) * capacity;
+  auto buffer = std::make_unique<int32_t[]>(sequences_size);
+  // Beam search rebuilds the generated part of its rows from the tree, only the prompts need copying there
+  const int valid_length = materialized_lengths_.empty() ? current_length_ : prompt_length_;
+  for (size_t i = 0; i < static_cast<size_t>(batch_beam_size_); i++)
+    std::copy(sequences_.begin() + i * capacity_, sequences_.begin() + i * capacity_ + valid_length, buffer.get() + i * capacity);
+  std::fill(materialized_lengths_.begin(), materialized_lengths_.end(), prompt_length_);
+
+  sequences_buffer_ = std::move(buffer);
+  sequences_ = cpu_span<int32_t>(sequences_buffer_.get(), sequences_size);
+  capacity_ = capacity;
+}
+
 void Sequences::AppendNextTokenToSequences(std::span<const int32_t> batch_beam_indices, std::span<const int32_t> batch_beam_next_tokens) {
-  for (ptrdiff_t i = 0; i < batch_beam_size_; i++) {
-    int batch_beam_index = batch_beam_indices[i];
-    std::span<const int32_t> source = sequences_.subspan(batch_beam_index * max_length_, current_length_);
-    std::span<int32_t> target = sequences_next_.subspan(i * max_length_, current_length_);
-    copy(source, target);
-
-    // Append next token to each beam.
-    sequences_next_[i * max_length_ + current_length_] = batch_beam_next_tokens[i];
-  }
+  assert(!materialized_lengths_.empty());
+  if (current_length_ == capacity_)
+    Grow();
+  // The tree grows with the generation too, a step at a time
+  tree_tokens_.insert(tree_tokens_.end(), batch_beam_next_tokens.begin(), batch_beam_next_tokens.begin() + batch_beam_size_);
+  tree_parents_.insert(tree_parents_.end(), batch_beam_indices.begin(), batch_beam_indices.begin() + batch_beam_size_);
 
   ++current_length_;
-
-  // Rotate buffer for next round.
-  std::swap(sequences_, sequences_next_);
 }
 
 void Sequences::AppendNextTokenToSequences(std::span<const int32_t> next_tokens) {
@@ -65,9 +101,11 @@ void Sequences::AppendNextTokenToSequences(std::span<const int32_t> next_tokens)
     DumpSpan(stream, next_tokens);
     stream << std::endl;
   }
+  if (current_length_ == capacity_)
+    Grow();
   // Append next token to each sequence.
   for (int i = 0; i < batch_beam_size_; i++) {
-    sequences_[i * max_length_ + current_length_] = next_tokens[i];
+    sequences_[i * capacity_ + current_length_] = next_tokens[i];
   }
 
   ++current_length_;
@@ -6,30 +6,46 @@ struct Sequences {
   Sequences(std::span<const int32_t> input_sequence, int batch_size, int beam_size, int max_length);
 
   // Returns a sequence of word IDs for a given beam index ( beam_index < batch_beam_size).
+  // It stays valid until the next AppendNextTokenToSequences call.
   cpu_span<int32_t> GetSequence(size_t batch_beam_index);
-  cpu_span<int32_t> GetSequences() { return sequences_; }
+  cpu_span<int32_t> GetSequences();  // (batch_beam_size, GetCapacity()), the first GetSequenceLength() of each row are valid
+
+  // The length of the rows of GetSequences(). They grow in chunks as tokens are appended, up to max_length, so a
+  // generation only holds memory for about the length it has reached.
+  int GetCapacity() const { return capacity_; }
 
   // Returns current sequence length.
   int GetSequenceLength() const;
 
   // Used by Beam search:
-  // Shuffles sequences around based on batch_beam_indices, then append next token to selected sequences.
+  // Each slot continues the sequence of slot batch_beam_indices[i] with batch_beam_next_tokens[i].
   void AppendNextTokenToSequences(std::span<const int32_t> batch_beam_indices, std::span<const int32_t> batch_beam_next_tokens);
 
   // Used by Greedy search:
   void AppendNextTokenToSequences(std::span<const int32_t> next_tokens);
 
  private:
+  // Copies what slot batch_beam_index has generated into its row of sequences_, if the row is out of date
+  void MaterializeSequence(size_t batch_beam_index);
+  void Grow();  // Makes the rows longer, when they are full
+
   std::unique_ptr<int32_t[]> sequences_buffer_;
 
-  // Two buffers of shape (batch_size, num_beams, max_seq_length) to store sequences.
-  // At each time, there is only one buffer is active. The other one will be active in next token.
-  // Each AppendNextTokenToSequences call will trigger a rotation of active buffer.
+  // Shape (batch_size, num_beams, capacity_). Greedy search appends to it directly. Beam search rebuilds a row
+  // from the token tree below only when it's asked for, as the beams get reordered every step.
   cpu_span<int32_t> sequences_;
-  cpu_span<int32_t> sequences_next_;  // This only exists for beam search, to allow for the easy reordering of sequences
+
+  // Beam search only, shape (current_length_ - prompt_length_, batch_beam_size), of the tokens generated after the prompt.
+  // Step s of slot i holds the token appended to it and the slot it extended at step s - 1, so reordering the beams
+  // costs O(batch_beam_size) per step instead of copying every sequence.
+  std::vector<int32_t> tree_tokens_;
+  std::vector<int32_t> tree_parents_;
+  std::vector<int> materialized_lengths_;  // The length each row of sequences_ was last rebuilt at
 
   int batch_beam_size_;
   int max_length_;
+  int capacity_;
+  int prompt_length_;
   int current_length_;
 };
 
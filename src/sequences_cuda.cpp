@@ -39,7 +39,7 @@ Sequences_Cuda::Sequences_Cuda(std::span<const int32_t> input_sequences, int bat
 
 RoamingArray<int32_t> Sequences_Cuda::GetSequence(size_t batch_beam_index) {
   auto span = sequences_.subspan(batch_beam_index * max_length_, current_length_);
-  return gpu_span<int32_t>{span.data(), span.size()};
+  return {gpu_span<int32_t>{span.data(), span.size()}, stream_};
 }
 
 int Sequences_Cuda::GetSequenceLength() const {
@@ -2,7 +2,13 @@
 // Licensed under the MIT License.
 #pragma once
 #include <assert.h>
+#include <atomic>
+#include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <tuple>
+#include <vector>
 #include "span.h"
 
 namespace Generators {
@@ -10,6 +16,26 @@ namespace Generators {
 template <typename... T>
 void Unreferenced(const T&...) {}
 
+// Totals of the allocations made for one subsystem, updated from any thread
+struct AllocationStats {
+  void OnAllocate(size_t bytes) {
+    count++;
+    allocated_bytes += bytes;
+    auto live = live_bytes += bytes;
+    for (auto peak = peak_bytes.load(); live > peak && !peak_bytes.compare_exchange_weak(peak, live);) {
+    }
+    for (auto largest = largest_bytes.load(); bytes > largest && !largest_bytes.compare_exchange_weak(largest, bytes);) {
+    }
+  }
+  void OnFree(size_t bytes) { live_bytes -= bytes; }
+
+  std::atomic<uint64_t> count{};
+  std::atomic<uint64_t> allocated_bytes{};  // Over every allocation made, including the freed ones
+  std::atomic<uint64_t> live_bytes{};
+  std::atomic<uint64_t> peak_bytes{};     // High-water mark of live_bytes
+  std::atomic<uint64_t> largest_bytes{};  // Of a single allocation
+};
+
 namespace Location {
 struct CPU {};
 struct GPU {};
@@ -101,6 +127,103 @@ struct cuda_event_holder {
   cudaEvent_t v_{};
 };
 
+// Keeps the pinned host and device buffers of the roaming array copies for reuse, by stream and size, as cudaMallocHost
+// is far too slow to call on every step. A buffer only goes back to the stream it was used on, so it's free for the
+// next copy on that stream without a wait, the stream orders the two. Sizes are rounded up to powers of two so varied
+// shapes share buffers, and past c_max_free_per_size buffers of a stream and size the freed ones are released.
+struct CudaCopyPool {
+  static constexpr size_t c_min_bytes = 256;
+  static constexpr size_t c_max_free_per_size = 8;
+
+  static CudaCopyPool& Get() {
+    static auto* pool = new CudaCopyPool;  // Never destroyed, the CUDA runtime can be unloaded before the statics are
+    return *pool;
+  }
+
+  static size_t RoundUp(size_t bytes) {
+    size_t rounded = c_min_bytes;
+    while (rounded < bytes)
+      rounded *= 2;
+    return rounded;
+  }
+
+  void* Allocate(cudaStream_t stream, size_t bytes, bool host) {
+    stats_.OnAllocate(bytes);
+    bytes = RoundUp(bytes);
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      auto it = free_.find(Key{reinterpret_cast<uintptr_t>(stream), bytes, host});
+      if (it != free_.end() && !it->second.empty()) {
+        void* p = it->second.back();
+        it->second.pop_back();
+        pooled_bytes_ -= bytes;
+        return p;
+      }
+    }
+    void* p{};
+    if (host)
+      CudaCheck() == ::cudaMallocHost(&p, bytes);
+    else
+      CudaCheck() == ::cudaMalloc(&p, bytes);
+    return p;
+  }
+
+  void Free(cudaStream_t stream, size_t bytes, bool host, void* p) {
+    stats_.OnFree(bytes);
+    bytes = RoundUp(bytes);
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      auto& list = free_[Key{reinterpret_cast<uintptr_t>(stream), bytes, host}];
+      if (list.size() < c_max_free_per_size) {
+        list.push_back(p);
+        pooled_bytes_ += bytes;
+        return;
+      }
+    }
+    // Both wait for the work queued with the buffer first
+    if (host)
+      (void)::cudaFreeHost(p);
+    else
+      (void)::cudaFree(p);
+  }
+
+  // Of the buffers handed out, whether they came from the free lists or not
+  const AllocationStats& GetStats() const { return stats_; }
+  // Of the buffers in the free lists
+  size_t GetPooledBytes() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    return pooled_bytes_;
+  }
+
+ private:
+  using Key = std::tuple<uintptr_t, size_t, bool>;
+  AllocationStats stats_;
+  mutable std::mutex mutex_;
+  std::map<Key, std::vector<void*>> free_;
+  size_t pooled_bytes_{};
+};
+
+struct CudaCopyPoolDeleter {
+  void operator()(void* p) {
+    CudaCopyPool::Get().Free(stream_, bytes_, host_, p);
+  }
+
+  cudaStream_t stream_{};
+  size_t bytes_{};
+  bool host_{};
+};
+
+template <typename T>
+using cuda_pool_unique_ptr = std::unique_ptr<T, CudaCopyPoolDeleter>;
+
+template <typename T, typename Span>
+cuda_pool_unique_ptr<T> CudaCopyPoolArray(cudaStream_t stream, size_t count, bool host, Span* p_span) {
+  const size_t bytes = sizeof(T) * count;
+  T* p = static_cast<T*>(CudaCopyPool::Get().Allocate(stream, bytes, host));
+  *p_span = Span(p, count);
+  return cuda_pool_unique_ptr<T>{p, CudaCopyPoolDeleter{stream, bytes, host}};
+}
+
 struct cuda_stream_holder {
   void Create() {
     assert(!v_);
@@ -135,70 +258,111 @@ struct cuda_stream_holder {
 #if USE_CUDA
 // A roaming array is one that can be in CPU or GPU memory, and will copy the memory as needed to be used from anywhere
 // It does not own the original memory, only the on-demand copy memory.
+//
+// The copies are queued on the stream of the array, the one its device memory is used on, into buffers of the
+// CudaCopyPool. A copy to the device is not waited on, so the cpu memory must not change until the stream has run up
+// to it. PrefetchToCPU() starts the copy to the host without waiting, for GetCPU() to wait on later, so the copy overlaps
+// with whatever the host does in between.
 template <typename T>
 struct RoamingArray {
   RoamingArray() = default;
   RoamingArray(const RoamingArray& v) { Assign(v); }
+  RoamingArray(RoamingArray&& v) = default;
+  RoamingArray& operator=(RoamingArray&& v) = default;
 
   bool empty() const { return cpu_.empty() && device_.empty(); }
+  bool IsOnGPU() const { return !device_.empty(); }  // True if GetGPU() won't need to copy
 
-  RoamingArray(cpu_span<T> v) {
-    SetCPU(v);
+  RoamingArray(cpu_span<T> v, cudaStream_t stream = nullptr) {
+    SetCPU(v, stream);
   }
 
-  RoamingArray(gpu_span<T> v) {
-    SetGPU(v);
+  RoamingArray(gpu_span<T> v, cudaStream_t stream = nullptr) {
+    SetGPU(v, stream);
   }
 
   operator cpu_span<T>() { return GetCPU(); }
   operator gpu_span<T>() { return GetGPU(); }
 
-  void SetCPU(cpu_span<T> cpu) {
+  void SetCPU(cpu_span<T> cpu, cudaStream_t stream = nullptr) {
     cpu_ = cpu;
     device_ = {};
+    stream_ = stream;
+    cpu_pending_ = false;
   }
 
-  void SetGPU(gpu_span<T> device) {
+  void SetGPU(gpu_span<T> device, cudaStream_t stream = nullptr) {
     device_ = device;
     cpu_ = {};
+    stream_ = stream;
+    cpu_pending_ = false;
   }
 
-  cpu_span<T> GetCPU() {
-    if (cpu_.empty() && !device_.empty()) {
-      cpu_owner_ = CudaMallocHostArray<T>(device_.size(), &cpu_);
-      cudaMemcpy(cpu_.data(), device_.data(), cpu_.size_bytes(), cudaMemcpyDeviceToHost);
-    }
+  void PrefetchToCPU() {
+    if (!cpu_.empty() || device_.empty())
+      return;
+    cpu_owner_ = CudaCopyPoolArray<T>(stream_, device_.size(), true, &cpu_);
+    CopyToCPU();
+  }
 
+  cpu_span<T> GetCPU() {
+    PrefetchToCPU();
+    WaitForCPU();
     return cpu_;
   }
 
   gpu_span<T> GetGPU() {
     if (device_.empty() && !cpu_.empty()) {
-      device_owner_ = CudaMallocArray<T>(cpu_.size(), &device_);
-      cudaMemcpy(device_.data(), cpu_.data(), cpu_.size_bytes(), cudaMemcpyHostToDevice);
+      device_owner_ = CudaCopyPoolArray<T>(stream_, cpu_.size(), false, &device_);
+      cudaMemcpyAsync(device_.data(), cpu_.data(), cpu_.size_bytes(), cudaMemcpyHostToDevice, stream_);
     }
     return device_;
   }
 
   void FlushCPUChanges() {
     if (!device_.empty())
-      cudaMemcpy(device_.data(), cpu_.data(), cpu_.size_bytes(), cudaMemcpyHostToDevice);
+      cudaMemcpyAsync(device_.data(), cpu_.data(), cpu_.size_bytes(), cudaMemcpyHostToDevice, stream_);
   }
 
   void FlushGPUChanges() {
-    if (!cpu_.empty())
-      cudaMemcpy(cpu_.data(), device_.data(), cpu_.size_bytes(), cudaMemcpyDeviceToHost);
+    if (!cpu_.empty()) {
+      CopyToCPU();
+      WaitForCPU();
+    }
   }
 
   void Assign(const RoamingArray<T>& v) {
+    if (v.cpu_pending_)
+      cudaEventSynchronize(*v.cpu_copied_);  // The copy only has the spans, not the pending copy
     cpu_ = v.cpu_;
     device_ = v.device_;
+    stream_ = v.stream_;
   }
 
   cpu_span<T> cpu_;
-  cuda_host_unique_ptr<T> cpu_owner_;
+  cuda_pool_unique_ptr<T> cpu_owner_;
   gpu_span<T> device_;
-  cuda_unique_ptr<T> device_owner_;
+  cuda_pool_unique_ptr<T> device_owner_;
+  cudaStream_t stream_{};
+
+ private:
+  void CopyToCPU() {
+    cudaMemcpyAsync(cpu_.data(), device_.data(), cpu_.size_bytes(), cudaMemcpyDeviceToHost, stream_);
+    if (!cpu_copied_)
+      cpu_copied_ = std::make_unique<cuda_event_holder>(cudaEventDisableTiming);
+    cudaEventRecord(*cpu_copied_, stream_);
+    cpu_pending_ = true;
+  }
+
+  void WaitForCPU() {
+    if (!cpu_pending_)
+      return;
+    cudaEventSynchronize(*cpu_copied_);
+    cpu_pending_ = false;
+  }
+
+  std::unique_ptr<cuda_event_holder> cpu_copied_;  // Recorded after the copy to the host
+  bool cpu_pending_{};                             // True until the copy to the host is waited on
 };
 #else
 // A roaming array is one that can be in CPU or GPU memory, and will copy the memory as needed to be used from anywhere
@@ -215,6 +379,8 @@ struct RoamingArray {
 
   operator cpu_span<T>() { return GetCPU(); }
 
+  void PrefetchToCPU() {}
+
   void SetCPU(cpu_span<T> cpu) {
     cpu_ = cpu;
   }
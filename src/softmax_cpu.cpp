@@ -1,4 +1,6 @@
 #include "generators.h"
+#include "softmax.h"
+#include "cpu_features.h"
 
 namespace Generators {
 
@@ -19,4 +21,270 @@ void log_softmax(std::span<float> values) {
   std::transform(values.begin(), values.end(), values.begin(), [max, log_max](float v) { return v - max - log_max; });
 }
 
+namespace {
+
+// The vector exp() below is the Cephes expf: x = n*ln(2) + r, exp(x) = 2^n * p(r). The input is clamped so that 2^n
+// stays a normal float, which rounds anything under ~1e-38 up to it. That's far below what sampling or scoring can see.
+constexpr float c_exp_lo = -87.3365479f;  // ln(2^-126)
+constexpr float c_exp_hi = 88.0f;
+constexpr float c_log2e = 1.44269504088896341f;
+constexpr float c_ln2_hi = 0.693359375f;
+constexpr float c_ln2_lo = -2.12194440e-4f;
+constexpr float c_p0 = 1.9875691500e-4f;
+constexpr float c_p1 = 1.3981999507e-3f;
+constexpr float c_p2 = 8.3334519073e-3f;
+constexpr float c_p3 = 4.1665795894e-2f;
+constexpr float c_p4 = 1.6666665459e-1f;
+constexpr float c_p5 = 5.0000001201e-1f;
+
+// Each implementation provides the three passes over the scores:
+//   Max:    the largest score
+//   ExpSum: the sum of exp((score - max) * scale), optionally storing each exp back into the scores
+//   MulAdd: score = score * mul + add
+struct Kernels {
+  float (*Max)(const float* p, size_t n);
+  float (*ExpSum)(float* p, size_t n, float max, float scale, bool store);
+  void (*MulAdd)(float* p, size_t n, float mul, float add);
+};
+
+float MaxScalar(const float* p, size_t n) {
+  return *std::max_element(p, p + n);
+}
+
+float ExpSumScalar(float* p, size_t n, float max, float scale, bool store) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < n; i++) {
+    float e = std::exp((p[i] - max) * scale);
+    if (store)
+      p[i] = e;
+    sum += e;
+  }
+  return sum;
+}
+
+void MulAddScalar(float* p, size_t n, float mul, float add) {
+  for (size_t i = 0; i < n; i++)
+    p[i] = p[i] * mul + add;
+}
+
+constexpr Kernels c_scalar_kernels{MaxScalar, ExpSumScalar, MulAddScalar};
+
+#if GENERATORS_X64
+
+GENERATORS_TARGET_AVX2 __m256 Exp(__m256 x) {
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(c_exp_lo)), _mm256_set1_ps(c_exp_hi));
+  __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(c_log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  x = _mm256_fnmadd_ps(n, _mm256_set1_ps(c_ln2_hi), x);
+  x = _mm256_fnmadd_ps(n, _mm256_set1_ps(c_ln2_lo), x);
+
+  __m256 y = _mm256_set1_ps(c_p0);
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_p1));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_p2));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_p3));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_p4));
+  y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_p5));
+  y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+  __m256i pow2n = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(y, _mm256_castsi256_ps(pow2n));
+}
+
+GENERATORS_TARGET_AVX2 float ReduceMax(__m256 v) {
+  __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+  m = _mm_max_ss(m, _mm_movehdup_ps(m));
+  return _mm_cvtss_f32(m);
+}
+
+GENERATORS_TARGET_AVX2 float ReduceAdd(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+
+GENERATORS_TARGET_AVX2 float MaxAvx2(const float* p, size_t n) {
+  if (n < 8)
+    return MaxScalar(p, n);
+  __m256 max = _mm256_loadu_ps(p);
+  size_t i = 8;
+  for (; i + 8 <= n; i += 8)
+    max = _mm256_max_ps(max, _mm256_loadu_ps(p + i));
+  float result = ReduceMax(max);
+  for (; i < n; i++)
+    result = std::max(result, p[i]);
+  return result;
+}
+
+GENERATORS_TARGET_AVX2 float ExpSumAvx2(float* p, size_t n, float max, float scale, bool store) {
+  const __m256 max_v = _mm256_set1_ps(max);
+  const __m256 scale_v = _mm256_set1_ps(scale);
+  __m256 sum = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 e = Exp(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(p + i), max_v), scale_v));
+    if (store)
+      _mm256_storeu_ps(p + i, e);
+    sum = _mm256_add_ps(sum, e);
+  }
+  return ReduceAdd(sum) + ExpSumScalar(p + i, n - i, max, scale, store);
+}
+
+GENERATORS_TARGET_AVX2 void MulAddAvx2(float* p, size_t n, float mul, float add) {
+  const __m256 mul_v = _mm256_set1_ps(mul);
+  const __m256 add_v = _mm256_set1_ps(add);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(p + i, _mm256_fmadd_ps(_mm256_loadu_ps(p + i), mul_v, add_v));
+  MulAddScalar(p + i, n - i, mul, add);
+}
+
+GENERATORS_TARGET_AVX512 __m512 Exp(__m512 x) {
+  x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(c_exp_lo)), _mm512_set1_ps(c_exp_hi));
+  __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(c_log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(c_ln2_hi), x);
+  x = _mm512_fnmadd_ps(n, _mm512_set1_ps(c_ln2_lo), x);
+
+  __m512 y = _mm512_set1_ps(c_p0);
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_p1));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_p2));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_p3));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_p4));
+  y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_p5));
+  y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+
+  __m512i pow2n = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+  return _mm512_mul_ps(y, _mm512_castsi512_ps(pow2n));
+}
+
+GENERATORS_TARGET_AVX512 float MaxAvx512(const float* p, size_t n) {
+  if (n < 16)
+    return MaxScalar(p, n);
+  __m512 max = _mm512_loadu_ps(p);
+  size_t i = 16;
+  for (; i + 16 <= n; i += 16)
+    max = _mm512_max_ps(max, _mm512_loadu_ps(p + i));
+  float result = _mm512_reduce_max_ps(max);
+  for (; i < n; i++)
+    result = std::max(result, p[i]);
+  return result;
+}
+
+GENERATORS_TARGET_AVX512 float ExpSumAvx512(float* p, size_t n, float max, float scale, bool store) {
+  const __m512 max_v = _mm512_set1_ps(max);
+  const __m512 scale_v = _mm512_set1_ps(scale);
+  __m512 sum = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 e = Exp(_mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(p + i), max_v), scale_v));
+    if (store)
+      _mm512_storeu_ps(p + i, e);
+    sum = _mm512_add_ps(sum, e);
+  }
+  return _mm512_reduce_add_ps(sum) + ExpSumScalar(p + i, n - i, max, scale, store);
+}
+
+GENERATORS_TARGET_AVX512 void MulAddAvx512(float* p, size_t n, float mul, float add) {
+  const __m512 mul_v = _mm512_set1_ps(mul);
+  const __m512 add_v = _mm512_set1_ps(add);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    _mm512_storeu_ps(p + i, _mm512_fmadd_ps(_mm512_loadu_ps(p + i), mul_v, add_v));
+  MulAddScalar(p + i, n - i, mul, add);
+}
+
+constexpr Kernels c_avx2_kernels{MaxAvx2, ExpSumAvx2, MulAddAvx2};
+constexpr Kernels c_avx512_kernels{MaxAvx512, ExpSumAvx512, MulAddAvx512};
+
+const Kernels& GetKernels() {
+  static const Kernels& kernels = HasAvx512() ? c_avx512_kernels : HasAvx2() ? c_avx2_kernels
+                                                                               : c_scalar_kernels;
+  return kernels;
+}
+
+#elif GENERATORS_NEON
+
+float32x4_t Exp(float32x4_t x) {
+  x = vminq_f32(vmaxq_f32(x, vdupq_n_f32(c_exp_lo)), vdupq_n_f32(c_exp_hi));
+  float32x4_t n = vrndnq_f32(vmulq_n_f32(x, c_log2e));
+  x = vfmsq_f32(x, n, vdupq_n_f32(c_ln2_hi));
+  x = vfmsq_f32(x, n, vdupq_n_f32(c_ln2_lo));
+
+  float32x4_t y = vdupq_n_f32(c_p0);
+  y = vfmaq_f32(vdupq_n_f32(c_p1), y, x);
+  y = vfmaq_f32(vdupq_n_f32(c_p2), y, x);
+  y = vfmaq_f32(vdupq_n_f32(c_p3), y, x);
+  y = vfmaq_f32(vdupq_n_f32(c_p4), y, x);
+  y = vfmaq_f32(vdupq_n_f32(c_p5), y, x);
+  y = vfmaq_f32(vaddq_f32(x, vdupq_n_f32(1.0f)), y, vmulq_f32(x, x));
+
+  int32x4_t pow2n = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
+  return vmulq_f32(y, vreinterpretq_f32_s32(pow2n));
+}
+
+float MaxNeon(const float* p, size_t n) {
+  if (n < 4)
+    return MaxScalar(p, n);
+  float32x4_t max = vld1q_f32(p);
+  size_t i = 4;
+  for (; i + 4 <= n; i += 4)
+    max = vmaxq_f32(max, vld1q_f32(p + i));
+  float result = vmaxvq_f32(max);
+  for (; i < n; i++)
+    result = std::max(result, p[i]);
+  return result;
+}
+
+float ExpSumNeon(float* p, size_t n, float max, float scale, bool store) {
+  const float32x4_t max_v = vdupq_n_f32(max);
+  float32x4_t sum = vdupq_n_f32(0.0f);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t e = Exp(vmulq_n_f32(vsubq_f32(vld1q_f32(p + i), max_v), scale));
+    if (store)
+      vst1q_f32(p + i, e);
+    sum = vaddq_f32(sum, e);
+  }
+  return vaddvq_f32(sum) + ExpSumScalar(p + i, n - i, max, scale, store);
+}
+
+void MulAddNeon(float* p, size_t n, float mul, float add) {
+  const float32x4_t add_v = vdupq_n_f32(add);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    vst1q_f32(p + i, vfmaq_n_f32(add_v, vld1q_f32(p + i), mul));
+  MulAddScalar(p + i, n - i, mul, add);
+}
+
+constexpr Kernels c_neon_kernels{MaxNeon, ExpSumNeon, MulAddNeon};
+
+const Kernels& GetKernels() { return c_neon_kernels; }
+
+#else
+
+const Kernels& GetKernels() { return c_scalar_kernels; }
+
+#endif
+
+}  // namespace
+
+void SoftMax(std::span<float> scores, float temperature) {
+  const auto& kernels = GetKernels();
+  const float max_score = kernels.Max(scores.data(), scores.size());
+
+  // exp((score - max) / temperature) is stored back while summing, then each one is divided by the sum
+  const float exp_sum = kernels.ExpSum(scores.data(), scores.size(), max_score, 1.0f / temperature, true);
+  kernels.MulAdd(scores.data(), scores.size(), 1.0f / exp_sum, 0.0f);
+}
+
+void LogSoftMax(std::span<float> scores, float temperature) {
+  const auto& kernels = GetKernels();
+  const float max_score = kernels.Max(scores.data(), scores.size());
+
+  // Only the sum of the exponentials is needed, so (score - max) / temperature - log(sum) is written in a single pass
+  const float scale = 1.0f / temperature;
+  const float exp_sum = kernels.ExpSum(scores.data(), scores.size(), max_score, scale, false);
+  kernels.MulAdd(scores.data(), scores.size(), scale, -max_score * scale - std::log(exp_sum));
+}
+
 }  // namespace Generators
@@ -0,0 +1,213 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "speculative.h"
+#include "search.h"
+#include "models/model.h"
+
+namespace Generators {
+
+namespace {
+
+// RunTokens() steps through a single sequence's kv cache one run at a time, so it can't be batched, beam searched,
+// padded, or use the fixed size kv caches of shared past/present buffers & graph capture
+void CheckSpeculativeParams(const Model& model, const GeneratorParams& params) {
+  if (params.batch_size != 1 || params.search.num_beams != 1)
+    throw std::runtime_error("Speculative decoding only supports a batch_size and num_beams of 1");
+  if (params.use_cuda_graph || params.search.past_present_share_buffer)
+    throw std::runtime_error("Speculative decoding doesn't support graph capture or past_present_share_buffer");
+  if (params.search.kv_window_size > 0)
+    throw std::runtime_error("Speculative decoding doesn't support kv_window_size, as it rewinds the kv caches");
+  if (model.device_type_ != DeviceType::CPU && model.device_type_ != DeviceType::CUDA)
+    throw std::runtime_error("Speculative decoding is only supported on CPU and CUDA, not " + to_string(model.device_type_));
+  if (std::find(params.input_ids.begin(), params.input_ids.end(), params.pad_token_id) != params.input_ids.end())
+    throw std::runtime_error("Speculative decoding doesn't support padded input_ids");
+  if (!params.logits_token_ids.empty())
+    throw std::runtime_error("Speculative decoding doesn't support model logits_token_ids");
+}
+
+size_t GetTokenCount(RoamingArray<float>& logits, size_t vocab_size, DeviceType device_type) {
+#if USE_CUDA
+  if (device_type == DeviceType::CUDA)
+    return logits.GetGPU().size() / vocab_size;
+#endif
+  return logits.GetCPU().size() / vocab_size;
+}
+
+// The logits of one of the tokens returned by RunTokens(), without moving the others between devices
+RoamingArray<float> GetTokenLogits(RoamingArray<float>& logits, size_t index, size_t vocab_size, DeviceType device_type) {
+#if USE_CUDA
+  if (device_type == DeviceType::CUDA) {
+    auto logits_gpu = logits.GetGPU();
+    return {gpu_span<float>{logits_gpu.data() + index * vocab_size, vocab_size}, logits.stream_};
+  }
+#endif
+  auto logits_cpu = logits.GetCPU();
+  return cpu_span<float>{logits_cpu.data() + index * vocab_size, vocab_size};
+}
+
+}  // namespace
+
+SpeculativeGenerator::SpeculativeGenerator(const Model& model, const Model& draft_model, const GeneratorParams& params, int lookahead)
+    : lookahead_{static_cast<size_t>(lookahead)} {
+  if (lookahead < 1)
+    throw std::runtime_error("lookahead must be 1 or greater, is " + std::to_string(lookahead));
+  if (draft_model.config_->model.vocab_size != model.config_->model.vocab_size)
+    throw std::runtime_error("The draft model's vocab_size (" + std::to_string(draft_model.config_->model.vocab_size) + ") must match the model's (" + std::to_string(model.config_->model.vocab_size) + ")");
+  if (model.config_->model.decoder.last_token_logits)
+    throw std::runtime_error("Speculative decoding needs the logits of every token, so the model can't use last_token_logits");
+  CheckSpeculativeParams(model, params);
+
+  // The draft runs on the same prompt, but only its kv cache and logits are used
+  draft_params_ = CreateGeneratorParams(draft_model);
+  draft_params_->search.max_length = params.search.max_length;
+  draft_params_->search.past_present_share_buffer = false;
+  draft_params_->batch_size = 1;
+  draft_params_->sequence_length = params.sequence_length;
+  draft_params_->input_ids_owner.assign(params.input_ids.begin(), params.input_ids.end());
+  draft_params_->input_ids = draft_params_->input_ids_owner;
+  CheckSpeculativeParams(draft_model, *draft_params_);
+
+  main_ = CreateGenerator(model, params);
+  draft_ = CreateGenerator(draft_model, *draft_params_);
+}
+
+SpeculativeGenerator::SpeculativeGenerator(const Model& model, const GeneratorParams& params, int lookahead, int max_ngram_size)
+    : lookahead_{static_cast<size_t>(lookahead)},
+      max_ngram_size_{static_cast<size_t>(max_ngram_size)} {
+  if (lookahead < 1)
+    throw std::runtime_error("lookahead must be 1 or greater, is " + std::to_string(lookahead));
+  if (max_ngram_size < 1)
+    throw std::runtime_error("max_ngram_size must be 1 or greater, is " + std::to_string(max_ngram_size));
+  if (model.config_->model.decoder.last_token_logits)
+    throw std::runtime_error("Speculative decoding needs the logits of every token, so the model can't use last_token_logits");
+  CheckSpeculativeParams(model, params);
+
+  main_ = CreateGenerator(model, params);
+}
+
+SpeculativeGenerator::SpeculativeGenerator(const Model& model, const GeneratorParams& params, int lookahead)
+    : lookahead_{static_cast<size_t>(lookahead)},
+      use_draft_heads_{true} {
+  const int draft_heads = model.config_->model.decoder.draft_heads;
+  if (lookahead < 1 || lookahead > draft_heads)
+    throw std::runtime_error("lookahead must be between 1 and the model's draft_heads (" + std::to_string(draft_heads) + "), is " + std::to_string(lookahead));
+  if (model.config_->model.decoder.last_token_logits)
+    throw std::runtime_error("Speculative decoding needs the logits of every token, so the model can't use last_token_logits");
+  CheckSpeculativeParams(model, params);
+
+  main_ = CreateGenerator(model, params);
+}
+
+void SpeculativeGenerator::ReadDraftHeads(size_t tokens_from_end) {
+  const auto& params = *main_->search_->params_;
+  head_tokens_.clear();
+  for (size_t head = 0; head < lookahead_; head++) {
+    auto logits = main_->state_->GetDraftLogits(head);
+    const size_t token_index = GetTokenCount(logits, params.vocab_size, params.device_type) - 1 - tokens_from_end;
+    auto token_logits = GetTokenLogits(logits, token_index, params.vocab_size, params.device_type);
+    auto token_logits_cpu = token_logits.GetCPU();
+    head_tokens_.push_back(static_cast<int32_t>(std::distance(token_logits_cpu.begin(), std::max_element(token_logits_cpu.begin(), token_logits_cpu.end()))));
+  }
+}
+
+void SpeculativeGenerator::ProposeTokens(std::span<const int32_t> sequence, size_t count) {
+  const size_t vocab_size = draft_params_->vocab_size;
+  draft_tokens_.assign(1, sequence.back());
+
+  // First catch up on the sequence tokens the draft hasn't seen, then feed it its own greedy picks
+  std::vector<int32_t> tokens(sequence.begin() + draft_length_, sequence.end());
+  for (size_t i = 0; i < count; i++) {
+    auto logits = draft_->state_->RunTokens(draft_length_, tokens);
+    draft_length_ += tokens.size();
+
+    auto last_logits = GetTokenLogits(logits, GetTokenCount(logits, vocab_size, draft_params_->device_type) - 1, vocab_size, draft_params_->device_type);
+    auto last_logits_cpu = last_logits.GetCPU();
+    const auto token = static_cast<int32_t>(std::distance(last_logits_cpu.begin(), std::max_element(last_logits_cpu.begin(), last_logits_cpu.end())));
+
+    draft_tokens_.push_back(token);
+    tokens.assign(1, token);
+  }
+  proposed_count_ += count;
+}
+
+void SpeculativeGenerator::LookUpTokens(std::span<const int32_t> sequence, size_t count) {
+  draft_tokens_.assign(1, sequence.back());
+
+  // The longest ngram wins, and of its matches the latest, as the recent tokens are the likeliest to be copied again
+  const size_t length = sequence.size();
+  for (size_t n = std::min(max_ngram_size_, length - 1); n > 0 && count > 0; n--) {
+    const auto ngram = sequence.subspan(length - n);
+    for (size_t start = length - n; start-- > 0;) {
+      if (!std::equal(ngram.begin(), ngram.end(), sequence.begin() + start))
+        continue;
+      const size_t end = std::min(start + n + count, length);
+      draft_tokens_.insert(draft_tokens_.end(), sequence.begin() + start + n, sequence.begin() + end);
+      proposed_count_ += end - start - n;
+      return;
+    }
+  }
+}
+
+void SpeculativeGenerator::GenerateNextTokens() {
+  if (main_->IsDone())
+    throw std::runtime_error("GenerateNextTokens called after the sequence is done");
+
+  // The first step runs the prompt through both models
+  if (main_length_ == 0) {
+    main_->ComputeLogits();
+    main_->GenerateNextToken();
+    if (use_draft_heads_)
+      ReadDraftHeads(0);
+    if (draft_)
+      draft_->state_->Run(draft_->search_->GetSequenceLength(), draft_->search_->GetNextTokens(), draft_->search_->GetNextIndices());
+    main_length_ = draft_length_ = static_cast<size_t>(main_->search_->params_->sequence_length);
+    return;
+  }
+
+  auto sequence = main_->GetSequence(0);
+  auto sequence_cpu = sequence.GetCPU();
+  const size_t length = sequence_cpu.size();
+
+  // The main run covers the positions [length - 1, length + count), keep them and every accepted token within max_length
+  const auto& params = *main_->search_->params_;
+  const size_t max_count = std::min(lookahead_, static_cast<size_t>(params.search.max_length) - length - 1);
+  if (draft_)
+    ProposeTokens(sequence_cpu, max_count);
+  else if (use_draft_heads_) {
+    // The heads ran on the token before the last one, whose own logits picked the last one, so they guess what follows it
+    draft_tokens_.assign(1, sequence_cpu.back());
+    draft_tokens_.insert(draft_tokens_.end(), head_tokens_.begin(), head_tokens_.begin() + max_count);
+    proposed_count_ += max_count;
+  } else
+    LookUpTokens(sequence_cpu, max_count);
+  const size_t count = draft_tokens_.size() - 1;
+
+  const size_t vocab_size = params.vocab_size;
+  const auto device_type = params.device_type;
+  auto logits = main_->state_->RunTokens(main_length_, draft_tokens_);
+
+  // The logits of token i choose the token after it, which is accepted as long as the draft proposed the same one
+  size_t accepted = 0;
+  for (size_t i = 0; i <= count; i++) {
+    main_->SetLogits(GetTokenLogits(logits, i, vocab_size, device_type));
+    main_->GenerateNextToken();
+    if (i == count || main_->IsDone())
+      break;
+
+    auto next_tokens = main_->search_->GetNextTokens();
+    if (next_tokens.GetCPU()[0] != draft_tokens_[i + 1])
+      break;
+    accepted++;
+  }
+  accepted_count_ += accepted;
+  if (use_draft_heads_)
+    ReadDraftHeads(count - accepted);
+
+  // Both kv caches keep only the entries for tokens that made it into the sequence, RunTokens() drops the rest
+  main_length_ = length + accepted;
+  draft_length_ = std::min(draft_length_, main_length_);
+}
+
+}  // namespace Generators
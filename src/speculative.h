@@ -0,0 +1,57 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// Speculative decoding of a single sequence. Every step a small draft model proposes up to 'lookahead' tokens one at a
+// time, then the main model runs all of them at once. The main model's search picks its tokens from those logits in
+// order, and the draft tokens are accepted for as long as they match what it picked. So the output is exactly what the
+// main model generates on its own (greedy or sampled), only with fewer main model runs when the draft agrees with it.
+struct SpeculativeGenerator {
+  SpeculativeGenerator(const Model& model, const Model& draft_model, const GeneratorParams& params, int lookahead);
+
+  // Prompt lookup decoding, without a draft model. The proposed tokens are the ones that followed the last earlier match
+  // of the sequence's final max_ngram_size tokens (or fewer, down to one) in the prompt and generated tokens, which
+  // suits outputs that copy spans of their prompt, like summaries and code edits. Steps without a match run one token.
+  SpeculativeGenerator(const Model& model, const GeneratorParams& params, int lookahead, int max_ngram_size);
+
+  // Medusa style decoding with the model's own draft heads (model.decoder.draft_heads), without a draft model. The
+  // proposed tokens are the picks of the first 'lookahead' heads at the last accepted token of the previous run, and are
+  // verified in the same run that gives the next step's head logits.
+  SpeculativeGenerator(const Model& model, const GeneratorParams& params, int lookahead);
+
+  bool IsDone() const { return main_->IsDone(); }
+
+  // Appends between 1 and lookahead + 1 tokens to the sequence
+  void GenerateNextTokens();
+
+  RoamingArray<int32_t> GetSequence() const { return main_->GetSequence(0); }
+
+  // How many draft tokens were proposed & accepted so far, for tuning the lookahead
+  size_t GetProposedCount() const { return proposed_count_; }
+  size_t GetAcceptedCount() const { return accepted_count_; }
+
+ private:
+  void ProposeTokens(std::span<const int32_t> sequence, size_t count);
+  void LookUpTokens(std::span<const int32_t> sequence, size_t count);
+  void ReadDraftHeads(size_t tokens_from_end);  // Takes the heads' picks at a token of the last run for the next proposal
+
+  std::unique_ptr<Generator> main_;
+  std::shared_ptr<GeneratorParams> draft_params_;
+  std::unique_ptr<Generator> draft_;  // None with prompt lookup
+  size_t lookahead_;
+  size_t max_ngram_size_{};
+  bool use_draft_heads_{};
+  std::vector<int32_t> head_tokens_;  // The draft heads' picks after the last sequence token
+
+  // Number of leading sequence tokens held by each model's kv cache. Both are behind the sequence by at least one token
+  size_t main_length_{};
+  size_t draft_length_{};
+
+  std::vector<int32_t> draft_tokens_;  // The last token of the sequence followed by the proposed tokens
+  size_t proposed_count_{};
+  size_t accepted_count_{};
+};
+
+}  // namespace Generators
@@ -0,0 +1,71 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "stop_sequences.h"
+#include <map>
+#include <queue>
+
+namespace Generators {
+
+StopSequences::StopSequences(std::span<const std::vector<int32_t>> sequences) {
+  // Build the trie of the stop sequences first, state 0 is its root
+  std::vector<std::map<int32_t, int32_t>> children(1);
+  matches_.assign(1, 0);
+  for (auto& sequence : sequences) {
+    if (sequence.empty())
+      throw std::runtime_error("A stop sequence must have at least one token");
+    int32_t state = c_initial_state;
+    for (auto token : sequence) {
+      auto next = static_cast<int32_t>(children.size());
+      auto [it, inserted] = children[state].emplace(token, next);
+      next = it->second;
+      if (inserted) {
+        children.emplace_back();
+        matches_.push_back(0);
+      }
+      state = next;
+    }
+    matches_[state] = 1;
+  }
+
+  edge_offsets_.push_back(0);
+  for (auto& edges : children) {
+    for (auto& [token, target] : edges) {
+      edge_tokens_.push_back(token);
+      edge_targets_.push_back(target);
+    }
+    edge_offsets_.push_back(static_cast<int32_t>(edge_tokens_.size()));
+  }
+
+  // Breadth first, so the failure states (always shorter) are done before the states that fall back to them. A state
+  // also matches when the stop sequence that ends its failure state does
+  failures_.assign(children.size(), c_initial_state);
+  std::queue<int32_t> queue;
+  for (auto& [token, child] : children[c_initial_state])
+    queue.push(child);
+  while (!queue.empty()) {
+    const int32_t state = queue.front();
+    queue.pop();
+    matches_[state] |= matches_[failures_[state]];
+    for (auto& [token, child] : children[state]) {
+      failures_[child] = Advance(failures_[state], token);
+      queue.push(child);
+    }
+  }
+}
+
+int32_t StopSequences::Advance(int32_t state, int32_t token) const {
+  for (;;) {
+    auto begin = edge_tokens_.begin() + edge_offsets_[state];
+    auto end = edge_tokens_.begin() + edge_offsets_[state + 1];
+    auto it = std::lower_bound(begin, end, token);
+    if (it != end && *it == token)
+      return edge_targets_[it - edge_tokens_.begin()];
+    if (state == c_initial_state)
+      return c_initial_state;
+    state = failures_[state];
+  }
+}
+
+}  // namespace Generators
@@ -0,0 +1,33 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// Ends a sequence once it generates any of a set of token sequences, like the tokens of stop strings, with the tokens of
+// the match as its last ones. The stop sequences are matched together by an Aho-Corasick automaton over the token ids:
+// a state is the longest start of a stop sequence that the generated tokens end with, so advancing by a token is a few
+// lookups in the edges of a state and the ones it falls back to, however many stop sequences there are.
+struct StopSequences {
+  explicit StopSequences(std::span<const std::vector<int32_t>> sequences);
+
+  static constexpr int32_t c_initial_state = 0;
+
+  int32_t Advance(int32_t state, int32_t token) const;
+  bool IsMatch(int32_t state) const { return matches_[state] != 0; }  // A stop sequence ends with the tokens so far
+
+  // The automaton as flat arrays, for the cuda search. The edges of state s are [offsets[s], offsets[s + 1]), sorted by
+  // token, and a state without an edge for a token falls back to its failure state
+  std::span<const int32_t> GetEdgeOffsets() const { return edge_offsets_; }  // state_count + 1
+  std::span<const int32_t> GetEdgeTokens() const { return edge_tokens_; }
+  std::span<const int32_t> GetEdgeTargets() const { return edge_targets_; }
+  std::span<const int32_t> GetFailures() const { return failures_; }  // state_count
+  std::span<const int32_t> GetMatches() const { return matches_; }    // state_count, 1 if IsMatch
+
+ private:
+  std::vector<int32_t> edge_offsets_, edge_tokens_, edge_targets_;
+  std::vector<int32_t> failures_;  // The state of the longest proper suffix of each state's tokens
+  std::vector<int32_t> matches_;
+};
+
+}  // namespace Generators
@@ -8,6 +8,7 @@ struct Tensor : std::enable_shared_from_this<Tensor> {
 
   std::unique_ptr<OrtValue> ort_tensor_;
   std::shared_ptr<Tensor> external_owner_;  // Set to 'this' when created by the C API to preserve lifetime
+  void* stream_{};                          // For a tensor in CUDA memory, the cudaStream_t its data is written on
 };
 
 using NamedTensors = std::unordered_map<std::string, std::shared_ptr<Tensor>>;
@@ -0,0 +1,188 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "thread_pool.h"
+#include "cpu_affinity.h"
+
+namespace Generators {
+
+ThreadPool::ThreadPool(size_t thread_count) {
+  for (size_t thread_index = 1; thread_index < thread_count; thread_index++)
+    workers_.emplace_back([this, thread_index] { WorkerLoop(thread_index); });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stopping_ = true;
+  }
+  work_ready_.notify_all();
+  for (auto& worker : workers_)
+    worker.join();
+}
+
+void ThreadPool::PinWorkers(const std::vector<int>& cpus) {
+  for (size_t i = 0; i < workers_.size(); i++)
+    PinThread(workers_[i], {cpus[(i + 1) % cpus.size()]});
+}
+
+void ThreadPool::ParallelFor(size_t count, const std::function<void(size_t, size_t)>& fn) {
+  if (workers_.empty() || count <= 1) {
+    for (size_t i = 0; i < count; i++)
+      fn(i, 0);
+    return;
+  }
+
+  std::lock_guard<std::mutex> call_lock{call_mutex_};
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    fn_ = &fn;
+    count_ = count;
+    next_index_ = 0;
+    busy_workers_ = workers_.size();
+    generation_++;
+  }
+  work_ready_.notify_all();
+
+  RunItems(0);
+
+  std::exception_ptr error;
+  {
+    std::unique_lock<std::mutex> lock{mutex_};
+    work_done_.wait(lock, [this] { return busy_workers_ == 0; });
+    fn_ = nullptr;
+    std::swap(error, error_);
+  }
+  if (error)
+    std::rethrow_exception(error);
+}
+
+void ThreadPool::WorkerLoop(size_t thread_index) {
+  uint64_t generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      work_ready_.wait(lock, [&] { return stopping_ || generation_ != generation; });
+      if (stopping_)
+        return;
+      generation = generation_;
+    }
+
+    RunItems(thread_index);
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (--busy_workers_ == 0)
+      work_done_.notify_one();
+  }
+}
+
+void ThreadPool::RunItems(size_t thread_index) {
+  for (size_t index; (index = next_index_++) < count_;) {
+    try {
+      (*fn_)(index, thread_index);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock{mutex_};
+      if (!error_)
+        error_ = std::current_exception();
+    }
+  }
+}
+
+TaskQueue::TaskQueue(size_t thread_count) {
+  for (size_t i = 0; i < std::max<size_t>(thread_count, 1); i++)
+    workers_.emplace_back([this] { WorkerLoop(); });
+}
+
+TaskQueue::~TaskQueue() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stopping_ = true;
+  }
+  task_ready_.notify_all();
+  for (auto& worker : workers_)
+    worker.join();
+}
+
+void TaskQueue::Submit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    tasks_.push_back(std::move(task));
+  }
+  task_ready_.notify_one();
+}
+
+void TaskQueue::WorkerLoop() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      task_ready_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+      if (tasks_.empty())
+        return;  // Only when stopping
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+DeadlineTimer::DeadlineTimer() {
+  thread_ = std::thread{[this] { TimerLoop(); }};  // Here, once the members it uses are constructed
+}
+
+DeadlineTimer::~DeadlineTimer() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stopping_ = true;
+  }
+  changed_.notify_all();
+  thread_.join();
+}
+
+uint64_t DeadlineTimer::Schedule(Clock::time_point when, std::function<void()> fn) {
+  uint64_t id;
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    id = next_id_++;
+    scheduled_.emplace(when, std::make_pair(id, std::move(fn)));
+  }
+  changed_.notify_all();  // It may be earlier than the one the timer waits for
+  return id;
+}
+
+void DeadlineTimer::Cancel(uint64_t id) {
+  std::unique_lock<std::mutex> lock{mutex_};
+  auto it = std::find_if(scheduled_.begin(), scheduled_.end(), [id](const auto& entry) { return entry.second.first == id; });
+  if (it != scheduled_.end()) {
+    scheduled_.erase(it);
+    return;
+  }
+  changed_.wait(lock, [&] { return running_id_ != id; });
+}
+
+void DeadlineTimer::TimerLoop() {
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (!stopping_) {
+    if (scheduled_.empty()) {
+      changed_.wait(lock);
+      continue;
+    }
+    auto first = scheduled_.begin();
+    if (Clock::now() < first->first) {
+      changed_.wait_until(lock, first->first);
+      continue;  // Woken early, or the entries changed
+    }
+
+    auto fn = std::move(first->second.second);
+    running_id_ = first->second.first;
+    scheduled_.erase(first);
+    lock.unlock();
+    fn();
+    lock.lock();
+    running_id_ = 0;
+    changed_.notify_all();
+  }
+}
+
+}  // namespace Generators
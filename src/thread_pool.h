@@ -0,0 +1,109 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Generators {
+
+// A fixed set of worker threads that split up loops together with the calling thread. The workers sleep between loops,
+// so unlike starting std::threads per loop it's cheap enough to use on every generated token.
+struct ThreadPool {
+  ThreadPool(size_t thread_count);  // Includes the calling thread, so thread_count - 1 workers are started
+  ~ThreadPool();
+
+  size_t GetThreadCount() const { return workers_.size() + 1; }
+
+  // Pins the workers to cpus, round robin. The calling threads stay where they are
+  void PinWorkers(const std::vector<int>& cpus);
+
+  // Runs fn(index, thread_index) for every index in [0, count) and returns once they're all done. thread_index is in
+  // [0, GetThreadCount()) and unique among the threads of this call, so it can pick per thread scratch memory the call
+  // owns, but not memory shared across calls: one that runs inline (no workers or count <= 1) uses 0 while another loop
+  // may be running. The first exception thrown by fn is rethrown here. Only one loop runs on the workers at a time,
+  // overlapping calls wait their turn.
+  void ParallelFor(size_t count, const std::function<void(size_t index, size_t thread_index)>& fn);
+
+ private:
+  ThreadPool(const ThreadPool&) = delete;
+  void operator=(const ThreadPool&) = delete;
+
+  void WorkerLoop(size_t thread_index);
+  void RunItems(size_t thread_index);
+
+  std::vector<std::thread> workers_;
+
+  std::mutex call_mutex_;  // Held for the duration of a ParallelFor
+  std::mutex mutex_;       // Guards everything below
+  std::condition_variable work_ready_;
+  std::condition_variable work_done_;
+  uint64_t generation_{};  // Incremented for every loop, so the workers know there's new work
+  size_t busy_workers_{};
+  bool stopping_{};
+  std::exception_ptr error_;
+
+  const std::function<void(size_t, size_t)>* fn_{};
+  size_t count_{};
+  std::atomic<size_t> next_index_{};
+};
+
+// Runs submitted tasks in order on a fixed set of worker threads, for work that blocks (like a model run) and so shouldn't
+// hold up a ThreadPool loop. Tasks still queued when it's destroyed are run before the workers exit.
+struct TaskQueue {
+  TaskQueue(size_t thread_count);
+  ~TaskQueue();
+
+  void Submit(std::function<void()> task);
+
+ private:
+  TaskQueue(const TaskQueue&) = delete;
+  void operator=(const TaskQueue&) = delete;
+
+  void WorkerLoop();
+
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;  // Guards everything below
+  std::condition_variable task_ready_;
+  std::deque<std::function<void()>> tasks_;
+  bool stopping_{};
+};
+
+// Calls each scheduled function on its own thread once its time comes, for deadlines that have to fire in the middle of
+// a blocking call. The functions are called one at a time, so they should only flag what has to stop.
+struct DeadlineTimer {
+  using Clock = std::chrono::steady_clock;
+
+  DeadlineTimer();
+  ~DeadlineTimer();  // Drops the functions whose time hasn't come
+
+  uint64_t Schedule(Clock::time_point when, std::function<void()> fn);  // Returns the id to Cancel it with
+
+  // Once it returns the function isn't called anymore, it waits if the function is running. Unknown ids are ignored
+  void Cancel(uint64_t id);
+
+ private:
+  DeadlineTimer(const DeadlineTimer&) = delete;
+  void operator=(const DeadlineTimer&) = delete;
+
+  void TimerLoop();
+
+  std::thread thread_;
+
+  std::mutex mutex_;  // Guards everything below
+  std::condition_variable changed_;
+  std::multimap<Clock::time_point, std::pair<uint64_t, std::function<void()>>> scheduled_;
+  uint64_t next_id_{1};
+  uint64_t running_id_{};  // Of the function being called, 0 for none
+  bool stopping_{};
+};
+
+}  // namespace Generators
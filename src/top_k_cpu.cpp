@@ -4,29 +4,29 @@ namespace Generators {
 void top_k_indices(std::span<int32_t> top_k, std::span<const float> inputs) {
   int32_t k = static_cast<int32_t>(top_k.size());
   assert(k <= inputs.size());  // Use a smaller top_k span if k is larger than inputs
+  if (k == 0)
+    return;
 
-  // Min heap to store pairs of (element, index)
-  std::priority_queue<std::pair<float, int32_t>, std::vector<std::pair<float, int32_t>>, std::greater<>> pq;
+  // Min heap of the indices of the k largest entries, kept in top_k itself so nothing is allocated
+  auto greater = [inputs = inputs.data()](int32_t a, int32_t b) { return inputs[a] > inputs[b]; };
 
   // Add first k elements into the heap
-  for (int32_t i = 0; i < k; i++) {
-    pq.push(std::make_pair(inputs[i], i));
-  }
+  std::iota(top_k.begin(), top_k.end(), 0);
+  std::make_heap(top_k.begin(), top_k.end(), greater);
 
   // For the rest of the elements we already have k, so remove the smallest on each iteration
   for (int32_t i = k; i < inputs.size(); i++) {
     // Entry is smaller than the smallest, so don't bother
-    if (inputs[i] <= pq.top().first)
+    if (inputs[i] <= inputs[top_k[0]])
       continue;
 
-    pq.pop();
-    pq.push(std::make_pair(inputs[i], i));
+    std::pop_heap(top_k.begin(), top_k.end(), greater);
+    top_k.back() = i;
+    std::push_heap(top_k.begin(), top_k.end(), greater);
   }
 
-  for (int i = 0; i < k; i++) {
-    top_k[k - i - 1] = pq.top().second;
-    pq.pop();
-  }
+  // Largest first
+  std::sort_heap(top_k.begin(), top_k.end(), greater);
 }
 
 }  // namespace Generators
@@ -0,0 +1,89 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include "generators.h"
+#include "vector_math.h"
+#include "cpu_features.h"
+
+namespace Generators {
+
+namespace {
+
+using DotKernel = float (*)(const float* a, const float* b, size_t n);
+
+float DotScalar(const float* a, const float* b, size_t n) {
+  float sum = 0.0f;
+  for (size_t i = 0; i < n; i++)
+    sum += a[i] * b[i];
+  return sum;
+}
+
+#if GENERATORS_X64
+
+GENERATORS_TARGET_AVX2 float ReduceAdd(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+
+// Two accumulators, so consecutive fmas don't wait on each other
+GENERATORS_TARGET_AVX2 float DotAvx2(const float* a, const float* b, size_t n) {
+  __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+    sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+  }
+  for (; i + 8 <= n; i += 8)
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+  return ReduceAdd(_mm256_add_ps(sum0, sum1)) + DotScalar(a + i, b + i, n - i);
+}
+
+GENERATORS_TARGET_AVX512 float DotAvx512(const float* a, const float* b, size_t n) {
+  __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+    sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+  }
+  for (; i + 16 <= n; i += 16)
+    sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+  return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1)) + DotScalar(a + i, b + i, n - i);
+}
+
+DotKernel GetDot() {
+  static const DotKernel dot = HasAvx512() ? DotAvx512 : HasAvx2() ? DotAvx2
+                                                                   : DotScalar;
+  return dot;
+}
+
+#elif GENERATORS_NEON
+
+float DotNeon(const float* a, const float* b, size_t n) {
+  float32x4_t sum0 = vdupq_n_f32(0.0f), sum1 = vdupq_n_f32(0.0f);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+    sum1 = vfmaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+  }
+  for (; i + 4 <= n; i += 4)
+    sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+  return vaddvq_f32(vaddq_f32(sum0, sum1)) + DotScalar(a + i, b + i, n - i);
+}
+
+DotKernel GetDot() { return DotNeon; }
+
+#else
+
+DotKernel GetDot() { return DotScalar; }
+
+#endif
+
+}  // namespace
+
+float Dot(std::span<const float> a, const float* b) {
+  return GetDot()(a.data(), b, a.size());
+}
+
+}  // namespace Generators
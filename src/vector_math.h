@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+#pragma once
+
+namespace Generators {
+
+// The sum of a[i] * b[i] over a, b holds as many. For the filters and transforms of the audio front end, using AVX-512,
+// AVX2 or NEON when the CPU has it
+float Dot(std::span<const float> a, const float* b);
+
+}  // namespace Generators
@@ -3,6 +3,9 @@
 #include <search.h>
 #include <models/model.h>
 #include <iostream>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <ort_genai.h>
 #ifndef MODEL_PATH
 #define MODEL_PATH "../../test/test_models/"
@@ -36,6 +39,16 @@ TEST(CAPITests, TokenizerCAPI) {
       tokenizer->Encode(string, *sequences);
   }
 
+  // Encoding the rest after an encoded prefix gives the tokens of the whole string
+  {
+    auto prefix = tokenizer->EncodePrefix("This is");
+    auto prefix_sequences = OgaSequences::Create();
+    tokenizer->EncodeWithPrefix(*prefix, " a test.", *prefix_sequences);
+    std::span<const int32_t> expected = sequences->Get(0), actual = prefix_sequences->Get(0);
+    if (!std::equal(expected.begin(), expected.end(), actual.begin(), actual.end()))
+      throw std::runtime_error("Prefix token encoding mismatch");
+  }
+
   // Decode one at a time
   for (size_t i = 0; i < sequences->Count(); i++) {
     auto out_string = tokenizer->Decode(sequences->Get(i));
@@ -57,6 +70,76 @@ TEST(CAPITests, TokenizerCAPI) {
     if (strcmp(input_strings[i], stream_result.c_str()) != 0)
       throw std::runtime_error("Stream token decoding mismatch");
   }
+
+  // Stream Decode all sequences at once, with a buffer too small for some chunks so they come out a token later
+  {
+    std::vector<std::unique_ptr<OgaTokenizerStream>> owners;
+    std::vector<OgaTokenizerStream*> streams;
+    size_t max_length = 0;
+    for (size_t i = 0; i < sequences->Count(); i++) {
+      streams.push_back(owners.emplace_back(OgaTokenizerStream::Create(*tokenizer)).get());
+      max_length = std::max(max_length, sequences->SequenceCount(i));
+    }
+
+    std::vector<std::string> stream_results(streams.size());
+    std::vector<char> buffer(16);
+    std::vector<size_t> chunk_offsets(streams.size() + 1);
+    std::vector<int32_t> tokens(streams.size());
+    // Past the end of a sequence -1 only writes what's still in its stream
+    for (size_t t = 0; t < max_length + streams.size(); t++) {
+      for (size_t i = 0; i < streams.size(); i++)
+        tokens[i] = t < sequences->SequenceCount(i) ? sequences->Get(i)[t] : -1;
+      OgaTokenizerStream::DecodeNext(streams.data(), tokens.data(), streams.size(), buffer.data(), buffer.size(), chunk_offsets.data());
+      for (size_t i = 0; i < streams.size(); i++)
+        stream_results[i].append(buffer.data() + chunk_offsets[i], chunk_offsets[i + 1] - chunk_offsets[i]);
+    }
+
+    for (size_t i = 0; i < streams.size(); i++) {
+      if (strcmp(input_strings[i], stream_results[i].c_str()) != 0)
+        throw std::runtime_error("Batched stream token decoding mismatch");
+    }
+  }
+
+  // A call that throws leaves every chunk in its stream, including the ones that fit before the chunk that didn't
+  {
+    auto stream_0 = OgaTokenizerStream::Create(*tokenizer);
+    auto stream_1 = OgaTokenizerStream::Create(*tokenizer);
+    std::array<OgaTokenizerStream*, 2> streams{stream_0.get(), stream_1.get()};
+    const int32_t token = sequences->Get(0)[1];
+    std::array<int32_t, 2> tokens{token, token};
+    std::array<size_t, 3> chunk_offsets{};
+    std::array<std::string, 2> stream_results;
+    auto append = [&](std::vector<char>& buffer) {
+      for (size_t i = 0; i < streams.size(); i++)
+        stream_results[i].append(buffer.data() + chunk_offsets[i], chunk_offsets[i + 1] - chunk_offsets[i]);
+    };
+
+    auto expected_stream = OgaTokenizerStream::Create(*tokenizer);
+    std::string expected = expected_stream->Decode(token);
+    // Only the first stream's chunk fits, the second one stays in its stream
+    std::vector<char> buffer(expected.size());
+    OgaTokenizerStream::DecodeNext(streams.data(), tokens.data(), streams.size(), buffer.data(), buffer.size(), chunk_offsets.data());
+    append(buffer);
+    expected += expected_stream->Decode(token);
+    // The second stream now holds two chunks, more than the buffer
+    EXPECT_THROW(OgaTokenizerStream::DecodeNext(streams.data(), tokens.data(), streams.size(), buffer.data(), buffer.size(), chunk_offsets.data()), std::runtime_error);
+
+    std::vector<char> large_buffer(64);
+    std::array<int32_t, 2> flush{-1, -1};
+    OgaTokenizerStream::DecodeNext(streams.data(), flush.data(), streams.size(), large_buffer.data(), large_buffer.size(), chunk_offsets.data());
+    append(large_buffer);
+    EXPECT_EQ(stream_results[0], expected);
+    EXPECT_EQ(stream_results[1], expected);
+  }
+
+  // The model parses its tokenizer once, later ones are the same tokenizer and outlive the other handles
+  {
+    auto shared_tokenizer = OgaTokenizer::Create(*model);
+    ASSERT_EQ(shared_tokenizer.get(), tokenizer.get());
+    tokenizer.reset();
+    auto out_string = shared_tokenizer->Decode(sequences->Get(0));
+    ASSERT_STREQ(input_strings[0], out_string);
+  }
 #endif
 }
 
@@ -171,6 +254,315 @@ TEST(CAPITests, GreedySearchGptFp32CAPI) {
     EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence_data, sequence_length * sizeof(int32_t)));
   }
 }
+
+// The next tokens of each step are the last tokens of the sequences
+TEST(CAPITests, GetNextTokensGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), 4, 2);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  EXPECT_THROW(generator->GetNextTokens(), std::runtime_error);  // No step has run
+
+  while (!generator->IsDone()) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+
+    auto next_tokens = generator->GetNextTokens();
+    ASSERT_EQ(next_tokens.size(), 2U);
+    for (size_t i = 0; i < next_tokens.size(); i++) {
+      auto sequence = generator->GetSequence(i);
+      EXPECT_EQ(next_tokens[i], sequence.back());
+    }
+  }
+}
+
+// Warming up runs generators of its own, so the generation after it is the same as without
+TEST(CAPITests, WarmupGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+  const int max_length = 10;
+  const int batch_size = 2;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+
+  const std::vector<int32_t> batch_sizes{1, 2};
+  const std::vector<int32_t> prompt_lengths{1, 4};
+  model->Warmup(*params, batch_sizes, prompt_lengths);
+  EXPECT_THROW(model->Warmup(*params, batch_sizes, std::vector<int32_t>{max_length}), std::runtime_error);
+
+  params->SetInputIDs(input_ids.data(), input_ids.size(), input_ids.size() / batch_size, batch_size);
+  auto sequences = model->Generate(*params);
+  for (int i = 0; i < batch_size; i++) {
+    ASSERT_EQ(sequences->SequenceCount(i), max_length);
+    EXPECT_TRUE(0 == std::memcmp(&expected_output[i * max_length], sequences->SequenceData(i), max_length * sizeof(int32_t)));
+  }
+}
+
+TEST(CAPITests, StopSequencesGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  // The second sequence ends with its first 114, 114, after the start of the other stop sequence falls back to it. The
+  // rest of it is pad tokens (98)
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 98, 98, 98};
+  const std::vector<int32_t> stop_sequence_0{731, 114, 999};
+  const std::vector<int32_t> stop_sequence_1{114, 114};
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), 4, 2);
+  params->AddStopSequence(stop_sequence_0.data(), stop_sequence_0.size());
+  params->AddStopSequence(stop_sequence_1.data(), stop_sequence_1.size());
+
+  auto sequences = model->Generate(*params);
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(sequences->SequenceCount(i), static_cast<size_t>(max_length));
+    EXPECT_TRUE(0 == std::memcmp(&expected_output[i * max_length], sequences->SequenceData(i), max_length * sizeof(int32_t)));
+  }
+}
+
+TEST(CAPITests, CancelGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), 4, 2);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  generator->ComputeLogits();
+  generator->GenerateNextToken();
+  generator->Cancel();
+  EXPECT_TRUE(generator->IsDone());
+  EXPECT_THROW(generator->ComputeLogits(), std::runtime_error);
+
+  // Cancelled from another thread between steps, which releases the state right away
+  generator = OgaGenerator::Create(*model, *params);
+  generator->ComputeLogits();
+  std::thread{[&] { generator->Cancel(); }}.join();
+  EXPECT_TRUE(generator->IsDone());
+  EXPECT_FALSE(generator->IsSwappedOut());
+  EXPECT_THROW(generator->GenerateNextToken(), std::runtime_error);
+
+  // Cancelled from the timer's thread once the deadline passes. The wait is only bounded so a failure doesn't hang
+  params->SetTimeout(1e-6);
+  generator = OgaGenerator::Create(*model, *params);
+  const auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!generator->IsDone() && std::chrono::steady_clock::now() < give_up)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_TRUE(generator->IsDone());
+  EXPECT_THROW(generator->ComputeLogits(), std::runtime_error);
+}
+
+// Each request's tokens come out of the step that generates them, and add up to its finished sequence
+TEST(CAPITests, SchedulerStreamGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto scheduler = OgaScheduler::Create(*model, 2, 0, true);
+
+  std::vector<uint64_t> ids;
+  for (size_t i = 0; i < 3; i++) {
+    auto params = OgaGeneratorParams::Create(*model);
+    params->SetSearchOption("max_length", 10);
+    params->SetInputIDs(input_ids.data() + (i % 2) * 4, 4, 4, 1);
+    ids.push_back(scheduler->AddRequest(*params));
+  }
+  scheduler->Cancel(ids[2]);  // Still waiting, it never runs
+  EXPECT_THROW(scheduler->Cancel(ids[2]), std::runtime_error);
+
+  std::vector<std::vector<int32_t>> streamed(2);
+  auto sequences = OgaSequences::Create();
+  std::vector<uint64_t> finished;
+  while (!scheduler->IsDone()) {
+    scheduler->Step();
+    EXPECT_EQ(scheduler->GetMetric("waiting_count"), 0.0);
+    for (size_t i = 0; i < scheduler->GetStepTokenCount(); i++) {
+      uint64_t id;
+      const int32_t* tokens;
+      size_t token_count;
+      scheduler->GetStepTokens(i, id, tokens, token_count);
+      ASSERT_EQ(token_count, 1U);
+      streamed[id - ids[0]].push_back(tokens[0]);
+    }
+
+    uint64_t request_ids[2];
+    const char* errors[2];
+    const size_t count = scheduler->TakeFinished(request_ids, errors, 2, sequences.get());
+    for (size_t i = 0; i < count; i++) {
+      EXPECT_EQ(errors[i], nullptr);
+      finished.push_back(request_ids[i]);
+    }
+  }
+
+  ASSERT_EQ(finished.size(), 2U);
+  ASSERT_EQ(sequences->Count(), 2U);
+  for (size_t i = 0; i < finished.size(); i++) {
+    const size_t index = finished[i] - ids[0];
+    const auto* expected_output_start = &expected_output[index * 10];
+    ASSERT_EQ(sequences->SequenceCount(i), 10U);
+    EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequences->SequenceData(i), 10 * sizeof(int32_t)));
+    ASSERT_EQ(streamed[index].size(), 6U);
+    EXPECT_TRUE(0 == std::memcmp(expected_output_start + 4, streamed[index].data(), 6 * sizeof(int32_t)));
+  }
+}
+
+TEST(CAPITests, LogProbsGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+  constexpr int batch_size = 2;
+  constexpr int top_logprobs = 3;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+  params->SetSearchOptionBool("logprobs", true);
+  params->SetSearchOption("top_logprobs", top_logprobs);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), 4, batch_size);
+
+  auto generator = OgaGenerator::Create(*model, *params);
+  while (!generator->IsDone()) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+
+    // Greedy search picks the most likely token, so it's the first of the top ones
+    std::array<float, batch_size> logprobs;
+    std::array<int32_t, batch_size * top_logprobs> top_tokens;
+    std::array<float, batch_size * top_logprobs> top_token_logprobs;
+    generator->GetLogProbs(logprobs.data(), top_tokens.data(), top_token_logprobs.data());
+    const auto length = generator->GetSequenceCount(0);
+    for (int i = 0; i < batch_size; i++) {
+      EXPECT_EQ(top_tokens[i * top_logprobs], generator->GetSequenceData(i)[length - 1]);
+      EXPECT_FLOAT_EQ(top_token_logprobs[i * top_logprobs], logprobs[i]);
+      EXPECT_LE(logprobs[i], 0.0f);
+      for (int j = 1; j < top_logprobs; j++)
+        EXPECT_LE(top_token_logprobs[i * top_logprobs + j], top_token_logprobs[i * top_logprobs + j - 1]);
+    }
+  }
+}
+
+TEST(CAPITests, ForkGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", 10);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), 4, 2);
+
+  // Only once the prompt has run, and only for a single sequence
+  auto generator = OgaGenerator::Create(*model, *params);
+  EXPECT_THROW(generator->Fork(), std::runtime_error);
+  generator->ComputeLogits();
+  EXPECT_THROW(generator->Fork(), std::runtime_error);
+
+  // Greedy forks continue the parent's sequence with the same tokens it generates
+  std::vector<int32_t> prompt{0, 0, 195, 731};
+  auto single_params = OgaGeneratorParams::Create(*model);
+  single_params->SetSearchOption("max_length", 10);
+  single_params->SetInputIDs(prompt.data(), prompt.size(), prompt.size(), 1);
+  auto parent = OgaGenerator::Create(*model, *single_params);
+  parent->ComputeLogits();
+  auto first_fork = parent->Fork();
+  parent->GenerateNextToken();
+  auto second_fork = parent->Fork();
+
+  for (auto* generator : {parent.get(), first_fork.get(), second_fork.get()}) {
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
+  }
+  const std::vector<int32_t> parent_sequence(parent->GetSequenceData(0), parent->GetSequenceData(0) + parent->GetSequenceCount(0));
+  EXPECT_EQ(parent_sequence.size(), 10U);
+  for (auto* fork : {first_fork.get(), second_fork.get()})
+    EXPECT_EQ(std::vector<int32_t>(fork->GetSequenceData(0), fork->GetSequenceData(0) + fork->GetSequenceCount(0)), parent_sequence);
+}
+
+// Like a decode server: a generator continues from the state another one saved after its prompt, and generates the same
+TEST(CAPITests, RestoredStateGptFp32CAPI) {
+  std::vector<int32_t> prompt{0, 0, 195, 731};
+  const int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto sequences = OgaSequences::Create();
+  sequences->Append(prompt.data(), prompt.size());
+  EXPECT_EQ(sequences->Count(), 1U);
+  EXPECT_EQ(sequences->SequenceCount(0), prompt.size());
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetInputSequences(*sequences);
+  auto expected = model->Generate(*params);
+  const std::vector<int32_t> expected_sequence(expected->SequenceData(0), expected->SequenceData(0) + expected->SequenceCount(0));
+
+  auto prefill = OgaGenerator::Create(*model, *params);
+  prefill->ComputeLogits();
+  prefill->GenerateNextToken();
+  const auto state = prefill->SaveState();
+  std::vector<int32_t> tokens(prefill->GetSequenceData(0), prefill->GetSequenceData(0) + prefill->GetSequenceCount(0));
+  prefill.reset();
+
+  auto restored_sequences = OgaSequences::Create();
+  restored_sequences->Append(tokens.data(), tokens.size());
+  auto restored_params = OgaGeneratorParams::Create(*model);
+  restored_params->SetSearchOption("max_length", max_length);
+  restored_params->SetInputSequences(*restored_sequences);
+  EXPECT_THROW(restored_params->SetRestoredState(state.data(), state.size() - 1), std::runtime_error);
+  restored_params->SetRestoredState(state.data(), state.size());
+
+  auto generator = OgaGenerator::Create(*model, *restored_params);
+  while (!generator->IsDone()) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+  }
+  EXPECT_EQ(std::vector<int32_t>(generator->GetSequenceData(0), generator->GetSequenceData(0) + generator->GetSequenceCount(0)), expected_sequence);
+}
+
+TEST(CAPITests, RowSearchGptFp32CAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  // The second sequence samples from only its top token and stops at its own max_length of 7, then gets pad tokens (98)
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 98, 98, 98};
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), 4, 2);
+  params->SetRowSearchOptionBool(1, "do_sample", true);
+  params->SetRowSearchOption(1, "top_k", 1);
+  params->SetRowSearchOption(1, "max_length", 7);
+
+  auto sequences = model->Generate(*params);
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(sequences->SequenceCount(i), static_cast<size_t>(max_length));
+    EXPECT_TRUE(0 == std::memcmp(&expected_output[i * max_length], sequences->SequenceData(i), max_length * sizeof(int32_t)));
+  }
+}
 #endif
 
 #if TEST_PHI2
@@ -231,6 +623,65 @@ struct Phi2Test {
   std::unique_ptr<OgaGeneratorParams> params_;
 };
 
+struct AsyncSteps {
+  std::mutex mutex;
+  std::condition_variable done;
+  int running{};
+  std::string error;
+};
+
+void OGA_API_CALL OnAsyncStep(OgaGenerator* generator, OgaResult* result, void* user_data) {
+  auto& steps = *reinterpret_cast<AsyncSteps*>(user_data);
+  // Queue the next step until the generator is done or fails
+  if (!result && !OgaGenerator_IsDone(generator)) {
+    result = OgaGenerator_GenerateNextTokenAsync(generator, OnAsyncStep, user_data);
+    if (!result)
+      return;
+  }
+
+  std::lock_guard<std::mutex> lock{steps.mutex};
+  if (result) {
+    steps.error = OgaResultGetError(result);
+    OgaDestroyResult(result);
+  }
+  steps.running--;
+  steps.done.notify_one();
+}
+
+TEST(CAPITests, GreedySearchGptFp32AsyncCAPI) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  std::vector<int32_t> expected_output{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+  int max_length = 10;
+
+  auto model = OgaModel::Create(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = OgaGeneratorParams::Create(*model);
+  params->SetSearchOption("max_length", max_length);
+  params->SetInputIDs(input_ids.data(), input_ids.size(), input_ids.size(), 1);
+
+  // Several generators stepping on the async threads at the same time, each callback queues the next step
+  std::vector<std::unique_ptr<OgaGenerator>> generators;
+  for (int i = 0; i < 4; i++)
+    generators.emplace_back(OgaGenerator::Create(*model, *params));
+
+  AsyncSteps steps;
+  steps.running = static_cast<int>(generators.size());
+  for (auto& generator : generators)
+    generator->GenerateNextTokenAsync(OnAsyncStep, &steps);
+
+  {
+    std::unique_lock<std::mutex> lock{steps.mutex};
+    steps.done.wait(lock, [&] { return steps.running == 0; });
+  }
+  EXPECT_EQ(steps.error, "");
+
+  for (auto& generator : generators) {
+    auto sequence = generator->GetSequence(0);
+    ASSERT_EQ(sequence.size(), expected_output.size());
+    EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence.data(), sequence.size() * sizeof(int32_t)));
+  }
+}
+
 TEST(CAPITests, TopKCAPI) {
   Phi2Test test;
 
@@ -10,6 +10,8 @@ using System.Collections.Generic;
 using System.Linq;
 using System.Reflection.Emit;
 using System.Runtime.InteropServices;
+using System.Threading;
+using System.Threading.Tasks;
 
 namespace Microsoft.ML.OnnxRuntimeGenAI.Tests
 {
@@ -88,6 +90,61 @@ namespace Microsoft.ML.OnnxRuntimeGenAI.Tests
             }
         }
 
+        [Fact(DisplayName = "TestGreedySearchAsync")]
+        public async Task TestGreedySearchAsync()
+        {
+            ulong maxLength = 10;
+            int[] inputIDs = new int[] { 0, 0, 0, 52, 0, 0, 195, 731 };
+            var inputIDsShape = new ulong[] { 2, 4 };
+            ulong batchSize = inputIDsShape[0];
+            ulong sequenceLength = inputIDsShape[1];
+            var expectedOutput = new int[] { 0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+                                             0, 0, 195, 731, 731, 114, 114, 114, 114, 114 };
+
+            string modelPath = Path.Combine(Directory.GetCurrentDirectory(), "test_models", "hf-internal-testing", "tiny-random-gpt2-fp32");
+            using (var model = new Model(modelPath))
+            {
+                Assert.NotNull(model);
+                using (var generatorParams = new GeneratorParams(model))
+                {
+                    Assert.NotNull(generatorParams);
+
+                    generatorParams.SetSearchOption("max_length", maxLength);
+                    generatorParams.SetInputIDs(inputIDs, sequenceLength, batchSize);
+
+                    using (var generator = new Generator(model, generatorParams))
+                    {
+                        Assert.NotNull(generator);
+
+                        while (!generator.IsDone())
+                        {
+                            await generator.GenerateNextTokenAsync();
+                        }
+
+                        for (ulong i = 0; i < batchSize; i++)
+                        {
+                            var sequence = generator.GetSequence(i).ToArray();
+                            var expectedSequence = expectedOutput.Skip((int)i * (int)maxLength).Take((int)maxLength);
+                            Assert.Equal(expectedSequence, sequence);
+                        }
+                    }
+
+                    // A cancelled token stops the generator for good
+                    using (var generator = new Generator(model, generatorParams))
+                    {
+                        using (var cancellation = new CancellationTokenSource())
+                        {
+                            await generator.GenerateNextTokenAsync(cancellation.Token);
+                            cancellation.Cancel();
+                            await Assert.ThrowsAnyAsync<OperationCanceledException>(() => generator.GenerateNextTokenAsync(cancellation.Token));
+                        }
+                        generator.Cancel();
+                        Assert.True(generator.IsDone());
+                    }
+                }
+            }
+        }
+
         [IgnoreOnModelAbsebceFact(DisplayName = "TestTopKSearch")]
         public void TestTopKSearch()
         {
@@ -312,6 +369,56 @@ namespace Microsoft.ML.OnnxRuntimeGenAI.Tests
             }
         }
 
+        [IgnoreOnModelAbsebceFact(DisplayName = "TestTokenizerStreamDecodeNextUtf8")]
+        public void TestTokenizerStreamDecodeNextUtf8()
+        {
+            string modelPath = Path.Combine(Directory.GetCurrentDirectory(), "test_models", "cpu", "phi-2");
+            using (var model = new Model(modelPath))
+            {
+                Assert.NotNull(model);
+                using (var tokenizer = new Tokenizer(model))
+                {
+                    Assert.NotNull(tokenizer);
+
+                    var strings = new string[] {
+                        "This is a test.",
+                        "Rats are awesome pets!",
+                        "The quick brown fox jumps over the lazy dog."
+                    };
+                    var sequences = tokenizer.EncodeBatch(strings);
+
+                    var utf8 = new byte[256];
+                    Assert.True(tokenizer.TryDecode(sequences[0], utf8, out int bytesWritten));
+                    Assert.Equal(strings[0], System.Text.Encoding.UTF8.GetString(utf8, 0, bytesWritten));
+                    Assert.False(tokenizer.TryDecode(sequences[0], new byte[2], out bytesWritten));
+
+                    var streams = strings.Select(_ => tokenizer.CreateStream()).ToArray();
+                    var decoded = strings.Select(_ => new List<byte>()).ToArray();
+                    var tokens = new int[streams.Length];
+                    var chunkOffsets = new int[streams.Length + 1];
+                    int maxLength = Enumerable.Range(0, strings.Length).Max(i => sequences[(ulong)i].Length);
+                    // Past the end of a sequence -1 only writes what's still in its stream
+                    for (int t = 0; t < maxLength + streams.Length; t++)
+                    {
+                        for (int i = 0; i < streams.Length; i++)
+                        {
+                            var sequence = sequences[(ulong)i];
+                            tokens[i] = t < sequence.Length ? sequence[t] : -1;
+                        }
+                        TokenizerStream.DecodeNext(streams, tokens, new Span<byte>(utf8, 0, 16), chunkOffsets);
+                        for (int i = 0; i < streams.Length; i++)
+                        {
+                            decoded[i].AddRange(new ArraySegment<byte>(utf8, chunkOffsets[i], chunkOffsets[i + 1] - chunkOffsets[i]));
+                        }
+                    }
+                    for (int i = 0; i < strings.Length; i++)
+                    {
+                        Assert.Equal(strings[i], System.Text.Encoding.UTF8.GetString(decoded[i].ToArray()));
+                    }
+                }
+            }
+        }
+
         [IgnoreOnModelAbsebceFact(DisplayName = "TestTokenizerSingleEncodeDecode")]
         public void TestTokenizerSingleEncodeDecode()
         {
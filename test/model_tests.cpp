@@ -4,9 +4,19 @@
 #include <gtest/gtest.h>
 #include <generators.h>
 #include <search.h>
+#include <scheduler.h>
+#include <speculative.h>
+#include <cascade.h>
 #include <models/model.h>
+#include <models/audio_features.h>
+#include <models/offloaded_weights.h>
+#include <models/visual_features_cache.h>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <random>
+#include <thread>
 #ifndef MODEL_PATH
 #define MODEL_PATH "../../test/test_models/"
 #endif
@@ -56,6 +66,908 @@ TEST(ModelTests, GreedySearchGptFp32) {
   }
 }
 
+// Prompts are only padded to their graph_capture_prompt_lengths bucket when asked for, as the pad tokens would be part
+// of the sequence. Without graph capture they never are
+TEST(ModelTests, PadToPromptGraphGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+  std::vector<int32_t> expected_output{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+  config->model.decoder.graph_capture_prompt_lengths = {8};
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+
+  for (bool pad : {false, true}) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    EXPECT_FALSE(params->search.pad_to_prompt_graph);
+    Generators::SetSearchBool(params->search, "pad_to_prompt_graph", pad);
+    EXPECT_EQ(params->search.pad_to_prompt_graph, pad);
+    params->search.max_length = 10;
+    params->batch_size = 1;
+    params->sequence_length = 4;
+    params->input_ids = input_ids;
+
+    auto generator = Generators::CreateGenerator(*model, *params);
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
+    auto sequence = generator->GetSequence(0).GetCPU();
+    EXPECT_EQ(std::vector<int32_t>(sequence.begin(), sequence.end()), expected_output);
+  }
+}
+
+TEST(ModelTests, SchedulerGreedySearchGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  // Each row of the batch above is its own request, with only one slot so the second request waits for the first
+  Generators::Scheduler scheduler{*model, 1};
+  std::vector<std::shared_ptr<Generators::GeneratorParams>> params;
+  for (size_t i = 0; i < 2; i++) {
+    auto& p = params.emplace_back(Generators::CreateGeneratorParams(*model));
+    p->search.max_length = 10;
+    p->batch_size = 1;
+    p->sequence_length = 4;
+    p->input_ids = std::span<const int32_t>(input_ids).subspan(i * 4, 4);
+    scheduler.AddRequest(p);
+  }
+
+  std::vector<Generators::Scheduler::Result> results;
+  while (!scheduler.IsDone()) {
+    scheduler.Step();
+    EXPECT_LE(scheduler.GetActiveCount(), 1U);
+    for (auto& result : scheduler.TakeFinished())
+      results.push_back(std::move(result));
+  }
+
+  ASSERT_EQ(results.size(), 2U);
+  for (auto& result : results) {
+    ASSERT_EQ(result.sequences.size(), 1U);
+    auto* expected_output_start = &expected_output[result.id * 10];
+    EXPECT_TRUE(0 == std::memcmp(expected_output_start, result.sequences[0].data(), 10 * sizeof(int32_t)));
+  }
+}
+
+TEST(ModelTests, SchedulerInstancesGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  // Two instances with a slot each, so both requests run at once, one on each
+  std::vector<std::shared_ptr<const Generators::Model>> models;
+  for (size_t i = 0; i < 2; i++)
+    models.push_back(Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+  Generators::Scheduler scheduler{models, Generators::SchedulerOptions{1}};
+  for (size_t i = 0; i < 2; i++) {
+    auto params = Generators::CreateGeneratorParams(*models[0]);
+    params->search.max_length = 10;
+    params->batch_size = 1;
+    params->sequence_length = 4;
+    params->input_ids = std::span<const int32_t>(input_ids).subspan(i * 4, 4);
+    scheduler.AddRequest(params);
+  }
+
+  std::vector<Generators::Scheduler::Result> results;
+  scheduler.Step();
+  EXPECT_EQ(scheduler.GetActiveCount(), 2U);
+  while (!scheduler.IsDone()) {
+    scheduler.Step();
+    for (auto& result : scheduler.TakeFinished())
+      results.push_back(std::move(result));
+  }
+
+  ASSERT_EQ(results.size(), 2U);
+  for (auto& result : results) {
+    auto* expected_output_start = &expected_output[result.id * 10];
+    EXPECT_TRUE(0 == std::memcmp(expected_output_start, result.sequences[0].data(), 10 * sizeof(int32_t)));
+  }
+}
+
+// With prefix_affinity a request goes to the instance that cached part of its prompt, until that instance's load
+// outweighs the part of the prompt it saves
+TEST(ModelTests, SchedulerPrefixAffinityGptFp32) {
+  std::vector<std::shared_ptr<const Generators::Model>> models;
+  for (size_t i = 0; i < 2; i++) {
+    auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+    config->model.decoder.prefix_cache.block_size = 4;
+    models.push_back(Generators::CreateModel(Generators::GetOrtEnv(), std::move(config)));
+  }
+
+  // The prompts share an 8 token system prompt, the second instance caches it by running a 9 token prompt
+  const std::vector<int32_t> system_prompt{10, 11, 12, 13, 14, 15, 16, 17};
+  const auto make_prompt = [&](int32_t first_token, size_t token_count) {
+    auto prompt = system_prompt;
+    for (size_t i = 0; i < token_count; i++)
+      prompt.push_back(first_token + static_cast<int32_t>(i));
+    return prompt;
+  };
+  const auto make_params = [&](std::span<const int32_t> prompt) {
+    auto params = Generators::CreateGeneratorParams(*models[0]);
+    params->search.max_length = 30;
+    params->batch_size = 1;
+    params->sequence_length = static_cast<int>(prompt.size());
+    params->input_ids = prompt;
+    return params;
+  };
+  const auto warm_prompt = make_prompt(100, 1);
+  Generators::CreateGenerator(*models[1], *make_params(warm_prompt))->ComputeLogits();
+
+  // Each 17 token prompt has 8 of its tokens cached on the second instance, which outweighs one other request there
+  // (8/17 - 1/4 > 0), but not two (8/17 - 2/4 < 0)
+  std::vector<std::vector<int32_t>> prompts;
+  prompts.reserve(3);
+  for (int32_t i = 0; i < 3; i++)
+    prompts.push_back(make_prompt(200 + 10 * i, 9));
+  auto* cache = models[1]->GetPrefixCache();
+  EXPECT_EQ(cache->GetCachedLength(prompts[0], cache->HashPrompt(prompts[0])), 8U);
+
+  Generators::SchedulerOptions options{4};
+  options.prefix_affinity = true;
+  Generators::Scheduler scheduler{models, options};
+  const std::array<double, 3> expected_counts_0{0, 0, 1}, expected_counts_1{1, 2, 2};
+  for (size_t i = 0; i < prompts.size(); i++) {
+    scheduler.AddRequest(make_params(prompts[i]));
+    scheduler.Step();
+    EXPECT_EQ(models[0]->GetMetric("generator_count"), expected_counts_0[i]);
+    EXPECT_EQ(models[1]->GetMetric("generator_count"), expected_counts_1[i]);
+  }
+}
+
+TEST(ModelTests, SchedulerPingPongGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  // The two active requests decode in halves of their own, on two threads, with the same results
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  Generators::SchedulerOptions options;
+  options.max_active_requests = 2;
+  options.ping_pong = true;
+  Generators::Scheduler scheduler{*model, options};
+  for (size_t i = 0; i < 2; i++) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 10;
+    params->batch_size = 1;
+    params->sequence_length = 4;
+    params->input_ids = std::span<const int32_t>(input_ids).subspan(i * 4, 4);
+    scheduler.AddRequest(params);
+  }
+
+  std::vector<Generators::Scheduler::Result> results;
+  while (!scheduler.IsDone()) {
+    scheduler.Step();
+    for (auto& result : scheduler.TakeFinished())
+      results.push_back(std::move(result));
+  }
+
+  ASSERT_EQ(results.size(), 2U);
+  for (auto& result : results) {
+    auto* expected_output_start = &expected_output[result.id * 10];
+    EXPECT_TRUE(0 == std::memcmp(expected_output_start, result.sequences[0].data(), 10 * sizeof(int32_t)));
+  }
+}
+
+TEST(ModelTests, SchedulerPriorityGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  // The second request is added later with a higher priority, so it takes the only slot first
+  Generators::SchedulerOptions options;
+  options.max_active_requests = 1;
+  Generators::Scheduler scheduler{*model, options};
+  std::vector<Generators::Scheduler::RequestId> ids;
+  for (size_t i = 0; i < 2; i++) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 10;
+    params->batch_size = 1;
+    params->sequence_length = 4;
+    params->input_ids = std::span<const int32_t>(input_ids).subspan(i * 4, 4);
+    Generators::RequestOptions request_options;
+    request_options.priority = static_cast<int>(i);
+    request_options.ttft_slo_seconds = 60;
+    ids.push_back(scheduler.AddRequest(params, request_options));
+  }
+
+  std::vector<Generators::Scheduler::Result> results;
+  while (!scheduler.IsDone()) {
+    scheduler.Step();
+    for (auto& result : scheduler.TakeFinished())
+      results.push_back(std::move(result));
+  }
+
+  ASSERT_EQ(results.size(), 2U);
+  EXPECT_EQ(results[0].id, ids[1]);
+  EXPECT_EQ(results[1].id, ids[0]);
+  EXPECT_TRUE(results[0].met_slo);
+  EXPECT_LE(results[0].ttft_seconds, results[1].ttft_seconds);
+}
+
+// Lower priority requests are preempted for a request only when that lets it in, and continue once there's room again
+TEST(ModelTests, SchedulerPreemptionGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  const auto& decoder = model->config_->model.decoder;
+  const size_t bytes_per_position = sizeof(float) * 2 * decoder.num_hidden_layers * decoder.num_key_value_heads * decoder.head_size;
+
+  Generators::SchedulerOptions options;
+  options.max_active_requests = 2;
+  options.max_kv_cache_bytes = bytes_per_position * 25;
+  options.preempt_lower_priority = true;
+  Generators::Scheduler scheduler{*model, options};
+  const auto add_request = [&](int max_length, int priority) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = max_length;
+    params->batch_size = 1;
+    params->sequence_length = static_cast<int>(input_ids.size());
+    params->input_ids = input_ids;
+    Generators::RequestOptions request_options;
+    request_options.priority = priority;
+    return scheduler.AddRequest(params, request_options);
+  };
+
+  add_request(10, 1);
+  add_request(10, 0);
+  scheduler.Step();
+  EXPECT_EQ(scheduler.GetActiveCount(), 2U);
+
+  // Even with the priority 0 request preempted, the kv caches of this one wouldn't fit next to the other's (10 + 20 > 25)
+  add_request(20, 1);
+  scheduler.Step();
+  EXPECT_EQ(scheduler.GetActiveCount(), 2U);
+  EXPECT_EQ(scheduler.GetPreemptedCount(), 0U);
+  EXPECT_EQ(scheduler.GetWaitingCount(), 1U);
+
+  // This one fits once the priority 0 request is preempted (10 + 10 <= 25)
+  add_request(10, 2);
+  scheduler.Step();
+  EXPECT_EQ(scheduler.GetActiveCount(), 2U);
+  EXPECT_EQ(scheduler.GetPreemptedCount(), 1U);
+  EXPECT_EQ(scheduler.GetWaitingCount(), 1U);
+
+  std::vector<Generators::Scheduler::Result> results;
+  while (!scheduler.IsDone()) {
+    scheduler.Step();
+    for (auto& result : scheduler.TakeFinished())
+      results.push_back(std::move(result));
+  }
+  ASSERT_EQ(results.size(), 4U);
+  for (auto& result : results)
+    EXPECT_TRUE(result.error.empty()) << result.error;
+}
+
+TEST(ModelTests, GenerateBatchGreedySearchGptFp32) {
+  // In reverse order of the batch above, to check the results come back in prompt order
+  std::vector<int32_t> input_ids{0, 0, 195, 731, 0, 0, 0, 52};
+  std::vector<std::span<const int32_t>> prompts{std::span<const int32_t>(input_ids).subspan(0, 4), std::span<const int32_t>(input_ids).subspan(4, 4)};
+
+  std::vector<std::vector<int32_t>> expected_output{
+      {731, 114, 114, 114, 114, 114},
+      {204, 204, 204, 204, 204, 204}};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = Generators::CreateGeneratorParams(*model);
+
+  // Both prompts in one request, then a token budget that only fits one of them per request
+  for (size_t max_batch_tokens : {0, 10}) {
+    Generators::BatchGenerateOptions options;
+    options.max_batch_tokens = max_batch_tokens;
+    options.max_new_tokens = 6;
+    EXPECT_EQ(Generators::GenerateBatch(*model, *params, prompts, options), expected_output);
+  }
+}
+
+TEST(ModelTests, SpeculativeGreedySearchGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  std::vector<int32_t> expected_output{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->batch_size = 1;
+  params->sequence_length = 4;
+  params->input_ids = input_ids;
+
+  // With the model as its own draft every proposed token is accepted, and the output matches the regular greedy search
+  Generators::SpeculativeGenerator generator{*model, *model, *params, 3};
+  while (!generator.IsDone())
+    generator.GenerateNextTokens();
+
+  EXPECT_EQ(generator.GetAcceptedCount(), generator.GetProposedCount());
+  auto sequence = generator.GetSequence();
+  auto sequence_cpu = sequence.GetCPU();
+  ASSERT_EQ(sequence_cpu.size(), expected_output.size());
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_cpu.data(), expected_output.size() * sizeof(int32_t)));
+}
+
+TEST(ModelTests, CascadeGreedySearchGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  std::vector<int32_t> expected_output{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->batch_size = 1;
+  params->sequence_length = 4;
+  params->input_ids = input_ids;
+
+  // With the model as both the small and the large one, the output is the same whether it stays or escalates
+  for (float min_logprob : {std::numeric_limits<float>::lowest(), 0.0f}) {
+    Generators::CascadeGenerator generator{*model, *model, *params, min_logprob, 2};
+    while (!generator.IsDone())
+      generator.GenerateNextToken();
+
+    EXPECT_EQ(generator.IsEscalated(), min_logprob == 0.0f);  // Every log probability is below 0
+    if (generator.IsEscalated())
+      EXPECT_EQ(generator.GetEscalationLength(), input_ids.size());  // The first pick was dropped
+    auto sequence = generator.GetSequence();
+    auto sequence_cpu = sequence.GetCPU();
+    ASSERT_EQ(sequence_cpu.size(), expected_output.size());
+    EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_cpu.data(), expected_output.size() * sizeof(int32_t)));
+  }
+}
+
+TEST(ModelTests, PromptLookupGreedySearchGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+  std::vector<int32_t> expected_output{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->batch_size = 1;
+  params->sequence_length = 4;
+  params->input_ids = input_ids;
+
+  // Once 204 repeats, the tokens after its earlier match are proposed, and they're what the model generates anyway
+  Generators::SpeculativeGenerator generator{*model, *params, 3, 2};
+  while (!generator.IsDone())
+    generator.GenerateNextTokens();
+
+  EXPECT_GT(generator.GetProposedCount(), 0U);
+  EXPECT_EQ(generator.GetAcceptedCount(), generator.GetProposedCount());
+  auto sequence = generator.GetSequence();
+  auto sequence_cpu = sequence.GetCPU();
+  ASSERT_EQ(sequence_cpu.size(), expected_output.size());
+  EXPECT_TRUE(0 == std::memcmp(expected_output.data(), sequence_cpu.data(), expected_output.size() * sizeof(int32_t)));
+}
+
+TEST(ModelTests, DraftHeadsGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52};
+
+  // The output names come from the config, only their %d is replaced
+  EXPECT_EQ(Generators::FormatIndexedName("draft_logits.%d", 2), "draft_logits.2");
+  EXPECT_EQ(Generators::FormatIndexedName("draft_%s_%n.%d", 0), "draft_%s_%n.0");
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 10;
+  params->batch_size = 1;
+  params->sequence_length = 4;
+  params->input_ids = input_ids;
+
+  // The model has no draft heads to propose with
+  EXPECT_THROW((Generators::SpeculativeGenerator{*model, *params, 1}), std::runtime_error);
+
+  // Nor the outputs a config claiming some would bind
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+  config->model.decoder.draft_heads = 2;
+  auto draft_model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+  auto draft_params = Generators::CreateGeneratorParams(*draft_model);
+  draft_params->search.max_length = 10;
+  draft_params->batch_size = 1;
+  draft_params->sequence_length = 4;
+  draft_params->input_ids = input_ids;
+  EXPECT_THROW(Generators::CreateGenerator(*draft_model, *draft_params), std::runtime_error);
+  EXPECT_THROW((Generators::SpeculativeGenerator{*draft_model, *draft_params, 3}), std::runtime_error);
+}
+
+TEST(ModelTests, ScoreGptFp32) {
+  // The continuations are what greedy search generates after each prompt, so each token is the most likely one
+  std::vector<int32_t> prompt_0{0, 0, 0, 52}, prompt_1{0, 0, 195, 731};
+  std::vector<int32_t> greedy_0{204, 204, 204}, greedy_1{731, 114};
+  std::vector<int32_t> other_0{204, 204, 731}, other_1{731, 204};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(),
+                                       MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  std::vector<std::span<const int32_t>> prompts{prompt_0, prompt_1};
+  std::vector<std::span<const int32_t>> greedy{greedy_0, greedy_1}, other{other_0, other_1};
+  auto greedy_logprobs = Generators::Score(*model, prompts, greedy);
+  auto other_logprobs = Generators::Score(*model, prompts, other);
+  ASSERT_EQ(greedy_logprobs.size(), 5U);
+  ASSERT_EQ(other_logprobs.size(), 5U);
+
+  for (auto logprob : greedy_logprobs)
+    EXPECT_LE(logprob, 0.0f);
+  // The tokens both continuations share score the same, the one they differ in scores lower off the greedy path
+  EXPECT_NEAR(greedy_logprobs[0], other_logprobs[0], 1e-4f);
+  EXPECT_NEAR(greedy_logprobs[1], other_logprobs[1], 1e-4f);
+  EXPECT_GT(greedy_logprobs[2], other_logprobs[2]);
+  EXPECT_NEAR(greedy_logprobs[3], other_logprobs[3], 1e-4f);
+  EXPECT_GT(greedy_logprobs[4], other_logprobs[4]);
+
+  // Token ids outside the vocabulary would index past the logits
+  std::vector<int32_t> past_vocab{204, 1000}, negative{-1};
+  std::vector<std::span<const int32_t>> bad_continuations{past_vocab, greedy_1};
+  EXPECT_THROW(Generators::Score(*model, prompts, bad_continuations), std::runtime_error);
+  std::vector<std::span<const int32_t>> bad_prompts{prompt_0, negative};
+  EXPECT_THROW(Generators::Score(*model, bad_prompts, greedy), std::runtime_error);
+}
+
+// The search picks logits rows, which logits_token_ids maps to the tokens it appends
+TEST(ModelTests, LogitsTokenIdsGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  auto generate = [&](int32_t row_offset) {
+    auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+    auto& rows = config->model.logits_token_ids;
+    for (int32_t row = 0; row < config->model.vocab_size; row++)
+      rows.push_back((row + row_offset) % config->model.vocab_size);
+    config->model.logits_eos_rows = {static_cast<int>(std::find(rows.begin(), rows.end(), config->model.eos_token_id) - rows.begin())};
+    auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->search.max_length = 5;
+    params->batch_size = 2;
+    params->sequence_length = 4;
+    params->input_ids = input_ids;
+    auto generator = Generators::CreateGenerator(*model, *params);
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+    return std::vector<int32_t>{generator->GetSequence(0).GetCPU()[4], generator->GetSequence(1).GetCPU()[4]};
+  };
+
+  // Greedy search picks the rows of 204 and 731, see GreedySearchGptFp32
+  EXPECT_EQ(generate(0), (std::vector<int32_t>{204, 731}));
+  EXPECT_EQ(generate(1), (std::vector<int32_t>{205, 732}));
+
+  // Penalties and logits processors look up the logits of tokens, which the rows aren't
+  auto config = std::make_unique<Generators::Config>(fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32"));
+  for (int32_t row = 0; row < config->model.vocab_size; row++)
+    config->model.logits_token_ids.push_back(row);
+  config->model.logits_eos_rows = {config->model.eos_token_id};
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), std::move(config));
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->search.max_length = 5;
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->input_ids = input_ids;
+  params->logits_processors.push_back([](Generators::LogitsProcessorContext&) {});
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+  params->logits_processors.clear();
+  params->search.repetition_penalty = 1.5f;
+  EXPECT_THROW(Generators::CreateGenerator(*model, *params), std::runtime_error);
+}
+
+TEST(ModelTests, ReplicaPoolPlacementGptFp32) {
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+  std::vector<int> device_ids{0, 1};
+  Generators::ReplicaPool pool{Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32", device_ids};
+  ASSERT_EQ(pool.GetReplicaCount(), 2U);
+
+  auto params = Generators::CreateGeneratorParams(*pool.GetReplica(0));
+  params->search.max_length = 10;
+  params->batch_size = 1;
+  params->sequence_length = static_cast<int>(input_ids.size());
+  params->input_ids = input_ids;
+
+  // Each new generator goes to the replica with fewer live generators, and the replicas generate the same tokens
+  auto first = pool.CreateGenerator(*params);
+  auto second = pool.CreateGenerator(*params);
+  EXPECT_EQ(pool.GetReplica(0)->GetMetric("generator_count"), 1.0);
+  EXPECT_EQ(pool.GetReplica(1)->GetMetric("generator_count"), 1.0);
+
+  for (auto* generator : {first.get(), second.get()}) {
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
+  }
+  auto sequence_0 = first->GetSequence(0).GetCPU();
+  auto sequence_1 = second->GetSequence(0).GetCPU();
+  ASSERT_EQ(sequence_0.size(), sequence_1.size());
+  EXPECT_TRUE(std::equal(sequence_0.begin(), sequence_0.end(), sequence_1.begin()));
+  const std::vector<int32_t> expected_sequence(sequence_0.begin(), sequence_0.end());
+
+  first.reset();
+  EXPECT_EQ(pool.GetLeastLoaded(), 0U);
+
+  // A state saved on replica 0 and restored with its params continues on whichever replica the generator is placed on
+  second.reset();
+  auto prefill = pool.CreateGenerator(*params);
+  prefill->ComputeLogits();
+  prefill->GenerateNextToken();
+  const auto state = prefill->SaveState();
+  auto prefill_sequence = prefill->GetSequence(0).GetCPU();
+  std::vector<int32_t> restored_ids(prefill_sequence.begin(), prefill_sequence.end());
+  prefill.reset();
+
+  auto restored_params = Generators::CreateGeneratorParams(*pool.GetReplica(0));
+  restored_params->search.max_length = 10;
+  restored_params->batch_size = 1;
+  restored_params->sequence_length = static_cast<int>(restored_ids.size());
+  restored_params->input_ids = restored_ids;
+  restored_params->SetRestoredState(state);
+
+  auto restored_0 = pool.CreateGenerator(*restored_params);
+  auto restored_1 = pool.CreateGenerator(*restored_params);
+  EXPECT_EQ(pool.GetReplica(0)->GetMetric("generator_count"), 1.0);
+  EXPECT_EQ(pool.GetReplica(1)->GetMetric("generator_count"), 1.0);
+  for (auto* generator : {restored_0.get(), restored_1.get()}) {
+    while (!generator->IsDone()) {
+      generator->ComputeLogits();
+      generator->GenerateNextToken();
+    }
+    auto sequence = generator->GetSequence(0).GetCPU();
+    EXPECT_TRUE(std::equal(sequence.begin(), sequence.end(), expected_sequence.begin(), expected_sequence.end()));
+  }
+}
+
+TEST(ModelTests, PrefixCacheLookup) {
+  Generators::PrefixCache cache{4, 2};
+  std::vector<int32_t> prompt{1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+
+  EXPECT_EQ(cache.Find(prompt), nullptr);
+  ASSERT_EQ(cache.GetStoreLength(prompt), 8U);  // The last token always runs, so only 2 full blocks are stored
+
+  auto entry = std::make_shared<Generators::PrefixCache::Entry>();
+  entry->tokens.assign(prompt.begin(), prompt.begin() + 8);
+  cache.Store(entry);
+  EXPECT_EQ(cache.GetStoreLength(prompt), 0U);
+
+  // A prompt sharing only the first block doesn't hit, one sharing both blocks does
+  std::vector<int32_t> other{1, 2, 3, 4, 0, 0, 0, 0, 0};
+  EXPECT_EQ(cache.Find(other), nullptr);
+  std::vector<int32_t> longer{1, 2, 3, 4, 5, 6, 7, 8, 42, 43, 44};
+  EXPECT_EQ(cache.Find(longer).get(), entry.get());
+
+  // The prompt must keep at least one token past the prefix
+  EXPECT_EQ(cache.Find(std::span<const int32_t>(prompt).subspan(0, 8)), nullptr);
+
+  // Looking up the cached length doesn't count as a use, so the entry is still the oldest and evicted first
+  auto second = std::make_shared<Generators::PrefixCache::Entry>();
+  second->tokens = {9, 9, 9, 9};
+  cache.Store(second);
+  EXPECT_EQ(cache.GetCachedLength(longer, cache.HashPrompt(longer)), 8U);
+  EXPECT_EQ(cache.GetCachedLength(other, cache.HashPrompt(other)), 0U);
+  auto third = std::make_shared<Generators::PrefixCache::Entry>();
+  third->tokens = {7, 7, 7, 7};
+  cache.Store(third);
+  EXPECT_EQ(cache.GetCachedLength(longer, cache.HashPrompt(longer)), 0U);
+}
+
+TEST(ModelTests, PrefixCacheEntrySerialize) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  Generators::PrefixCache::Entry entry;
+  entry.tokens = {52, 204, 731};
+  std::array<int64_t, 4> shape{1, 2, 3, 4};
+  for (int i = 0; i < 2; i++) {
+    auto value = OrtValue::CreateTensor<float>(*model->allocator_device_, shape);
+    auto* data = value->GetTensorMutableData<float>();
+    for (int j = 0; j < 24; j++)
+      data[j] = static_cast<float>(i * 100 + j);
+    entry.kv.push_back(std::move(value));
+  }
+
+  auto serialized = entry.Serialize(*model, model->cuda_stream_);
+  auto restored = Generators::PrefixCache::Entry::Deserialize(*model, serialized, model->cuda_stream_);
+  EXPECT_EQ(restored->tokens, entry.tokens);
+  ASSERT_EQ(restored->kv.size(), 2U);
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(restored->kv[i]->GetTensorTypeAndShapeInfo()->GetShape(), std::vector<int64_t>(shape.begin(), shape.end()));
+    EXPECT_TRUE(0 == std::memcmp(restored->kv[i]->GetTensorData<float>(), entry.kv[i]->GetTensorData<float>(), 24 * sizeof(float)));
+  }
+
+  // Counts and dims past the end of the data, at the offsets of the token count, the first rank and its first dim
+  for (size_t offset : {8, 32, 36}) {
+    auto corrupt = serialized;
+    std::memset(corrupt.data() + offset, 0x7F, 4);
+    EXPECT_THROW(Generators::PrefixCache::Entry::Deserialize(*model, corrupt, model->cuda_stream_), std::runtime_error);
+  }
+
+  serialized.pop_back();
+  EXPECT_THROW(Generators::PrefixCache::Entry::Deserialize(*model, serialized, model->cuda_stream_), std::runtime_error);
+}
+
+TEST(ModelTests, PrefixCacheExportImport) {
+  // Another cache maps the exported kv caches instead of copying them, here in the same process
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  Generators::PrefixCache exporter{2, 2}, importer{2, 2};
+  std::vector<int32_t> prompt{52, 204, 731, 12, 9};
+
+  auto entry = std::make_shared<Generators::PrefixCache::Entry>();
+  entry->tokens.assign(prompt.begin(), prompt.begin() + 4);
+  std::array<int64_t, 4> shape{1, 2, 4, 3};
+  for (int i = 0; i < 2; i++) {
+    auto value = OrtValue::CreateTensor<float>(*model->allocator_device_, shape);
+    auto* data = value->GetTensorMutableData<float>();
+    for (int j = 0; j < 24; j++)
+      data[j] = static_cast<float>(i * 100 + j);
+    entry->kv.push_back(std::move(value));
+  }
+  EXPECT_THROW(exporter.Export(*model, prompt, model->cuda_stream_), std::runtime_error);
+  exporter.Store(entry);
+
+  auto descriptor = exporter.Export(*model, prompt, model->cuda_stream_);
+  EXPECT_EQ(exporter.Export(*model, prompt, model->cuda_stream_), descriptor);
+  importer.Import(*model, descriptor);
+  auto imported = importer.Find(prompt);
+  ASSERT_NE(imported, nullptr);
+  EXPECT_EQ(imported->tokens, entry->tokens);
+  EXPECT_NE(imported->shared_block, nullptr);
+  ASSERT_EQ(imported->kv.size(), 2U);
+  for (int i = 0; i < 2; i++) {
+    EXPECT_EQ(imported->kv[i]->GetTensorTypeAndShapeInfo()->GetShape(), std::vector<int64_t>(shape.begin(), shape.end()));
+    EXPECT_TRUE(0 == std::memcmp(imported->kv[i]->GetTensorData<float>(), entry->kv[i]->GetTensorData<float>(), 24 * sizeof(float)));
+  }
+
+  descriptor.pop_back();
+  EXPECT_THROW(Generators::PrefixCache{2, 2}.Import(*model, descriptor), std::runtime_error);
+}
+
+TEST(ModelTests, OffloadedWeightsRoundTrip) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+
+  // A safetensors file is the 8 byte little endian header size, the JSON header, then the data its offsets are into
+  const std::vector<float> a{0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f};
+  const std::vector<int32_t> b{7, 8, 9};
+  const char* path = "offloaded_weights_test.safetensors";
+  auto write_file = [&](const std::string& header, uint64_t header_size) {
+    std::ofstream file{path, std::ios::binary};
+    for (int i = 0; i < 8; i++)
+      file.put(static_cast<char>(header_size >> (i * 8)));
+    file.write(header.data(), header.size());
+    file.write(reinterpret_cast<const char*>(a.data()), a.size() * sizeof(float));
+    file.write(reinterpret_cast<const char*>(b.data()), b.size() * sizeof(int32_t));
+  };
+  const std::string header = R"({"__metadata__":{"format":"pt"},"b":{"dtype":"I32","shape":[3],"data_offsets":[24,36]},"a":{"dtype":"F32","shape":[2,3],"data_offsets":[0,24]}})";
+  write_file(header, header.size());
+
+  // The tensors are in the order of their data, each at an aligned offset
+  auto weights = std::make_unique<Generators::OffloadedWeights>(*model, fs::path(path));
+  ASSERT_EQ(weights->tensors_.size(), 2U);
+  EXPECT_EQ(weights->tensors_[0].name, "a");
+  EXPECT_EQ(weights->tensors_[0].type, ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT);
+  EXPECT_EQ(weights->tensors_[0].shape, (std::vector<int64_t>{2, 3}));
+  EXPECT_EQ(weights->tensors_[1].name, "b");
+  EXPECT_EQ(weights->tensors_[1].type, ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32);
+  EXPECT_EQ(weights->tensors_[1].shape, (std::vector<int64_t>{3}));
+  EXPECT_GT(weights->tensors_[1].offset, 0U);
+  EXPECT_EQ(weights->tensors_[1].offset % 256, 0U);
+
+  // On the CPU a stage binds its host copy of the weights
+  std::vector<std::unique_ptr<Generators::OffloadedWeights>> stages;
+  stages.push_back(std::move(weights));
+  stages.push_back(nullptr);
+  Generators::WeightStream stream{*model, std::move(stages)};
+  EXPECT_TRUE(stream.IsOffloaded(0));
+  EXPECT_FALSE(stream.IsOffloaded(1));
+  auto tensors = stream.Bind(0, model->cuda_stream_);
+  ASSERT_EQ(tensors.size(), 2U);
+  EXPECT_EQ(tensors[0]->GetTensorTypeAndShapeInfo()->GetShape(), (std::vector<int64_t>{2, 3}));
+  EXPECT_TRUE(0 == std::memcmp(tensors[0]->GetTensorData<float>(), a.data(), a.size() * sizeof(float)));
+  EXPECT_TRUE(0 == std::memcmp(tensors[1]->GetTensorData<int32_t>(), b.data(), b.size() * sizeof(int32_t)));
+  stream.Release(0, model->cuda_stream_);
+
+  // A header size or data offsets past the end of the file are rejected
+  write_file(header, uint64_t{1} << 60);
+  EXPECT_THROW((Generators::OffloadedWeights{*model, fs::path(path)}), std::runtime_error);
+  const std::string past_end = R"({"a":{"dtype":"F32","shape":[2,3],"data_offsets":[0,24]},"b":{"dtype":"I32","shape":[3],"data_offsets":[36,48]}})";
+  write_file(past_end, past_end.size());
+  EXPECT_THROW((Generators::OffloadedWeights{*model, fs::path(path)}), std::runtime_error);
+  std::remove(path);
+}
+
+TEST(ModelTests, VisualFeaturesCacheCollision) {
+  auto memory_info = OrtMemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+  std::vector<float> image_0{1, 2, 3, 4}, image_1{1, 2, 3, 5}, features{0.5f};
+  std::array<int64_t, 1> image_shape{4}, features_shape{1};
+  auto pixels_0 = OrtValue::CreateTensor<float>(*memory_info, image_0, image_shape);
+  auto pixels_1 = OrtValue::CreateTensor<float>(*memory_info, image_1, image_shape);
+  std::array<const OrtValue*, 1> inputs_0{pixels_0.get()}, inputs_1{pixels_1.get()};
+
+  Generators::VisualFeaturesCache cache{4};
+  const auto key_0 = Generators::VisualFeaturesCache::GetKey(inputs_0);
+  cache.Store(key_0, OrtValue::CreateTensor<float>(*memory_info, features, features_shape));
+  EXPECT_NE(cache.Find(Generators::VisualFeaturesCache::GetKey(inputs_0)), nullptr);
+  EXPECT_EQ(cache.Find(Generators::VisualFeaturesCache::GetKey(inputs_1)), nullptr);
+
+  // Another image whose hash collides with a stored one misses, as its bytes differ
+  auto colliding = Generators::VisualFeaturesCache::GetKey(inputs_1);
+  colliding.hash = key_0.hash;
+  EXPECT_EQ(cache.Find(colliding), nullptr);
+}
+
+TEST(ModelTests, TokenizerCacheMatchesUncached) {
+  Generators::Config config{fs::path(MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32")};
+  auto uncached = std::make_shared<Generators::Tokenizer>(config);
+  config.model.tokenizer_cache_size = 2;
+  auto cached = std::make_shared<Generators::Tokenizer>(config);
+
+  // Hits, misses and strings encoded again after being evicted all give the uncached tokens
+  const std::vector<std::string> strings{"This is a test.", "Rats are awesome pets!", "This is a test.", "The quick brown fox", "Rats are awesome pets!", "This is a test."};
+  for (auto& string : strings)
+    EXPECT_EQ(cached->Encode(string.c_str()), uncached->Encode(string.c_str())) << string;
+}
+
+TEST(ModelTests, DefaultImageCounts) {
+  Generators::Images three_images{nullptr, 3};
+  EXPECT_EQ(Generators::DefaultImageCounts(2, nullptr), (std::vector<size_t>{0, 0}));
+  // A single prompt owns all the images, a batch one image per prompt
+  EXPECT_EQ(Generators::DefaultImageCounts(1, &three_images), (std::vector<size_t>{3}));
+  EXPECT_EQ(Generators::DefaultImageCounts(3, &three_images), (std::vector<size_t>{1, 1, 1}));
+  EXPECT_THROW(Generators::DefaultImageCounts(2, &three_images), std::runtime_error);
+}
+
+TEST(ModelTests, CapturedGraphPoolEvictsLeastRecentlyReturned) {
+  Generators::Config config;
+  auto pool = std::make_shared<Generators::CapturedGraphPool>(&config, nullptr, nullptr);
+  Ort::Allocator& allocator = Ort::Allocator::GetWithDefaultOptions();
+
+  // Each graph allocates a buffer counted in its own bytes, which go back to 0 once it's evicted
+  std::vector<std::shared_ptr<std::atomic<int64_t>>> graph_bytes;
+  auto add_graph = [&](int max_batch_size) {
+    auto& bytes = graph_bytes.emplace_back(std::make_shared<std::atomic<int64_t>>());
+    Generators::CapturedGraphInfoPtr graph{new Generators::CapturedGraphInfo};
+    graph->pool_ = pool;
+    graph->max_batch_size_ = max_batch_size;
+    graph->key_ = std::make_unique<CapturedGraphKey>(max_batch_size, 16, 1, std::vector<Generators::GeneratorParams::Input>{});
+    graph->sb_input_ids_ = std::make_unique<Generators::StaticBuffer>(&allocator, max_batch_size, bytes);
+    const std::array<int64_t, 1> shape{max_batch_size};
+    graph->sb_input_ids_->CreateTensorOnStaticBuffer(shape, ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32);
+    pool->AddCapturedGraph(std::move(graph));
+  };
+
+  // Returned in this order, across two keys
+  add_graph(1);
+  add_graph(2);
+  add_graph(1);
+  EXPECT_EQ(pool->GetPooledGraphCount(), 3);
+
+  for (size_t evicted = 0; evicted < graph_bytes.size(); evicted++) {
+    ASSERT_TRUE(pool->EvictPooledGraph());
+    for (size_t i = 0; i < graph_bytes.size(); i++)
+      EXPECT_EQ(*graph_bytes[i] == 0, i <= evicted);
+  }
+  EXPECT_FALSE(pool->EvictPooledGraph());
+  EXPECT_EQ(pool->GetPooledGraphCount(), 0);
+  EXPECT_EQ(pool->GetEvictedGraphCount(), 3);
+}
+
+TEST(ModelTests, StepArenaGrowsAfterOverflow) {
+  // Counts what the arena allocates of the CPU allocator
+  struct CountingAllocator : OrtAllocator {
+    CountingAllocator() : OrtAllocator{} {
+      version = ORT_API_VERSION;
+      OrtAllocator::Alloc = [](OrtAllocator* this_, size_t size) {
+        auto& counting = *static_cast<CountingAllocator*>(this_);
+        counting.allocations++;
+        counting.live++;
+        return counting.cpu.Alloc(size);
+      };
+      OrtAllocator::Free = [](OrtAllocator* this_, void* p) {
+        auto& counting = *static_cast<CountingAllocator*>(this_);
+        counting.live--;
+        counting.cpu.Free(p);
+      };
+      OrtAllocator::Info = [](const OrtAllocator* this_) { return &static_cast<const CountingAllocator*>(this_)->cpu.GetInfo(); };
+    }
+
+    Ort::Allocator& cpu{Ort::Allocator::GetWithDefaultOptions()};
+    int allocations{};
+    int live{};
+  };
+  CountingAllocator counting;
+  Generators::StepArena arena{counting};
+
+  // Nothing fits in the empty block, so the first step overflows and the block is sized for it plus 25%
+  arena.Alloc(&arena, 100);
+  arena.Alloc(&arena, 300);
+  EXPECT_EQ(counting.allocations, 2);
+  arena.Reset();
+  EXPECT_EQ(arena.GetCapacity(), (256 + 512) * 5 / 4);
+  EXPECT_EQ(counting.live, 1);
+
+  // The same step now comes out of the block, at aligned offsets, and the next one reuses it
+  auto* first = static_cast<std::byte*>(arena.Alloc(&arena, 100));
+  auto* second = static_cast<std::byte*>(arena.Alloc(&arena, 300));
+  EXPECT_EQ(second - first, 256);
+  arena.Reset();
+  EXPECT_EQ(arena.Alloc(&arena, 1), first);
+  EXPECT_EQ(counting.allocations, 3);
+
+  // Past the end of the block
+  arena.Alloc(&arena, 768);
+  EXPECT_EQ(counting.allocations, 4);
+  arena.Reset();
+  EXPECT_EQ(arena.GetCapacity(), (256 + 768) * 5 / 4);
+  EXPECT_EQ(counting.live, 1);
+
+  arena.Release();
+  EXPECT_EQ(arena.GetCapacity(), 0);
+  EXPECT_EQ(counting.live, 0);
+}
+
+TEST(ModelTests, WhisperInputFeaturesBatch) {
+  auto memory_info = OrtMemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+
+  // Two mels each, of 3 and 1 frames
+  std::vector<float> long_clip{1, 2, 3, 4, 5, 6};
+  std::vector<float> short_clip{-1, 7};
+  std::array<int64_t, 3> long_shape{1, 2, 3}, short_shape{1, 2, 1};
+  Generators::Tensor long_tensor{OrtValue::CreateTensor<float>(*memory_info, long_clip, long_shape)};
+  Generators::Tensor short_tensor{OrtValue::CreateTensor<float>(*memory_info, short_clip, short_shape)};
+
+  Generators::GeneratorParams params;
+  std::vector<const Generators::Tensor*> clips{&long_tensor, &short_tensor};
+  params.SetWhisperInputFeatures(clips);
+
+  auto& features = *std::get<Generators::GeneratorParams::Whisper>(params.inputs).input_features->ort_tensor_;
+  EXPECT_EQ(features.GetTensorTypeAndShapeInfo()->GetShape(), (std::vector<int64_t>{2, 2, 3}));
+
+  // The short clip is padded with its own minimum
+  std::vector<float> expected{1, 2, 3, 4, 5, 6, -1, -1, -1, 7, -1, -1};
+  auto* data = features.GetTensorData<float>();
+  EXPECT_EQ(std::vector<float>(data, data + expected.size()), expected);
+}
+
+TEST(ModelTests, WhisperAudioLogMel) {
+  // A second of a 1 kHz tone at 44.1 kHz, and half a second of silence at 16 kHz
+  std::vector<float> tone(44100), silence(8000);
+  for (size_t i = 0; i < tone.size(); i++)
+    tone[i] = 0.5f * static_cast<float>(std::sin(2 * 3.14159265358979 * 1000 * i / 44100));
+
+  auto resampled = Generators::ResampleTo16kHz(tone, 44100);
+  ASSERT_EQ(resampled.size(), 16000U);
+  for (size_t i = 100; i < 15900; i++)
+    EXPECT_NEAR(resampled[i], 0.5f * std::sin(2 * 3.14159265358979 * 1000 * i / 16000), 1e-3);
+
+  Generators::GeneratorParams params;
+  std::vector<std::span<const float>> clips{tone};
+  params.SetWhisperAudio(clips, 44100, 80, true);
+  auto& features = *std::get<Generators::GeneratorParams::Whisper>(params.inputs).input_features->ort_tensor_;
+  EXPECT_EQ(features.GetTensorTypeAndShapeInfo()->GetShape(), (std::vector<int64_t>{1, 80, 3000}));
+
+  // 1 kHz is at 15 on the slaney mel scale, which tops out at about 45.2 at 8 kHz, so the tone peaks in mel 26. After
+  // the tone the padding sits at the 80 dB floor
+  auto* data = features.GetTensorData<float>();
+  const auto* frame = data + 50;
+  int peak = 0;
+  for (int m = 1; m < 80; m++) {
+    if (frame[m * 3000] > frame[peak * 3000])
+      peak = m;
+  }
+  EXPECT_EQ(peak, 26);
+  EXPECT_FLOAT_EQ(frame[peak * 3000] - 2.0f, data[peak * 3000 + 2000]);
+
+  // Without padding to 30 seconds the batch is as long as its longest clip, 100 frames a second
+  clips.assign({std::span<const float>{silence}, std::span<const float>{resampled}});
+  params.SetWhisperAudio(clips, 16000, 128, false);
+  auto& chunk = *std::get<Generators::GeneratorParams::Whisper>(params.inputs).input_features->ort_tensor_;
+  EXPECT_EQ(chunk.GetTensorTypeAndShapeInfo()->GetShape(), (std::vector<int64_t>{2, 128, 100}));
+  EXPECT_THROW(params.SetWhisperAudio(clips, 0, 80, true), std::runtime_error);
+}
+
 TEST(ModelTests, BeamSearchGptFp32) {
   std::vector<int64_t> input_ids_shape{3, 12};
   std::vector<int32_t> input_ids{
@@ -94,6 +1006,91 @@ TEST(ModelTests, BeamSearchGptFp32) {
     EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence.data(), params->search.max_length * sizeof(int32_t)));
   }
 }
+
+TEST(ModelTests, DiverseBeamSearchGptFp32) {
+  std::vector<int32_t> input_ids{
+      0, 0, 0, 0, 0, 52, 195, 731, 321, 301, 734, 620,
+      41, 554, 74, 622, 206, 222, 75, 223, 221, 198, 224, 572,
+      0, 0, 0, 52, 328, 219, 328, 206, 288, 227, 896, 328};
+  const int batch_size = 3, sequence_length = 12;
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto generate = [&](int num_beams, int num_beam_groups, float diversity_penalty, int num_return_sequences) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->batch_size = batch_size;
+    params->sequence_length = sequence_length;
+    params->input_ids = input_ids;
+    params->search.max_length = 20;
+    params->search.num_beams = num_beams;
+    params->search.num_beam_groups = num_beam_groups;
+    params->search.diversity_penalty = diversity_penalty;
+    params->search.num_return_sequences = num_return_sequences;
+    return Generators::Generate(*model, *params);
+  };
+
+  // Without a penalty the groups are the same beam search, of their size
+  EXPECT_EQ(generate(4, 2, 0.0f, 1), generate(2, 1, 0.0f, 1));
+
+  // A group of one beam never picks the token the group before it picked for the same step
+  auto same = generate(2, 2, 0.0f, 2);
+  auto diverse = generate(2, 2, 1e4f, 2);
+  ASSERT_EQ(diverse.size(), static_cast<size_t>(batch_size * 2));
+  for (int i = 0; i < batch_size; i++) {
+    EXPECT_EQ(same[i * 2][sequence_length], same[i * 2 + 1][sequence_length]);
+    EXPECT_NE(diverse[i * 2][sequence_length], diverse[i * 2 + 1][sequence_length]);
+  }
+}
+
+// The combined kv caches of GPT-2 only share their buffers without beams, and then the attention needs the past length
+TEST(ModelTests, PastPresentShareBufferCombinedKvGptFp32) {
+  std::vector<int32_t> input_ids{
+      0, 0, 0, 0, 0, 52, 195, 731, 321, 301, 734, 620,
+      41, 554, 74, 622, 206, 222, 75, 223, 221, 198, 224, 572,
+      0, 0, 0, 52, 328, 219, 328, 206, 288, 227, 896, 328};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto create_params = [&](int num_beams, bool past_present_share_buffer) {
+    auto params = Generators::CreateGeneratorParams(*model);
+    params->batch_size = 3;
+    params->sequence_length = 12;
+    params->input_ids = input_ids;
+    params->search.max_length = 20;
+    params->search.num_beams = num_beams;
+    params->search.past_present_share_buffer = past_present_share_buffer;
+    return params;
+  };
+
+  // The test model's attention has no past_sequence_length input
+  EXPECT_THROW(Generators::CreateGenerator(*model, *create_params(1, true)), std::runtime_error);
+  EXPECT_EQ(Generators::Generate(*model, *create_params(4, true)), Generators::Generate(*model, *create_params(4, false)));
+}
+
+// The n-grams of the beams follow them as they're reordered, so no beam generates one its own sequence already has
+TEST(ModelTests, BeamSearchNoRepeatNgramGptFp32) {
+  std::vector<int32_t> input_ids{
+      0, 0, 0, 0, 0, 52, 195, 731, 321, 301, 734, 620,
+      41, 554, 74, 622, 206, 222, 75, 223, 221, 198, 224, 572,
+      0, 0, 0, 52, 328, 219, 328, 206, 288, 227, 896, 328};
+  const size_t sequence_length = 12;
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->batch_size = 3;
+  params->sequence_length = static_cast<int>(sequence_length);
+  params->input_ids = input_ids;
+  params->search.max_length = 20;
+  params->search.num_beams = 4;
+  params->search.no_repeat_ngram_size = 2;
+  auto result = Generators::Generate(*model, *params);
+
+  ASSERT_EQ(result.size(), 3U);
+  for (auto& sequence : result) {
+    for (size_t end = sequence_length; end < sequence.size(); end++) {
+      for (size_t start = 0; start + 1 < end; start++)
+        EXPECT_FALSE(sequence[start] == sequence[end - 1] && sequence[start + 1] == sequence[end]);
+    }
+  }
+}
 #endif
 
 #if USE_CUDA
@@ -135,7 +1132,97 @@ TEST(ModelTests, GreedySearchGptCuda) {
     Test_GreedySearch_Gpt_Cuda(model_path.first, model_path.second);
 }
 
-void Test_BeamSearch_Gpt_Cuda(const char* model_path, const char* model_label) {
+TEST(ModelTests, SwapOutGreedySearchGptCuda) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), c_tiny_gpt2_model_paths[0].first);
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->search.max_length = 10;
+  params->input_ids = input_ids;
+
+  auto generator = Generators::CreateGenerator(*model, *params);
+
+  // Every other step swaps back in explicitly, the others in ComputeLogits
+  for (int step = 0; !generator->IsDone(); step++) {
+    generator->ComputeLogits();
+    generator->GenerateNextToken();
+    if (generator->IsDone())
+      break;
+
+    generator->SwapOut();
+    EXPECT_TRUE(generator->IsSwappedOut());
+    EXPECT_EQ(generator->GetMetric("kv_cache_bytes"), 0.0);
+    if (step % 2)
+      generator->SwapIn();
+  }
+
+  for (int i = 0; i < params->batch_size; i++) {
+    auto sequence = generator->GetSequence(i).GetCPU();
+    auto* expected_output_start = &expected_output[i * params->search.max_length];
+    EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence.data(), params->search.max_length * sizeof(int32_t)));
+  }
+}
+
+// Generators sharing params each get a stream of their own, and stepping them from several threads at once gives what
+// a single one does
+TEST(ModelTests, ConcurrentGeneratorsGptCuda) {
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), c_tiny_gpt2_model_paths[0].first);
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->batch_size = 2;
+  params->sequence_length = 4;
+  params->search.max_length = 10;
+  params->input_ids = input_ids;
+
+  std::vector<std::unique_ptr<Generators::Generator>> generators;
+  for (int i = 0; i < 4; i++)
+    generators.push_back(Generators::CreateGenerator(*model, *params));
+  for (size_t i = 0; i < generators.size(); i++) {
+    EXPECT_NE(generators[i]->state_->cuda_stream_, model->cuda_stream_.get());
+    for (size_t j = 0; j < i; j++)
+      EXPECT_NE(generators[i]->state_->cuda_stream_, generators[j]->state_->cuda_stream_);
+  }
+
+  std::vector<std::thread> threads;
+  for (auto& generator : generators) {
+    threads.emplace_back([&generator] {
+      while (!generator->IsDone()) {
+        generator->ComputeLogits();
+        generator->GenerateNextToken();
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  for (auto& generator : generators) {
+    for (int i = 0; i < params->batch_size; i++) {
+      auto sequence = generator->GetSequence(i).GetCPU();
+      auto* expected_output_start = &expected_output[i * params->search.max_length];
+      EXPECT_TRUE(0 == std::memcmp(expected_output_start, sequence.data(), params->search.max_length * sizeof(int32_t)));
+    }
+  }
+
+  // A released stream goes back to the pool for the next generator
+  auto stream = generators.back()->state_->cuda_stream_;
+  generators.pop_back();
+  EXPECT_EQ(Generators::CreateGenerator(*model, *params)->state_->cuda_stream_, stream);
+}
+
+void Test_BeamSearch_Gpt_Cuda(const char* model_path, const char* model_label, int done_check_interval = 1) {
   std::vector<int64_t> input_ids_shape{3, 12};
   std::vector<int32_t> input_ids{
       0, 0, 0, 0, 0, 52, 195, 731, 321, 301, 734, 620,
@@ -160,6 +1247,7 @@ void Test_BeamSearch_Gpt_Cuda(const char* model_path, const char* model_label) {
   params->search.max_length = 20;
   params->search.num_beams = 4;
   params->search.length_penalty = 1.0f;
+  params->search.done_check_interval = done_check_interval;
 
   auto generator = Generators::CreateGenerator(*model, *params);
   auto result = Generators::Generate(*model, *params);
@@ -178,6 +1266,12 @@ TEST(ModelTests, BeamSearchGptCuda) {
     Test_BeamSearch_Gpt_Cuda(model_path.first, model_path.second);
 }
 
+// The steps run before the done status is read back only pad the finished beams, so the hypotheses stay the same
+TEST(ModelTests, BeamSearchDoneCheckIntervalGptCuda) {
+  for (auto model_path : c_tiny_gpt2_model_paths)
+    Test_BeamSearch_Gpt_Cuda(model_path.first, model_path.second, 4);
+}
+
 TEST(ModelTests, TestApiCuda) {
 #if TEST_PHI2
 
@@ -241,4 +1335,30 @@ Print all primes between 1 and n
 #endif
 }
 
+// Dropping the finished rows from the runs leaves what the other rows generate as it was
+TEST(ModelTests, CompactFinishedRowsCuda) {
+#if TEST_PHI2
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "phi-2");
+  auto tokenizer = model->CreateTokenizer();
+  std::array<std::vector<int32_t>, 3> prompts{tokenizer->Encode("def print_prime(n):"), tokenizer->Encode("Hello, my name is"), tokenizer->Encode("The capital of France")};
+  std::vector<std::span<const int32_t>> spans{prompts.begin(), prompts.end()};
+  auto input_ids = Generators::PadInputs(spans, model->config_->model.pad_token_id);
+
+  auto params = Generators::CreateGeneratorParams(*model);
+  params->batch_size = static_cast<int>(prompts.size());
+  params->sequence_length = static_cast<int>(input_ids.size() / prompts.size());
+  params->input_ids = input_ids;
+  params->search.max_length = params->sequence_length + 16;
+
+  // The first token the first row generates ends it, so it finishes long before the others
+  auto first = Generators::Generate(*model, *params);
+  params->eos_token_id = first[0][params->sequence_length];
+
+  auto expected = Generators::Generate(*model, *params);
+  params->search.compact_finished_rows = true;
+  auto compacted = Generators::Generate(*model, *params);
+  EXPECT_EQ(expected, compacted);
+#endif
+}
+
 #endif
\ No newline at end of file
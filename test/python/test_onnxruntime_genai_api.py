@@ -1,6 +1,8 @@
 # Copyright (c) Microsoft Corporation. All rights reserved.
 # Licensed under the MIT License
 
+import asyncio
+import json
 import os
 import sys
 import sysconfig
@@ -154,6 +156,61 @@ def test_logging():
     og.set_log_options(enabled=False)
 
 
+def test_trace(test_data_path, tmp_path):
+    model_path = os.fspath(Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32")
+    trace_path = tmp_path / "trace.json"
+
+    model = og.Model(model_path)
+    params = og.GeneratorParams(model)
+    params.input_ids = np.array([[0, 0, 0, 52]], dtype=np.int32)
+    params.set_search_options(max_length=10)
+
+    og.set_log_options(enabled=True, trace=True, trace_filename=os.fspath(trace_path))
+    model.generate(params)
+    og.set_log_options(trace=False, enabled=False)
+
+    import json
+
+    names = {event["name"] for event in json.loads(trace_path.read_text())["traceEvents"]}
+    assert {"State::Run", "OrtSession::Run", "Logits::Get", "Generator::GenerateNextToken"} <= names
+
+
+def test_metrics(test_data_path):
+    model_path = os.fspath(Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32")
+
+    model = og.Model(model_path)
+    params = og.GeneratorParams(model)
+    params.input_ids = np.array([[0, 0, 0, 52]], dtype=np.int32)
+    params.set_search_options(max_length=10)
+
+    generator = og.Generator(model, params)
+    while not generator.is_done():
+        generator.compute_logits()
+        generator.generate_next_token()
+
+    metrics = generator.get_metrics()
+    assert metrics["step_count"] == 6
+    assert metrics["generated_token_count"] == 6
+    assert metrics["kv_cache_bytes"] > 0
+    assert sum(metrics["decode_time_histogram"]) == 5
+    assert len(metrics["decode_time_bounds_ms"]) == len(metrics["decode_time_histogram"]) - 1
+
+    model_metrics = model.get_metrics()
+    assert model_metrics["generated_token_count"] == 6
+    assert model_metrics["kv_cache_bytes"] == metrics["kv_cache_bytes"]
+    assert model_metrics["device_memory_bytes"] == metrics["kv_cache_bytes"]
+    assert model_metrics["device_memory_budget_bytes"] == 0
+    assert model_metrics["captured_graph_count"] == model_metrics["pooled_captured_graph_count"] == 0
+    assert model_metrics["captured_graph_evictions"] == model_metrics["captured_graph_pool_budget_bytes"] == 0
+    assert model_metrics["kv_cache_allocation_count"] > 0
+    assert model_metrics["kv_cache_peak_bytes"] >= model_metrics["kv_cache_live_bytes"] > 0
+    assert model_metrics["logits_allocations_per_step"] > 0
+    del generator
+    assert model.get_metrics()["kv_cache_bytes"] == 0
+    assert model.get_metrics()["kv_cache_live_bytes"] == 0
+    assert model.get_metrics()["device_memory_bytes"] == 0
+
+
 @pytest.mark.parametrize(
     "relative_model_path",
     (
@@ -173,6 +230,164 @@ def test_model_device_type(test_data_path, relative_model_path):
 
     assert model.device_type == relative_model_path[1]
 
+def test_concurrent_generators(test_data_path):
+    import threading
+
+    model_path = os.fspath(Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32")
+    model = og.Model(model_path)
+
+    def generate(results, index):
+        params = og.GeneratorParams(model)
+        params.input_ids = np.array([0, 0, 195, 731], dtype=np.int32)
+        params.set_search_options(do_sample=False, max_length=10)
+        generator = og.Generator(model, params)
+        while not generator.is_done():
+            generator.compute_logits()
+            generator.generate_next_token()
+        results[index] = generator.get_sequence(0)
+
+    results = [None] * 4
+    threads = [threading.Thread(target=generate, args=(results, i)) for i in range(len(results))]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    for result in results[1:]:
+        assert np.array_equal(result, results[0])
+
+
+def test_reloadable_model(test_data_path):
+    model_path = os.fspath(Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32")
+    reloadable = og.ReloadableModel(model_path)
+    assert reloadable.version == 0
+
+    def start(model):
+        params = og.GeneratorParams(model)
+        params.input_ids = np.array([0, 0, 195, 731], dtype=np.int32)
+        params.set_search_options(do_sample=False, max_length=10)
+        return og.Generator(model, params)
+
+    # A generator started before the reload finishes on the old model after it
+    old_model = reloadable.get_model()
+    old_generator = start(old_model)
+    old_generator.compute_logits()
+    old_generator.generate_next_token()
+
+    reloadable.reload(model_path)
+    assert reloadable.version == 1
+    new_model = reloadable.get_model()
+    assert new_model is not old_model
+    del old_model
+
+    new_generator = start(new_model)
+    for generator in (old_generator, new_generator):
+        while not generator.is_done():
+            generator.compute_logits()
+            generator.generate_next_token()
+    assert np.array_equal(old_generator.get_sequence(0), new_generator.get_sequence(0))
+
+
+def test_generate_tokens(test_data_path):
+    model_path = os.fspath(Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32")
+    model = og.Model(model_path)
+
+    params = og.GeneratorParams(model)
+    params.input_ids = np.array([[0, 0, 0, 52], [0, 0, 195, 731]], dtype=np.int32)
+    params.set_search_options(do_sample=False, max_length=10)
+
+    expected = og.Generator(model, params)
+    while not expected.is_done():
+        expected.compute_logits()
+        expected.generate_next_token()
+
+    # Only 6 steps fit before max_length, so the second call stops early
+    generator = og.Generator(model, params)
+    tokens = generator.generate_tokens(4)
+    assert tokens.shape == (4, 2)
+    tokens = np.concatenate([tokens, generator.generate_tokens(4)])
+    assert tokens.shape == (6, 2)
+    assert generator.is_done()
+    assert generator.generate_tokens(4).shape == (0, 2)
+
+    for i in range(2):
+        assert np.array_equal(generator.get_sequence(i), expected.get_sequence(i))
+        assert np.array_equal(tokens[:, i], expected.get_sequence(i)[4:])
+
+
+def test_generate_next_token_async(test_data_path):
+    model_path = os.fspath(Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32")
+    model = og.Model(model_path)
+
+    params = og.GeneratorParams(model)
+    params.input_ids = np.array([[0, 0, 0, 52], [0, 0, 195, 731]], dtype=np.int32)
+    params.set_search_options(do_sample=False, max_length=10)
+
+    expected = og.Generator(model, params)
+    while not expected.is_done():
+        expected.compute_logits()
+        expected.generate_next_token()
+
+    # Both generators step on the async threads while the event loop waits on them
+    async def generate():
+        generator = og.Generator(model, params)
+        while not generator.is_done():
+            await generator.generate_next_token_async()
+        return generator
+
+    async def generate_all():
+        return await asyncio.gather(generate(), generate())
+
+    for generator in asyncio.run(generate_all()):
+        for i in range(2):
+            assert np.array_equal(generator.get_sequence(i), expected.get_sequence(i))
+
+
+@pytest.mark.skipif(
+    sysconfig.get_platform().endswith("arm64") or sys.version_info.minor < 8,
+    reason="Python 3.8 is required for downloading models.",
+)
+@pytest.mark.parametrize("device", devices)
+def test_generator_stream(device, phi2_for):
+    model = og.Model(phi2_for(device))
+    tokenizer = og.Tokenizer(model)
+
+    params = og.GeneratorParams(model)
+    params.input_ids = tokenizer.encode("This is a test.")
+    params.set_search_options(do_sample=False, max_length=20)
+
+    async def stream():
+        generator = og.Generator(model, params)
+        chunks = [chunk async for chunk in generator.stream(tokenizer)]
+        return generator, "".join(chunks)
+
+    generator, text = asyncio.run(stream())
+    assert text == tokenizer.decode(generator.get_sequence(0)[len(params.input_ids):])
+
+
+def test_get_output_view(test_data_path):
+    model_path = os.fspath(Path(test_data_path) / "hf-internal-testing" / "tiny-random-gpt2-fp32")
+
+    model = og.Model(model_path)
+    params = og.GeneratorParams(model)
+    params.input_ids = np.array([[0, 0, 0, 52], [0, 0, 195, 731]], dtype=np.int32)
+    params.set_search_options(do_sample=False, max_length=10)
+
+    generator = og.Generator(model, params)
+    generator.compute_logits()
+
+    view = generator.get_output_view("logits")
+    assert view.device == "cpu"
+    assert view.shape == (2, 4, 1000)
+    assert view.dtype == np.float32
+    assert not hasattr(view, "__cuda_array_interface__")
+
+    logits = generator.get_output("logits")
+    assert np.array_equal(np.asarray(view), logits)
+    if hasattr(np, "from_dlpack"):
+        assert np.array_equal(np.from_dlpack(view), logits)
+
+
 @pytest.mark.parametrize(
     "relative_model_path",
     (
@@ -220,4 +435,387 @@ def test_get_output(test_data_path, relative_model_path):
     generator.compute_logits()
     logits = generator.get_output('logits')
     assert np.allclose(logits[:,:,::200], expected_sampled_logits_token_gen, atol=1e-3)
-    generator.generate_next_token()
\ No newline at end of file
+    generator.generate_next_token()
+
+def make_decoder_test_model(
+    model_path, static_window_size=0, position_ids=False, hidden_states=False, share_buffer=False, max_adapters=0
+):
+    # A one layer decoder whose presents are its pasts followed by the new tokens, as the exported attention's are. Every
+    # logit sees the sum of the values the attention mask keeps, so the pasts have to line up with the mask to match.
+    # With share_buffer the new tokens are written into the past after its first mask length - sequence length entries
+    # instead, so it works with pasts of max_length as well. With max_adapters the projection to the logits has a LoRA
+    onnx = pytest.importorskip("onnx")
+    from onnx import TensorProto, helper, numpy_helper
+
+    vocab_size, head_size = 16, 4
+    rng = np.random.default_rng(0)
+    # Small integers so the sums are exact whatever order they're taken in
+    embedding = rng.integers(-4, 5, (vocab_size, head_size)).astype(np.float32)
+    projection = rng.integers(-4, 5, (head_size, vocab_size)).astype(np.float32)
+
+    past_shape = ["batch_size", 1, "past_sequence_length", head_size]
+    present_shape = ["batch_size", 1, "present_sequence_length" if share_buffer else "total_sequence_length", head_size]
+    if share_buffer:
+        present_nodes = [
+            helper.make_node("Shape", ["input_ids"], ["new_length"], start=1, end=2),
+            helper.make_node("Shape", ["attention_mask"], ["total_length"], start=1, end=2),
+            helper.make_node("Shape", ["past_key_values.0.value"], ["past_length"], start=2, end=3),
+            helper.make_node("Max", ["past_length", "total_length"], ["buffer_length"]),
+            helper.make_node("Sub", ["total_length", "new_length"], ["write_start"]),
+            helper.make_node("Sub", ["buffer_length", "total_length"], ["write_tail"]),
+            helper.make_node("Sub", ["buffer_length", "past_length"], ["past_tail"]),
+            helper.make_node("Concat", ["zero", "zero", "write_start", "zero", "zero", "zero", "write_tail", "zero"], ["kv_pads"], axis=0),
+            helper.make_node("Concat", ["zero", "zero", "zero", "zero", "zero", "zero", "past_tail", "zero"], ["past_pads"], axis=0),
+            helper.make_node("Pad", ["kv", "kv_pads"], ["kv_written"]),
+            helper.make_node("Concat", ["one", "one", "new_length", "one"], ["new_shape"], axis=0),
+            helper.make_node("ConstantOfShape", ["new_shape"], ["new_ones"], value=helper.make_tensor("value", TensorProto.INT32, [1], [1])),
+            helper.make_node("Pad", ["new_ones", "kv_pads"], ["written_ones"]),
+            helper.make_node("Cast", ["written_ones"], ["written"], to=TensorProto.BOOL),
+            helper.make_node("Slice", ["present.0.value", "zero", "total_length", "axis_2"], ["values"]),
+        ]
+        for name in ("key", "value"):
+            # Where rather than arithmetic, as the entries past the valid ones can be anything
+            present_nodes.append(helper.make_node("Pad", [f"past_key_values.0.{name}", "past_pads"], [f"past_{name}"]))
+            present_nodes.append(helper.make_node("Where", ["written", "kv_written", f"past_{name}"], [f"present.0.{name}"]))
+    else:
+        present_nodes = [
+            helper.make_node("Concat", ["past_key_values.0.key", "kv"], ["present.0.key"], axis=2),
+            helper.make_node("Concat", ["past_key_values.0.value", "kv"], ["present.0.value"], axis=2),
+            helper.make_node("Identity", ["present.0.value"], ["values"]),
+        ]
+    graph = helper.make_graph(
+        [
+            helper.make_node("Gather", ["embedding", "input_ids"], ["hidden"]),
+            helper.make_node("Unsqueeze", ["hidden", "axis_1"], ["kv"]),
+            *present_nodes,
+            helper.make_node("Cast", ["attention_mask"], ["mask"], to=TensorProto.FLOAT),
+            helper.make_node("Reshape", ["mask", "mask_shape"], ["mask_4d"]),
+            helper.make_node("Mul", ["values", "mask_4d"], ["masked"]),
+            helper.make_node("ReduceSum", ["masked", "axis_2"], ["context"], keepdims=0),
+            helper.make_node("Add", ["hidden", "context"], ["attended"]),
+            helper.make_node("MatMul", ["attended", "projection"], ["logits"]),
+        ],
+        "windowed",
+        [
+            helper.make_tensor_value_info("input_ids", TensorProto.INT64, ["batch_size", "sequence_length"]),
+            helper.make_tensor_value_info("attention_mask", TensorProto.INT64, ["batch_size", "total_sequence_length"]),
+            helper.make_tensor_value_info("past_key_values.0.key", TensorProto.FLOAT, past_shape),
+            helper.make_tensor_value_info("past_key_values.0.value", TensorProto.FLOAT, past_shape),
+        ],
+        [
+            helper.make_tensor_value_info("logits", TensorProto.FLOAT, ["batch_size", "sequence_length", vocab_size]),
+            helper.make_tensor_value_info("present.0.key", TensorProto.FLOAT, present_shape),
+            helper.make_tensor_value_info("present.0.value", TensorProto.FLOAT, present_shape),
+        ],
+        [
+            numpy_helper.from_array(embedding, "embedding"),
+            numpy_helper.from_array(projection, "projection"),
+            numpy_helper.from_array(np.array([1], dtype=np.int64), "axis_1"),
+            numpy_helper.from_array(np.array([2], dtype=np.int64), "axis_2"),
+            numpy_helper.from_array(np.array([0, 1, -1, 1], dtype=np.int64), "mask_shape"),
+            numpy_helper.from_array(np.array([0], dtype=np.int64), "zero"),
+            numpy_helper.from_array(np.array([1], dtype=np.int64), "one"),
+        ],
+    )
+    inputs = {"input_ids": "input_ids", "attention_mask": "attention_mask"}
+    if position_ids:
+        # Only taken, the positions don't change the sums
+        graph.input.append(helper.make_tensor_value_info("position_ids", TensorProto.INT64, ["batch_size", "sequence_length"]))
+        inputs["position_ids"] = "position_ids"
+    if hidden_states:
+        # What the projection to the logits takes, like a decoder built with exclude_lm_head outputs
+        graph.node.append(helper.make_node("Identity", ["attended"], ["hidden_states"]))
+        graph.output.append(helper.make_tensor_value_info("hidden_states", TensorProto.FLOAT, ["batch_size", "sequence_length", head_size]))
+    if max_adapters:
+        # Each sequence adds attended * A * B of its adapter slot to its logits
+        next(node for node in graph.node if node.output[0] == "logits").output[0] = "base_logits"
+        graph.node.extend(
+            [
+                helper.make_node("Gather", ["lora.A", "lora_adapter_ids"], ["adapter_a"]),
+                helper.make_node("Gather", ["lora.B", "lora_adapter_ids"], ["adapter_b"]),
+                helper.make_node("MatMul", ["attended", "adapter_a"], ["adapter_low_rank"]),
+                helper.make_node("MatMul", ["adapter_low_rank", "adapter_b"], ["adapter_logits"]),
+                helper.make_node("Add", ["base_logits", "adapter_logits"], ["logits"]),
+            ]
+        )
+        graph.input.extend(
+            [
+                helper.make_tensor_value_info("lora.A", TensorProto.FLOAT, [max_adapters + 1, head_size, "rank"]),
+                helper.make_tensor_value_info("lora.B", TensorProto.FLOAT, [max_adapters + 1, "rank", vocab_size]),
+                helper.make_tensor_value_info("lora_adapter_ids", TensorProto.INT32, ["batch_size"]),
+            ]
+        )
+    onnx_model = helper.make_model(graph, opset_imports=[helper.make_opsetid("", 17)])
+    onnx_model.ir_version = 8
+    model_path.mkdir()
+    onnx.save(onnx_model, os.fspath(model_path / "model.onnx"))
+
+    decoder = {
+        "filename": "model.onnx",
+        "num_attention_heads": 1,
+        "num_key_value_heads": 1,
+        "head_size": head_size,
+        "hidden_size": head_size,
+        "num_hidden_layers": 1,
+        "inputs": inputs,
+        "outputs": {"logits": "logits"},
+    }
+    if static_window_size:
+        decoder["static_window_size"] = static_window_size
+    if max_adapters:
+        decoder["adapters"] = {"max_adapters": max_adapters, "max_rank": 2}
+    config = {
+        "model": {
+            "type": "llama",
+            "pad_token_id": 0,
+            "bos_token_id": 0,
+            "eos_token_id": vocab_size - 1,
+            "vocab_size": vocab_size,
+            "context_length": 32,
+            "decoder": decoder,
+        },
+        "search": {"max_length": 20},
+    }
+    (model_path / "genai_config.json").write_text(json.dumps(config))
+    return os.fspath(model_path)
+
+
+def test_static_window_size(tmp_path):
+    sequences = []
+    for static_window_size in (0, 4):
+        model = og.Model(make_decoder_test_model(tmp_path / f"window_{static_window_size}", static_window_size))
+        params = og.GeneratorParams(model)
+        # The last window of the prompt is padded
+        params.input_ids = np.array([3, 1, 4, 1, 5, 9, 2, 6, 5, 3], dtype=np.int32)
+        params.set_search_options(do_sample=False, max_length=20)
+        generator = og.Generator(model, params)
+        while not generator.is_done():
+            generator.compute_logits()
+            generator.generate_next_token()
+        sequences.append(generator.get_sequence(0))
+
+    assert np.array_equal(sequences[1], sequences[0])
+
+
+def load_decoder_test_weights(model_path):
+    onnx = pytest.importorskip("onnx")
+    from onnx import numpy_helper
+
+    initializers = {i.name: numpy_helper.to_array(i) for i in onnx.load(os.path.join(model_path, "model.onnx")).graph.initializer}
+    return initializers["embedding"], initializers["projection"]
+
+
+def test_kv_window_size(tmp_path):
+    # The kv caches keep the first kv_sink_tokens entries and the last kv_window_size ones, and the mask has to keep the
+    # same ones for the masked sum of the test model to match one over the kept tokens
+    model_path = make_decoder_test_model(tmp_path / "model", position_ids=True)
+    embedding, projection = load_decoder_test_weights(model_path)
+    model = og.Model(model_path)
+    sink_tokens, window_size = 2, 4
+    prompt = [3, 1, 4, 1, 5, 9, 2, 6, 5, 3]
+
+    params = og.GeneratorParams(model)
+    params.input_ids = np.array(prompt, dtype=np.int32)
+    params.set_search_options(do_sample=False, max_length=20, kv_window_size=window_size, kv_sink_tokens=sink_tokens)
+    generator = og.Generator(model, params)
+    kept, token = list(prompt), prompt[-1]
+    while not generator.is_done():
+        generator.compute_logits()
+        generator.generate_next_token()
+        logits = (embedding[token] + embedding[kept].sum(axis=0)) @ projection
+        token = int(generator.get_next_tokens()[0])
+        assert logits[token] == logits.max()
+        if len(kept) > sink_tokens + window_size:
+            kept = kept[:sink_tokens] + kept[-window_size:]
+        kept.append(token)
+
+
+def test_embed(tmp_path):
+    # The hidden state of a token is its embedding plus the sum of the embeddings of its prompt, the padding is masked
+    model_path = make_decoder_test_model(tmp_path / "model", hidden_states=True)
+    embedding, _ = load_decoder_test_weights(model_path)
+    model = og.Model(model_path)
+    prompts = [[3, 1, 4, 1, 5], [9, 2], [6, 5, 3]]
+
+    # Every prompt in one padded batch, then the two shorter ones together and the longest on its own
+    for max_batch_tokens in (0, 6):
+        inputs = [np.array(prompt, dtype=np.int32) for prompt in prompts]
+        mean = model.embed(inputs, "mean", max_batch_tokens)
+        last_token = model.embed(inputs, "last_token", max_batch_tokens)
+        assert mean.shape == last_token.shape == (len(prompts), embedding.shape[1])
+        for i, prompt in enumerate(prompts):
+            context = embedding[prompt].sum(axis=0)
+            assert np.allclose(mean[i], embedding[prompt].mean(axis=0) + context)
+            assert np.allclose(last_token[i], embedding[prompt[-1]] + context)
+
+    with pytest.raises(Exception):
+        model.embed([np.array([3, 1], dtype=np.int32)], "max")
+
+
+def test_attention_mask_updates(tmp_path):
+    # A single sequence's mask grows in place, the rows of a batch are copied to the other buffer every step. Either way
+    # the masked sum of the test model has to see every token of the sequence and none of the padding
+    model_path = make_decoder_test_model(tmp_path / "model")
+    embedding, projection = load_decoder_test_weights(model_path)
+    model = og.Model(model_path)
+    prompts = [[3, 1, 4, 1, 5, 9], [2, 6, 5]]
+
+    def generate(input_ids):
+        params = og.GeneratorParams(model)
+        params.input_ids = np.array(input_ids, dtype=np.int32)
+        params.set_search_options(do_sample=False, max_length=16)
+        generator = og.Generator(model, params)
+        while not generator.is_done():
+            generator.compute_logits()
+            generator.generate_next_token()
+        return [generator.get_sequence(i) for i in range(len(input_ids))]
+
+    padded = [[0] * (len(prompts[0]) - len(prompt)) + prompt for prompt in prompts]
+    batched = generate(padded)
+    for i, prompt in enumerate(prompts):
+        alone = generate([prompt])[0]
+        for length in range(len(prompt), len(alone)):
+            logits = (embedding[alone[length - 1]] + embedding[alone[:length]].sum(axis=0)) @ projection
+            assert logits[alone[length]] == logits.max()
+        # The padded prompt leaves the batch row fewer tokens to generate before max_length
+        generated = batched[i][len(padded[i]):]
+        length = min(len(generated), len(alone) - len(prompt))
+        assert np.array_equal(generated[:length], alone[len(prompt):len(prompt) + length])
+
+
+def test_past_present_share_buffer(tmp_path):
+    # The shared buffers are max_length long and stay where they are, with beams every step moves the entries of each beam
+    # to where its new position is
+    model = og.Model(make_decoder_test_model(tmp_path / "model", share_buffer=True))
+    input_ids = [[0, 0, 3, 1, 4, 1], [2, 6, 5, 3, 5, 9]]
+
+    def generate(num_beams, past_present_share_buffer):
+        params = og.GeneratorParams(model)
+        params.input_ids = np.array(input_ids, dtype=np.int32)
+        params.set_search_options(
+            do_sample=False, num_beams=num_beams, max_length=16, past_present_share_buffer=past_present_share_buffer
+        )
+        generator = og.Generator(model, params)
+        while not generator.is_done():
+            generator.compute_logits()
+            generator.generate_next_token()
+        return [generator.get_sequence(i) for i in range(len(input_ids))]
+
+    for num_beams in (1, 3):
+        expected = generate(num_beams, False)
+        for sequence, expected_sequence in zip(generate(num_beams, True), expected):
+            assert np.array_equal(sequence, expected_sequence)
+
+
+def test_adapters(tmp_path):
+    # Sequences of one batch on the base model and on an adapter of a lower rank than the model's
+    model_path = make_decoder_test_model(tmp_path / "model", max_adapters=2)
+    embedding, projection = load_decoder_test_weights(model_path)
+    model = og.Model(model_path)
+    rng = np.random.default_rng(1)
+    adapter_a = rng.integers(-2, 3, (embedding.shape[1], 1)).astype(np.float32)
+    adapter_b = rng.integers(-4, 5, (1, projection.shape[1])).astype(np.float32)
+    model.load_adapter("tuned", {"lora.A": adapter_a, "lora.B": adapter_b})
+    with pytest.raises(Exception):
+        model.load_adapter("unknown", {"lora.C": adapter_a})
+
+    prompt = [3, 1, 4, 1, 5]
+    params = og.GeneratorParams(model)
+    params.input_ids = np.array([prompt, prompt], dtype=np.int32)
+    params.set_search_options(do_sample=False, max_length=14)
+    params.set_adapters(["", "tuned"])
+    generator = og.Generator(model, params)
+    sequences, done = [list(prompt), list(prompt)], [False, False]
+    while not generator.is_done():
+        generator.compute_logits()
+        generator.generate_next_token()
+        next_tokens = generator.get_next_tokens()
+        for row, sequence in enumerate(sequences):
+            if done[row]:
+                continue
+            hidden = embedding[sequence[-1]] + embedding[sequence].sum(axis=0)
+            logits = hidden @ projection
+            if row == 1:
+                logits += hidden @ adapter_a @ adapter_b
+            assert logits[next_tokens[row]] == logits.max()
+            sequence.append(int(next_tokens[row]))
+            done[row] = sequence[-1] == projection.shape[1] - 1
+    del generator
+
+    model.unload_adapter("tuned")
+    params.set_adapters(["tuned"])
+    with pytest.raises(Exception):
+        og.Generator(model, params)
+
+
+def test_unpadded_prefill(tmp_path):
+    # The prompts run on their own, then their kv caches are copied into the batch's. The positions past a shorter
+    # prompt are masked out, and have to be zeros for the masked sum of the test model to match
+    model = og.Model(make_decoder_test_model(tmp_path / "model", 0))
+    prompts = [[3, 1, 4, 1, 5, 9, 2, 6], [5, 3, 5]]
+
+    def generate(input_ids, unpadded_prefill):
+        params = og.GeneratorParams(model)
+        params.input_ids = np.array(input_ids, dtype=np.int32)
+        params.set_search_options(do_sample=False, max_length=16, unpadded_prefill=unpadded_prefill)
+        generator = og.Generator(model, params)
+        while not generator.is_done():
+            generator.compute_logits()
+            generator.generate_next_token()
+        return [generator.get_sequence(i) for i in range(len(input_ids))]
+
+    padded = [prompt + [0] * (len(prompts[0]) - len(prompt)) for prompt in prompts]
+    batched = generate(padded, True)
+    for i, prompt in enumerate(prompts):
+        alone = generate([prompt], False)[0]
+        generated = batched[i][len(padded[i]):]
+        expected = alone[len(prompt):len(prompt) + len(generated)]
+        assert np.array_equal(generated[:len(expected)], expected)
+
+
+@pytest.mark.skipif(
+    sysconfig.get_platform().endswith("arm64") or sys.version_info.minor < 8,
+    reason="Python 3.8 is required for the model builder.",
+)
+def test_builder_int4_tied_embeddings(tmp_path):
+    onnx = pytest.importorskip("onnx")
+    transformers = pytest.importorskip("transformers")
+    pytest.importorskip("torch")
+    from onnxruntime_genai.models.builder import create_model
+
+    input_path = tmp_path / "input"
+    config = transformers.LlamaConfig(
+        vocab_size=256, hidden_size=64, intermediate_size=128, num_hidden_layers=1, num_attention_heads=2,
+        num_key_value_heads=2, max_position_embeddings=128, tie_word_embeddings=True,
+    )
+    transformers.LlamaForCausalLM(config).save_pretrained(input_path)
+
+    output_path = tmp_path / "output"
+    create_model(
+        None, os.fspath(input_path), os.fspath(output_path), "int4", "cpu", os.fspath(tmp_path / "cache"),
+        int4_embeddings="1", int4_block_size="32",
+    )
+
+    # The table is stored once, in the shape GatherBlockQuantized takes, and only reshaped for the LM head's MatMulNBits
+    graph = onnx.load(os.fspath(output_path / "model.onnx"), load_external_data=False).graph
+    initializers = {initializer.name: initializer for initializer in graph.initializer}
+    assert list(initializers["model.embed_tokens.qweight"].dims) == [256, 32]
+    assert list(initializers["model.embed_tokens.scales"].dims) == [256, 2]
+    assert not any(name.startswith("lm_head") for name in initializers)
+
+    nodes = {node.op_type: node for node in graph.node}
+    assert list(nodes["GatherBlockQuantized"].input) == ["model.embed_tokens.qweight", "input_ids", "model.embed_tokens.scales"]
+    lm_head = [node for node in graph.node if node.op_type == "MatMulNBits" and node.name.startswith("/lm_head/")][0]
+    reshapes = {node.output[0]: node for node in graph.node if node.op_type == "Reshape"}
+    assert reshapes[lm_head.input[1]].input[0] == "model.embed_tokens.qweight"
+    assert reshapes[lm_head.input[2]].input[0] == "model.embed_tokens.scales"
+
+    model = og.Model(os.fspath(output_path))
+    params = og.GeneratorParams(model)
+    params.input_ids = np.array([1, 2, 3, 4], dtype=np.int32)
+    params.set_search_options(do_sample=False, max_length=8)
+    generator = og.Generator(model, params)
+    while not generator.is_done():
+        generator.compute_logits()
+        generator.generate_next_token()
+    assert len(generator.get_sequence(0)) == 8
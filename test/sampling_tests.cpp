@@ -5,8 +5,11 @@
 #include <generators.h>
 #include <search.h>
 #include <models/model.h>
+#include <constrained_decoding.h>
+#include <float16.h>
 #include <iostream>
 #include <random>
+#include <set>
 
 // Our working directory is generators/build so one up puts us in the root directory:
 #ifndef MODEL_PATH
@@ -131,6 +134,106 @@ void CreateRandomLogits(float* logits, int num_large, int vocab_size, int batch_
   }
 }
 
+TEST(SamplingTests, LogitsProcessorsCpu) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{0, 1};
+  std::vector<float> logits_cpu{0.1f, 0.6f, 0.1f, 0.1f, 0.1f,
+                                0.1f, 0.1f, 0.6f, 0.1f, 0.1f};
+  int vocab_size = 5;
+  int batch_size = 2;
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->batch_size = batch_size;
+  params->sequence_length = 1;
+  params->vocab_size = vocab_size;
+  params->input_ids = input_ids;
+  // The first bans each sequence's last token, the second boosts token 4, so the picks depend on both running in order
+  int calls = 0;
+  params->logits_processors.push_back([&](Generators::LogitsProcessorContext& context) {
+    EXPECT_EQ(context.device_type, Generators::DeviceType::CPU);
+    EXPECT_EQ(context.batch_beam_size, batch_size);
+    EXPECT_EQ(context.sequence_length, 1);
+    auto scores = context.scores.GetCPU();
+    auto sequences = context.sequences.GetCPU();
+    for (int i = 0; i < context.batch_beam_size; i++)
+      scores[i * context.vocab_size + sequences[i * context.max_length]] = std::numeric_limits<float>::lowest();
+    EXPECT_EQ(calls++, 0);
+  });
+  params->logits_processors.push_back([&](Generators::LogitsProcessorContext& context) {
+    auto scores = context.scores.GetCPU();
+    scores[4] += 1.0f;
+    scores[1 * context.vocab_size + 1] = 1.0f;
+    EXPECT_EQ(calls++, 1);
+  });
+  auto generator = Generators::CreateGenerator(*model, *params);
+  generator->search_->SetLogits(Generators::cpu_span<float>(logits_cpu));
+  generator->computed_logits_ = true;
+  generator->GenerateNextToken();
+  EXPECT_EQ(calls, 2);
+  auto next_tokens = generator->search_->GetNextTokens().GetCPU();
+  EXPECT_EQ(next_tokens[0], 4);
+  EXPECT_EQ(next_tokens[1], 1);  // Banned by the first processor, then given the highest score by the second
+}
+
+TEST(SamplingTests, SequencesGrowCpu) {
+  // Appends past the first chunks of the rows, greedy appends in place and beams move a token to the other slot each step
+  std::vector<int32_t> prompts{7, 8, 7, 8}, prompt{7, 8};
+  const int max_length = 2000;
+  Generators::Sequences greedy{prompts, 2, 1, max_length};
+  Generators::Sequences beams{prompt, 1, 2, max_length};
+  EXPECT_LT(greedy.GetCapacity(), max_length);
+  for (int32_t step = 0; step < max_length - 2; step++) {
+    greedy.AppendNextTokenToSequences(std::vector<int32_t>{step, -step});
+    beams.AppendNextTokenToSequences(std::vector<int32_t>{1, 0}, std::vector<int32_t>{step, -step});
+  }
+  EXPECT_EQ(greedy.GetCapacity(), max_length);
+  EXPECT_EQ(greedy.GetSequenceLength(), max_length);
+  for (size_t row = 0; row < 2; row++) {
+    auto greedy_sequence = greedy.GetSequence(row);
+    auto beam_sequence = beams.GetSequence(row);
+    ASSERT_EQ(greedy_sequence.size(), max_length);
+    ASSERT_EQ(beam_sequence.size(), max_length);
+    EXPECT_EQ(greedy_sequence[1], 8);
+    EXPECT_EQ(beam_sequence[1], 8);
+    for (int32_t step = 0; step < max_length - 2; step++) {
+      EXPECT_EQ(greedy_sequence[2 + step], row == 0 ? step : -step);
+      // A slot's token at a step came from the other slot at the step before, the last one keeps its own
+      const bool same_slot = (max_length - 3 - step) % 2 == 0;
+      EXPECT_EQ(beam_sequence[2 + step], (row == 0) == same_slot ? step : -step);
+    }
+  }
+}
+
+TEST(SamplingTests, RandomStreamsIndependentOfBatch) {
+  // A batch entry with a seed of its own draws the same values as on its own, the entries sharing a seed get separate ones
+  auto batched = Generators::CreateGeneratorParams();
+  batched->batch_size = 3;
+  batched->search.random_seed = 1;
+  batched->GetMutableRowSearch(1).random_seed = 42;
+  auto single = Generators::CreateGeneratorParams();
+  single->batch_size = 1;
+  single->search.random_seed = 42;
+
+  auto batched_streams = Generators::GetRandomStreams(*batched);
+  auto single_streams = Generators::GetRandomStreams(*single);
+  ASSERT_EQ(batched_streams.size(), 3);
+  EXPECT_EQ(batched_streams[0].index, 0);
+  EXPECT_EQ(batched_streams[2].index, 1);
+  for (uint64_t step = 0; step < 100; step++) {
+    const float value = Generators::RandomUniform(batched_streams[1], step);
+    EXPECT_EQ(value, Generators::RandomUniform(single_streams[0], step));
+    EXPECT_GE(value, 0.0f);
+    EXPECT_LT(value, 1.0f);
+    EXPECT_NE(Generators::RandomUniform(batched_streams[0], step), Generators::RandomUniform(batched_streams[2], step));
+  }
+
+  // A fork of a seeded generator draws apart from it
+  single->fork_index = 1;
+  auto fork_streams = Generators::GetRandomStreams(*single);
+  EXPECT_EQ(fork_streams[0].seed, single_streams[0].seed);
+  EXPECT_NE(Generators::RandomUniform(fork_streams[0], 0), Generators::RandomUniform(single_streams[0], 0));
+}
+
 TEST(SamplingTests, RandomizedSamplingTopPCpu) {
   auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
   int vocab_size = 32000;  // vocab size of llama
@@ -246,6 +349,231 @@ TEST(SamplingTests, RandomizedSamplingTopPAndKCpu) {
   }
 }
 
+TEST(SamplingTests, ThreadPoolParallelFor) {
+  Generators::ThreadPool pool{4};
+  std::vector<std::atomic<int>> runs(100);
+  std::vector<std::atomic<int>> threads_in_use(pool.GetThreadCount());
+  pool.ParallelFor(runs.size(), [&](size_t index, size_t thread_index) {
+    ASSERT_LT(thread_index, pool.GetThreadCount());
+    EXPECT_EQ(threads_in_use[thread_index]++, 0);  // No two running items share a thread_index
+    runs[index]++;
+    threads_in_use[thread_index]--;
+  });
+  for (auto& run : runs)
+    EXPECT_EQ(run.load(), 1);
+
+  EXPECT_THROW(pool.ParallelFor(10, [](size_t index, size_t) { if (index == 3) throw std::runtime_error("Failed"); }), std::runtime_error);
+}
+
+TEST(SamplingTests, StopSequencesMatchSuffixes) {
+  // Overlapping stop sequences, where matching "1 2 3 4" has to fall back from "1 2 3" to "2 3"
+  const std::vector<std::vector<int32_t>> sequences{{1, 2, 4}, {2, 3, 4}, {3}, {2, 5}, {1, 2, 3, 4, 5}};
+  Generators::StopSequences stop_sequences{sequences};
+
+  // Whatever the tokens, a state matches exactly when the tokens so far end with a stop sequence
+  std::mt19937 engine{0};
+  std::uniform_int_distribution<int32_t> distribution{0, 5};
+  std::vector<int32_t> tokens;
+  int32_t state = Generators::StopSequences::c_initial_state;
+  for (int i = 0; i < 1000; i++) {
+    tokens.push_back(distribution(engine));
+    state = stop_sequences.Advance(state, tokens.back());
+    bool expected = false;
+    for (auto& sequence : sequences)
+      expected |= tokens.size() >= sequence.size() && std::equal(sequence.begin(), sequence.end(), tokens.end() - sequence.size());
+    ASSERT_EQ(stop_sequences.IsMatch(state), expected) << "token " << i;
+  }
+
+  state = Generators::StopSequences::c_initial_state;
+  for (int32_t token : {1, 2, 3})
+    state = stop_sequences.Advance(state, token);
+  EXPECT_TRUE(stop_sequences.IsMatch(state));
+  EXPECT_TRUE(stop_sequences.IsMatch(stop_sequences.Advance(state, 4)));
+
+  const std::vector<std::vector<int32_t>> empty_sequence{{1}, {}};
+  EXPECT_THROW(Generators::StopSequences{empty_sequence}, std::runtime_error);
+}
+
+TEST(SamplingTests, Fp16ConversionCpu) {
+  // Representable values convert exactly and the others to the nearest fp16. 37 values, so the vector loops leave a tail
+  struct Case {
+    float value;
+    uint16_t fp16;
+    float round_trip;
+  };
+  const std::vector<Case> cases{
+      {0.0f, 0x0000, 0.0f}, {-0.0f, 0x8000, -0.0f}, {1.0f, 0x3C00, 1.0f}, {-2.5f, 0xC100, -2.5f},
+      {65504.0f, 0x7BFF, 65504.0f}, {0x1p-14f, 0x0400, 0x1p-14f}, {0x1p-24f, 0x0001, 0x1p-24f},
+      {1.0f + 0x1p-12f, 0x3C00, 1.0f}, {1.0f + 0x3p-12f, 0x3C01, 1.0f + 0x1p-10f}};
+  std::vector<float> fp32(37);
+  for (size_t i = 0; i < fp32.size(); i++)
+    fp32[i] = cases[i % cases.size()].value;
+
+  std::vector<uint16_t> fp16(fp32.size());
+  Generators::Fp32ToFp16(fp32, fp16);
+  std::vector<float> round_trip(fp16.size());
+  Generators::Fp16ToFp32(fp16, round_trip);
+  for (size_t i = 0; i < fp32.size(); i++) {
+    auto& expected = cases[i % cases.size()];
+    EXPECT_EQ(fp16[i], expected.fp16) << "index " << i;
+    EXPECT_EQ(round_trip[i], expected.round_trip) << "index " << i;
+    EXPECT_EQ(std::signbit(round_trip[i]), std::signbit(expected.round_trip)) << "index " << i;
+  }
+}
+
+TEST(SamplingTests, TokenConstraintCpu) {
+  // Token 0 is eos
+  const std::vector<std::string> vocab{"", "a", "b", "ab", "ba", "c", "{", "}", "\"x\"", ":", "1", "12", " "};
+  const std::vector<int32_t> eos_token_ids{0};
+  auto allowed = [](const Generators::TokenConstraint& constraint, int32_t state) {
+    std::vector<int32_t> tokens;
+    auto mask = constraint.GetMask(state);
+    for (int32_t token = 0; token < static_cast<int32_t>(mask.size() * 32); token++)
+      if (mask[token / 32] & (1U << (token % 32)))
+        tokens.push_back(token);
+    return tokens;
+  };
+
+  Generators::TokenConstraint regex{"regex", "a+b?", vocab, eos_token_ids};
+  int32_t state = Generators::TokenConstraint::c_initial_state;
+  EXPECT_EQ(allowed(regex, state), (std::vector<int32_t>{1, 3}));
+  state = regex.Advance(state, 1);
+  EXPECT_TRUE(regex.IsComplete(state));
+  EXPECT_EQ(allowed(regex, state), (std::vector<int32_t>{0, 1, 2, 3}));
+  state = regex.Advance(state, 2);
+  EXPECT_EQ(allowed(regex, state), (std::vector<int32_t>{0}));  // Only eos can follow the b
+  EXPECT_EQ(allowed(regex, regex.Advance(state, 0)), (std::vector<int32_t>{0}));
+
+  // The search leaves only the allowed tokens to pick from
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->batch_size = 1;
+  params->sequence_length = 1;
+  params->vocab_size = static_cast<int>(vocab.size());
+  params->eos_token_id = 0;
+  params->device_type = Generators::DeviceType::CPU;
+  const std::vector<int32_t> input_ids{5};
+  params->input_ids = input_ids;
+  Generators::GreedySearch_Cpu search{*params};
+  std::vector<float> logits(vocab.size(), 1.0f);
+  logits[3] = 2.0f;
+  logits[5] = 10.0f;
+  search.SetLogits(Generators::cpu_span<float>(logits));
+  const std::vector<int32_t> states{Generators::TokenConstraint::c_initial_state};
+  search.ApplyTokenConstraint(regex, states);
+  search.SelectTop();
+  EXPECT_EQ(search.GetNextTokens().GetCPU()[0], 3);
+
+  const auto schema = R"({"type": "object", "properties": {"x": {"type": "integer"}}, "required": ["x"]})";
+  Generators::TokenConstraint json{"json_schema", schema, vocab, eos_token_ids};
+  state = Generators::TokenConstraint::c_initial_state;
+  for (int32_t token : {6, 12, 8, 9, 11, 7}) {
+    auto tokens = allowed(json, state);
+    EXPECT_NE(std::find(tokens.begin(), tokens.end(), token), tokens.end()) << "token " << token;
+    EXPECT_FALSE(json.IsComplete(state));
+    state = json.Advance(state, token);
+  }
+  EXPECT_TRUE(json.IsComplete(state));
+  EXPECT_EQ(allowed(json, json.Advance(Generators::TokenConstraint::c_initial_state, 6)).size(), 2);  // Only ' ' and '"x"', as x is required
+
+  EXPECT_THROW(Generators::TokenConstraint("regex", "a(b", vocab, eos_token_ids), std::runtime_error);
+  EXPECT_THROW(Generators::RegexFromJsonSchema(R"({"$ref": "#/definitions/a"})"), std::runtime_error);
+}
+
+TEST(SamplingTests, PenaltiesCpu) {
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->batch_size = 1;
+  params->sequence_length = 2;
+  params->vocab_size = 5;
+  params->eos_token_id = 0;
+  params->device_type = Generators::DeviceType::CPU;
+  const std::vector<int32_t> input_ids{1, 2};
+  params->input_ids = input_ids;
+  Generators::GreedySearch_Cpu search{*params};
+
+  // The repetition penalty covers the prompt too, the presence and frequency penalties only the generated tokens
+  const std::vector<float> logits{1.0f, 4.0f, -2.0f, 3.0f, 1.0f};
+  const std::vector<std::vector<float>> expected_scores{{1.0f, 2.0f, -4.0f, 3.0f, 1.0f},
+                                                        {1.0f, 2.0f, -4.0f, 0.75f, 1.0f},
+                                                        {1.0f, 1.25f, -4.0f, 0.75f, 1.0f},
+                                                        {1.0f, 1.0f, -4.0f, 0.75f, 1.0f}};
+  const std::vector<int32_t> expected_tokens{3, 1, 1};
+  for (size_t step = 0; step < expected_scores.size(); step++) {
+    std::vector<float> step_logits{logits};
+    search.SetLogits(Generators::cpu_span<float>(step_logits));
+    search.ApplyPenalties(2.0f, 0.5f, 0.25f);
+    auto scores = search.GetScores(0);
+    EXPECT_EQ(std::vector<float>(scores.begin(), scores.end()), expected_scores[step]) << "step " << step;
+    search.SelectTop();
+    if (step < expected_tokens.size())
+      EXPECT_EQ(search.GetNextTokens().GetCPU()[0], expected_tokens[step]);
+  }
+}
+
+TEST(SamplingTests, NoRepeatNgramCpu) {
+  auto params = Generators::CreateGeneratorParams();
+  params->search.max_length = 10;
+  params->batch_size = 1;
+  params->sequence_length = 4;
+  params->vocab_size = 5;
+  params->eos_token_id = 0;
+  params->device_type = Generators::DeviceType::CPU;
+  const std::vector<int32_t> input_ids{1, 2, 3, 1};
+  params->input_ids = input_ids;
+  Generators::GreedySearch_Cpu search{*params};
+
+  // 1 2 was already seen, then 3 1 after the 3 is picked
+  for (auto [favored, expected] : {std::pair{2, 3}, std::pair{1, 4}}) {
+    std::vector<float> logits{0.0f, 0.0f, 0.0f, 0.0f, 1.0f};
+    logits[favored] = 5.0f;
+    if (expected == 3)
+      logits[3] = 2.0f;
+    search.SetLogits(Generators::cpu_span<float>(logits));
+    search.ApplyNoRepeatNgram(2);
+    search.SelectTop();
+    EXPECT_EQ(search.GetNextTokens().GetCPU()[0], expected);
+  }
+}
+
+TEST(SamplingTests, RowSearchTopKCpu) {
+  // The first row is greedy, the second samples from its top 2 and the third from its top 3
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{0, 1, 2};
+  std::vector<float> logits_cpu{0.5f, 2.0f, 1.75f, 0.25f, 0.25f,
+                                2.0f, 0.25f, 0.25f, 2.0f, 1.0f,
+                                0.25f, 2.0f, 2.0f, 0.25f, 2.0f};
+  int vocab_size = 5;
+  int batch_size = 3;
+  std::vector<std::set<int32_t>> sampled(batch_size);
+  for (int seed = 0; seed < 64; seed++) {
+    auto params = Generators::CreateGeneratorParams();
+    params->search.max_length = 10;
+    params->search.random_seed = seed;
+    params->batch_size = batch_size;
+    params->sequence_length = 1;
+    params->vocab_size = vocab_size;
+    params->input_ids = input_ids;
+    params->device_type = Generators::DeviceType::CPU;
+    for (int row = 1; row < batch_size; row++) {
+      auto& row_search = params->GetMutableRowSearch(row);
+      row_search.do_sample = true;
+      row_search.top_k = row + 1;
+    }
+    auto generator = Generators::CreateGenerator(*model, *params);
+    auto logits_copy = logits_cpu;
+    generator->search_->SetLogits(Generators::cpu_span<float>(logits_copy));
+    generator->computed_logits_ = true;
+    generator->GenerateNextToken();
+    auto next_tokens = generator->search_->GetNextTokens().GetCPU();
+    for (int b = 0; b < batch_size; b++)
+      sampled[b].insert(next_tokens[b]);
+  }
+  EXPECT_EQ(sampled[0], (std::set<int32_t>{1}));
+  EXPECT_EQ(sampled[1], (std::set<int32_t>{0, 3}));
+  EXPECT_EQ(sampled[2], (std::set<int32_t>{1, 2, 4}));
+}
+
 #if USE_CUDA
 #include "tests_helper.cuh"
 
@@ -350,6 +678,45 @@ TEST(SamplingTests, BatchedSamplingTopPAndKCuda) {
   }
 }
 
+TEST(SamplingTests, RowSearchTopKCuda) {
+  // The first row is greedy, the second samples from its top 2 and the third from its top 3, all in one launch
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  std::vector<int32_t> input_ids{0, 1, 2};
+  std::vector<float> logits_cpu{0.5f, 2.0f, 1.75f, 0.25f, 0.25f,
+                                2.0f, 0.25f, 0.25f, 2.0f, 1.0f,
+                                0.25f, 2.0f, 2.0f, 0.25f, 2.0f};
+  auto logits_gpu = Generators::CudaMallocArray<float>(logits_cpu.size());
+  int vocab_size = 5;
+  int batch_size = 3;
+  std::vector<std::set<int32_t>> sampled(batch_size);
+  for (int seed = 0; seed < 64; seed++) {
+    auto params = Generators::CreateGeneratorParams();
+    params->search.max_length = 10;
+    params->search.random_seed = seed;
+    params->batch_size = batch_size;
+    params->sequence_length = 1;
+    params->vocab_size = vocab_size;
+    params->input_ids = input_ids;
+    params->device_type = Generators::DeviceType::CUDA;
+    for (int row = 1; row < batch_size; row++) {
+      auto& row_search = params->GetMutableRowSearch(row);
+      row_search.do_sample = true;
+      row_search.top_k = row + 1;
+    }
+    cudaMemcpyAsync(logits_gpu.get(), logits_cpu.data(), logits_cpu.size() * sizeof(float), cudaMemcpyHostToDevice, params->cuda_stream);
+    auto generator = Generators::CreateGenerator(*model, *params);
+    generator->search_->SetLogits(Generators::gpu_span<float>(logits_gpu.get(), logits_cpu.size()));
+    generator->computed_logits_ = true;
+    generator->GenerateNextToken();
+    auto next_tokens = generator->search_->GetNextTokens().GetCPU();
+    for (int b = 0; b < batch_size; b++)
+      sampled[b].insert(next_tokens[b]);
+  }
+  EXPECT_EQ(sampled[0], (std::set<int32_t>{1}));
+  EXPECT_EQ(sampled[1], (std::set<int32_t>{0, 3}));
+  EXPECT_EQ(sampled[2], (std::set<int32_t>{1, 2, 4}));
+}
+
 TEST(SamplingTests, RandomizedSamplingTopPCuda) {
   auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
   int vocab_size = 32000;  // vocab size of llama
@@ -433,6 +800,47 @@ TEST(SamplingTests, RandomizedSamplingTopKCuda) {
   }
 }
 
+// Top k subsets above the sorted top k limit of 64 and up to what fits in shared memory are sampled from a subset
+// gathered on the device, every sampled token has to be in the CPU's top k
+TEST(SamplingTests, RandomizedSamplingLargeTopKCuda) {
+  auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
+  int vocab_size = 32000;
+  int batch_size = 5;
+  std::vector<int32_t> input_ids{0, 1, 2, 3, 4};
+  std::vector<float> cpu_logits(static_cast<size_t>(vocab_size) * batch_size);
+  auto logits_gpu = Generators::CudaMallocArray<float>(cpu_logits.size());
+  std::mt19937 engine(42);
+  std::normal_distribution<float> dist(0.0f, 3.0f);
+  for (int k : {65, 300, 1024}) {
+    auto params = Generators::CreateGeneratorParams();
+    params->search.max_length = 10;
+    params->search.do_sample = true;
+    params->search.top_k = k;
+    params->batch_size = batch_size;
+    params->sequence_length = 1;
+    params->vocab_size = vocab_size;
+    params->input_ids = input_ids;
+    params->device_type = Generators::DeviceType::CUDA;
+    for (int i = 0; i < 20; i++) {
+      for (auto& logit : cpu_logits)
+        logit = dist(engine);
+      cudaMemcpy(logits_gpu.get(), cpu_logits.data(), cpu_logits.size() * sizeof(float), cudaMemcpyHostToDevice);
+      auto generator = Generators::CreateGenerator(*model, *params);
+      generator->search_->SetLogits(Generators::gpu_span<float>(logits_gpu.get(), cpu_logits.size()));
+      generator->computed_logits_ = true;
+      generator->GenerateNextToken();
+      auto next_tokens = generator->search_->GetNextTokens().GetCPU();
+      for (int b = 0; b < batch_size; b++) {
+        std::vector<float> row(cpu_logits.begin() + b * vocab_size, cpu_logits.begin() + (b + 1) * vocab_size);
+        std::nth_element(row.begin(), row.begin() + (k - 1), row.end(), std::greater<float>());
+        ASSERT_GE(next_tokens[b], 0);
+        ASSERT_LT(next_tokens[b], vocab_size);
+        EXPECT_GE(cpu_logits[next_tokens[b] + b * vocab_size], row[k - 1]) << "k " << k;
+      }
+    }
+  }
+}
+
 TEST(SamplingTests, RandomizedSamplingTopPAndKCuda) {
   auto model = Generators::CreateModel(Generators::GetOrtEnv(), MODEL_PATH "hf-internal-testing/tiny-random-gpt2-fp32");
   int vocab_size = 32000;  // vocab size of llama
@@ -517,4 +925,26 @@ TEST(SamplingTests, RandomizedSamplingSelectTopCuda) {
   }
 }
 
+TEST(SamplingTests, CudaCopyPoolReuseCuda) {
+  auto& pool = Generators::CudaCopyPool::Get();
+  Generators::cuda_stream_holder stream;
+  stream.Create();
+  const size_t pooled_bytes = pool.GetPooledBytes();
+
+  // Sizes round up to a power of two, so a buffer freed at one size is reused for another of the same bucket
+  void* buffer = pool.Allocate(stream.get(), 1000, true);
+  pool.Free(stream.get(), 1000, true, buffer);
+  EXPECT_EQ(pool.GetPooledBytes(), pooled_bytes + 1024);
+  EXPECT_EQ(pool.Allocate(stream.get(), 1024, true), buffer);
+  pool.Free(stream.get(), 1024, true, buffer);
+
+  // Past the cap of a stream and size, freed buffers are released rather than kept
+  std::vector<void*> buffers;
+  for (size_t i = 0; i < Generators::CudaCopyPool::c_max_free_per_size + 4; i++)
+    buffers.push_back(pool.Allocate(stream.get(), 1024, true));
+  for (void* p : buffers)
+    pool.Free(stream.get(), 1024, true, p);
+  EXPECT_EQ(pool.GetPooledBytes(), pooled_bytes + Generators::CudaCopyPool::c_max_free_per_size * 1024);
+}
+
 #endif
\ No newline at end of file